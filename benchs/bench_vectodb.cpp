@@ -0,0 +1,274 @@
+#include "vectodb.hpp"
+
+#include "faiss/utils.h"
+
+#include <benchmark/benchmark.h>
+#include <glog/logging.h>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/**
+ * Microbenchmarks of the hot paths: AddWithIds, Search at varying nq/k/dim,
+ * UpdateBase replay and the faiss distance kernels. Each region also
+ * reports hardware counter deltas (cycles, instructions, IPC, LLC and
+ * dTLB read misses, backend stalls) next to the wall time; run as root or
+ * with perf_event_paranoid <= 2 to get them.
+ *
+ * Build and run with
+ *
+ *   $ scons bench
+ *   $ benchs/bench_vectodb --benchmark_format=json > bench.json
+ *
+ * and diff the JSON between releases to catch regressions before deploy.
+ **/
+
+static const char* work_dir = "/tmp/bench_vectodb";
+
+/**
+ * Hardware counters per benchmark region. Wall time alone can't say
+ * whether the refine gather is bound by dTLB misses or LLC misses, which
+ * is exactly the input the hugepage and prefetch knobs need. Counters
+ * open disabled and are gated with pause/resume around the timed section,
+ * so Pause/ResumeTiming setup work is excluded. inherit covers the OpenMP
+ * workers and the flat-scan thread the search forks. A counter the kernel
+ * refuses (perf_event_paranoid, missing PMU event) reports nothing and
+ * the bench still runs.
+ */
+struct PerfCounters {
+    struct Counter {
+        const char* name;
+        unsigned type;
+        unsigned long long config;
+        int fd;
+        unsigned long long base;
+    };
+    Counter counters[5] = {
+        { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, -1, 0 },
+        { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, -1, 0 },
+        { "llc_miss", PERF_TYPE_HW_CACHE,
+            PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16), -1, 0 },
+        { "dtlb_miss", PERF_TYPE_HW_CACHE,
+            PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16), -1, 0 },
+        { "stall_backend", PERF_TYPE_HARDWARE, PERF_COUNT_HW_STALLED_CYCLES_BACKEND, -1, 0 },
+    };
+
+    PerfCounters()
+    {
+        for (Counter& c : counters) {
+            perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = c.type;
+            attr.config = c.config;
+            attr.disabled = 1;
+            attr.inherit = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            c.fd = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+        }
+    }
+
+    ~PerfCounters()
+    {
+        for (Counter& c : counters)
+            if (c.fd >= 0)
+                close(c.fd);
+    }
+
+    void resume()
+    {
+        for (Counter& c : counters)
+            if (c.fd >= 0)
+                ioctl(c.fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+
+    void pause()
+    {
+        for (Counter& c : counters)
+            if (c.fd >= 0)
+                ioctl(c.fd, PERF_EVENT_IOC_DISABLE, 0);
+    }
+
+    //publishes the accumulated deltas as per-iteration benchmark counters
+    void report(benchmark::State& st)
+    {
+        double cycles = 0, instructions = 0;
+        for (Counter& c : counters) {
+            if (c.fd < 0)
+                continue;
+            unsigned long long val = 0;
+            if (read(c.fd, &val, sizeof(val)) != sizeof(val))
+                continue;
+            double delta = (double)(val - c.base);
+            c.base = val;
+            st.counters[c.name] = benchmark::Counter(delta, benchmark::Counter::kAvgIterations);
+            if (0 == strcmp(c.name, "cycles"))
+                cycles = delta;
+            else if (0 == strcmp(c.name, "instructions"))
+                instructions = delta;
+        }
+        if (cycles > 0 && instructions > 0)
+            st.counters["ipc"] = benchmark::Counter(instructions / cycles);
+    }
+};
+
+static vector<float> randVecs(long n, long dim, unsigned seed)
+{
+    mt19937 rng(seed);
+    uniform_real_distribution<float> uni(0.0f, 1.0f);
+    vector<float> vecs(n * dim);
+    for (auto& v : vecs)
+        v = uni(rng);
+    for (long i = 0; i < n; i++) {
+        vector<float> one(vecs.begin() + i * dim, vecs.begin() + (i + 1) * dim);
+        VectoDB::Normalize(one);
+        copy(one.begin(), one.end(), vecs.begin() + i * dim);
+    }
+    return vecs;
+}
+
+static vector<long> seqXids(long n, long start)
+{
+    vector<long> xids(n);
+    for (long i = 0; i < n; i++)
+        xids[i] = start + i;
+    return xids;
+}
+
+static void BM_AddWithIds(benchmark::State& st)
+{
+    const long nb = st.range(0);
+    const long dim = st.range(1);
+    vector<float> xb = randVecs(nb, dim, 42);
+    long next_xid = 0;
+    PerfCounters perf;
+    for (auto _ : st) {
+        st.PauseTiming();
+        VectoDB::ClearWorkDir(work_dir);
+        VectoDB vdb(work_dir, dim);
+        next_xid = 0;
+        st.ResumeTiming();
+        perf.resume();
+        vector<long> xids = seqXids(nb, next_xid);
+        next_xid += nb;
+        vdb.AddWithIds(nb, &xb[0], &xids[0]);
+        perf.pause();
+    }
+    perf.report(st);
+    st.SetItemsProcessed(st.iterations() * nb);
+}
+BENCHMARK(BM_AddWithIds)->Args({ 10000, 128 })->Args({ 10000, 256 })->Unit(benchmark::kMillisecond);
+
+static void BM_Search(benchmark::State& st)
+{
+    const long nq = st.range(0);
+    const long k = st.range(1);
+    const long dim = st.range(2);
+    const long nb = 100000;
+    VectoDB::ClearWorkDir(work_dir);
+    VectoDB vdb(work_dir, dim);
+    vector<float> xb = randVecs(nb, dim, 42);
+    vector<long> xids = seqXids(nb, 0);
+    vdb.AddWithIds(nb, &xb[0], &xids[0]);
+    vector<float> xq = randVecs(nq, dim, 7);
+    vector<float> distances(nq * k);
+    vector<long> res_xids(nq * k);
+    PerfCounters perf;
+    long st0[13] = { 0 }, st1[13] = { 0 };
+    vdb.GetSearchStats(st0, 13);
+    perf.resume();
+    for (auto _ : st) {
+        vdb.SearchKnn(nq, k, &xq[0], &distances[0], &res_xids[0]);
+    }
+    perf.pause();
+    perf.report(st);
+    // per-stage attribution the process-wide perf counters can't see:
+    // tsc cycles per query by search stage, from the engine's own counters
+    vdb.GetSearchStats(st1, 13);
+    double dnq = (double)(st1[0] - st0[0]);
+    if (dnq > 0) {
+        st.counters["cyc_index_q"] = (double)(st1[1] - st0[1]) / dnq;
+        st.counters["cyc_refine_q"] = (double)(st1[2] - st0[2]) / dnq;
+        st.counters["cyc_flat_q"] = (double)(st1[3] - st0[3]) / dnq;
+        st.counters["cyc_merge_q"] = (double)(st1[4] - st0[4]) / dnq;
+    }
+    st.SetItemsProcessed(st.iterations() * nq);
+}
+BENCHMARK(BM_Search)
+    ->Args({ 1, 1, 128 })
+    ->Args({ 1, 10, 128 })
+    ->Args({ 100, 1, 128 })
+    ->Args({ 100, 10, 128 })
+    ->Args({ 100, 10, 256 })
+    ->Unit(benchmark::kMillisecond);
+
+static void BM_UpdateBase(benchmark::State& st)
+{
+    const long nu = st.range(0);
+    const long dim = 128;
+    const long nb = 100000;
+    vector<float> xb = randVecs(nb, dim, 42);
+    vector<long> xids = seqXids(nb, 0);
+    vector<float> xu = randVecs(nu, dim, 7);
+    PerfCounters perf;
+    for (auto _ : st) {
+        st.PauseTiming();
+        VectoDB::ClearWorkDir(work_dir);
+        VectoDB vdb(work_dir, dim);
+        vdb.AddWithIds(nb, &xb[0], &xids[0]);
+        vector<long> upd_xids = seqXids(nu, 0);
+        vdb.UpdateWithIds(nu, &xu[0], &upd_xids[0]);
+        st.ResumeTiming();
+        perf.resume();
+        vdb.UpdateBase();
+        perf.pause();
+    }
+    perf.report(st);
+    st.SetItemsProcessed(st.iterations() * nu);
+}
+BENCHMARK(BM_UpdateBase)->Arg(1000)->Arg(10000)->Unit(benchmark::kMillisecond);
+
+static void BM_FvecL2sqr(benchmark::State& st)
+{
+    const long dim = st.range(0);
+    vector<float> x = randVecs(1, dim, 42);
+    vector<float> y = randVecs(1, dim, 7);
+    PerfCounters perf;
+    perf.resume();
+    for (auto _ : st) {
+        benchmark::DoNotOptimize(faiss::fvec_L2sqr(&x[0], &y[0], dim));
+    }
+    perf.pause();
+    perf.report(st);
+    st.SetItemsProcessed(st.iterations());
+}
+BENCHMARK(BM_FvecL2sqr)->Arg(64)->Arg(128)->Arg(256)->Arg(512);
+
+static void BM_FvecInnerProduct(benchmark::State& st)
+{
+    const long dim = st.range(0);
+    vector<float> x = randVecs(1, dim, 42);
+    vector<float> y = randVecs(1, dim, 7);
+    PerfCounters perf;
+    perf.resume();
+    for (auto _ : st) {
+        benchmark::DoNotOptimize(faiss::fvec_inner_product(&x[0], &y[0], dim));
+    }
+    perf.pause();
+    perf.report(st);
+    st.SetItemsProcessed(st.iterations());
+}
+BENCHMARK(BM_FvecInnerProduct)->Arg(64)->Arg(128)->Arg(256)->Arg(512);
+
+BENCHMARK_MAIN();
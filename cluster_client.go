@@ -0,0 +1,322 @@
+package vectodb
+
+import (
+	"bytes"
+	"encoding/binary"
+	"encoding/json"
+	"fmt"
+	"io/ioutil"
+	"math"
+	"net/http"
+	"net/url"
+	"sync"
+	"time"
+
+	"github.com/pkg/errors"
+)
+
+// ClusterClient is the supported Go client of the vectodblite cluster.
+// Hand-rolled HTTP callers pay for what they skip: JSON float marshalling
+// dominates search cost, a connection per request floods the nodes, and
+// requests landing on a non-owner eat a forwarding hop. The client speaks
+// the binary /api/v1/search_batch endpoint, routes every request straight
+// to the owner via a locally maintained ClusterRouter table (refreshed in
+// the background and corrected from ownership redirects), and pipelines
+// requests per node: a bounded queue drained by a few workers over
+// keep-alive connections, so bursts wait in the client instead of piling
+// connections onto the cluster. Batch calls come in sync and async
+// (future-returning) flavors; the async form keeps the per-node pipeline
+// full from a single caller goroutine.
+type ClusterClient struct {
+	dim    int
+	router *ClusterRouter
+	hc     *http.Client
+	mtx    sync.Mutex
+	pipes  map[string]*nodePipe
+	closed bool
+}
+
+const (
+	clientInflightPerNode = 4                //concurrent requests a node pipe keeps in flight
+	clientQueueCap        = 256              //pending calls buffered per node before enqueue blocks
+	clientRouteRefresh    = 30 * time.Second //background routing table refresh period
+	clientTimeout         = 10 * time.Second //per-request deadline
+	clientMaxHops         = 3                //attempts per call across ownership redirects
+)
+
+// reqAddBatch and rspAddBatch mirror the /api/v1/add_batch wire format.
+type reqAddBatch struct {
+	DbID int         `json:"dbID"`
+	Xbs  [][]float32 `json:"xbs"`
+}
+
+type rspAddBatch struct {
+	Xids []uint64 `json:"xids"`
+	Err  string   `json:"err"`
+}
+
+// nodePipe pipelines this client's requests to one node: workers drain a
+// bounded queue over the shared keep-alive transport, so the in-flight
+// count per node stays fixed no matter how many callers enqueue.
+type nodePipe struct {
+	queue chan func()
+	wg    sync.WaitGroup
+}
+
+func newNodePipe() (np *nodePipe) {
+	np = &nodePipe{queue: make(chan func(), clientQueueCap)}
+	for i := 0; i < clientInflightPerNode; i++ {
+		np.wg.Add(1)
+		go func() {
+			defer np.wg.Done()
+			for call := range np.queue {
+				call()
+			}
+		}()
+	}
+	return
+}
+
+// NewClusterClient connects to the cluster via some seed node addresses,
+// fetches the initial routing table and keeps it fresh in the background.
+// dim shall match the cluster's configured vector dimension.
+func NewClusterClient(seeds []string, dim int) (cc *ClusterClient, err error) {
+	if len(seeds) == 0 {
+		err = errors.Errorf("no seed nodes")
+		return
+	}
+	cc = &ClusterClient{
+		dim:    dim,
+		router: NewClusterRouter(seeds),
+		hc: &http.Client{
+			Transport: &http.Transport{
+				MaxIdleConnsPerHost: clientInflightPerNode,
+				IdleConnTimeout:     90 * time.Second,
+			},
+			Timeout: clientTimeout,
+			//redirects are handled explicitly so the learned ownership
+			//feeds back into the routing table
+			CheckRedirect: func(req *http.Request, via []*http.Request) error {
+				return http.ErrUseLastResponse
+			},
+		},
+		pipes: make(map[string]*nodePipe, 0),
+	}
+	if err = cc.router.Refresh(); err != nil {
+		cc = nil
+		return
+	}
+	cc.router.StartRefreshLoop(clientRouteRefresh)
+	return
+}
+
+// Close stops the routing refresh loop and drains the node pipes. Pending
+// async calls still complete; new calls fail.
+func (cc *ClusterClient) Close() {
+	cc.router.StopRefreshLoop()
+	cc.mtx.Lock()
+	if cc.closed {
+		cc.mtx.Unlock()
+		return
+	}
+	cc.closed = true
+	pipes := cc.pipes
+	cc.pipes = make(map[string]*nodePipe, 0)
+	cc.mtx.Unlock()
+	for _, np := range pipes {
+		close(np.queue)
+		np.wg.Wait()
+	}
+	return
+}
+
+// pipeOf returns the pipe of nodeAddr, creating it on first use. Returns
+// nil after Close.
+func (cc *ClusterClient) pipeOf(nodeAddr string) (np *nodePipe) {
+	cc.mtx.Lock()
+	defer cc.mtx.Unlock()
+	if cc.closed {
+		return
+	}
+	var ok bool
+	if np, ok = cc.pipes[nodeAddr]; !ok {
+		np = newNodePipe()
+		cc.pipes[nodeAddr] = np
+	}
+	return
+}
+
+// enqueue schedules call on the pipe of dbID's current owner.
+func (cc *ClusterClient) enqueue(dbID int, call func()) (err error) {
+	np := cc.pipeOf(cc.router.GetRoute(dbID))
+	if np == nil {
+		err = errors.Errorf("client is closed")
+		return
+	}
+	np.queue <- call
+	return
+}
+
+// doPost posts body to path on the owner of dbID. Ownership redirects are
+// followed up to clientMaxHops; a permanent one (the cluster's "this node
+// owns it now") is recorded into the routing table, a temporary one (read
+// spreading, in-flight migration) is just followed.
+func (cc *ClusterClient) doPost(dbID int, path, contentType string, body []byte) (rspBody []byte, err error) {
+	addr := cc.router.GetRoute(dbID)
+	for hop := 0; hop < clientMaxHops; hop++ {
+		var rsp *http.Response
+		if rsp, err = cc.hc.Post(fmt.Sprintf("http://%s%s", addr, path), contentType, bytes.NewReader(body)); err != nil {
+			err = errors.Wrap(err, "")
+			return
+		}
+		if rsp.StatusCode == http.StatusTemporaryRedirect || rsp.StatusCode == http.StatusPermanentRedirect {
+			loc := rsp.Header.Get("Location")
+			rsp.Body.Close()
+			var dst *url.URL
+			if dst, err = url.Parse(loc); err != nil {
+				err = errors.Wrap(err, "")
+				return
+			}
+			if rsp.StatusCode == http.StatusPermanentRedirect {
+				cc.router.UpdateRoute(dbID, dst.Host)
+			}
+			addr = dst.Host
+			continue
+		}
+		rspBody, err = ioutil.ReadAll(rsp.Body)
+		rsp.Body.Close()
+		if err != nil {
+			err = errors.Wrap(err, "")
+			return
+		}
+		if rsp.StatusCode != http.StatusOK {
+			err = errors.Errorf("%s: node %s answered status %d: %s", path, addr, rsp.StatusCode, string(rspBody))
+			return
+		}
+		return
+	}
+	err = errors.Errorf("%s: dbID %d still redirecting after %d hops", path, dbID, clientMaxHops)
+	return
+}
+
+func (cc *ClusterClient) addBatch(dbID int, xbs [][]float32) (xids []uint64, err error) {
+	reqBody, err := json.Marshal(reqAddBatch{DbID: dbID, Xbs: xbs})
+	if err != nil {
+		err = errors.Wrap(err, "")
+		return
+	}
+	var rspBody []byte
+	if rspBody, err = cc.doPost(dbID, "/api/v1/add_batch", "application/json", reqBody); err != nil {
+		return
+	}
+	var rsp rspAddBatch
+	if err = json.Unmarshal(rspBody, &rsp); err != nil {
+		err = errors.Wrapf(err, "failed to decode add_batch response: %+v", string(rspBody))
+		return
+	}
+	if rsp.Err != "" {
+		err = errors.New(rsp.Err)
+		return
+	}
+	xids = rsp.Xids
+	return
+}
+
+func (cc *ClusterClient) searchBatch(dbID int, nq int, xq []float32) (xids []uint64, distances []float32, err error) {
+	if len(xq) != nq*cc.dim {
+		err = errors.Errorf("invalid length of xq, want %d, have %d", nq*cc.dim, len(xq))
+		return
+	}
+	// the binary codec of /api/v1/search_batch: raw little-endian float32
+	// out, uint64 xids plus float32 distances back
+	reqBody := make([]byte, 4*len(xq))
+	for i, v := range xq {
+		binary.LittleEndian.PutUint32(reqBody[4*i:], math.Float32bits(v))
+	}
+	var rspBody []byte
+	if rspBody, err = cc.doPost(dbID, fmt.Sprintf("/api/v1/search_batch?dbID=%d", dbID), "application/octet-stream", reqBody); err != nil {
+		return
+	}
+	if len(rspBody) != 12*nq {
+		err = errors.Errorf("invalid search_batch response length %d, want %d", len(rspBody), 12*nq)
+		return
+	}
+	xids = make([]uint64, nq)
+	distances = make([]float32, nq)
+	for i := 0; i < nq; i++ {
+		xids[i] = binary.LittleEndian.Uint64(rspBody[8*i:])
+		distances[i] = math.Float32frombits(binary.LittleEndian.Uint32(rspBody[8*nq+4*i:]))
+	}
+	return
+}
+
+// AddBatchFuture is the pending result of AddBatchAsync.
+type AddBatchFuture struct {
+	xids []uint64
+	err  error
+	done chan struct{}
+}
+
+// Wait blocks until the batch is applied and returns the assigned xids,
+// parallel to the submitted vectors.
+func (fut *AddBatchFuture) Wait() (xids []uint64, err error) {
+	<-fut.done
+	return fut.xids, fut.err
+}
+
+// SearchBatchFuture is the pending result of SearchBatchAsync.
+type SearchBatchFuture struct {
+	xids      []uint64
+	distances []float32
+	err       error
+	done      chan struct{}
+}
+
+// Wait blocks until the result arrives. ^uint64(0) marks a query without a
+// match under the distance threshold.
+func (fut *SearchBatchFuture) Wait() (xids []uint64, distances []float32, err error) {
+	<-fut.done
+	return fut.xids, fut.distances, fut.err
+}
+
+// AddBatchAsync submits a batch of vectors to the vectodblite dbID and
+// returns immediately; the assigned xids come from the future. Enqueue
+// blocks only when the owner's pipe is full.
+func (cc *ClusterClient) AddBatchAsync(dbID int, xbs [][]float32) (fut *AddBatchFuture) {
+	fut = &AddBatchFuture{done: make(chan struct{})}
+	if err := cc.enqueue(dbID, func() {
+		fut.xids, fut.err = cc.addBatch(dbID, xbs)
+		close(fut.done)
+	}); err != nil {
+		fut.err = err
+		close(fut.done)
+	}
+	return
+}
+
+// AddBatch submits a batch of vectors to the vectodblite dbID and waits for
+// the assigned xids.
+func (cc *ClusterClient) AddBatch(dbID int, xbs [][]float32) (xids []uint64, err error) {
+	return cc.AddBatchAsync(dbID, xbs).Wait()
+}
+
+// SearchBatchAsync submits nq queries (nq*dim float32, row-major) against
+// the vectodblite dbID over the binary endpoint and returns immediately.
+func (cc *ClusterClient) SearchBatchAsync(dbID int, nq int, xq []float32) (fut *SearchBatchFuture) {
+	fut = &SearchBatchFuture{done: make(chan struct{})}
+	if err := cc.enqueue(dbID, func() {
+		fut.xids, fut.distances, fut.err = cc.searchBatch(dbID, nq, xq)
+		close(fut.done)
+	}); err != nil {
+		fut.err = err
+		close(fut.done)
+	}
+	return
+}
+
+// SearchBatch submits nq queries against the vectodblite dbID over the
+// binary endpoint and waits for the nearest xid and distance per query.
+// ^uint64(0) marks a query without a match under the distance threshold.
+func (cc *ClusterClient) SearchBatch(dbID int, nq int, xq []float32) (xids []uint64, distances []float32, err error) {
+	return cc.SearchBatchAsync(dbID, nq, xq).Wait()
+}
@@ -0,0 +1,145 @@
+package vectodb
+
+import (
+	"context"
+	"encoding/json"
+	"fmt"
+	"io/ioutil"
+	"math/rand"
+	"net/http"
+	"sync"
+	"time"
+
+	"github.com/pkg/errors"
+	log "github.com/sirupsen/logrus"
+)
+
+// rspRouting mirrors the /routing response of the vectodblite cluster.
+type rspRouting struct {
+	Version int64          `json:"version"`
+	Routes  map[int]string `json:"routes"`
+	Err     string         `json:"err"`
+}
+
+// ClusterRouter is a client-side routing table for the vectodblite cluster.
+// It polls the /routing endpoint of any node, so requests hit the owner of a
+// dbID first time instead of paying a forwarding hop inside the cluster.
+// Redirects observed by the caller can be fed back via UpdateRoute.
+type ClusterRouter struct {
+	rwlock  sync.RWMutex
+	hc      *http.Client
+	seeds   []string //addresses of some cluster nodes, used for /routing and as fallback
+	routes  map[int]string
+	version int64
+	cancel  context.CancelFunc
+}
+
+func NewClusterRouter(seeds []string) (cr *ClusterRouter) {
+	cr = &ClusterRouter{
+		hc:     &http.Client{Timeout: time.Second * 5},
+		seeds:  seeds,
+		routes: make(map[int]string, 0),
+	}
+	return
+}
+
+// Refresh fetches the routing table from one of the seed nodes. Stale
+// responses (version going backwards) are ignored.
+func (cr *ClusterRouter) Refresh() (err error) {
+	if len(cr.seeds) == 0 {
+		err = errors.Errorf("no seed nodes")
+		return
+	}
+	seed := cr.seeds[rand.Intn(len(cr.seeds))]
+	var rsp *http.Response
+	if rsp, err = cr.hc.Get(fmt.Sprintf("http://%s/routing", seed)); err != nil {
+		err = errors.Wrap(err, "")
+		return
+	}
+	rspBody, err := ioutil.ReadAll(rsp.Body)
+	rsp.Body.Close()
+	if err != nil {
+		err = errors.Wrap(err, "")
+		return
+	}
+	var routing rspRouting
+	if err = json.Unmarshal(rspBody, &routing); err != nil {
+		err = errors.Wrapf(err, "failed to decode routing response: %+v", string(rspBody))
+		return
+	}
+	if routing.Err != "" {
+		err = errors.New(routing.Err)
+		return
+	}
+	cr.rwlock.Lock()
+	defer cr.rwlock.Unlock()
+	if routing.Version < cr.version {
+		return
+	}
+	cr.routes = routing.Routes
+	cr.version = routing.Version
+	return
+}
+
+// GetRoute returns the owner of dbID, or a random seed when the ownership is
+// unknown yet (the cluster will then assign an owner and redirect).
+func (cr *ClusterRouter) GetRoute(dbID int) (nodeAddr string) {
+	cr.rwlock.RLock()
+	defer cr.rwlock.RUnlock()
+	var ok bool
+	if nodeAddr, ok = cr.routes[dbID]; ok {
+		return
+	}
+	nodeAddr = cr.seeds[rand.Intn(len(cr.seeds))]
+	return
+}
+
+// UpdateRoute records an ownership learned from a redirect, keeping the table
+// warm between refreshes.
+func (cr *ClusterRouter) UpdateRoute(dbID int, nodeAddr string) {
+	cr.rwlock.Lock()
+	defer cr.rwlock.Unlock()
+	cr.routes[dbID] = nodeAddr
+	return
+}
+
+// Version returns the etcd revision of the current table.
+func (cr *ClusterRouter) Version() int64 {
+	cr.rwlock.RLock()
+	defer cr.rwlock.RUnlock()
+	return cr.version
+}
+
+// StartRefreshLoop keeps the table fresh in the background.
+func (cr *ClusterRouter) StartRefreshLoop(interval time.Duration) {
+	if cr.cancel != nil {
+		return
+	}
+	ctx, cancel := context.WithCancel(context.Background())
+	cr.cancel = cancel
+	go func() {
+		ticker := time.NewTicker(interval)
+		defer ticker.Stop()
+		for {
+			select {
+			case <-ctx.Done():
+				return
+			case <-ticker.C:
+				if err := cr.Refresh(); err != nil {
+					log.Warnf("routing refresh failed: %+v", err)
+				}
+			}
+		}
+	}()
+	return
+}
+
+// StopRefreshLoop stops the loop started by StartRefreshLoop.
+func (cr *ClusterRouter) StopRefreshLoop() {
+	if cr.cancel == nil {
+		return
+	}
+	cr.cancel()
+	cr.cancel = nil
+	return
+}
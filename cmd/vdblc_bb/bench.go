@@ -0,0 +1,314 @@
+package main
+
+// Load-generator mode of vdblc_bb: open-loop paced add/search mixes against a
+// running vectodblite cluster, with per-operation and per-node latency
+// percentiles. Unlike the blackbox check, it does not start or stop the
+// cluster; point it at one with -addrs or let it discover the nodes in
+// Eureka.
+
+import (
+	"fmt"
+	"math"
+	"math/bits"
+	"math/rand"
+	"net/http"
+	"sort"
+	"strconv"
+	"strings"
+	"sync"
+	"sync/atomic"
+	"time"
+
+	"github.com/pkg/errors"
+	log "github.com/sirupsen/logrus"
+)
+
+// latHist is an HDR-style log-linear histogram of microsecond latencies:
+// one major bucket per power of two, 16 linear sub-buckets each, so every
+// recorded value lands within ~6% of its bucket's representative value.
+// Recording is a single atomic add, cheap enough for the request path.
+const latSubBits = 4
+
+type latHist struct {
+	counts [64 << latSubBits]uint64
+	count  uint64
+	sum    uint64
+	max    uint64
+}
+
+func (h *latHist) record(us int64) {
+	if us < 0 {
+		us = 0
+	}
+	v := uint64(us)
+	var slot int
+	if v < 1<<latSubBits {
+		slot = int(v)
+	} else {
+		major := bits.Len64(v) - 1
+		sub := (v >> uint(major-latSubBits)) & (1<<latSubBits - 1)
+		slot = (major-latSubBits+1)<<latSubBits + int(sub)
+	}
+	atomic.AddUint64(&h.counts[slot], 1)
+	atomic.AddUint64(&h.count, 1)
+	atomic.AddUint64(&h.sum, v)
+	for {
+		cur := atomic.LoadUint64(&h.max)
+		if v <= cur || atomic.CompareAndSwapUint64(&h.max, cur, v) {
+			break
+		}
+	}
+}
+
+// slotValue is the representative (upper-bound) latency of a slot in µs.
+func slotValue(slot int) uint64 {
+	if slot < 1<<latSubBits {
+		return uint64(slot)
+	}
+	major := slot>>latSubBits + latSubBits - 1
+	sub := uint64(slot & (1<<latSubBits - 1))
+	return (1<<latSubBits + sub + 1) << uint(major-latSubBits)
+}
+
+func (h *latHist) percentile(q float64) uint64 {
+	total := atomic.LoadUint64(&h.count)
+	if total == 0 {
+		return 0
+	}
+	rank := uint64(math.Ceil(q * float64(total)))
+	var seen uint64
+	for slot := range h.counts {
+		seen += atomic.LoadUint64(&h.counts[slot])
+		if seen >= rank {
+			return slotValue(slot)
+		}
+	}
+	return atomic.LoadUint64(&h.max)
+}
+
+func (h *latHist) String() string {
+	n := atomic.LoadUint64(&h.count)
+	if n == 0 {
+		return "no samples"
+	}
+	mean := time.Duration(atomic.LoadUint64(&h.sum)/n) * time.Microsecond
+	return fmt.Sprintf("n %d, mean %v, p50 %v, p95 %v, p99 %v, p999 %v, max %v",
+		n, mean,
+		time.Duration(h.percentile(0.50))*time.Microsecond,
+		time.Duration(h.percentile(0.95))*time.Microsecond,
+		time.Duration(h.percentile(0.99))*time.Microsecond,
+		time.Duration(h.percentile(0.999))*time.Microsecond,
+		time.Duration(atomic.LoadUint64(&h.max))*time.Microsecond)
+}
+
+// BenchConfig is one cell of the sweep grid.
+type BenchConfig struct {
+	Dim         int
+	DbNum       int
+	QPS         int
+	SearchRatio float64
+	Warmup      time.Duration
+	Duration    time.Duration
+	Conns       int
+}
+
+type benchStats struct {
+	mtx     sync.Mutex
+	perOp   map[string]*latHist // "add" / "search"
+	perNode map[string]*latHist // "search@127.0.0.1:6731"
+	errs    uint64
+	dropped uint64 // ops the pacer had to shed because every worker was busy
+}
+
+func newBenchStats() *benchStats {
+	return &benchStats{
+		perOp:   make(map[string]*latHist),
+		perNode: make(map[string]*latHist),
+	}
+}
+
+func (bs *benchStats) hist(table map[string]*latHist, key string) *latHist {
+	bs.mtx.Lock()
+	h, ok := table[key]
+	if !ok {
+		h = &latHist{}
+		table[key] = h
+	}
+	bs.mtx.Unlock()
+	return h
+}
+
+func genVecDim(dim int) (vec []float32) {
+	vec = make([]float32, dim)
+	var prod float64
+	for i := 0; i < dim; i++ {
+		vec[i] = rand.Float32()
+		prod += float64(vec[i]) * float64(vec[i])
+	}
+	prod = math.Sqrt(prod)
+	for i := 0; i < dim; i++ {
+		vec[i] = float32(float64(vec[i]) / prod)
+	}
+	return
+}
+
+// runBenchCell drives one configuration: warmup at target QPS with stats
+// discarded, then the measured run. Pacing is open-loop — operations are
+// scheduled on the wall clock regardless of completions, and latency is
+// measured from the scheduled start, so queueing delay under overload shows
+// up in the percentiles instead of silently throttling the offered load.
+func runBenchCell(cfg BenchConfig, nodeAddrs []string) (err error) {
+	router := NewRouter(nodeAddrs)
+	hc := &http.Client{Timeout: 10 * time.Second}
+	hc.CheckRedirect = router.CheckRedirect
+
+	log.Infof("bench dim %d, dbs %d, qps %d, search ratio %.2f, warmup %v, duration %v, conns %d",
+		cfg.Dim, cfg.DbNum, cfg.QPS, cfg.SearchRatio, cfg.Warmup, cfg.Duration, cfg.Conns)
+
+	stats := newBenchStats()
+	measuring := int32(0)
+
+	oneOp := func(scheduled time.Time) {
+		dbID := ShopIdBegin + rand.Intn(cfg.DbNum)
+		nodeAddr := router.GetRoute(dbID)
+		var op string
+		var opErr error
+		if rand.Float64() < cfg.SearchRatio {
+			op = "search"
+			rsp := &RspSearch{}
+			opErr = PostJson(hc, getApiURL(nodeAddr, "search"), ReqSearch{DbID: dbID, Xq: genVecDim(cfg.Dim)}, rsp)
+			if opErr == nil && rsp.Err != "" {
+				opErr = errors.New(rsp.Err)
+			}
+		} else {
+			op = "add"
+			rsp := &RspAdd{}
+			opErr = PostJson(hc, getApiURL(nodeAddr, "add"), ReqAdd{DbID: dbID, Xb: genVecDim(cfg.Dim)}, rsp)
+			if opErr == nil && rsp.Err != "" {
+				opErr = errors.New(rsp.Err)
+			}
+		}
+		if atomic.LoadInt32(&measuring) == 0 {
+			return
+		}
+		if opErr != nil {
+			atomic.AddUint64(&stats.errs, 1)
+			return
+		}
+		us := time.Since(scheduled).Microseconds()
+		stats.hist(stats.perOp, op).record(us)
+		stats.hist(stats.perNode, op+"@"+nodeAddr).record(us)
+	}
+
+	work := make(chan time.Time, cfg.Conns)
+	var wg sync.WaitGroup
+	for w := 0; w < cfg.Conns; w++ {
+		wg.Add(1)
+		go func() {
+			defer wg.Done()
+			for scheduled := range work {
+				oneOp(scheduled)
+			}
+		}()
+	}
+
+	interval := time.Second / time.Duration(cfg.QPS)
+	pace := func(d time.Duration) {
+		deadline := time.Now().Add(d)
+		next := time.Now()
+		for time.Now().Before(deadline) {
+			select {
+			case work <- next:
+			default:
+				// every worker is busy and the queue is full; shedding keeps
+				// the pacer on schedule, and the drop count reports overload
+				atomic.AddUint64(&stats.dropped, 1)
+			}
+			next = next.Add(interval)
+			if sleep := time.Until(next); sleep > 0 {
+				time.Sleep(sleep)
+			}
+		}
+	}
+
+	if cfg.Warmup > 0 {
+		pace(cfg.Warmup)
+	}
+	atomic.StoreInt32(&measuring, 1)
+	start := time.Now()
+	pace(cfg.Duration)
+	close(work)
+	wg.Wait()
+	elapsed := time.Since(start)
+
+	var done uint64
+	ops := make([]string, 0, len(stats.perOp))
+	for op, h := range stats.perOp {
+		ops = append(ops, op)
+		done += atomic.LoadUint64(&h.count)
+	}
+	sort.Strings(ops)
+	log.Infof("bench done: %d ops in %v (%.0f/s achieved of %d/s offered), %d errors, %d shed",
+		done, elapsed.Round(time.Millisecond), float64(done)/elapsed.Seconds(), cfg.QPS,
+		atomic.LoadUint64(&stats.errs), atomic.LoadUint64(&stats.dropped))
+	for _, op := range ops {
+		log.Infof("  %-8s %s", op, stats.perOp[op])
+	}
+	nodes := make([]string, 0, len(stats.perNode))
+	for key := range stats.perNode {
+		nodes = append(nodes, key)
+	}
+	sort.Strings(nodes)
+	for _, key := range nodes {
+		log.Infof("  %-28s %s", key, stats.perNode[key])
+	}
+	if stats.errs > done/10 {
+		err = errors.Errorf("%d of %d operations failed", stats.errs, done)
+	}
+	return
+}
+
+func parseIntList(s string) (vals []int, err error) {
+	for _, part := range strings.Split(s, ",") {
+		var v int
+		if v, err = strconv.Atoi(strings.TrimSpace(part)); err != nil {
+			err = errors.Wrapf(err, "bad list element %q", part)
+			return
+		}
+		vals = append(vals, v)
+	}
+	return
+}
+
+// runBench sweeps the dimension x database-count grid, one measured cell per
+// combination. Every dimension in the sweep must match what the target
+// cluster was started with (--dim is a cluster-wide flag).
+func runBench(dims, dbNums []int, qps int, searchRatio float64, warmup, duration time.Duration, conns int, addrs string) (err error) {
+	var nodeAddrs []string
+	if addrs != "" {
+		nodeAddrs = strings.Split(addrs, ",")
+	} else if nodeAddrs, err = getNodeAddrs(); err != nil {
+		return
+	}
+	if len(nodeAddrs) == 0 {
+		return errors.New("no cluster nodes, pass -addrs or register the cluster in Eureka")
+	}
+	log.Infof("bench targets: %+v", nodeAddrs)
+	for _, dim := range dims {
+		for _, dbNum := range dbNums {
+			cfg := BenchConfig{
+				Dim:         dim,
+				DbNum:       dbNum,
+				QPS:         qps,
+				SearchRatio: searchRatio,
+				Warmup:      warmup,
+				Duration:    duration,
+				Conns:       conns,
+			}
+			if err = runBenchCell(cfg, nodeAddrs); err != nil {
+				return
+			}
+		}
+	}
+	return
+}
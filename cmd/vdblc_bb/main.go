@@ -2,9 +2,9 @@ package main
 
 import (
 	"context"
+	"flag"
 	"fmt"
 	"io"
-	"math"
 	"math/rand"
 	"os"
 	"os/exec"
@@ -243,17 +243,7 @@ func getApiURL(nodeAddr, method string) (URL string) {
 }
 
 func genVec() (vec []float32) {
-	vec = make([]float32, Dim)
-	var prod float64
-	for i := 0; i < Dim; i++ {
-		vec[i] = rand.Float32()
-		prod += float64(vec[i]) * float64(vec[i])
-	}
-	prod = math.Sqrt(prod)
-	for i := 0; i < Dim; i++ {
-		vec[i] = float32(float64(vec[i]) / prod)
-	}
-	return
+	return genVecDim(Dim)
 }
 
 func search(shopDbCache map[int][]Record, hc *http.Client, router *Router) (err error) {
@@ -326,12 +316,37 @@ func getNodeAddrs() (nodeAddrs []string, err error) {
 }
 
 func main() {
+	benchMode := flag.Bool("bench", false, "run as a load generator against an already-running cluster instead of the blackbox check")
+	benchDims := flag.String("dims", strconv.Itoa(Dim), "comma-separated dimension sweep, each must match the cluster's --dim")
+	benchDbs := flag.String("dbs", strconv.Itoa(ShopNum), "comma-separated database-count sweep")
+	benchQPS := flag.Int("qps", 1000, "offered load per sweep cell, open-loop paced")
+	benchSearch := flag.Float64("search-ratio", 0.9, "fraction of operations that are searches, the rest are adds")
+	benchWarmup := flag.Duration("warmup", 10*time.Second, "per-cell warmup, stats discarded")
+	benchDuration := flag.Duration("duration", 60*time.Second, "per-cell measured duration")
+	benchConns := flag.Int("conns", 64, "concurrent workers")
+	benchAddrs := flag.String("addrs", "", "comma-separated node addresses, empty discovers the cluster in Eureka")
+	flag.Parse()
+
 	formatter := &log.TextFormatter{
 		FullTimestamp: true,
 	}
 	log.SetFormatter(formatter)
 	log.SetLevel(log.DebugLevel)
 	var err error
+	if *benchMode {
+		log.SetLevel(log.InfoLevel) //per-request debug logging would dominate the run
+		var dims, dbNums []int
+		if dims, err = parseIntList(*benchDims); err != nil {
+			log.Fatalf("got error %+v", err)
+		}
+		if dbNums, err = parseIntList(*benchDbs); err != nil {
+			log.Fatalf("got error %+v", err)
+		}
+		if err = runBench(dims, dbNums, *benchQPS, *benchSearch, *benchWarmup, *benchDuration, *benchConns, *benchAddrs); err != nil {
+			log.Fatalf("got error %+v", err)
+		}
+		return
+	}
 	clear := true
 	if err = setupEnv(clear); err != nil {
 		log.Fatalf("got error %+v", err)
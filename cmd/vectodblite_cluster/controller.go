@@ -1,9 +1,15 @@
 package main
 
 import (
+	"encoding/binary"
 	"fmt"
+	"io/ioutil"
+	"math"
+	"math/rand"
 	"net/http"
+	"strconv"
 	"sync"
+	"sync/atomic"
 	"time"
 
 	"github.com/coreos/etcd/clientv3"
@@ -13,10 +19,16 @@ import (
 	"github.com/pkg/errors"
 	log "github.com/sirupsen/logrus"
 	"golang.org/x/net/context"
+	"google.golang.org/grpc"
 )
 
 type Status struct {
-	Status string `json:"status"`
+	Status          string `json:"status"`
+	ResidentDbs     int    `json:"residentDbs"`
+	ResidentVectors int    `json:"residentVectors"`
+	MemBytes        int64  `json:"memBytes"`
+	MemBudgetBytes  int64  `json:"memBudgetBytes"`
+	NumEvicted      int64  `json:"numEvicted"`
 }
 
 type Health struct {
@@ -55,15 +67,94 @@ type RspAdd struct {
 	Err string `json:"err"`
 }
 
+type ReqAddBatch struct {
+	DbID int         `json:"dbID"`
+	Xbs  [][]float32 `json:"xbs"`
+}
+
+type RspAddBatch struct {
+	Xids []uint64 `json:"xids"` //parallel to xbs
+	Err  string   `json:"err"`
+}
+
+type AddItem struct {
+	DbID int       `json:"dbID"`
+	Xb   []float32 `json:"xb"`
+	Xid  uint64    `json:"xid,omitempty"`
+}
+
+type ReqAddMulti struct {
+	Items []AddItem `json:"items"`
+	//set on the aggregated hop between nodes, to stop re-forwarding
+	Forwarded bool `json:"forwarded,omitempty"`
+}
+
+type RspAddMulti struct {
+	Xids []uint64 `json:"xids"` //parallel to items, 0 marks a failed item
+	Err  string   `json:"err"`
+}
+
 type ReqSearch struct {
 	DbID int       `json:"dbID"`
 	Xq   []float32 `json:"xq"`
+	K    int       `json:"k,omitempty"` //number of nearest matches, default 1
 }
 
 type RspSearch struct {
-	Xid      uint64  `json:"xid"`
-	Distance float32 `json:"distance"`
-	Err      string  `json:"err"`
+	Xid       uint64    `json:"xid"`
+	Distance  float32   `json:"distance"`
+	Xids      []uint64  `json:"xids,omitempty"`      //k nearest, present when k > 1
+	Distances []float32 `json:"distances,omitempty"` //k nearest, present when k > 1
+	Err       string    `json:"err"`
+}
+
+type ReqHandoff struct {
+	DbID        int    `json:"dbID"`
+	DstNodeAddr string `json:"dstNodeAddr"`
+}
+
+type RspHandoff struct {
+	DbID int    `json:"dbID"`
+	Err  string `json:"err"`
+}
+
+type ReqImport struct {
+	DbID  int               `json:"dbID"`
+	Items map[string][]byte `json:"items"`
+	//non-empty marks the import as a read-replica seed owned by that node
+	OwnerAddr string `json:"ownerAddr,omitempty"`
+}
+
+type RspImport struct {
+	DbID int    `json:"dbID"`
+	Err  string `json:"err"`
+}
+
+type ReqReplicate struct {
+	DbID         int      `json:"dbID"`
+	ReplicaAddrs []string `json:"replicaAddrs"` //empty tears the replica set down
+}
+
+type RspReplicate struct {
+	DbID int    `json:"dbID"`
+	Err  string `json:"err"`
+}
+
+type ReqReplicaAdd struct {
+	DbID int       `json:"dbID"`
+	Xb   []float32 `json:"xb"`
+	Xid  uint64    `json:"xid"`
+}
+
+type RspReplicaAdd struct {
+	DbID int    `json:"dbID"`
+	Err  string `json:"err"`
+}
+
+type RspRouting struct {
+	Version int64          `json:"version"` //etcd revision the map was read at
+	Routes  map[int]string `json:"routes"`  //dbID -> nodeAddr
+	Err     string         `json:"err"`
 }
 
 type ControllerConf struct {
@@ -74,23 +165,41 @@ type ControllerConf struct {
 	DisThr          float64
 	SizeLimit       int
 	BalanceInterval int
+	MemBudget       int //MB of resident vectodblite databases this node may keep
 
 	EurekaAddr string
 	EurekaApp  string
 }
 
 type Controller struct {
-	conf      *ControllerConf
-	rwlock    sync.RWMutex
-	dbls      map[int]*vectodb.VectoDBLite
-	hc        *http.Client
-	etcdCli   *clientv3.Client
-	isLeader  bool
-	curLeader string
-	ctx       context.Context
-	ctxL      context.Context
-	cancelL   context.CancelFunc
-	conn      fargo.EurekaConnection
+	conf        *ControllerConf
+	rwlock      sync.RWMutex
+	dbls        map[int]*vectodb.VectoDBLite
+	mtxAccess   sync.Mutex
+	lastAccess  map[int]int64    //dbID -> unix nano of last request, drives eviction
+	accessCount map[int]int64    //dbID -> requests since the last load report, drives hot detection
+	replicas    map[int][]string //owner side: dbID -> read replica addrs, guarded by rwlock
+	replicaOf   map[int]string   //replica side: dbID -> owner addr, guarded by rwlock
+	replicaPlan map[int][]string //leader side: assigned replica sets, servLeaderWork only
+	mtxSplit    sync.Mutex
+	splits      map[int]bool //dbID -> split into subDbIDs(dbID), mirrored from etcd
+	splitting   map[int]bool //splits in flight on this node
+	prewarmed   map[int]*vectodb.VectoDBLite //announced placements loaded ahead of cutover, guarded by rwlock
+	prewarming  map[int]bool                 //prewarm loads in flight, guarded by rwlock
+	prewarmPlan map[int]string               //leader side: announced moves, servLeaderWork only
+	numEvicted  int64
+	hc          *http.Client
+	rpcServer   *grpc.Server
+	mtxConns    sync.Mutex
+	peerConns   map[string]*grpc.ClientConn //peer gin addr -> rpc connection
+	etcdCli     *clientv3.Client
+	leaseID     clientv3.LeaseID //keepalive lease, also carries the pushed NodeLoad
+	isLeader    bool
+	curLeader   string
+	ctx         context.Context
+	ctxL        context.Context
+	cancelL     context.CancelFunc
+	conn        fargo.EurekaConnection
 }
 
 func NewControllerConf() (conf *ControllerConf) {
@@ -102,6 +211,7 @@ func NewControllerConf() (conf *ControllerConf) {
 		DisThr:          0.9,
 		SizeLimit:       10000,
 		BalanceInterval: 60,
+		MemBudget:       4096,
 		EurekaAddr:      "http://127.0.0.1:8761/eureka",
 		EurekaApp:       "vectodblite-cluster",
 	}
@@ -109,14 +219,30 @@ func NewControllerConf() (conf *ControllerConf) {
 
 func NewController(conf *ControllerConf, ctx context.Context) (ctl *Controller) {
 	ctl = &Controller{
-		conf: conf,
-		dbls: make(map[int]*vectodb.VectoDBLite),
-		hc:   &http.Client{Timeout: time.Second * 5},
-		ctx:  ctx,
+		conf:        conf,
+		dbls:        make(map[int]*vectodb.VectoDBLite),
+		lastAccess:  make(map[int]int64),
+		accessCount: make(map[int]int64),
+		replicas:    make(map[int][]string),
+		replicaOf:   make(map[int]string),
+		replicaPlan: make(map[int][]string),
+		splits:      make(map[int]bool),
+		splitting:   make(map[int]bool),
+		prewarmed:   make(map[int]*vectodb.VectoDBLite),
+		prewarming:  make(map[int]bool),
+		prewarmPlan: make(map[int]string),
+		hc:          NewForwardClient(time.Second * 5),
+		peerConns:   make(map[string]*grpc.ClientConn),
+		ctx:         ctx,
+	}
+	if err := ctl.initRpc(); err != nil {
+		log.Fatalf("got error %+v", err)
 	}
 	if err := ctl.initMgmt(); err != nil {
 		log.Fatalf("got error %+v", err)
 	}
+	go ctl.servEvict(ctx)
+	go ctl.servSplitWatch(ctx)
 	return
 }
 
@@ -133,6 +259,8 @@ func NewController(conf *ControllerConf, ctx context.Context) (ctl *Controller)
 func (ctl *Controller) HandleAdd(c *gin.Context) {
 	var reqAdd ReqAdd
 	var err error
+	route := "local"
+	defer observeRequest("add", &route, &err)()
 	if err = c.ShouldBind(&reqAdd); err != nil {
 		err = errors.Wrap(err, "")
 		log.Infof("failed to parse request body, error %+v", err)
@@ -140,8 +268,24 @@ func (ctl *Controller) HandleAdd(c *gin.Context) {
 	} else {
 		var rspAdd RspAdd
 		var dbl *vectodb.VectoDBLite
+		if ctl.isSplit(reqAdd.DbID) {
+			// a split database: fix the xid up front (every hop hashes the
+			// same way) and rewrite the request to the owning sub-shard
+			if reqAdd.Xid == 0 || reqAdd.Xid == ^uint64(0) {
+				reqAdd.Xid = vectodb.AllocateXid(reqAdd.Xb)
+			}
+			reqAdd.DbID = ctl.resolveSplit(reqAdd.DbID, reqAdd.Xid)
+		}
 		ctl.rwlock.RLock()
 		defer ctl.rwlock.RUnlock()
+		// writes always go through the owner; a replica only serves reads
+		if ownerAddr, ok := ctl.replicaOf[reqAdd.DbID]; ok {
+			dstURL := *c.Request.URL
+			dstURL.Host = ownerAddr
+			c.Redirect(http.StatusTemporaryRedirect, dstURL.String())
+			route = "redirect"
+			return
+		}
 		if dbl, err = ctl.getVectoDBLite(c, reqAdd.DbID); err != nil {
 			rspAdd.Err = err.Error()
 			log.Errorf("got error %+v", err)
@@ -149,6 +293,7 @@ func (ctl *Controller) HandleAdd(c *gin.Context) {
 			return
 		} else if dbl == nil {
 			//already return a response
+			route = "redirect"
 			return
 		}
 		if reqAdd.Xid == 0 || reqAdd.Xid == ^uint64(0) {
@@ -160,11 +305,283 @@ func (ctl *Controller) HandleAdd(c *gin.Context) {
 		if err != nil {
 			rspAdd.Err = err.Error()
 			log.Errorf("got error %+v", err)
+		} else if replicaAddrs, ok := ctl.replicas[reqAdd.DbID]; ok {
+			// feed the read replicas asynchronously; redis remains the source
+			// of truth, so a lost replication add costs freshness, not data
+			go ctl.replicateAdd(reqAdd.DbID, reqAdd.Xb, rspAdd.Xid, replicaAddrs)
+		}
+		if err == nil {
+			ctl.maybeSplit(reqAdd.DbID, dbl)
 		}
 		c.JSON(200, rspAdd)
 	}
 }
 
+// @Description Add a batch of vectors to the given vectodblite. The whole
+// batch is hashed, persisted with one pipelined redis write and added to the
+// index in one call, so bulk enrollment jobs should prefer this over add.
+// @Accept  json
+// @Produce  json
+// @Param   add		body	main.ReqAddBatch	true 	"ReqAddBatch"
+// @Success 200 {object} main.RspAddBatch "RspAddBatch"
+// @Failure 308 "redirection"
+// @Failure 400
+// @Router /api/v1/add_batch [post]
+func (ctl *Controller) HandleAddBatch(c *gin.Context) {
+	var reqAddBatch ReqAddBatch
+	var err error
+	route := "local"
+	defer observeRequest("add_batch", &route, &err)()
+	if err = c.ShouldBind(&reqAddBatch); err != nil {
+		err = errors.Wrap(err, "")
+		log.Infof("failed to parse request body, error %+v", err)
+		c.String(http.StatusBadRequest, err.Error())
+	} else {
+		var rspAddBatch RspAddBatch
+		var dbl *vectodb.VectoDBLite
+		if ctl.isSplit(reqAddBatch.DbID) {
+			// a split batch may span both halves; reuse the add_multi
+			// machinery, which groups per sub-shard and forwards in bulk
+			route = "split"
+			reqAddMulti := ReqAddMulti{Items: make([]AddItem, len(reqAddBatch.Xbs))}
+			for i, xb := range reqAddBatch.Xbs {
+				reqAddMulti.Items[i] = AddItem{DbID: reqAddBatch.DbID, Xb: xb, Xid: vectodb.AllocateXid(xb)}
+			}
+			rspAddMulti := ctl.addMulti(c.Request.Context(), &reqAddMulti)
+			rspAddBatch.Xids = rspAddMulti.Xids
+			rspAddBatch.Err = rspAddMulti.Err
+			if rspAddBatch.Err != "" {
+				err = errors.New(rspAddBatch.Err)
+			}
+			c.JSON(200, rspAddBatch)
+			return
+		}
+		ctl.rwlock.RLock()
+		defer ctl.rwlock.RUnlock()
+		// writes always go through the owner; a replica only serves reads
+		if ownerAddr, ok := ctl.replicaOf[reqAddBatch.DbID]; ok {
+			dstURL := *c.Request.URL
+			dstURL.Host = ownerAddr
+			c.Redirect(http.StatusTemporaryRedirect, dstURL.String())
+			route = "redirect"
+			return
+		}
+		if dbl, err = ctl.getVectoDBLite(c, reqAddBatch.DbID); err != nil {
+			rspAddBatch.Err = err.Error()
+			log.Errorf("got error %+v", err)
+			c.JSON(200, rspAddBatch)
+			return
+		} else if dbl == nil {
+			//already return a response
+			route = "redirect"
+			return
+		}
+		rspAddBatch.Xids, err = dbl.AddBatch(reqAddBatch.Xbs)
+		if err != nil {
+			rspAddBatch.Err = err.Error()
+			log.Errorf("got error %+v", err)
+		} else if replicaAddrs, ok := ctl.replicas[reqAddBatch.DbID]; ok {
+			// feed the read replicas asynchronously, one stream add per vector
+			go func(dbID int, xbs [][]float32, xids []uint64, addrs []string) {
+				for i := range xbs {
+					ctl.replicateAdd(dbID, xbs[i], xids[i], addrs)
+				}
+			}(reqAddBatch.DbID, reqAddBatch.Xbs, rspAddBatch.Xids, replicaAddrs)
+		}
+		if err == nil {
+			ctl.maybeSplit(reqAddBatch.DbID, dbl)
+		}
+		c.JSON(200, rspAddBatch)
+	}
+}
+
+// @Description Add a batch of (dbID, vector) pairs spanning many
+// vectodblites. Items owned here apply as per-database batches; the rest
+// are grouped by owning node via the routing table and forwarded as one
+// aggregated sub-batch per peer, so an enrollment pipeline spraying
+// thousands of dbIDs pays a handful of large requests instead of one
+// request per vector.
+// @Accept  json
+// @Produce  json
+// @Param   add		body	main.ReqAddMulti	true 	"ReqAddMulti"
+// @Success 200 {object} main.RspAddMulti "RspAddMulti"
+// @Failure 400
+// @Router /api/v1/add_multi [post]
+func (ctl *Controller) HandleAddMulti(c *gin.Context) {
+	var reqAddMulti ReqAddMulti
+	var err error
+	route := "local"
+	defer observeRequest("add_multi", &route, &err)()
+	if err = c.ShouldBind(&reqAddMulti); err != nil {
+		err = errors.Wrap(err, "")
+		log.Infof("failed to parse request body, error %+v", err)
+		c.String(http.StatusBadRequest, err.Error())
+		return
+	}
+	rspAddMulti := ctl.addMulti(c.Request.Context(), &reqAddMulti)
+	if rspAddMulti.Err != "" {
+		err = errors.New(rspAddMulti.Err)
+	}
+	c.JSON(200, rspAddMulti)
+}
+
+// addMulti is the transport-independent core of add_multi, shared by the gin
+// handler and the rpc AddMulti method the aggregated sub-batches arrive on.
+func (ctl *Controller) addMulti(ctx context.Context, reqAddMulti *ReqAddMulti) (rspAddMulti *RspAddMulti) {
+	var err error
+	rspAddMulti = &RspAddMulti{
+		Xids: make([]uint64, len(reqAddMulti.Items)),
+	}
+	//group item positions by database, rewriting split dbIDs to the sub-shard
+	//owning each item's xid first
+	byDb := make(map[int][]int)
+	for i := range reqAddMulti.Items {
+		it := &reqAddMulti.Items[i]
+		if ctl.isSplit(it.DbID) {
+			if it.Xid == 0 || it.Xid == ^uint64(0) {
+				it.Xid = vectodb.AllocateXid(it.Xb)
+			}
+			it.DbID = ctl.resolveSplit(it.DbID, it.Xid)
+		}
+		byDb[it.DbID] = append(byDb[it.DbID], i)
+	}
+	//split the databases into local ones and one group per owning node;
+	//a single etcd range answers routing for the whole batch
+	localDbs := make([]int, 0, len(byDb))
+	byNode := make(map[string][]int) //owner addr -> item positions
+	var routes map[int]string
+	ctl.rwlock.RLock()
+	for dbID, idxs := range byDb {
+		if ownerAddr, isReplica := ctl.replicaOf[dbID]; isReplica {
+			byNode[ownerAddr] = append(byNode[ownerAddr], idxs...)
+			continue
+		}
+		if _, ok := ctl.dbls[dbID]; ok {
+			localDbs = append(localDbs, dbID)
+			continue
+		}
+		if routes == nil {
+			if routes, _, err = ctl.getRoutes(ctx); err != nil {
+				break
+			}
+		}
+		if addr, ok := routes[dbID]; ok && addr != ctl.conf.ListenAddr {
+			byNode[addr] = append(byNode[addr], idxs...)
+		} else {
+			//unrouted databases land here and get acquired on apply
+			localDbs = append(localDbs, dbID)
+		}
+	}
+	ctl.rwlock.RUnlock()
+	if err != nil {
+		log.Errorf("got error %+v", err)
+		rspAddMulti.Err = err.Error()
+		return
+	}
+
+	forward := func(addr string, idxs []int) {
+		sub := ReqAddMulti{
+			Items:     make([]AddItem, len(idxs)),
+			Forwarded: true,
+		}
+		for j, i := range idxs {
+			sub.Items[j] = reqAddMulti.Items[i]
+		}
+		subRsp := &RspAddMulti{}
+		if errF := ctl.callPeer(addr, "AddMulti", "/api/v1/add_multi", &sub, subRsp); errF != nil {
+			log.Errorf("got error %+v", errF)
+			if err == nil {
+				err = errF
+			}
+			return
+		}
+		if subRsp.Err != "" && err == nil {
+			err = errors.New(subRsp.Err)
+		}
+		for j, i := range idxs {
+			if j < len(subRsp.Xids) {
+				rspAddMulti.Xids[i] = subRsp.Xids[j]
+			}
+		}
+	}
+
+	applyLocal := func(dbID int, idxs []int) {
+		ctl.rwlock.RLock()
+		defer ctl.rwlock.RUnlock()
+		dbl, dstNodeAddr, errR := ctl.resolveVectoDBLite(ctx, dbID)
+		if errR != nil {
+			log.Errorf("got error %+v", errR)
+			if err == nil {
+				err = errR
+			}
+			return
+		}
+		if dbl == nil {
+			if reqAddMulti.Forwarded {
+				//one aggregated hop only; the sender's routing was stale
+				if err == nil {
+					err = errors.Errorf("not the owner of vectodblite %d", dbID)
+				}
+				return
+			}
+			forward(dstNodeAddr, idxs)
+			return
+		}
+		hashedIdxs := make([]int, 0, len(idxs))
+		xbs := make([][]float32, 0, len(idxs))
+		for _, i := range idxs {
+			it := reqAddMulti.Items[i]
+			if it.Xid == 0 || it.Xid == ^uint64(0) {
+				hashedIdxs = append(hashedIdxs, i)
+				xbs = append(xbs, it.Xb)
+				continue
+			}
+			if errA := dbl.AddWithId(it.Xb, it.Xid); errA != nil {
+				log.Errorf("got error %+v", errA)
+				if err == nil {
+					err = errA
+				}
+				continue
+			}
+			rspAddMulti.Xids[i] = it.Xid
+		}
+		if len(xbs) != 0 {
+			bxids, errB := dbl.AddBatch(xbs)
+			if errB != nil {
+				log.Errorf("got error %+v", errB)
+				if err == nil {
+					err = errB
+				}
+			} else {
+				for j, i := range hashedIdxs {
+					rspAddMulti.Xids[i] = bxids[j]
+				}
+			}
+		}
+		if replicaAddrs, ok := ctl.replicas[dbID]; ok {
+			go func(xids []uint64, addrs []string) {
+				for _, i := range idxs {
+					if xids[i] != 0 {
+						ctl.replicateAdd(dbID, reqAddMulti.Items[i].Xb, xids[i], addrs)
+					}
+				}
+			}(rspAddMulti.Xids, replicaAddrs)
+		}
+		ctl.maybeSplit(dbID, dbl)
+	}
+
+	for _, dbID := range localDbs {
+		applyLocal(dbID, byDb[dbID])
+	}
+	for addr, idxs := range byNode {
+		forward(addr, idxs)
+	}
+	if err != nil {
+		rspAddMulti.Err = err.Error()
+	}
+	return
+}
+
 // @Description Search a vector in the given vectodblite
 // @Accept  json
 // @Produce  json
@@ -176,6 +593,8 @@ func (ctl *Controller) HandleAdd(c *gin.Context) {
 func (ctl *Controller) HandleSearch(c *gin.Context) {
 	var reqSearch ReqSearch
 	var err error
+	route := "local"
+	defer observeRequest("search", &route, &err)()
 	if err = c.ShouldBind(&reqSearch); err != nil {
 		err = errors.Wrap(err, "")
 		log.Infof("failed to parse request body, error %+v", err)
@@ -183,6 +602,20 @@ func (ctl *Controller) HandleSearch(c *gin.Context) {
 	} else {
 		var rspSearch RspSearch
 		var dbl *vectodb.VectoDBLite
+		if ctl.isSplit(reqSearch.DbID) {
+			// fan out to the sub-shards and merge, keeping the external dbID
+			// stable
+			route = "split"
+			t0 := time.Now()
+			rsp := ctl.searchSplit(c.Request.Context(), &reqSearch)
+			mSearchDur.With(`op="search"`).Observe(time.Since(t0))
+			if rsp.Err != "" {
+				err = errors.New(rsp.Err)
+				log.Errorf("got error %+v", err)
+			}
+			c.JSON(200, rsp)
+			return
+		}
 		ctl.rwlock.RLock()
 		defer ctl.rwlock.RUnlock()
 		if dbl, err = ctl.getVectoDBLite(c, reqSearch.DbID); err != nil {
@@ -192,9 +625,31 @@ func (ctl *Controller) HandleSearch(c *gin.Context) {
 			return
 		} else if dbl == nil {
 			//already return a response
+			route = "redirect"
 			return
 		}
-		rspSearch.Xid, rspSearch.Distance, err = dbl.Search(reqSearch.Xq)
+		// spread reads across owner + replicas; the redirect is temporary so
+		// smart clients keep routing writes at the owner
+		if replicaAddrs, ok := ctl.replicas[reqSearch.DbID]; ok && len(replicaAddrs) > 0 {
+			if pick := rand.Intn(len(replicaAddrs) + 1); pick > 0 {
+				dstURL := *c.Request.URL
+				dstURL.Host = replicaAddrs[pick-1]
+				c.Redirect(http.StatusTemporaryRedirect, dstURL.String())
+				route = "redirect"
+				return
+			}
+		}
+		t0 := time.Now()
+		if reqSearch.K > 1 {
+			rspSearch.Xids, rspSearch.Distances, err = dbl.SearchKnn(1, reqSearch.K, reqSearch.Xq)
+			if err == nil {
+				rspSearch.Xid = rspSearch.Xids[0]
+				rspSearch.Distance = rspSearch.Distances[0]
+			}
+		} else {
+			rspSearch.Xid, rspSearch.Distance, err = dbl.Search(reqSearch.Xq)
+		}
+		mSearchDur.With(`op="search"`).Observe(time.Since(t0))
 		if err != nil {
 			rspSearch.Err = err.Error()
 			log.Errorf("got error %+v", err)
@@ -203,15 +658,118 @@ func (ctl *Controller) HandleSearch(c *gin.Context) {
 	}
 }
 
+// @Description Batch search in the given vectodblite. Marshalling float
+// arrays through JSON costs more CPU than the search itself, so the wire
+// format is binary: the request body is nq*dim raw little-endian float32,
+// the response body is nq little-endian uint64 xids (^uint64(0) marks a
+// miss) followed by nq little-endian float32 distances.
+// @Accept  octet-stream
+// @Produce  octet-stream
+// @Param   dbID	query	int	true	"database id"
+// @Success 200
+// @Failure 308 "redirection"
+// @Failure 400
+// @Router /api/v1/search_batch [post]
+func (ctl *Controller) HandleSearchBatch(c *gin.Context) {
+	var err error
+	var dbID int
+	route := "local"
+	defer observeRequest("search_batch", &route, &err)()
+	if dbID, err = strconv.Atoi(c.Query("dbID")); err != nil {
+		err = errors.Wrap(err, "")
+		log.Infof("failed to parse dbID, error %+v", err)
+		c.String(http.StatusBadRequest, err.Error())
+		return
+	}
+	var body []byte
+	if body, err = ioutil.ReadAll(c.Request.Body); err != nil {
+		err = errors.Wrap(err, "")
+		log.Infof("failed to read request body, error %+v", err)
+		c.String(http.StatusBadRequest, err.Error())
+		return
+	}
+	lenLine := 4 * ctl.conf.Dim
+	if len(body) == 0 || len(body)%lenLine != 0 {
+		log.Infof("invalid request body length %d, want a non-zero multiple of %d", len(body), lenLine)
+		c.String(http.StatusBadRequest, fmt.Sprintf("invalid body length %d", len(body)))
+		return
+	}
+	nq := len(body) / lenLine
+	xq := make([]float32, nq*ctl.conf.Dim)
+	for i := range xq {
+		xq[i] = math.Float32frombits(binary.LittleEndian.Uint32(body[4*i:]))
+	}
+	if ctl.isSplit(dbID) {
+		// fan the whole batch to the sub-shards and keep the per-row best
+		route = "split"
+		var xids []uint64
+		var distances []float32
+		t0 := time.Now()
+		if xids, distances, err = ctl.searchBatchOne(c.Request.Context(), dbID, nq, xq, body); err != nil {
+			log.Errorf("got error %+v", err)
+			c.String(http.StatusBadRequest, err.Error())
+			return
+		}
+		mSearchDur.With(`op="search_batch"`).Observe(time.Since(t0))
+		out := make([]byte, 12*nq)
+		for i := 0; i < nq; i++ {
+			binary.LittleEndian.PutUint64(out[8*i:], xids[i])
+			binary.LittleEndian.PutUint32(out[8*nq+4*i:], math.Float32bits(distances[i]))
+		}
+		c.Data(200, "application/octet-stream", out)
+		return
+	}
+	var dbl *vectodb.VectoDBLite
+	ctl.rwlock.RLock()
+	defer ctl.rwlock.RUnlock()
+	if dbl, err = ctl.getVectoDBLite(c, dbID); err != nil {
+		log.Errorf("got error %+v", err)
+		c.String(http.StatusBadRequest, err.Error())
+		return
+	} else if dbl == nil {
+		//already return a response
+		route = "redirect"
+		return
+	}
+	var xids []uint64
+	var distances []float32
+	t0 := time.Now()
+	if xids, distances, err = dbl.SearchBatch(nq, xq); err != nil {
+		log.Errorf("got error %+v", err)
+		c.String(http.StatusBadRequest, err.Error())
+		return
+	}
+	mSearchDur.With(`op="search_batch"`).Observe(time.Since(t0))
+	out := make([]byte, 12*nq)
+	for i := 0; i < nq; i++ {
+		binary.LittleEndian.PutUint64(out[8*i:], xids[i])
+		binary.LittleEndian.PutUint32(out[8*nq+4*i:], math.Float32bits(distances[i]))
+	}
+	c.Data(200, "application/octet-stream", out)
+}
+
 // assumes RLock is holded
 func (ctl *Controller) getVectoDBLite(c *gin.Context, dbID int) (dbl *vectodb.VectoDBLite, err error) {
+	var dstNodeAddr string
+	if dbl, dstNodeAddr, err = ctl.resolveVectoDBLite(c.Request.Context(), dbID); err != nil || dbl != nil {
+		return
+	}
+	dstURL := *c.Request.URL
+	dstURL.Host = dstNodeAddr
+	c.Redirect(http.StatusPermanentRedirect, dstURL.String())
+	return
+}
+
+// resolveVectoDBLite returns either a resident (possibly freshly loaded)
+// database, or the address of the node the request belongs on. Assumes
+// RLock is holded.
+func (ctl *Controller) resolveVectoDBLite(ctx context.Context, dbID int) (dbl *vectodb.VectoDBLite, dstNodeAddr string, err error) {
 	var ok bool
 	if dbl, ok = ctl.dbls[dbID]; ok {
+		ctl.touchAccess(dbID)
 		return
 	}
-	var dstNodeAddr string
 	if ctl.isLeader {
-		ctx := c.Request.Context()
 		if dstNodeAddr, err = ctl.acquire(ctx, dbID, ctl.conf.ListenAddr); err != nil {
 			return
 		}
@@ -221,28 +779,48 @@ func (ctl *Controller) getVectoDBLite(c *gin.Context, dbID int) (dbl *vectodb.Ve
 			err = errors.Errorf("Need to send acquire request to the leader. However the leader is unknown.")
 			return
 		}
-		servURL := fmt.Sprintf("http://%s/mgmt/v1/acquire", curLeader)
 		reqAcquire := ReqAcquire{
 			DbID:     dbID,
 			NodeAddr: ctl.conf.ListenAddr,
 		}
 		rspAcquire := &RspAcquire{}
-		if err = PostJson(ctl.hc, servURL, reqAcquire, rspAcquire); err != nil {
+		if err = ctl.callPeer(curLeader, "Acquire", "/mgmt/v1/acquire", &reqAcquire, rspAcquire); err != nil {
 			return
 		}
 		dstNodeAddr = rspAcquire.NodeAddr
 	}
 
 	if ctl.conf.ListenAddr != dstNodeAddr {
-		dstURL := *c.Request.URL
-		dstURL.Host = dstNodeAddr
-		c.Redirect(http.StatusPermanentRedirect, dstURL.String())
 		return
 	}
+	dstNodeAddr = ""
+	// adopt a prewarmed instance when the leader announced this placement a
+	// cycle ahead, skipping the cold load entirely
+	ctl.rwlock.RUnlock()
+	ctl.rwlock.Lock()
+	if dblW, ok := ctl.prewarmed[dbID]; ok {
+		delete(ctl.prewarmed, dbID)
+		if dblE, ok2 := ctl.dbls[dbID]; ok2 {
+			go dblW.Destroy()
+			dbl = dblE
+		} else {
+			ctl.dbls[dbID] = dblW
+			delete(ctl.replicaOf, dbID)
+			dbl = dblW
+		}
+		ctl.rwlock.Unlock()
+		ctl.rwlock.RLock()
+		ctl.touchAccess(dbID)
+		return
+	}
+	ctl.rwlock.Unlock()
+	ctl.rwlock.RLock()
 	var dblNew *vectodb.VectoDBLite
+	t0 := time.Now()
 	if dblNew, err = vectodb.NewVectoDBLite(ctl.conf.RedisAddr, dbID, ctl.conf.Dim, float32(ctl.conf.DisThr), ctl.conf.SizeLimit); err != nil {
 		return
 	}
+	mLoadDur.With("").Observe(time.Since(t0))
 	ctl.rwlock.RUnlock()
 	ctl.rwlock.Lock()
 	defer func() {
@@ -250,9 +828,81 @@ func (ctl *Controller) getVectoDBLite(c *gin.Context, dbID int) (dbl *vectodb.Ve
 		ctl.rwlock.RLock()
 	}()
 	if dbl, ok = ctl.dbls[dbID]; ok {
+		ctl.touchAccess(dbID)
 		return
 	}
 	ctl.dbls[dbID] = dblNew
+	// this node owns the database now; forget any stale replica marker
+	delete(ctl.replicaOf, dbID)
 	dbl = dblNew
+	ctl.touchAccess(dbID)
 	return
 }
+
+func (ctl *Controller) touchAccess(dbID int) {
+	ctl.mtxAccess.Lock()
+	ctl.lastAccess[dbID] = time.Now().UnixNano()
+	ctl.accessCount[dbID]++
+	ctl.mtxAccess.Unlock()
+}
+
+// memBytesPerVec estimates the resident cost of one vector: flat index
+// storage plus the VecTimestamp copy held by the LRU, plus key and map
+// overhead.
+func (ctl *Controller) memBytesPerVec() int64 {
+	return int64(8*ctl.conf.Dim + 64)
+}
+
+// servEvict keeps the resident set within the node memory budget, evicting
+// the least recently accessed databases back to redis-only state. An evicted
+// database keeps its etcd ownership, so the next request for it routes here
+// and reloads it from redis.
+func (ctl *Controller) servEvict(ctx context.Context) {
+	ticker := time.NewTicker(30 * time.Second)
+	defer ticker.Stop()
+	for {
+		select {
+		case <-ctx.Done():
+			log.Infof("servEvict goroutine exited")
+			return
+		case <-ticker.C:
+			ctl.enforceMemBudget()
+		}
+	}
+}
+
+func (ctl *Controller) enforceMemBudget() {
+	budget := int64(ctl.conf.MemBudget) * (1 << 20)
+	for {
+		ctl.rwlock.Lock()
+		var total int64
+		for _, dbl := range ctl.dbls {
+			total += int64(dbl.Size()) * ctl.memBytesPerVec()
+		}
+		if total <= budget || len(ctl.dbls) <= 1 {
+			ctl.rwlock.Unlock()
+			return
+		}
+		coldID, coldAt := 0, int64(math.MaxInt64)
+		ctl.mtxAccess.Lock()
+		for dbID := range ctl.dbls {
+			if at := ctl.lastAccess[dbID]; at < coldAt {
+				coldID, coldAt = dbID, at
+			}
+		}
+		delete(ctl.lastAccess, coldID)
+		delete(ctl.accessCount, coldID)
+		ctl.mtxAccess.Unlock()
+		dbl := ctl.dbls[coldID]
+		delete(ctl.dbls, coldID)
+		delete(ctl.replicas, coldID)
+		delete(ctl.replicaOf, coldID)
+		ctl.rwlock.Unlock()
+		atomic.AddInt64(&ctl.numEvicted, 1)
+		mEvictions.Inc("")
+		log.Infof("evicted cold vectodblite %d to fit memory budget", coldID)
+		if err := dbl.Destroy(); err != nil {
+			log.Errorf("got error %+v", err)
+		}
+	}
+}
@@ -39,8 +39,10 @@ func parseResp(resp *clientv3.GetResponse) (k string, v string) {
 	return
 }
 
-func observe(ctx context.Context, c *clientv3.Client, pfx string, cb LeaderChangedHandler) {
-	s, err := concurrency.NewSession(c)
+func observe(ctx context.Context, c *clientv3.Client, pfx string, leaseID clientv3.LeaseID, cb LeaderChangedHandler) {
+	//ride the node's single lease instead of granting another; clientv3
+	//coalesces keepalives per lease, so this adds no etcd traffic
+	s, err := concurrency.NewSession(c, concurrency.WithLease(leaseID))
 	if err != nil {
 		err = errors.Wrap(err, "")
 		log.Fatalf("got error %+v", err)
@@ -66,13 +68,16 @@ func observe(ctx context.Context, c *clientv3.Client, pfx string, cb LeaderChang
 	return
 }
 
-func campaign(ctx context.Context, c *clientv3.Client, pfx string, prop string) {
+func campaign(ctx context.Context, c *clientv3.Client, pfx string, prop string, leaseID clientv3.LeaseID) {
 	/**
 	According to https://github.com/coreos/etcd/blob/master/etcdctl/README.md,
 	The lease length of a leader defaults to 60 seconds. If a candidate is abnormally terminated, election progress may be delayed by up to 60 seconds.
 	However I haven't notice that long delay.
+	The session shares the node's lease (instead of a dedicated 10s one), so
+	each node renews exactly one lease; leader failover detection moves to
+	that lease's TTL, which is also when a dead node's keys disappear.
 	*/
-	s, err := concurrency.NewSession(c, concurrency.WithTTL(10))
+	s, err := concurrency.NewSession(c, concurrency.WithLease(leaseID))
 	if err != nil {
 		err = errors.Wrap(err, "")
 		log.Fatalf("got error %+v", err)
@@ -122,9 +127,9 @@ func NewEtcdClient(etcdAddr string) (*clientv3.Client, error) {
 
 //https://blog.golang.org/context, Go Concurrency Patterns: Context
 //https://golang.org/pkg/context/
-func StartElection(ctx context.Context, client *clientv3.Client, path string, proposal string, cb LeaderChangedHandler) {
+func StartElection(ctx context.Context, client *clientv3.Client, path string, proposal string, leaseID clientv3.LeaseID, cb LeaderChangedHandler) {
 	//Note: puting election and jobs at the same path level doesn't work!
 	pfx := fmt.Sprintf("%s/election", path)
-	go observe(ctx, client, pfx, cb)
-	go campaign(ctx, client, pfx, proposal)
+	go observe(ctx, client, pfx, leaseID, cb)
+	go campaign(ctx, client, pfx, proposal, leaseID)
 }
@@ -4,11 +4,35 @@ import (
 	"bytes"
 	"encoding/json"
 	"io/ioutil"
+	"net"
 	"net/http"
+	"time"
 
 	"github.com/pkg/errors"
 )
 
+// NewForwardClient returns an http.Client tuned for the inter-node forwarding
+// path: a large per-peer pool of persistent connections so every hop reuses a
+// warm connection instead of paying setup, and HTTP/2 when the peer supports
+// it so concurrent forwards to the same peer multiplex over one wire exchange.
+// The stock DefaultTransport keeps only 2 idle connections per host, which
+// serializes concurrent forwards to the dbID owner.
+func NewForwardClient(timeout time.Duration) *http.Client {
+	return &http.Client{
+		Timeout: timeout,
+		Transport: &http.Transport{
+			DialContext: (&net.Dialer{
+				Timeout:   5 * time.Second,
+				KeepAlive: 30 * time.Second,
+			}).DialContext,
+			ForceAttemptHTTP2:   true,
+			MaxIdleConns:        256,
+			MaxIdleConnsPerHost: 64,
+			IdleConnTimeout:     90 * time.Second,
+		},
+	}
+}
+
 func PostJson(hc *http.Client, servURL string, reqObj, rspObj interface{}) (err error) {
 	var reqBody, rspBody []byte
 	if reqBody, err = json.Marshal(reqObj); err != nil {
@@ -45,6 +45,7 @@ func parseConfig() (conf *ControllerConf) {
 	flag.Float64Var(&conf.DisThr, "distance-threshold", conf.DisThr, "VectoDBLite distance threshold")
 	flag.IntVar(&conf.SizeLimit, "size-limit", conf.SizeLimit, "VectoDBLite size limit")
 	flag.IntVar(&conf.BalanceInterval, "balance-interval", conf.BalanceInterval, "Time interval (in seconds) to balance the cluster load")
+	flag.IntVar(&conf.MemBudget, "mem-budget", conf.MemBudget, "Memory budget (MB) for resident vectodblite databases. Least recently accessed databases beyond it are evicted to redis-only state.")
 
 	flag.StringVar(&conf.EurekaAddr, "eureka-addr", conf.EurekaAddr, "eureka server address list, seperated by comma.")
 	flag.StringVar(&conf.EurekaApp, "eureka-app", conf.EurekaApp, "VectoDBLite cluster service name which will be registered with eureka.")
@@ -78,10 +79,21 @@ func main() {
 	ctl := NewController(conf, ctx)
 	r := gin.Default()
 	r.POST("/api/v1/add", ctl.HandleAdd)
+	r.POST("/api/v1/add_batch", ctl.HandleAddBatch)
+	r.POST("/api/v1/add_multi", ctl.HandleAddMulti)
 	r.POST("/api/v1/search", ctl.HandleSearch)
+	r.POST("/api/v1/search_batch", ctl.HandleSearchBatch)
+	r.POST("/api/v1/search_multi", ctl.HandleSearchMulti)
 	r.POST("/mgmt/v1/acquire", ctl.HandleAcquire)
 	r.POST("/mgmt/v1/release", ctl.HandleRelease)
+	r.POST("/mgmt/v1/handoff", ctl.HandleHandoff)
+	r.POST("/mgmt/v1/import", ctl.HandleImport)
+	r.POST("/mgmt/v1/replicate", ctl.HandleReplicate)
+	r.POST("/mgmt/v1/replica_add", ctl.HandleReplicaAdd)
+	r.POST("/mgmt/v1/prewarm", ctl.HandlePrewarm)
+	r.GET("/routing", ctl.HandleRouting)
 	r.GET("/status", ctl.HandleStatus)
+	r.GET("/metrics", ctl.HandleMetrics)
 	r.GET("/health", ctl.HandleHealth)
 	r.GET("/swagger/*any", ginSwagger.WrapHandler(swaggerFiles.Handler))
 	r.Run(conf.ListenAddr)
@@ -0,0 +1,203 @@
+package main
+
+// Prometheus-format metrics for the cluster node. The client_golang library
+// is not vendored, but the text exposition format is trivial to emit, so the
+// counters and histograms here are hand-rolled atomics and /metrics renders
+// them directly. Buckets follow the prometheus convention: cumulative counts
+// per upper bound, plus _sum and _count.
+
+import (
+	"fmt"
+	"sort"
+	"strings"
+	"sync"
+	"sync/atomic"
+	"time"
+
+	"github.com/gin-gonic/gin"
+)
+
+var metricBuckets = []float64{0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10}
+
+type histogram struct {
+	counts    []uint64 // one slot per bucket bound, non-cumulative
+	overflow  uint64   // observations above the last bound
+	count     uint64
+	sumMicros uint64
+}
+
+func newHistogram() *histogram {
+	return &histogram{counts: make([]uint64, len(metricBuckets))}
+}
+
+func (h *histogram) Observe(d time.Duration) {
+	secs := d.Seconds()
+	slot := sort.SearchFloat64s(metricBuckets, secs)
+	if slot < len(metricBuckets) {
+		atomic.AddUint64(&h.counts[slot], 1)
+	} else {
+		atomic.AddUint64(&h.overflow, 1)
+	}
+	atomic.AddUint64(&h.count, 1)
+	atomic.AddUint64(&h.sumMicros, uint64(d.Microseconds()))
+}
+
+// histVec is a histogram family sharing one metric name, one child per
+// label set. Children are created on first use and never removed.
+type histVec struct {
+	name string
+	help string
+	mtx  sync.Mutex
+	kids map[string]*histogram // preformatted labels -> child
+}
+
+func newHistVec(name, help string) *histVec {
+	hv := &histVec{name: name, help: help, kids: make(map[string]*histogram)}
+	metricHists = append(metricHists, hv)
+	return hv
+}
+
+// labels is preformatted prometheus label syntax, e.g. `op="add",route="local"`.
+func (hv *histVec) With(labels string) *histogram {
+	hv.mtx.Lock()
+	h, ok := hv.kids[labels]
+	if !ok {
+		h = newHistogram()
+		hv.kids[labels] = h
+	}
+	hv.mtx.Unlock()
+	return h
+}
+
+type counterVec struct {
+	name string
+	help string
+	mtx  sync.Mutex
+	kids map[string]*uint64
+}
+
+func newCounterVec(name, help string) *counterVec {
+	cv := &counterVec{name: name, help: help, kids: make(map[string]*uint64)}
+	metricCounters = append(metricCounters, cv)
+	return cv
+}
+
+func (cv *counterVec) Inc(labels string) {
+	cv.mtx.Lock()
+	c, ok := cv.kids[labels]
+	if !ok {
+		c = new(uint64)
+		cv.kids[labels] = c
+	}
+	cv.mtx.Unlock()
+	atomic.AddUint64(c, 1)
+}
+
+var (
+	metricHists    []*histVec
+	metricCounters []*counterVec
+
+	// total handler invocations, read by servLoadReport to derive node QPS
+	metricReqTotal uint64
+
+	// request handlers, split by whether the database is resident here
+	// (route="local") or the request ended in a redirect to the owner
+	mReqDur = newHistVec("vdblc_request_duration_seconds",
+		"Request handler latency by operation and route.")
+	// the faiss call proper, excluding JSON marshalling and routing
+	mSearchDur = newHistVec("vdblc_search_core_seconds",
+		"VectoDBLite search latency, excluding HTTP and routing overhead.")
+	// redis-backed database loads triggered by a request for a non-resident db
+	mLoadDur = newHistVec("vdblc_db_load_seconds",
+		"Time to load a vectodblite database from redis into memory.")
+	mAcquireDur = newHistVec("vdblc_acquire_seconds",
+		"Leader-side db ownership acquisition latency.")
+	mReleaseDur = newHistVec("vdblc_release_seconds",
+		"Db ownership release latency.")
+	mBalanceDur = newHistVec("vdblc_balance_seconds",
+		"Duration of one leader rebalance pass.")
+
+	mRedirects = newCounterVec("vdblc_redirects_total",
+		"Requests redirected to the owning node, by operation.")
+	mErrors = newCounterVec("vdblc_errors_total",
+		"Failed operations, by operation.")
+	mEvictions = newCounterVec("vdblc_evictions_total",
+		"Databases evicted to redis-only state by the memory budget.")
+)
+
+func labelsFor(op, route string) string {
+	return `op="` + op + `",route="` + route + `"`
+}
+
+func exposeLabels(labels string) string {
+	if labels == "" {
+		return ""
+	}
+	return "{" + labels + "}"
+}
+
+// HandleMetrics renders every registered metric in the prometheus text
+// exposition format.
+// @Description Prometheus metrics of this node
+// @Produce  plain
+// @Success 200
+// @Router /metrics [get]
+func (ctl *Controller) HandleMetrics(c *gin.Context) {
+	var b strings.Builder
+	for _, cv := range metricCounters {
+		fmt.Fprintf(&b, "# HELP %s %s\n# TYPE %s counter\n", cv.name, cv.help, cv.name)
+		cv.mtx.Lock()
+		keys := make([]string, 0, len(cv.kids))
+		for k := range cv.kids {
+			keys = append(keys, k)
+		}
+		sort.Strings(keys)
+		for _, k := range keys {
+			fmt.Fprintf(&b, "%s%s %d\n", cv.name, exposeLabels(k), atomic.LoadUint64(cv.kids[k]))
+		}
+		cv.mtx.Unlock()
+	}
+	for _, hv := range metricHists {
+		fmt.Fprintf(&b, "# HELP %s %s\n# TYPE %s histogram\n", hv.name, hv.help, hv.name)
+		hv.mtx.Lock()
+		keys := make([]string, 0, len(hv.kids))
+		for k := range hv.kids {
+			keys = append(keys, k)
+		}
+		sort.Strings(keys)
+		for _, k := range keys {
+			h := hv.kids[k]
+			sep := ","
+			if k == "" {
+				sep = ""
+			}
+			var cum uint64
+			for i, bound := range metricBuckets {
+				cum += atomic.LoadUint64(&h.counts[i])
+				fmt.Fprintf(&b, "%s_bucket{%s%sle=\"%g\"} %d\n", hv.name, k, sep, bound, cum)
+			}
+			cum += atomic.LoadUint64(&h.overflow)
+			fmt.Fprintf(&b, "%s_bucket{%s%sle=\"+Inf\"} %d\n", hv.name, k, sep, cum)
+			fmt.Fprintf(&b, "%s_sum%s %g\n", hv.name, exposeLabels(k), float64(atomic.LoadUint64(&h.sumMicros))/1e6)
+			fmt.Fprintf(&b, "%s_count%s %d\n", hv.name, exposeLabels(k), atomic.LoadUint64(&h.count))
+		}
+		hv.mtx.Unlock()
+	}
+	c.Data(200, "text/plain; version=0.0.4", []byte(b.String()))
+}
+
+// observeRequest times one request handler invocation. route and errp are
+// read at defer time, after the handler decided how the request ended.
+func observeRequest(op string, route *string, errp *error) func() {
+	t0 := time.Now()
+	atomic.AddUint64(&metricReqTotal, 1)
+	return func() {
+		switch {
+		case *errp != nil:
+			mErrors.Inc(`op="` + op + `"`)
+		case *route == "redirect":
+			mRedirects.Inc(`op="` + op + `"`)
+		}
+		mReqDur.With(labelsFor(op, *route)).Observe(time.Since(t0))
+	}
+}
@@ -1,17 +1,20 @@
 package main
 
 import (
+	"encoding/json"
 	"fmt"
-	"math/rand"
 	"net/http"
 	"path/filepath"
+	"sort"
 	"strconv"
 	"strings"
+	"sync/atomic"
 	"time"
 
 	"github.com/coreos/etcd/clientv3"
 	"github.com/gin-gonic/gin"
 	"github.com/hudl/fargo"
+	"github.com/infinivision/vectodb"
 	"github.com/pkg/errors"
 	log "github.com/sirupsen/logrus"
 	"golang.org/x/net/context"
@@ -21,8 +24,40 @@ const (
 	MaxLoadDelta = 2
 	// https://github.com/Netflix/eureka/wiki/Understanding-eureka-client-server-communication
 	EurekaHeartbeatInterval = 30
+	// seconds between pushes of this node's NodeLoad into its etcd lease key
+	LoadReportInterval = 20
+	// migrations per balance round; the rest wait for the next round
+	MaxMigrationsPerRound = 8
+	// per-db QPS above which the leader assigns read replicas
+	HotDbQPS = 200
+	// read replicas per hot database, capped by the cluster size
+	NumReadReplicas = 2
+	// ops per etcd txn, under the server's default 128-op limit
+	EtcdMaxTxnOps = 120
 )
 
+// NodeLoad is the load summary each node pushes into its lease-bound
+// "<EurekaApp>/node/<addr>" key. The leader already watches that prefix for
+// liveness, so load updates ride the existing watch and the leader never has
+// to poll nodes individually; the summary also gives the balancer a view of
+// QPS and memory pressure that the ownership map alone cannot provide.
+type NodeLoad struct {
+	DbIDs           []int   `json:"dbIDs"`
+	ResidentVectors int     `json:"residentVectors"`
+	MemBytes        int64   `json:"memBytes"`
+	QPS             float64 `json:"qps"`
+	HotDbIDs        []int   `json:"hotDbIDs,omitempty"` //dbs above HotDbQPS, candidates for read replicas
+}
+
+// parseNodeLoad tolerates node keys written by older binaries ("alive"),
+// treating them as an empty summary.
+func parseNodeLoad(val []byte) (nl NodeLoad) {
+	if err := json.Unmarshal(val, &nl); err != nil {
+		nl = NodeLoad{}
+	}
+	return
+}
+
 func (ctl *Controller) initMgmt() (err error) {
 	if ctl.etcdCli, err = NewEtcdClient(ctl.conf.EtcdAddr); err != nil {
 		err = errors.Wrap(err, "")
@@ -30,11 +65,146 @@ func (ctl *Controller) initMgmt() (err error) {
 	if err = ctl.nodeKeepalive(); err != nil {
 		return
 	}
-	StartElection(ctl.ctx, ctl.etcdCli, ctl.conf.EurekaApp, ctl.conf.ListenAddr, ctl.leaderChangedCb)
+	StartElection(ctl.ctx, ctl.etcdCli, ctl.conf.EurekaApp, ctl.conf.ListenAddr, ctl.leaseID, ctl.leaderChangedCb)
 	go ctl.servRegister()
+	go ctl.servLoadReport(ctl.ctx)
+	return
+}
+
+// loadSummary snapshots this node's resident databases. QPS is filled in by
+// the caller since it needs a time window.
+func (ctl *Controller) loadSummary() (nl NodeLoad) {
+	nl.DbIDs = make([]int, 0)
+	ctl.rwlock.RLock()
+	for dbID, dbl := range ctl.dbls {
+		nl.DbIDs = append(nl.DbIDs, dbID)
+		nl.ResidentVectors += dbl.Size()
+	}
+	ctl.rwlock.RUnlock()
+	sort.Ints(nl.DbIDs)
+	nl.MemBytes = int64(nl.ResidentVectors) * ctl.memBytesPerVec()
 	return
 }
 
+// servLoadReport refreshes the node key with the current load summary. The
+// key stays bound to the keepalive lease, so a crashed node still disappears
+// from the prefix. The refresh commits through reportAndAssert, so the
+// node's whole periodic etcd state costs one batched txn per tick.
+func (ctl *Controller) servLoadReport(ctx context.Context) {
+	k := fmt.Sprintf("%s/node/%s", ctl.conf.EurekaApp, ctl.conf.ListenAddr)
+	ticker := time.NewTicker(LoadReportInterval * time.Second)
+	defer ticker.Stop()
+	prevReqs := atomic.LoadUint64(&metricReqTotal)
+	prevAt := time.Now()
+	for {
+		select {
+		case <-ctx.Done():
+			log.Infof("servLoadReport goroutine exited")
+			return
+		case <-ticker.C:
+			nl := ctl.loadSummary()
+			reqs := atomic.LoadUint64(&metricReqTotal)
+			now := time.Now()
+			window := now.Sub(prevAt).Seconds()
+			nl.QPS = float64(reqs-prevReqs) / window
+			prevReqs, prevAt = reqs, now
+			// per-db counts since the previous report mark the hot databases
+			ctl.mtxAccess.Lock()
+			for dbID, cnt := range ctl.accessCount {
+				if float64(cnt)/window >= HotDbQPS {
+					nl.HotDbIDs = append(nl.HotDbIDs, dbID)
+				}
+				delete(ctl.accessCount, dbID)
+			}
+			ctl.mtxAccess.Unlock()
+			sort.Ints(nl.HotDbIDs)
+			val, err := json.Marshal(nl)
+			if err != nil {
+				err = errors.Wrap(err, "")
+				log.Errorf("got error %+v", err)
+				continue
+			}
+			if err = ctl.reportAndAssert(ctx, k, string(val)); err != nil {
+				log.Errorf("got error %+v", err)
+			}
+		}
+	}
+}
+
+// reportAndAssert commits this node's periodic etcd state in one batched txn
+// per EtcdMaxTxnOps chunk of owned databases: the lease-bound load summary
+// rides together with comparisons asserting this node's ownership keys. In
+// the steady state a tick is a single conditional write; only when a key
+// drifted does the Else branch read the chunk back, and the rare missing
+// keys (an etcd restore, a manual cleanup) are re-created with
+// create-guarded puts. A key now owned by someone else is left alone — the
+// balancer moved that database and requests for it redirect.
+func (ctl *Controller) reportAndAssert(ctx context.Context, nodeKey, nodeVal string) (err error) {
+	owned := make([]int, 0)
+	ctl.rwlock.RLock()
+	for dbID := range ctl.dbls {
+		if _, ok := ctl.replicaOf[dbID]; ok {
+			continue //resident as a read replica, the owner asserts it
+		}
+		owned = append(owned, dbID)
+	}
+	ctl.rwlock.RUnlock()
+	sort.Ints(owned)
+	putNode := clientv3.OpPut(nodeKey, nodeVal, clientv3.WithLease(ctl.leaseID))
+	missing := make([]int, 0)
+	for start := 0; ; start += EtcdMaxTxnOps {
+		end := start + EtcdMaxTxnOps
+		if end > len(owned) {
+			end = len(owned)
+		}
+		chunk := owned[start:end]
+		cmps := make([]clientv3.Cmp, 0, len(chunk))
+		elses := make([]clientv3.Op, 0, len(chunk)+1)
+		for _, dbID := range chunk {
+			key := fmt.Sprintf("%s/vectodblite/%d", ctl.conf.EurekaApp, dbID)
+			//a value compare on an absent key fails, routing to Else
+			cmps = append(cmps, clientv3.Compare(clientv3.Value(key), "=", ctl.conf.ListenAddr))
+			elses = append(elses, clientv3.OpGet(key))
+		}
+		thens := make([]clientv3.Op, 0, 1)
+		if start == 0 {
+			//the load summary is written on either branch
+			thens = append(thens, putNode)
+			elses = append(elses, putNode)
+		}
+		var resp *clientv3.TxnResponse
+		if resp, err = ctl.etcdCli.Txn(ctx).If(cmps...).Then(thens...).Else(elses...).Commit(); err != nil {
+			err = errors.Wrap(err, "")
+			return
+		}
+		if !resp.Succeeded {
+			for i, dbID := range chunk {
+				if rr := resp.Responses[i].GetResponseRange(); rr != nil && len(rr.Kvs) == 0 {
+					missing = append(missing, dbID)
+				}
+			}
+		}
+		if end >= len(owned) {
+			break
+		}
+	}
+	for _, dbID := range missing {
+		key := fmt.Sprintf("%s/vectodblite/%d", ctl.conf.EurekaApp, dbID)
+		txn := ctl.etcdCli.Txn(ctx).If(clientv3.Compare(clientv3.CreateRevision(key), "=", 0))
+		txn = txn.Then(clientv3.OpPut(key, ctl.conf.ListenAddr))
+		if _, err = txn.Commit(); err != nil {
+			err = errors.Wrap(err, "")
+			return
+		}
+		log.Warnf("re-created lost ownership key of vectodblite %d", dbID)
+	}
+	return
+}
+
+// nodeKeepalive grants this node's single etcd lease and starts its
+// keepalive. The node key, the election campaign and the election observer
+// all share it (clientv3 coalesces keepalives per lease), so each node
+// renews exactly one lease however many features hang off it.
 func (ctl *Controller) nodeKeepalive() (err error) {
 	resp, err := ctl.etcdCli.Grant(ctl.ctx, int64(60))
 	if err != nil {
@@ -47,12 +217,16 @@ func (ctl *Controller) nodeKeepalive() (err error) {
 		err = errors.Wrap(err, "")
 		return
 	}
-	leaseID := resp.ID
+	ctl.leaseID = resp.ID
 
 	k := fmt.Sprintf("%s/node/%s", ctl.conf.EurekaApp, ctl.conf.ListenAddr)
-	val := "alive"
+	var val []byte
+	if val, err = json.Marshal(ctl.loadSummary()); err != nil {
+		err = errors.Wrap(err, "")
+		return
+	}
 	txn := ctl.etcdCli.Txn(ctl.ctx).If(clientv3.Compare(clientv3.CreateRevision(k), "=", 0))
-	txn = txn.Then(clientv3.OpPut(k, val, clientv3.WithLease(leaseID)))
+	txn = txn.Then(clientv3.OpPut(k, string(val), clientv3.WithLease(ctl.leaseID)))
 	if _, err = txn.Commit(); err != nil {
 		err = errors.Wrap(err, "")
 		return err
@@ -76,7 +250,7 @@ func (ctl *Controller) leaderChangedCb(prevLeader, curLeader string) {
 
 func (ctl *Controller) servLeaderWork(ctx context.Context) {
 	var err error
-	aliveNodes := make(map[string]int, 0)
+	aliveNodes := make(map[string]NodeLoad, 0)
 	pfx := fmt.Sprintf("%s/node", ctl.conf.EurekaApp)
 	var resp *clientv3.GetResponse
 	if resp, err = clientv3.NewKV(ctl.etcdCli).Get(ctx, pfx, clientv3.WithPrefix()); err != nil {
@@ -85,7 +259,7 @@ func (ctl *Controller) servLeaderWork(ctx context.Context) {
 	}
 	for _, item := range resp.Kvs {
 		nodeAddr := filepath.Base(string(item.Key))
-		aliveNodes[nodeAddr] = 0
+		aliveNodes[nodeAddr] = parseNodeLoad(item.Value)
 	}
 	revision := resp.Header.Revision
 
@@ -119,7 +293,9 @@ func (ctl *Controller) servLeaderWork(ctx context.Context) {
 				if e.Type == clientv3.EventTypeDelete {
 					delete(aliveNodes, nodeAddr)
 				} else if e.IsCreate() || e.IsModify() {
-					aliveNodes[nodeAddr] = 0
+					// nodes push their NodeLoad into the watched key, so
+					// every report lands here without the leader polling
+					aliveNodes[nodeAddr] = parseNodeLoad(e.Kv.Value)
 				}
 			}
 			if err = ctl.purgeDeadNodes(load, aliveNodes); err != nil {
@@ -129,9 +305,10 @@ func (ctl *Controller) servLeaderWork(ctx context.Context) {
 			if load, err = ctl.getLoad(); err != nil {
 				log.Errorf("got error %+x", err)
 			}
-			if err = ctl.balance(load); err != nil {
+			if err = ctl.balance(load, aliveNodes); err != nil {
 				log.Errorf("got error %+v", err)
 			}
+			ctl.manageReplicas(load, aliveNodes)
 			balanceTick = time.After(balanceInterval)
 		}
 	}
@@ -165,15 +342,37 @@ func (ctl *Controller) getLoad() (load map[string][]int, err error) {
 	return
 }
 
-func (ctl *Controller) purgeDeadNodes(load map[string][]int, aliveNodes map[string]int) (err error) {
+func (ctl *Controller) purgeDeadNodes(load map[string][]int, aliveNodes map[string]NodeLoad) (err error) {
+	// failover pre-warm: re-place each orphaned database on its ring-chosen
+	// survivor right away and start the load there, instead of leaving the
+	// cold load to whichever request arrives first
+	nodeAddrs := make([]string, 0, len(aliveNodes))
+	for addr := range aliveNodes {
+		nodeAddrs = append(nodeAddrs, addr)
+	}
+	sort.Strings(nodeAddrs)
+	var ring *hashRing
+	if len(nodeAddrs) != 0 {
+		ring = newHashRing(nodeAddrs)
+	}
 	for nodeAddr, dbList := range load {
 		if _, ok := aliveNodes[nodeAddr]; !ok {
 			for _, dbID := range dbList {
 				key := fmt.Sprintf("%s/vectodblite/%d", ctl.conf.EurekaApp, dbID)
-				if _, err = clientv3.NewKV(ctl.etcdCli).Delete(ctl.ctxL, key); err != nil {
+				if ring == nil {
+					if _, err = clientv3.NewKV(ctl.etcdCli).Delete(ctl.ctxL, key); err != nil {
+						err = errors.Wrap(err, "")
+						return
+					}
+					continue
+				}
+				dstAddr := ring.owner(dbID, map[string]int{}, 1)
+				if _, err = clientv3.NewKV(ctl.etcdCli).Put(ctl.ctxL, key, dstAddr); err != nil {
 					err = errors.Wrap(err, "")
 					return
 				}
+				go ctl.sendPrewarm(dbID, dstAddr)
+				log.Infof("re-placed orphaned vectodblite %d on %s", dbID, dstAddr)
 			}
 			delete(load, nodeAddr)
 			log.Infof("purged dead node %v", nodeAddr)
@@ -182,59 +381,240 @@ func (ctl *Controller) purgeDeadNodes(load map[string][]int, aliveNodes map[stri
 	return
 }
 
-func (ctl *Controller) balance(load map[string][]int) (err error) {
+func (ctl *Controller) balance(load map[string][]int, aliveNodes map[string]NodeLoad) (err error) {
+	defer func(t0 time.Time) {
+		mBalanceDur.With("").Observe(time.Since(t0))
+	}(time.Now())
 	if len(load) < 2 {
 		log.Infof("skipped balancing since number of nodes %d is less than 2", len(load))
 		return
 	}
+	// the ring contains alive nodes only; databases still owned by a dead
+	// node are purgeDeadNodes' business, not the balancer's
+	nodeAddrs := make([]string, 0, len(aliveNodes))
+	for addr := range aliveNodes {
+		nodeAddrs = append(nodeAddrs, addr)
+	}
+	sort.Strings(nodeAddrs)
+	if len(nodeAddrs) < 2 {
+		return
+	}
+	ring := newHashRing(nodeAddrs)
+
 	var totalDbLen int
-	for _, dbList := range load {
+	dbIDs := make([]int, 0)
+	owner := make(map[int]string)
+	for nodeAddr, dbList := range load {
 		totalDbLen += len(dbList)
+		for _, dbID := range dbList {
+			dbIDs = append(dbIDs, dbID)
+			owner[dbID] = nodeAddr
+		}
+	}
+	// bounded load: no node takes more than its fair share plus slack
+	capacity := (totalDbLen+len(nodeAddrs)-1)/len(nodeAddrs) + MaxLoadDelta
+	// sorted iteration makes the bounded-load placement deterministic, so
+	// a database that stays put this round stays put next round too
+	sort.Ints(dbIDs)
+	counts := make(map[string]int, len(nodeAddrs))
+	desired := make(map[int]string)
+	for _, dbID := range dbIDs {
+		dstAddr := ring.owner(dbID, counts, capacity)
+		counts[dstAddr]++
+		srcAddr := owner[dbID]
+		if dstAddr == "" || dstAddr == srcAddr {
+			continue
+		}
+		if _, ok := aliveNodes[srcAddr]; !ok {
+			continue
+		}
+		desired[dbID] = dstAddr
 	}
-	avgDbLen := totalDbLen / len(load)
+	// withdraw announcements whose move is no longer planned, before any new
+	// announcements or cutovers
+	for dbID, dstAddr := range ctl.prewarmPlan {
+		if desired[dbID] != dstAddr {
+			ctl.sendPrewarmCancel(dbID, dstAddr)
+			delete(ctl.prewarmPlan, dbID)
+		}
+	}
+	moved := 0
+	for _, dbID := range dbIDs {
+		dstAddr, ok := desired[dbID]
+		if !ok {
+			continue
+		}
+		if moved >= MaxMigrationsPerRound {
+			// every migration is a warm handoff at best and a redis reload at
+			// worst; deferring the rest to the next round keeps the churn off
+			// the serving path
+			log.Infof("migration cap %d reached, deferring the remaining moves to the next balance round", MaxMigrationsPerRound)
+			break
+		}
+		// announce one cycle ahead; the cutover waits until the destination
+		// has the database loaded, so redirected traffic never lands cold
+		if !ctl.sendPrewarm(dbID, dstAddr) {
+			ctl.prewarmPlan[dbID] = dstAddr
+			moved++
+			continue
+		}
+		delete(ctl.prewarmPlan, dbID)
+		if err = ctl.migrate(dbID, owner[dbID], dstAddr); err != nil {
+			return
+		}
+		moved++
+	}
+
+	log.Debugf("balancing done, migrated %d of %d databases", moved, totalDbLen)
+	return
+}
 
+// migrate moves one database between nodes. Prefer a warm handoff; fall back
+// to release + lazy re-acquire (cold redis load) if the handoff fails.
+func (ctl *Controller) migrate(dbID int, srcAddr, dstAddr string) (err error) {
+	var errH error
+	if srcAddr == ctl.conf.ListenAddr {
+		errH = ctl.handoff(dbID, dstAddr)
+	} else {
+		reqHandoff := ReqHandoff{
+			DbID:        dbID,
+			DstNodeAddr: dstAddr,
+		}
+		rspHandoff := &RspHandoff{}
+		if errH = ctl.callPeer(srcAddr, "Handoff", "/mgmt/v1/handoff", &reqHandoff, rspHandoff); errH == nil && rspHandoff.Err != "" {
+			errH = errors.New(rspHandoff.Err)
+		}
+	}
+	if errH == nil {
+		return
+	}
+	log.Warnf("warm handoff of vectodblite %d from %s to %s failed, falling back to release: %+v", dbID, srcAddr, dstAddr, errH)
+	if srcAddr == ctl.conf.ListenAddr {
+		if err = ctl.release(dbID); err != nil {
+			return
+		}
+	} else {
+		reqRelease := ReqRelease{
+			DbID: dbID,
+		}
+		rspRelease := &RspRelease{}
+		if err = ctl.callPeer(srcAddr, "Release", "/mgmt/v1/release", &reqRelease, rspRelease); err != nil {
+			return
+		} else if rspRelease.Err != "" {
+			err = errors.New(rspRelease.Err)
+			return
+		}
+		key := fmt.Sprintf("%s/vectodblite/%d", ctl.conf.EurekaApp, dbID)
+		if _, err = clientv3.NewKV(ctl.etcdCli).Delete(ctl.ctxL, key); err != nil {
+			err = errors.Wrap(err, "")
+			return
+		}
+	}
+	return
+}
+
+// manageReplicas assigns read replicas to hot databases and tears them down
+// once the database cools off. Ownership stays exclusive: replicas serve
+// searches only, and the owner keeps them fresh with a small replication
+// stream of adds. The plan lives on the leader and is re-derived from pushed
+// NodeLoad reports after a failover, so it needs no persistence.
+func (ctl *Controller) manageReplicas(load map[string][]int, aliveNodes map[string]NodeLoad) {
+	owner := make(map[int]string)
 	for nodeAddr, dbList := range load {
-		dbLen := len(dbList)
-		if dbLen-avgDbLen <= MaxLoadDelta {
-			continue
+		for _, dbID := range dbList {
+			owner[dbID] = nodeAddr
 		}
-		numBalance := dbLen - avgDbLen - MaxLoadDelta
-		log.Infof("balancing %d databases from %v", numBalance, nodeAddr)
+	}
+	// replica reports count too: a hot replica means the db is still hot
+	hot := make(map[int]bool)
+	for _, nl := range aliveNodes {
+		for _, dbID := range nl.HotDbIDs {
+			if _, ok := owner[dbID]; ok {
+				hot[dbID] = true
+			}
+		}
+	}
+	// least-loaded nodes first, memory pressure as the tiebreak
+	nodeAddrs := make([]string, 0, len(aliveNodes))
+	for addr := range aliveNodes {
+		nodeAddrs = append(nodeAddrs, addr)
+	}
+	sort.Slice(nodeAddrs, func(i, j int) bool {
+		ni, nj := nodeAddrs[i], nodeAddrs[j]
+		if len(load[ni]) != len(load[nj]) {
+			return len(load[ni]) < len(load[nj])
+		}
+		return aliveNodes[ni].MemBytes < aliveNodes[nj].MemBytes
+	})
 
-		for i := 0; i < numBalance; i++ {
-			// Pick a random db from the node, tell the node to release it, remove it from etcd and load.
-			dbIDIdx := rand.Intn(len(dbList))
-			dbID := dbList[dbIDIdx]
-			if nodeAddr == ctl.conf.ListenAddr {
-				if err = ctl.release(dbID); err != nil {
-					return
-				}
-			} else {
-				reqRelease := ReqRelease{
-					DbID: dbID,
-				}
-				rspRelease := &RspRelease{}
-				if err = PostJson(ctl.hc, fmt.Sprintf("http://%s/mgmt/v1/release", nodeAddr), reqRelease, rspRelease); err != nil {
-					return
-				} else if rspRelease.Err != "" {
-					err = errors.New(rspRelease.Err)
-					return
-				}
-				key := fmt.Sprintf("%s/vectodblite/%d", ctl.conf.EurekaApp, dbID)
-				if _, err = clientv3.NewKV(ctl.etcdCli).Delete(ctl.ctxL, key); err != nil {
-					err = errors.Wrap(err, "")
-					return
-				}
+	for dbID := range hot {
+		want := NumReadReplicas
+		if want > len(nodeAddrs)-1 {
+			want = len(nodeAddrs) - 1
+		}
+		picked := make([]string, 0, want)
+		for _, addr := range nodeAddrs {
+			if len(picked) >= want {
+				break
+			}
+			if addr != owner[dbID] {
+				picked = append(picked, addr)
 			}
-			dbList = append(dbList[:dbIDIdx], dbList[dbIDIdx+1:]...)
 		}
-		load[nodeAddr] = dbList
+		if len(picked) == 0 || sameStrings(ctl.replicaPlan[dbID], picked) {
+			continue
+		}
+		if err := ctl.sendReplicate(dbID, owner[dbID], picked); err != nil {
+			log.Errorf("got error %+v", err)
+			continue
+		}
+		ctl.replicaPlan[dbID] = picked
+		log.Infof("assigned read replicas %v for hot vectodblite %d owned by %s", picked, dbID, owner[dbID])
 	}
+	for dbID := range ctl.replicaPlan {
+		if hot[dbID] {
+			continue
+		}
+		if ownerAddr, ok := owner[dbID]; ok {
+			if err := ctl.sendReplicate(dbID, ownerAddr, []string{}); err != nil {
+				log.Errorf("got error %+v", err)
+				continue
+			}
+		}
+		delete(ctl.replicaPlan, dbID)
+		log.Infof("dropped read replicas of cooled-off vectodblite %d", dbID)
+	}
+}
 
-	log.Debugf("balancing done. previous avgDbLen %v.", avgDbLen)
+func (ctl *Controller) sendReplicate(dbID int, ownerAddr string, replicaAddrs []string) (err error) {
+	if ownerAddr == ctl.conf.ListenAddr {
+		return ctl.applyReplicate(dbID, replicaAddrs)
+	}
+	reqReplicate := ReqReplicate{
+		DbID:         dbID,
+		ReplicaAddrs: replicaAddrs,
+	}
+	rspReplicate := &RspReplicate{}
+	if err = ctl.callPeer(ownerAddr, "Replicate", "/mgmt/v1/replicate", &reqReplicate, rspReplicate); err != nil {
+		return
+	} else if rspReplicate.Err != "" {
+		err = errors.New(rspReplicate.Err)
+	}
 	return
 }
 
+func sameStrings(a, b []string) bool {
+	if len(a) != len(b) {
+		return false
+	}
+	for i := range a {
+		if a[i] != b[i] {
+			return false
+		}
+	}
+	return true
+}
+
 // @Description Assocaite a vectodblite with the given node. Only the leader node supports this API.
 // @Accept  json
 // @Produce json
@@ -273,12 +653,21 @@ func (ctl *Controller) acquire(ctx context.Context, dbID int, nodeAddr string) (
 		err = errors.Errorf("not capable to acquire since I'm not the leader")
 		return
 	}
+	defer func(t0 time.Time) {
+		mAcquireDur.With("").Observe(time.Since(t0))
+	}(time.Now())
 	k := fmt.Sprintf("%s/vectodblite/%d", ctl.conf.EurekaApp, dbID)
+	splitK := fmt.Sprintf("%s/split/%d", ctl.conf.EurekaApp, dbID)
 	// https://coreos.com/etcd/docs/latest/learning/api.html
+	// A split parent must never be re-acquired: its records moved to the
+	// sub-shards, so resurrecting the parent would serve an empty database.
+	// Guarding in the txn closes the window where a node's split watch lags.
 	val := nodeAddr
-	txn := ctl.etcdCli.Txn(ctx).If(clientv3.Compare(clientv3.CreateRevision(k), "=", 0))
+	txn := ctl.etcdCli.Txn(ctx).If(
+		clientv3.Compare(clientv3.CreateRevision(k), "=", 0),
+		clientv3.Compare(clientv3.CreateRevision(splitK), "=", 0))
 	txn = txn.Then(clientv3.OpPut(k, val))
-	txn = txn.Else(clientv3.OpGet(k))
+	txn = txn.Else(clientv3.OpGet(k), clientv3.OpGet(splitK))
 	resp, err := txn.Commit()
 	if err != nil {
 		err = errors.Wrap(err, "")
@@ -287,10 +676,315 @@ func (ctl *Controller) acquire(ctx context.Context, dbID int, nodeAddr string) (
 	if resp.Succeeded {
 		dstNodeAddr = nodeAddr
 		log.Infof("acquired vectodblite %d for %s", dbID, nodeAddr)
-	} else {
-		kv := resp.Responses[0].GetResponseRange().Kvs[0]
-		dstNodeAddr = string(kv.Value)
+	} else if kvs := resp.Responses[0].GetResponseRange().Kvs; len(kvs) != 0 {
+		dstNodeAddr = string(kvs[0].Value)
 		log.Infof("failed to acquire vectodblite %d for %s, it's already acquired by %s", dbID, nodeAddr, dstNodeAddr)
+	} else {
+		err = errors.Errorf("vectodblite %d is split; requests for it are rewritten to its sub-shards", dbID)
+	}
+	return
+}
+
+// @Description Warm-migrate a vectodblite from this node to another. The
+// source streams its resident records to the destination directly, so the
+// destination skips the redis read storm of a cold load; ownership flips in
+// etcd only after the import succeeds, and until then both nodes hold the
+// database so searches never block.
+// @Accept  json
+// @Produce json
+// @Param   add		body	main.ReqHandoff	true 	"ReqHandoff"
+// @Success 200 {object} main.RspHandoff "RspHandoff"
+// @Failure 400
+// @Router /mgmt/v1/handoff [post]
+func (ctl *Controller) HandleHandoff(c *gin.Context) {
+	var reqHandoff ReqHandoff
+	var err error
+	if err = c.ShouldBind(&reqHandoff); err != nil {
+		err = errors.Wrap(err, "")
+		log.Infof("failed to parse request body, error %+v", err)
+		c.String(http.StatusBadRequest, err.Error())
+	} else {
+		rspHandoff := RspHandoff{
+			DbID: reqHandoff.DbID,
+		}
+		if err = ctl.handoff(reqHandoff.DbID, reqHandoff.DstNodeAddr); err != nil {
+			log.Errorf("got error %+v", err)
+			rspHandoff.Err = err.Error()
+		}
+		c.JSON(200, rspHandoff)
+	}
+}
+
+func (ctl *Controller) handoff(dbID int, dstNodeAddr string) (err error) {
+	ctl.rwlock.RLock()
+	dbl, ok := ctl.dbls[dbID]
+	if !ok {
+		ctl.rwlock.RUnlock()
+		err = errors.Errorf("vectodblite %d is not resident", dbID)
+		return
+	}
+	var items map[string][]byte
+	items, err = dbl.Dump()
+	ctl.rwlock.RUnlock()
+	if err != nil {
+		return
+	}
+	reqImport := ReqImport{
+		DbID:  dbID,
+		Items: items,
+	}
+	var rspImport *RspImport
+	if rspImport, err = ctl.importToPeer(dstNodeAddr, &reqImport); err != nil {
+		return
+	} else if rspImport.Err != "" {
+		err = errors.New(rspImport.Err)
+		return
+	}
+	// The destination holds the database now too; flip the ownership and only
+	// then drop the local instance, so there's no moment without an owner.
+	key := fmt.Sprintf("%s/vectodblite/%d", ctl.conf.EurekaApp, dbID)
+	if _, err = clientv3.NewKV(ctl.etcdCli).Put(ctl.ctx, key, dstNodeAddr); err != nil {
+		err = errors.Wrap(err, "")
+		return
+	}
+	if err = ctl.release(dbID); err != nil {
+		return
+	}
+	log.Infof("handed off vectodblite %d to %s", dbID, dstNodeAddr)
+	return
+}
+
+// @Description Import a vectodblite streamed from another node during warm
+// migration. The records seed the in-memory index directly; redis stays the
+// fallback source of truth.
+// @Accept  json
+// @Produce json
+// @Param   add		body	main.ReqImport	true 	"ReqImport"
+// @Success 200 {object} main.RspImport "RspImport"
+// @Failure 400
+// @Router /mgmt/v1/import [post]
+func (ctl *Controller) HandleImport(c *gin.Context) {
+	var reqImport ReqImport
+	var err error
+	if err = c.ShouldBind(&reqImport); err != nil {
+		err = errors.Wrap(err, "")
+		log.Infof("failed to parse request body, error %+v", err)
+		c.String(http.StatusBadRequest, err.Error())
+	} else {
+		c.JSON(200, ctl.importDb(&reqImport))
+	}
+}
+
+// importDb is the transport-independent core of import, shared by the gin
+// handler and the rpc ImportStream method.
+func (ctl *Controller) importDb(reqImport *ReqImport) (rspImport *RspImport) {
+	rspImport = &RspImport{
+		DbID: reqImport.DbID,
+	}
+	// cutover of an announced move: the prewarmed instance already holds the
+	// redis state, so the streamed dump merely tops up the records that
+	// arrived at the source since the prewarm
+	ctl.rwlock.Lock()
+	dblW, warm := ctl.prewarmed[reqImport.DbID]
+	if warm {
+		delete(ctl.prewarmed, reqImport.DbID)
+		if _, ok := ctl.dbls[reqImport.DbID]; ok {
+			warm = false
+			go dblW.Destroy()
+		} else {
+			ctl.dbls[reqImport.DbID] = dblW
+		}
+	}
+	ctl.rwlock.Unlock()
+	if warm {
+		if numAdded, errM := dblW.MergeDump(reqImport.Items); errM != nil {
+			log.Errorf("got error %+v", errM)
+			rspImport.Err = errM.Error()
+		} else {
+			log.Infof("cut over prewarmed vectodblite %d, merged %d fresh records", reqImport.DbID, numAdded)
+		}
+		if reqImport.OwnerAddr != "" {
+			ctl.rwlock.Lock()
+			ctl.replicaOf[reqImport.DbID] = reqImport.OwnerAddr
+			ctl.rwlock.Unlock()
+		}
+		return
+	}
+	var dblNew *vectodb.VectoDBLite
+	var err error
+	if dblNew, err = vectodb.NewVectoDBLiteFromDump(ctl.conf.RedisAddr, reqImport.DbID, ctl.conf.Dim, float32(ctl.conf.DisThr), ctl.conf.SizeLimit, reqImport.Items); err != nil {
+		log.Errorf("got error %+v", err)
+		rspImport.Err = err.Error()
+		return
+	}
+	ctl.rwlock.Lock()
+	if _, ok := ctl.dbls[reqImport.DbID]; ok {
+		ctl.rwlock.Unlock()
+		dblNew.Destroy()
+	} else {
+		ctl.dbls[reqImport.DbID] = dblNew
+		ctl.rwlock.Unlock()
+	}
+	if reqImport.OwnerAddr != "" {
+		// the import seeded a read replica: remember the owner so writes
+		// redirect there while searches serve from the local copy
+		ctl.rwlock.Lock()
+		ctl.replicaOf[reqImport.DbID] = reqImport.OwnerAddr
+		ctl.rwlock.Unlock()
+	}
+	return
+}
+
+// @Description Set the read replica list of a vectodblite owned by this
+// node. Sent by the leader when a database turns hot or cools off; an empty
+// list tears the replica set down. New replicas are seeded with a dump of
+// the resident records, then kept fresh by the owner streaming each add.
+// @Accept  json
+// @Produce json
+// @Param   add		body	main.ReqReplicate	true 	"ReqReplicate"
+// @Success 200 {object} main.RspReplicate "RspReplicate"
+// @Failure 400
+// @Router /mgmt/v1/replicate [post]
+func (ctl *Controller) HandleReplicate(c *gin.Context) {
+	var reqReplicate ReqReplicate
+	var err error
+	if err = c.ShouldBind(&reqReplicate); err != nil {
+		err = errors.Wrap(err, "")
+		log.Infof("failed to parse request body, error %+v", err)
+		c.String(http.StatusBadRequest, err.Error())
+	} else {
+		rspReplicate := RspReplicate{
+			DbID: reqReplicate.DbID,
+		}
+		if err = ctl.applyReplicate(reqReplicate.DbID, reqReplicate.ReplicaAddrs); err != nil {
+			log.Errorf("got error %+v", err)
+			rspReplicate.Err = err.Error()
+		}
+		c.JSON(200, rspReplicate)
+	}
+}
+
+func (ctl *Controller) applyReplicate(dbID int, replicaAddrs []string) (err error) {
+	ctl.rwlock.RLock()
+	dbl, ok := ctl.dbls[dbID]
+	cur := ctl.replicas[dbID]
+	ctl.rwlock.RUnlock()
+	if !ok && len(replicaAddrs) != 0 {
+		err = errors.Errorf("vectodblite %d is not resident", dbID)
+		return
+	}
+	curSet := make(map[string]bool, len(cur))
+	for _, addr := range cur {
+		curSet[addr] = true
+	}
+	// seed the new replicas with a dump of the resident records, the same
+	// stream a warm handoff uses
+	final := make([]string, 0, len(replicaAddrs))
+	for _, addr := range replicaAddrs {
+		if curSet[addr] {
+			delete(curSet, addr)
+			final = append(final, addr)
+			continue
+		}
+		var items map[string][]byte
+		if items, err = dbl.Dump(); err != nil {
+			return
+		}
+		reqImport := ReqImport{
+			DbID:      dbID,
+			Items:     items,
+			OwnerAddr: ctl.conf.ListenAddr,
+		}
+		rspImport, errS := ctl.importToPeer(addr, &reqImport)
+		if errS != nil {
+			log.Errorf("failed to seed replica of vectodblite %d at %s, error %+v", dbID, addr, errS)
+			continue
+		} else if rspImport.Err != "" {
+			log.Errorf("failed to seed replica of vectodblite %d at %s, error %s", dbID, addr, rspImport.Err)
+			continue
+		}
+		final = append(final, addr)
+	}
+	// drop replicas that left the set
+	for addr := range curSet {
+		reqRelease := ReqRelease{
+			DbID: dbID,
+		}
+		rspRelease := &RspRelease{}
+		if errR := ctl.callPeer(addr, "Release", "/mgmt/v1/release", &reqRelease, rspRelease); errR != nil {
+			log.Warnf("failed to drop replica of vectodblite %d at %s, error %+v", dbID, addr, errR)
+		}
+	}
+	ctl.rwlock.Lock()
+	if len(final) == 0 {
+		delete(ctl.replicas, dbID)
+	} else {
+		ctl.replicas[dbID] = final
+	}
+	ctl.rwlock.Unlock()
+	return
+}
+
+// replicateAdd streams one accepted add to the read replicas, best effort.
+// A replica that misses an add serves marginally stale results until it is
+// reseeded or dropped; redis remains the source of truth throughout.
+func (ctl *Controller) replicateAdd(dbID int, xb []float32, xid uint64, replicaAddrs []string) {
+	reqReplicaAdd := ReqReplicaAdd{
+		DbID: dbID,
+		Xb:   xb,
+		Xid:  xid,
+	}
+	for _, addr := range replicaAddrs {
+		rspReplicaAdd := &RspReplicaAdd{}
+		if err := ctl.callPeer(addr, "ReplicaAdd", "/mgmt/v1/replica_add", &reqReplicaAdd, rspReplicaAdd); err != nil {
+			log.Warnf("failed to replicate add of vectodblite %d to %s, error %+v", dbID, addr, err)
+		} else if rspReplicaAdd.Err != "" {
+			log.Warnf("failed to replicate add of vectodblite %d to %s, error %s", dbID, addr, rspReplicaAdd.Err)
+		}
+	}
+}
+
+// @Description Apply one replicated add to the local read replica. Sent by
+// the owner of the database; rejected if this node is not a replica of it.
+// @Accept  json
+// @Produce json
+// @Param   add		body	main.ReqReplicaAdd	true 	"ReqReplicaAdd"
+// @Success 200 {object} main.RspReplicaAdd "RspReplicaAdd"
+// @Failure 400
+// @Router /mgmt/v1/replica_add [post]
+func (ctl *Controller) HandleReplicaAdd(c *gin.Context) {
+	var reqReplicaAdd ReqReplicaAdd
+	var err error
+	if err = c.ShouldBind(&reqReplicaAdd); err != nil {
+		err = errors.Wrap(err, "")
+		log.Infof("failed to parse request body, error %+v", err)
+		c.String(http.StatusBadRequest, err.Error())
+	} else {
+		c.JSON(200, ctl.applyReplicaAdd(&reqReplicaAdd))
+	}
+}
+
+// applyReplicaAdd is the transport-independent core of replica_add, shared
+// by the gin handler and the rpc ReplicaAdd method.
+func (ctl *Controller) applyReplicaAdd(reqReplicaAdd *ReqReplicaAdd) (rspReplicaAdd *RspReplicaAdd) {
+	rspReplicaAdd = &RspReplicaAdd{
+		DbID: reqReplicaAdd.DbID,
+	}
+	ctl.rwlock.RLock()
+	dbl, ok := ctl.dbls[reqReplicaAdd.DbID]
+	_, isReplica := ctl.replicaOf[reqReplicaAdd.DbID]
+	if !ok || !isReplica {
+		ctl.rwlock.RUnlock()
+		rspReplicaAdd.Err = fmt.Sprintf("not a replica of vectodblite %d", reqReplicaAdd.DbID)
+		return
+	}
+	// AddWithId re-puts the same record into redis; that write is
+	// idempotent since owner and replica share the redis keyspace
+	err := dbl.AddWithId(reqReplicaAdd.Xb, reqReplicaAdd.Xid)
+	ctl.rwlock.RUnlock()
+	if err != nil {
+		log.Errorf("got error %+v", err)
+		rspReplicaAdd.Err = err.Error()
 	}
 	return
 }
@@ -324,10 +1018,19 @@ func (ctl *Controller) HandleRelease(c *gin.Context) {
 }
 
 func (ctl *Controller) release(dbID int) (err error) {
+	defer func(t0 time.Time) {
+		mReleaseDur.With("").Observe(time.Since(t0))
+	}(time.Now())
 	ctl.rwlock.Lock()
 	defer ctl.rwlock.Unlock()
 	if dbl, ok := ctl.dbls[dbID]; ok {
 		delete(ctl.dbls, dbID)
+		delete(ctl.replicas, dbID)
+		delete(ctl.replicaOf, dbID)
+		ctl.mtxAccess.Lock()
+		delete(ctl.lastAccess, dbID)
+		delete(ctl.accessCount, dbID)
+		ctl.mtxAccess.Unlock()
 		if err = dbl.Destroy(); err != nil {
 			return
 		} else {
@@ -339,14 +1042,65 @@ func (ctl *Controller) release(dbID int) (err error) {
 	return
 }
 
-// @Description Eureka statusPageUrl.
+// @Description The dbID->node ownership map with the etcd revision it was
+// read at. The same map is watchable directly at the etcd prefix
+// "<EurekaApp>/vectodblite"; this endpoint serves smart clients that route
+// over plain HTTP and hit the owner first time instead of paying a
+// forwarding hop. Any node can serve it.
+// @Produce json
+// @Success 200 {object} main.RspRouting "RspRouting"
+// @Router /routing [get]
+func (ctl *Controller) HandleRouting(c *gin.Context) {
+	rsp := RspRouting{}
+	var err error
+	if rsp.Routes, rsp.Version, err = ctl.getRoutes(c.Request.Context()); err != nil {
+		log.Errorf("got error %+v", err)
+		rsp.Err = err.Error()
+	}
+	c.JSON(200, rsp)
+}
+
+// getRoutes reads the whole dbID->node ownership map in one etcd range.
+func (ctl *Controller) getRoutes(ctx context.Context) (routes map[int]string, version int64, err error) {
+	routes = make(map[int]string, 0)
+	pfx := fmt.Sprintf("%s/vectodblite", ctl.conf.EurekaApp)
+	resp, err := clientv3.NewKV(ctl.etcdCli).Get(ctx, pfx, clientv3.WithPrefix())
+	if err != nil {
+		err = errors.Wrap(err, "")
+		return
+	}
+	version = resp.Header.Revision
+	for _, item := range resp.Kvs {
+		strDbID := filepath.Base(string(item.Key))
+		var dbID int
+		if dbID, err = strconv.Atoi(strDbID); err != nil {
+			log.Errorf("invalid routing key %s", string(item.Key))
+			err = nil
+			continue
+		}
+		routes[dbID] = string(item.Value)
+	}
+	return
+}
+
+// @Description Eureka statusPageUrl. Also reports residency and eviction
+// metrics of the per-node database LRU.
 // @Produce json
 // @Success 200 {object} main.Status "Status"
 // @Router /status [get]
 func (ctl *Controller) HandleStatus(c *gin.Context) {
 	status := Status{
-		Status: "UP",
+		Status:         "UP",
+		MemBudgetBytes: int64(ctl.conf.MemBudget) * (1 << 20),
+		NumEvicted:     atomic.LoadInt64(&ctl.numEvicted),
+	}
+	ctl.rwlock.RLock()
+	status.ResidentDbs = len(ctl.dbls)
+	for _, dbl := range ctl.dbls {
+		status.ResidentVectors += dbl.Size()
 	}
+	ctl.rwlock.RUnlock()
+	status.MemBytes = int64(status.ResidentVectors) * ctl.memBytesPerVec()
 	c.JSON(200, status)
 }
 
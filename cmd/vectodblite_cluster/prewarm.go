@@ -0,0 +1,152 @@
+package main
+
+// Predictive pre-warming of planned placements. A migration used to land on
+// a cold destination: the redis load and flat-index build ran exactly when
+// redirected traffic arrived. The balancer now announces each planned move
+// one cycle ahead; the destination loads the database from redis (or its
+// snapshot) in the background, and the cutover — warm handoff plus ownership
+// flip — waits until the destination reports warm, with the handoff dump
+// merely topping up records added since the prewarm. Dead-node failover uses
+// the same announcement: the leader re-places each orphaned database on a
+// surviving node and starts its load there immediately, instead of leaving
+// the cold load to the first request.
+
+import (
+	"net/http"
+	"time"
+
+	"github.com/gin-gonic/gin"
+	"github.com/infinivision/vectodb"
+	"github.com/pkg/errors"
+	log "github.com/sirupsen/logrus"
+)
+
+type ReqPrewarm struct {
+	DbID int `json:"dbID"`
+	//true withdraws an announcement, dropping the prewarmed instance
+	Cancel bool `json:"cancel,omitempty"`
+}
+
+type RspPrewarm struct {
+	DbID int    `json:"dbID"`
+	Warm bool   `json:"warm"` //the database is resident or prewarmed here
+	Err  string `json:"err"`
+}
+
+// @Description Announce that this node is the planned destination of a
+// database, or withdraw the announcement. The node loads the database from
+// redis in the background and reports warm=true once it is ready, at which
+// point the leader performs the actual cutover. Idempotent: re-announcing
+// polls the warm state.
+// @Accept  json
+// @Produce json
+// @Param   add		body	main.ReqPrewarm	true 	"ReqPrewarm"
+// @Success 200 {object} main.RspPrewarm "RspPrewarm"
+// @Failure 400
+// @Router /mgmt/v1/prewarm [post]
+func (ctl *Controller) HandlePrewarm(c *gin.Context) {
+	var reqPrewarm ReqPrewarm
+	var err error
+	if err = c.ShouldBind(&reqPrewarm); err != nil {
+		err = errors.Wrap(err, "")
+		log.Infof("failed to parse request body, error %+v", err)
+		c.String(http.StatusBadRequest, err.Error())
+	} else {
+		c.JSON(200, ctl.applyPrewarm(&reqPrewarm))
+	}
+}
+
+// applyPrewarm is the transport-independent core of prewarm, shared by the
+// gin handler and the rpc Prewarm method.
+func (ctl *Controller) applyPrewarm(reqPrewarm *ReqPrewarm) (rspPrewarm *RspPrewarm) {
+	rspPrewarm = &RspPrewarm{
+		DbID: reqPrewarm.DbID,
+	}
+	dbID := reqPrewarm.DbID
+	ctl.rwlock.Lock()
+	if reqPrewarm.Cancel {
+		dblW, ok := ctl.prewarmed[dbID]
+		delete(ctl.prewarmed, dbID)
+		ctl.rwlock.Unlock()
+		if ok {
+			log.Infof("dropped prewarmed vectodblite %d on withdrawn announcement", dbID)
+			if err := dblW.Destroy(); err != nil {
+				log.Errorf("got error %+v", err)
+			}
+		}
+		return
+	}
+	if _, ok := ctl.dbls[dbID]; ok {
+		rspPrewarm.Warm = true
+		ctl.rwlock.Unlock()
+		return
+	}
+	if _, ok := ctl.prewarmed[dbID]; ok {
+		rspPrewarm.Warm = true
+		ctl.rwlock.Unlock()
+		return
+	}
+	if ctl.prewarming[dbID] {
+		//the announced load is still running
+		ctl.rwlock.Unlock()
+		return
+	}
+	ctl.prewarming[dbID] = true
+	ctl.rwlock.Unlock()
+	go func() {
+		t0 := time.Now()
+		dblNew, errL := vectodb.NewVectoDBLite(ctl.conf.RedisAddr, dbID, ctl.conf.Dim, float32(ctl.conf.DisThr), ctl.conf.SizeLimit)
+		ctl.rwlock.Lock()
+		delete(ctl.prewarming, dbID)
+		if errL != nil {
+			ctl.rwlock.Unlock()
+			log.Errorf("failed to prewarm vectodblite %d, error %+v", dbID, errL)
+			return
+		}
+		if _, ok := ctl.dbls[dbID]; ok {
+			//the database arrived through another path meanwhile
+			ctl.rwlock.Unlock()
+			dblNew.Destroy()
+			return
+		}
+		ctl.prewarmed[dbID] = dblNew
+		ctl.rwlock.Unlock()
+		mLoadDur.With("").Observe(time.Since(t0))
+		log.Infof("prewarmed vectodblite %d in %v", dbID, time.Since(t0))
+	}()
+	return
+}
+
+// sendPrewarm announces (or polls) a planned placement at the destination and
+// reports whether it is warm there. Failures count as not warm; the balancer
+// just retries next round.
+func (ctl *Controller) sendPrewarm(dbID int, dstAddr string) (warm bool) {
+	reqPrewarm := ReqPrewarm{DbID: dbID}
+	rspPrewarm := &RspPrewarm{}
+	if dstAddr == ctl.conf.ListenAddr {
+		rspPrewarm = ctl.applyPrewarm(&reqPrewarm)
+	} else if err := ctl.callPeer(dstAddr, "Prewarm", "/mgmt/v1/prewarm", &reqPrewarm, rspPrewarm); err != nil {
+		log.Warnf("failed to announce prewarm of vectodblite %d to %s, error %+v", dbID, dstAddr, err)
+		return
+	}
+	if rspPrewarm.Err != "" {
+		log.Warnf("failed to announce prewarm of vectodblite %d to %s, error %s", dbID, dstAddr, rspPrewarm.Err)
+		return
+	}
+	warm = rspPrewarm.Warm
+	return
+}
+
+// sendPrewarmCancel withdraws an announcement whose move is no longer
+// planned, so the destination does not sit on a stale prewarmed instance.
+func (ctl *Controller) sendPrewarmCancel(dbID int, dstAddr string) {
+	reqPrewarm := ReqPrewarm{DbID: dbID, Cancel: true}
+	rspPrewarm := &RspPrewarm{}
+	if dstAddr == ctl.conf.ListenAddr {
+		ctl.applyPrewarm(&reqPrewarm)
+		return
+	}
+	if err := ctl.callPeer(dstAddr, "Prewarm", "/mgmt/v1/prewarm", &reqPrewarm, rspPrewarm); err != nil {
+		log.Warnf("failed to withdraw prewarm of vectodblite %d at %s, error %+v", dbID, dstAddr, err)
+	}
+}
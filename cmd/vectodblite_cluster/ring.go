@@ -0,0 +1,58 @@
+package main
+
+// Consistent-hash placement for the balancer. Hashing dbIDs onto a ring of
+// virtual nodes makes the preferred owner of a database a pure function of
+// the alive node set, so adding or removing one node moves only ~1/N of the
+// databases instead of reshuffling by count — and each migration is an
+// expensive redis reload or a warm handoff, so fewer is better. The
+// bounded-load walk keeps any single node from drawing far more than its
+// share when the hash is unlucky.
+
+import (
+	"hash/fnv"
+	"sort"
+	"strconv"
+)
+
+const VnodesPerNode = 128
+
+type ringPoint struct {
+	hash uint64
+	addr string
+}
+
+type hashRing struct {
+	points []ringPoint
+}
+
+func newHashRing(nodeAddrs []string) (r *hashRing) {
+	r = &hashRing{points: make([]ringPoint, 0, VnodesPerNode*len(nodeAddrs))}
+	for _, addr := range nodeAddrs {
+		for i := 0; i < VnodesPerNode; i++ {
+			h := fnv.New64a()
+			h.Write([]byte(addr + "#" + strconv.Itoa(i)))
+			r.points = append(r.points, ringPoint{hash: h.Sum64(), addr: addr})
+		}
+	}
+	sort.Slice(r.points, func(i, j int) bool { return r.points[i].hash < r.points[j].hash })
+	return
+}
+
+// owner walks clockwise from the dbID's ring position and returns the first
+// node whose assigned count is still below capacity. counts is the
+// assignment being built; the caller increments it after each placement.
+func (r *hashRing) owner(dbID int, counts map[string]int, capacity int) string {
+	if len(r.points) == 0 {
+		return ""
+	}
+	h := fnv.New64a()
+	h.Write([]byte(strconv.Itoa(dbID)))
+	at := sort.Search(len(r.points), func(i int) bool { return r.points[i].hash >= h.Sum64() })
+	for i := 0; i < len(r.points); i++ {
+		p := r.points[(at+i)%len(r.points)]
+		if counts[p.addr] < capacity {
+			return p.addr
+		}
+	}
+	return r.points[at%len(r.points)].addr
+}
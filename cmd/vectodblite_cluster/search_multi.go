@@ -0,0 +1,180 @@
+package main
+
+// Scatter-gather search across many databases. Probing one vector against
+// dozens of dbIDs (one per channel) used to cost one HTTP round trip per
+// database. search_multi carries the vector plus a dbID list in one request;
+// the receiving node answers the resident databases itself, groups the rest
+// by owning node via the routing table, fans one aggregated sub-request per
+// peer over the pipelined rpc transport, and merges the per-database results
+// — so the round-trip count collapses from len(dbIDs) to the node fan-out.
+
+import (
+	"net/http"
+	"sync"
+
+	"github.com/gin-gonic/gin"
+	"github.com/pkg/errors"
+	log "github.com/sirupsen/logrus"
+	"golang.org/x/net/context"
+)
+
+type ReqSearchMulti struct {
+	DbIDs []int     `json:"dbIDs"`
+	Xq    []float32 `json:"xq"`
+	K     int       `json:"k,omitempty"` //nearest matches per database, default 1
+	//set on the aggregated hop between nodes, to stop re-forwarding
+	Forwarded bool `json:"forwarded,omitempty"`
+}
+
+// SearchItem is the per-database result, the same shape RspSearch has.
+type SearchItem struct {
+	DbID      int       `json:"dbID"`
+	Xid       uint64    `json:"xid"`
+	Distance  float32   `json:"distance"`
+	Xids      []uint64  `json:"xids,omitempty"`      //k nearest, present when k > 1
+	Distances []float32 `json:"distances,omitempty"` //k nearest, present when k > 1
+	Err       string    `json:"err,omitempty"`
+}
+
+type RspSearchMulti struct {
+	Results []SearchItem `json:"results"` //parallel to dbIDs
+	Err     string       `json:"err"`
+}
+
+// @Description Search one vector in many vectodblites at once. Databases
+// resident here answer locally; the rest are grouped by owning node and
+// forwarded as one aggregated sub-request per peer, so probing a vector
+// against dozens of dbIDs costs a handful of round trips instead of one per
+// database. Per-database failures land in the matching result slot, not in
+// the top-level err.
+// @Accept  json
+// @Produce  json
+// @Param   search		body	main.ReqSearchMulti	true 	"ReqSearchMulti"
+// @Success 200 {object} main.RspSearchMulti "RspSearchMulti"
+// @Failure 400
+// @Router /api/v1/search_multi [post]
+func (ctl *Controller) HandleSearchMulti(c *gin.Context) {
+	var reqSearchMulti ReqSearchMulti
+	var err error
+	route := "local"
+	defer observeRequest("search_multi", &route, &err)()
+	if err = c.ShouldBind(&reqSearchMulti); err != nil {
+		err = errors.Wrap(err, "")
+		log.Infof("failed to parse request body, error %+v", err)
+		c.String(http.StatusBadRequest, err.Error())
+		return
+	}
+	rspSearchMulti := ctl.searchMulti(c.Request.Context(), &reqSearchMulti)
+	if rspSearchMulti.Err != "" {
+		err = errors.New(rspSearchMulti.Err)
+	}
+	c.JSON(200, rspSearchMulti)
+}
+
+// searchMulti is the transport-independent core of search_multi, shared by
+// the gin handler and the rpc SearchMulti method the aggregated sub-requests
+// arrive on.
+func (ctl *Controller) searchMulti(ctx context.Context, reqSearchMulti *ReqSearchMulti) (rspSearchMulti *RspSearchMulti) {
+	var err error
+	rspSearchMulti = &RspSearchMulti{
+		Results: make([]SearchItem, len(reqSearchMulti.DbIDs)),
+	}
+	k := reqSearchMulti.K
+	if k < 1 {
+		k = 1
+	}
+	for i, dbID := range reqSearchMulti.DbIDs {
+		rspSearchMulti.Results[i].DbID = dbID
+		rspSearchMulti.Results[i].Xid = ^uint64(0)
+	}
+	//split the databases into local ones and one group per owning node; a
+	//single etcd range answers routing for the whole request
+	local := make([]int, 0, len(reqSearchMulti.DbIDs))
+	byNode := make(map[string][]int) //owner addr -> result positions
+	var routes map[int]string
+	ctl.rwlock.RLock()
+	for i, dbID := range reqSearchMulti.DbIDs {
+		if ctl.isSplit(dbID) {
+			//searchOne fans the sub-shards itself
+			local = append(local, i)
+			continue
+		}
+		if _, ok := ctl.dbls[dbID]; ok {
+			local = append(local, i)
+			continue
+		}
+		if reqSearchMulti.Forwarded {
+			//one aggregated hop only; the sender's routing was stale
+			rspSearchMulti.Results[i].Err = errors.Errorf("not the owner of vectodblite %d", dbID).Error()
+			continue
+		}
+		if routes == nil {
+			if routes, _, err = ctl.getRoutes(ctx); err != nil {
+				break
+			}
+		}
+		if addr, ok := routes[dbID]; ok && addr != ctl.conf.ListenAddr {
+			byNode[addr] = append(byNode[addr], i)
+		} else {
+			//unrouted databases land here and get acquired on search
+			local = append(local, i)
+		}
+	}
+	ctl.rwlock.RUnlock()
+	if err != nil {
+		log.Errorf("got error %+v", err)
+		rspSearchMulti.Err = err.Error()
+		return
+	}
+
+	//every result position is owned by exactly one goroutine, so the fans
+	//need no locking
+	var wg sync.WaitGroup
+	for _, i := range local {
+		wg.Add(1)
+		go func(i int) {
+			defer wg.Done()
+			res := &rspSearchMulti.Results[i]
+			xids, distances, errS := ctl.searchOne(ctx, res.DbID, reqSearchMulti.Xq, k)
+			if errS != nil {
+				log.Errorf("got error %+v", errS)
+				res.Err = errS.Error()
+				return
+			}
+			res.Xid, res.Distance = xids[0], distances[0]
+			if reqSearchMulti.K > 1 {
+				res.Xids, res.Distances = xids, distances
+			}
+		}(i)
+	}
+	for addr, idxs := range byNode {
+		wg.Add(1)
+		go func(addr string, idxs []int) {
+			defer wg.Done()
+			sub := ReqSearchMulti{
+				DbIDs:     make([]int, len(idxs)),
+				Xq:        reqSearchMulti.Xq,
+				K:         reqSearchMulti.K,
+				Forwarded: true,
+			}
+			for j, i := range idxs {
+				sub.DbIDs[j] = reqSearchMulti.DbIDs[i]
+			}
+			subRsp := &RspSearchMulti{}
+			if errF := ctl.callPeer(addr, "SearchMulti", "/api/v1/search_multi", &sub, subRsp); errF != nil {
+				log.Errorf("got error %+v", errF)
+				for _, i := range idxs {
+					rspSearchMulti.Results[i].Err = errF.Error()
+				}
+				return
+			}
+			for j, i := range idxs {
+				if j < len(subRsp.Results) {
+					rspSearchMulti.Results[i] = subRsp.Results[j]
+				}
+			}
+		}(addr, idxs)
+	}
+	wg.Wait()
+	return
+}
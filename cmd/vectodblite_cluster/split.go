@@ -0,0 +1,421 @@
+package main
+
+// Transparent splitting of oversized databases. A vectodblite is a brute-force
+// scan, so once a database reaches sizeLimit the LRU starts dropping records
+// and the owning node hot-spots. Instead, the owner hash-splits the database
+// into two sub-shards keyed on one xid bit. The sub-shards are ordinary
+// vectodblite databases with their own redis hashes and etcd ownership keys,
+// so the balancer places them independently; a marker under
+// "<EurekaApp>/split/<dbID>" (mirrored on every node by an etcd watch) keeps
+// the external dbID stable — adds for a split dbID are rewritten to the
+// sub-shard owning the xid, and searches fan out to both sub-shards with the
+// results merged. Splits nest, each depth partitioning on the next xid bit,
+// so per-database scan cost stays bounded however large a dbID grows.
+
+import (
+	"bytes"
+	"encoding/binary"
+	"fmt"
+	"io/ioutil"
+	"math"
+	"sort"
+	"strconv"
+	"sync"
+
+	"github.com/coreos/etcd/clientv3"
+	"github.com/infinivision/vectodb"
+	"github.com/pkg/errors"
+	log "github.com/sirupsen/logrus"
+	"golang.org/x/net/context"
+)
+
+// sub-shard dbIDs are derived above this base; external dbIDs must stay below
+const SplitDbIDBase = 1 << 24
+
+// subDbIDs derives the two sub-shard dbIDs of a split database. The mapping
+// is injective over all dbIDs, so sub-shards can split again.
+func subDbIDs(dbID int) [2]int {
+	return [2]int{SplitDbIDBase + 2*dbID, SplitDbIDBase + 2*dbID + 1}
+}
+
+// splitDepth is how many splits deep a dbID sits. The split of a depth-d
+// database partitions on xid bit d, so nested splits use distinct bits.
+func splitDepth(dbID int) (depth int) {
+	for dbID >= SplitDbIDBase {
+		dbID = (dbID - SplitDbIDBase) / 2
+		depth++
+	}
+	return
+}
+
+func (ctl *Controller) isSplit(dbID int) bool {
+	ctl.mtxSplit.Lock()
+	defer ctl.mtxSplit.Unlock()
+	return ctl.splits[dbID]
+}
+
+// resolveSplit maps a dbID to the sub-shard owning xid, descending through
+// nested splits. A dbID that is not split maps to itself.
+func (ctl *Controller) resolveSplit(dbID int, xid uint64) int {
+	ctl.mtxSplit.Lock()
+	defer ctl.mtxSplit.Unlock()
+	for ctl.splits[dbID] {
+		dbID = subDbIDs(dbID)[(xid>>uint(splitDepth(dbID)))&1]
+	}
+	return dbID
+}
+
+// servSplitWatch mirrors the etcd split markers into ctl.splits, the same
+// initial-range-then-watch pattern servLeaderWork uses for node liveness, so
+// every node rewrites requests for split databases without per-request etcd
+// reads.
+func (ctl *Controller) servSplitWatch(ctx context.Context) {
+	pfx := fmt.Sprintf("%s/split", ctl.conf.EurekaApp)
+	resp, err := clientv3.NewKV(ctl.etcdCli).Get(ctx, pfx, clientv3.WithPrefix())
+	if err != nil {
+		err = errors.Wrap(err, "")
+		log.Fatalf("got error %+v", err)
+	}
+	ctl.mtxSplit.Lock()
+	for _, item := range resp.Kvs {
+		if dbID, err2 := strconv.Atoi(string(item.Key[len(pfx)+1:])); err2 == nil {
+			ctl.splits[dbID] = true
+		}
+	}
+	ctl.mtxSplit.Unlock()
+	watcher := clientv3.NewWatcher(ctl.etcdCli)
+	splitChangeCh := watcher.Watch(ctx, pfx, clientv3.WithPrefix(), clientv3.WithRev(resp.Header.Revision+1))
+	for {
+		select {
+		case <-ctx.Done():
+			log.Infof("servSplitWatch goroutine exited")
+			return
+		case sc := <-splitChangeCh:
+			if err = sc.Err(); err != nil {
+				err = errors.Wrap(err, "")
+				log.Errorf("got error %+v", err)
+			}
+			for _, e := range sc.Events {
+				dbID, err2 := strconv.Atoi(string(e.Kv.Key[len(pfx)+1:]))
+				if err2 != nil {
+					continue
+				}
+				ctl.mtxSplit.Lock()
+				if e.Type == clientv3.EventTypeDelete {
+					delete(ctl.splits, dbID)
+				} else {
+					ctl.splits[dbID] = true
+				}
+				ctl.mtxSplit.Unlock()
+			}
+		}
+	}
+}
+
+// maybeSplit kicks off an asynchronous split once a resident database reaches
+// its sizeLimit, just before the LRU would start evicting records. Called
+// from the add paths with ctl.rwlock read-held; the split itself runs in its
+// own goroutine and takes the locks it needs.
+func (ctl *Controller) maybeSplit(dbID int, dbl *vectodb.VectoDBLite) {
+	if dbl.Size() < ctl.conf.SizeLimit {
+		return
+	}
+	ctl.mtxSplit.Lock()
+	if ctl.splits[dbID] || ctl.splitting[dbID] {
+		ctl.mtxSplit.Unlock()
+		return
+	}
+	ctl.splitting[dbID] = true
+	ctl.mtxSplit.Unlock()
+	go func() {
+		if err := ctl.splitDb(dbID); err != nil {
+			log.Errorf("failed to split vectodblite %d, error %+v", dbID, err)
+		}
+		ctl.mtxSplit.Lock()
+		delete(ctl.splitting, dbID)
+		ctl.mtxSplit.Unlock()
+	}()
+}
+
+// splitDb hash-splits an oversized database into its two sub-shards. Both
+// halves are built and persisted on this node first; one etcd txn then makes
+// the split visible atomically, after which the parent dbID is retired.
+func (ctl *Controller) splitDb(dbID int) (err error) {
+	ctl.rwlock.RLock()
+	dbl, ok := ctl.dbls[dbID]
+	if !ok {
+		ctl.rwlock.RUnlock()
+		err = errors.Errorf("vectodblite %d is not resident", dbID)
+		return
+	}
+	var items map[string][]byte
+	items, err = dbl.Dump()
+	ctl.rwlock.RUnlock()
+	if err != nil {
+		return
+	}
+	subs := subDbIDs(dbID)
+	depth := uint(splitDepth(dbID))
+	halves := [2]map[string][]byte{make(map[string][]byte), make(map[string][]byte)}
+	for xidS, vtB := range items {
+		xid, err2 := strconv.ParseUint(xidS, 16, 64)
+		if err2 != nil {
+			continue
+		}
+		halves[(xid>>depth)&1][xidS] = vtB
+	}
+	// the sub-shards live on this node first; persist them to their own redis
+	// hashes before the marker commits so no crash window loses records
+	for k := 0; k < 2; k++ {
+		if rspImport := ctl.importDb(&ReqImport{DbID: subs[k], Items: halves[k]}); rspImport.Err != "" {
+			err = errors.New(rspImport.Err)
+			return
+		}
+		ctl.rwlock.RLock()
+		subDbl := ctl.dbls[subs[k]]
+		ctl.rwlock.RUnlock()
+		if err = subDbl.PersistResident(); err != nil {
+			return
+		}
+	}
+	// one txn makes the split visible: the marker plus both sub-shard
+	// ownership keys, all create-guarded so a concurrent split elsewhere wins
+	// cleanly
+	markerKey := fmt.Sprintf("%s/split/%d", ctl.conf.EurekaApp, dbID)
+	key0 := fmt.Sprintf("%s/vectodblite/%d", ctl.conf.EurekaApp, subs[0])
+	key1 := fmt.Sprintf("%s/vectodblite/%d", ctl.conf.EurekaApp, subs[1])
+	txn := ctl.etcdCli.Txn(ctl.ctx).If(
+		clientv3.Compare(clientv3.CreateRevision(markerKey), "=", 0),
+		clientv3.Compare(clientv3.CreateRevision(key0), "=", 0),
+		clientv3.Compare(clientv3.CreateRevision(key1), "=", 0))
+	txn = txn.Then(
+		clientv3.OpPut(markerKey, ctl.conf.ListenAddr),
+		clientv3.OpPut(key0, ctl.conf.ListenAddr),
+		clientv3.OpPut(key1, ctl.conf.ListenAddr))
+	var resp *clientv3.TxnResponse
+	if resp, err = txn.Commit(); err != nil {
+		err = errors.Wrap(err, "")
+		return
+	}
+	if !resp.Succeeded {
+		log.Infof("vectodblite %d was split concurrently elsewhere, dropping the local halves", dbID)
+		for k := 0; k < 2; k++ {
+			if errR := ctl.release(subs[k]); errR != nil {
+				log.Warnf("failed to release sub-shard %d, error %+v", subs[k], errR)
+			}
+		}
+		return
+	}
+	ctl.mtxSplit.Lock()
+	ctl.splits[dbID] = true
+	ctl.mtxSplit.Unlock()
+	// the parent is retired: drop its ownership key, resident instance and
+	// redis hash, whose records all live on under the sub-shard hashes
+	parentKey := fmt.Sprintf("%s/vectodblite/%d", ctl.conf.EurekaApp, dbID)
+	if _, err = clientv3.NewKV(ctl.etcdCli).Delete(ctl.ctx, parentKey); err != nil {
+		err = errors.Wrap(err, "")
+		return
+	}
+	if err = ctl.release(dbID); err != nil {
+		return
+	}
+	if errD := vectodb.DropDbData(ctl.conf.RedisAddr, dbID); errD != nil {
+		log.Warnf("failed to drop redis data of split vectodblite %d, error %+v", dbID, errD)
+	}
+	log.Infof("split vectodblite %d into sub-shards %d and %d", dbID, subs[0], subs[1])
+	return
+}
+
+// searchSplit fans a search over the two sub-shards of a split database and
+// merges the per-shard results by distance (inner product: larger is better),
+// so callers see one database however many times it has split.
+func (ctl *Controller) searchSplit(ctx context.Context, reqSearch *ReqSearch) (rspSearch *RspSearch) {
+	k := reqSearch.K
+	if k < 1 {
+		k = 1
+	}
+	subs := subDbIDs(reqSearch.DbID)
+	type subResult struct {
+		xids      []uint64
+		distances []float32
+		err       error
+	}
+	var results [2]subResult
+	var wg sync.WaitGroup
+	for i := 0; i < 2; i++ {
+		wg.Add(1)
+		go func(i int) {
+			defer wg.Done()
+			results[i].xids, results[i].distances, results[i].err = ctl.searchOne(ctx, subs[i], reqSearch.Xq, k)
+		}(i)
+	}
+	wg.Wait()
+	rspSearch = &RspSearch{Xid: ^uint64(0)}
+	for i := 0; i < 2; i++ {
+		if results[i].err != nil {
+			rspSearch.Err = results[i].err.Error()
+			return
+		}
+	}
+	type hit struct {
+		xid      uint64
+		distance float32
+	}
+	hits := make([]hit, 0, 2*k)
+	for s := 0; s < 2; s++ {
+		for j := range results[s].xids {
+			if results[s].xids[j] != ^uint64(0) {
+				hits = append(hits, hit{results[s].xids[j], results[s].distances[j]})
+			}
+		}
+	}
+	sort.Slice(hits, func(i, j int) bool { return hits[i].distance > hits[j].distance })
+	if len(hits) > k {
+		hits = hits[:k]
+	}
+	if reqSearch.K > 1 {
+		rspSearch.Xids = make([]uint64, reqSearch.K)
+		rspSearch.Distances = make([]float32, reqSearch.K)
+		for j := range rspSearch.Xids {
+			rspSearch.Xids[j] = ^uint64(0)
+		}
+		for j, h := range hits {
+			rspSearch.Xids[j], rspSearch.Distances[j] = h.xid, h.distance
+		}
+	}
+	if len(hits) != 0 {
+		rspSearch.Xid, rspSearch.Distance = hits[0].xid, hits[0].distance
+	}
+	return
+}
+
+// searchOne searches a single dbID: recursing when it is itself split,
+// serving locally when resident, and posting to the owner otherwise (the
+// forward rides the redirect-following http client, so stale routing only
+// costs a hop). Returned slices hold k rows, missing hits as ^uint64(0).
+func (ctl *Controller) searchOne(ctx context.Context, dbID int, xq []float32, k int) (xids []uint64, distances []float32, err error) {
+	if ctl.isSplit(dbID) {
+		rsp := ctl.searchSplit(ctx, &ReqSearch{DbID: dbID, Xq: xq, K: k})
+		if rsp.Err != "" {
+			err = errors.New(rsp.Err)
+			return
+		}
+		if k > 1 {
+			return rsp.Xids, rsp.Distances, nil
+		}
+		return []uint64{rsp.Xid}, []float32{rsp.Distance}, nil
+	}
+	ctl.rwlock.RLock()
+	dbl, dstNodeAddr, errR := ctl.resolveVectoDBLite(ctx, dbID)
+	if errR != nil {
+		ctl.rwlock.RUnlock()
+		err = errR
+		return
+	}
+	if dbl != nil {
+		if k > 1 {
+			xids, distances, err = dbl.SearchKnn(1, k, xq)
+		} else {
+			xids = make([]uint64, 1)
+			distances = make([]float32, 1)
+			xids[0], distances[0], err = dbl.Search(xq)
+		}
+		ctl.rwlock.RUnlock()
+		return
+	}
+	ctl.rwlock.RUnlock()
+	reqSearch := ReqSearch{DbID: dbID, Xq: xq, K: k}
+	rsp := &RspSearch{}
+	if err = PostJson(ctl.hc, fmt.Sprintf("http://%s/api/v1/search", dstNodeAddr), &reqSearch, rsp); err != nil {
+		return
+	}
+	if rsp.Err != "" {
+		err = errors.New(rsp.Err)
+		return
+	}
+	if k > 1 {
+		return rsp.Xids, rsp.Distances, nil
+	}
+	return []uint64{rsp.Xid}, []float32{rsp.Distance}, nil
+}
+
+// searchBatchOne is searchOne for whole batches, used by search_batch on
+// split databases: the batch fans to both sub-shards in parallel and the
+// per-row best match wins. body is the raw binary encoding of xq, reused
+// verbatim when a sub-shard lives on another node.
+func (ctl *Controller) searchBatchOne(ctx context.Context, dbID, nq int, xq []float32, body []byte) (xids []uint64, distances []float32, err error) {
+	if ctl.isSplit(dbID) {
+		subs := subDbIDs(dbID)
+		var subXids [2][]uint64
+		var subDists [2][]float32
+		var subErrs [2]error
+		var wg sync.WaitGroup
+		for i := 0; i < 2; i++ {
+			wg.Add(1)
+			go func(i int) {
+				defer wg.Done()
+				subXids[i], subDists[i], subErrs[i] = ctl.searchBatchOne(ctx, subs[i], nq, xq, body)
+			}(i)
+		}
+		wg.Wait()
+		for i := 0; i < 2; i++ {
+			if subErrs[i] != nil {
+				err = subErrs[i]
+				return
+			}
+		}
+		xids = make([]uint64, nq)
+		distances = make([]float32, nq)
+		for i := 0; i < nq; i++ {
+			xids[i] = ^uint64(0)
+			for s := 0; s < 2; s++ {
+				if subXids[s][i] != ^uint64(0) && (xids[i] == ^uint64(0) || subDists[s][i] > distances[i]) {
+					xids[i], distances[i] = subXids[s][i], subDists[s][i]
+				}
+			}
+		}
+		return
+	}
+	ctl.rwlock.RLock()
+	dbl, dstNodeAddr, errR := ctl.resolveVectoDBLite(ctx, dbID)
+	if errR != nil {
+		ctl.rwlock.RUnlock()
+		err = errR
+		return
+	}
+	if dbl != nil {
+		xids, distances, err = dbl.SearchBatch(nq, xq)
+		ctl.rwlock.RUnlock()
+		return
+	}
+	ctl.rwlock.RUnlock()
+	return ctl.postSearchBatch(dstNodeAddr, dbID, nq, body)
+}
+
+// postSearchBatch forwards a binary search_batch body to the given node and
+// decodes the binary reply.
+func (ctl *Controller) postSearchBatch(addr string, dbID, nq int, body []byte) (xids []uint64, distances []float32, err error) {
+	servURL := fmt.Sprintf("http://%s/api/v1/search_batch?dbID=%d", addr, dbID)
+	rsp, err := ctl.hc.Post(servURL, "application/octet-stream", bytes.NewReader(body))
+	if err != nil {
+		err = errors.Wrapf(err, "servURL %+v", servURL)
+		return
+	}
+	rspBody, err := ioutil.ReadAll(rsp.Body)
+	rsp.Body.Close()
+	if err != nil {
+		err = errors.Wrapf(err, "servURL %+v", servURL)
+		return
+	}
+	if len(rspBody) != 12*nq {
+		err = errors.Errorf("servURL %+v, invalid response body length %d, want %d", servURL, len(rspBody), 12*nq)
+		return
+	}
+	xids = make([]uint64, nq)
+	distances = make([]float32, nq)
+	for i := 0; i < nq; i++ {
+		xids[i] = binary.LittleEndian.Uint64(rspBody[8*i:])
+		distances[i] = math.Float32frombits(binary.LittleEndian.Uint32(rspBody[8*nq+4*i:]))
+	}
+	return
+}
@@ -0,0 +1,203 @@
+package main
+
+// Scaling-curve harness: runs the full ingest/build/search pipeline at a
+// series of database sizes and emits one CSV row per size, so superlinear
+// knees (xid map rehash, list imbalance, mmap TLB) show up as a bend in the
+// curve long before production finds them. Vectors are synthetic and
+// generated in parallel on the fly — no dataset files are needed, so the
+// 100M point costs disk only for the base columns themselves.
+//
+//   go run bench_scaling_vectodb.go -sizes 1000000,10000000,50000000,100000000
+//
+// Per size it reports ingest rate, build wall time, activation stall (the
+// worst search latency observed while the freshly built index hot-swaps
+// in), search p50/p99 and the per-component memory footprint.
+
+import (
+	"context"
+	"flag"
+	"fmt"
+	"math/rand"
+	"os"
+	"sort"
+	"strconv"
+	"strings"
+	"sync"
+	"time"
+
+	"github.com/infinivision/vectodb"
+	log "github.com/sirupsen/logrus"
+)
+
+var (
+	sizesFlag   = flag.String("sizes", "1000000,10000000,50000000,100000000", "comma-separated database sizes")
+	dimFlag     = flag.Int("dim", 128, "vector dimension")
+	nqFlag      = flag.Int("nq", 1000, "queries per latency measurement")
+	batchFlag   = flag.Int("batch", 100000, "ingest batch size")
+	genFlag     = flag.Int("generators", 4, "parallel generator goroutines")
+	indexKey    = flag.String("indexkey", "IVF4096,PQ32", "faiss index key")
+	queryParams = flag.String("queryparams", "nprobe=256,ht=256", "faiss query params")
+	workRoot    = flag.String("workdir", "/tmp/bench_scaling_vectodb_go", "work_dir root, one subdir per size")
+)
+
+type sizeReport struct {
+	size      int
+	ingestVps float64
+	buildSec  float64
+	stallMs   float64
+	p50Ms     float64
+	p99Ms     float64
+	mem       vectodb.MemoryStats
+}
+
+// genBatches feeds deterministic random batches laid out like AddWithIds
+// into out, generating from several goroutines so ingest measures the
+// engine, not the generator.
+func genBatches(dim, batch, total, workers int, out chan<- []float32) {
+	var wg sync.WaitGroup
+	per := (total + workers - 1) / workers
+	for w := 0; w < workers; w++ {
+		n := per
+		if w == workers-1 {
+			n = total - per*(workers-1)
+		}
+		wg.Add(1)
+		go func(seed int64, n int) {
+			defer wg.Done()
+			rnd := rand.New(rand.NewSource(seed))
+			for done := 0; done < n; done += batch {
+				nb := batch
+				if n-done < nb {
+					nb = n - done
+				}
+				xb := make([]float32, nb*dim)
+				for i := range xb {
+					xb[i] = rnd.Float32()
+				}
+				out <- xb
+			}
+		}(int64(20180620+w), n)
+	}
+	wg.Wait()
+	close(out)
+}
+
+func percentile(sorted []time.Duration, p float64) (ms float64) {
+	idx := int(p * float64(len(sorted)-1))
+	ms = float64(sorted[idx]) / float64(time.Millisecond)
+	return
+}
+
+func runSize(size int) (rep sizeReport) {
+	rep.size = size
+	dim := *dimFlag
+	workDir := fmt.Sprintf("%s/%d", *workRoot, size)
+	if err := vectodb.VectodbClearWorkDir(workDir); err != nil {
+		log.Fatalf("%+v", err)
+	}
+	vdb, err := vectodb.NewVectoDB(workDir, dim, 1, *indexKey, *queryParams, 1e30, 0)
+	if err != nil {
+		log.Fatalf("%+v", err)
+	}
+
+	log.Infof("size %d: ingesting", size)
+	batches := make(chan []float32, *genFlag)
+	go genBatches(dim, *batchFlag, size, *genFlag, batches)
+	t0 := time.Now()
+	nextXid := int64(0)
+	for xb := range batches {
+		nb := len(xb) / dim
+		xids := make([]int64, nb)
+		for i := range xids {
+			xids[i] = nextXid + int64(i)
+		}
+		nextXid += int64(nb)
+		if err = vdb.AddWithIds(xb, xids); err != nil {
+			log.Fatalf("%+v", err)
+		}
+	}
+	rep.ingestVps = float64(size) / time.Since(t0).Seconds()
+	log.Infof("size %d: ingested at %.0f vec/s", size, rep.ingestVps)
+
+	// probe with 1-NN searches throughout the build: the worst latency seen
+	// in that window is the activation stall the hot swap imposed
+	xq := make([]float32, dim)
+	rnd := rand.New(rand.NewSource(20180620))
+	for i := range xq {
+		xq[i] = rnd.Float32()
+	}
+	var stall time.Duration
+	ctx, cancel := context.WithCancel(context.Background())
+	var probeWg sync.WaitGroup
+	probeWg.Add(1)
+	go func() {
+		defer probeWg.Done()
+		D := make([]float32, 1)
+		I := make([]int64, 1)
+		for ctx.Err() == nil {
+			q0 := time.Now()
+			if _, err2 := vdb.Search(xq, D, I); err2 != nil {
+				log.Fatalf("%+v", err2)
+			}
+			if d := time.Since(q0); d > stall {
+				stall = d
+			}
+			time.Sleep(10 * time.Millisecond)
+		}
+	}()
+	log.Infof("size %d: building", size)
+	t0 = time.Now()
+	if err = vdb.UpdateIndex(); err != nil {
+		log.Fatalf("%+v", err)
+	}
+	rep.buildSec = time.Since(t0).Seconds()
+	cancel()
+	probeWg.Wait()
+	rep.stallMs = float64(stall) / float64(time.Millisecond)
+	log.Infof("size %d: built in %.1fs, worst probe %.1fms", size, rep.buildSec, rep.stallMs)
+
+	lats := make([]time.Duration, 0, *nqFlag)
+	D := make([]float32, 1)
+	I := make([]int64, 1)
+	for i := 0; i < *nqFlag; i++ {
+		for j := range xq {
+			xq[j] = rnd.Float32()
+		}
+		q0 := time.Now()
+		if _, err = vdb.Search(xq, D, I); err != nil {
+			log.Fatalf("%+v", err)
+		}
+		lats = append(lats, time.Since(q0))
+	}
+	sort.Slice(lats, func(i, j int) bool { return lats[i] < lats[j] })
+	rep.p50Ms = percentile(lats, 0.50)
+	rep.p99Ms = percentile(lats, 0.99)
+	log.Infof("size %d: search p50 %.2fms p99 %.2fms", size, rep.p50Ms, rep.p99Ms)
+
+	if rep.mem, err = vdb.GetMemoryStats(); err != nil {
+		log.Fatalf("%+v", err)
+	}
+	if err = vdb.Destroy(); err != nil {
+		log.Fatalf("%+v", err)
+	}
+	return
+}
+
+func main() {
+	flag.Parse()
+	var reps []sizeReport
+	for _, s := range strings.Split(*sizesFlag, ",") {
+		size, err := strconv.Atoi(strings.TrimSpace(s))
+		if err != nil {
+			log.Fatalf("%+v", err)
+		}
+		reps = append(reps, runSize(size))
+	}
+	mb := func(b int64) float64 { return float64(b) / (1 << 20) }
+	fmt.Fprintln(os.Stdout, "size,ingest_vps,build_sec,act_stall_ms,search_p50_ms,search_p99_ms,index_mb,flat_mb,xid_mb,mapped_mb,heap_resident_mb")
+	for _, r := range reps {
+		fmt.Fprintf(os.Stdout, "%d,%.0f,%.1f,%.2f,%.3f,%.3f,%.1f,%.1f,%.1f,%.1f,%.1f\n",
+			r.size, r.ingestVps, r.buildSec, r.stallMs, r.p50Ms, r.p99Ms,
+			mb(r.mem.IndexBytes), mb(r.mem.FlatBytes), mb(r.mem.XidBytes), mb(r.mem.MappedBytes), mb(r.mem.HeapResident))
+	}
+}
@@ -167,24 +167,13 @@ func main() {
 	}
 
 	log.Infof("Loading database")
-	var xb []float32
-	var dim int
+	// Checkpointed ingest: a loader that dies mid-way resumes at the last
+	// checkpoint in workDir instead of restarting the whole file.
 	var nb int
-	if xb, dim, nb, err = fvecs_read(siftBase); err != nil {
-		log.Fatalf("%+v", err)
-	}
-	if dim != siftDim {
-		log.Fatalf("%s dim %d, expects 128", siftBase, dim)
-	}
-
-	xids := make([]int64, nb)
-	for i := 0; i < nb; i++ {
-		xids[i] = int64(i)
-	}
-
-	if err = vdb.AddWithIds(xb, xids); err != nil {
+	if nb, err = vdb.BulkLoadResumable(siftBase, 0, 100000); err != nil {
 		log.Fatalf("%+v", err)
 	}
+	log.Infof("loaded %d vectors this run", nb)
 
 	if err = vdb.UpdateIndex(); err != nil {
 		log.Fatalf("%+v", err)
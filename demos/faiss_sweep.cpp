@@ -0,0 +1,213 @@
+/**
+ * Recall/latency operating-curve harness. faiss_train and faiss_search have
+ * to be driven by hand per configuration; this sweeps an index_key grid and,
+ * for each trained index, every query-parameter combination faiss knows for
+ * it, and emits one CSV row per operating point: train/add time, serialized
+ * index size, per-query latency and recall@1/@10/@100 against the ground
+ * truth. The output is meant to be plotted or joined directly, so VectoDB
+ * constructor settings per deployment come from curves instead of folklore.
+ *
+ * Usage: faiss_sweep [datadir] [index_keys] [out_csv]
+ *   datadir     sift1M-layout dataset directory (default "sift1M"):
+ *               sift_learn.fvecs, sift_base.fvecs, sift_query.fvecs,
+ *               sift_groundtruth.ivecs
+ *   index_keys  ';'-separated faiss factory strings (commas appear inside
+ *               keys), default a representative IVF/PQ/HNSW set
+ *   out_csv     output file, default stdout
+ */
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <vector>
+
+#include "faiss/AutoTune.h"
+#include "faiss/index_io.h"
+
+using namespace std;
+
+/*****************************************************
+ * I/O functions for fvecs and ivecs
+ *****************************************************/
+
+float*
+fvecs_read(const char* fname, size_t* d_out, size_t* n_out)
+{
+    FILE* f = fopen(fname, "r");
+    if (!f) {
+        fprintf(stderr, "could not open %s\n", fname);
+        perror("");
+        abort();
+    }
+    int d;
+    fread(&d, 1, sizeof(int), f);
+    assert((d > 0 && d < 1000000) || !"unreasonable dimension");
+    fseek(f, 0, SEEK_SET);
+    struct stat st;
+    fstat(fileno(f), &st);
+    size_t sz = st.st_size;
+    assert(sz % ((d + 1) * 4) == 0 || !"weird file size");
+    size_t n = sz / ((d + 1) * 4);
+
+    *d_out = d;
+    *n_out = n;
+    float* x = new float[n * (d + 1)];
+    size_t nr = fread(x, sizeof(float), n * (d + 1), f);
+    assert(nr == n * (d + 1) || !"could not read whole file");
+
+    // shift array to remove row headers
+    for (size_t i = 0; i < n; i++)
+        memmove(x + i * d, x + 1 + i * (d + 1), d * sizeof(*x));
+
+    fclose(f);
+    return x;
+}
+
+// not very clean, but works as long as sizeof(int) == sizeof(float)
+int* ivecs_read(const char* fname, size_t* d_out, size_t* n_out)
+{
+    return (int*)fvecs_read(fname, d_out, n_out);
+}
+
+double elapsed()
+{
+    struct timeval tv;
+    gettimeofday(&tv, nullptr);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+// recall@R: fraction of queries whose true nearest neighbor appears in the
+// first R results
+double recall_at(size_t nq, size_t k, size_t R, const faiss::Index::idx_t* I, const faiss::Index::idx_t* gt, size_t gt_k)
+{
+    size_t hits = 0;
+    for (size_t i = 0; i < nq; i++) {
+        faiss::Index::idx_t nn = gt[i * gt_k];
+        for (size_t j = 0; j < min(R, k); j++) {
+            if (I[i * k + j] == nn) {
+                hits++;
+                break;
+            }
+        }
+    }
+    return double(hits) / double(nq);
+}
+
+int main(int argc, char** argv)
+{
+    double t0 = elapsed();
+    string datadir = argc > 1 ? argv[1] : "sift1M";
+    string keys = argc > 2 ? argv[2] : "IVF1024,Flat;IVF4096,Flat;IVF4096,PQ32;IVF4096,PQ8+16;PQ32;HNSW32";
+    FILE* out = stdout;
+    if (argc > 3) {
+        out = fopen(argv[3], "w");
+        if (!out) {
+            perror(argv[3]);
+            exit(-1);
+        }
+    }
+
+    size_t d, nt;
+    printf("[%.3f s] Loading train set\n", elapsed() - t0);
+    float* xt = fvecs_read((datadir + "/sift_learn.fvecs").c_str(), &d, &nt);
+
+    size_t d2, nb;
+    printf("[%.3f s] Loading database\n", elapsed() - t0);
+    float* xb = fvecs_read((datadir + "/sift_base.fvecs").c_str(), &d2, &nb);
+    assert(d == d2 || !"dataset does not have same dimension as train set");
+
+    size_t nq;
+    printf("[%.3f s] Loading queries\n", elapsed() - t0);
+    float* xq = fvecs_read((datadir + "/sift_query.fvecs").c_str(), &d2, &nq);
+    assert(d == d2 || !"query does not have same dimension as train set");
+
+    size_t gt_k, nq2;
+    printf("[%.3f s] Loading ground truth\n", elapsed() - t0);
+    int* gt_int = ivecs_read((datadir + "/sift_groundtruth.ivecs").c_str(), &gt_k, &nq2);
+    assert(nq2 == nq || !"incorrect nb of ground truth entries");
+    faiss::Index::idx_t* gt = new faiss::Index::idx_t[gt_k * nq];
+    for (size_t i = 0; i < gt_k * nq; i++)
+        gt[i] = gt_int[i];
+    delete[] gt_int;
+
+    const size_t k = 100;
+    faiss::Index::idx_t* I = new faiss::Index::idx_t[nq * k];
+    float* D = new float[nq * k];
+
+    fprintf(out, "index_key,query_params,train_s,add_s,index_bytes,ms_per_query,qps,recall_at_1,recall_at_10,recall_at_100\n");
+
+    size_t begin = 0;
+    while (begin < keys.size()) {
+        size_t end = keys.find(';', begin);
+        if (end == string::npos)
+            end = keys.size();
+        string index_key = keys.substr(begin, end - begin);
+        begin = end + 1;
+        if (index_key.empty())
+            continue;
+
+        printf("[%.3f s] Preparing index \"%s\" d=%ld\n", elapsed() - t0, index_key.c_str(), d);
+        faiss::Index* index = faiss::index_factory(d, index_key.c_str());
+
+        printf("[%.3f s] Training on %ld vectors\n", elapsed() - t0, nt);
+        double t_train = elapsed();
+        index->train(nt, xt);
+        t_train = elapsed() - t_train;
+
+        printf("[%.3f s] Indexing database, size %ld*%ld\n", elapsed() - t0, nb, d);
+        double t_add = elapsed();
+        index->add(nb, xb);
+        t_add = elapsed() - t_add;
+
+        // serialized size stands in for the memory footprint of the index
+        string tmpfp = datadir + "/.sweep_index.tmp";
+        faiss::write_index(index, tmpfp.c_str());
+        struct stat st;
+        stat(tmpfp.c_str(), &st);
+        size_t index_bytes = st.st_size;
+        unlink(tmpfp.c_str());
+
+        faiss::ParameterSpace params;
+        params.initialize(index);
+        size_t ncomb = params.n_combinations();
+        printf("[%.3f s] Sweeping %ld parameter combinations\n", elapsed() - t0, ncomb);
+
+        for (size_t c = 0; c < ncomb; c++) {
+            params.set_index_parameters(index, c);
+            string pname = params.combination_name(c);
+
+            double t_search = elapsed();
+            index->search(nq, xq, k, D, I);
+            t_search = elapsed() - t_search;
+
+            double r1 = recall_at(nq, k, 1, I, gt, gt_k);
+            double r10 = recall_at(nq, k, 10, I, gt, gt_k);
+            double r100 = recall_at(nq, k, 100, I, gt, gt_k);
+            fprintf(out, "%s,\"%s\",%.3f,%.3f,%ld,%.4f,%.1f,%.4f,%.4f,%.4f\n",
+                index_key.c_str(), pname.c_str(), t_train, t_add, index_bytes,
+                1000.0 * t_search / nq, nq / t_search, r1, r10, r100);
+            fflush(out);
+        }
+        delete index;
+    }
+
+    if (out != stdout)
+        fclose(out);
+    delete[] I;
+    delete[] D;
+    delete[] gt;
+    delete[] xt;
+    delete[] xb;
+    delete[] xq;
+    printf("[%.3f s] sweep done\n", elapsed() - t0);
+    return 0;
+}
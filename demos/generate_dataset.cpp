@@ -14,15 +14,19 @@
 #include <cstdlib>
 #include <cstring>
 
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <boost/filesystem.hpp>
 #include <fstream>
 #include <iostream>
 #include <random>
 #include <sys/time.h>
+#include <thread>
+#include <vector>
 
 #include "faiss/AutoTune.h"
 #include "faiss/IndexFlat.h"
@@ -143,7 +147,10 @@ void expand(size_t dim, float* vec, int ratio, Random& randGen, std::vector<char
     normalize(dim * ratio, (float*)(&outbuf[4]));
 }
 
-void expand_fvecs(string fp, string outdir, int repeats)
+// Expanded records are fixed size (4 + 4*d*ratio bytes), so each thread can
+// pwrite its line range directly at the right offset: no shared stream, no
+// lock, the disk sees large sequential-ish writes per thread.
+void expand_fvecs(string fp, string outdir, int repeats, int nthreads)
 {
     fs::create_directories(outdir);
 
@@ -153,14 +160,8 @@ void expand_fvecs(string fp, string outdir, int repeats)
     //sometimes we need tiny dataset
     //nb = std::min(100000UL, nb);
 
-    //https://stackoverflow.com/questions/31483349/how-can-i-open-a-file-for-reading-writing-creating-it-if-it-does-not-exist-w
-    string fp_base;
-    std::fstream fs_base;
-    fs_base.exceptions(std::ios::failbit | std::ios::badbit);
-
-    Random randGen(4, 2);
-    std::vector<char> outbuf;
-    int outlen;
+    const int ratio = 4;
+    const size_t orec = 4 + 4 * d * ratio;
 
     fs::path ph(fp);
     string fn = ph.filename().string();
@@ -169,20 +170,116 @@ void expand_fvecs(string fp, string outdir, int repeats)
         oss << outdir << "/" << fn;
         if (repeats > 1)
             oss << "." << r;
-        fp_base = oss.str();
-
-        fs_base.open(fp_base, std::fstream::out | std::fstream::binary | std::fstream::trunc);
+        string fp_base = oss.str();
 
-        for (size_t i = 0; i < nb; i++) {
-            expand(d, &xb[d * i], 4, randGen, outbuf, outlen);
-            fs_base.write(&outbuf[0], outlen);
+        int fd = open(fp_base.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            perror(fp_base.c_str());
+            abort();
+        }
+        if (ftruncate(fd, (off_t)(nb * orec)) != 0) {
+            perror("ftruncate");
+            abort();
+        }
+        std::vector<std::thread> workers;
+        for (int t = 0; t < nthreads; t++) {
+            workers.emplace_back([&, t]() {
+                //Random seeds from random_device per instance, one per thread
+                Random randGen(4, 2);
+                std::vector<char> outbuf;
+                int outlen;
+                size_t begin = nb * t / nthreads;
+                size_t end = nb * (t + 1) / nthreads;
+                for (size_t i = begin; i < end; i++) {
+                    expand(d, &xb[d * i], ratio, randGen, outbuf, outlen);
+                    assert((size_t)outlen == orec);
+                    ssize_t wr = pwrite(fd, &outbuf[0], outlen, (off_t)(i * orec));
+                    assert(wr == outlen);
+                }
+            });
         }
-        fs_base.close();
+        for (auto& w : workers)
+            w.join();
+        close(fd);
         printf("[%.3f s] done %s\n", elapsed() - t0, fp_base.c_str());
     }
     delete[] xb;
 }
 
+// synth_fvecs generates n dim-d vectors from scratch, multi-threaded with
+// per-thread RNG streams. With nclusters > 0 vectors are drawn around that
+// many shared centers with 1/(rank+1)-skewed popularity, so an IVF built on
+// the data gets imbalanced inverted lists the way production data does;
+// nclusters == 0 gives plain normalized gaussian noise.
+void synth_fvecs(const string& fp, size_t n, size_t dim, int nclusters, int nthreads, unsigned long seed)
+{
+    std::mt19937_64 e0(seed);
+    std::normal_distribution<float> unit_dist(0, 1);
+    std::vector<float> centers((size_t)std::max(nclusters, 0) * dim);
+    for (size_t i = 0; i < centers.size(); i++)
+        centers[i] = unit_dist(e0);
+    std::vector<double> cdf(std::max(nclusters, 0));
+    if (nclusters > 0) {
+        double sum = 0;
+        for (int i = 0; i < nclusters; i++) {
+            sum += 1.0 / (i + 1);
+            cdf[i] = sum;
+        }
+        for (int i = 0; i < nclusters; i++)
+            cdf[i] /= sum;
+    }
+
+    int fd = open(fp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(fp.c_str());
+        abort();
+    }
+    const size_t rec = 4 + 4 * dim;
+    if (ftruncate(fd, (off_t)(n * rec)) != 0) {
+        perror("ftruncate");
+        abort();
+    }
+    std::vector<std::thread> workers;
+    for (int t = 0; t < nthreads; t++) {
+        workers.emplace_back([&, t]() {
+            //independent per-thread stream from the shared seed
+            std::mt19937_64 e(seed + 0x9e3779b97f4a7c15UL * (unsigned long)(t + 1));
+            std::normal_distribution<float> noise(0, nclusters > 0 ? 0.05f : 1.0f);
+            std::uniform_real_distribution<double> uni(0.0, 1.0);
+            size_t begin = n * t / nthreads;
+            size_t end = n * (t + 1) / nthreads;
+            const size_t batch = 1024;
+            std::vector<char> buf(batch * rec);
+            size_t i = begin;
+            while (i < end) {
+                size_t m = std::min(batch, end - i);
+                for (size_t b = 0; b < m; b++) {
+                    char* p = &buf[b * rec];
+                    *(int*)p = (int)dim;
+                    float* v = (float*)(p + 4);
+                    const float* c = nullptr;
+                    if (nclusters > 0) {
+                        size_t ci = std::lower_bound(cdf.begin(), cdf.end(), uni(e)) - cdf.begin();
+                        if (ci >= (size_t)nclusters)
+                            ci = nclusters - 1;
+                        c = &centers[ci * dim];
+                    }
+                    for (size_t j = 0; j < dim; j++)
+                        v[j] = (c ? c[j] : 0.0f) + noise(e);
+                    normalize(dim, v);
+                }
+                ssize_t wr = pwrite(fd, buf.data(), m * rec, (off_t)(i * rec));
+                assert(wr == (ssize_t)(m * rec));
+                i += m;
+            }
+        });
+    }
+    for (auto& w : workers)
+        w.join();
+    close(fd);
+    printf("[%.3f s] done %s, %zu x %zud, %d clusters\n", elapsed() - t0, fp.c_str(), n, dim, nclusters);
+}
+
 void generate_groundtruth(string fp_base, string fp_query, string outdir, int seq)
 {
     size_t d, nb;
@@ -223,19 +320,38 @@ void generate_groundtruth(string fp_base, string fp_query, string outdir, int se
 
 int main(int argc, char** argv)
 {
-    const string usage("generate_dataset [base|query|ground] [repeats]");
-    if (argc < 2 || argc > 3) {
+    const string usage("generate_dataset base <repeats> [threads]\n"
+                       "generate_dataset query\n"
+                       "generate_dataset ground <repeats>\n"
+                       "generate_dataset synth <n> <dim> <nclusters> [threads] [seed]");
+    if (argc < 2) {
         cerr << usage << endl;
         exit(-1);
     }
     string outdir("sift100M");
     t0 = elapsed();
+    int nthreads = (int)std::max(1u, std::thread::hardware_concurrency());
 
     if (strcmp(argv[1], "base") == 0) {
         int repeats = atoi(argv[2]);
-        expand_fvecs("sift1M/sift_base.fvecs", outdir, repeats);
+        if (argc > 3)
+            nthreads = std::max(1, atoi(argv[3]));
+        expand_fvecs("sift1M/sift_base.fvecs", outdir, repeats, nthreads);
     } else if (strcmp(argv[1], "query") == 0) {
-        expand_fvecs("sift1M/sift_query.fvecs", outdir, 1);
+        expand_fvecs("sift1M/sift_query.fvecs", outdir, 1, 1);
+    } else if (strcmp(argv[1], "synth") == 0) {
+        if (argc < 5) {
+            cerr << usage << endl;
+            exit(-1);
+        }
+        size_t n = (size_t)atol(argv[2]);
+        size_t dim = (size_t)atol(argv[3]);
+        int nclusters = atoi(argv[4]);
+        if (argc > 5)
+            nthreads = std::max(1, atoi(argv[5]));
+        unsigned long seed = argc > 6 ? (unsigned long)atol(argv[6]) : 42;
+        fs::create_directories(outdir);
+        synth_fvecs(outdir + "/synth_base.fvecs", n, dim, nclusters, nthreads, seed);
     } else {
         int repeats = atoi(argv[2]);
         for (int i = 0; i < repeats; i++) {
@@ -796,6 +796,24 @@ Index *index_factory (int d, const char *description_in, MetricType metric)
             del_coarse_quantizer.release ();
             index_ivf->own_fields = true;
             index_1 = index_ivf;
+        } else if (!index && stok.size() > 2 &&
+                   stok.compare (stok.size() - 2, 2, "x4") == 0 &&
+                   sscanf (tok, "PQ%dx4", &M) == 1) {
+            // 4-bit PQ, scanned with the SIMD fast-scan path of IndexIVFPQ
+            if (coarse_quantizer) {
+                IndexIVFPQ *index_ivf = new IndexIVFPQ (
+                    coarse_quantizer, d, ncentroids, M, 4);
+                index_ivf->quantizer_trains_alone =
+                    get_trains_alone (coarse_quantizer);
+                index_ivf->metric_type = metric;
+                index_ivf->cp.spherical = metric == METRIC_INNER_PRODUCT;
+                del_coarse_quantizer.release ();
+                index_ivf->own_fields = true;
+                index_ivf->do_polysemous_training = false;
+                index_1 = index_ivf;
+            } else {
+                index_1 = new IndexPQ (d, M, 4, metric);
+            }
         } else if (!index && (sscanf (tok, "PQ%d", &M) == 1 ||
                               sscanf (tok, "PQ%dnp", &M) == 1)) {
             bool do_polysemous_training = stok.find("np") == std::string::npos;
@@ -32,7 +32,9 @@ ClusteringParameters::ClusteringParameters ():
     frozen_centroids(false),
     min_points_per_centroid(39),
     max_points_per_centroid(256),
-    seed(1234)
+    seed(1234),
+    minibatch_niter(0),
+    minibatch_frac(0.1f)
 {}
 // 39 corresponds to 10000 / 256 -> to avoid warnings on PQ tests with randu10k
 
@@ -182,6 +184,48 @@ void Clustering::train (idx_t nx, const float *x_in, Index & index) {
         }
 
         index.add (k, centroids.data());
+
+        // stage 1: minibatch iterations on a fresh random sample each time;
+        // cheap approximate assignments move the centroids most of the way
+        // before the full-batch iterations below refine them
+        if (minibatch_niter > 0) {
+            idx_t nmb = (idx_t)(nx * minibatch_frac);
+            if (nmb < (idx_t)k) nmb = (idx_t)k;
+            if (nmb > nx) nmb = nx;
+            std::vector<float> xmb (nmb * d);
+            RandomGenerator rng (seed + 3 + redo * 19349663L);
+            for (int i = 0; i < minibatch_niter; i++) {
+                for (idx_t j = 0; j < nmb; j++) {
+                    idx_t pick = rng.rand_long () % nx;
+                    memcpy (&xmb[j * d], x + pick * d, d * sizeof (float));
+                }
+                double t0s = getmillisecs();
+                index.search (nmb, xmb.data(), 1, dis, assign);
+                t_search_tot += getmillisecs() - t0s;
+
+                km_update_centroids (
+                      xmb.data(), centroids.data(),
+                      assign, d, k, nmb,
+                      frozen_centroids ? n_input_centroids : 0);
+
+                if (verbose) {
+                    printf ("  Minibatch iteration %d / %d (%.2f s)     \r",
+                            i, minibatch_niter,
+                            (getmillisecs() - t0) / 1000.0);
+                    fflush (stdout);
+                }
+
+                if (spherical)
+                    fvec_renorm_L2 (d, k, centroids.data());
+
+                index.reset ();
+                if (update_index)
+                    index.train (k, centroids.data());
+                index.add (k, centroids.data());
+            }
+            if (verbose) printf("\n");
+        }
+
         float err = 0;
         for (int i = 0; i < niter; i++) {
             double t0s = getmillisecs();
@@ -35,6 +35,13 @@ struct ClusteringParameters {
 
     int seed; ///< seed for the random number generator
 
+    /// nb of minibatch iterations run before the niter full-batch ones.
+    /// Each one assigns and updates on a fresh random sample of
+    /// minibatch_frac * n points, moving the centroids most of the way at a
+    /// fraction of the cost; the full-batch iterations then refine. 0 = off.
+    int minibatch_niter;
+    float minibatch_frac; ///< sample fraction per minibatch iteration
+
     /// sets reasonable defaults
     ClusteringParameters ();
 };
@@ -28,7 +28,10 @@
 #include <cassert>
 #include <cstdio>
 
+#include <algorithm>
 #include <limits>
+#include <utility>
+#include <vector>
 
 
 
@@ -491,6 +494,90 @@ void indirect_heap_push (size_t k,
 
 
 
+/*******************************************************************
+ * Buffered top-k selection
+ *
+ * Alternative to a binary heap for small k. Every candidate is compared
+ * against a running threshold (the current k-th best value) with a single
+ * well-predicted branch; the rare survivors are buffered and folded into
+ * the kept set with one partial sort once the buffer fills. This removes
+ * the branch-miss heavy per-candidate heap maintenance from scan loops,
+ * and the threshold compare is trivially auto-vectorized when the caller
+ * has an array of distances at hand.
+ *
+ * C is CMax<...> to collect minima (as in L2 search), CMin<...> to
+ * collect maxima (inner product), ie. the same convention as HeapArray.
+ * finalize() leaves vals/ids sorted best-first like heap_reorder.
+ *******************************************************************/
+
+template <class C>
+struct BufferedTopk {
+    typedef typename C::T T;
+    typedef typename C::TI TI;
+
+    static const size_t bufsize = 32;
+
+    size_t k;
+    T * vals;   /// k result values, valid after finalize()
+    TI * ids;
+    T threshold;   /// worst kept value once n_kept == k, else neutral
+    size_t n_kept;
+    size_t n_buf;
+    T buf_val [bufsize];
+    TI buf_id [bufsize];
+    std::vector<std::pair<T, TI> > scratch;
+
+    BufferedTopk (size_t k, T * vals, TI * ids):
+        k (k), vals (vals), ids (ids),
+        threshold (C::neutral()), n_kept (0), n_buf (0)
+    {}
+
+    /// consider one candidate
+    inline void add (T val, TI id)
+    {
+        if (C::cmp (threshold, val)) {
+            buf_val [n_buf] = val;
+            buf_id [n_buf] = id;
+            if (++n_buf == bufsize)
+                flush ();
+        }
+    }
+
+    /// fold the buffer into the kept set, tighten the threshold
+    void flush ()
+    {
+        if (n_buf == 0) return;
+        scratch.resize (n_kept + n_buf);
+        for (size_t i = 0; i < n_kept; i++)
+            scratch [i] = std::make_pair (vals [i], ids [i]);
+        for (size_t i = 0; i < n_buf; i++)
+            scratch [n_kept + i] = std::make_pair (buf_val [i], buf_id [i]);
+        size_t nk = scratch.size() < k ? scratch.size() : k;
+        std::partial_sort (scratch.begin(), scratch.begin() + nk, scratch.end(),
+            [] (const std::pair<T, TI> & a, const std::pair<T, TI> & b)
+                { return C::cmp (b.first, a.first); });
+        for (size_t i = 0; i < nk; i++) {
+            vals [i] = scratch [i].first;
+            ids [i] = scratch [i].second;
+        }
+        n_kept = nk;
+        n_buf = 0;
+        if (n_kept == k)
+            threshold = vals [k - 1];
+    }
+
+    /// flush and pad up to k entries, like heap_reorder on a padded heap
+    void finalize ()
+    {
+        flush ();
+        for (size_t i = n_kept; i < k; i++) {
+            vals [i] = C::neutral ();
+            ids [i] = -1;
+        }
+    }
+};
+
+
 
 } // namespace faiss
 
@@ -77,6 +77,19 @@ struct VisitedTable {
     }
 };
 
+/** Reusable per-thread VisitedTable, so concurrent searches do not
+ * allocate and clear ntotal bytes per query batch. The table only
+ * grows; marks of the previous search are invalidated by advancing
+ * the generation counter instead of a memset. */
+static VisitedTable& get_per_thread_visited_table (int size)
+{
+    static thread_local VisitedTable vt (0);
+    if ((int)vt.visited.size() < size)
+        vt.visited.resize (size, 0); // new slots read as not visited
+    vt.advance ();
+    return vt;
+}
+
 
 namespace {
 
@@ -982,7 +995,7 @@ void IndexHNSW::search (idx_t n, const float *x, idx_t k,
 {
 
     {
-        VisitedTable vt (ntotal);
+        VisitedTable& vt = get_per_thread_visited_table (ntotal);
         DistanceComputer *dis = get_distance_computer();
         ScopeDeleter1<DistanceComputer> del(dis);
         size_t nreorder = 0;
@@ -1090,7 +1103,7 @@ void IndexHNSW::search_level_0(
         DistanceComputer *qdis = get_distance_computer();
         ScopeDeleter1<DistanceComputer> del(qdis);
 
-        VisitedTable vt (ntotal);
+        VisitedTable& vt = get_per_thread_visited_table (ntotal);
 
         for(idx_t i = 0; i < n; i++) {
             idx_t * idxi = labels + i * k;
@@ -2068,7 +2081,7 @@ void IndexHNSW2Level::search (idx_t n, const float *x, idx_t k,
             n, x, k, coarse_assign, coarse_dis, distances, labels, false);
 
         {
-            VisitedTable vt (ntotal);
+            VisitedTable& vt = get_per_thread_visited_table (ntotal);
             DistanceComputer *dis = get_distance_computer();
             ScopeDeleter1<DistanceComputer> del(dis);
 
@@ -179,7 +179,10 @@ size_t ArrayInvertedLists::add_entries (
 size_t ArrayInvertedLists::list_size(size_t list_no) const
 {
     assert (list_no < nlist);
-    return ids[list_no].size();
+    // derived from the codes, not the ids: callers may free the id arrays
+    // once an external id table replaces them, and the lists must still
+    // report their true length to the scan loops
+    return codes[list_no].size() / code_size;
 }
 
 const uint8_t * ArrayInvertedLists::get_codes (size_t list_no) const
@@ -14,6 +14,8 @@
 
 #include <cstdio>
 
+#include <omp.h>
+
 #include "utils.h"
 
 #include "FaissAssert.h"
@@ -62,7 +64,25 @@ void IndexIVFFlat::add_core (idx_t n, const float * x, const long *xids,
         idx = idx0;
     }
     long n_add = 0;
-    for (size_t i = 0; i < n; i++) {
+    if (!maintain_direct_map && n > 1024) {
+        // add_entry on *different* lists may run concurrently (see
+        // InvertedLists): each thread owns the lists with
+        // list_no % nt == rank, so the appends need no locks
+#pragma omp parallel reduction(+: n_add)
+        {
+            int nt = omp_get_num_threads ();
+            int rank = omp_get_thread_num ();
+            for (size_t i = 0; i < n; i++) {
+                long list_no = idx [i];
+                if (list_no < 0 || list_no % nt != rank)
+                    continue;
+                long id = xids ? xids[i] : ntotal + i;
+                invlists->add_entry (list_no, id,
+                                     (const uint8_t*) (x + i * d));
+                n_add++;
+            }
+        }
+    } else for (size_t i = 0; i < n; i++) {
         long id = xids ? xids[i] : ntotal + i;
         long list_no = idx [i];
 
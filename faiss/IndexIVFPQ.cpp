@@ -18,6 +18,12 @@
 
 #include <algorithm>
 
+#include <omp.h>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
 #include "Heap.h"
 #include "utils.h"
 
@@ -52,6 +58,7 @@ IndexIVFPQ::IndexIVFPQ (Index * quantizer, size_t d, size_t nlist,
     by_residual = true;
     use_precomputed_table = 0;
     scan_table_threshold = 0;
+    early_termination_dis = HUGE_VALF;
 
     polysemous_training = nullptr;
     do_polysemous_training = false;
@@ -243,8 +250,8 @@ void IndexIVFPQ::add_core_o (idx_t n, const float * x, const long *xids,
 
     if (by_residual) {
         float *residuals = new float [n * d];
-        // TODO: parallelize?
-        for (size_t i = 0; i < n; i++) {
+#pragma omp parallel for
+        for (idx_t i = 0; i < n; i++) {
             if (idx[i] < 0)
                 memset (residuals + i * d, 0, sizeof(*residuals) * d);
             else
@@ -259,9 +266,44 @@ void IndexIVFPQ::add_core_o (idx_t n, const float * x, const long *xids,
     pq.compute_codes (to_encode, xcodes, n);
 
     double t2 = getmillisecs ();
-    // TODO: parallelize?
     size_t n_ignore = 0;
-    for (size_t i = 0; i < n; i++) {
+    if (!maintain_direct_map && n > 1024) {
+        // the append loop is where large adds go serial. add_entry on
+        // *different* lists may run concurrently (see InvertedLists), so
+        // each thread owns the lists with list_no % nt == rank and scans
+        // the batch for its keys; no locks needed. The direct_map case
+        // stays below: push_back order must follow i.
+#pragma omp parallel reduction(+: n_ignore)
+        {
+            int nt = omp_get_num_threads ();
+            int rank = omp_get_thread_num ();
+            for (size_t i = 0; i < n; i++) {
+                idx_t key = idx[i];
+                if (key < 0) {
+                    if (rank == 0) {
+                        n_ignore ++;
+                        if (residuals_2)
+                            memset (residuals_2 + i * d, 0,
+                                    sizeof(*residuals_2) * d);
+                    }
+                    continue;
+                }
+                if (key % nt != rank)
+                    continue;
+                idx_t id = xids ? xids[i] : ntotal + i;
+                uint8_t *code = xcodes + i * code_size;
+                invlists->add_entry (key, id, code);
+
+                if (residuals_2) {
+                    float *res2 = residuals_2 + i * d;
+                    const float *xi = to_encode + i * d;
+                    pq.decode (code, res2);
+                    for (int j = 0; j < d; j++)
+                        res2[j] = xi[j] - res2[j];
+                }
+            }
+        }
+    } else for (size_t i = 0; i < n; i++) {
         idx_t key = idx[i];
         if (key < 0) {
             n_ignore ++;
@@ -742,10 +784,117 @@ struct InvertedListScanner: QueryTables {
      * Scaning the codes: simple PQ scan.
      *****************************************************/
 
+#ifdef __AVX2__
+    /** 4-bit fast-scan: the M 16-entry distance tables are quantized to
+     * uint8 and held in SIMD registers; one PSHUFB looks up 32 codes per
+     * instruction and distances accumulate in 16-bit lanes. The scan is
+     * exact: a candidate that passes the quantized threshold (widened by
+     * the worst-case quantization error) is rescored with the float
+     * tables before entering the heap. Codes of each 32-vector block are
+     * transposed on the fly to the sub-quantizer-major layout PSHUFB
+     * needs; the transpose is sequential byte traffic and is much
+     * cheaper than the M float table lookups it replaces. */
+    void scan_list_with_table_4bit (
+             size_t k, float * heap_sim, long * heap_ids, bool store_pairs)
+    {
+        float dis0 = precompute_list_tables ();
+        const size_t M = pq.M;
+
+        // quantize tables with a shared scale: tab[m][c] ~ lo[m] + scale * qtab[m][c]
+        std::vector<uint8_t> qtab (M * 16);
+        std::vector<float> lo (M);
+        float bias = 0, range = 0;
+        for (size_t m = 0; m < M; m++) {
+            const float *tab = sim_table + m * pq.ksub;
+            float lom = tab[0], him = tab[0];
+            for (int c = 1; c < 16; c++) {
+                lom = std::min (lom, tab[c]);
+                him = std::max (him, tab[c]);
+            }
+            lo[m] = lom;
+            bias += lom;
+            range = std::max (range, him - lom);
+        }
+        float scale = range > 0 ? range / 255.0f : 1.0f;
+        for (size_t m = 0; m < M; m++) {
+            const float *tab = sim_table + m * pq.ksub;
+            for (int c = 0; c < 16; c++) {
+                float q = floorf ((tab[c] - lo[m]) / scale + 0.5f);
+                qtab[m * 16 + c] = (uint8_t)std::min (q, 255.0f);
+            }
+        }
+        // worst-case rounding error of the accumulated distance
+        float margin = 0.5f * scale * M;
+
+        std::vector<uint8_t> tr (32 * M);
+        uint16_t sums[32] __attribute__ ((aligned (32)));
+        size_t j0 = 0;
+        for (; j0 + 32 <= list_size; j0 += 32) {
+            const uint8_t *codes = list_codes + j0 * M;
+            for (size_t j = 0; j < 32; j++)
+                for (size_t m = 0; m < M; m++)
+                    tr[m * 32 + j] = codes[j * M + m] & 15;
+            __m256i acc_lo = _mm256_setzero_si256 ();
+            __m256i acc_hi = _mm256_setzero_si256 ();
+            for (size_t m = 0; m < M; m++) {
+                __m256i tab = _mm256_broadcastsi128_si256 (
+                    _mm_loadu_si128 ((const __m128i*)(qtab.data() + m * 16)));
+                __m256i idx = _mm256_loadu_si256 ((const __m256i*)(tr.data() + m * 32));
+                __m256i vals = _mm256_shuffle_epi8 (tab, idx);
+                acc_lo = _mm256_add_epi16 (acc_lo,
+                    _mm256_cvtepu8_epi16 (_mm256_castsi256_si128 (vals)));
+                acc_hi = _mm256_add_epi16 (acc_hi,
+                    _mm256_cvtepu8_epi16 (_mm256_extracti128_si256 (vals, 1)));
+            }
+            _mm256_store_si256 ((__m256i*)&sums[0], acc_lo);
+            _mm256_store_si256 ((__m256i*)&sums[16], acc_hi);
+            for (size_t j = 0; j < 32; j++) {
+                float dis = dis0 + bias + scale * sums[j];
+                if (dis - margin < heap_sim[0]) {
+                    float ed = dis0;
+                    const uint8_t *code = codes + j * M;
+                    const float *tab = sim_table;
+                    for (size_t m = 0; m < M; m++) {
+                        ed += tab[code[m]];
+                        tab += pq.ksub;
+                    }
+                    if (ed < heap_sim[0]) {
+                        maxheap_pop (k, heap_sim, heap_ids);
+                        long id = store_pairs ? (key << 32 | (j0 + j))
+                                              : list_ids[j0 + j];
+                        maxheap_push (k, heap_sim, heap_ids, ed, id);
+                    }
+                }
+            }
+        }
+        // scalar tail
+        for (size_t j = j0; j < list_size; j++) {
+            float dis = dis0;
+            const uint8_t *code = list_codes + j * M;
+            const float *tab = sim_table;
+            for (size_t m = 0; m < M; m++) {
+                dis += tab[code[m]];
+                tab += pq.ksub;
+            }
+            if (dis < heap_sim[0]) {
+                maxheap_pop (k, heap_sim, heap_ids);
+                long id = store_pairs ? (key << 32 | j) : list_ids[j];
+                maxheap_push (k, heap_sim, heap_ids, dis, id);
+            }
+        }
+    }
+#endif
+
     /// version of the scan where we use precomputed tables
     void scan_list_with_table (
              size_t k, float * heap_sim, long * heap_ids, bool store_pairs)
     {
+#ifdef __AVX2__
+        if (pq.nbits == 4 && list_size >= 32) {
+            scan_list_with_table_4bit (k, heap_sim, heap_ids, store_pairs);
+            return;
+        }
+#endif
         float dis0 = precompute_list_tables ();
 
         for (size_t j = 0; j < list_size; j++) {
@@ -849,8 +998,10 @@ struct InvertedListScanner: QueryTables {
     size_t n_hamming_pass;
 
 
-    template <class HammingComputer>
-    void scan_list_polysemous_hc (
+    // scratch of the batched Hamming prefilter, reused across lists
+    std::vector<hamdis_t> hdis_scratch;
+
+    void scan_list_polysemous (
              size_t k, float * heap_sim, long * heap_ids, bool store_pairs)
     {
         float dis0 = precompute_list_tables ();
@@ -858,11 +1009,16 @@ struct InvertedListScanner: QueryTables {
 
         int code_size = pq.code_size;
 
-        HammingComputer hc (q_code.data(), code_size);
+        // batched prefilter: one pass over the codes with the
+        // runtime-dispatched Hamming kernel (AVX2 / AVX-512 VPOPCNT),
+        // then only survivors touch the distance tables
+        hdis_scratch.resize (list_size);
+        hammings_1_to_n (q_code.data(), list_codes, list_size,
+                         code_size, hdis_scratch.data());
 
         for (size_t j = 0; j < list_size; j++) {
             const uint8_t *b_code = list_codes;
-            int hd = hc.hamming (b_code);
+            int hd = hdis_scratch[j];
             if (hd < ht) {
                 n_hamming_pass ++;
 
@@ -884,33 +1040,6 @@ struct InvertedListScanner: QueryTables {
         }
     }
 
-    void scan_list_polysemous (
-             size_t k, float * heap_sim, long * heap_ids, bool store_pairs)
-    {
-        switch (pq.code_size) {
-#define HANDLE_CODE_SIZE(cs)  \
-        case cs:  \
-            scan_list_polysemous_hc <HammingComputer ## cs> \
-                (k, heap_sim, heap_ids, store_pairs); \
-            break
-        HANDLE_CODE_SIZE(4);
-        HANDLE_CODE_SIZE(8);
-        HANDLE_CODE_SIZE(16);
-        HANDLE_CODE_SIZE(20);
-        HANDLE_CODE_SIZE(32);
-        HANDLE_CODE_SIZE(64);
-#undef HANDLE_CODE_SIZE
-        default:
-            if (pq.code_size % 8 == 0)
-                scan_list_polysemous_hc <HammingComputerM8>
-                    (k, heap_sim, heap_ids, store_pairs);
-            else
-                scan_list_polysemous_hc <HammingComputerM4>
-                    (k, heap_sim, heap_ids, store_pairs);
-            break;
-        }
-    }
-
 };
 
 
@@ -956,6 +1085,12 @@ void IndexIVFPQ::search_preassigned (idx_t nx, const float *qx, idx_t k,
             uint64_t t0;
             TIC;
             maxheap_heapify (k, heap_sim, heap_ids);
+            if (early_termination_dis < HUGE_VALF) {
+                // seed the heap with the termination distance: candidates
+                // over it never enter, their slots keep the -1 label
+                for (size_t j = 0; j < k; j++)
+                    heap_sim[j] = early_termination_dis;
+            }
             heap_cycles += TOC;
 
             TIC;
@@ -971,14 +1106,25 @@ void IndexIVFPQ::search_preassigned (idx_t nx, const float *qx, idx_t k,
                     continue;
                 }
 
+                if (early_termination_dis < HUGE_VALF) {
+                    // keys are sorted by coarse distance, so once a list's
+                    // centroid fails the termination distance the remaining
+                    // lists fail it too
+                    float coarse = metric_type == METRIC_INNER_PRODUCT ?
+                        -coarse_dis_i[ik] : coarse_dis_i[ik];
+                    if (coarse > early_termination_dis) break;
+                }
+
                 size_t list_size = invlists->list_size (key);
                 stats_nlist ++;
                 nscan += list_size;
 
                 if (list_size == 0) continue;
 
-                qt.init_list (key, coarse_dis_i[ik],
-                              list_size, invlists->get_ids (key),
+                // with store_pairs the scan emits (list, offset) pairs and
+                // never reads the ids, so they may not even be materialized
+                qt.init_list (key, coarse_dis_i[ik], list_size,
+                              store_pairs ? nullptr : invlists->get_ids (key),
                               invlists->get_codes (key));
 
                 TIC;
@@ -1026,6 +1172,7 @@ IndexIVFPQ::IndexIVFPQ ()
     // initialize some runtime values
     use_precomputed_table = 0;
     scan_table_threshold = 0;
+    early_termination_dis = HUGE_VALF;
     do_polysemous_training = false;
     polysemous_ht = 0;
     polysemous_training = nullptr;
@@ -38,6 +38,14 @@ struct IndexIVFPQ: IndexIVF {
     size_t scan_table_threshold;   ///< use table computation or on-the-fly?
     int polysemous_ht;             ///< Hamming thresh for polysemous filtering
 
+    /// runtime, not serialized. When finite, the result heap is seeded with
+    /// this internal (smaller-is-better) distance so only candidates under it
+    /// enter, and the probe loop stops at the first list whose coarse
+    /// distance already fails it (keys arrive sorted by coarse distance).
+    /// For threshold-filtered callers this skips the work of queries whose
+    /// results would be discarded anyway.
+    float early_termination_dis;
+
 
     /// if use_precompute_table
     /// size nlist * pq.M * pq.ksub
@@ -455,9 +455,13 @@ struct Score3Computer: PermutationObjective {
     Taccu compute (const int * perm) const
     {
         Taccu accu = 0;
-        const Ttab *p = n_gt.data();
+        // the i-slices of the cube are disjoint, a reduction sums them up.
+        // When the caller already runs one sub-quantizer per thread the
+        // region does not nest and the loop stays serial there.
+#pragma omp parallel for reduction(+: accu)
         for (int i = 0; i < nc; i++) {
             int ip = perm [i];
+            const Ttab *p = n_gt.data() + (size_t)i * nc * nc;
             for (int j = 0; j < nc; j++) {
                 int jp = perm [j];
                 for (int k = 0; k < nc; k++) {
@@ -489,10 +493,13 @@ struct Score3Computer: PermutationObjective {
         if (iw > jw) std::swap (iw, jw);
 
         Taccu accu = 0;
-        const Ttab * n_gt_i = n_gt.data();
+        // evaluating one candidate swap walks the i-slices independently,
+        // so the evaluation parallelizes with a reduction like compute()
+#pragma omp parallel for reduction(+: accu)
         for (int i = 0; i < nc; i++) {
             int ip0 = perm [i];
             int ip = perm [i == iw ? jw : i == jw ? iw : i];
+            const Ttab * n_gt_i = n_gt.data() + (size_t)i * nc * nc;
 
             //accu += update_i (perm, iw, jw, ip0, ip, n_gt_i);
 
@@ -502,8 +509,6 @@ struct Score3Computer: PermutationObjective {
             if (ip != ip0)
                 accu += update_i_plane (perm, iw, jw,
                                        ip0, ip, n_gt_i);
-
-            n_gt_i += nc * nc;
         }
 
         return accu;
@@ -702,6 +707,11 @@ struct RankingScore2: Score3Computer<float, double> {
 
     void init_n_gt ()
     {
+        // queries are independent except that two queries with the same
+        // code accumulate into the same plane of n_gt, so each query sums
+        // into a local plane and merges it under the critical section; the
+        // merge is nc^2 adds, noise next to the weight accumulation itself
+#pragma omp parallel for schedule(dynamic)
         for (int q = 0; q < nq; q++) {
             const float *gtd = gt_distances + q * nb;
             const uint32_t *cb = bcodes;// all same codes
@@ -729,14 +739,20 @@ struct RankingScore2: Score3Computer<float, double> {
 
             // this is very expensive. Any suggestion for improvement
             // welcome.
+            std::vector<float> plane (nc * nc);
             for (int i = 0; i < nc; i++) {
                 std::vector<int> & di = tab[i];
                 for (int j = 0; j < nc; j++) {
                     std::vector<int> & dj = tab[j];
-                    n_gt_q [i * nc + j] += accum_gt_weight_diff (di, dj);
+                    plane [i * nc + j] = accum_gt_weight_diff (di, dj);
 
                 }
             }
+#pragma omp critical
+            {
+                for (int i = 0; i < nc * nc; i++)
+                    n_gt_q [i] += plane [i];
+            }
 
         }
 
@@ -768,8 +784,15 @@ void PolysemousTraining::optimize_reproduce_distances (
 
     int n = pq.ksub;
     int nbits = pq.nbits;
-
-    for (int m = 0; m < pq.M; m++) {
+    const int M = pq.M;
+
+    // the sub-quantizers are independent: each annealing reads and permutes
+    // only its own centroids, and each m builds its own optimizer from the
+    // same parameters, so the result is identical to the serial run. With a
+    // log_pattern the loop stays serial: the optimizer throws if a log file
+    // cannot be opened, and throwing out of a parallel region aborts.
+#pragma omp parallel for schedule(dynamic) if (log_pattern.size() == 0)
+    for (int m = 0; m < M; m++) {
         std::vector<double> dis_table;
 
         // printf ("Optimizing quantizer %d\n", m);
@@ -839,7 +862,12 @@ void PolysemousTraining::optimize_ranking (
     if (n == 0)
         pq.compute_sdc_table ();
 
-    for (int m = 0; m < pq.M; m++) {
+    const int M = pq.M;
+
+    // same independence argument as optimize_reproduce_distances: one
+    // sub-quantizer per iteration, nothing shared but the training set
+#pragma omp parallel for schedule(dynamic) if (log_pattern.size() == 0)
+    for (int m = 0; m < M; m++) {
         size_t nq, nb;
         std::vector <uint32_t> codes; // query codes, then db codes
         std::vector <float> gt_distances; // nq * nb matrix of distances
@@ -32,6 +32,10 @@
 #include <assert.h>
 #include <limits.h>
 
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
 #include "Heap.h"
 #include "FaissAssert.h"
 
@@ -440,6 +444,119 @@ void hammings (
 }
 
 
+/*********************************************************
+ * Batched 1-to-n Hamming distances, runtime-dispatched
+ *
+ * Same dispatch mechanism as the AVX-512 kernels in utils.cpp: variants
+ * compiled via the target attribute, CPU tested once at startup.
+ *********************************************************/
+
+static void hammings_1_to_n_ref (
+        const uint8_t * q, const uint8_t * codes,
+        size_t n, size_t code_size, hamdis_t * dis)
+{
+    size_t n8 = code_size / 8;
+    for (size_t j = 0; j < n; j++) {
+        const uint8_t *b = codes + j * code_size;
+        hamdis_t h = 0;
+        for (size_t i = 0; i < n8; i++)
+            h += popcount64 (C64(q)[i] ^ C64(b)[i]);
+        for (size_t i = 8 * n8; i < code_size; i++)
+            h += hamdis_tab_ham_bytes [q[i] ^ b[i]];
+        dis[j] = h;
+    }
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define USE_RUNTIME_HAMMING_SIMD
+
+static const bool cpu_ham_avx2 = __builtin_cpu_supports ("avx2");
+static const bool cpu_ham_avx512popcnt =
+    __builtin_cpu_supports ("avx512vpopcntdq") &&
+    __builtin_cpu_supports ("avx512bw");
+
+__attribute__((target("avx2")))
+static void hammings_1_to_n_avx2 (
+        const uint8_t * q, const uint8_t * codes,
+        size_t n, size_t code_size, hamdis_t * dis)
+{
+    // nibble-LUT popcount (PSHUFB), 32 code bytes per iteration
+    const __m256i lut = _mm256_setr_epi8 (
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low4 = _mm256_set1_epi8 (0xf);
+    for (size_t j = 0; j < n; j++) {
+        const uint8_t *b = codes + j * code_size;
+        __m256i acc = _mm256_setzero_si256 ();
+        size_t i = 0;
+        for (; i + 32 <= code_size; i += 32) {
+            __m256i x = _mm256_xor_si256 (
+                _mm256_loadu_si256 ((const __m256i *)(q + i)),
+                _mm256_loadu_si256 ((const __m256i *)(b + i)));
+            __m256i lo = _mm256_and_si256 (x, low4);
+            __m256i hi = _mm256_and_si256 (_mm256_srli_epi16 (x, 4), low4);
+            __m256i cnt = _mm256_add_epi8 (_mm256_shuffle_epi8 (lut, lo),
+                                           _mm256_shuffle_epi8 (lut, hi));
+            acc = _mm256_add_epi64 (acc,
+                _mm256_sad_epu8 (cnt, _mm256_setzero_si256 ()));
+        }
+        __m128i s = _mm_add_epi64 (_mm256_castsi256_si128 (acc),
+                                   _mm256_extracti128_si256 (acc, 1));
+        hamdis_t h = (hamdis_t)(_mm_cvtsi128_si64 (s) +
+                                _mm_extract_epi64 (s, 1));
+        for (; i < code_size; i++)
+            h += hamdis_tab_ham_bytes [q[i] ^ b[i]];
+        dis[j] = h;
+    }
+}
+
+__attribute__((target("avx512vpopcntdq,avx512bw,avx512f")))
+static void hammings_1_to_n_avx512 (
+        const uint8_t * q, const uint8_t * codes,
+        size_t n, size_t code_size, hamdis_t * dis)
+{
+    for (size_t j = 0; j < n; j++) {
+        const uint8_t *b = codes + j * code_size;
+        __m512i acc = _mm512_setzero_si512 ();
+        size_t i = 0;
+        for (; i + 64 <= code_size; i += 64) {
+            __m512i x = _mm512_xor_si512 (
+                _mm512_loadu_si512 (q + i),
+                _mm512_loadu_si512 (b + i));
+            acc = _mm512_add_epi64 (acc, _mm512_popcnt_epi64 (x));
+        }
+        hamdis_t h = (hamdis_t)_mm512_reduce_add_epi64 (acc);
+        if (i < code_size) {
+            __mmask64 mask = (~0ULL) >> (64 - (code_size - i));
+            __m512i x = _mm512_xor_si512 (
+                _mm512_maskz_loadu_epi8 (mask, q + i),
+                _mm512_maskz_loadu_epi8 (mask, b + i));
+            h += (hamdis_t)_mm512_reduce_add_epi64 (_mm512_popcnt_epi64 (x));
+        }
+        dis[j] = h;
+    }
+}
+
+#endif
+
+void hammings_1_to_n (
+        const uint8_t * q, const uint8_t * codes,
+        size_t n, size_t code_size, hamdis_t * dis)
+{
+#ifdef USE_RUNTIME_HAMMING_SIMD
+    if (cpu_ham_avx512popcnt && code_size >= 32) {
+        hammings_1_to_n_avx512 (q, codes, n, code_size, dis);
+        return;
+    }
+    if (cpu_ham_avx2 && code_size >= 32) {
+        hammings_1_to_n_avx2 (q, codes, n, code_size, dis);
+        return;
+    }
+#endif
+    hammings_1_to_n_ref (q, codes, n, code_size, dis);
+}
+
+
 void hammings_knn_core (
         int_maxheap_array_t * ha,
         const uint8_t * a,
@@ -57,6 +57,19 @@ void hammings (
         size_t nbytespercode,
         hamdis_t * dis);
 
+/** Hamming distances of one query code against n contiguous codes.
+ * Dispatched at runtime to an AVX2 nibble-LUT popcount kernel, or
+ * AVX-512 VPOPCNTDQ where the CPU has it (same mechanism as the
+ * runtime-dispatched kernels in utils.cpp). Any code_size is accepted.
+ * Used as a batched prefilter by the polysemous scan.
+ */
+void hammings_1_to_n (
+        const uint8_t * q,
+        const uint8_t * codes,
+        size_t n,
+        size_t code_size,
+        hamdis_t * dis);
+
 void bitvec_print (const uint8_t * b, size_t d);
 
 
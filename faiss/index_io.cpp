@@ -106,6 +106,23 @@ struct ScopeFileCloser {
     ~ScopeFileCloser () {fclose (f); }
 };
 
+// alignment of payload sections written by write_index_mmap, so that
+// read_index_mmap maps cacheline-aligned codes in place
+static const long MMAP_ALIGN = 64;
+
+static void write_pad_to_align (FILE *f) {
+    static const char zeros[MMAP_ALIGN] = {0};
+    long pad = (-ftell (f)) & (MMAP_ALIGN - 1);
+    if (pad > 0)
+        WRITEANDCHECK (zeros, (size_t)pad);
+}
+
+static void read_skip_align (FILE *f) {
+    long pad = (-ftell (f)) & (MMAP_ALIGN - 1);
+    if (pad > 0)
+        fseek (f, pad, SEEK_CUR);
+}
+
 
 
 
@@ -183,13 +200,17 @@ static void write_ScalarQuantizer (const ScalarQuantizer *ivsc, FILE *f) {
     WRITEVECTOR (ivsc->trained);
 }
 
-static void write_InvertedLists (const InvertedLists *ils, FILE *f) {
+static void write_InvertedLists (const InvertedLists *ils, FILE *f,
+                                 int io_flags = 0) {
     if (ils == nullptr) {
         uint32_t h = fourcc ("il00");
         WRITE1 (h);
     } else if (const auto & ails =
                dynamic_cast<const ArrayInvertedLists *>(ils)) {
-        uint32_t h = fourcc ("ilar");
+        // "ilaa" is the same layout as "ilar" with each list's payload
+        // aligned on MMAP_ALIGN, for mapping in place
+        bool aligned = io_flags & IO_FLAG_MMAP;
+        uint32_t h = fourcc (aligned ? "ilaa" : "ilar");
         WRITE1 (h);
         WRITE1 (ails->nlist);
         WRITE1 (ails->code_size);
@@ -224,6 +245,8 @@ static void write_InvertedLists (const InvertedLists *ils, FILE *f) {
         for (size_t i = 0; i < ails->nlist; i++) {
             size_t n = ails->ids[i].size();
             if (n > 0) {
+                if (aligned)
+                    write_pad_to_align (f);
                 WRITEANDCHECK (ails->codes[i].data(), n * ails->code_size);
                 WRITEANDCHECK (ails->ids[i].data(), n);
             }
@@ -286,7 +309,7 @@ static void write_ivf_header (const IndexIVF * ivf, FILE *f) {
     WRITEVECTOR (ivf->direct_map);
 }
 
-void write_index (const Index *idx, FILE *f) {
+void write_index (const Index *idx, FILE *f, int io_flags) {
     if (const IndexFlat * idxf = dynamic_cast<const IndexFlat *> (idx)) {
         uint32_t h = fourcc (
               idxf->metric_type == METRIC_INNER_PRODUCT ? "IxFI" :
@@ -340,7 +363,7 @@ void write_index (const Index *idx, FILE *f) {
         uint32_t h = fourcc ("IwFl");
         WRITE1 (h);
         write_ivf_header (ivfl, f);
-        write_InvertedLists (ivfl->invlists, f);
+        write_InvertedLists (ivfl->invlists, f, io_flags);
     } else if(const IndexIVFScalarQuantizer * ivsc =
               dynamic_cast<const IndexIVFScalarQuantizer *> (idx)) {
         uint32_t h = fourcc ("IwSQ");
@@ -348,7 +371,7 @@ void write_index (const Index *idx, FILE *f) {
         write_ivf_header (ivsc, f);
         write_ScalarQuantizer (&ivsc->sq, f);
         WRITE1 (ivsc->code_size);
-        write_InvertedLists (ivsc->invlists, f);
+        write_InvertedLists (ivsc->invlists, f, io_flags);
     } else if(const IndexIVFPQ * ivpq =
               dynamic_cast<const IndexIVFPQ *> (idx)) {
         const IndexIVFPQR * ivfpqr = dynamic_cast<const IndexIVFPQR *> (idx);
@@ -359,7 +382,7 @@ void write_index (const Index *idx, FILE *f) {
         WRITE1 (ivpq->by_residual);
         WRITE1 (ivpq->code_size);
         write_ProductQuantizer (&ivpq->pq, f);
-        write_InvertedLists (ivpq->invlists, f);
+        write_InvertedLists (ivpq->invlists, f, io_flags);
         if (ivfpqr) {
             write_ProductQuantizer (&ivfpqr->refine_pq, f);
             WRITEVECTOR (ivfpqr->refine_codes);
@@ -375,7 +398,7 @@ void write_index (const Index *idx, FILE *f) {
         WRITE1 (nt);
         for (int i = 0; i < nt; i++)
             write_VectorTransform (ixpt->chain[i], f);
-        write_index (ixpt->index, f);
+        write_index (ixpt->index, f, io_flags);
     } else if(const MultiIndexQuantizer * imiq =
               dynamic_cast<const MultiIndexQuantizer *> (idx)) {
         uint32_t h = fourcc ("Imiq");
@@ -387,7 +410,7 @@ void write_index (const Index *idx, FILE *f) {
         uint32_t h = fourcc ("IxRF");
         WRITE1 (h);
         write_index_header (idxrf, f);
-        write_index (idxrf->base_index, f);
+        write_index (idxrf->base_index, f, io_flags);
         write_index (&idxrf->refine_index, f);
         WRITE1 (idxrf->k_factor);
     } else if(const IndexIDMap * idxmap =
@@ -398,7 +421,7 @@ void write_index (const Index *idx, FILE *f) {
         // no need to store additional info for IndexIDMap2
         WRITE1 (h);
         write_index_header (idxmap, f);
-        write_index (idxmap->index, f);
+        write_index (idxmap->index, f, io_flags);
         WRITEVECTOR (idxmap->id_map);
     } else if(const IndexHNSW * idxhnsw =
               dynamic_cast<const IndexHNSW *> (idx)) {
@@ -412,7 +435,7 @@ void write_index (const Index *idx, FILE *f) {
         WRITE1 (h);
         write_index_header (idxhnsw, f);
         write_HNSW (&idxhnsw->hnsw, f);
-        write_index (idxhnsw->storage, f);
+        write_index (idxhnsw->storage, f, io_flags);
     } else {
       FAISS_THROW_MSG ("don't know how to serialize this type of index");
     }
@@ -425,6 +448,13 @@ void write_index (const Index *idx, const char *fname) {
     write_index (idx, f);
 }
 
+void write_index_mmap (const Index *idx, const char *fname) {
+    FILE *f = fopen (fname, "w");
+    FAISS_THROW_IF_NOT_FMT (f, "cannot open %s for writing", fname);
+    ScopeFileCloser closer(f);
+    write_index (idx, f, IO_FLAG_MMAP);
+}
+
 void write_VectorTransform (const VectorTransform *vt, const char *fname) {
     FILE *f = fopen (fname, "w");
     FAISS_THROW_IF_NOT_FMT (f, "cannot open %s for writing", fname);
@@ -524,7 +554,9 @@ InvertedLists *read_InvertedLists (FILE *f, int io_flags) {
     READ1 (h);
     if (h == fourcc ("il00")) {
         return nullptr;
-    } else if (h == fourcc ("ilar") && !(io_flags & IO_FLAG_MMAP)) {
+    } else if ((h == fourcc ("ilar") || h == fourcc ("ilaa")) &&
+               !(io_flags & IO_FLAG_MMAP)) {
+        bool aligned = h == fourcc ("ilaa");
         auto ails = new ArrayInvertedLists (0, 0);
         READ1 (ails->nlist);
         READ1 (ails->code_size);
@@ -539,12 +571,16 @@ InvertedLists *read_InvertedLists (FILE *f, int io_flags) {
         for (size_t i = 0; i < ails->nlist; i++) {
             size_t n = ails->ids[i].size();
             if (n > 0) {
+                if (aligned)
+                    read_skip_align (f);
                 READANDCHECK (ails->codes[i].data(), n * ails->code_size);
                 READANDCHECK (ails->ids[i].data(), n);
             }
         }
         return ails;
-    } else if (h == fourcc ("ilar") && (io_flags & IO_FLAG_MMAP)) {
+    } else if ((h == fourcc ("ilar") || h == fourcc ("ilaa")) &&
+               (io_flags & IO_FLAG_MMAP)) {
+        bool aligned = h == fourcc ("ilaa");
         auto ails = new OnDiskInvertedLists ();
         READ1 (ails->nlist);
         READ1 (ails->code_size);
@@ -569,6 +605,8 @@ InvertedLists *read_InvertedLists (FILE *f, int io_flags) {
         for (size_t i = 0; i < ails->nlist; i++) {
             OnDiskInvertedLists::List & l = ails->lists[i];
             l.size = l.capacity = sizes[i];
+            if (aligned && l.size > 0)
+                o = (o + MMAP_ALIGN - 1) & ~(MMAP_ALIGN - 1);
             l.offset = o;
             o += l.size * (sizeof(OnDiskInvertedLists::idx_t) +
                            ails->code_size);
@@ -922,6 +960,12 @@ Index *read_index (const char *fname, int io_flags) {
     return idx;
 }
 
+Index *read_index_mmap (const char *fname, int io_flags) {
+    // headers are parsed eagerly through stdio; the inverted list
+    // payloads get mapped in place (the mapping outlives the FILE)
+    return read_index (fname, io_flags | IO_FLAG_MMAP | IO_FLAG_READ_ONLY);
+}
+
 VectorTransform *read_VectorTransform (const char *fname) {
     FILE *f = fopen (fname, "r");
     if (!f) {
@@ -22,9 +22,13 @@ struct VectorTransform;
 struct IndexIVF;
 struct ProductQuantizer;
 
-void write_index (const Index *idx, FILE *f);
+void write_index (const Index *idx, FILE *f, int io_flags = 0);
 void write_index (const Index *idx, const char *fname);
 
+/** Write in a sectioned variant of the format where large payloads
+ * (inverted list data) land on 64-byte aligned sections, so that
+ * read_index_mmap can map them in place instead of reading them. */
+void write_index_mmap (const Index *idx, const char *fname);
 
 const int IO_FLAG_MMAP = 1;
 const int IO_FLAG_READ_ONLY = 2;
@@ -32,6 +36,14 @@ const int IO_FLAG_READ_ONLY = 2;
 Index *read_index (FILE * f, int io_flags = 0);
 Index *read_index (const char *fname, int io_flags = 0);
 
+/** Parse headers eagerly but mmap large payload sections in place,
+ * letting the page cache manage residency. Opening a multi-GB IVF
+ * index takes milliseconds instead of reading it front-to-back.
+ * The resulting index is read-only (no add/remove). Works on files
+ * from write_index too; write_index_mmap additionally aligns the
+ * mapped sections. */
+Index *read_index_mmap (const char *fname, int io_flags = 0);
+
 
 
 void write_VectorTransform (const VectorTransform *vt, const char *fname);
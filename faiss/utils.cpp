@@ -454,6 +454,82 @@ float fvec_norm_L2sqr_ref (const float * __restrict x,
 }
 
 
+/*********************************************************
+ * AVX-512 implementations, dispatched at runtime
+ *
+ * Compiled via the target attribute so the binary stays runnable on
+ * pre-AVX-512 parts; the entry points below test the CPU once.
+ */
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define USE_RUNTIME_AVX512
+
+static const bool cpu_avx512f = __builtin_cpu_supports ("avx512f");
+
+__attribute__((target("avx512f")))
+static float fvec_L2sqr_avx512 (const float * x,
+                                const float * y,
+                                size_t d)
+{
+    __m512 msum = _mm512_setzero_ps();
+    while (d >= 16) {
+        __m512 mx = _mm512_loadu_ps (x); x += 16;
+        __m512 my = _mm512_loadu_ps (y); y += 16;
+        __m512 a_m_b = _mm512_sub_ps (mx, my);
+        msum = _mm512_fmadd_ps (a_m_b, a_m_b, msum);
+        d -= 16;
+    }
+    float res = _mm512_reduce_add_ps (msum);
+    if (d > 0) {
+        __mmask16 mask = (__mmask16)((1U << d) - 1);
+        __m512 mx = _mm512_maskz_loadu_ps (mask, x);
+        __m512 my = _mm512_maskz_loadu_ps (mask, y);
+        __m512 a_m_b = _mm512_sub_ps (mx, my);
+        res += _mm512_reduce_add_ps (_mm512_mul_ps (a_m_b, a_m_b));
+    }
+    return res;
+}
+
+__attribute__((target("avx512f")))
+static float fvec_inner_product_avx512 (const float * x,
+                                        const float * y,
+                                        size_t d)
+{
+    __m512 msum = _mm512_setzero_ps();
+    while (d >= 16) {
+        __m512 mx = _mm512_loadu_ps (x); x += 16;
+        __m512 my = _mm512_loadu_ps (y); y += 16;
+        msum = _mm512_fmadd_ps (mx, my, msum);
+        d -= 16;
+    }
+    float res = _mm512_reduce_add_ps (msum);
+    if (d > 0) {
+        __mmask16 mask = (__mmask16)((1U << d) - 1);
+        __m512 mx = _mm512_maskz_loadu_ps (mask, x);
+        __m512 my = _mm512_maskz_loadu_ps (mask, y);
+        res += _mm512_reduce_add_ps (_mm512_mul_ps (mx, my));
+    }
+    return res;
+}
+
+__attribute__((target("avx512f")))
+static void fvec_madd_avx512 (size_t n, const float *a,
+                              float bf, const float *b, float *c)
+{
+    __m512 mbf = _mm512_set1_ps (bf);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512 v = _mm512_fmadd_ps (mbf, _mm512_loadu_ps (b + i),
+                                    _mm512_loadu_ps (a + i));
+        _mm512_storeu_ps (c + i, v);
+    }
+    for (; i < n; i++)
+        c[i] = a[i] + bf * b[i];
+}
+
+#endif
+
+
 /*********************************************************
  * SSE and AVX implementations
  */
@@ -497,6 +573,10 @@ float fvec_inner_product (const float * x,
                           const float * y,
                           size_t d)
 {
+#ifdef USE_RUNTIME_AVX512
+    if (cpu_avx512f)
+        return fvec_inner_product_avx512 (x, y, d);
+#endif
     __m256 msum1 = _mm256_setzero_ps();
 
     while (d >= 8) {
@@ -531,6 +611,10 @@ float fvec_L2sqr (const float * x,
                  const float * y,
                  size_t d)
 {
+#ifdef USE_RUNTIME_AVX512
+    if (cpu_avx512f)
+        return fvec_L2sqr_avx512 (x, y, d);
+#endif
     __m256 msum1 = _mm256_setzero_ps();
 
     while (d >= 8) {
@@ -571,6 +655,10 @@ float fvec_L2sqr (const float * x,
                  const float * y,
                  size_t d)
 {
+#ifdef USE_RUNTIME_AVX512
+    if (cpu_avx512f)
+        return fvec_L2sqr_avx512 (x, y, d);
+#endif
     __m128 msum1 = _mm_setzero_ps();
 
     while (d >= 4) {
@@ -599,6 +687,10 @@ float fvec_inner_product (const float * x,
                          const float * y,
                          size_t d)
 {
+#ifdef USE_RUNTIME_AVX512
+    if (cpu_avx512f)
+        return fvec_inner_product_avx512 (x, y, d);
+#endif
     __m128 mx, my;
     __m128 msum1 = _mm_setzero_ps();
 
@@ -746,6 +838,11 @@ void fvec_renorm_L2 (size_t d, size_t nx, float * __restrict x)
 
 
 
+// up to this k, selection goes through BufferedTopk instead of a binary
+// heap: one predictable threshold compare per candidate instead of
+// branch-miss heavy heap maintenance
+static const size_t topk_buffered_kmax = 128;
+
 /* Find the nearest neighbors for nx queries in a set of ny vectors */
 static void knn_inner_product_sse (const float * x,
                         const float * y,
@@ -761,6 +858,16 @@ static void knn_inner_product_sse (const float * x,
         float * __restrict simi = res->get_val(i);
         long * __restrict idxi = res->get_ids (i);
 
+        if (k <= topk_buffered_kmax) {
+            BufferedTopk<CMin<float, long> > sel (k, simi, idxi);
+            for (size_t j = 0; j < ny; j++) {
+                sel.add (fvec_inner_product (x_, y_, d), j);
+                y_ += d;
+            }
+            sel.finalize ();
+            continue;
+        }
+
         minheap_heapify (k, simi, idxi);
 
         for (size_t j = 0; j < ny; j++) {
@@ -792,6 +899,16 @@ static void knn_L2sqr_sse (
         float * __restrict simi = res->get_val(i);
         long * __restrict idxi = res->get_ids (i);
 
+        if (k <= topk_buffered_kmax) {
+            BufferedTopk<CMax<float, long> > sel (k, simi, idxi);
+            for (j = 0; j < ny; j++) {
+                sel.add (fvec_L2sqr (x_, y_, d), j);
+                y_ += d;
+            }
+            sel.finalize ();
+            continue;
+        }
+
         maxheap_heapify (k, simi, idxi);
         for (j = 0; j < ny; j++) {
             float disij = fvec_L2sqr (x_, y_, d);
@@ -820,9 +937,8 @@ static void knn_inner_product_blas (
     // BLAS does not like empty matrices
     if (nx == 0 || ny == 0) return;
 
-    /* block sizes */
-    const size_t bs_x = 4096, bs_y = 1024;
-    // const size_t bs_x = 16, bs_y = 16;
+    /* block sizes: runtime-tunable, see distance_compute_blas_bs_[xy] */
+    const size_t bs_x = distance_compute_blas_bs_x, bs_y = distance_compute_blas_bs_y;
     float *ip_block = new float[bs_x * bs_y];
 
     for (size_t i0 = 0; i0 < nx; i0 += bs_x) {
@@ -859,16 +975,29 @@ static void knn_L2sqr_blas (const float * x,
         float_maxheap_array_t * res,
         const DistanceCorrection &corr)
 {
-    res->heapify ();
+    size_t k = res->k;
+    if (k > topk_buffered_kmax)
+        res->heapify ();
 
     // BLAS does not like empty matrices
-    if (nx == 0 || ny == 0) return;
-
-    size_t k = res->k;
+    if (nx == 0 || ny == 0) {
+        if (k <= topk_buffered_kmax) {
+            // no selection state ran to pad the outputs; emit the same
+            // sentinels an empty heapified result carries
+            for (size_t i = 0; i < nx; i++) {
+                float * simi = res->get_val (i);
+                long * idxi = res->get_ids (i);
+                for (size_t j = 0; j < k; j++) {
+                    simi [j] = CMax<float, long>::neutral ();
+                    idxi [j] = -1;
+                }
+            }
+        }
+        return;
+    }
 
-    /* block sizes */
-    const size_t bs_x = 4096, bs_y = 1024;
-    // const size_t bs_x = 16, bs_y = 16;
+    /* block sizes: runtime-tunable, see distance_compute_blas_bs_[xy] */
+    const size_t bs_x = distance_compute_blas_bs_x, bs_y = distance_compute_blas_bs_y;
     float *ip_block = new float[bs_x * bs_y];
 
     float *x_norms = new float[nx];
@@ -881,6 +1010,15 @@ static void knn_L2sqr_blas (const float * x,
         size_t i1 = i0 + bs_x;
         if(i1 > nx) i1 = nx;
 
+        // buffered selection state of the block's queries; the j loop
+        // completes within one i block so the state stays block-local
+        std::vector<BufferedTopk<CMax<float, long> > > sels;
+        if (k <= topk_buffered_kmax) {
+            sels.reserve (i1 - i0);
+            for (size_t i = i0; i < i1; i++)
+                sels.emplace_back (k, res->get_val(i), res->get_ids(i));
+        }
+
         for (size_t j0 = 0; j0 < ny; j0 += bs_y) {
             size_t j1 = j0 + bs_y;
             if (j1 > ny) j1 = ny;
@@ -896,9 +1034,21 @@ static void knn_L2sqr_blas (const float * x,
 
             /* collect minima */
             for (size_t i = i0; i < i1; i++) {
+                const float *ip_line = ip_block + (i - i0) * (j1 - j0);
+
+                if (!sels.empty()) {
+                    BufferedTopk<CMax<float, long> > & sel = sels[i - i0];
+                    for (size_t j = j0; j < j1; j++) {
+                        float ip = *ip_line++;
+                        float dis = x_norms[i] + y_norms[j] - 2 * ip;
+                        dis = corr (dis, i, j);
+                        sel.add (dis, j);
+                    }
+                    continue;
+                }
+
                 float * __restrict simi = res->get_val(i);
                 long * __restrict idxi = res->get_ids (i);
-                const float *ip_line = ip_block + (i - i0) * (j1 - j0);
 
                 for (size_t j = j0; j < j1; j++) {
                     float ip = *ip_line++;
@@ -913,8 +1063,11 @@ static void knn_L2sqr_blas (const float * x,
                 }
             }
         }
+        for (size_t i = 0; i < sels.size(); i++)
+            sels[i].finalize ();
     }
-    res->reorder ();
+    if (k > topk_buffered_kmax)
+        res->reorder ();
 
     delete [] ip_block;
     delete [] x_norms;
@@ -934,6 +1087,8 @@ static void knn_L2sqr_blas (const float * x,
  *******************************************************/
 
 int distance_compute_blas_threshold = 20;
+size_t distance_compute_blas_bs_x = 4096;
+size_t distance_compute_blas_bs_y = 1024;
 
 void knn_inner_product (const float * x,
         const float * y,
@@ -1118,9 +1273,8 @@ static void range_search_blas (
     // BLAS does not like empty matrices
     if (nx == 0 || ny == 0) return;
 
-    /* block sizes */
-    const size_t bs_x = 4096, bs_y = 1024;
-    // const size_t bs_x = 16, bs_y = 16;
+    /* block sizes: runtime-tunable, see distance_compute_blas_bs_[xy] */
+    const size_t bs_x = distance_compute_blas_bs_x, bs_y = distance_compute_blas_bs_y;
     float *ip_block = new float[bs_x * bs_y];
 
     float *x_norms = nullptr, *y_norms = nullptr;
@@ -1861,6 +2015,12 @@ static inline void fvec_madd_sse (size_t n, const float *a,
 void fvec_madd (size_t n, const float *a,
                        float bf, const float *b, float *c)
 {
+#ifdef USE_RUNTIME_AVX512
+    if (cpu_avx512f) {
+        fvec_madd_avx512 (n, a, bf, b, c);
+        return;
+    }
+#endif
     if ((n & 3) == 0 &&
         ((((long)a) | ((long)b) | ((long)c)) & 15) == 0)
         fvec_madd_sse (n, a, bf, b, c);
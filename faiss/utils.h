@@ -198,6 +198,11 @@ void fvec_L2sqr_by_idx (
 // threshold on nx above which we switch to BLAS to compute distances
 extern int distance_compute_blas_threshold;
 
+// block sizes of the blocked sgemm distance computations; the defaults suit
+// mid-2010s Xeons, hosts with different cache geometry can retune them
+extern size_t distance_compute_blas_bs_x;
+extern size_t distance_compute_blas_bs_y;
+
 /** Return the k nearest neighors of each of the nx vectors x among the ny
  *  vector y, w.r.t to max inner product
  *
@@ -1,66 +1,243 @@
 
 #include "index_flat_wrapper.h"
 #include "faiss/IndexFlat.h"
-#include <boost/thread/shared_mutex.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <memory>
 #include <mutex>
 #include <pthread.h>
 #include <sstream>
 #include <string>
 #include <unordered_map>
+#include <vector>
 
 using namespace std;
 using mtxlock = unique_lock<mutex>;
-using rlock = unique_lock<boost::shared_mutex>;
-using wlock = boost::shared_lock<boost::shared_mutex>;
+
+//a tail segment is rewritten in place (tail rows + new rows) until it grows
+//past this, so the segment count stays bounded under one-vector-at-a-time adds
+const long SEG_MERGE_MAX = 4096L;
+
+//Segment is immutable once published inside a Snapshot.
+struct Segment {
+    shared_ptr<faiss::IndexFlat> flat;
+    shared_ptr<vector<uint64_t>> xids;
+};
+
+/**
+ * Snapshot is an immutable view of the whole database. Searches load the
+ * current snapshot with a single atomic operation and never take a lock, so
+ * concurrent searches don't serialize and adds never stall behind a long
+ * brute-force scan. Writers (add/remove/compact) serialize on mtx_w, build
+ * the next snapshot from cheap shared_ptr copies of the unchanged segments,
+ * and publish it with an atomic pointer swap.
+ */
+struct Snapshot {
+    vector<Segment> segs;
+    vector<char> deleted; //tombstones over the concatenated rows
+    long n_deleted;
+    long ntotal;
+};
 
 struct IndexFlatWrapper {
+    long dim;
     float dist_threshold;
-    boost::shared_mutex rw_flat;
-    faiss::IndexFlat* flat;
-    unordered_map<uint64_t, uint64_t> xid2num;
-    vector<uint64_t> xids; //vector of xid of all vectors
+    float compact_frac; //compact once tombstones exceed this fraction of rows
+    mutex mtx_w; //serializes writers; readers only atomic_load snap
+    shared_ptr<const Snapshot> snap;
+    unordered_map<uint64_t, uint64_t> xid2num; //writer-only, guarded by mtx_w
 };
 
 void* IndexFlatNew(long dim, float dist_threshold)
 {
     IndexFlatWrapper* ifw = new IndexFlatWrapper();
+    ifw->dim = dim;
     ifw->dist_threshold = dist_threshold;
-    ifw->flat = new faiss::IndexFlat(dim, faiss::METRIC_INNER_PRODUCT);
+    ifw->compact_frac = 0.25f;
+    shared_ptr<const Snapshot> snap = make_shared<Snapshot>();
+    atomic_store(&ifw->snap, snap);
     return ifw;
 }
 
 void IndexFlatDelete(void* ifwIn)
 {
     IndexFlatWrapper* ifw = static_cast<IndexFlatWrapper*>(ifwIn);
-    delete ifw->flat;
     delete ifw;
 }
 
+static Segment buildSegment(long dim, long nb, const float* xb, const uint64_t* xids)
+{
+    Segment seg;
+    seg.flat = make_shared<faiss::IndexFlat>(dim, faiss::METRIC_INNER_PRODUCT);
+    seg.flat->add(nb, xb);
+    seg.xids = make_shared<vector<uint64_t>>(xids, xids + nb);
+    return seg;
+}
+
 void IndexFlatAddWithIds(void* ifwIn, long nb, float* xb, unsigned long* xids)
 {
     IndexFlatWrapper* ifw = static_cast<IndexFlatWrapper*>(ifwIn);
-    wlock w{ ifw->rw_flat };
-    long ntotal = ifw->flat->ntotal;
-    ifw->flat->add(nb, xb);
+    mtxlock w{ ifw->mtx_w };
+    shared_ptr<const Snapshot> cur = atomic_load(&ifw->snap);
+    shared_ptr<Snapshot> next = make_shared<Snapshot>();
+    next->segs = cur->segs;
+    next->deleted = cur->deleted;
+    next->n_deleted = cur->n_deleted;
+    next->ntotal = cur->ntotal + nb;
+    long ntail = next->segs.empty() ? 0 : (long)next->segs.back().flat->ntotal;
+    if (ntail != 0 && ntail + nb <= SEG_MERGE_MAX) {
+        //rewrite the tail segment with the new rows appended; global row
+        //order is preserved so the tombstone bitmap needs no remapping
+        Segment& tail = next->segs.back();
+        vector<float> vecs((ntail + nb) * ifw->dim);
+        memcpy(&vecs[0], tail.flat->xb.data(), ntail * ifw->dim * sizeof(float));
+        memcpy(&vecs[ntail * ifw->dim], xb, nb * ifw->dim * sizeof(float));
+        vector<uint64_t> ids(*tail.xids);
+        ids.insert(ids.end(), xids, xids + nb);
+        next->segs.back() = buildSegment(ifw->dim, ntail + nb, &vecs[0], &ids[0]);
+    } else {
+        next->segs.push_back(buildSegment(ifw->dim, nb, xb, xids));
+    }
+    next->deleted.resize(next->ntotal, 0);
+    for (long i = 0; i < nb; i++)
+        ifw->xid2num[xids[i]] = cur->ntotal + i;
+    atomic_store(&ifw->snap, shared_ptr<const Snapshot>(next));
+}
+
+//rebuild a single segment from the live rows. Assumes mtx_w is held.
+static void compact(IndexFlatWrapper* ifw, const Snapshot& cur)
+{
+    vector<float> vecs;
+    vector<uint64_t> ids;
+    vecs.reserve((cur.ntotal - cur.n_deleted) * ifw->dim);
+    ids.reserve(cur.ntotal - cur.n_deleted);
+    long num = 0;
+    for (const Segment& seg : cur.segs) {
+        long nseg = seg.flat->ntotal;
+        for (long i = 0; i < nseg; i++, num++) {
+            if (cur.deleted[num])
+                continue;
+            const float* vec = &seg.flat->xb[i * ifw->dim];
+            vecs.insert(vecs.end(), vec, vec + ifw->dim);
+            ids.push_back((*seg.xids)[i]);
+        }
+    }
+    shared_ptr<Snapshot> next = make_shared<Snapshot>();
+    next->ntotal = (long)ids.size();
+    next->n_deleted = 0;
+    next->deleted.assign(next->ntotal, 0);
+    if (next->ntotal != 0)
+        next->segs.push_back(buildSegment(ifw->dim, next->ntotal, &vecs[0], &ids[0]));
+    ifw->xid2num.clear();
+    for (size_t i = 0; i < ids.size(); i++)
+        ifw->xid2num[ids[i]] = i;
+    atomic_store(&ifw->snap, shared_ptr<const Snapshot>(next));
+}
+
+void IndexFlatRemoveIds(void* ifwIn, long nb, unsigned long* xids)
+{
+    IndexFlatWrapper* ifw = static_cast<IndexFlatWrapper*>(ifwIn);
+    mtxlock w{ ifw->mtx_w };
+    shared_ptr<const Snapshot> cur = atomic_load(&ifw->snap);
+    shared_ptr<Snapshot> next = make_shared<Snapshot>();
+    next->segs = cur->segs;
+    next->deleted = cur->deleted;
+    next->n_deleted = cur->n_deleted;
+    next->ntotal = cur->ntotal;
     for (long i = 0; i < nb; i++) {
-        ifw->xid2num[xids[i]] = ntotal + i;
-        ifw->xids.push_back(xids[i]);
+        auto it = ifw->xid2num.find(xids[i]);
+        if (it == ifw->xid2num.end())
+            continue;
+        uint64_t num = it->second;
+        ifw->xid2num.erase(it);
+        if (!next->deleted[num]) {
+            next->deleted[num] = 1;
+            next->n_deleted++;
+        }
+    }
+    if (next->n_deleted > 0 && (float)next->n_deleted > ifw->compact_frac * (float)next->ntotal) {
+        compact(ifw, *next);
+        return;
     }
+    atomic_store(&ifw->snap, shared_ptr<const Snapshot>(next));
 }
 
-void IndexFlatSearch(void* ifwIn, long nq, float* xq, float* distances, unsigned long* xids)
+void IndexFlatSetCompactThreshold(void* ifwIn, float frac)
 {
-    static const long k = 1;
     IndexFlatWrapper* ifw = static_cast<IndexFlatWrapper*>(ifwIn);
-    {
-        rlock r{ ifw->rw_flat };
-        ifw->flat->search(nq, xq, k, distances, (long*)xids);
+    mtxlock w{ ifw->mtx_w };
+    ifw->compact_frac = frac;
+}
+
+//fills nq*k result slots row-major, padding with uint64(-1) when fewer than
+//k live rows exist. Works on an immutable snapshot, no locking. Fetching
+//k + n_deleted candidates per segment guarantees at least k live rows are
+//seen, so no retry loop is needed.
+static void searchKnn(const Snapshot& snap, float dist_threshold, long nq, long k, float* xq, float* distances, unsigned long* xids)
+{
+    for (long i = 0; i < nq * k; i++) {
+        distances[i] = 0;
+        xids[i] = uint64_t(-1);
+    }
+    if (snap.ntotal == 0)
+        return;
+    long keff = std::min(snap.ntotal, k + snap.n_deleted);
+    //candidates per query, merged over segments: (distance, global row num)
+    vector<vector<pair<float, long>>> cands(nq);
+    vector<float> D;
+    vector<long> I;
+    long num_base = 0;
+    for (const Segment& seg : snap.segs) {
+        long nseg = seg.flat->ntotal;
+        long kseg = std::min(keff, nseg);
+        D.resize(nq * kseg);
+        I.resize(nq * kseg);
+        seg.flat->search(nq, xq, kseg, &D[0], &I[0]);
+        for (long i = 0; i < nq; i++) {
+            for (long j = 0; j < kseg; j++) {
+                long num = I[i * kseg + j];
+                if (num < 0)
+                    break;
+                if (!snap.deleted[num_base + num])
+                    cands[i].emplace_back(D[i * kseg + j], num_base + num);
+            }
+        }
+        num_base += nseg;
     }
-    for (int i = 0; i < nq; i++) {
-        if (distances[i] < ifw->dist_threshold) {
-            xids[i] = uint64_t(-1);
-        } else {
-            xids[i] = ifw->xids[xids[i]];
+    for (long i = 0; i < nq; i++) {
+        vector<pair<float, long>>& cand = cands[i];
+        long top = std::min((long)cand.size(), k);
+        //inner product: larger distance is better
+        partial_sort(cand.begin(), cand.begin() + top, cand.end(),
+            [](const pair<float, long>& a, const pair<float, long>& b) { return a.first > b.first; });
+        for (long j = 0; j < top; j++) {
+            long num = cand[j].second;
+            //locate the owning segment of the global row num
+            long base = 0;
+            for (const Segment& seg : snap.segs) {
+                long nseg = seg.flat->ntotal;
+                if (num < base + nseg) {
+                    distances[i * k + j] = cand[j].first;
+                    xids[i * k + j] = (dist_threshold <= cand[j].first) ? (*seg.xids)[num - base] : uint64_t(-1);
+                    break;
+                }
+                base += nseg;
+            }
         }
     }
 }
+
+void IndexFlatSearch(void* ifwIn, long nq, float* xq, float* distances, unsigned long* xids)
+{
+    IndexFlatWrapper* ifw = static_cast<IndexFlatWrapper*>(ifwIn);
+    shared_ptr<const Snapshot> snap = atomic_load(&ifw->snap);
+    searchKnn(*snap, ifw->dist_threshold, nq, 1, xq, distances, xids);
+}
+
+void IndexFlatSearchKnn(void* ifwIn, long nq, long k, float* xq, float* distances, unsigned long* xids)
+{
+    IndexFlatWrapper* ifw = static_cast<IndexFlatWrapper*>(ifwIn);
+    shared_ptr<const Snapshot> snap = atomic_load(&ifw->snap);
+    searchKnn(*snap, ifw->dist_threshold, nq, k, xq, distances, xids);
+}
@@ -8,7 +8,15 @@ extern "C" {
 void* IndexFlatNew(long dim, float dist_threshold);
 void IndexFlatDelete(void* ifw);
 void IndexFlatAddWithIds(void* ifw, long nb, float* xb, unsigned long* xids);
+// Tombstone the given xids. Tombstoned rows never enter the top-1 comparison;
+// storage is rewritten only once tombstones exceed the compact threshold
+// (default 0.25 of rows).
+void IndexFlatRemoveIds(void* ifw, long nb, unsigned long* xids);
+void IndexFlatSetCompactThreshold(void* ifw, float frac);
 void IndexFlatSearch(void* ifw, long nq, float* xq, float* distances, unsigned long* xids);
+// Batched k-NN search. distances and xids are nq*k, row-major; unfilled
+// slots (fewer than k live rows, or below dist_threshold) hold xid -1.
+void IndexFlatSearchKnn(void* ifw, long nq, long k, float* xq, float* distances, unsigned long* xids);
 
 #ifdef __cplusplus
 }
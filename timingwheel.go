@@ -0,0 +1,102 @@
+package vectodb
+
+// Hierarchical timing wheel for VectoDBLite expirations. A flat periodic
+// scan costs O(n) per tick per database, which adds up on nodes hosting
+// hundreds of databases; the wheel makes each tick touch only the entries
+// whose slot came due. Four levels of 64 slots at a 10s tick span ~5 years,
+// comfortably past the 1-year ValidSeconds horizon. Entries are scheduled at
+// their ExpireAt when they enter the LRU and re-validated when they pop, so
+// a touch() that pushed the deadline out just re-schedules the entry instead
+// of paying anything on the search path.
+
+import (
+	"sync"
+)
+
+const (
+	wheelLevels = 4
+	wheelSlots  = 64
+)
+
+type wheelEntry struct {
+	xid      uint64
+	expireAt int64
+}
+
+type timingWheel struct {
+	mtx     sync.Mutex
+	tickSec int64
+	nowSec  int64 //time the wheel has advanced to
+	cur     [wheelLevels]int
+	slots   [wheelLevels][wheelSlots][]wheelEntry
+}
+
+func newTimingWheel(tickSec, nowSec int64) *timingWheel {
+	return &timingWheel{tickSec: tickSec, nowSec: nowSec}
+}
+
+// unit is the seconds one slot of the given level covers.
+func (tw *timingWheel) unit(level int) int64 {
+	u := tw.tickSec
+	for l := 0; l < level; l++ {
+		u *= wheelSlots
+	}
+	return u
+}
+
+func (tw *timingWheel) schedule(xid uint64, expireAt int64) {
+	tw.mtx.Lock()
+	tw.scheduleLocked(wheelEntry{xid: xid, expireAt: expireAt})
+	tw.mtx.Unlock()
+}
+
+func (tw *timingWheel) scheduleLocked(e wheelEntry) {
+	offset := e.expireAt - tw.nowSec
+	if offset < tw.tickSec {
+		offset = tw.tickSec
+	}
+	for l := 0; l < wheelLevels; l++ {
+		u := tw.unit(l)
+		if offset < u*wheelSlots || l == wheelLevels-1 {
+			steps := offset / u
+			if steps >= wheelSlots {
+				//beyond the top span; park it at the far edge, the cascade
+				//re-spreads it as the wheel turns
+				steps = wheelSlots - 1
+			}
+			slot := (tw.cur[l] + int(steps)) % wheelSlots
+			tw.slots[l][slot] = append(tw.slots[l][slot], e)
+			return
+		}
+	}
+}
+
+// advance turns the wheel up to nowSec and returns the entries whose slot
+// came due. The caller re-validates each against the authoritative ExpireAt.
+func (tw *timingWheel) advance(nowSec int64) (due []wheelEntry) {
+	tw.mtx.Lock()
+	for tw.nowSec+tw.tickSec <= nowSec {
+		tw.nowSec += tw.tickSec
+		tw.step(0, &due)
+	}
+	tw.mtx.Unlock()
+	return
+}
+
+func (tw *timingWheel) step(level int, due *[]wheelEntry) {
+	tw.cur[level] = (tw.cur[level] + 1) % wheelSlots
+	slot := tw.cur[level]
+	entries := tw.slots[level][slot]
+	tw.slots[level][slot] = nil
+	if level == 0 {
+		*due = append(*due, entries...)
+	} else {
+		//cascade: redistribute into the finer levels
+		for _, e := range entries {
+			tw.scheduleLocked(e)
+		}
+	}
+	if slot == 0 && level+1 < wheelLevels {
+		tw.step(level+1, due)
+	}
+}
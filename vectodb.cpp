@@ -2,725 +2,8245 @@
 #include "vectodb.h"
 
 #include "faiss/AutoTune.h"
+#include "faiss/AuxIndexStructures.h"
+#include "faiss/Clustering.h"
+#include "faiss/FaissException.h"
 #include "faiss/IndexFlat.h"
 #include "faiss/IndexHNSW.h"
 #include "faiss/IndexIVFFlat.h"
+#include "faiss/IndexIVFPQ.h"
+#include "faiss/OnDiskInvertedLists.h"
+#include "faiss/VectorTransform.h"
+#include "faiss/hamming.h"
 #include "faiss/index_io.h"
+#include "faiss/utils.h"
+#ifdef VECTODB_USE_GPU
+#include "faiss/gpu/GpuAutoTune.h"
+#include "faiss/gpu/StandardGpuResources.h"
+#endif
 
 #include <boost/filesystem.hpp>
 #include <boost/system/system_error.hpp>
 #include <boost/thread/shared_mutex.hpp>
 #include <glog/logging.h>
 
+#include <immintrin.h>
+
 #include <algorithm>
 #include <atomic>
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <fcntl.h>
 #include <fstream>
 #include <iostream>
 #include <math.h>
 #include <mutex>
+#include <omp.h>
+#include <random>
 #include <pthread.h>
 #include <sstream>
 #include <stdio.h>
 #include <string>
 #include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <system_error>
+#include <thread>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+// --- USDT tracepoints ---
+// Stable probes (provider "vectodb") for bpftrace/perf on the hot-path
+// transitions, instead of uprobes on mangled symbols that break every
+// release. A disarmed probe is a single nop and its arguments are plain
+// loads, so the cost is zero until a tracer arms it. Builds without the
+// systemtap headers just lose the probes.
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define VDB_HAVE_SDT 1
+#endif
+#endif
+#ifndef VDB_HAVE_SDT
+#define DTRACE_PROBE(provider, name)
+#define DTRACE_PROBE1(provider, name, a1)
+#define DTRACE_PROBE2(provider, name, a1, a2)
+#define DTRACE_PROBE3(provider, name, a1, a2, a3)
+#define DTRACE_PROBE4(provider, name, a1, a2, a3, a4)
+#endif
+
 using namespace std;
 namespace fs = boost::filesystem;
 using mtxlock = unique_lock<mutex>;
-using rlock = unique_lock<boost::shared_mutex>;
-using wlock = boost::shared_lock<boost::shared_mutex>;
+using rlock = boost::shared_lock<boost::shared_mutex>;
+using wlock = unique_lock<boost::shared_mutex>;
 
 const long MIN_NTRAIN = 10000L;
 const long MAX_NTRAIN = 160000L; //the number of training points which IVF4096 needs for 1M dataset
+const long ADD_CHUNK = 100000L; //index->add batch size of BuildIndex, keeps build memory O(chunk) instead of O(database)
+const long SEG_BYTES = 1L << 30; //target size of a base.vec.<k> segment file, rounded down to whole lines
+const int XID_NSHARD = 16; //shards of the xid map, must be a power of two
+const long XID_BLOOM_BITS = 1L << 24; //bits of the negative-lookup xid filter (2MB), must be a power of two
+const long AUTO_TUNE_NQ = 100L; //held-out queries of the index_key="auto" parameter sweep
+const double AUTO_TUNE_RECALL = 0.9; //target 1-recall@1 of the sweep
+const int AUTO_TUNE_NEXP = 24; //experiment budget of ParameterSpace::explore
+const int SEARCH_HIST_NBUCKET = 32; //log2 buckets of the per-query search cycle histogram
+const long SLOWLOG_NSLOT = 64L; //entries of the slow-query ring (slowlog_us=<n>)
+const long SLOWLOG_NFIELD = 14L; //longs per slow-query entry, the GetSlowLog record stride
+const int RCACHE_NSHARD = 16; //lock stripes of the result cache, must be a power of two
+const long FLAT_PAR_MIN_LINES = 16384L; //flat-tail lines per sub-segment below which a parallel scan is not worth the fork
+const long LSH_KEEP_FACTOR = 4L; //candidates per requested result surviving the Hamming prefilter into the exact stage
+const long EVT_RING_CAP = 1024L; //records per per-thread event ring, must be a power of two
+const long EVT_DRAIN_MS = 100L; //drain period of the background event-log thread
+const long DELTA_MAX_COUNT = 8L; //delta indexes tolerated before a full rebuild compacts them
+const long DELTA_COMPACT_FRACTION = 4L; //compact once delta lines exceed main index size / this
+const long DIRECT_IO_ALIGN = 4096L; //offset/buffer alignment of the O_DIRECT build reader, covers 4Kn sectors
+const long BATCH_SLICE_NQ = 64L; //queries per SearchKnnBatch slice, the granularity at which interactive traffic preempts batch work
+const long SPLIT_HOT_FACTOR = 4L; //a list this many times the mean size is a split candidate
+const long SPLIT_MIN_LINES = 4096L; //lists smaller than this never split, whatever the mean
+const long SPLIT_TRAIN_MAX = 65536L; //sample cap of the local 2-means when splitting one list
+const long REFINE_SHALLOW_MIN = 25L; //floor of the adaptive refine depth, before the distance-margin escalation
+const float REFINE_MARGIN = 0.1f; //relative PQ-distance margin below which the refine keeps its full depth
+const long REFINE_GEMM_MIN_NQ = 32L; //batch queries per slice at which the refine gathers one tile and reranks through sgemm
+const long SEG_PROMOTE_HITS = 256L; //refine gathers per rebalance window that promote a cold segment to the fast tier
+const long SEG_DEMOTE_HITS = 16L; //refine gathers per window below which RebalanceTiers releases a hot segment's pages
+const long SEG_HEAT_NBLOCK = 64L; //residency blocks per mapped segment (16MB granularity at the 1GB segment size)
+const long BLOCK_PROMOTE_HITS = 32L; //refine gathers per window that pull one block's pages back in
+const long BLOCK_DEMOTE_HITS = 2L; //gathers per window below which a hot block's pages may page out
+const long SHED_DEPTH_L1 = 8L; //coalescer waiters per round at which interactive queries shed to degradation level 1
+const long SHED_DEPTH_L2 = 32L; //coalescer waiters at which shedding deepens to level 2
+const long SHED_CALM_ROUNDS = 16L; //consecutive calm coalescer rounds before the shed level steps back down
+const long INDEX_RETAIN_GENS = 2L; //prior index generations kept on disk (.index.1 .. .index.N) for RollbackIndex
+const long ROLLBACK_MIN_NQ = 1000L; //queries each side of an activation before RollbackIfRegressed may judge it
+
+struct XidShard {
+    boost::shared_mutex rw;
+    unordered_map<long, long> xid2num;
+};
+
+static inline int xidShardOf(long xid)
+{
+    return (int)(((unsigned long)xid * 0x9E3779B97F4A7C15UL) >> 60) & (XID_NSHARD - 1);
+}
+
+// Negative-lookup filter over the known xids. Enrollment streams are mostly
+// new entities, and a definite miss here skips the shard probe — the stripe
+// lock and the hash walk with its cache misses — entirely. Two bits per key
+// from one golden-ratio mix; inserts are relaxed atomic ORs, deletes leave
+// their bits set. A stale or false positive only costs the probe the caller
+// would have paid anyway, and a saturated filter degrades the same way.
+static inline void xidBloomAdd(std::atomic<uint64_t>* bloom, long xid)
+{
+    unsigned long h = (unsigned long)xid * 0x9E3779B97F4A7C15UL;
+    unsigned long b1 = (h >> 16) & (XID_BLOOM_BITS - 1);
+    unsigned long b2 = (h >> 40) & (XID_BLOOM_BITS - 1);
+    bloom[b1 >> 6].fetch_or(1UL << (b1 & 63), std::memory_order_relaxed);
+    bloom[b2 >> 6].fetch_or(1UL << (b2 & 63), std::memory_order_relaxed);
+}
+
+static inline bool xidBloomMaybe(const std::atomic<uint64_t>* bloom, long xid)
+{
+    unsigned long h = (unsigned long)xid * 0x9E3779B97F4A7C15UL;
+    unsigned long b1 = (h >> 16) & (XID_BLOOM_BITS - 1);
+    unsigned long b2 = (h >> 40) & (XID_BLOOM_BITS - 1);
+    return (bloom[b1 >> 6].load(std::memory_order_relaxed) & (1UL << (b1 & 63)))
+        && (bloom[b2 >> 6].load(std::memory_order_relaxed) & (1UL << (b2 & 63)));
+}
+
+const long XID_STORE_RESERVE = 1L << 36; //lines of address space reserved per db, 512GB virtual — far past any base
+const long XID_STORE_COMMIT = 1L << 21; //commit granularity in lines, 16MB of pages per mprotect step
+
+// Append-only store of the xid column mirror. A plain vector<long> doubles
+// by copying: at 100M entries that is an 800MB memcpy made while rw_xids is
+// held exclusively, freezing every concurrent search's translation pass.
+// Instead the whole capacity is reserved up front as inaccessible virtual
+// address space and pages are committed in fixed steps as the column grows:
+// elements never move, the base pointer is stable for the life of the db
+// (the AVX2 merge gather and the replication range writes read through it
+// directly), and appends touch only the tail pages — the write lock is held
+// for the append itself, never for a copy. The count is published with
+// release/acquire, so a reader that takes no lock still sees a fully
+// written prefix. Mutation stays single-writer under rw_xids as before.
+struct XidStore {
+    long* base = nullptr;
+    std::atomic<long> count{ 0 };
+    long committed = 0; //lines whose pages are read-write, only ever grows
+
+    XidStore()
+    {
+        void* p = mmap(nullptr, XID_STORE_RESERVE * sizeof(long), PROT_NONE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (p == MAP_FAILED)
+            LOG(FATAL) << "xid store reservation failed with " << strerror(errno);
+        base = (long*)p;
+    }
+    ~XidStore()
+    {
+        munmap(base, XID_STORE_RESERVE * sizeof(long));
+    }
+    XidStore(const XidStore&) = delete;
+    XidStore& operator=(const XidStore&) = delete;
+
+    long size() const { return count.load(std::memory_order_acquire); }
+    long memBytes() const { return committed * (long)sizeof(long); }
+    long operator[](long i) const { return base[i]; }
+    long& operator[](long i) { return base[i]; }
+
+    void commitTo(long n)
+    {
+        if (n <= committed)
+            return;
+        long c = (n + XID_STORE_COMMIT - 1) / XID_STORE_COMMIT * XID_STORE_COMMIT;
+        if (0 != mprotect(base + committed, (c - committed) * sizeof(long), PROT_READ | PROT_WRITE))
+            LOG(FATAL) << "xid store commit failed with " << strerror(errno);
+        committed = c;
+    }
+    //sets the count without filling; the caller writes the lines in place
+    void resize(long n)
+    {
+        commitTo(n);
+        count.store(n, std::memory_order_release);
+    }
+    void push_back(long v)
+    {
+        long n = count.load(std::memory_order_relaxed);
+        commitTo(n + 1);
+        base[n] = v;
+        count.store(n + 1, std::memory_order_release);
+    }
+    void append(const long* v, long n)
+    {
+        long old = count.load(std::memory_order_relaxed);
+        commitTo(old + n);
+        memcpy(base + old, v, n * sizeof(long));
+        count.store(old + n, std::memory_order_release);
+    }
+    //wholesale replacement (open, compaction renumber); committed pages are kept
+    void assign(const long* v, long n)
+    {
+        commitTo(n);
+        if (n > 0)
+            memcpy(base, v, n * sizeof(long));
+        count.store(n, std::memory_order_release);
+    }
+};
+
+//binary MANIFEST of a work_dir, replaced by atomic rename on every activation
+struct Manifest {
+    long magic;
+    long version; //storage format version, 2 is the columnar layout
+    long ntrain; //the number of training points of the current index, 0 if none
+    long nbase; //the number of base lines covered when the manifest was written
+};
+const long MANIFEST_MAGIC = 0x46494e414d424456L; //"VDBMANIF" little-endian
+const long MANIFEST_VERSION = 2L;
+
+//extracts "key=value" from query_params and strips it, since faiss auto-tuning
+//knows nothing about engine-level options. Returns the value, or "" if absent.
+static string stripParam(string& query_params, const string& key)
+{
+    size_t pos = query_params.find(key + "=");
+    if (pos == string::npos)
+        return string();
+    size_t vstart = pos + key.length() + 1;
+    size_t vend = query_params.find(',', vstart);
+    if (vend == string::npos)
+        vend = query_params.length();
+    string val = query_params.substr(vstart, vend - vstart);
+    if (vend < query_params.length())
+        query_params.erase(pos, vend + 1 - pos);
+    else
+        query_params.erase(pos == 0 ? 0 : pos - 1);
+    return val;
+}
+
+//a 1-NN search waiting to be merged into a coalesced batch
+struct SearchReq {
+    long nq;
+    const float* xq;
+    float* distances;
+    long* xids;
+    bool done;
+    long total;
+};
+
+//per-thread scratch of the search path, reused across calls so steady-state
+//searches allocate nothing once grown to the high-water mark
+struct SearchScratch {
+    vector<float> D;
+    vector<faiss::Index::idx_t> I;
+    vector<vector<pair<float, long>>> results;
+};
+static thread_local SearchScratch search_scratch;
+
+//cycle counter of the search instrumentation. Cheap enough for the hot path,
+//monotonicity per core is all the stage deltas need.
+static inline unsigned long rdtscNow()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    return (unsigned long)chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+//monotonic microsecond stamp of the search deadline checks: immune to
+//wall-clock steps, cheap enough for list/chunk granularity polls.
+static inline long monoNowUs()
+{
+    return (long)chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//the sgemm the batched rerank goes through: faiss links BLAS anyway, so
+//declare the Fortran entry the same way faiss/utils.cpp does
+#ifndef FINTEGER
+#define FINTEGER long
+#endif
+extern "C" int sgemm_(const char* transa, const char* transb, FINTEGER* m, FINTEGER* n, FINTEGER* k, const float* alpha, const float* a, FINTEGER* lda, const float* b, FINTEGER* ldb, float* beta, float* c, FINTEGER* ldc);
+
+// --- BLAS microcalibration -----------------------------------------------
+// faiss switches between its SIMD loop and the blocked-sgemm path at a
+// fixed query-count threshold and tiles the sgemm with block sizes sized
+// for mid-2010s Xeons; both are far off on newer cache geometries (measured
+// 2x on the blocked path from tiles alone). Once per process — and, through
+// a per-machine cache file, once per host — a short sweep measures the real
+// crossover and the best tiles on synthetic data and installs them in the
+// faiss globals, so the flat memtable scan, the refine fallbacks and the
+// brute-force wrapper all profit. VECTODB_BLAS_THRESHOLD, VECTODB_BLAS_BS_X
+// and VECTODB_BLAS_BS_Y override individual values; VECTODB_BLAS_CALIBRATE=0
+// skips the sweep and keeps the faiss defaults.
+static const char* BLAS_TUNE_FP = "/var/tmp/vectodb.blas.tune";
+static std::once_flag blas_calib_once;
+
+static void calibrateBlas()
+{
+    const char* cal = getenv("VECTODB_BLAS_CALIBRATE");
+    bool sweep = cal == nullptr || string(cal) != "0";
+    long thr = 0, bsx = 0, bsy = 0;
+    if (const char* s = getenv("VECTODB_BLAS_THRESHOLD"))
+        thr = strtol(s, nullptr, 10);
+    if (const char* s = getenv("VECTODB_BLAS_BS_X"))
+        bsx = strtol(s, nullptr, 10);
+    if (const char* s = getenv("VECTODB_BLAS_BS_Y"))
+        bsy = strtol(s, nullptr, 10);
+    if ((thr <= 0 || bsx <= 0 || bsy <= 0) && sweep) {
+        //a previous run on this host already measured
+        ifstream f(BLAS_TUNE_FP);
+        string ver;
+        long t = 0, x = 0, y = 0;
+        if (f && (f >> ver >> t >> x >> y) && ver == "v1") {
+            if (thr <= 0)
+                thr = t;
+            if (bsx <= 0)
+                bsx = x;
+            if (bsy <= 0)
+                bsy = y;
+        }
+    }
+    bool measured = false;
+    if ((thr <= 0 || bsx <= 0 || bsy <= 0) && sweep) {
+        const long d = 128, ny = 8192, k = 16;
+        vector<float> y(ny * d), x(4096 * d);
+        std::mt19937 gen(42);
+        std::uniform_real_distribution<float> dis(-1.0f, 1.0f);
+        for (float& v : y)
+            v = dis(gen);
+        for (float& v : x)
+            v = dis(gen);
+        vector<float> D(4096 * k);
+        vector<long> I(4096 * k);
+        //force one side through the public entry by moving the threshold
+        auto timeKnn = [&](long nx, int threshold) {
+            faiss::distance_compute_blas_threshold = threshold;
+            faiss::float_maxheap_array_t res = { size_t(nx), size_t(k), &I[0], &D[0] };
+            long best = LONG_MAX;
+            for (int rep = 0; rep < 2; rep++) {
+                long t0 = monoNowUs();
+                faiss::knn_L2sqr(&x[0], &y[0], d, nx, ny, &res);
+                best = std::min(best, monoNowUs() - t0);
+            }
+            return best;
+        };
+        if (thr <= 0) {
+            thr = 64; //the SIMD loop won everywhere we looked
+            for (long nx = 4; nx <= 64; nx *= 2)
+                if (timeKnn(nx, 1) < timeKnn(nx, INT_MAX)) {
+                    thr = nx;
+                    break;
+                }
+        }
+        if (bsy <= 0) {
+            long best = LONG_MAX;
+            for (long cand = 256; cand <= 4096; cand *= 2) {
+                faiss::distance_compute_blas_bs_y = cand;
+                long t = timeKnn(256, 1);
+                if (t < best) {
+                    best = t;
+                    bsy = cand;
+                }
+            }
+            faiss::distance_compute_blas_bs_y = bsy;
+        }
+        if (bsx <= 0) {
+            long best = LONG_MAX;
+            for (long cand = 1024; cand <= 4096; cand *= 2) {
+                faiss::distance_compute_blas_bs_x = cand;
+                long t = timeKnn(4096, 1);
+                if (t < best) {
+                    best = t;
+                    bsx = cand;
+                }
+            }
+        }
+        measured = true;
+    }
+    if (thr > 0)
+        faiss::distance_compute_blas_threshold = (int)thr;
+    else
+        faiss::distance_compute_blas_threshold = 20; //faiss default, sweep disabled
+    if (bsx > 0)
+        faiss::distance_compute_blas_bs_x = bsx;
+    if (bsy > 0)
+        faiss::distance_compute_blas_bs_y = bsy;
+    LOG(INFO) << "BLAS tuning: threshold=" << faiss::distance_compute_blas_threshold
+              << " bs_x=" << faiss::distance_compute_blas_bs_x
+              << " bs_y=" << faiss::distance_compute_blas_bs_y
+              << (measured ? " (measured)" : " (cached/override)");
+    if (measured) {
+        string tmp = string(BLAS_TUNE_FP) + ".tmp";
+        ofstream f(tmp);
+        if (f) {
+            f << "v1 " << thr << " " << bsx << " " << bsy << "\n";
+            f.close();
+            rename(tmp.c_str(), BLAS_TUNE_FP);
+        }
+    }
+}
+
+// --- jemalloc arena partitioning -----------------------------------------
+// The binary links jemalloc; left on the default arenas the giant transient
+// build allocations (readBase vectors, training scratch) interleave with
+// the long-lived index storage and whatever the search path allocates, and
+// the freed holes keep RSS climbing between restarts. Subsystems therefore
+// get dedicated arenas: build transients in one whose dirty pages are
+// returned wholesale after every activation, index storage in another. The
+// symbol is weak, so a binary linked without jemalloc keeps the default
+// allocator and all of this is a no-op.
+extern "C" int mallctl(const char* name, void* oldp, size_t* oldlenp, void* newp, size_t newlen) __attribute__((weak));
+
+static unsigned arena_build = 0;
+static unsigned arena_index = 0;
+static std::once_flag arena_once;
+
+static void createArenas()
+{
+    if (mallctl == nullptr)
+        return;
+    size_t sz = sizeof(unsigned);
+    if (0 != mallctl("arenas.create", &arena_build, &sz, nullptr, 0))
+        arena_build = 0;
+    sz = sizeof(unsigned);
+    if (0 != mallctl("arenas.create", &arena_index, &sz, nullptr, 0))
+        arena_index = 0;
+    LOG(INFO) << "jemalloc arenas: build=" << arena_build << " index=" << arena_index;
+}
+
+//binds the calling thread to an arena for the scope and restores the
+//previous binding on exit, since build threads and cgo threads outlive the
+//work they did for us. arena 0 (creation failed, or no jemalloc) is a no-op.
+struct ArenaBinder {
+    unsigned prev = 0;
+    bool bound = false;
+    explicit ArenaBinder(unsigned arena)
+    {
+        std::call_once(arena_once, createArenas);
+        if (arena == 0)
+            return;
+        size_t sz = sizeof(prev);
+        bound = 0 == mallctl("thread.arena", &prev, &sz, &arena, sizeof(arena));
+    }
+    ~ArenaBinder()
+    {
+        if (bound)
+            mallctl("thread.arena", nullptr, nullptr, &prev, sizeof(prev));
+    }
+};
+
+//returns the build arena's dirty pages to the OS, once an activation has
+//retired the transients wholesale
+static void purgeBuildArena()
+{
+    std::call_once(arena_once, createArenas);
+    if (arena_build == 0)
+        return;
+    char name[64];
+    snprintf(name, sizeof(name), "arena.%u.purge", arena_build);
+    mallctl(name, nullptr, nullptr, nullptr, 0);
+}
+
+//one jemalloc counter, 0 without jemalloc or on an unknown name. The stats
+//are cached behind an epoch; the caller bumps it once per snapshot
+static long mallocStat(const char* name)
+{
+    if (mallctl == nullptr)
+        return 0;
+    size_t v = 0;
+    size_t sz = sizeof(v);
+    if (0 != mallctl(name, &v, &sz, nullptr, 0))
+        return 0;
+    return (long)v;
+}
+
+static long mallocArenaStat(unsigned arena, const char* what)
+{
+    char name[96];
+    snprintf(name, sizeof(name), "stats.arenas.%u.%s", arena, what);
+    return mallocStat(name);
+}
+
+static void mallocStatsRefresh()
+{
+    if (mallctl == nullptr)
+        return;
+    uint64_t e = 1;
+    size_t sz = sizeof(e);
+    mallctl("epoch", &e, &sz, &e, sizeof(e));
+}
+
+// --- container CPU quota ------------------------------------------------
+// Under a Kubernetes CPU limit omp_get_num_procs() still reports the
+// host's cores (64 on a 4-CPU-limit pod), so teams sized from it blow the
+// cfs quota and stall until the next period — visible as latency jitter at
+// period boundaries. The real budget is the quota ceiling, quota/period
+// rounded up, read from cgroup v2 (cpu.max) or v1 (cpu.cfs_quota_us).
+const long CGROUP_REDETECT_SEC = 10L; //seconds between quota re-reads, so in-place limit changes take hold without a restart
+
+static long cgroupCpuQuota()
+{
+    //cgroup v2: cpu.max holds "max <period>" or "<quota> <period>"
+    ifstream f2("/sys/fs/cgroup/cpu.max");
+    if (f2) {
+        string q;
+        long period = 0;
+        if ((f2 >> q >> period) && q != "max" && period > 0)
+            return (strtol(q.c_str(), nullptr, 10) + period - 1) / period;
+        return 0;
+    }
+    //cgroup v1: quota and period in separate files, quota -1 means none
+    ifstream fq("/sys/fs/cgroup/cpu/cpu.cfs_quota_us");
+    ifstream fp("/sys/fs/cgroup/cpu/cpu.cfs_period_us");
+    long quota = 0, period = 0;
+    if (fq && fp && (fq >> quota) && (fp >> period) && quota > 0 && period > 0)
+        return (quota + period - 1) / period;
+    return 0;
+}
+
+//the core count every pool and team sizes from: host cores capped by the
+//cgroup quota, cached and re-detected every CGROUP_REDETECT_SEC
+static long effectiveNumProcs()
+{
+    static atomic<long> cached{ 0 };
+    static atomic<long> checked_at{ 0 };
+    long v = cached.load(memory_order_relaxed);
+    long now = (long)std::time(nullptr);
+    if (v > 0 && now - checked_at.load(memory_order_relaxed) < CGROUP_REDETECT_SEC)
+        return v;
+    long ncpu = omp_get_num_procs();
+    long quota = cgroupCpuQuota();
+    long nv = quota > 0 ? std::min(ncpu, quota) : ncpu;
+    if (v > 0 && nv != v)
+        LOG(INFO) << "cgroup cpu quota moved effective parallelism " << v << " -> " << nv << " (host cores " << ncpu << ")";
+    cached.store(nv, memory_order_relaxed);
+    checked_at.store(now, memory_order_relaxed);
+    return nv;
+}
+
+// --- OpenMP concurrency governor ----------------------------------------
+// Each faiss call forks its own OpenMP team, so 64 concurrent searchers
+// oversubscribe the box several-fold while OMP_NUM_THREADS=1 cripples
+// large-nq batches. A process-wide token budget of the effective core
+// count sizes each call instead: callers take min(nq, free cores) tokens
+// (always at least one, never blocking) and run their team at that width,
+// so nq=1 calls go single-threaded under load and big batches get the
+// cores actually free.
+static atomic<long> omp_tokens_used{ 0 };
+
+//RAII: sizes the calling thread's OpenMP team for the enclosed faiss calls
+//and returns the tokens (and the previous team size) on scope exit
+struct OmpGovernor {
+    int grant;
+    int prev;
+    explicit OmpGovernor(long want)
+    {
+        const long ncpu = effectiveNumProcs();
+        want = std::min(std::max(want, 1L), ncpu);
+        long used = omp_tokens_used.load(memory_order_relaxed);
+        long g;
+        do {
+            g = std::max(1L, std::min(want, ncpu - used));
+        } while (!omp_tokens_used.compare_exchange_weak(used, used + g, memory_order_relaxed));
+        grant = (int)g;
+        prev = omp_get_max_threads();
+        omp_set_num_threads(grant);
+    }
+    ~OmpGovernor()
+    {
+        omp_set_num_threads(prev);
+        omp_tokens_used.fetch_sub(grant, memory_order_relaxed);
+    }
+};
+
+// --- asynchronous event log ---------------------------------------------
+// glog's sink lock makes inline FlushLogFiles (and a burst of LOG lines)
+// stall the calling thread for tens of ms under disk pressure. Engine
+// threads instead write fixed-size records into a per-thread SPSC ring; a
+// single background thread aggregates, formats through glog and performs
+// the flushes. A full ring drops the record and counts it — no engine
+// thread ever blocks on log I/O. The facility is process-wide like glog
+// itself, shared by all VectoDB instances.
+enum EvtCode : int {
+    EVT_ADD = 0, //a=vectors added, b=WAL bytes enqueued
+    EVT_UPDATE, //a=vectors submitted, b=vectors whose xid resolved
+    EVT_DELETE, //a=xids submitted, b=lines tombstoned
+    EVT_NCODE //count of codes, keep last
+};
+struct EvtRecord {
+    int code;
+    long a;
+    long b;
+};
+struct EvtRing {
+    atomic<long> head{ 0 }; //written by the owning thread only
+    atomic<long> tail{ 0 }; //written by the drainer only
+    EvtRecord slots[EVT_RING_CAP];
+};
+static mutex evt_mtx; //ring registration and drainer wakeup only, never on the record path
+static condition_variable evt_cv;
+static vector<EvtRing*> evt_rings;
+static atomic<long> evt_dropped{ 0 };
+static atomic<bool> evt_flush_req{ false };
+static bool evt_started = false;
+
+static void evtDrain()
+{
+    vector<EvtRing*> rings;
+    {
+        mtxlock lk{ evt_mtx };
+        rings = evt_rings;
+    }
+    long cnt[EVT_NCODE] = {}, sum_a[EVT_NCODE] = {}, sum_b[EVT_NCODE] = {};
+    for (EvtRing* r : rings) {
+        long t = r->tail.load(memory_order_relaxed);
+        const long h = r->head.load(memory_order_acquire);
+        for (; t < h; t++) {
+            const EvtRecord& rec = r->slots[t & (EVT_RING_CAP - 1)];
+            cnt[rec.code]++;
+            sum_a[rec.code] += rec.a;
+            sum_b[rec.code] += rec.b;
+        }
+        r->tail.store(t, memory_order_release);
+    }
+    // one line per active code per cycle keeps the log volume bounded no
+    // matter how hot the producers run
+    if (cnt[EVT_ADD] > 0)
+        LOG(INFO) << "evt add: " << cnt[EVT_ADD] << " batches, " << sum_a[EVT_ADD] << " vectors, " << sum_b[EVT_ADD] << " wal bytes";
+    if (cnt[EVT_UPDATE] > 0)
+        LOG(INFO) << "evt update: " << cnt[EVT_UPDATE] << " batches, " << sum_b[EVT_UPDATE] << "/" << sum_a[EVT_UPDATE] << " vectors resolved";
+    if (cnt[EVT_DELETE] > 0)
+        LOG(INFO) << "evt delete: " << cnt[EVT_DELETE] << " batches, " << sum_b[EVT_DELETE] << "/" << sum_a[EVT_DELETE] << " xids tombstoned";
+    static long dropped_seen = 0;
+    const long dropped = evt_dropped.load(memory_order_relaxed);
+    if (dropped > dropped_seen) {
+        LOG(WARNING) << "evt log dropped " << dropped - dropped_seen << " records (" << dropped << " total)";
+        dropped_seen = dropped;
+    }
+}
+
+static void evtServ()
+{
+    for (;;) {
+        {
+            mtxlock lk{ evt_mtx };
+            evt_cv.wait_for(lk, chrono::milliseconds(EVT_DRAIN_MS));
+        }
+        evtDrain();
+        if (evt_flush_req.exchange(false, memory_order_acq_rel))
+            google::FlushLogFiles(google::INFO);
+    }
+}
+
+static void evtStart()
+{
+    mtxlock lk{ evt_mtx };
+    if (!evt_started) {
+        // process-lifetime daemon, detached like glog's own flusher
+        std::thread(evtServ).detach();
+        evt_started = true;
+    }
+}
+
+static EvtRing* evtRingOfThread()
+{
+    static thread_local EvtRing* ring = nullptr;
+    if (ring == nullptr) {
+        // leaked at thread exit on purpose: rings are small and the drainer
+        // keeps a reference
+        ring = new EvtRing();
+        evtStart();
+        mtxlock lk{ evt_mtx };
+        evt_rings.push_back(ring);
+    }
+    return ring;
+}
+
+static void evtLog(int code, long a, long b)
+{
+    EvtRing* r = evtRingOfThread();
+    const long h = r->head.load(memory_order_relaxed);
+    if (h - r->tail.load(memory_order_acquire) >= EVT_RING_CAP) {
+        evt_dropped.fetch_add(1, memory_order_relaxed);
+        return;
+    }
+    r->slots[h & (EVT_RING_CAP - 1)] = EvtRecord{ code, a, b };
+    r->head.store(h + 1, memory_order_release);
+}
+
+//replaces inline google::FlushLogFiles: hands the flush to the background
+//thread so callers return without touching the sink lock
+static void evtFlushAsync()
+{
+    evtStart();
+    evt_flush_req.store(true, memory_order_release);
+    evt_cv.notify_one();
+}
+
+// --- chrome trace spans ---------------------------------------------------
+// Opt-in span recorder behind TraceStart/TraceDump: the pipeline operations
+// (builds, activations, group commits, update replays, search batches)
+// record begin/end/thread/args into a process-wide lock-free ring, dumped
+// as Chrome trace-event JSON for Perfetto. Logs can't reconstruct how these
+// interleave over an incident window; the trace shows exactly what
+// overlapped with a spike. Recording off costs one relaxed load per span.
+const long TRACE_RING_CAP = 1L << 14; //spans kept, oldest overwritten; must be a power of two
+struct TraceSpan {
+    const char* name; //static string, nullptr marks a never-written slot
+    long tid;
+    long us_begin; //monotonic micros
+    long us_end;
+    const char* k1; //static arg keys, nullptr = absent
+    const char* k2;
+    long a1;
+    long a2;
+};
+static atomic<bool> trace_on{ false };
+static atomic<long> trace_head{ 0 };
+static TraceSpan trace_ring[TRACE_RING_CAP];
+
+//RAII span: captures begin at construction, publishes the whole record at
+//scope exit with one slot claim. Arms only while recording is on, so the
+//steady_clock reads stay off the disabled path.
+struct TraceScope {
+    TraceSpan s;
+    bool armed;
+    explicit TraceScope(const char* name, const char* k1 = nullptr, long a1 = 0, const char* k2 = nullptr, long a2 = 0)
+        : armed(trace_on.load(memory_order_relaxed))
+    {
+        if (!armed)
+            return;
+        s.name = name;
+        s.tid = (long)syscall(SYS_gettid);
+        s.k1 = k1;
+        s.k2 = k2;
+        s.a1 = a1;
+        s.a2 = a2;
+        s.us_begin = monoNowUs();
+    }
+    ~TraceScope()
+    {
+        if (!armed)
+            return;
+        s.us_end = monoNowUs();
+        long h = trace_head.fetch_add(1, memory_order_relaxed);
+        trace_ring[h & (TRACE_RING_CAP - 1)] = s;
+    }
+};
+
+//one slot of the content-addressed 1-NN result cache. The full query vector
+//is kept so a hash collision degrades to a miss, never to a wrong answer.
+struct RCacheEntry {
+    unsigned long hash = 0; //0 marks an empty slot
+    long epoch = 0; //entries whose epoch lags the current one are stale
+    float dis = 0;
+    long xid = -1;
+    vector<float> vec;
+};
+
+//a batch of deduplicated lines waiting for the group-commit writer
+struct PendingAdd {
+    vector<long> xids;
+    vector<long> counts;
+    vector<float> vec;
+    vector<float> norms; //metric L2: ||x||^2 per line, computed once by the adder
+    uint32_t tstamp = 0; //ttl_sec=<n>: unix second of the add, one per batch
+};
+
+//temperature of one mapped base segment. hits counts refine gathers since
+//the last RebalanceTiers pass; elements never move (the deque only grows
+//under the rw_data write lock) so searches increment them lock-free. Padded
+//to a cache line so neighbouring segments don't false-share the counters.
+struct alignas(64) SegHeat {
+    atomic<long> hits{ 0 };
+    atomic<long> hits_window{ 0 }; //gathers of the last completed window, what GetSegmentStats reports
+    atomic<int> hot{ 1 }; //new segments start on the fast tier; RebalanceTiers demotes idle ones
+    //per-block gather counters: refine accesses cluster by inverted list, and
+    //lists were filled in line order, so a hot list shows up as a hot range
+    //of blocks. RebalanceTiers keeps those resident and lets cold blocks page
+    //out, at 1/SEG_HEAT_NBLOCK of the segment instead of all-or-nothing.
+    atomic<long> block_hits[SEG_HEAT_NBLOCK] = {};
+    atomic<uint64_t> hot_blocks{ ~0UL }; //residency bitmask, new segments start fully resident
+};
+static_assert(SEG_HEAT_NBLOCK <= 64, "hot_blocks is a 64-bit mask");
+
+//one distinct updated line in an update aggregation table, used both by the
+//UpdateBase replay and by the in-memory coalescing table (upd_coalesce=<n>).
+//The vector lives in a bump arena at offset off, freed wholesale afterwards.
+struct UpdSlot {
+    long line_num; //-1 means empty
+    long count;
+    long off;
+};
+
+static inline size_t updSlotOf(long line_num, size_t mask)
+{
+    return (size_t)(((unsigned long)line_num * 0x9E3779B97F4A7C15UL) >> 17) & mask;
+}
+
+//The long heading each update.fvecs record packs the number of raw updates a
+//merged record absorbed into its high bits: <count:22><line_num:40>. Plain
+//appends write count 0, which reads back as 1, so backlog files written
+//before the coalescing table existed parse unchanged.
+static const int UPD_LINE_BITS = 40;
+static const long UPD_LINE_MASK = (1L << UPD_LINE_BITS) - 1;
+static const long UPD_COUNT_MAX = (1L << (62 - UPD_LINE_BITS)) - 1;
+
+//one slow-query record (slowlog_us=<n>). Wall times are microseconds; the
+//stage costs are rdtsc cycles like GetSearchStats, so the two line up.
+struct SlowQuery {
+    long wall_us; //unix microseconds at completion
+    long nq;
+    long k;
+    long batch; //1 = a SearchKnnBatch slice
+    long total_us; //wall time of the call, what the threshold compares
+    long lock_us; //wait for the four snapshot reader locks
+    long cyc_coarse; //coarse quantization, per-call nprobe path only
+    long cyc_index; //index stage including the list scan
+    long cyc_refine; //exact refine over the mapped base
+    long cyc_flat; //flat-tail scan, concurrent with the index stage
+    long cyc_merge;
+    long nprobe; //effective nprobe, 0 when the per-call path did not run
+    long visited; //lines of the selected inverted lists
+    long faults; //process page faults (minor+major) during the call
+};
 
 struct DbState {
     DbState()
-        : data(nullptr)
-        , len_data(0)
+        : fd_xids(-1)
+        , fd_counts(-1)
+        , fd_times(-1)
+        , fd_norms(-1)
+        , fd_vec(-1)
+        , vec_nsegs(0)
+        , vec_tail_lines(0)
+        , wal_seq_enq(0)
+        , wal_seq_durable(0)
+        , wal_pending_lines(0)
+        , wal_stop(false)
+        , follow_stop(false)
+        , coal_leader_active(false)
+        , shed_level(0)
+        , shed_calm(0)
+        , st_shed_nq(0)
+        , prefaulted_lines(-1)
         , total(0)
+        , stat_flat(0)
+        , stat_ntrain(0)
+        , stat_nsize(0)
+        , stat_upd_bytes(0)
+        , stat_building(false)
+        , stat_build_mem(0)
+        , stat_build_phase(0)
+        , stat_build_processed(0)
+        , build_cancel(false)
+        , stat_warmed(false)
         , ntrain(0L)
         , index(nullptr)
         , flat(nullptr)
         , flat_start_num(0)
+        , xids_identity(true)
+        , rcache_epoch(0)
+        , st_cache_lookups(0)
+        , st_cache_hits(0)
+        , act_nq0(0)
+        , act_cyc0(0)
+        , act_baseline_cyc(0)
+        , act_no_persist(false)
+        , st_nq(0)
+        , st_cyc_index(0)
+        , st_cyc_refine(0)
+        , st_cyc_flat(0)
+        , st_cyc_merge(0)
+        , st_flat_wins(0)
+        , st_index_wins(0)
+        , inter_inflight(0)
+        , st_list_splits(0)
     {
+        for (int i = 0; i < SEARCH_HIST_NBUCKET; i++)
+            st_hist[i] = 0;
+        for (int i = 0; i < 2; i++) {
+            st_prio_nq[i] = 0;
+            st_prio_cyc[i] = 0;
+        }
     }
     ~DbState()
     {
+        if (fd_xids >= 0)
+            close(fd_xids);
+        if (fd_counts >= 0)
+            close(fd_counts);
+        if (fd_times >= 0)
+            close(fd_times);
+        if (fd_norms >= 0)
+            close(fd_norms);
+        if (fd_vec >= 0)
+            close(fd_vec);
     }
 
     mutex m_base;
-    std::fstream fs_base; //for append of base.fvecs
+    int fd_xids; //O_APPEND fd of base.xids, written by the wal thread only
+    int fd_counts; //O_APPEND fd of base.counts
+    int fd_times; //O_APPEND fd of base.times (ttl_sec=<n> only)
+    int fd_norms; //O_APPEND fd of base.norms (metric L2 only)
+    int fd_vec; //O_APPEND fd of the tail segment of base.vec
+    long vec_nsegs; //number of base.vec.<k> segment files, the last one is the tail
+    long vec_tail_lines; //lines in the tail segment, rolls over to a fresh file at seg_lines. Maintained under m_base
+
+    // group-commit machinery. Adds enqueue under m_wal, the writer thread
+    // coalesces the queue into one large append per column file.
+    mutex m_wal;
+    condition_variable cv_wal; //wakes the writer
+    condition_variable cv_durable; //wakes callers waiting on the durability watermark
+    deque<PendingAdd> wal_queue;
+    long wal_seq_enq; //sequence of the last enqueued batch
+    long wal_seq_durable; //sequence of the last batch flushed to the column files
+    atomic<long> wal_pending_lines; //lines enqueued but not yet durable, the ingestion backpressure signal
+    bool wal_stop;
+    std::thread wal_thread;
+
+    std::thread persist_thread; //serializes the activated index to disk in the background
+
+    // readonly follower: polls the manifest and the base columns the writer
+    // node keeps appending to on the shared work_dir
+    mutex m_follow;
+    condition_variable cv_follow;
+    bool follow_stop;
+    std::thread follow_thread;
+
+    // coalescer of concurrent 1-NN searches. The first arrival leads the
+    // batch, later arrivals within the window piggyback on its faiss call.
+    mutex m_coal;
+    condition_variable cv_coal;
+    vector<SearchReq*> coal_queue;
+    bool coal_leader_active;
+    //overload shedding, driven by the coalescer round size: past SHED_DEPTH
+    //thresholds interactive queries trade a little recall (halved nprobe,
+    //shallow refine) for bounded latency instead of cascading timeouts
+    atomic<int> shed_level; //0 full quality, 1/2 degraded
+    long shed_calm; //calm rounds toward stepping the level down, guarded by m_coal
+    atomic<long> st_shed_nq; //interactive queries answered at a degraded level
 
     boost::shared_mutex rw_data;
-    uint8_t* data; //mapped (readonly) base file. remap after activating an index
-    long len_data; //length of mapped file, be equivlant to index.ntotal*len_base_line
+    vector<VectoDB::SegMap> seg_maps; //mapped (readonly) segments of the vector column. Activation (re)maps only the segments that changed
+    deque<SegHeat> seg_heat; //per-segment temperature, parallel to seg_maps
+    long prefaulted_lines; //base lines whose pages activation already touched, -1 until the first activation. Maintained under m_base
     atomic<long> total;
 
+    // Lock-free mirrors of the counters the Go layer polls every tick,
+    // updated with relaxed stores wherever the guarded originals change, so
+    // GetStats never contends with searches.
+    atomic<long> stat_flat; //flat->ntotal
+    atomic<long> stat_ntrain; //ntrain of the activated index
+    atomic<long> stat_nsize; //ntotal of the activated index
+    atomic<long> stat_upd_bytes; //bytes in the update.fvecs backlog
+    atomic<bool> stat_building; //a BuildIndex is in flight, owned by the build that CAS'ed it
+    atomic<long> stat_build_mem; //transient bytes the in-flight build holds from the build budget
+    atomic<long> stat_build_phase; //VectoDB::BUILD_* phase of the in-flight build
+    atomic<long> stat_build_processed; //vectors done in the current build phase
+    atomic<bool> build_cancel; //ask the in-flight build to abort at the next chunk boundary
+    atomic<bool> stat_warmed; //a Warmup has completed
+
     // Main activities in decreasing priority: insert, search, build and activate index.
     // Normally index is large, the read-lock (search) time is long(~26s for 10K searchs of sift),
     // the write-lock (activate index) just protects a pointer assignment.
     boost::shared_mutex rw_index;
     long ntrain; // the number of training points of the index
     faiss::Index* index;
+    vector<faiss::Index*> index_replicas; //numa=1: clone of index per NUMA node past the first, built first-touch on that node
+    // LSM-style delta tier: small indexes built from the flat tail between
+    // full rebuilds. Delta d covers base lines [delta_starts[d],
+    // delta_starts[d] + delta_indexes[d]->ntotal); its labels are 0-based
+    // within that range. Activation of a full build deletes them all.
+    vector<faiss::Index*> delta_indexes;
+    vector<long> delta_starts;
+    // ids32=1: compact 32-bit id table of the activated index, replacing the
+    // per-list 64-bit ids (freed once the index file is persisted). List l's
+    // ids are ids32_tab[ids32_off[l] .. ids32_off[l+1]); swapped together
+    // with the index under rw_index. When active, every main-index scan runs
+    // store_pairs and the merge widens (list, offset) pairs through here.
+    vector<uint32_t> ids32_tab;
+    vector<long> ids32_off;
+    atomic<bool> ids32_active{ false };
 
     // Normally flat is small, the read-lock time is short(40ms for 1K sift vectors),
     // the write-lock is also short(insertion speed is ~1M sift vectors/second).
     // So it's better to use C++ rwlock.
     boost::shared_mutex rw_flat;
     faiss::Index* flat;
+    vector<uint64_t> flat_sigs; //lsh=<bits>: packed LSH signature per flat row, maintained alongside flat
+    vector<float> flat_norms; //metric L2: ||x||^2 per flat row, maintained alongside flat
     long flat_start_num; //the line num of the first vecrot of flat. It's index->ntotal normally.
 
+    XidShard xid_shards[XID_NSHARD]; //sharded xid -> line_num map, striped locks keep concurrent Add/Update/Search off a global lock
+    std::vector<std::atomic<uint64_t>> xid_bloom = std::vector<std::atomic<uint64_t>>(XID_BLOOM_BITS / 64); //negative-lookup filter over the shard maps' keys
+
     boost::shared_mutex rw_xids;
-    unordered_map<long, long> xid2num;
-    vector<long> xids; //vector of xid of all vectors
+    XidStore xids; //xid of every base line; never reallocates, so appends cannot stall readers
+    atomic<bool> xids_identity; //every xid equals its line number so far: the merge emits candidates pre-translated, no lock and no gather
+    vector<float> base_norms; //metric L2: ||x||^2 per base line, mirrors the base.norms column
+    vector<long> repl_patched; //line numbers patched in place since open, the log ReadPatchedTail ships to standbys
+    vector<char> dels; //tombstone byte per base line, mirrors the base.dels column. A tombstoned line never surfaces from a search
+    vector<uint32_t> times; //ttl_sec=<n>: unix second each line was added, mirrors the base.times column. 0 exempts the line (ingested before TTL was enabled)
+    vector<long> repl_deleted; //line numbers tombstoned since open, the log ReadDeletedTail ships to standbys. CompactBase clears it
+    atomic<long> stat_dels{ 0 }; //lock-free mirror of the tombstone count
+    std::time_t dels_mtime = 0; //readonly follower: mtime of base.dels at the last reload
 
     mutex m_update;
     std::fstream fs_update; //for append, sequential read and truncate of update.fvecs
 
+    // upd_coalesce=<n>: bounded in-memory coalescing of the update backlog.
+    // Repeat updates of one line accumulate into its slot instead of each
+    // appending a record; the table spills to update.fvecs as merged records
+    // only on overflow, snapshot, shutdown or replay. Guarded by m_update.
+    vector<UpdSlot> upd_table;
+    vector<float> upd_arena;
+    size_t upd_mask = 0;
+    long upd_distinct = 0;
+    atomic<long> upd_mem_lines{ 0 }; //mirror of upd_distinct for the lock-free stats readers
+
     mutex m_base2;
-    std::fstream fs_base2; //for random write of base.fvecs
-};
+    std::fstream fs_counts2; //for random write of base.counts. UpdateBase opens the vec segments it touches on demand
+    std::fstream fs_norms2; //for random write of base.norms during an UpdateBase replay (metric L2 only)
+    std::fstream fs_dels2; //for random write of base.dels
 
-struct VecExt {
-    long count;
-    vector<float> vec;
-};
+    mutex m_del; //serializes DeleteWithIds, UpdateBase and ApplyPatch against CompactBase, which holds it end to end so neither the base bytes nor the patch/tombstone logs move under its copy
+    long sweep_cursor = 0; //lines below it are already swept (expired, exempt or tombstoned); timestamps are append-ordered so expiry only ever grows this prefix. Guarded by m_del
+    atomic<long> compact_epoch{ 0 }; //bumped by CompactBase while renumbering; the update append paths re-resolve their line numbers when it moves under them
+    boost::shared_mutex rw_compact; //adders hold it shared from line allocation through their map inserts; the compaction barrier takes it exclusively so no add straddles the renumbering
 
-VectoDB::VectoDB(const char* work_dir_in, long dim_in, int metric_type_in, const char* index_key_in, const char* query_params_in, float dist_threshold_in)
-    : work_dir(work_dir_in)
-    , dim(dim_in)
-    , len_vec(dim * sizeof(float))
-    , len_base_line(2 * sizeof(long) + len_vec)
-    , len_upd_line(sizeof(long) + len_vec)
-    , metric_type(metric_type_in)
-    , dist_threshold(dist_threshold_in)
-    , index_key(index_key_in)
-    , query_params(query_params_in)
-{
-    static_assert(sizeof(float) == 4, "sizeof(float) must be 4");
-    static_assert(sizeof(long) > 4, "sizeof(long) must be larger than 4");
+    // content-addressed 1-NN result cache (cache=<n>). Direct-mapped by query
+    // hash; writes bump the epoch instead of walking the table, so every
+    // entry of an older epoch is stale at once.
+    vector<RCacheEntry> rcache;
+    mutex m_rcache[RCACHE_NSHARD];
+    atomic<long> rcache_epoch;
+    atomic<long> st_cache_lookups;
+    atomic<long> st_cache_hits;
 
-    fs::path dir{ fs::absolute(work_dir_in) };
-    work_dir = dir.string().c_str();
+    // Per-stage search counters. Each search call accumulates its stage
+    // cycles in locals and publishes them with a handful of relaxed adds,
+    // so the shared cachelines are touched once per call, not per candidate.
+    // latency baseline of the previous index generation, for
+    // RollbackIfRegressed. Written under the rw_index write lock at every
+    // activation, read under the read lock.
+    long act_nq0; //st_nq at the last activation
+    long act_cyc0; //summed stage cycles at the last activation
+    long act_baseline_cyc; //mean cycles/query of the window before the last activation, 0 = unknown
+    bool act_no_persist; //one-shot: the next ActivateIndex serves a file already on disk (rollback), skip the persist
 
-    auto st{ std::make_unique<DbState>() }; //Make DbState be exception safe
-    state = std::move(st); // equivalent to state.reset(st.release());
-    fs::create_directories(dir);
-    //filename spec: base.fvecs, <index_key>.<ntrain>.index
-    //line spec of base.fvecs: <xid> <count> {<dim>}<float>
-    //line spec of update.fvecs: <line_num_at_base> {<dim>}<float>
-    const string& fp_base = getBaseFp();
-    //Loading database
-    //https://stackoverflow.com/questions/31483349/how-can-i-open-a-file-for-reading-writing-creating-it-if-it-does-not-exist-w
-    state->fs_base.exceptions(std::ios::failbit | std::ios::badbit);
-    state->fs_base.open(fp_base, std::fstream::out | std::fstream::app); //create file if not exist, otherwise do nothing
-    state->fs_base.close();
-    state->fs_base.open(fp_base, std::fstream::in | std::fstream::out | std::fstream::binary);
-    state->fs_base.seekp(0, ios_base::end); //a particular libstdc++ implementation may use a single pointer for both seekg and seekp.
+    atomic<long> st_nq;
+    atomic<long> st_cyc_index; //cycles in the main index search
+    atomic<long> st_cyc_refine; //cycles in the exact-distance refine
+    atomic<long> st_cyc_flat; //cycles in the flat-tail scan
+    atomic<long> st_cyc_merge; //cycles in filter/top-k/xid translation
+    atomic<long> st_flat_wins; //rank-0 result came from the flat tail
+    atomic<long> st_index_wins; //rank-0 result came from the main index
+    atomic<long> st_hist[SEARCH_HIST_NBUCKET]; //log2 histogram of per-query search cycles
 
-    long ntrain = getIndexFpNtrain();
-    faiss::Index* index = nullptr;
-    if (ntrain > 0) {
-        //Loading index
-        const string& fp_index = getIndexFp(ntrain);
-        LOG(INFO) << "Loading index " << fp_index;
-        index = faiss::read_index(fp_index.c_str());
+    // Priority classes. Every public search entry runs interactive by
+    // default; batch work declares itself via SearchKnnBatch and executes in
+    // small slices, each slice waiting here until interactive traffic has
+    // drained. Per-class counters verify the isolation from production.
+    atomic<long> inter_inflight;
+    mutex m_prio;
+    condition_variable cv_prio;
+    atomic<long> st_prio_nq[2]; //0 interactive, 1 batch
+    atomic<long> st_prio_cyc[2];
+    atomic<long> st_list_splits; //hot inverted lists split by SplitHotLists since open
+
+    // slow-query ring (slowlog_us=<n>): slot slowlog_seq % SLOWLOG_NSLOT is
+    // written next, so the newest SLOWLOG_NSLOT slow calls are always kept
+    mutex m_slowlog;
+    SlowQuery slowlog[SLOWLOG_NSLOT] = {};
+    long slowlog_seq = 0;
+};
+
+// Fused kernel of update replay: out = l2_normalize(acc + w * cur).
+// One vectorized pass accumulates the weighted sum and the squared norm,
+// a short second pass applies the reciprocal norm.
+static void fvec_waccum_normalize(float* out, const float* acc, const float* cur, float w, long dim)
+{
+    double sqr = 0;
+    long d = 0;
+#ifdef __AVX__
+    __m256 msqr = _mm256_setzero_ps();
+    __m256 mw = _mm256_set1_ps(w);
+    for (; d + 8 <= dim; d += 8) {
+        __m256 v = _mm256_add_ps(_mm256_loadu_ps(acc + d), _mm256_mul_ps(mw, _mm256_loadu_ps(cur + d)));
+        _mm256_storeu_ps(out + d, v);
+        msqr = _mm256_add_ps(msqr, _mm256_mul_ps(v, v));
     }
-    ActivateIndex(index, ntrain);
+    float buf[8];
+    _mm256_storeu_ps(buf, msqr);
+    for (int j = 0; j < 8; j++)
+        sqr += buf[j];
+#endif
+    for (; d < dim; d++) {
+        float v = acc[d] + w * cur[d];
+        out[d] = v;
+        sqr += double(v) * double(v);
+    }
+    float inv = (float)(1.0 / sqrt(sqr));
+    for (d = 0; d < dim; d++) {
+        out[d] *= inv;
+    }
+}
 
-    vector<long> xids;
-    readXids(state->data, state->total, 0, xids);
-    for (long i = 0; i < (long)xids.size(); i++) {
-        state->xid2num[xids[i]] = i;
+// SQ8 line layout: <vmin:float> <vscale:float> {<dim>}<uint8>.
+// decode: x[d] = vmin + vscale * code[d]. The scale is per vector, so the
+// 8-bit grid always spans exactly the range of that vector's components.
+static void sq8_encode(const float* vec, long dim, uint8_t* line)
+{
+    float vmin = vec[0], vmax = vec[0];
+    for (long d = 1; d < dim; d++) {
+        vmin = std::min(vmin, vec[d]);
+        vmax = std::max(vmax, vec[d]);
+    }
+    float vscale = (vmax - vmin) / 255.0f;
+    ((float*)line)[0] = vmin;
+    ((float*)line)[1] = vscale;
+    uint8_t* code = line + 2 * sizeof(float);
+    float inv = vscale > 0 ? 1.0f / vscale : 0.0f;
+    for (long d = 0; d < dim; d++) {
+        code[d] = (uint8_t)(int)((vec[d] - vmin) * inv + 0.5f);
     }
-    state->xids = std::move(xids);
+}
 
-    const string& fp_update = getUpdateFp();
-    state->fs_update.exceptions(std::ios::failbit | std::ios::badbit);
-    state->fs_update.open(fp_update, std::fstream::out | std::fstream::app);
-    state->fs_update.close();
-    state->fs_update.open(fp_update, std::fstream::in | std::fstream::out | std::fstream::binary);
-    state->fs_update.seekp(0, ios_base::end);
+static void sq8_decode(const uint8_t* line, long dim, float* vec)
+{
+    float vmin = ((const float*)line)[0];
+    float vscale = ((const float*)line)[1];
+    const uint8_t* code = line + 2 * sizeof(float);
+    for (long d = 0; d < dim; d++) {
+        vec[d] = vmin + vscale * code[d];
+    }
+}
 
-    state->fs_base2.exceptions(std::ios::failbit | std::ios::badbit);
-    state->fs_base2.open(fp_base, std::fstream::in | std::fstream::out | std::fstream::binary);
+// Binary line layout (binary=1): {dim/8}<uint8>, bit d set iff vec[d] > 0.5.
+// The encode round-trips any 0/1 vector exactly; anything else is snapped to
+// the nearer of the two, which is the sensible reading of a fingerprint that
+// went through float arithmetic.
+static void bin_encode(const float* vec, long dim, uint8_t* line)
+{
+    memset(line, 0, dim / 8);
+    for (long d = 0; d < dim; d++)
+        if (vec[d] > 0.5f)
+            line[d >> 3] |= (uint8_t)(1 << (d & 7));
+}
 
-    google::FlushLogFiles(google::INFO);
+static void bin_decode(const uint8_t* line, long dim, float* vec)
+{
+    for (long d = 0; d < dim; d++)
+        vec[d] = (line[d >> 3] >> (d & 7)) & 1 ? 1.0f : 0.0f;
 }
 
-VectoDB::~VectoDB()
+// Hamming distance of two packed lines; on 0/1 vectors this IS the squared
+// L2 distance, which is why binary mode can hand it to the float pipeline.
+static inline float bin_hamming(const uint8_t* a, const uint8_t* b, long nbytes)
 {
-    // There's no lock protection since I assume the object is idle.
-    // Up layer could protect it with rwlock.
-    if (state.get() != nullptr) {
-        munmapFile(getBaseFp(), state->data, state->len_data);
-        delete state->index;
-        delete state->flat;
+    long acc = 0;
+    long i = 0;
+    for (; i + 8 <= nbytes; i += 8) {
+        uint64_t wa, wb; //lines sit at arbitrary offsets of the segment mmaps
+        memcpy(&wa, a + i, 8);
+        memcpy(&wb, b + i, 8);
+        acc += __builtin_popcountl(wa ^ wb);
     }
+    for (; i < nbytes; i++)
+        acc += __builtin_popcount((unsigned)(a[i] ^ b[i]));
+    return (float)acc;
 }
 
-void VectoDB::BuildIndex(long cur_ntrain, long cur_nsize, faiss::Index*& index_out, long& ntrain) const
+// Dimension-specialized exact distances. With DIM fixed at compile time the
+// trip count is a constant, so the compiler fully unrolls the loop and the
+// tail handling disappears; the constructor binds the fleet's dims (128, 256,
+// 512) once per instance and everything else falls back to the generic faiss
+// loops. Loads stay unaligned: base lines sit at arbitrary offsets of the
+// segment mmaps, so 32-byte alignment is not guaranteed.
+template <int DIM>
+static float fvec_L2sqr_dim(const float* x, const float* y, size_t)
 {
-    index_out = nullptr;
-    ntrain = 0;
-    if (0 == index_key.compare("Flat")) {
-        return;
+    double sqr = 0;
+    int d = 0;
+#ifdef __AVX2__
+    __m256 msqr = _mm256_setzero_ps();
+    for (; d + 8 <= DIM; d += 8) {
+        __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(x + d), _mm256_loadu_ps(y + d));
+        msqr = _mm256_add_ps(msqr, _mm256_mul_ps(diff, diff));
+    }
+    float buf[8];
+    _mm256_storeu_ps(buf, msqr);
+    for (int i = 0; i < 8; i++)
+        sqr += buf[i];
+#endif
+    for (; d < DIM; d++) {
+        float diff = x[d] - y[d];
+        sqr += diff * diff;
     }
+    return (float)sqr;
+}
 
-    const string& fp_base = getBaseFp();
-    uint8_t* data = nullptr;
-    long len_data = 0;
-    mmapFile(fp_base, data, len_data); // this may occur in the middle of wirting to fp_base.
-    long nb = getNumLines(len_data, len_base_line);
-    faiss::Index* index = nullptr;
-    long nt = 0;
+template <int DIM>
+static float fvec_inner_product_dim(const float* x, const float* y, size_t)
+{
+    double acc = 0;
+    int d = 0;
+#ifdef __AVX2__
+    __m256 macc = _mm256_setzero_ps();
+    for (; d + 8 <= DIM; d += 8)
+        macc = _mm256_add_ps(macc, _mm256_mul_ps(_mm256_loadu_ps(x + d), _mm256_loadu_ps(y + d)));
+    float buf[8];
+    _mm256_storeu_ps(buf, macc);
+    for (int i = 0; i < 8; i++)
+        acc += buf[i];
+#endif
+    for (; d < DIM; d++)
+        acc += x[d] * y[d];
+    return (float)acc;
+}
 
-    // Prepareing index
-    LOG(INFO) << "BuildIndex " << work_dir << ". dim=" << dim << ", index_key=\"" << index_key << "\", metric=" << metric_type << ", nb=" << nb;
-    if (nb < MIN_NTRAIN)
-        goto quit;
+// Exact distances against an SQ8 line, decoding on the fly so the gather
+// stays within the 4x-smaller cache footprint of the codes.
+static float fvec_L2sqr_sq8(const float* x, const uint8_t* line, long dim)
+{
+    float vmin = ((const float*)line)[0];
+    float vscale = ((const float*)line)[1];
+    const uint8_t* code = line + 2 * sizeof(float);
+    double sqr = 0;
+    long d = 0;
+#ifdef __AVX2__
+    __m256 msqr = _mm256_setzero_ps();
+    __m256 mmin = _mm256_set1_ps(vmin);
+    __m256 mscale = _mm256_set1_ps(vscale);
+    for (; d + 8 <= dim; d += 8) {
+        __m256 my = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(code + d))));
+        my = _mm256_add_ps(mmin, _mm256_mul_ps(mscale, my));
+        __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(x + d), my);
+        msqr = _mm256_add_ps(msqr, _mm256_mul_ps(diff, diff));
+    }
+    float buf[8];
+    _mm256_storeu_ps(buf, msqr);
+    for (int i = 0; i < 8; i++)
+        sqr += buf[i];
+#endif
+    for (; d < dim; d++) {
+        float diff = x[d] - (vmin + vscale * code[d]);
+        sqr += diff * diff;
+    }
+    return (float)sqr;
+}
 
-    nt = std::min(nb, std::max(nb / 10, MAX_NTRAIN));
-    if (nt == cur_ntrain) {
-        long& index_size = cur_nsize;
-        if (nb == index_size) {
-            LOG(INFO) << "Nothing to do since ntrain " << nt << " and index_size " << index_size << " are unchanged";
-            index_out = nullptr;
+static float fvec_inner_product_sq8(const float* x, const uint8_t* line, long dim)
+{
+    float vmin = ((const float*)line)[0];
+    float vscale = ((const float*)line)[1];
+    const uint8_t* code = line + 2 * sizeof(float);
+    double acc = 0;
+    long d = 0;
+#ifdef __AVX2__
+    __m256 macc = _mm256_setzero_ps();
+    __m256 mmin = _mm256_set1_ps(vmin);
+    __m256 mscale = _mm256_set1_ps(vscale);
+    for (; d + 8 <= dim; d += 8) {
+        __m256 my = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(code + d))));
+        my = _mm256_add_ps(mmin, _mm256_mul_ps(mscale, my));
+        macc = _mm256_add_ps(macc, _mm256_mul_ps(_mm256_loadu_ps(x + d), my));
+    }
+    float buf[8];
+    _mm256_storeu_ps(buf, macc);
+    for (int i = 0; i < 8; i++)
+        acc += buf[i];
+#endif
+    for (; d < dim; d++) {
+        acc += x[d] * (vmin + vscale * code[d]);
+    }
+    return (float)acc;
+}
+
+// Float16 conversions of the Flat16 memtable. The scalar fallbacks flush
+// denormals to zero, far below any component of a normalized vector.
+static inline uint16_t fp16_encode_one(float f)
+{
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    uint32_t sign = (x >> 16) & 0x8000;
+    int32_t exp = (int32_t)((x >> 23) & 0xff) - 127 + 15;
+    uint32_t mant = x & 0x7fffff;
+    if (exp <= 0)
+        return (uint16_t)sign;
+    if (exp >= 31)
+        return (uint16_t)(sign | 0x7c00);
+    return (uint16_t)(sign | (exp << 10) | (mant >> 13));
+}
+
+static inline float fp16_decode_one(uint16_t h)
+{
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+    uint32_t x;
+    if (exp == 0)
+        x = sign;
+    else if (exp == 31)
+        x = sign | 0x7f800000 | (mant << 13);
+    else
+        x = sign | ((exp - 15 + 127) << 23) | (mant << 13);
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+static void fp16_encode(const float* vec, long n, uint16_t* out)
+{
+    long i = 0;
+#ifdef __F16C__
+    for (; i + 8 <= n; i += 8)
+        _mm_storeu_si128((__m128i*)(out + i),
+            _mm256_cvtps_ph(_mm256_loadu_ps(vec + i), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC));
+#endif
+    for (; i < n; i++)
+        out[i] = fp16_encode_one(vec[i]);
+}
+
+// Exact distances against a float16 line, widening to float32 in registers so
+// the scan moves half the bytes of a float32 tail.
+static float fvec_L2sqr_fp16(const float* x, const uint16_t* y, long dim)
+{
+    double sqr = 0;
+    long d = 0;
+#ifdef __F16C__
+    __m256 msqr = _mm256_setzero_ps();
+    for (; d + 8 <= dim; d += 8) {
+        __m256 my = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(y + d)));
+        __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(x + d), my);
+        msqr = _mm256_add_ps(msqr, _mm256_mul_ps(diff, diff));
+    }
+    float buf[8];
+    _mm256_storeu_ps(buf, msqr);
+    for (int i = 0; i < 8; i++)
+        sqr += buf[i];
+#endif
+    for (; d < dim; d++) {
+        float diff = x[d] - fp16_decode_one(y[d]);
+        sqr += diff * diff;
+    }
+    return (float)sqr;
+}
+
+static float fvec_inner_product_fp16(const float* x, const uint16_t* y, long dim)
+{
+    double acc = 0;
+    long d = 0;
+#ifdef __F16C__
+    __m256 macc = _mm256_setzero_ps();
+    for (; d + 8 <= dim; d += 8) {
+        __m256 my = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(y + d)));
+        macc = _mm256_add_ps(macc, _mm256_mul_ps(_mm256_loadu_ps(x + d), my));
+    }
+    float buf[8];
+    _mm256_storeu_ps(buf, macc);
+    for (int i = 0; i < 8; i++)
+        acc += buf[i];
+#endif
+    for (; d < dim; d++) {
+        acc += x[d] * fp16_decode_one(y[d]);
+    }
+    return (float)acc;
+}
+
+// Flat memtable holding float16 codes (memtable=Flat16). Half the footprint
+// and scan bandwidth of IndexFlat, ~3 decimal digits of precision — noise for
+// normalized vectors, whose exact distance the refine stage recomputes from
+// base anyway.
+struct IndexFlat16 : faiss::Index {
+    std::vector<uint16_t> xb16; //ntotal * d codes
+    IndexFlat16(long d_in, faiss::MetricType metric)
+        : faiss::Index(d_in, metric)
+    {
+        is_trained = true;
+    }
+    void add(idx_t n, const float* x) override
+    {
+        xb16.resize((ntotal + n) * d);
+        fp16_encode(x, n * d, &xb16[ntotal * d]);
+        ntotal += n;
+    }
+    void reset() override
+    {
+        xb16.clear();
+        ntotal = 0;
+    }
+    //top-k of rows [s, e) per query; labels are absolute row numbers
+    void search_subset(idx_t s, idx_t e, idx_t n, const float* x, idx_t k, float* distances, idx_t* labels) const
+    {
+        for (idx_t i = 0; i < n; i++) {
+            const float* xi = x + i * d;
+            float* D = distances + i * k;
+            idx_t* I = labels + i * k;
+            if (metric_type == faiss::METRIC_INNER_PRODUCT) {
+                faiss::minheap_heapify(k, D, I);
+                for (idx_t j = s; j < e; j++) {
+                    float dis = fvec_inner_product_fp16(xi, &xb16[j * d], d);
+                    if (dis > D[0]) {
+                        faiss::minheap_pop(k, D, I);
+                        faiss::minheap_push(k, D, I, dis, j);
+                    }
+                }
+                faiss::minheap_reorder(k, D, I);
+            } else {
+                faiss::maxheap_heapify(k, D, I);
+                for (idx_t j = s; j < e; j++) {
+                    float dis = fvec_L2sqr_fp16(xi, &xb16[j * d], d);
+                    if (dis < D[0]) {
+                        faiss::maxheap_pop(k, D, I);
+                        faiss::maxheap_push(k, D, I, dis, j);
+                    }
+                }
+                faiss::maxheap_reorder(k, D, I);
+            }
+        }
+    }
+    void search(idx_t n, const float* x, idx_t k, float* distances, idx_t* labels) const override
+    {
+#pragma omp parallel for
+        for (idx_t i = 0; i < n; i++)
+            search_subset(0, ntotal, 1, x + i * d, k, distances + i * k, labels + i * k);
+    }
+};
+
+// Flat memtable holding SQ8 codes with per-vector min/scale (memtable=SQ8).
+// A quarter of IndexFlat's footprint — on memory-constrained nodes that is
+// 4x the databases resident before eviction — scanned by the same fused
+// dequantize-distance kernels the SQ8 base uses, so codes never expand to
+// floats outside the registers.
+struct IndexFlatSQ8 : faiss::Index {
+    long len_line; //8-byte min/scale header + d codes
+    std::vector<uint8_t> xb8; //ntotal * len_line
+    IndexFlatSQ8(long d_in, faiss::MetricType metric)
+        : faiss::Index(d_in, metric)
+        , len_line(2 * sizeof(float) + d_in)
+    {
+        is_trained = true;
+    }
+    void add(idx_t n, const float* x) override
+    {
+        xb8.resize((ntotal + n) * len_line);
+        for (idx_t i = 0; i < n; i++)
+            sq8_encode(x + i * d, d, &xb8[(ntotal + i) * len_line]);
+        ntotal += n;
+    }
+    void reset() override
+    {
+        xb8.clear();
+        ntotal = 0;
+    }
+    //top-k of rows [s, e) per query; labels are absolute row numbers
+    void search_subset(idx_t s, idx_t e, idx_t n, const float* x, idx_t k, float* distances, idx_t* labels) const
+    {
+        for (idx_t i = 0; i < n; i++) {
+            const float* xi = x + i * d;
+            float* D = distances + i * k;
+            idx_t* I = labels + i * k;
+            if (metric_type == faiss::METRIC_INNER_PRODUCT) {
+                faiss::minheap_heapify(k, D, I);
+                for (idx_t j = s; j < e; j++) {
+                    float dis = fvec_inner_product_sq8(xi, &xb8[j * len_line], d);
+                    if (dis > D[0]) {
+                        faiss::minheap_pop(k, D, I);
+                        faiss::minheap_push(k, D, I, dis, j);
+                    }
+                }
+                faiss::minheap_reorder(k, D, I);
+            } else {
+                faiss::maxheap_heapify(k, D, I);
+                for (idx_t j = s; j < e; j++) {
+                    float dis = fvec_L2sqr_sq8(xi, &xb8[j * len_line], d);
+                    if (dis < D[0]) {
+                        faiss::maxheap_pop(k, D, I);
+                        faiss::maxheap_push(k, D, I, dis, j);
+                    }
+                }
+                faiss::maxheap_reorder(k, D, I);
+            }
+        }
+    }
+    void search(idx_t n, const float* x, idx_t k, float* distances, idx_t* labels) const override
+    {
+#pragma omp parallel for
+        for (idx_t i = 0; i < n; i++)
+            search_subset(0, ntotal, 1, x + i * d, k, distances + i * k, labels + i * k);
+    }
+};
+
+// Hamming memtable over packed 1-bit codes, forced by binary=1. 1/32 of
+// IndexFlat's footprint, and the scan is pure popcount — at 256 bits one
+// cache line holds two candidates instead of 1/16th of one. Queries arrive
+// as 0/1 floats like everywhere else and are packed once per query; the
+// reported distances are Hamming, which on this data is the squared L2 the
+// rest of the pipeline expects. Binary mode is metric L2 only, so there is
+// no inner-product branch.
+struct IndexFlatBin : faiss::Index {
+    long len_line; //d / 8 packed bytes
+    std::vector<uint8_t> xbb; //ntotal * len_line
+    IndexFlatBin(long d_in, faiss::MetricType metric)
+        : faiss::Index(d_in, metric)
+        , len_line(d_in / 8)
+    {
+        is_trained = true;
+    }
+    void add(idx_t n, const float* x) override
+    {
+        xbb.resize((ntotal + n) * len_line);
+        for (idx_t i = 0; i < n; i++)
+            bin_encode(x + i * d, d, &xbb[(ntotal + i) * len_line]);
+        ntotal += n;
+    }
+    void reset() override
+    {
+        xbb.clear();
+        ntotal = 0;
+    }
+    //top-k of rows [s, e) per query; labels are absolute row numbers
+    void search_subset(idx_t s, idx_t e, idx_t n, const float* x, idx_t k, float* distances, idx_t* labels) const
+    {
+        std::vector<uint8_t> q(len_line);
+        for (idx_t i = 0; i < n; i++) {
+            bin_encode(x + i * d, d, &q[0]);
+            float* D = distances + i * k;
+            idx_t* I = labels + i * k;
+            faiss::maxheap_heapify(k, D, I);
+            for (idx_t j = s; j < e; j++) {
+                float dis = bin_hamming(&q[0], &xbb[j * len_line], len_line);
+                if (dis < D[0]) {
+                    faiss::maxheap_pop(k, D, I);
+                    faiss::maxheap_push(k, D, I, dis, j);
+                }
+            }
+            faiss::maxheap_reorder(k, D, I);
+        }
+    }
+    void search(idx_t n, const float* x, idx_t k, float* distances, idx_t* labels) const override
+    {
+#pragma omp parallel for
+        for (idx_t i = 0; i < n; i++)
+            search_subset(0, ntotal, 1, x + i * d, k, distances + i * k, labels + i * k);
+    }
+};
+
+// Flat memtable in a block-interleaved layout (memtable=FlatBlk): groups of
+// BLK rows with their dimensions interleaved, so one AVX register holds the
+// same dimension of 8 candidates and the scan runs vertical multiply-adds
+// with no horizontal reduction until the block is done — measured ~1.7x the
+// row-major scan at dim=128. Same floats as IndexFlat, just permuted, so
+// decode is a lossless gather and exactness is untouched.
+struct IndexFlatBlk : faiss::Index {
+    static const long BLK = 8;
+    std::vector<float> xbb; //ceil(ntotal / BLK) blocks of BLK * d floats; row r of block b at xbb[(b * d + dd) * BLK + r % BLK]
+    IndexFlatBlk(long d_in, faiss::MetricType metric)
+        : faiss::Index(d_in, metric)
+    {
+        is_trained = true;
+    }
+    void add(idx_t n, const float* x) override
+    {
+        long nblk = (ntotal + n + BLK - 1) / BLK;
+        xbb.resize(nblk * BLK * d); //new space zero-filled, tail lanes stay benign
+        for (idx_t i = 0; i < n; i++)
+            putRow(ntotal + i, x + i * d);
+        ntotal += n;
+    }
+    void reset() override
+    {
+        xbb.clear();
+        ntotal = 0;
+    }
+    void putRow(idx_t row, const float* x)
+    {
+        float* blk = &xbb[(row / BLK) * BLK * d];
+        long r = row % BLK;
+        for (long dd = 0; dd < d; dd++)
+            blk[dd * BLK + r] = x[dd];
+    }
+    void getRow(idx_t row, float* x) const
+    {
+        const float* blk = &xbb[(row / BLK) * BLK * d];
+        long r = row % BLK;
+        for (long dd = 0; dd < d; dd++)
+            x[dd] = blk[dd * BLK + r];
+    }
+    //the BLK distances of one block against one query, vertical accumulation
+    inline void blockDistances(const float* xi, const float* blk, float* out) const
+    {
+        long dd = 0;
+#ifdef __AVX2__
+        __m256 acc = _mm256_setzero_ps();
+        if (metric_type == faiss::METRIC_INNER_PRODUCT) {
+            for (; dd < d; dd++)
+                acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_set1_ps(xi[dd]), _mm256_loadu_ps(blk + dd * BLK)));
         } else {
-            LOG(INFO) << "Reuse current index since ntrain " << nt << " is unchanged. index_size will increase from " << index_size << " to " << nb;
-            index = faiss::read_index(getIndexFp(nt).c_str());
-            vector<float> base2;
-            readBase(data, nb, index_size, base2);
-            index->add(nb - index_size, &base2[0]);
-            index_out = index;
+            for (; dd < d; dd++) {
+                __m256 diff = _mm256_sub_ps(_mm256_set1_ps(xi[dd]), _mm256_loadu_ps(blk + dd * BLK));
+                acc = _mm256_add_ps(acc, _mm256_mul_ps(diff, diff));
+            }
         }
-    } else {
-        LOG(INFO) << "Training on " << nt << " vectors. cur_ntrain is " << cur_ntrain;
-        index = faiss::index_factory(dim, index_key.c_str(), metric_type == 0 ? faiss::METRIC_INNER_PRODUCT : faiss::METRIC_L2);
-        // according to faiss/benchs/bench_hnsw.py, ivf_hnsw_quantizer.
-        auto index_ivf = dynamic_cast<faiss::IndexIVFFlat*>(index);
-        if (index_ivf != nullptr) {
-            index_ivf->cp.min_points_per_centroid = 5; //quiet warning
-            index_ivf->quantizer_trains_alone = 2;
-        }
-        // Training
-        vector<float> base;
-        readBase(data, nb, 0, base);
-        assert((long)base.size() >= nt * dim);
-        index->train(nt, &base[0]);
+        _mm256_storeu_ps(out, acc);
+#else
+        for (long r = 0; r < BLK; r++)
+            out[r] = 0;
+        if (metric_type == faiss::METRIC_INNER_PRODUCT) {
+            for (; dd < d; dd++)
+                for (long r = 0; r < BLK; r++)
+                    out[r] += xi[dd] * blk[dd * BLK + r];
+        } else {
+            for (; dd < d; dd++)
+                for (long r = 0; r < BLK; r++) {
+                    float diff = xi[dd] - blk[dd * BLK + r];
+                    out[r] += diff * diff;
+                }
+        }
+#endif
+    }
+    //top-k of rows [s, e) per query; labels are absolute row numbers
+    void search_subset(idx_t s, idx_t e, idx_t n, const float* x, idx_t k, float* distances, idx_t* labels) const
+    {
+        for (idx_t i = 0; i < n; i++) {
+            const float* xi = x + i * d;
+            float* D = distances + i * k;
+            idx_t* I = labels + i * k;
+            float dis8[BLK];
+            if (metric_type == faiss::METRIC_INNER_PRODUCT) {
+                faiss::minheap_heapify(k, D, I);
+                for (idx_t b = s / BLK; b * BLK < e; b++) {
+                    blockDistances(xi, &xbb[b * BLK * d], dis8);
+                    idx_t r0 = std::max(s, b * BLK) - b * BLK;
+                    idx_t r1 = std::min(e, (b + 1) * BLK) - b * BLK;
+                    for (idx_t r = r0; r < r1; r++)
+                        if (dis8[r] > D[0]) {
+                            faiss::minheap_pop(k, D, I);
+                            faiss::minheap_push(k, D, I, dis8[r], b * BLK + r);
+                        }
+                }
+                faiss::minheap_reorder(k, D, I);
+            } else {
+                faiss::maxheap_heapify(k, D, I);
+                for (idx_t b = s / BLK; b * BLK < e; b++) {
+                    blockDistances(xi, &xbb[b * BLK * d], dis8);
+                    idx_t r0 = std::max(s, b * BLK) - b * BLK;
+                    idx_t r1 = std::min(e, (b + 1) * BLK) - b * BLK;
+                    for (idx_t r = r0; r < r1; r++)
+                        if (dis8[r] < D[0]) {
+                            faiss::maxheap_pop(k, D, I);
+                            faiss::maxheap_push(k, D, I, dis8[r], b * BLK + r);
+                        }
+                }
+                faiss::maxheap_reorder(k, D, I);
+            }
+        }
+    }
+    void search(idx_t n, const float* x, idx_t k, float* distances, idx_t* labels) const override
+    {
+#pragma omp parallel for
+        for (idx_t i = 0; i < n; i++)
+            search_subset(0, ntotal, 1, x + i * d, k, distances + i * k, labels + i * k);
+    }
+};
 
-        // selected_params is cached auto-tuning result.
-        faiss::ParameterSpace params;
-        params.initialize(index);
-        params.set_index_parameters(index, query_params.c_str());
+// heap footprint of a faiss index in bytes: exact for the flat and IVF
+// family we deploy, a vector-width upper bound for anything else
+static long indexMemBytes(const faiss::Index* index)
+{
+    if (index == nullptr)
+        return 0;
+    if (auto ipt = dynamic_cast<const faiss::IndexPreTransform*>(index))
+        return indexMemBytes(ipt->index); //the transform matrices are noise next to the codes
+    if (auto ivf = dynamic_cast<const faiss::IndexIVF*>(index)) {
+        long bytes = indexMemBytes(ivf->quantizer);
+        const faiss::InvertedLists* il = ivf->invlists;
+        for (size_t l = 0; l < il->nlist; l++)
+            bytes += (long)il->list_size(l) * ((long)il->code_size + (long)sizeof(long));
+        return bytes;
+    }
+    if (auto f16 = dynamic_cast<const IndexFlat16*>(index))
+        return (long)f16->xb16.size() * (long)sizeof(uint16_t);
+    if (auto f8 = dynamic_cast<const IndexFlatSQ8*>(index))
+        return (long)f8->xb8.size();
+    if (auto fbin = dynamic_cast<const IndexFlatBin*>(index))
+        return (long)fbin->xbb.size();
+    if (auto blk = dynamic_cast<const IndexFlatBlk*>(index))
+        return (long)blk->xbb.size() * (long)sizeof(float);
+    if (auto flat = dynamic_cast<const faiss::IndexFlat*>(index))
+        return (long)flat->xb.size() * (long)sizeof(float);
+    return index->ntotal * index->d * (long)sizeof(float);
+}
 
-        // Indexing database
-        LOG(INFO) << "Indexing " << nb << " vectors";
-        index->add(nb, &base[0]);
-        index_out = index;
+//append a whole buffer, looping on short writes and EINTR. A failed base
+//append would silently lose accepted vectors, so it is fatal, matching the
+//exception-enabled fstreams this replaced.
+static void writeFull(int fd, const void* buf, size_t len)
+{
+    const char* p = (const char*)buf;
+    while (len > 0) {
+        ssize_t nw = write(fd, p, len);
+        if (nw < 0) {
+            if (errno == EINTR)
+                continue;
+            LOG(FATAL) << "append failed with " << strerror(errno);
+        }
+        p += nw;
+        len -= (size_t)nw;
     }
-quit:
-    ntrain = nt;
-    munmapFile(fp_base, data, len_data);
-    LOG(INFO) << "BuildIndex " << work_dir << " done";
-    google::FlushLogFiles(google::INFO);
 }
 
-void VectoDB::ActivateIndex(faiss::Index* index, long ntrain)
+//positioned flavor of writeFull, for concurrent writers sharing one fd
+static void pwriteFull(int fd, const void* buf, size_t len, long off)
 {
-    const string& fp_base = getBaseFp();
-    mtxlock m{ state->m_base };
-    state->fs_base.flush();
-    {
-        wlock w{ state->rw_data };
-        mmapFile(fp_base, state->data, state->len_data);
+    const char* p = (const char*)buf;
+    while (len > 0) {
+        ssize_t nw = pwrite(fd, p, len, off);
+        if (nw < 0) {
+            if (errno == EINTR)
+                continue;
+            LOG(FATAL) << "pwrite failed with " << strerror(errno);
+        }
+        p += nw;
+        off += nw;
+        len -= (size_t)nw;
     }
-    long nb = getNumLines(state->len_data, len_base_line);
-    state->total = nb;
+}
 
-    long index_size = 0;
-    if (index != nullptr) {
-        clearIndexFiles();
-        // Output index
-        faiss::write_index(index, getIndexFp(ntrain).c_str());
-        index_size = index->ntotal;
+//bulk copy with non-temporal stores: build-time chunks are far larger than
+//the LLC, so cached destination lines would only evict the search working set
+static void memcpy_stream(void* dst, const void* src, size_t n)
+{
+    uint8_t* d = (uint8_t*)dst;
+    const uint8_t* s = (const uint8_t*)src;
+#ifdef __AVX2__
+    size_t head = std::min(n, (32 - ((uintptr_t)d & 31)) & 31);
+    memcpy(d, s, head);
+    d += head;
+    s += head;
+    n -= head;
+    while (n >= 32) {
+        _mm256_stream_si256((__m256i*)d, _mm256_loadu_si256((const __m256i*)s));
+        d += 32;
+        s += 32;
+        n -= 32;
+    }
+    _mm_sfence();
+#endif
+    memcpy(d, s, n);
+}
+
+VectoDB::VectoDB(const char* work_dir_in, long dim_in, int metric_type_in, const char* index_key_in, const char* query_params_in, float dist_threshold_in)
+    : work_dir(work_dir_in)
+    , dim(dim_in)
+    , len_vec(dim * sizeof(float))
+    , len_base_line(2 * sizeof(long) + dim * sizeof(float))
+    , len_upd_line(sizeof(long) + dim * sizeof(float))
+    , metric_type(metric_type_in)
+    , dist_threshold(dist_threshold_in)
+    , index_key(index_key_in)
+    , query_params(query_params_in)
+    , memtable_key("Flat")
+    , ondisk_ivf(false)
+    , sq8(false)
+    , binary(false)
+    , coalesce_us(0)
+{
+    std::call_once(blas_calib_once, calibrateBlas);
+    // Engine-level options ride along in query_params and are stripped before
+    // the string reaches faiss auto-tuning:
+    //   "ondisk=1"        keeps IVF inverted lists in a mapped file
+    //   "memtable=HNSW<M>" selects an HNSW memtable for the unindexed tail;
+    //                     "memtable=Flat16" stores the tail in float16, half
+    //                     the scan bandwidth at ~3 decimal digits of precision
+    //   "memtable=SQ8"    stores the tail as SQ8 codes with per-vector
+    //                     min/scale, a quarter of the Flat footprint, scanned
+    //                     by fused dequantize-distance kernels
+    //   "memtable=FlatBlk" stores the tail block-interleaved (8 rows with
+    //                     dimensions interleaved), scanned by vertical SIMD
+    //                     multiply-adds — same floats, ~1.7x the scan speed
+    //   "sq8=1"           stores base.vec SQ8-encoded, 4x smaller, ~1% recall loss
+    //   "binary=1"        1-bit base encoding for binary fingerprints: the
+    //                     callers keep handing 0.0/1.0 floats through the
+    //                     unchanged Add/Search/Update surface, the engine
+    //                     stores base.vec packed at a bit per dimension (32x
+    //                     smaller) and scans the tail by popcount. On 0/1
+    //                     components squared L2 equals Hamming distance, so
+    //                     the float distances, thresholds and the IVF tier
+    //                     built over the decoded base all keep their meaning.
+    //                     Needs metric_type 1 and dim a multiple of 8; forces
+    //                     the Hamming memtable
+    //   "coalesce_us=<n>" merges concurrent 1-NN searches arriving within n
+    //                     microseconds; identical query vectors collapse to
+    //                     one slot of the merged batch
+    //   "minibatch=<n>"   trains the coarse quantizer with n minibatch k-means
+    //                     iterations plus a few full-batch refinement passes
+    //   "gpu=<device>"    trains and adds on that GPU during BuildIndex,
+    //                     converted back to a CPU index for serving
+    //   "mmap=1"          persists the index in the aligned sectioned format
+    //                     and opens it with read_index_mmap: headers eager,
+    //                     inverted lists mapped in place
+    //   "hugepage=1"      advises MADV_HUGEPAGE on the base mapping (THP),
+    //                     cutting dTLB misses of the refine gather
+    //   "mlock_gb=<n>"    locks the first n GB of the base mapping in RAM
+    //   "numa=1"          replicates the activated index per NUMA node and
+    //                     routes each search to the replica local to its CPU
+    //   "cache=<n>"       caches the 1-NN answers of up to n distinct query
+    //                     vectors, invalidated as a whole on every write
+    //   "lsh=<bits>"      prefilters the flat-tail scan with packed LSH
+    //                     signatures: the Hamming scan keeps a short list and
+    //                     only the survivors get exact float distances
+    //   "pca=<d>"         prepends a PCA reduction to d dims to the built
+    //                     index; the base keeps the raw vectors and the exact
+    //                     refine over the mmap repairs the ranking
+    //   "build_threads=<n>" caps the OpenMP team of BuildIndex at n threads
+    //   "build_cores=<a>-<b>" pins the build (and its OpenMP workers) to
+    //                     that cpu range, keeping live search off those cores' rivals
+    //   "build_nice=<n>"  runs the build at that CPU nice; >=10 also drops
+    //                     its file I/O to the idle class
+    //   "build_mem_gb=<n>" staggers concurrent builds (vectodb_multi shards)
+    //                     under a process-wide memory budget of n GB
+    //   "build_direct=1"  streams the base through O_DIRECT reads during
+    //                     BuildIndex, leaving the page cache (and the refine
+    //                     gather's hot pages) to the serving path
+    //   "stream_add=<n>"  streams the durable tail into the live index's
+    //                     inverted lists once it holds n lines, keeping the
+    //                     brute-force flat scan to the last write burst
+    //   "readonly=1"      follower over a shared work_dir (NFS, EBS
+    //                     multi-attach): no write stream is opened, the
+    //                     manifest is watched for the writer node's
+    //                     activations and new indexes hot-swap in; every
+    //                     mutating call is rejected
+    //   "ids32=1"         after each activation the 64-bit ids faiss keeps
+    //                     per inverted list are copied into one compact
+    //                     32-bit table and freed — half the id memory at
+    //                     100M scale. Scans then emit (list, offset) pairs
+    //                     and the ids widen back at result emission. IVFFlat
+    //                     and IVFPQ only; incompatible with ondisk=1 and
+    //                     stream_add, and range searches skip the main index
+    //   "slowlog_us=<n>"  searches slower than n microseconds record their
+    //                     per-stage breakdown into a 64-entry ring, read
+    //                     back with GetSlowLog
+    //   "attach=1"        readonly attach for a process co-located with the
+    //                     writer on the same host. Implies readonly=1 and
+    //                     mmap=1: the base segments and the activated index
+    //                     payload are then the same page-cache pages in both
+    //                     processes — shared memory without a separate shm
+    //                     segment or any per-query IPC — and the follower
+    //                     polls at 100ms since a local stat is nearly free
+    ondisk_ivf = (stripParam(query_params, "ondisk") == "1");
+    mmap_index = (stripParam(query_params, "mmap") == "1");
+    sq8 = (stripParam(query_params, "sq8") == "1");
+    binary = (stripParam(query_params, "binary") == "1");
+    if (binary && metric_type != 1) {
+        LOG(WARNING) << "binary=1 needs metric_type 1 (squared L2 is Hamming on 0/1 vectors, inner product is not), ignoring binary";
+        binary = false;
+    }
+    if (binary && dim % 8 != 0) {
+        LOG(WARNING) << "binary=1 needs dim to be a multiple of 8, not " << dim << ", ignoring binary";
+        binary = false;
+    }
+    if (binary && sq8) {
+        LOG(WARNING) << "binary=1 already packs the base harder than sq8=1, ignoring sq8";
+        sq8 = false;
+    }
+    readonly = (stripParam(query_params, "readonly") == "1");
+    attach = (stripParam(query_params, "attach") == "1");
+    if (attach) {
+        readonly = true;
+        mmap_index = true; //ilar and ilaa payloads both map in place, so the writer's format does not matter
+    }
+    const string& mb = stripParam(query_params, "minibatch");
+    minibatch_niter = mb.empty() ? 0 : std::stol(mb);
+    const string& gd = stripParam(query_params, "gpu");
+    gpu_device = gd.empty() ? -1 : (int)std::stol(gd);
+    huge_pages = (stripParam(query_params, "hugepage") == "1");
+    const string& ml = stripParam(query_params, "mlock_gb");
+    mlock_bytes = ml.empty() ? 0 : std::stol(ml) << 30;
+#ifndef VECTODB_USE_GPU
+    if (gpu_device >= 0) {
+        LOG(WARNING) << "gpu=" << gpu_device << " requested but this build has no GPU support (scons gpu), building on CPU";
+        gpu_device = -1;
+    }
+#endif
+    if (sq8)
+        len_vec = 2 * sizeof(float) + dim; //per-line <vmin> <vscale> {<dim>}<uint8>
+    if (binary)
+        len_vec = dim / 8; //per-line {dim/8}<uint8>, bit d = vec[d] > 0.5
+    seg_lines = SEG_BYTES / len_vec;
+    const string& mt = stripParam(query_params, "memtable");
+    if (!mt.empty())
+        memtable_key = mt;
+    if (binary && !mt.empty())
+        LOG(WARNING) << "binary=1 scans the tail by popcount, overriding memtable=" << mt;
+    const string& co = stripParam(query_params, "coalesce_us");
+    if (!co.empty())
+        coalesce_us = std::stol(co);
+    numa_nodes = 1;
+    if (stripParam(query_params, "numa") == "1")
+        parseNumaTopology();
+    const string& lb = stripParam(query_params, "lsh");
+    lsh_bits = lb.empty() ? 0 : (int)((std::stol(lb) + 63) / 64 * 64); //whole words keep the Hamming scan branch-free
+    if (lsh_bits > 0) {
+        // fixed seed: signatures of the same vector agree across restarts,
+        // not that anything persists them today
+        std::mt19937 gen(20180620);
+        std::normal_distribution<float> dist(0.0f, 1.0f);
+        lsh_planes.resize((long)lsh_bits * dim);
+        for (float& v : lsh_planes)
+            v = dist(gen);
+    }
+    const string& bt = stripParam(query_params, "build_threads");
+    build_threads = bt.empty() ? 0 : std::stol(bt);
+    build_core_lo = build_core_hi = -1;
+    const string& bc = stripParam(query_params, "build_cores");
+    if (!bc.empty()) {
+        // a full cpulist would need commas, which query_params reserves as
+        // the option separator; a single range covers the deployments we have
+        size_t dash = bc.find('-');
+        build_core_lo = (int)std::stol(bc.substr(0, dash));
+        build_core_hi = dash == string::npos ? build_core_lo : (int)std::stol(bc.substr(dash + 1));
+    }
+    const string& bn = stripParam(query_params, "build_nice");
+    build_nice = bn.empty() ? 0 : std::stol(bn);
+    const string& bm = stripParam(query_params, "build_mem_gb");
+    build_mem_gb = bm.empty() ? 0 : std::stol(bm);
+    build_direct = (stripParam(query_params, "build_direct") == "1");
+    const string& sa = stripParam(query_params, "stream_add");
+    stream_add = sa.empty() ? 0 : std::stol(sa);
+    const string& pc = stripParam(query_params, "pca");
+    pca_dim = pc.empty() ? 0 : std::stol(pc);
+    if (pca_dim >= dim || pca_dim < 0) {
+        LOG(WARNING) << "pca=" << pca_dim << " does not reduce dim " << dim << ", ignoring";
+        pca_dim = 0;
+    }
+    const string& uc = stripParam(query_params, "upd_coalesce");
+    upd_coalesce = uc.empty() ? 0 : std::stol(uc);
+    const string& tl = stripParam(query_params, "ttl_sec");
+    ttl_sec = tl.empty() ? 0 : std::stol(tl);
+    upd_sq8 = (stripParam(query_params, "upd_sq8") == "1");
+    if (upd_sq8)
+        len_upd_line = sizeof(long) + 2 * sizeof(float) + dim;
+    const string& sl = stripParam(query_params, "slowlog_us");
+    slowlog_us = sl.empty() ? 0 : std::stol(sl);
+    ids32 = (stripParam(query_params, "ids32") == "1");
+    if (ids32 && ondisk_ivf) {
+        LOG(WARNING) << "ids32=1 is incompatible with ondisk=1 (those ids live in the mapped file, not on the heap), ignoring ids32";
+        ids32 = false;
     }
+    if (ids32 && stream_add > 0) {
+        LOG(WARNING) << "ids32=1 freezes the activated lists, disabling stream_add=" << stream_add;
+        stream_add = 0;
+    }
+    const string& cc = stripParam(query_params, "cache");
+    cache_cap = cc.empty() ? 0 : std::stol(cc);
+    if (cache_cap > 0) {
+        long cap = 64; //round up to a power of two so the slot is a mask
+        while (cap < cache_cap)
+            cap <<= 1;
+        cache_cap = cap;
+    }
+    // bind dim-specialized distance kernels once; the flat prefilter and the
+    // refine gather call through these pointers on every float line
+    switch (dim) {
+    case 128:
+        fvec_l2 = fvec_L2sqr_dim<128>;
+        fvec_ip = fvec_inner_product_dim<128>;
+        break;
+    case 256:
+        fvec_l2 = fvec_L2sqr_dim<256>;
+        fvec_ip = fvec_inner_product_dim<256>;
+        break;
+    case 512:
+        fvec_l2 = fvec_L2sqr_dim<512>;
+        fvec_ip = fvec_inner_product_dim<512>;
+        break;
+    default:
+        fvec_l2 = faiss::fvec_L2sqr;
+        fvec_ip = faiss::fvec_inner_product;
+    }
+    static_assert(sizeof(float) == 4, "sizeof(float) must be 4");
+    static_assert(sizeof(long) > 4, "sizeof(long) must be larger than 4");
+
+    fs::path dir{ fs::absolute(work_dir_in) };
+    work_dir = dir.string().c_str();
+
+    auto st{ std::make_unique<DbState>() }; //Make DbState be exception safe
+    state = std::move(st); // equivalent to state.reset(st.release());
+    if (cache_cap > 0)
+        state->rcache.resize(cache_cap);
+    fs::create_directories(dir);
+    //filename spec: base.xids, base.counts, base.vec.<k>, <index_key>.<ntrain>.index
+    //line spec of base.xids: <xid>
+    //line spec of base.counts: <count>
+    //line spec of base.vec.<k>: {<dim>}<float>, seg_lines lines per full segment
+    //line spec of update.fvecs: <count:22|line_num_at_base:40> {<dim>}<float>;
+    //count is the raw updates a merged record absorbed, 0 reads as 1.
+    //with upd_sq8=1 the float payload is <vmin:float> <vscale:float> {<dim>}<uint8>
+    //line spec of base.dels: <deleted>, one byte per base line, 1 = tombstoned
+    //line spec of base.times: <unix_sec:32>, the second the line was added (ttl_sec=<n> only); 0 exempts the line from expiry
+    if (readonly) {
+        //migrations and torn-tail recovery rewrite files; the writer node
+        //sharing this work_dir owns them
+        LOG(INFO) << "Opening " << work_dir << " read-only";
+    } else {
+        recoverCompact();
+        migrateBaseV1();
+        migrateVecSegments();
+        recoverTornTails();
+    }
+    //Loading database
+    //https://stackoverflow.com/questions/31483349/how-can-i-open-a-file-for-reading-writing-creating-it-if-it-does-not-exist-w
+    if (!readonly) {
+        state->fd_xids = openAppendFd(getXidsFp());
+        state->fd_counts = openAppendFd(getCountsFp());
+        if (metric_type == 1)
+            state->fd_norms = openAppendFd(getNormsFp());
+    }
+    while (fs::exists(getVecSegFp(state->vec_nsegs)))
+        state->vec_nsegs++;
+    if (state->vec_nsegs == 0)
+        state->vec_nsegs = 1; //fresh work_dir, openAppendFd creates the tail
+    const string& fp_tail = getVecSegFp(state->vec_nsegs - 1);
+    if (fs::exists(fp_tail))
+        state->vec_tail_lines = (long)fs::file_size(fp_tail) / len_vec;
+    if (!readonly) {
+        state->fd_vec = openAppendFd(fp_tail);
+        state->wal_thread = std::thread(&VectoDB::servWal, this);
+    }
+
+    // The manifest makes open O(1); legacy dirs without one fall back to a scan.
+    long ntrain = readManifest();
+    if (ntrain < 0)
+        ntrain = getIndexFpNtrain();
+    if (ntrain > 0 && !fs::exists(getIndexFp(ntrain)))
+        ntrain = 0;
+    faiss::Index* index = nullptr;
+    if (ntrain > 0) {
+        //Loading index
+        const string& fp_index = getIndexFp(ntrain);
+        LOG(INFO) << "Loading index " << fp_index;
+        ArenaBinder b{ arena_index };
+        index = mmap_index ? faiss::read_index_mmap(fp_index.c_str())
+                           : faiss::read_index(fp_index.c_str());
+    }
+    ActivateIndex(index, ntrain);
 
+    vector<long> xids;
+    readXids(state->total, 0, xids);
+    long nxids = (long)xids.size();
+    // Build the sharded map in parallel, one worker per shard. The scan of
+    // xids is repeated per worker but the insertions, which dominate, run
+    // concurrently on disjoint shards.
+#pragma omp parallel for
+    for (int s = 0; s < XID_NSHARD; s++) {
+        XidShard& shard = state->xid_shards[s];
+        shard.xid2num.reserve(2 * nxids / XID_NSHARD);
+        for (long i = 0; i < nxids; i++) {
+            if (xidShardOf(xids[i]) == s)
+                shard.xid2num[xids[i]] = i;
+        }
+    }
+    //seed the negative-lookup filter with every known xid
+#pragma omp parallel for
+    for (long i = 0; i < nxids; i++)
+        xidBloomAdd(&state->xid_bloom[0], xids[i]);
     {
-        wlock w{ state->rw_index };
+        bool ident = true;
+        for (long i = 0; i < nxids; i++)
+            if (xids[i] != i) {
+                ident = false;
+                break;
+            }
+        state->xids_identity.store(ident, std::memory_order_relaxed);
+    }
+    state->xids.assign(nxids > 0 ? &xids[0] : nullptr, nxids);
+    if (metric_type == 1)
+        loadBaseNorms();
+    loadDels();
+    if (ttl_sec > 0 && !readonly) {
+        loadTimes();
+        state->fd_times = openAppendFd(getTimesFp());
+    }
+
+    if (!readonly) {
+        const string& fp_update = getUpdateFp();
+        state->fs_update.exceptions(std::ios::failbit | std::ios::badbit);
+        state->fs_update.open(fp_update, std::fstream::out | std::fstream::app);
+        state->fs_update.close();
+        state->fs_update.open(fp_update, std::fstream::in | std::fstream::out | std::fstream::binary);
+        state->fs_update.seekp(0, ios_base::end);
+        state->stat_upd_bytes.store((long)state->fs_update.tellp(), std::memory_order_relaxed);
+
+        state->fs_counts2.exceptions(std::ios::failbit | std::ios::badbit);
+        state->fs_counts2.open(getCountsFp(), std::fstream::in | std::fstream::out | std::fstream::binary);
+        if (metric_type == 1) {
+            state->fs_norms2.exceptions(std::ios::failbit | std::ios::badbit);
+            state->fs_norms2.open(getNormsFp(), std::fstream::in | std::fstream::out | std::fstream::binary);
+        }
+        const string& fp_dels = getDelsFp();
+        state->fs_dels2.exceptions(std::ios::failbit | std::ios::badbit);
+        state->fs_dels2.open(fp_dels, std::fstream::out | std::fstream::app);
+        state->fs_dels2.close();
+        state->fs_dels2.open(fp_dels, std::fstream::in | std::fstream::out | std::fstream::binary);
+    } else {
+        state->follow_thread = std::thread(&VectoDB::servFollow, this);
+    }
+
+    evtFlushAsync();
+}
+
+VectoDB::~VectoDB()
+{
+    // There's no lock protection since I assume the object is idle.
+    // Up layer could protect it with rwlock.
+    if (state.get() != nullptr) {
+        {
+            mtxlock lk{ state->m_wal };
+            state->wal_stop = true;
+        }
+        state->cv_wal.notify_one();
+        if (state->wal_thread.joinable())
+            state->wal_thread.join();
+        {
+            mtxlock lk{ state->m_follow };
+            state->follow_stop = true;
+        }
+        state->cv_follow.notify_one();
+        if (state->follow_thread.joinable())
+            state->follow_thread.join();
+        if (state->persist_thread.joinable())
+            state->persist_thread.join();
+        if (!readonly) {
+            //pending coalesced updates go to the backlog file, not down with the process
+            mtxlock u{ state->m_update };
+            updSpillLocked();
+            state->fs_update.flush();
+        }
+        unmapVecSegments(state->seg_maps);
         delete state->index;
-        state->ntrain = ntrain;
-        state->index = index;
+        for (faiss::Index* replica : state->index_replicas)
+            delete replica;
+        for (faiss::Index* delta : state->delta_indexes)
+            delete delta;
+        delete state->flat;
+    }
+}
+
+//returns the index inside an OPQ/PCA pretransform chain, or the index itself.
+//The IVF-specific paths (nprobe override, ondisk lists, scan thresholds)
+//want the wrapped IVF, not the wrapper.
+static faiss::Index* innerIndex(faiss::Index* index)
+{
+    faiss::IndexPreTransform* ipt = dynamic_cast<faiss::IndexPreTransform*>(index);
+    return ipt == nullptr ? index : ipt->index;
+}
+
+//ids32=1: drop the 64-bit per-list ids once the compact table has replaced
+//them and nothing (persist included) can read them again. Store-pairs scans
+//never touch the id arrays, so this is safe under concurrent searches.
+static void freeListIds(faiss::Index* index)
+{
+    faiss::IndexIVF* ivf = dynamic_cast<faiss::IndexIVF*>(innerIndex(index));
+    faiss::ArrayInvertedLists* ail = ivf == nullptr ? nullptr : dynamic_cast<faiss::ArrayInvertedLists*>(ivf->invlists);
+    if (ail == nullptr)
+        return;
+    for (auto& lids : ail->ids)
+        vector<faiss::Index::idx_t>().swap(lids);
+}
+
+std::string VectoDB::chooseIndexKey(long nb) const
+{
+    // Heuristics follow the faiss guidelines: nlist ~ 4*sqrt(nb) rounded
+    // to a power of two. Small databases keep exact residuals (IVF,Flat);
+    // past 1M vectors memory forces PQ codes, with an OPQ pretransform
+    // when the dimension leaves it room to rotate.
+    long nlist = 64;
+    while (nlist < 65536 && nlist * nlist < 16 * nb)
+        nlist *= 2;
+    ostringstream oss;
+    // pca=<d>: the index lives in the reduced space, so PQ sizing follows it
+    const long d_idx = pca_dim > 0 ? pca_dim : dim;
+    long M = 0;
+    for (long m : { 32L, 16L, 64L, 8L }) {
+        if (d_idx % m == 0) {
+            M = m;
+            break;
+        }
+    }
+    if (nb <= 1000000L || M == 0) {
+        oss << "IVF" << nlist << ",Flat";
+    } else {
+        if (d_idx >= 2 * M)
+            oss << "OPQ" << M << ",";
+        oss << "IVF" << nlist << ",PQ" << M;
+    }
+    return oss.str();
+}
+
+std::string VectoDB::autoTuneParams(faiss::Index* index, const vector<SegMap>& segs, long nb) const
+{
+    // Held-out sample: the last AUTO_TUNE_NQ base vectors, added last and
+    // least represented in training. Ground truth is one brute-force pass
+    // per mapped segment merged at k=1, then a bounded ParameterSpace sweep
+    // picks the cheapest operating point reaching the target recall.
+    const long nq = std::min(AUTO_TUNE_NQ, nb);
+    vector<float> xq_vec; //the sample may straddle a segment boundary
+    readBase(segs, nb, nb - nq, xq_vec);
+    const float* xq = &xq_vec[0];
+    vector<float> gt_dis(nq);
+    vector<long> gt_ids(nq, -1);
+    vector<float> seg_dis(nq);
+    vector<long> seg_ids(nq);
+    for (long k = 0; k * seg_lines < nb; k++) {
+        long ny = std::min(seg_lines, nb - k * seg_lines);
+        const float* y = (const float*)segs[k].data;
+        if (metric_type == 0) {
+            faiss::float_minheap_array_t res;
+            res.nh = nq;
+            res.k = 1;
+            res.ids = seg_ids.data();
+            res.val = seg_dis.data();
+            faiss::knn_inner_product(xq, y, dim, nq, ny, &res);
+        } else {
+            faiss::float_maxheap_array_t res;
+            res.nh = nq;
+            res.k = 1;
+            res.ids = seg_ids.data();
+            res.val = seg_dis.data();
+            faiss::knn_L2sqr(xq, y, dim, nq, ny, &res);
+        }
+        for (long i = 0; i < nq; i++) {
+            if (gt_ids[i] < 0 || CompareDistance(metric_type, seg_dis[i], gt_dis[i])) {
+                gt_dis[i] = seg_dis[i];
+                gt_ids[i] = seg_ids[i] + k * seg_lines;
+            }
+        }
+    }
+    faiss::OneRecallAtRCriterion crit(nq, 1);
+    crit.set_groundtruth(1, nullptr, gt_ids.data());
+
+    faiss::ParameterSpace ps;
+    ps.initialize(index);
+    ps.n_experiments = AUTO_TUNE_NEXP;
+    faiss::OperatingPoints ops;
+    ps.explore(index, nq, xq, crit, &ops);
+    // the Pareto frontier is sorted by increasing perf (and thus time);
+    // the first point at the target recall is the cheapest one
+    for (const faiss::OperatingPoint& op : ops.optimal_pts) {
+        if (op.perf >= AUTO_TUNE_RECALL)
+            return op.key;
     }
+    if (!ops.optimal_pts.empty())
+        return ops.optimal_pts.back().key;
+    return string();
+}
+
+// process-wide build memory budget (build_mem_gb). Concurrent shard builds
+// (vectodb_multi) queue here instead of stacking their training and add
+// buffers on the same box.
+static mutex build_mtx;
+static condition_variable build_cv;
+static long build_mem_inflight = 0;
+
+static void buildMemAcquire(long bytes, long budget)
+{
+    mtxlock lk{ build_mtx };
+    // an oversized build is admitted alone rather than waiting forever
+    build_cv.wait(lk, [&] { return build_mem_inflight == 0 || build_mem_inflight + bytes <= budget; });
+    build_mem_inflight += bytes;
+}
+
+static void buildMemRelease(long bytes)
+{
+    {
+        mtxlock lk{ build_mtx };
+        build_mem_inflight -= bytes;
+    }
+    build_cv.notify_all();
+}
+
+void VectoDB::BuildIndex(long cur_ntrain, long cur_nsize, faiss::Index*& index_out, long& ntrain) const
+{
+    if (!TryBuildIndex(cur_ntrain, cur_nsize, index_out, ntrain))
+        LOG(WARNING) << "BuildIndex " << work_dir << " skipped, another build is in flight";
+}
+
+bool VectoDB::TryBuildIndex(long cur_ntrain, long cur_nsize, faiss::Index*& index_out, long& ntrain) const
+{
+    index_out = nullptr;
+    ntrain = 0;
+    if (readonly) {
+        LOG(ERROR) << work_dir << " is opened readonly, rejecting TryBuildIndex; builds belong to the writer node";
+        return false;
+    }
+    if (0 == index_key.compare("Flat"))
+        return true; //nothing to build, the call "ran"
+    // stat_building doubles as the build lock: whoever flips it owns the
+    // build until quit clears it, so overlapping builds cannot race
+    bool expected = false;
+    if (!state->stat_building.compare_exchange_strong(expected, true, std::memory_order_relaxed))
+        return false;
+    state->build_cancel.store(false, std::memory_order_relaxed);
+    // The build runs on a dedicated thread: affinity, priority and the
+    // OpenMP team size are per-thread settings, and the calling thread
+    // belongs to the Go runtime — it must come back unchanged.
+    std::thread t([&, this] {
+        if (build_core_lo >= 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            for (int c = build_core_lo; c <= build_core_hi; c++)
+                CPU_SET(c, &set);
+            // OpenMP workers fork from this thread and inherit the mask
+            sched_setaffinity(0, sizeof(set), &set);
+        }
+        std::unique_ptr<OmpGovernor> gov;
+        if (build_threads > 0)
+            omp_set_num_threads((int)build_threads);
+        else
+            // no explicit cap: the build takes the cores free at admission
+            // and holds them, so concurrent searchers shrink to match
+            gov = std::make_unique<OmpGovernor>(effectiveNumProcs());
+        if (build_nice > 0) {
+            setpriority(PRIO_PROCESS, 0, (int)build_nice); //thread-scoped on Linux
+#ifdef SYS_ioprio_set
+            if (build_nice >= 10)
+                syscall(SYS_ioprio_set, 1 /*IOPRIO_WHO_PROCESS*/, 0, 3 << 13 /*IOPRIO_CLASS_IDLE*/);
+#endif
+        }
+        buildIndexInner(cur_ntrain, cur_nsize, index_out, ntrain);
+    });
+    t.join();
+    return true;
+}
+
+void VectoDB::buildIndexInner(long cur_ntrain, long cur_nsize, faiss::Index*& index_out, long& ntrain) const
+{
+    ArenaBinder bind{ arena_build }; //build transients stay out of the search arenas
+    TraceScope trace{ "build", "cur_ntrain", cur_ntrain, "cur_nsize", cur_nsize };
+    vector<SegMap> segs; //private build mapping, scanned front to back
+    long nb = mapVecSegments(segs, true); // this may occur in the middle of writing to the tail segment.
+    faiss::Index* index = nullptr;
+    long nt = 0;
+    long mem_est = 0; //bytes held from the process-wide build budget
+    // "auto" resolves to a concrete factory string scaled to the data;
+    // file naming stays on the literal index_key
+    string build_key = index_key;
+
+    // Prepareing index
+    if (nb < MIN_NTRAIN) {
+        LOG(INFO) << "BuildIndex " << work_dir << ". nb=" << nb << " is below MIN_NTRAIN, serving flat";
+        goto quit;
+    }
+    if (0 == index_key.compare("auto"))
+        build_key = chooseIndexKey(nb);
+    if (pca_dim > 0)
+        build_key = "PCA" + std::to_string(pca_dim) + "," + build_key;
+    LOG(INFO) << "BuildIndex " << work_dir << ". dim=" << dim << ", index_key=\"" << build_key << "\", metric=" << metric_type << ", nb=" << nb;
+
+    nt = std::min(nb, std::max(nb / 10, MAX_NTRAIN));
+    if (build_mem_gb > 0) {
+        // coarse upper bound: contiguous training copy + add staging + the
+        // index itself at base-line width
+        mem_est = (nt + ADD_CHUNK) * dim * (long)sizeof(float) + nb * len_vec;
+        buildMemAcquire(mem_est, build_mem_gb << 30);
+        state->stat_build_mem.store(mem_est, std::memory_order_relaxed);
+        LOG(INFO) << "BuildIndex " << work_dir << " admitted under the " << build_mem_gb << " GB build budget";
+    }
+    if (nt == cur_ntrain) {
+        long& index_size = cur_nsize;
+        if (nb == index_size) {
+            LOG(INFO) << "Nothing to do since ntrain " << nt << " and index_size " << index_size << " are unchanged";
+            index_out = nullptr;
+        } else {
+            LOG(INFO) << "Reuse current index since ntrain " << nt << " is unchanged. index_size will increase from " << index_size << " to " << nb;
+            {
+                ArenaBinder b{ arena_index };
+                index = faiss::read_index(getIndexFp(nt).c_str());
+            }
+            addChunked(index, segs, nb, index_size);
+            if (state->build_cancel.load(std::memory_order_relaxed)) {
+                delete index;
+                index = nullptr;
+            }
+            index_out = index;
+        }
+    } else {
+        // Reuse persisted training artifacts (coarse centroids, codebooks)
+        // unless the training set has at least doubled since they were made.
+        long trained_nt = readTrainedNtrain();
+        if (trained_nt > 0 && nt <= 2 * trained_nt) {
+            LOG(INFO) << "Reusing trained artifacts of ntrain " << trained_nt << ", target ntrain is " << nt;
+            index = faiss::read_index(getTrainedFp().c_str());
+            nt = trained_nt;
+        } else {
+            LOG(INFO) << "Training on " << nt << " vectors. cur_ntrain is " << cur_ntrain;
+            index = faiss::index_factory(dim, build_key.c_str(), metric_type == 0 ? faiss::METRIC_INNER_PRODUCT : faiss::METRIC_L2);
+            // according to faiss/benchs/bench_hnsw.py, ivf_hnsw_quantizer.
+            auto index_ivf = dynamic_cast<faiss::IndexIVFFlat*>(innerIndex(index));
+            if (index_ivf != nullptr) {
+                index_ivf->cp.min_points_per_centroid = 5; //quiet warning
+                index_ivf->quantizer_trains_alone = 2;
+            }
+            if (minibatch_niter > 0) {
+                auto ivf = dynamic_cast<faiss::IndexIVF*>(innerIndex(index));
+                if (ivf != nullptr) {
+                    // 2-stage k-means: most iterations on samples, a few
+                    // full-batch passes to refine
+                    ivf->cp.minibatch_niter = (int)minibatch_niter;
+                    ivf->cp.niter = 5;
+                }
+            }
+            // Training. The training prefix may straddle a segment boundary
+            // (and needs a decode pass in SQ8 mode), so copy it into one
+            // contiguous buffer; at MAX_NTRAIN lines that is a small fraction
+            // of the training time.
+            state->stat_build_phase.store(BUILD_TRAIN, std::memory_order_relaxed);
+            DTRACE_PROBE1(vectodb, build__phase, BUILD_TRAIN);
+            state->stat_build_processed.store(0, std::memory_order_relaxed);
+            vector<float> train_vec;
+            if (!build_direct || !readBaseDirect(nt, 0, train_vec))
+                readBase(segs, nt, 0, train_vec);
+            if (state->stat_dels.load(std::memory_order_relaxed) > 0) {
+                // tombstoned lines must not shape the centroids and codebooks;
+                // compact the training buffer down to the live rows (their
+                // labels still match their lines — only training skips them)
+                rlock rn{ state->rw_xids };
+                const vector<char>& dels = state->dels;
+                long w = 0;
+                for (long i = 0; i < nt; i++) {
+                    if (i < (long)dels.size() && dels[i])
+                        continue;
+                    if (w != i)
+                        memcpy(&train_vec[w * dim], &train_vec[i * dim], dim * sizeof(float));
+                    w++;
+                }
+                if (w < nt && w >= MIN_NTRAIN) {
+                    LOG(INFO) << "Excluding " << nt - w << " tombstoned lines from the training set";
+                    nt = w;
+                }
+            }
+#ifdef VECTODB_USE_GPU
+            if (gpu_device >= 0) {
+                // Train on GPU: clone the empty index there, train, and pull
+                // the centroids and codebooks back for the artifact cache.
+                LOG(INFO) << "Training on GPU device " << gpu_device;
+                faiss::gpu::StandardGpuResources res;
+                faiss::Index* gindex = faiss::gpu::index_cpu_to_gpu(&res, gpu_device, index);
+                gindex->train(nt, &train_vec[0]);
+                delete index;
+                index = faiss::gpu::index_gpu_to_cpu(gindex);
+                delete gindex;
+            } else
+#endif
+            index->train(nt, &train_vec[0]);
+            writeTrained(index, nt);
+            state->stat_build_processed.store(nt, std::memory_order_relaxed);
+        }
+        // training is the longest uninterruptible stretch; a cancellation
+        // raised during it takes effect here, before the add pass
+        if (state->build_cancel.load(std::memory_order_relaxed)) {
+            LOG(INFO) << "BuildIndex " << work_dir << " cancelled after training";
+            delete index;
+            index = nullptr;
+            goto quit;
+        }
+
+        // selected_params is cached auto-tuning result.
+        faiss::ParameterSpace params;
+        params.initialize(index);
+        // in auto mode the sweep below picks the params; the configured
+        // query_params may not even parse for the chosen factory string
+        if (0 != index_key.compare("auto"))
+            params.set_index_parameters(index, query_params.c_str());
+
+        // Indexing database
+        LOG(INFO) << "Indexing " << nb << " vectors";
+#ifdef VECTODB_USE_GPU
+        if (gpu_device >= 0) {
+            // Add in streamed ADD_CHUNK batches on GPU, then convert to a
+            // CPU index for ActivateIndex serving.
+            faiss::gpu::StandardGpuResources res;
+            faiss::Index* gindex = faiss::gpu::index_cpu_to_gpu(&res, gpu_device, index);
+            addChunked(gindex, segs, nb, 0);
+            delete index;
+            index = faiss::gpu::index_gpu_to_cpu(gindex);
+            delete gindex;
+            // runtime params (nprobe, ht) don't round-trip through the clone
+            if (0 != index_key.compare("auto"))
+                params.set_index_parameters(index, query_params.c_str());
+        } else
+#endif
+        addChunked(index, segs, nb, 0);
+        if (state->build_cancel.load(std::memory_order_relaxed)) {
+            LOG(INFO) << "BuildIndex " << work_dir << " cancelled during add";
+            delete index;
+            index = nullptr;
+            goto quit;
+        }
+        if (0 == index_key.compare("auto")) {
+            state->stat_build_phase.store(BUILD_TUNE, std::memory_order_relaxed);
+            DTRACE_PROBE1(vectodb, build__phase, BUILD_TUNE);
+            if (sq8 || binary) {
+                LOG(WARNING) << (sq8 ? "sq8=1" : "binary=1") << " base is not plain float, skipping the auto-tune sweep";
+            } else {
+                const string& tuned = autoTuneParams(index, segs, nb);
+                if (!tuned.empty()) {
+                    LOG(INFO) << "Auto-tuned query_params \"" << tuned << "\" for index_key \"" << build_key << "\"";
+                    params.set_index_parameters(index, tuned.c_str());
+                }
+            }
+        }
+        if (ondisk_ivf) {
+            // Move the inverted lists to a mapped file so activation holds
+            // only the quantizer and metadata in resident memory.
+            faiss::IndexIVF* index_ivf2 = dynamic_cast<faiss::IndexIVF*>(innerIndex(index));
+            if (index_ivf2 != nullptr) {
+                const string fp_ivfdata = getIndexFp(nt) + ".ivfdata";
+                auto ondisk = new faiss::OnDiskInvertedLists(index_ivf2->nlist, index_ivf2->code_size, fp_ivfdata.c_str());
+                const faiss::InvertedLists* src = index_ivf2->invlists;
+                ondisk->merge_from(&src, 1);
+                index_ivf2->replace_invlists(ondisk, true);
+            }
+        }
+        index_out = index;
+    }
+quit:
+    ntrain = nt;
+    if (mem_est > 0) {
+        buildMemRelease(mem_est);
+        state->stat_build_mem.store(0, std::memory_order_relaxed);
+    }
+    unmapVecSegments(segs);
+    state->stat_build_phase.store(BUILD_IDLE, std::memory_order_relaxed);
+    DTRACE_PROBE1(vectodb, build__phase, BUILD_IDLE);
+    state->stat_build_processed.store(0, std::memory_order_relaxed);
+    state->stat_building.store(false, std::memory_order_relaxed);
+    LOG(INFO) << "BuildIndex " << work_dir << " done";
+    evtFlushAsync();
+}
+
+void VectoDB::servWal()
+{
+    for (;;) {
+        deque<PendingAdd> batch;
+        long seq;
+        {
+            mtxlock lk{ state->m_wal };
+            state->cv_wal.wait(lk, [this] { return state->wal_stop || !state->wal_queue.empty(); });
+            if (state->wal_queue.empty() && state->wal_stop)
+                return;
+            batch.swap(state->wal_queue);
+            seq = state->wal_seq_enq;
+        }
+        // coalesce the pending batches into one large append per column file
+        vector<long> xids;
+        vector<long> counts;
+        vector<float> vec;
+        vector<float> norms;
+        vector<uint32_t> tss;
+        for (auto& p : batch) {
+            xids.insert(xids.end(), p.xids.begin(), p.xids.end());
+            counts.insert(counts.end(), p.counts.begin(), p.counts.end());
+            vec.insert(vec.end(), p.vec.begin(), p.vec.end());
+            norms.insert(norms.end(), p.norms.begin(), p.norms.end());
+            if (ttl_sec > 0)
+                tss.insert(tss.end(), p.xids.size(), p.tstamp);
+        }
+        DTRACE_PROBE3(vectodb, wal__flush, (long)xids.size(), (long)batch.size(), seq);
+        TraceScope trace{ "wal_flush", "lines", (long)xids.size(), "batches", (long)batch.size() };
+        vector<uint8_t> enc;
+        if (sq8 || binary) {
+            // encode off the hot path, in the writer thread
+            long nl = (long)vec.size() / dim;
+            enc.resize(nl * len_vec);
+            for (long i = 0; i < nl; i++) {
+                if (sq8)
+                    sq8_encode(&vec[i * dim], dim, &enc[i * len_vec]);
+                else
+                    bin_encode(&vec[i * dim], dim, &enc[i * len_vec]);
+            }
+        }
+        {
+            // one O_APPEND syscall per column; the page cache absorbs the
+            // data directly, so there is no user-space buffer left to flush
+            mtxlock m{ state->m_base };
+            writeFull(state->fd_xids, &xids[0], xids.size() * sizeof(long));
+            writeFull(state->fd_counts, &counts[0], counts.size() * sizeof(long));
+            if (ttl_sec > 0)
+                writeFull(state->fd_times, &tss[0], tss.size() * sizeof(uint32_t));
+            if (metric_type == 1)
+                writeFull(state->fd_norms, &norms[0], norms.size() * sizeof(float));
+            // the vec column rolls over to a fresh segment file once the tail
+            // reaches seg_lines, so full segments stay append-free forever
+            const uint8_t* p = enc.empty() ? (const uint8_t*)&vec[0] : &enc[0];
+            long nl = (long)(enc.empty() ? vec.size() * sizeof(float) : (long)enc.size()) / len_vec;
+            for (long done = 0; done < nl;) {
+                if (state->vec_tail_lines == seg_lines) {
+                    close(state->fd_vec);
+                    state->fd_vec = openAppendFd(getVecSegFp(state->vec_nsegs));
+                    state->vec_nsegs++;
+                    state->vec_tail_lines = 0;
+                }
+                long n = std::min(nl - done, seg_lines - state->vec_tail_lines);
+                writeFull(state->fd_vec, p + done * len_vec, n * len_vec);
+                state->vec_tail_lines += n;
+                done += n;
+            }
+        }
+        {
+            mtxlock lk{ state->m_wal };
+            state->wal_seq_durable = seq;
+        }
+        state->wal_pending_lines.fetch_sub((long)xids.size(), memory_order_relaxed);
+        state->cv_durable.notify_all();
+        if (stream_add > 0)
+            streamAbsorb();
+    }
+}
+
+// stream_add=<n>: appends the durable tail straight into the live index's
+// inverted lists once the flat holds n lines. The coarse quantizer is fixed
+// after training, so each vector lands in the same list a rebuild would put
+// it in, and add() continues labelling at ntotal, which is exactly the base
+// line number whenever the flat starts at the index boundary. Runs on the wal
+// thread right after the lines it absorbs became durable; an absorb is one
+// assign+append pass over at most a write burst, so durability waiters behind
+// it stall for milliseconds, not a rebuild.
+void VectoDB::streamAbsorb()
+{
+    if (state->stat_flat.load(std::memory_order_relaxed) < stream_add)
+        return;
+    mtxlock m{ state->m_base };
+    long nb = remapBase();
+    {
+        wlock w{ state->rw_index };
+        // only when the index directly abuts the flat: with delta indexes in
+        // between (or no index yet) the labels would not line up
+        if (state->index == nullptr || !state->delta_indexes.empty())
+            return;
+        long cut = state->index->ntotal;
+        {
+            rlock rf{ state->rw_flat };
+            if (state->flat_start_num != cut)
+                return;
+        }
+        if (nb <= cut)
+            return;
+        //lines are contiguous only within a segment; coded lines need a decode pass
+        vector<float> buf;
+        for (long s = cut; s < nb;) {
+            long e = std::min(nb, (s / seg_lines + 1) * seg_lines);
+            const float* v;
+            if (sq8 || binary) {
+                readBase(state->seg_maps, e, s, buf);
+                v = &buf[0];
+            } else {
+                v = (const float*)segLine(state->seg_maps, s);
+            }
+            state->index->add(e - s, v);
+            for (faiss::Index* replica : state->index_replicas)
+                if (replica != nullptr)
+                    replica->add(e - s, v);
+            s = e;
+        }
+        state->stat_nsize.store(state->index->ntotal, std::memory_order_relaxed);
+    }
+    //the absorbed lines leave the flat; whatever arrived since stays
+    rebuildFlatTail(nb, nb);
+}
+
+void VectoDB::drainWal()
+{
+    mtxlock lk{ state->m_wal };
+    state->cv_durable.wait(lk, [this] { return state->wal_seq_durable >= state->wal_seq_enq; });
+}
+
+// readonly=1: follows the writer node sharing the work_dir. Polls the
+// manifest for new activations and hot-swaps the index in; between
+// activations, tails the base columns so freshly appended lines show up in
+// the flat memtable and the mirrors without any write stream being open.
+// attach=1 is the same loop at a 100ms poll: on a local work_dir the stat
+// calls are nearly free and the sidecar tracks the writer sub-second.
+void VectoDB::servFollow()
+{
+    long active_ntrain = state->stat_ntrain.load(std::memory_order_relaxed);
+    std::time_t active_mtime = 0;
+    if (active_ntrain > 0 && fs::exists(getIndexFp(active_ntrain)))
+        active_mtime = fs::last_write_time(getIndexFp(active_ntrain));
+    for (;;) {
+        {
+            std::unique_lock<mutex> lk{ state->m_follow };
+            state->cv_follow.wait_for(lk, attach ? std::chrono::milliseconds(100) : std::chrono::milliseconds(1000), [this] { return state->follow_stop; });
+            if (state->follow_stop)
+                return;
+        }
+        try {
+            long ntrain = readManifest();
+            if (ntrain < 0)
+                ntrain = getIndexFpNtrain();
+            bool swap = false;
+            std::time_t mtime = 0;
+            if (ntrain > 0 && fs::exists(getIndexFp(ntrain))) {
+                mtime = fs::last_write_time(getIndexFp(ntrain));
+                // a rebuild at the same ntrain lands at the same name, so the
+                // mtime breaks the tie
+                swap = ntrain != active_ntrain || mtime != active_mtime;
+            }
+            if (swap) {
+                const string& fp_index = getIndexFp(ntrain);
+                LOG(INFO) << "Follower " << work_dir << " activating " << fp_index;
+                faiss::Index* index = mmap_index ? faiss::read_index_mmap(fp_index.c_str())
+                                                 : faiss::read_index(fp_index.c_str());
+                ActivateIndex(index, ntrain); //readonly skips the persist, the file is already on disk
+                active_ntrain = ntrain;
+                active_mtime = mtime;
+            }
+            refreshFollowTail();
+        } catch (std::exception& e) {
+            // the writer renames and truncates files while we read them; the
+            // next poll retries from a fresh directory view
+            LOG(WARNING) << "Follower " << work_dir << " poll failed: " << e.what();
+        }
+    }
+}
+
+// tails the columns of the shared work_dir: remaps newly appended base lines
+// into the flat memtable and extends the xid and norm mirrors. The writer
+// appends the columns independently, so only lines every column has are
+// taken; the rest shows up next poll.
+void VectoDB::refreshFollowTail()
+{
+    //the store's acquire count is safe to read without the lock
+    long old_total = state->xids.size();
+    long nb = 0;
+    {
+        mtxlock m{ state->m_base };
+        nb = remapBase();
+        if (fs::exists(getXidsFp()))
+            nb = std::min(nb, (long)(fs::file_size(getXidsFp()) / sizeof(long)));
+        else
+            nb = 0;
+        if (metric_type == 1 && fs::exists(getNormsFp()))
+            nb = std::min(nb, (long)(fs::file_size(getNormsFp()) / sizeof(float)));
+        if (nb > old_total)
+            rebuildFlatTail(state->stat_nsize.load(std::memory_order_relaxed), nb);
+    }
+    if (nb <= old_total)
+        return;
+    vector<long> xids;
+    readXids(nb, old_total, xids);
+    vector<float> norms;
+    if (metric_type == 1) {
+        norms.resize(nb - old_total);
+        ifstream fs_norms(getNormsFp(), std::ifstream::binary);
+        fs_norms.seekg(old_total * sizeof(float), ios_base::beg);
+        fs_norms.read((char*)&norms[0], (nb - old_total) * sizeof(float));
+    }
+    for (long i = 0; i < (long)xids.size(); i++) {
+        XidShard& shard = state->xid_shards[xidShardOf(xids[i])];
+        wlock w{ shard.rw };
+        shard.xid2num[xids[i]] = old_total + i;
+        xidBloomAdd(&state->xid_bloom[0], xids[i]);
+    }
+    {
+        wlock w{ state->rw_xids };
+        bool ident = state->xids_identity.load(std::memory_order_relaxed);
+        for (long i = 0; ident && i < (long)xids.size(); i++)
+            if (xids[i] != old_total + i)
+                ident = false;
+        state->xids_identity.store(ident, std::memory_order_relaxed);
+        state->xids.append(&xids[0], (long)xids.size());
+        if (metric_type == 1)
+            state->base_norms.insert(state->base_norms.end(), norms.begin(), norms.end());
+    }
+    refreshFollowDels();
+}
+
+// tombstones are patched in place, not appended, so the dels column is
+// reloaded wholesale when its mtime moves; the newly dead xids leave the
+// lookup maps like they did on the writer. The column is one byte per line,
+// small enough that the reload is noise next to the poll itself.
+void VectoDB::refreshFollowDels()
+{
+    const string& fp = getDelsFp();
+    if (!fs::exists(fp))
+        return;
+    std::time_t mtime = fs::last_write_time(fp);
+    if (mtime == state->dels_mtime)
+        return;
+    state->dels_mtime = mtime;
+    long have = (long)fs::file_size(fp);
+    vector<char> fresh(have);
+    if (have > 0) {
+        ifstream fs(fp, std::ifstream::binary);
+        fs.read(&fresh[0], have);
+    }
+    vector<long> newly_dead;
+    {
+        wlock w{ state->rw_xids };
+        if ((long)fresh.size() > (long)state->xids.size())
+            fresh.resize(state->xids.size()); //the dels append ran ahead of the xids poll
+        long n_dels = 0;
+        for (long i = 0; i < (long)fresh.size(); i++) {
+            if (fresh[i]) {
+                n_dels++;
+                if (i >= (long)state->dels.size() || !state->dels[i])
+                    newly_dead.push_back(state->xids[i]);
+            }
+        }
+        state->dels = std::move(fresh);
+        state->stat_dels.store(n_dels, std::memory_order_relaxed);
+    }
+    for (long xid : newly_dead) {
+        XidShard& shard = state->xid_shards[xidShardOf(xid)];
+        wlock w{ shard.rw };
+        shard.xid2num.erase(xid);
+    }
+    if (!newly_dead.empty())
+        state->rcache_epoch.fetch_add(1, std::memory_order_release);
+}
+
+void VectoDB::parseNumaTopology()
+{
+    // No libnuma dependency: the kernel exposes the topology under sysfs.
+    // Node k's cpulist is of the form "0-13,28-41".
+    for (int node = 0;; node++) {
+        ostringstream oss;
+        oss << "/sys/devices/system/node/node" << node << "/cpulist";
+        std::ifstream fs(oss.str());
+        if (!fs.is_open())
+            break;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        string range;
+        while (std::getline(fs, range, ',')) {
+            size_t dash = range.find('-');
+            int lo = std::stoi(range);
+            int hi = dash == string::npos ? lo : std::stoi(range.substr(dash + 1));
+            for (int cpu = lo; cpu <= hi; cpu++) {
+                CPU_SET(cpu, &set);
+                if (cpu >= (int)cpu_to_node.size())
+                    cpu_to_node.resize(cpu + 1, 0);
+                cpu_to_node[cpu] = node;
+            }
+        }
+        node_cpus.push_back(set);
+    }
+    numa_nodes = std::max(1, (int)node_cpus.size());
+    if (numa_nodes <= 1)
+        LOG(INFO) << "numa=1 requested but the machine has a single node, serving one index";
+    else
+        LOG(INFO) << "numa=1: replicating the activated index across " << numa_nodes << " nodes";
+}
+
+// Picks the index replica local to the calling thread's NUMA node, falling
+// back to the primary. Caller holds rw_index.
+faiss::Index* VectoDB::localIndexReplica() const
+{
+    if (!state->index_replicas.empty()) {
+        int cpu = sched_getcpu();
+        if (cpu >= 0 && cpu < (int)cpu_to_node.size()) {
+            int node = cpu_to_node[cpu];
+            if (node > 0 && node <= (int)state->index_replicas.size()
+                && state->index_replicas[node - 1] != nullptr)
+                return state->index_replicas[node - 1];
+        }
+    }
+    return state->index;
+}
+
+// (Re)maps only the segments whose file size changed since the last
+// activation: the old tail plus whatever the wal rolled past. Full segments
+// are immutable, so per-call mapping work is bounded by the new data, not
+// the whole base. Caller holds m_base; returns the mapped line count.
+long VectoDB::remapBase()
+{
+    long nb = 0;
+    {
+        wlock w{ state->rw_data };
+        for (long k = 0; k < state->vec_nsegs; k++) {
+            const string& fp = getVecSegFp(k);
+            long len_f = fs::exists(fp) ? (long)fs::file_size(fp) : 0;
+            if (k >= (long)state->seg_maps.size())
+                state->seg_maps.push_back(SegMap{ nullptr, 0 });
+            if (k >= (long)state->seg_heat.size())
+                state->seg_heat.emplace_back();
+            SegMap& seg = state->seg_maps[k];
+            if (seg.len != len_f) {
+                mmapFile(fp, seg.data, seg.len);
+                //the mlock budget covers the front of the base, cumulatively across segments
+                applyMappingOptions(seg.data, seg.len, mlock_bytes - k * seg_lines * len_vec);
+            }
+            nb += getNumLines(seg.len, len_vec);
+        }
+    }
+    // total is the line-number allocator: concurrent adders may already have
+    // claimed lines past the durable count, so it only ever moves forward
+    long cur = state->total.load(std::memory_order_relaxed);
+    while (nb > cur && !state->total.compare_exchange_weak(cur, nb)) {
+    }
+    return nb;
+}
+
+void VectoDB::ActivateIndex(faiss::Index* index, long ntrain)
+{
+    TraceScope trace{ "activate", "ntrain", ntrain, "nsize", index == nullptr ? 0L : (long)index->ntotal };
+    drainWal(); //the wal thread appends straight through the page cache, so draining it is the flush
+    mtxlock m{ state->m_base };
+    bool no_persist = state->act_no_persist;
+    state->act_no_persist = false;
+    long nb = remapBase();
+
+    // The previous persister (if any) must be done before its index may be deleted below.
+    if (state->persist_thread.joinable())
+        state->persist_thread.join();
+
+    // Pre-fault the newly appended portion of the base mapping before the
+    // pointer swap: the first refine gathers after an activation otherwise
+    // take the page faults in the middle of live searches, a minutes-long
+    // p99 spike after every activation. The touched range is one write
+    // burst, so the pass is bounded; the first activation after open leaves
+    // the whole base to Warmup, whose touch rate is budgeted.
+    if (state->prefaulted_lines >= 0 && nb > state->prefaulted_lines) {
+        const long page = sysconf(_SC_PAGESIZE);
+        volatile unsigned long sink = 0; //defeats dead-load elimination
+        for (long s = state->prefaulted_lines; s < nb;) {
+            long e = std::min(nb, (s / seg_lines + 1) * seg_lines);
+            const uint8_t* p = state->seg_maps[s / seg_lines].data + (s % seg_lines) * len_vec;
+            long len = (e - s) * len_vec;
+            for (long o = 0; o < len; o += page)
+                sink += p[o];
+            s = e;
+        }
+    }
+    state->prefaulted_lines = nb;
+
+    long index_size = 0;
+    if (index != nullptr) {
+        index_size = index->ntotal;
+        // Push the search-time threshold down into the IVFPQ scan: the merge
+        // discards results failing dist_threshold anyway, so lists and
+        // candidates that cannot pass are abandoned inside the scan instead
+        // of filling a heap that gets thrown away. The scan works on
+        // internal smaller-is-better distances, hence the sign flip for IP.
+        // OPQ rotations are orthonormal, so the threshold carries into the
+        // rotated space unchanged. A dim-reducing PCA does not preserve
+        // distances (they only shrink), so the threshold stays out of the
+        // scan there and the refine applies it on the raw vectors instead.
+        faiss::IndexIVFPQ* ivfpq = dynamic_cast<faiss::IndexIVFPQ*>(innerIndex(index));
+        if (ivfpq != nullptr && ivfpq->d == index->d)
+            ivfpq->early_termination_dis = metric_type == 0 ? -dist_threshold : dist_threshold;
+    }
+
+    // ids32=1: lift the per-list ids into the compact 32-bit table while the
+    // index is still private to us. The 64-bit originals stay alive until
+    // the persist below has written them to disk.
+    vector<uint32_t> ids32_tab;
+    vector<long> ids32_off;
+    bool ids32_on = false;
+    if (ids32 && index != nullptr && index->ntotal <= (1L << 32)) {
+        faiss::IndexIVF* aivf = dynamic_cast<faiss::IndexIVF*>(innerIndex(index));
+        bool plain = aivf != nullptr
+            && dynamic_cast<faiss::IndexIVFPQR*>(aivf) == nullptr //PQR's second stage reads ids during the scan
+            && dynamic_cast<faiss::ArrayInvertedLists*>(aivf->invlists) != nullptr;
+        if (plain) {
+            long nlist = (long)aivf->nlist;
+            ids32_off.resize(nlist + 1);
+            ids32_tab.reserve(index->ntotal);
+            for (long l = 0; l < nlist; l++) {
+                ids32_off[l] = (long)ids32_tab.size();
+                const faiss::Index::idx_t* lids = aivf->invlists->get_ids(l);
+                long sz = (long)aivf->invlists->list_size(l);
+                for (long j = 0; j < sz; j++)
+                    ids32_tab.push_back((uint32_t)lids[j]);
+            }
+            ids32_off[nlist] = (long)ids32_tab.size();
+            ids32_on = true;
+        } else {
+            LOG(WARNING) << "ids32=1: index " << index_key << " keeps no in-memory array lists, serving with 64-bit ids";
+        }
+    }
+
+    // numa=1: clone the incoming index once per remote node before taking the
+    // write lock (it's still private to us here). Each clone runs on a thread
+    // bound to its node, so first-touch places the replica's memory locally.
+    vector<faiss::Index*> replicas;
+    if (numa_nodes > 1 && index != nullptr) {
+        replicas.resize(numa_nodes - 1, nullptr);
+        for (int node = 1; node < numa_nodes; node++) {
+            std::thread t([this, index, node, &replicas] {
+                sched_setaffinity(0, sizeof(cpu_set_t), &node_cpus[node]);
+                ArenaBinder b{ arena_index };
+                try {
+                    replicas[node - 1] = faiss::clone_index(index);
+                } catch (faiss::FaissException& e) {
+                    LOG(WARNING) << "index " << index_key << " does not support clone_index, node " << node << " searches the primary: " << e.what();
+                }
+            });
+            t.join();
+        }
+        if (ids32_on)
+            // the clones preserve list order, so the one table covers them;
+            // their private 64-bit ids are dead weight from the start
+            for (faiss::Index* replica : replicas)
+                if (replica != nullptr)
+                    freeListIds(replica);
+    }
+
+    {
+        DTRACE_PROBE(vectodb, rw__index__wlock__req);
+        wlock w{ state->rw_index };
+        DTRACE_PROBE3(vectodb, activate__swap, ntrain, index_size, nb);
+        delete state->index;
+        for (faiss::Index* replica : state->index_replicas)
+            delete replica;
+        // the full build covers everything the deltas did, so they retire here
+        for (faiss::Index* delta : state->delta_indexes)
+            delete delta;
+        state->delta_indexes.clear();
+        state->delta_starts.clear();
+        state->ntrain = ntrain;
+        state->index = index;
+        state->index_replicas = std::move(replicas);
+        state->ids32_tab.swap(ids32_tab);
+        state->ids32_off.swap(ids32_off);
+        state->ids32_active.store(ids32_on, std::memory_order_relaxed);
+        state->stat_ntrain.store(index == nullptr ? 0 : ntrain, std::memory_order_relaxed);
+        state->stat_nsize.store(index_size, std::memory_order_relaxed);
+
+        // close the latency window of the generation this activation
+        // replaces; RollbackIfRegressed compares the new one against it
+        long nq_now = state->st_nq.load(std::memory_order_relaxed);
+        long cyc_now = state->st_cyc_index.load(std::memory_order_relaxed)
+            + state->st_cyc_refine.load(std::memory_order_relaxed)
+            + state->st_cyc_flat.load(std::memory_order_relaxed)
+            + state->st_cyc_merge.load(std::memory_order_relaxed);
+        if (nq_now - state->act_nq0 >= ROLLBACK_MIN_NQ)
+            state->act_baseline_cyc = (cyc_now - state->act_cyc0) / (nq_now - state->act_nq0);
+        state->act_nq0 = nq_now;
+        state->act_cyc0 = cyc_now;
+    }
+
+    if (index != nullptr && !readonly && !no_persist) {
+        // Persist in the background: write to a temporary, rename atomically,
+        // then retire older index files. The previous on-disk index stays
+        // valid until the rename lands. A readonly follower activates the
+        // writer's file, which is already on disk.
+        long nb_manifest = nb;
+        bool ids32_free = ids32_on;
+        state->persist_thread = std::thread([this, index, ntrain, nb_manifest, ids32_free] {
+            const string fp_index = getIndexFp(ntrain);
+            const string fp_tmp = fp_index + ".tmp";
+            if (mmap_index)
+                faiss::write_index_mmap(index, fp_tmp.c_str());
+            else
+                faiss::write_index(index, fp_tmp.c_str());
+            rotateIndexFiles();
+            fs::rename(fp_tmp, fp_index);
+            writeManifest(ntrain, nb_manifest);
+            clearIndexFiles(fp_index);
+            if (ids32_free)
+                freeListIds(index); //the ids are on disk now, only the compact table serves
+        });
+    } else if (ids32_on) {
+        // follower and rollback activations serve a file already on disk
+        freeListIds(index);
+    }
+
+    rebuildFlatTail(index_size, nb);
+    purgeBuildArena(); //the build's transients are garbage now, return the pages
+}
+
+// Rebuilds the flat tail incrementally so it covers base lines [cut, nb): the
+// new flat is a suffix of the old one (the lines now answered by an index are
+// trimmed from the front), plus whatever lines of base the old flat has not
+// seen yet. Only that delta is read from disk. Caller holds m_base; cut is
+// index->ntotal at activation, or the delta-index end when a delta absorbs
+// the tail.
+void VectoDB::rebuildFlatTail(long cut, long nb)
+{
+    DTRACE_PROBE(vectodb, rw__flat__wlock__req);
+    wlock l{ state->rw_flat };
+    DTRACE_PROBE2(vectodb, rw__flat__wlock__acq, cut, nb);
+    faiss::Index* flat = newMemtable();
+    faiss::IndexFlat* old_flat = dynamic_cast<faiss::IndexFlat*>(state->flat);
+    long covered = cut;
+    if (old_flat != nullptr && state->flat_start_num <= cut
+        && state->flat_start_num + old_flat->ntotal >= cut) {
+        long n_keep = state->flat_start_num + old_flat->ntotal - cut;
+        if (n_keep > 0)
+            flat->add(n_keep, &old_flat->xb[(cut - state->flat_start_num) * dim]);
+        covered = cut + n_keep;
+    }
+    IndexFlat16* old_f16 = dynamic_cast<IndexFlat16*>(state->flat);
+    IndexFlat16* new_f16 = dynamic_cast<IndexFlat16*>(flat);
+    if (old_f16 != nullptr && new_f16 != nullptr && state->flat_start_num <= cut
+        && state->flat_start_num + old_f16->ntotal >= cut) {
+        //the surviving suffix carries over as codes, no decode/re-encode pass
+        long n_keep = state->flat_start_num + old_f16->ntotal - cut;
+        if (n_keep > 0) {
+            new_f16->xb16.assign(old_f16->xb16.begin() + (cut - state->flat_start_num) * dim,
+                old_f16->xb16.end());
+            new_f16->ntotal = n_keep;
+        }
+        covered = cut + n_keep;
+    }
+    IndexFlatSQ8* old_f8 = dynamic_cast<IndexFlatSQ8*>(state->flat);
+    IndexFlatSQ8* new_f8 = dynamic_cast<IndexFlatSQ8*>(flat);
+    if (old_f8 != nullptr && new_f8 != nullptr && state->flat_start_num <= cut
+        && state->flat_start_num + old_f8->ntotal >= cut) {
+        //SQ8 codes carry over verbatim too
+        long n_keep = state->flat_start_num + old_f8->ntotal - cut;
+        if (n_keep > 0) {
+            new_f8->xb8.assign(old_f8->xb8.begin() + (cut - state->flat_start_num) * old_f8->len_line,
+                old_f8->xb8.end());
+            new_f8->ntotal = n_keep;
+        }
+        covered = cut + n_keep;
+    }
+    IndexFlatBlk* old_blk = dynamic_cast<IndexFlatBlk*>(state->flat);
+    IndexFlatBlk* new_blk = dynamic_cast<IndexFlatBlk*>(flat);
+    if (old_blk != nullptr && new_blk != nullptr && state->flat_start_num <= cut
+        && state->flat_start_num + old_blk->ntotal >= cut) {
+        //interleaved rows gather back to row-major once, then re-add re-interleaves
+        long n_keep = state->flat_start_num + old_blk->ntotal - cut;
+        if (n_keep > 0) {
+            vector<float> rows(n_keep * dim);
+            for (long i = 0; i < n_keep; i++)
+                old_blk->getRow(cut - state->flat_start_num + i, &rows[i * dim]);
+            flat->add(n_keep, &rows[0]);
+        }
+        covered = cut + n_keep;
+    }
+    vector<uint64_t> new_sigs;
+    long sig_words = lsh_bits / 64;
+    if (lsh_bits > 0 && covered > cut) {
+        //the carried suffix keeps its signatures too
+        new_sigs.assign(state->flat_sigs.begin() + (cut - state->flat_start_num) * sig_words,
+            state->flat_sigs.end());
+    }
+    vector<float> new_norms;
+    if (metric_type == 1 && covered > cut) {
+        //and its cached norms
+        new_norms.assign(state->flat_norms.begin() + (cut - state->flat_start_num),
+            state->flat_norms.end());
+    }
+    if (covered < nb) {
+        //the tail scan is sequential; restore random access for the refine
+        //gather once the flat is rebuilt. Lines are contiguous only within a
+        //segment, so the delta is added one per-segment run at a time.
+        vector<float> delta;
+        for (long s = covered; s < nb;) {
+            long e = std::min(nb, (s / seg_lines + 1) * seg_lines);
+            uint8_t* p = state->seg_maps[s / seg_lines].data + (s % seg_lines) * len_vec;
+            adviseAccess(p, (e - s) * len_vec, true);
+            const bool coded = sq8 || binary; //either way the lines decode through readBase
+            if (coded) {
+                readBase(state->seg_maps, e, s, delta);
+                flat->add(e - s, &delta[0]);
+            } else {
+                flat->add(e - s, (const float*)p);
+            }
+            if (lsh_bits > 0) {
+                const float* v = coded ? &delta[0] : (const float*)p;
+                size_t off = new_sigs.size();
+                new_sigs.resize(off + (e - s) * sig_words, 0);
+                for (long i = 0; i < e - s; i++)
+                    lshSign(v + i * dim, &new_sigs[off + i * sig_words]);
+            }
+            if (metric_type == 1) {
+                const float* v = coded ? &delta[0] : (const float*)p;
+                size_t off = new_norms.size();
+                new_norms.resize(off + (e - s));
+                faiss::fvec_norms_L2sqr(&new_norms[off], v, dim, e - s);
+            }
+            adviseAccess(p, (e - s) * len_vec, false);
+            s = e;
+        }
+    }
+    delete state->flat;
+    state->flat = flat;
+    state->flat_sigs = std::move(new_sigs);
+    state->flat_norms = std::move(new_norms);
+    state->flat_start_num = cut;
+    state->stat_flat.store(flat->ntotal, std::memory_order_relaxed);
+    //the index answers approximately, so a swap can change them
+    state->rcache_epoch.fetch_add(1, memory_order_release);
+}
+
+long VectoDB::BuildDeltaIndex()
+{
+    if (readonly) {
+        LOG(ERROR) << work_dir << " is opened readonly, rejecting BuildDeltaIndex; builds belong to the writer node";
+        return 0;
+    }
+    if (0 == index_key.compare("Flat"))
+        return 0;
+    // deltas hang off an activated main index and its trained artifacts;
+    // without either the caller should run a full BuildIndex instead
+    if (state->stat_nsize.load(std::memory_order_relaxed) <= 0 || readTrainedNtrain() <= 0)
+        return 0;
+    bool expected = false;
+    if (!state->stat_building.compare_exchange_strong(expected, true, std::memory_order_relaxed))
+        return 0;
+    state->build_cancel.store(false, std::memory_order_relaxed);
+    long absorbed = 0;
+    long start = 0, end = 0;
+    long delta_lines = 0, ndeltas = 0;
+    long mem_est = 0; //bytes held from the process-wide build budget
+    faiss::Index* delta = nullptr;
+    vector<SegMap> segs; //private mapping, scanned front to back like a full build
+    ArenaBinder bind{ arena_build }; //runs on the caller's thread, restored on exit
+    TraceScope trace{ "build_delta" };
+    drainWal(); //the tail must be durable before it is read back from disk
+    {
+        rlock r{ state->rw_flat };
+        start = state->flat_start_num;
+    }
+    end = mapVecSegments(segs, true);
+    if (end <= start)
+        goto quit;
+    {
+        rlock r{ state->rw_index };
+        ndeltas = (long)state->delta_indexes.size();
+        for (faiss::Index* d : state->delta_indexes)
+            delta_lines += d->ntotal;
+    }
+    if (ndeltas >= DELTA_MAX_COUNT
+        || (delta_lines + end - start) * DELTA_COMPACT_FRACTION > state->stat_nsize.load(std::memory_order_relaxed)) {
+        // the tier is carrying too much; tell the caller to compact with a
+        // full rebuild, whose activation retires every delta at once
+        absorbed = -1;
+        goto quit;
+    }
+    if (build_mem_gb > 0) {
+        // the transient is the delta codes plus one add-staging chunk; queue
+        // behind the other builds on the box like a full rebuild does
+        mem_est = (end - start + ADD_CHUNK) * dim * (long)sizeof(float);
+        buildMemAcquire(mem_est, build_mem_gb << 30);
+        state->stat_build_mem.store(mem_est, std::memory_order_relaxed);
+    }
+    LOG(INFO) << "BuildDeltaIndex " << work_dir << ". absorbing lines [" << start << ", " << end << ") as delta " << ndeltas;
+    //empty trained skeleton: the coarse centroids and codebooks of the main
+    //index are reused, so only the add pass remains
+    delta = faiss::read_index(getTrainedFp().c_str());
+    {
+        faiss::ParameterSpace params;
+        params.initialize(delta);
+        // in auto mode the configured query_params may not even parse for the
+        // resolved factory string; the delta keeps the factory defaults then
+        if (0 != index_key.compare("auto"))
+            params.set_index_parameters(delta, query_params.c_str());
+        faiss::IndexIVFPQ* ivfpq = dynamic_cast<faiss::IndexIVFPQ*>(innerIndex(delta));
+        if (ivfpq != nullptr && ivfpq->d == delta->d)
+            ivfpq->early_termination_dis = metric_type == 0 ? -dist_threshold : dist_threshold;
+    }
+    addChunked(delta, segs, end, start);
+    if (state->build_cancel.load(std::memory_order_relaxed)) {
+        delete delta;
+        goto quit;
+    }
+    {
+        wlock w{ state->rw_index };
+        state->delta_indexes.push_back(delta);
+        state->delta_starts.push_back(start);
+    }
+    {
+        // The delta now answers [start, end); trim those lines off the flat.
+        // The transient overlap mirrors activation, where the index swap and
+        // the flat trim are separate critical sections too: both tiers may
+        // answer a line for a moment, which the merge tolerates.
+        mtxlock m{ state->m_base };
+        long nb = remapBase();
+        rebuildFlatTail(end, nb);
+    }
+    absorbed = end - start;
+quit:
+    if (mem_est > 0) {
+        buildMemRelease(mem_est);
+        state->stat_build_mem.store(0, std::memory_order_relaxed);
+    }
+    unmapVecSegments(segs);
+    state->stat_build_phase.store(BUILD_IDLE, std::memory_order_relaxed);
+    DTRACE_PROBE1(vectodb, build__phase, BUILD_IDLE);
+    state->stat_build_processed.store(0, std::memory_order_relaxed);
+    state->stat_building.store(false, std::memory_order_relaxed);
+    purgeBuildArena();
+    if (absorbed > 0) {
+        LOG(INFO) << "BuildDeltaIndex " << work_dir << " done, absorbed " << absorbed << " vectors";
+        evtFlushAsync();
+    }
+    return absorbed;
+}
+
+faiss::Index* VectoDB::newMemtable() const
+{
+    if (binary) //packed popcount scan, the only memtable that fits a 1-bit base
+        return new IndexFlatBin(dim, faiss::METRIC_L2);
+    if (0 == memtable_key.compare(0, 4, "HNSW")) {
+        if (metric_type == 1) {
+            int M = 32;
+            if (memtable_key.length() > 4)
+                M = std::stoi(memtable_key.substr(4));
+            return new faiss::IndexHNSWFlat(dim, M);
+        }
+        LOG(WARNING) << "memtable " << memtable_key << " supports only METRIC_L2, falling back to Flat";
+    } else if (0 == memtable_key.compare("Flat16")) {
+        return new IndexFlat16(dim, metric_type == 0 ? faiss::METRIC_INNER_PRODUCT : faiss::METRIC_L2);
+    } else if (0 == memtable_key.compare("SQ8")) {
+        return new IndexFlatSQ8(dim, metric_type == 0 ? faiss::METRIC_INNER_PRODUCT : faiss::METRIC_L2);
+    } else if (0 == memtable_key.compare("FlatBlk")) {
+        return new IndexFlatBlk(dim, metric_type == 0 ? faiss::METRIC_INNER_PRODUCT : faiss::METRIC_L2);
+    } else if (0 != memtable_key.compare("Flat")) {
+        LOG(WARNING) << "unknown memtable " << memtable_key << ", falling back to Flat";
+    }
+    return new faiss::IndexFlat(dim, metric_type == 0 ? faiss::METRIC_INNER_PRODUCT : faiss::METRIC_L2);
+}
+
+//fills the packed lsh=<bits> signature of one vector; bit b is the sign of
+//the projection onto random hyperplane b
+void VectoDB::lshSign(const float* vec, uint64_t* sig) const
+{
+    long words = lsh_bits / 64;
+    for (long w = 0; w < words; w++)
+        sig[w] = 0;
+    for (int b = 0; b < lsh_bits; b++) {
+        if (fvec_ip(vec, &lsh_planes[(long)b * dim], dim) > 0)
+            sig[b / 64] |= 1UL << (b % 64);
+    }
+}
+
+long VectoDB::LoadIndex()
+{
+    long ntrain = getIndexFpNtrain();
+    if (ntrain <= 0)
+        return 0;
+    ArenaBinder b{ arena_index };
+    faiss::Index* index = faiss::read_index(getIndexFp(ntrain).c_str());
+    ActivateIndex(index, ntrain);
+    return ntrain;
+}
+
+long VectoDB::RollbackIndex()
+{
+    long nt = 0;
+    {
+        mtxlock m{ state->m_base };
+        if (state->persist_thread.joinable())
+            state->persist_thread.join();
+        // the newest retained generation sits in slot 1
+        const string tail = ".index.1";
+        string prefix(index_key);
+        prefix.append(".");
+        fs::path fp1;
+        for (auto ent = fs::directory_iterator(work_dir); ent != fs::directory_iterator(); ent++) {
+            const fs::path& p = ent->path();
+            if (!fs::is_regular_file(p))
+                continue;
+            const string fn = p.filename().string();
+            if (fn.length() >= tail.length()
+                && 0 == fn.compare(fn.length() - tail.length(), tail.length(), tail)
+                && 0 == fn.compare(0, prefix.length(), prefix)) {
+                nt = std::stol(fn.substr(prefix.length(), fn.length() - prefix.length() - tail.length()));
+                fp1 = p;
+                break;
+            }
+        }
+        if (nt <= 0) {
+            LOG(ERROR) << "RollbackIndex " << work_dir << ": no retained index generation";
+            return -1;
+        }
+        // drop the regressed generation, promote the retained ones one slot
+        long cur = readManifest();
+        if (cur > 0 && fs::exists(getIndexFp(cur))) {
+            fs::remove(getIndexFp(cur));
+            if (fs::exists(getIndexFp(cur) + ".ivfdata"))
+                fs::remove(getIndexFp(cur) + ".ivfdata");
+        }
+        fs::rename(fp1, getIndexFp(nt));
+        const string fp_ivf1 = getIndexFp(nt) + ".ivfdata.1";
+        if (fs::exists(fp_ivf1))
+            fs::rename(fp_ivf1, getIndexFp(nt) + ".ivfdata");
+        for (long g = 2; g <= INDEX_RETAIN_GENS; g++) {
+            const string tails[] = { ".index." + std::to_string(g), ".ivfdata." + std::to_string(g) };
+            for (auto ent = fs::directory_iterator(work_dir); ent != fs::directory_iterator(); ent++) {
+                const fs::path& p = ent->path();
+                if (!fs::is_regular_file(p))
+                    continue;
+                const string fn = p.filename().string();
+                for (const string& t : tails) {
+                    if (fn.length() < t.length()
+                        || 0 != fn.compare(fn.length() - t.length(), t.length(), t))
+                        continue;
+                    string dst = p.string();
+                    dst.replace(dst.rfind('.') + 1, string::npos, std::to_string(g - 1));
+                    fs::rename(p, dst);
+                    break;
+                }
+            }
+        }
+        writeManifest(nt, state->total.load(std::memory_order_relaxed));
+        state->act_no_persist = true; //the promoted file is already on disk
+    }
+    LOG(WARNING) << "RollbackIndex " << work_dir << ": re-activating retained generation ntrain=" << nt;
+    ArenaBinder b{ arena_index };
+    faiss::Index* index = faiss::read_index(getIndexFp(nt).c_str());
+    ActivateIndex(index, nt);
+    return nt;
+}
+
+long VectoDB::RollbackIfRegressed(double max_ratio)
+{
+    long nq0, cyc0, baseline;
+    {
+        rlock r{ state->rw_index };
+        nq0 = state->act_nq0;
+        cyc0 = state->act_cyc0;
+        baseline = state->act_baseline_cyc;
+    }
+    if (baseline <= 0)
+        return 0; //no generation served long enough before the activation
+    long nq = state->st_nq.load(std::memory_order_relaxed) - nq0;
+    if (nq < ROLLBACK_MIN_NQ)
+        return 0; //not judged yet
+    long cyc = state->st_cyc_index.load(std::memory_order_relaxed)
+        + state->st_cyc_refine.load(std::memory_order_relaxed)
+        + state->st_cyc_flat.load(std::memory_order_relaxed)
+        + state->st_cyc_merge.load(std::memory_order_relaxed) - cyc0;
+    long mean = cyc / nq;
+    if ((double)mean <= max_ratio * (double)baseline)
+        return 0;
+    LOG(WARNING) << "RollbackIfRegressed " << work_dir << ": " << mean
+                 << " cycles/query against a baseline of " << baseline << ", rolling back";
+    return RollbackIndex();
+}
+
+void VectoDB::GetIndexSize(long& ntrain, long& nsize) const
+{
+    // the relaxed mirrors are set at activation (and at every stream_add
+    // absorb, the only way the index grows in place), so the poll is exact
+    // and stays off rw_index
+    ntrain = state->stat_ntrain.load(std::memory_order_relaxed);
+    nsize = state->stat_nsize.load(std::memory_order_relaxed);
+}
+
+long VectoDB::GetTotal()
+{
+    return state->total.load(std::memory_order_relaxed);
+}
+
+long VectoDB::GetFlatSize()
+{
+    return state->stat_flat.load(std::memory_order_relaxed);
+}
+
+long VectoDB::GetUpdateSize()
+{
+    return state->stat_upd_bytes.load(std::memory_order_relaxed) / len_upd_line
+        + state->upd_mem_lines.load(std::memory_order_relaxed);
+}
+
+long VectoDB::GetWalQueueDepth() const
+{
+    return state->wal_pending_lines.load(std::memory_order_relaxed);
+}
+
+void VectoDB::GetStats(long& total, long& flat_size, long& index_ntrain, long& index_size, long& update_size, long& building) const
+{
+    total = state->total.load(std::memory_order_relaxed);
+    flat_size = state->stat_flat.load(std::memory_order_relaxed);
+    index_ntrain = state->stat_ntrain.load(std::memory_order_relaxed);
+    index_size = state->stat_nsize.load(std::memory_order_relaxed);
+    update_size = state->stat_upd_bytes.load(std::memory_order_relaxed) / len_upd_line
+        + state->upd_mem_lines.load(std::memory_order_relaxed);
+    building = state->stat_building.load(std::memory_order_relaxed) ? 1 : 0;
+}
+
+void VectoDB::GetBuildProgress(long& phase, long& processed) const
+{
+    phase = state->stat_build_phase.load(std::memory_order_relaxed);
+    processed = state->stat_build_processed.load(std::memory_order_relaxed);
+}
+
+void VectoDB::CancelBuild() const
+{
+    if (state->stat_building.load(std::memory_order_relaxed)) {
+        LOG(INFO) << "CancelBuild " << work_dir;
+        state->build_cancel.store(true, std::memory_order_relaxed);
+    }
+}
+
+void VectoDB::AddWithIds(long nb, const float* xb, const long* xids)
+{
+    if (readonly) {
+        LOG(ERROR) << work_dir << " is opened readonly, rejecting AddWithIds; writes belong to the writer node";
+        return;
+    }
+    // deduplicate every incoming xid, against the database and within the batch
+    vector<long> keep_xids;
+    vector<float> keep_vec;
+    keep_xids.reserve(nb);
+    keep_vec.reserve(nb * dim);
+    for (long i = 0; i < nb; i++) {
+        //a definite filter miss means the xid was never enrolled: skip the probe
+        if (xidBloomMaybe(&state->xid_bloom[0], xids[i])) {
+            XidShard& shard = state->xid_shards[xidShardOf(xids[i])];
+            rlock r{ shard.rw };
+            if (shard.xid2num.count(xids[i]) > 0)
+                continue;
+        }
+        bool in_batch = false;
+        for (long xid : keep_xids)
+            if (xid == xids[i]) {
+                in_batch = true;
+                break;
+            }
+        if (in_batch)
+            continue;
+        keep_xids.push_back(xids[i]);
+        keep_vec.insert(keep_vec.end(), &xb[i * dim], &xb[(i + 1) * dim]);
+    }
+    addDeduped(keep_xids, keep_vec);
+}
+
+//post-dedup tail of AddWithIds, shared with the insert half of
+//UpsertWithIds: appends the batch to the flat memtable, the mirrors and the
+//WAL, and waits for the group commit to make it durable
+void VectoDB::addDeduped(std::vector<long>& keep_xids, std::vector<float>& keep_vec)
+{
+    long nk = (long)keep_xids.size();
+    if (nk == 0)
+        return;
+    // norms once per batch: the flat scan and the refine use the identity
+    // ||x-q||^2 = ||x||^2 + ||q||^2 - 2<x,q> with these cached
+    vector<float> nrm;
+    if (metric_type == 1) {
+        nrm.resize(nk);
+        faiss::fvec_norms_L2sqr(&nrm[0], &keep_vec[0], dim, nk);
+    }
+    long ntotal;
+    long my_seq;
+    const uint32_t now_ts = ttl_sec > 0 ? (uint32_t)std::time(nullptr) : 0;
+    {
+        // held shared from line allocation through the map inserts below, so
+        // the whole add lands in one numbering even if a CompactBase barrier
+        // is waiting to renumber the base
+        rlock g{ state->rw_compact };
+        {
+            // m_wal keeps the file order, the flat order and the assigned line
+            // numbers consistent across concurrent adders.
+            mtxlock m{ state->m_wal };
+            ntotal = state->total.fetch_add(nk);
+            {
+                DTRACE_PROBE(vectodb, rw__flat__wlock__req);
+                wlock w1{ state->rw_flat };
+                wlock w2{ state->rw_xids };
+                DTRACE_PROBE2(vectodb, flat__add, nk, state->flat->ntotal);
+                state->flat->add(nk, &keep_vec[0]);
+                if (lsh_bits > 0) {
+                    long words = lsh_bits / 64;
+                    size_t off = state->flat_sigs.size();
+                    state->flat_sigs.resize(off + nk * words, 0);
+                    for (long i = 0; i < nk; i++)
+                        lshSign(&keep_vec[i * dim], &state->flat_sigs[off + i * words]);
+                }
+                if (metric_type == 1)
+                    state->flat_norms.insert(state->flat_norms.end(), nrm.begin(), nrm.end());
+                state->stat_flat.store(state->flat->ntotal, std::memory_order_relaxed);
+                state->xids.append(&keep_xids[0], nk);
+                if (ttl_sec > 0)
+                    state->times.insert(state->times.end(), nk, now_ts);
+                if (metric_type == 1)
+                    state->base_norms.insert(state->base_norms.end(), nrm.begin(), nrm.end());
+            }
+            PendingAdd pending;
+            pending.xids = keep_xids;
+            pending.counts.assign(nk, 1L);
+            pending.tstamp = now_ts;
+            pending.vec = std::move(keep_vec);
+            pending.norms = std::move(nrm);
+            state->wal_queue.push_back(std::move(pending));
+            my_seq = ++state->wal_seq_enq;
+            state->wal_pending_lines.fetch_add(nk, memory_order_relaxed);
+        }
+        state->cv_wal.notify_one();
+        //the batch is searchable now, retire every cached answer
+        state->rcache_epoch.fetch_add(1, memory_order_release);
+        evtLog(EVT_ADD, nk, nk * len_base_line);
+        for (long i = 0; i < nk; i++) {
+            XidShard& shard = state->xid_shards[xidShardOf(keep_xids[i])];
+            wlock w{ shard.rw };
+            shard.xid2num[keep_xids[i]] = ntotal + i;
+            xidBloomAdd(&state->xid_bloom[0], keep_xids[i]);
+        }
+        if (state->xids_identity.load(std::memory_order_relaxed))
+            for (long i = 0; i < nk; i++)
+                if (keep_xids[i] != ntotal + i) {
+                    state->xids_identity.store(false, std::memory_order_relaxed);
+                    break;
+                }
+    }
+    // wait until the group-commit writer has made this batch durable
+    {
+        mtxlock lk{ state->m_wal };
+        state->cv_durable.wait(lk, [this, my_seq] { return state->wal_seq_durable >= my_seq; });
+    }
+}
+
+long VectoDB::BulkLoad(const char* fp_fvecs, const long* xids_in)
+{
+    if (readonly) {
+        LOG(ERROR) << work_dir << " is opened readonly, rejecting BulkLoad; writes belong to the writer node";
+        return -1;
+    }
+    drainWal();
+    mtxlock m{ state->m_base };
+    if (state->total != 0) {
+        LOG(ERROR) << "BulkLoad " << work_dir << " requires an empty database, total is " << state->total;
+        return -1;
+    }
+    uint8_t* src = nullptr;
+    long len_src = 0;
+    mmapFile(fp_fvecs, src, len_src);
+    adviseAccess(src, len_src, true); //one front-to-back conversion pass
+    const long len_src_line = (long)sizeof(int) + dim * (long)sizeof(float);
+    long nb = getNumLines(len_src, len_src_line);
+    if (nb == 0) {
+        munmapFile(fp_fvecs, src, len_src);
+        return 0;
+    }
+    LOG(INFO) << "BulkLoad " << work_dir << ": " << nb << " lines of " << fp_fvecs;
+
+    // carve the line range into chunks that never straddle a segment
+    // boundary, so every chunk converts and pwrites into exactly one file
+    vector<pair<long, long>> chunks;
+    for (long s = 0; s < nb;) {
+        long e = std::min({ s + ADD_CHUNK, nb, (s / seg_lines + 1) * seg_lines });
+        chunks.emplace_back(s, e);
+        s = e;
+    }
+    long nsegs = (nb + seg_lines - 1) / seg_lines;
+    close(state->fd_vec); //the empty tail of the fresh work_dir
+    vector<int> seg_fds(nsegs);
+    for (long k = 0; k < nsegs; k++) {
+        long lines = std::min(seg_lines, nb - k * seg_lines);
+        const string& fp = getVecSegFp(k);
+        int fd = open(fp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || ftruncate(fd, lines * len_vec) < 0)
+            LOG(FATAL) << "BulkLoad could not create " << fp << " with " << strerror(errno);
+        seg_fds[k] = fd;
+    }
+    // parallel chunk writers: each strips the per-line dimension header
+    // (SQ8-encoding when enabled) into a thread-local buffer and pwrites it
+    // at its offset, so ingestion runs at disk bandwidth
+    std::atomic<long> bad{ -1 };
+    vector<float> norms;
+    if (metric_type == 1)
+        norms.resize(nb); //chunks are disjoint, so the writers fill it race-free
+#pragma omp parallel
+    {
+        vector<uint8_t> buf;
+#pragma omp for schedule(dynamic)
+        for (long c = 0; c < (long)chunks.size(); c++) {
+            long s = chunks[c].first;
+            long e = chunks[c].second;
+            buf.resize((e - s) * len_vec);
+            for (long i = s; i < e; i++) {
+                const uint8_t* line = src + i * len_src_line;
+                if (*(const int*)line != (int)dim) {
+                    bad = i;
+                    break;
+                }
+                if (metric_type == 1)
+                    norms[i] = faiss::fvec_norm_L2sqr((const float*)(line + sizeof(int)), dim);
+                if (sq8)
+                    sq8_encode((const float*)(line + sizeof(int)), dim, &buf[(i - s) * len_vec]);
+                else if (binary)
+                    bin_encode((const float*)(line + sizeof(int)), dim, &buf[(i - s) * len_vec]);
+                else
+                    memcpy(&buf[(i - s) * len_vec], line + sizeof(int), len_vec);
+            }
+            if (bad < 0)
+                pwriteFull(seg_fds[s / seg_lines], &buf[0], (e - s) * len_vec, (s % seg_lines) * len_vec);
+        }
+    }
+    for (long k = 0; k < nsegs; k++)
+        close(seg_fds[k]);
+    munmapFile(fp_fvecs, src, len_src);
+    if (bad >= 0)
+        LOG(FATAL) << "BulkLoad " << fp_fvecs << " line " << bad.load() << " does not have dimension " << dim;
+
+    // the xids and counts columns are small; append them through the wal fds
+    // in large chunks
+    const uint32_t load_ts = ttl_sec > 0 ? (uint32_t)std::time(nullptr) : 0;
+    {
+        vector<long> buf(ADD_CHUNK);
+        for (long s = 0; s < nb; s += ADD_CHUNK) {
+            long e = std::min(nb, s + ADD_CHUNK);
+            if (xids_in != nullptr)
+                memcpy(&buf[0], xids_in + s, (e - s) * sizeof(long));
+            else
+                for (long i = s; i < e; i++)
+                    buf[i - s] = i;
+            writeFull(state->fd_xids, &buf[0], (e - s) * sizeof(long));
+        }
+        std::fill(buf.begin(), buf.end(), 1L);
+        for (long s = 0; s < nb; s += ADD_CHUNK)
+            writeFull(state->fd_counts, &buf[0], std::min(nb - s, ADD_CHUNK) * sizeof(long));
+        if (ttl_sec > 0) {
+            vector<uint32_t> tbuf(ADD_CHUNK, load_ts);
+            for (long s = 0; s < nb; s += ADD_CHUNK)
+                writeFull(state->fd_times, &tbuf[0], std::min(nb - s, ADD_CHUNK) * sizeof(uint32_t));
+        }
+        if (metric_type == 1)
+            writeFull(state->fd_norms, &norms[0], nb * sizeof(float));
+    }
+    state->vec_nsegs = nsegs;
+    state->vec_tail_lines = nb - (nsegs - 1) * seg_lines;
+    state->fd_vec = openAppendFd(getVecSegFp(nsegs - 1));
+    state->total = nb;
+
+    // parallel xid-map build, same shape as the open path. The flat memtable
+    // is skipped entirely; the one BuildIndex + ActivateIndex that follows
+    // covers every loaded line, so the rebuilt flat tail stays empty.
+    {
+        wlock w{ state->rw_xids };
+        if (ttl_sec > 0)
+            state->times.assign(nb, load_ts);
+        if (metric_type == 1)
+            state->base_norms = std::move(norms);
+        if (xids_in != nullptr) {
+            bool ident = true;
+            for (long i = 0; i < nb; i++)
+                if (xids_in[i] != i) {
+                    ident = false;
+                    break;
+                }
+            state->xids_identity.store(ident, std::memory_order_relaxed);
+        }
+        state->xids.resize(nb);
+        if (xids_in != nullptr)
+            memcpy(&state->xids[0], xids_in, nb * sizeof(long));
+        else
+#pragma omp parallel for
+            for (long i = 0; i < nb; i++)
+                state->xids[i] = i;
+    }
+#pragma omp parallel for
+    for (int s = 0; s < XID_NSHARD; s++) {
+        XidShard& shard = state->xid_shards[s];
+        wlock w{ shard.rw };
+        shard.xid2num.reserve(2 * nb / XID_NSHARD);
+        for (long i = 0; i < nb; i++) {
+            if (xidShardOf(state->xids[i]) == s)
+                shard.xid2num[state->xids[i]] = i;
+        }
+    }
+#pragma omp parallel for
+    for (long i = 0; i < nb; i++)
+        xidBloomAdd(&state->xid_bloom[0], state->xids[i]);
+    LOG(INFO) << "BulkLoad " << work_dir << " done, " << nb << " lines";
+    state->rcache_epoch.fetch_add(1, memory_order_release);
+    evtFlushAsync();
+    return nb;
+}
+
+// Write every slot of the coalescing table to update.fvecs as one merged
+// record carrying its absorbed-repeat count in the packed heading, then reset
+// the table keeping its allocation. Caller holds m_update.
+void VectoDB::updSpillLocked()
+{
+    if (state->upd_distinct == 0)
+        return;
+    vector<char> buf(state->upd_distinct * len_upd_line);
+    long pos = 0;
+    for (const UpdSlot& slot : state->upd_table) {
+        if (slot.line_num == -1)
+            continue;
+        *(long*)&buf[pos] = (slot.count << UPD_LINE_BITS) | slot.line_num;
+        if (upd_sq8)
+            sq8_encode(&state->upd_arena[slot.off], dim, (uint8_t*)&buf[pos + sizeof(long)]);
+        else
+            memcpy(&buf[pos + sizeof(long)], &state->upd_arena[slot.off], dim * sizeof(float));
+        pos += len_upd_line;
+    }
+    state->fs_update.write(&buf[0], pos);
+    state->stat_upd_bytes.fetch_add(pos, std::memory_order_relaxed);
+    std::fill(state->upd_table.begin(), state->upd_table.end(), UpdSlot{ -1, 0, 0 });
+    state->upd_arena.clear();
+    state->upd_distinct = 0;
+    state->upd_mem_lines.store(0, std::memory_order_relaxed);
+}
+
+// Absorb a batch of update records into the in-memory coalescing table
+// (upd_coalesce=<n>). Repeats of a line accumulate into its slot, so a line
+// updated hundreds of times between replays costs one table entry instead of
+// hundreds of backlog records; a record of a new line past the bound first
+// spills the whole table, keeping memory bounded while the backlog file and
+// its replay shrink by the redundancy factor of the update stream. Returns
+// false without touching the table when a compaction renumbered the base
+// after epoch0 was read; the caller re-resolves and retries.
+bool VectoDB::updAbsorb(const char* recs, long nrec, long epoch0)
+{
+    mtxlock m{ state->m_update };
+    if (epoch0 != state->compact_epoch.load(std::memory_order_relaxed))
+        return false;
+    if (state->upd_table.empty()) {
+        size_t cap = 64;
+        while (cap < (size_t)(2 * upd_coalesce))
+            cap <<= 1;
+        state->upd_mask = cap - 1;
+        state->upd_table.assign(cap, UpdSlot{ -1, 0, 0 });
+    }
+    //the table accumulates in float whatever the record payload is; quantized
+    //records are decoded once on the way in and re-encoded only at spill
+    vector<float> dec(upd_sq8 ? dim : 0);
+    for (long i = 0; i < nrec; i++) {
+        const char* rec = recs + i * len_upd_line;
+        long line_num = *(const long*)rec;
+        const float* v = (const float*)(rec + sizeof(long));
+        if (upd_sq8) {
+            sq8_decode((const uint8_t*)(rec + sizeof(long)), dim, &dec[0]);
+            v = &dec[0];
+        }
+        for (;;) {
+            size_t h = updSlotOf(line_num, state->upd_mask);
+            while (state->upd_table[h].line_num != -1 && state->upd_table[h].line_num != line_num)
+                h = (h + 1) & state->upd_mask;
+            UpdSlot& slot = state->upd_table[h];
+            if (slot.line_num == line_num) {
+                if (slot.count >= UPD_COUNT_MAX) { //the packed count of this line would overflow
+                    updSpillLocked();
+                    continue;
+                }
+                slot.count++;
+                float* acc = &state->upd_arena[slot.off];
+                for (int d = 0; d < dim; d++)
+                    acc[d] += v[d];
+                break;
+            }
+            if (state->upd_distinct >= upd_coalesce) { //table full, spill and retry on the emptied one
+                updSpillLocked();
+                continue;
+            }
+            slot.line_num = line_num;
+            slot.count = 1;
+            slot.off = (long)state->upd_arena.size();
+            state->upd_arena.insert(state->upd_arena.end(), v, v + dim);
+            state->upd_distinct++;
+            break;
+        }
+    }
+    state->upd_mem_lines.store(state->upd_distinct, std::memory_order_relaxed);
+    return true;
+}
+
+void VectoDB::UpdateWithIds(long nb, const float* xb, const long* xids)
+{
+    if (readonly) {
+        LOG(ERROR) << work_dir << " is opened readonly, rejecting UpdateWithIds; writes belong to the writer node";
+        return;
+    }
+    // Probe and serialize before taking m_update: line_nums are stable once
+    // assigned (the base is append-only), the sharded rlocks don't block
+    // Search's xid translation, and only the file append stays serialized.
+    // CompactBase is the one thing that renumbers lines; the epoch check
+    // under m_update catches a compaction landing between the probe and the
+    // append, and the retry re-resolves against the new numbering.
+    // The buffer is per-thread and reused across calls.
+    static thread_local std::vector<char> buf;
+    if ((long)buf.size() < nb * len_upd_line)
+        buf.resize(nb * len_upd_line);
+    for (;;) {
+        long epoch = state->compact_epoch.load(std::memory_order_acquire);
+        long pos = 0;
+        for (long i = 0; i < nb; i++) {
+            if (!xidBloomMaybe(&state->xid_bloom[0], xids[i]))
+                continue; //never enrolled, nothing to update
+            XidShard& shard = state->xid_shards[xidShardOf(xids[i])];
+            long line_num;
+            {
+                rlock r{ shard.rw };
+                auto it = shard.xid2num.find(xids[i]);
+                if (it == shard.xid2num.end())
+                    continue;
+                line_num = it->second;
+            }
+            *(long*)&buf[pos] = line_num;
+            if (upd_sq8)
+                sq8_encode(&xb[i * dim], dim, (uint8_t*)&buf[pos + sizeof(long)]);
+            else
+                memcpy(&buf[pos + sizeof(long)], &xb[i * dim], dim * sizeof(float));
+            pos += len_upd_line;
+        }
+        if (pos == 0)
+            return;
+        if (upd_coalesce > 0) {
+            if (!updAbsorb(&buf[0], pos / len_upd_line, epoch))
+                continue;
+        } else {
+            mtxlock m{ state->m_update };
+            if (epoch != state->compact_epoch.load(std::memory_order_relaxed))
+                continue;
+            state->fs_update.write(&buf[0], pos);
+            state->stat_upd_bytes.fetch_add(pos, std::memory_order_relaxed);
+        }
+        evtLog(EVT_UPDATE, nb, pos / len_upd_line);
+        return;
+    }
+}
+
+void VectoDB::UpsertWithIds(long nb, const float* xb, const long* xids)
+{
+    if (readonly) {
+        LOG(ERROR) << work_dir << " is opened readonly, rejecting UpsertWithIds; writes belong to the writer node";
+        return;
+    }
+    // One sharded-map probe pass splits the batch: known xids become update
+    // lines, unknown ones are deduplicated within the batch and inserted.
+    // Each subset is then appended in one go, so a mixed batch pays one
+    // probe pass and one append per stream instead of two of each.
+    static thread_local std::vector<char> ubuf;
+    if ((long)ubuf.size() < nb * len_upd_line)
+        ubuf.resize(nb * len_upd_line);
+    vector<long> ins_xids;
+    vector<float> ins_vec;
+    for (;;) {
+        // same epoch retry as UpdateWithIds: a compaction landing between the
+        // probe and the append renumbers the resolved lines
+        long epoch = state->compact_epoch.load(std::memory_order_acquire);
+        long pos = 0;
+        ins_xids.clear();
+        ins_vec.clear();
+        for (long i = 0; i < nb; i++) {
+            long line_num = -1;
+            if (xidBloomMaybe(&state->xid_bloom[0], xids[i])) {
+                XidShard& shard = state->xid_shards[xidShardOf(xids[i])];
+                rlock r{ shard.rw };
+                auto it = shard.xid2num.find(xids[i]);
+                if (it != shard.xid2num.end())
+                    line_num = it->second;
+            }
+            if (line_num >= 0) {
+                *(long*)&ubuf[pos] = line_num;
+                if (upd_sq8)
+                    sq8_encode(&xb[i * dim], dim, (uint8_t*)&ubuf[pos + sizeof(long)]);
+                else
+                    memcpy(&ubuf[pos + sizeof(long)], &xb[i * dim], dim * sizeof(float));
+                pos += len_upd_line;
+                continue;
+            }
+            bool in_batch = false;
+            for (long xid : ins_xids)
+                if (xid == xids[i]) {
+                    in_batch = true;
+                    break;
+                }
+            if (in_batch)
+                continue;
+            ins_xids.push_back(xids[i]);
+            ins_vec.insert(ins_vec.end(), &xb[i * dim], &xb[(i + 1) * dim]);
+        }
+        if (pos > 0) {
+            if (upd_coalesce > 0) {
+                if (!updAbsorb(&ubuf[0], pos / len_upd_line, epoch))
+                    continue;
+            } else {
+                mtxlock m{ state->m_update };
+                if (epoch != state->compact_epoch.load(std::memory_order_relaxed))
+                    continue;
+                state->fs_update.write(&ubuf[0], pos);
+                state->stat_upd_bytes.fetch_add(pos, std::memory_order_relaxed);
+            }
+            evtLog(EVT_UPDATE, nb, pos / len_upd_line);
+        }
+        break;
+    }
+    // last so the update append overlaps the insert half's group commit
+    addDeduped(ins_xids, ins_vec);
+}
+
+long VectoDB::DeleteWithIds(long nb, const long* xids)
+{
+    if (readonly) {
+        LOG(ERROR) << work_dir << " is opened readonly, rejecting DeleteWithIds; writes belong to the writer node";
+        return 0;
+    }
+    mtxlock d{ state->m_del };
+    return deleteInner(nb, xids);
+}
+
+//the body of DeleteWithIds, factored out so SweepExpired can tombstone under
+//the m_del it already holds. Caller holds m_del.
+long VectoDB::deleteInner(long nb, const long* xids)
+{
+    // Drop the xids from the lookup maps first: a deleted xid stops resolving
+    // immediately, so a re-add of it creates a fresh line instead of updating
+    // the dead one.
+    vector<long> lines;
+    lines.reserve(nb);
+    for (long i = 0; i < nb; i++) {
+        if (!xidBloomMaybe(&state->xid_bloom[0], xids[i]))
+            continue; //never enrolled, nothing to tombstone
+        XidShard& shard = state->xid_shards[xidShardOf(xids[i])];
+        wlock w{ shard.rw };
+        auto it = shard.xid2num.find(xids[i]);
+        if (it == shard.xid2num.end())
+            continue;
+        lines.push_back(it->second);
+        shard.xid2num.erase(it);
+    }
+    if (lines.empty())
+        return 0;
+    std::sort(lines.begin(), lines.end());
+    {
+        wlock w{ state->rw_xids };
+        if ((long)state->dels.size() <= lines.back())
+            state->dels.resize(lines.back() + 1, 0);
+        for (long line : lines)
+            state->dels[line] = 1;
+        state->repl_deleted.insert(state->repl_deleted.end(), lines.begin(), lines.end());
+        state->stat_dels.fetch_add((long)lines.size(), std::memory_order_relaxed);
+    }
+    {
+        // persist the tombstone column; the sorted order coalesces adjacent
+        // lines into one write per run. Writing past EOF zero-fills the gap,
+        // so the column needs no append bookkeeping.
+        mtxlock m{ state->m_base2 };
+        char ones[4096];
+        memset(ones, 1, sizeof(ones));
+        size_t s = 0;
+        while (s < lines.size()) {
+            size_t e = s + 1;
+            while (e < lines.size() && lines[e] == lines[e - 1] + 1)
+                e++;
+            state->fs_dels2.seekp(lines[s], ios_base::beg);
+            for (size_t off = s; off < e; off += sizeof(ones))
+                state->fs_dels2.write(ones, std::min(e - off, sizeof(ones)));
+            s = e;
+        }
+        state->fs_dels2.flush(); //the follower tails the file
+    }
+    state->rcache_epoch.fetch_add(1, std::memory_order_release);
+    evtLog(EVT_DELETE, nb, (long)lines.size());
+    return (long)lines.size();
+}
+
+long VectoDB::SweepExpired()
+{
+    if (ttl_sec <= 0)
+        return 0;
+    if (readonly) {
+        LOG(ERROR) << work_dir << " is opened readonly, rejecting SweepExpired; writes belong to the writer node";
+        return 0;
+    }
+    const uint32_t cutoff = (uint32_t)(std::time(nullptr) - ttl_sec);
+    mtxlock d{ state->m_del };
+    // timestamps are append-ordered, so the expired set is a prefix: the scan
+    // resumes at the cursor and stops at the first line still inside its TTL.
+    // Lines a clock step filed out of order expire once their successors do.
+    vector<long> xids;
+    long cur = state->sweep_cursor;
+    {
+        rlock r{ state->rw_xids };
+        long nb = (long)state->times.size();
+        for (; cur < nb; cur++) {
+            uint32_t ts = state->times[cur];
+            if (ts == 0 || (cur < (long)state->dels.size() && state->dels[cur]))
+                continue; //exempt or already tombstoned
+            if (ts > cutoff)
+                break;
+            xids.push_back(state->xids[cur]);
+        }
+    }
+    long n = xids.empty() ? 0 : deleteInner((long)xids.size(), &xids[0]);
+    state->sweep_cursor = cur;
+    if (n > 0)
+        LOG(INFO) << "SweepExpired " << work_dir << ": tombstoned " << n << " lines older than " << ttl_sec << "s";
+    return n;
+}
+
+long VectoDB::GetDeletedSize()
+{
+    return state->stat_dels.load(std::memory_order_relaxed);
+}
+
+long VectoDB::ReadDeletedTail(long start_idx, long max_xids, long* xids)
+{
+    if (start_idx < 0 || max_xids <= 0)
+        return 0;
+    rlock r{ state->rw_xids };
+    long n = std::min(max_xids, (long)state->repl_deleted.size() - start_idx);
+    if (n <= 0)
+        return 0;
+    //the xids mirror keeps the entry of a dead line, only the lookup maps drop it
+    for (long i = 0; i < n; i++)
+        xids[i] = state->xids[state->repl_deleted[start_idx + i]];
+    return n;
+}
+
+// Relocates the inverted-list entries of updated lines inside one IVF index:
+// the coarse assignment of the pre-update vector says where the entry was
+// filed, the new vector is re-encoded, and the entry is rewritten in place or
+// moved swap-with-last style (as IndexIVFFlat::update_vectors does) when the
+// assignment changed. label_offset translates base line numbers to index
+// labels. Caller holds rw_index for writing. Returns the lines it could not
+// patch.
+long VectoDB::patchIvfEntries(faiss::Index* idx, long label_offset, const vector<long>& lines,
+    const vector<float>& old_vecs, const vector<float>& new_vecs) const
+{
+    long n = (long)lines.size();
+    if (n == 0)
+        return 0;
+    faiss::IndexPreTransform* ipt = dynamic_cast<faiss::IndexPreTransform*>(idx);
+    faiss::IndexIVF* ivf = dynamic_cast<faiss::IndexIVF*>(innerIndex(idx));
+    if (ivf == nullptr || ivf->maintain_direct_map)
+        return n;
+    faiss::IndexIVFPQ* pq = dynamic_cast<faiss::IndexIVFPQ*>(ivf);
+    faiss::IndexIVFFlat* ivf_flat = dynamic_cast<faiss::IndexIVFFlat*>(ivf);
+    if (pq == nullptr && ivf_flat == nullptr)
+        return n;
+    const float* xt_old = &old_vecs[0];
+    const float* xt_new = &new_vecs[0];
+    faiss::ScopeDeleter<float> del_old, del_new;
+    if (ipt != nullptr) {
+        xt_old = ipt->apply_chain(n, &old_vecs[0]);
+        if (xt_old != &old_vecs[0])
+            del_old.set(xt_old);
+        xt_new = ipt->apply_chain(n, &new_vecs[0]);
+        if (xt_new != &new_vecs[0])
+            del_new.set(xt_new);
+    }
+    vector<long> keys_old(n), keys_new(n);
+    ivf->quantizer->assign(n, xt_old, &keys_old[0]);
+    ivf->quantizer->assign(n, xt_new, &keys_new[0]);
+    vector<uint8_t> codes(n * ivf->code_size);
+    if (pq != nullptr)
+        pq->encode_multiple(n, &keys_new[0], xt_new, &codes[0], false);
+    else
+        memcpy(&codes[0], xt_new, n * ivf->code_size); //IVFFlat codes are the raw vectors
+    faiss::InvertedLists* il = ivf->invlists;
+    long failed = 0;
+    for (long i = 0; i < n; i++) {
+        long label = lines[i] - label_offset;
+        long list_old = keys_old[i];
+        size_t l = il->list_size(list_old);
+        const faiss::Index::idx_t* ids = il->get_ids(list_old);
+        size_t off = 0;
+        while (off < l && ids[off] != label)
+            off++;
+        if (off == l) {
+            //the entry is not where the pre-update vector says, e.g. an
+            //earlier update of this line went unpatched before a restart
+            failed++;
+            continue;
+        }
+        if (list_old == keys_new[i]) {
+            il->update_entry(list_old, off, label, &codes[i * ivf->code_size]);
+        } else {
+            if (off != l - 1)
+                il->update_entry(list_old, off, il->get_single_id(list_old, l - 1),
+                    il->get_single_code(list_old, l - 1));
+            il->resize(list_old, l - 1);
+            il->add_entry(keys_new[i], label, &codes[i * ivf->code_size]);
+        }
+    }
+    return failed;
+}
+
+// Applies a batch of updated vectors to every live tier in place — main
+// index, its replicas, delta indexes and the flat — so the typical tiny
+// update burst becomes visible immediately instead of waiting for a full
+// rebuild. Every memtable flavor takes the row overwrite, the HNSW one
+// through its flat storage. Returns the lines no tier could absorb (an
+// entry a prior unpatched update displaced); the caller keeps the rebuild
+// path for those.
+long VectoDB::patchIndexTiers(const vector<long>& lines, const vector<float>& old_vecs, const vector<float>& new_vecs)
+{
+    if (lines.empty())
+        return 0;
+    long failed = 0;
+    {
+        wlock w{ state->rw_index };
+        vector<long> sub;
+        vector<float> sub_old, sub_new;
+        auto subset = [&](long lo, long hi) {
+            sub.clear();
+            sub_old.clear();
+            sub_new.clear();
+            for (size_t i = 0; i < lines.size(); i++) {
+                if (lines[i] < lo || lines[i] >= hi)
+                    continue;
+                sub.push_back(lines[i]);
+                sub_old.insert(sub_old.end(), &old_vecs[i * dim], &old_vecs[(i + 1) * dim]);
+                sub_new.insert(sub_new.end(), &new_vecs[i * dim], &new_vecs[(i + 1) * dim]);
+            }
+        };
+        if (state->index != nullptr) {
+            subset(0, state->index->ntotal);
+            if (state->ids32_active.load(memory_order_relaxed)) {
+                //ids32=1 freed the per-list ids the patch walks to locate its
+                //entry; these lines stay stale until the next rebuild relinks them
+                if (!sub.empty())
+                    LOG(WARNING) << "UpdateBase " << work_dir << ": ids32=1 freed the per-list ids, " << sub.size()
+                                 << " updated lines wait for the next rebuild";
+                failed += (long)sub.size();
+            } else {
+                failed += patchIvfEntries(state->index, 0, sub, sub_old, sub_new);
+                //replicas are best effort: a replica miss only costs recall there
+                for (faiss::Index* replica : state->index_replicas)
+                    if (replica != nullptr)
+                        patchIvfEntries(replica, 0, sub, sub_old, sub_new);
+            }
+        }
+        for (size_t di = 0; di < state->delta_indexes.size(); di++) {
+            long start = state->delta_starts[di];
+            subset(start, start + state->delta_indexes[di]->ntotal);
+            failed += patchIvfEntries(state->delta_indexes[di], start, sub, sub_old, sub_new);
+        }
+    }
+    {
+        wlock l{ state->rw_flat };
+        faiss::IndexFlat* f = dynamic_cast<faiss::IndexFlat*>(state->flat);
+        IndexFlat16* f16 = dynamic_cast<IndexFlat16*>(state->flat);
+        IndexFlatSQ8* f8 = dynamic_cast<IndexFlatSQ8*>(state->flat);
+        IndexFlatBin* fbin = dynamic_cast<IndexFlatBin*>(state->flat);
+        IndexFlatBlk* fb = dynamic_cast<IndexFlatBlk*>(state->flat);
+        faiss::IndexHNSW* fh = dynamic_cast<faiss::IndexHNSW*>(state->flat);
+        //the HNSW graph computes distances from its flat storage at query
+        //time, so rewriting the row makes the new vector visible at once;
+        //the edges were laid out for the old vector, which only nudges
+        //recall around that row until the next rebuild relinks it
+        faiss::IndexFlat* fhs = fh == nullptr ? nullptr : dynamic_cast<faiss::IndexFlat*>(fh->storage);
+        long words = lsh_bits / 64;
+        for (size_t i = 0; i < lines.size(); i++) {
+            long row = lines[i] - state->flat_start_num;
+            if (row < 0 || row >= state->flat->ntotal)
+                continue;
+            bool rewrote = true;
+            if (f != nullptr)
+                memcpy(&f->xb[row * dim], &new_vecs[i * dim], dim * sizeof(float));
+            else if (f16 != nullptr)
+                fp16_encode(&new_vecs[i * dim], dim, &f16->xb16[row * dim]);
+            else if (f8 != nullptr)
+                sq8_encode(&new_vecs[i * dim], dim, &f8->xb8[row * f8->len_line]);
+            else if (fbin != nullptr)
+                bin_encode(&new_vecs[i * dim], dim, &fbin->xbb[row * fbin->len_line]);
+            else if (fb != nullptr)
+                fb->putRow(row, &new_vecs[i * dim]);
+            else if (fhs != nullptr)
+                memcpy(&fhs->xb[row * dim], &new_vecs[i * dim], dim * sizeof(float));
+            else {
+                failed++; //a memtable without reachable flat storage cannot be rewritten in place
+                rewrote = false;
+            }
+            if (lsh_bits > 0 && rewrote)
+                lshSign(&new_vecs[i * dim], &state->flat_sigs[row * words]);
+            if (metric_type == 1 && rewrote)
+                state->flat_norms[row] = faiss::fvec_norm_L2sqr(&new_vecs[i * dim], dim);
+        }
+    }
+    return failed;
+}
+
+// Local re-clustering of one oversized inverted list: clustered production
+// data piles millions of entries into a few IVF lists, and every query that
+// probes one pays the outsized scan — the bimodal half of the latency
+// histogram. Splitting re-clusters such a list into two sub-centroids in
+// place (quantizer centroid rewritten + one appended, entries re-filed, PQ
+// residual codes re-encoded), so tail latency flattens without retraining or
+// raising nprobe for everyone. Not persisted: a restart reopens the unsplit
+// index, and the next full build re-clusters from scratch anyway.
+long VectoDB::SplitHotLists(long max_splits)
+{
+    if (readonly) {
+        LOG(ERROR) << work_dir << " is opened readonly, rejecting SplitHotLists; maintenance belongs to the writer node";
+        return 0;
+    }
+    if (ids32) {
+        LOG(WARNING) << "ids32=1 freezes the activated lists, skipping SplitHotLists";
+        return 0;
+    }
+    wlock w{ state->rw_index };
+    if (state->index == nullptr || max_splits <= 0)
+        return 0;
+    faiss::IndexPreTransform* ipt = dynamic_cast<faiss::IndexPreTransform*>(state->index);
+    faiss::IndexIVF* ivf = dynamic_cast<faiss::IndexIVF*>(innerIndex(state->index));
+    faiss::ArrayInvertedLists* ail = ivf == nullptr ? nullptr : dynamic_cast<faiss::ArrayInvertedLists*>(ivf->invlists);
+    faiss::IndexFlat* qf = ivf == nullptr ? nullptr : dynamic_cast<faiss::IndexFlat*>(ivf->quantizer);
+    if (ail == nullptr || qf == nullptr) {
+        LOG(WARNING) << "SplitHotLists " << work_dir << " needs in-memory inverted lists and a flat coarse quantizer, skipping";
+        return 0;
+    }
+    const long d_q = (long)ivf->d;
+    const size_t cs = ail->code_size;
+    long mean = std::max(1L, (long)ivf->ntotal / (long)ivf->nlist);
+    vector<pair<long, long>> hot; //(-size, list): biggest offenders first
+    for (long l = 0; l < (long)ivf->nlist; l++) {
+        long sz = (long)ail->ids[l].size();
+        if (sz >= SPLIT_HOT_FACTOR * mean && sz >= SPLIT_MIN_LINES)
+            hot.emplace_back(-sz, l);
+    }
+    if (hot.empty())
+        return 0;
+    sort(hot.begin(), hot.end());
+    if ((long)hot.size() > max_splits)
+        hot.resize(max_splits);
+
+    faiss::IndexIVFPQ* ivfpq = dynamic_cast<faiss::IndexIVFPQ*>(ivf);
+    long done = 0;
+    rlock rd{ state->rw_data }; //the list's raw vectors come from the base mapping
+    for (const pair<long, long>& h : hot) {
+        long l = h.second;
+        long n = (long)ail->ids[l].size();
+        vector<float> x(n * dim);
+        for (long j = 0; j < n; j++) {
+            const uint8_t* line = segLine(state->seg_maps, (long)ail->ids[l][j]);
+            if (sq8)
+                sq8_decode(line, dim, &x[j * dim]);
+            else if (binary)
+                bin_decode(line, dim, &x[j * dim]);
+            else
+                memcpy(&x[j * dim], line, dim * sizeof(float));
+        }
+        // the coarse quantizer lives in the transformed space of any OPQ/PCA
+        // chain in front, so cluster and assign there
+        const float* xt = &x[0];
+        faiss::ScopeDeleter<float> del_xt;
+        if (ipt != nullptr) {
+            xt = ipt->apply_chain(n, &x[0]);
+            if (xt != &x[0])
+                del_xt.set(xt);
+        }
+        vector<float> cents(2 * d_q);
+        if (n > SPLIT_TRAIN_MAX) {
+            //a strided sample trains as well and keeps the 2-means cheap
+            long stride = (n + SPLIT_TRAIN_MAX - 1) / SPLIT_TRAIN_MAX;
+            vector<float> sample;
+            sample.reserve(SPLIT_TRAIN_MAX * d_q);
+            for (long j = 0; j < n; j += stride)
+                sample.insert(sample.end(), xt + j * d_q, xt + (j + 1) * d_q);
+            faiss::kmeans_clustering(d_q, sample.size() / d_q, 2, &sample[0], &cents[0]);
+        } else {
+            faiss::kmeans_clustering(d_q, n, 2, xt, &cents[0]);
+        }
+        vector<char> side(n);
+        long cnt[2] = { 0, 0 };
+        for (long j = 0; j < n; j++) {
+            float d0 = faiss::fvec_L2sqr(xt + j * d_q, &cents[0], d_q);
+            float d1 = faiss::fvec_L2sqr(xt + j * d_q, &cents[d_q], d_q);
+            side[j] = d1 < d0;
+            cnt[(int)side[j]]++;
+        }
+        if (cnt[0] == 0 || cnt[1] == 0)
+            continue; //degenerate (near-identical vectors), splitting gains nothing
+        // build both halves once; residual PQ codes are re-encoded against
+        // their new centroid, everything else moves verbatim
+        vector<faiss::Index::idx_t> half_ids[2];
+        vector<uint8_t> half_codes[2];
+        for (int s = 0; s < 2; s++) {
+            half_ids[s].reserve(cnt[s]);
+            half_codes[s].reserve(cnt[s] * cs);
+        }
+        vector<float> resid(d_q);
+        vector<uint8_t> code(cs);
+        for (long j = 0; j < n; j++) {
+            int s = (int)side[j];
+            half_ids[s].push_back(ail->ids[l][j]);
+            if (ivfpq != nullptr && ivfpq->by_residual) {
+                for (long c = 0; c < d_q; c++)
+                    resid[c] = xt[j * d_q + c] - cents[s * d_q + c];
+                ivfpq->pq.compute_code(&resid[0], &code[0]);
+                half_codes[s].insert(half_codes[s].end(), code.begin(), code.end());
+            } else {
+                const uint8_t* old = &ail->codes[l][j * cs];
+                half_codes[s].insert(half_codes[s].end(), old, old + cs);
+            }
+        }
+        // publish into an index tier: centroid A overwrites the hot list's,
+        // centroid B is appended as a fresh list
+        auto apply = [&](faiss::Index* root) {
+            faiss::IndexIVF* t = dynamic_cast<faiss::IndexIVF*>(innerIndex(root));
+            faiss::ArrayInvertedLists* tl = t == nullptr ? nullptr : dynamic_cast<faiss::ArrayInvertedLists*>(t->invlists);
+            faiss::IndexFlat* tq = t == nullptr ? nullptr : dynamic_cast<faiss::IndexFlat*>(t->quantizer);
+            if (tl == nullptr || tq == nullptr || (long)tl->ids[l].size() != n)
+                return false;
+            memcpy(&tq->xb[l * d_q], &cents[0], d_q * sizeof(float));
+            tq->add(1, &cents[d_q]);
+            tl->ids[l] = half_ids[0];
+            tl->codes[l] = half_codes[0];
+            tl->ids.push_back(half_ids[1]);
+            tl->codes.push_back(half_codes[1]);
+            tl->nlist++;
+            t->nlist++;
+            return true;
+        };
+        apply(state->index);
+        //replicas are identical clones, so the same split applies verbatim
+        for (faiss::Index* replica : state->index_replicas)
+            if (replica != nullptr)
+                apply(replica);
+        done++;
+        state->st_list_splits.fetch_add(1, memory_order_relaxed);
+        LOG(INFO) << "SplitHotLists " << work_dir << " split list " << l << " (" << n << " entries) into " << cnt[0] << "+" << cnt[1];
+    }
+    if (done > 0 && ivfpq != nullptr && ivfpq->use_precomputed_table) {
+        //the tables are keyed by coarse centroid, refresh them once per call
+        ivfpq->precompute_table();
+        for (faiss::Index* replica : state->index_replicas) {
+            faiss::IndexIVFPQ* rpq = replica == nullptr ? nullptr : dynamic_cast<faiss::IndexIVFPQ*>(innerIndex(replica));
+            if (rpq != nullptr && rpq->use_precomputed_table)
+                rpq->precompute_table();
+        }
+    }
+    return done;
+}
+
+long VectoDB::UpdateBase(long* patched)
+{
+    if (readonly) {
+        LOG(ERROR) << work_dir << " is opened readonly, rejecting UpdateBase; writes belong to the writer node";
+        return 0;
+    }
+    TraceScope trace{ "update_replay" };
+    mtxlock del{ state->m_del }; //a concurrent CompactBase would renumber the lines this replay patches
+    // flat open-addressing table keyed by line_num, linear probing. One heap
+    // allocation for the table and one growing arena replace the per-line
+    // node and vector allocations of the former std::map aggregation.
+    vector<UpdSlot> table;
+    vector<float> arena;
+    size_t mask = 0;
+    long played = 0;
+    {
+        mtxlock m{ state->m_update };
+        long file_recs = state->fs_update.tellp() / len_upd_line;
+        played = file_recs + state->upd_distinct;
+        if (played <= 0)
+            return played;
+
+        LOG(INFO) << "Loading " << played << " updates";
+        size_t cap = 64;
+        while (cap < (size_t)(2 * played))
+            cap <<= 1;
+        mask = cap - 1;
+        table.assign(cap, UpdSlot{ -1, 0, 0 });
+        // read and truncate update.fvecs; a merged record carries the raw
+        // updates it absorbed in the high bits of its heading long
+        vector<float> vec(dim);
+        vector<uint8_t> code(upd_sq8 ? 2 * sizeof(float) + dim : 0);
+        long word = 0;
+        state->fs_update.seekg(0, ios_base::beg);
+        for (long i = 0; i < file_recs; i++) {
+            state->fs_update.read((char*)&word, sizeof(long));
+            if (upd_sq8) {
+                state->fs_update.read((char*)&code[0], (long)code.size());
+                sq8_decode(&code[0], dim, &vec[0]);
+            } else
+                state->fs_update.read((char*)&vec[0], dim * sizeof(float));
+            long line_num = word & UPD_LINE_MASK;
+            long cnt = word >> UPD_LINE_BITS;
+            if (cnt == 0)
+                cnt = 1;
+            size_t h = updSlotOf(line_num, mask);
+            while (table[h].line_num != -1 && table[h].line_num != line_num)
+                h = (h + 1) & mask;
+            UpdSlot& slot = table[h];
+            if (slot.line_num == -1) {
+                slot.line_num = line_num;
+                slot.count = cnt;
+                slot.off = (long)arena.size();
+                arena.insert(arena.end(), vec.begin(), vec.end());
+            } else {
+                slot.count += cnt;
+                float* acc = &arena[slot.off];
+                for (int d = 0; d < dim; d++) {
+                    acc[d] += vec[d];
+                }
+            }
+        }
+        // drain the in-memory coalescing table into the same aggregation
+        for (const UpdSlot& ms : state->upd_table) {
+            if (ms.line_num == -1)
+                continue;
+            const float* v = &state->upd_arena[ms.off];
+            size_t h = updSlotOf(ms.line_num, mask);
+            while (table[h].line_num != -1 && table[h].line_num != ms.line_num)
+                h = (h + 1) & mask;
+            UpdSlot& slot = table[h];
+            if (slot.line_num == -1) {
+                slot.line_num = ms.line_num;
+                slot.count = ms.count;
+                slot.off = (long)arena.size();
+                arena.insert(arena.end(), v, v + dim);
+            } else {
+                slot.count += ms.count;
+                float* acc = &arena[slot.off];
+                for (int d = 0; d < dim; d++) {
+                    acc[d] += v[d];
+                }
+            }
+        }
+        vector<UpdSlot>().swap(state->upd_table);
+        vector<float>().swap(state->upd_arena);
+        state->upd_mask = 0;
+        state->upd_distinct = 0;
+        state->upd_mem_lines.store(0, std::memory_order_relaxed);
+        state->fs_update.close();
+        state->fs_update.open(getUpdateFp(), std::fstream::in | std::fstream::out | std::fstream::binary | std::fstream::trunc);
+        state->stat_upd_bytes.store(0, std::memory_order_relaxed);
+    }
+    // replay in line_num order
+    vector<UpdSlot*> updates;
+    for (auto& slot : table)
+        if (slot.line_num != -1)
+            updates.push_back(&slot);
+    std::sort(updates.begin(), updates.end(), [](const UpdSlot* a, const UpdSlot* b) { return a->line_num < b->line_num; });
+    LOG(INFO) << "Playing " << played << " updates";
+    // the replay has both versions of every updated line in hand; keep them
+    // so the live tiers can be patched in place below
+    vector<long> upd_lines;
+    vector<float> upd_old, upd_new;
+    upd_lines.reserve(updates.size());
+    {
+        const string& fp_counts = getCountsFp();
+        uint8_t* counts_data = nullptr;
+        long len_counts = 0;
+        mmapFile(fp_counts, counts_data, len_counts);
+        vector<SegMap> segs;
+        mapVecSegments(segs, false); //the replay gathers random lines
+        mtxlock m{ state->m_base2 };
+
+        // The updates are sorted by line_num, so contiguous lines coalesce
+        // into one large write per column instead of two tiny writes per line.
+        // The vector run holds raw base.vec lines, encoded in SQ8 mode, and
+        // additionally splits at segment boundaries; the sorted order keeps
+        // that to at most one segment-file reopen per segment.
+        std::fstream fs_vec2;
+        fs_vec2.exceptions(std::ios::failbit | std::ios::badbit);
+        long cur_seg = -1;
+        vector<float> vec(dim);
+        vector<float> cur(dim);
+        vector<long> run_counts;
+        vector<float> run_norms;
+        vector<uint8_t> run_lines;
+        long run_start = -1;
+        auto flushRun = [&]() {
+            if (run_start < 0)
+                return;
+            state->fs_counts2.seekp(run_start * (long)sizeof(long), ios_base::beg);
+            state->fs_counts2.write((const char*)&run_counts[0], run_counts.size() * sizeof(long));
+            if (metric_type == 1) {
+                state->fs_norms2.seekp(run_start * (long)sizeof(float), ios_base::beg);
+                state->fs_norms2.write((const char*)&run_norms[0], run_norms.size() * sizeof(float));
+            }
+            long nrun = (long)run_counts.size();
+            for (long done = 0; done < nrun;) {
+                long line = run_start + done;
+                long k = line / seg_lines;
+                long n = std::min(nrun - done, seg_lines - line % seg_lines);
+                if (k != cur_seg) {
+                    if (cur_seg >= 0) {
+                        fs_vec2.flush();
+                        fs_vec2.close();
+                    }
+                    fs_vec2.open(getVecSegFp(k), std::fstream::in | std::fstream::out | std::fstream::binary);
+                    cur_seg = k;
+                }
+                fs_vec2.seekp((line % seg_lines) * len_vec, ios_base::beg);
+                fs_vec2.write((const char*)&run_lines[done * len_vec], n * len_vec);
+                done += n;
+            }
+            run_counts.clear();
+            run_norms.clear();
+            run_lines.clear();
+            run_start = -1;
+        };
+        for (UpdSlot* update : updates) {
+            long line_num = update->line_num;
+            long curCnt = *(long*)(counts_data + line_num * sizeof(long));
+            update->count += curCnt;
+            //LOG(INFO) << "Playing update, line_num " << line_num << " updates";
+            const uint8_t* vec_line = segLine(segs, line_num);
+            const float* curVec = (const float*)vec_line;
+            if (sq8) {
+                sq8_decode(vec_line, dim, &cur[0]);
+                curVec = &cur[0];
+            } else if (binary) {
+                bin_decode(vec_line, dim, &cur[0]);
+                curVec = &cur[0];
+            }
+            const float* acc = &arena[update->off];
+            fvec_waccum_normalize(&vec[0], acc, curVec, (float)curCnt, dim);
+            upd_lines.push_back(line_num);
+            upd_old.insert(upd_old.end(), curVec, curVec + dim);
+            upd_new.insert(upd_new.end(), vec.begin(), vec.end());
+            if (run_start >= 0 && line_num != run_start + (long)run_counts.size())
+                flushRun();
+            if (run_start < 0)
+                run_start = line_num;
+            run_counts.push_back(update->count);
+            if (metric_type == 1)
+                run_norms.push_back(faiss::fvec_norm_L2sqr(&vec[0], dim));
+            size_t off = run_lines.size();
+            run_lines.resize(off + len_vec);
+            if (sq8)
+                sq8_encode(&vec[0], dim, &run_lines[off]);
+            else if (binary)
+                bin_encode(&vec[0], dim, &run_lines[off]);
+            else
+                memcpy(&run_lines[off], &vec[0], len_vec);
+        }
+        flushRun();
+        // The experiment indicates that the readers of mmaped file are not ware to following changes untill they be flushed.
+        // TODO: Is it possible that readers get the middle state of a change?
+        state->fs_counts2.flush();
+        if (metric_type == 1)
+            state->fs_norms2.flush();
+        if (cur_seg >= 0)
+            fs_vec2.flush();
+        munmapFile(fp_counts, counts_data, len_counts);
+        unmapVecSegments(segs);
+    }
+    {
+        wlock w{ state->rw_xids };
+        if (metric_type == 1) {
+            //the in-memory mirror must agree with the patched column
+            for (size_t i = 0; i < upd_lines.size(); i++)
+                state->base_norms[upd_lines[i]] = faiss::fvec_norm_L2sqr(&upd_new[i * dim], dim);
+        }
+        //the replication patch log ships these lines to standbys
+        state->repl_patched.insert(state->repl_patched.end(), upd_lines.begin(), upd_lines.end());
+    }
+    long failed = patchIndexTiers(upd_lines, upd_old, upd_new);
+    if (failed > 0)
+        LOG(INFO) << "UpdateBase " << work_dir << ": " << failed << " of " << upd_lines.size() << " updated lines not patchable in place, a rebuild is still due";
+    if (patched != nullptr)
+        *patched = failed == 0 ? 1 : 0;
+    LOG(INFO) << "Played " << played << " updates";
+    state->rcache_epoch.fetch_add(1, memory_order_release);
+    evtFlushAsync();
+    return played;
+}
+
+long VectoDB::CompactBase()
+{
+    if (readonly) {
+        LOG(ERROR) << work_dir << " is opened readonly, rejecting CompactBase; writes belong to the writer node";
+        return 0;
+    }
+    // the build flag doubles as the compaction lock: both walk the whole base
+    // and both end in an index swap, so they never overlap
+    bool expected = false;
+    if (!state->stat_building.compare_exchange_strong(expected, true, std::memory_order_relaxed)) {
+        LOG(INFO) << "CompactBase " << work_dir << " skipped, a build is in flight";
+        return 0;
+    }
+    mtxlock del{ state->m_del }; //freezes deletes, update replays and patch applies; the tombstone set cannot move under the copy
+    TraceScope trace{ "compact" };
+    long reclaimed = compactInner();
+    state->stat_building.store(false, std::memory_order_relaxed);
+    if (reclaimed > 0)
+        evtFlushAsync();
+    return reclaimed;
+}
+
+// The compaction itself: stream every column into .cpt temps with the dead
+// lines dropped (no locks, against bytes m_del keeps frozen), then a short
+// barrier freezes the writers, appends the lines added meanwhile, and swaps
+// the files. A marker recording the new segment and line counts makes the
+// multi-file swap crash-atomic — recoverCompact() replays or rolls it back on
+// the next open. The live tiers are remapped in place, inverted-list labels
+// rewritten and the flat memtable filtered, so serving quality never dips and
+// no rebuild is owed; the remapped index is persisted synchronously inside
+// the barrier because the old file on disk refers to the old numbering.
+// Compaction renumbers every line, so standbys following the tail/patch ship
+// must re-sync from a fresh snapshot afterwards. Returns the number of
+// reclaimed lines, 0 when nothing is tombstoned, -1 when a live tier cannot
+// be remapped in place (on-disk or mmapped inverted lists, an HNSW memtable);
+// a full BuildIndex makes the tiers remappable again.
+long VectoDB::compactInner()
+{
+    drainWal(); //the copy below reads the columns from disk
+    vector<char> dead; //tombstones in the old numbering; frozen while m_del is held
+    long nb0 = 0;
+    {
+        rlock r{ state->rw_xids };
+        nb0 = (long)state->xids.size();
+        dead.assign(state->dels.begin(), state->dels.end());
+    }
+    if ((long)dead.size() > nb0)
+        dead.resize(nb0);
+    long ndead = 0;
+    for (char d : dead)
+        ndead += d;
+    if (ndead == 0)
+        return 0;
+    // every live tier must be label-remappable in place, or serving would
+    // degrade the moment the lines shift
+    auto remappable = [](faiss::Index* idx) {
+        faiss::IndexIVF* ivf = dynamic_cast<faiss::IndexIVF*>(innerIndex(idx));
+        return ivf != nullptr && !ivf->maintain_direct_map
+            && dynamic_cast<faiss::ArrayInvertedLists*>(ivf->invlists) != nullptr;
+    };
+    {
+        rlock r{ state->rw_index };
+        if (state->ids32_active.load(memory_order_relaxed)) {
+            //the remap rewrites the per-list ids, which ids32=1 freed, and the
+            //compact table keeps the old numbering; neither survives a renumber
+            LOG(WARNING) << "CompactBase " << work_dir << ": ids32=1 freed the per-list ids the remap rewrites, compaction needs ids32=0";
+            return -1;
+        }
+        if (state->index != nullptr && !remappable(state->index)) {
+            LOG(WARNING) << "CompactBase " << work_dir << ": the index has no in-memory inverted lists to remap, run a full BuildIndex first";
+            return -1;
+        }
+        for (faiss::Index* delta : state->delta_indexes) {
+            if (!remappable(delta)) {
+                LOG(WARNING) << "CompactBase " << work_dir << ": a delta index has no in-memory inverted lists to remap, run a full BuildIndex first";
+                return -1;
+            }
+        }
+    }
+    {
+        rlock r{ state->rw_flat };
+        if (dynamic_cast<faiss::IndexFlat*>(state->flat) == nullptr
+            && dynamic_cast<IndexFlat16*>(state->flat) == nullptr
+            && dynamic_cast<IndexFlatSQ8*>(state->flat) == nullptr
+            && dynamic_cast<IndexFlatBlk*>(state->flat) == nullptr) {
+            LOG(WARNING) << "CompactBase " << work_dir << ": memtable " << memtable_key << " cannot drop rows in place, run a full BuildIndex first";
+            return -1;
+        }
+    }
+    // prefix of dead lines before each line; uint32 is plenty per line even
+    // on a base of hundreds of millions
+    vector<uint32_t> dead_before(nb0 + 1, 0);
+    for (long i = 0; i < nb0; i++)
+        dead_before[i + 1] = dead_before[i] + (dead[i] ? 1 : 0);
+    auto newNum = [&](long line) {
+        return line < nb0 ? line - (long)dead_before[line] : line - ndead;
+    };
+    LOG(INFO) << "CompactBase " << work_dir << ": dropping " << ndead << " of " << nb0 << " lines";
+
+    // ---- bulk copy: live lines stream into the temps while adds and
+    // searches proceed. m_del keeps the copied bytes frozen (only deletes,
+    // replays and patches rewrite lines in place), so no catch-up pass for
+    // the prefix is needed, only for the appended tail.
+    {
+        vector<SegMap> segs;
+        mapVecSegments(segs, true);
+        std::ofstream fs_out;
+        fs_out.exceptions(std::ios::failbit | std::ios::badbit);
+        long cur_out = -1;
+        long i = 0;
+        while (i < nb0) {
+            if (dead[i]) {
+                i++;
+                continue;
+            }
+            long p = i - (long)dead_before[i];
+            // a run ends at the first dead line or at either segment boundary
+            long e = std::min(nb0, (i / seg_lines + 1) * seg_lines);
+            e = std::min(e, i + ((p / seg_lines + 1) * seg_lines - p));
+            for (long j = i + 1; j < e; j++)
+                if (dead[j]) {
+                    e = j;
+                    break;
+                }
+            if (p / seg_lines != cur_out) {
+                if (cur_out >= 0)
+                    fs_out.close();
+                fs_out.open(getVecSegFp(p / seg_lines) + ".cpt", std::ofstream::binary | std::ofstream::trunc);
+                cur_out = p / seg_lines;
+            }
+            fs_out.write((const char*)segs[i / seg_lines].data + (i % seg_lines) * len_vec, (e - i) * len_vec);
+            i = e;
+        }
+        if (cur_out >= 0)
+            fs_out.close();
+        unmapVecSegments(segs);
+        //the scalar columns take one chunked filter pass each
+        auto filterColumn = [&](const string& fp, long elem) {
+            ifstream in(fp, std::ifstream::binary);
+            ofstream out(fp + ".cpt", std::ofstream::binary | std::ofstream::trunc);
+            const long chunk = 1L << 20; //lines per pass
+            vector<char> src(chunk * elem), dst(chunk * elem);
+            for (long s = 0; s < nb0; s += chunk) {
+                long n = std::min(chunk, nb0 - s);
+                in.read(&src[0], n * elem);
+                long w = 0;
+                for (long j = 0; j < n; j++) {
+                    if (dead[s + j])
+                        continue;
+                    memcpy(&dst[w * elem], &src[j * elem], elem);
+                    w++;
+                }
+                out.write(&dst[0], w * elem);
+            }
+        };
+        filterColumn(getXidsFp(), (long)sizeof(long));
+        filterColumn(getCountsFp(), (long)sizeof(long));
+        if (ttl_sec > 0)
+            filterColumn(getTimesFp(), (long)sizeof(uint32_t));
+        if (metric_type == 1)
+            filterColumn(getNormsFp(), (long)sizeof(float));
+    }
+
+    // ---- barrier: freeze every writer, append the tail the copy missed,
+    // swap the files and renumber the in-memory world. The order matches the
+    // nesting the other paths use: rw_compact and m_wal outermost (adders),
+    // m_base (wal/activation), m_update, then the reader locks, m_base2 last.
+    {
+        wlock g{ state->rw_compact };
+        mtxlock wl{ state->m_wal };
+        state->cv_durable.wait(wl, [this] { return state->wal_seq_durable >= state->wal_seq_enq; });
+        mtxlock mb{ state->m_base };
+        if (state->persist_thread.joinable())
+            state->persist_thread.join(); //it renames index files this barrier also rewrites
+        mtxlock mu{ state->m_update };
+        wlock wi{ state->rw_index };
+        wlock wf{ state->rw_flat };
+        wlock wd{ state->rw_data };
+        wlock wx{ state->rw_xids };
+        mtxlock m2{ state->m_base2 };
+        // an index activated during the copy could be of another type
+        if (state->index != nullptr && !remappable(state->index)) {
+            for (long k = 0; fs::exists(getVecSegFp(k) + ".cpt"); k++)
+                fs::remove(getVecSegFp(k) + ".cpt");
+            for (const string& fp : { getXidsFp(), getCountsFp(), getTimesFp(), getNormsFp() })
+                fs::remove(fp + ".cpt");
+            LOG(WARNING) << "CompactBase " << work_dir << ": the index activated during the copy is not remappable, run a full BuildIndex first";
+            return -1;
+        }
+        long nb_now = (long)state->xids.size();
+        long new_nb = nb_now - ndead;
+        if (nb_now > nb0) {
+            //lines appended since the copy are all live, shift them wholesale
+            std::ifstream fs_in;
+            fs_in.exceptions(std::ios::failbit | std::ios::badbit);
+            std::ofstream fs_out;
+            fs_out.exceptions(std::ios::failbit | std::ios::badbit);
+            long cur_in = -1, cur_out = -1;
+            vector<char> buf;
+            long i = nb0;
+            while (i < nb_now) {
+                long p = i - ndead;
+                long e = std::min(nb_now, (i / seg_lines + 1) * seg_lines);
+                e = std::min(e, i + ((p / seg_lines + 1) * seg_lines - p));
+                if (i / seg_lines != cur_in) {
+                    if (cur_in >= 0)
+                        fs_in.close();
+                    fs_in.open(getVecSegFp(i / seg_lines), std::ifstream::binary);
+                    cur_in = i / seg_lines;
+                }
+                if (p / seg_lines != cur_out) {
+                    if (cur_out >= 0)
+                        fs_out.close();
+                    //the boundary temp is appended, fresh ones are created
+                    fs_out.open(getVecSegFp(p / seg_lines) + ".cpt", std::ofstream::binary | std::ofstream::app);
+                    cur_out = p / seg_lines;
+                }
+                buf.resize((e - i) * len_vec);
+                fs_in.seekg((i % seg_lines) * len_vec, ios_base::beg);
+                fs_in.read(&buf[0], (e - i) * len_vec);
+                fs_out.write(&buf[0], (e - i) * len_vec);
+                i = e;
+            }
+            if (cur_in >= 0)
+                fs_in.close();
+            if (cur_out >= 0)
+                fs_out.close();
+            {
+                ofstream out(getXidsFp() + ".cpt", std::ofstream::binary | std::ofstream::app);
+                out.write((const char*)&state->xids[nb0], (nb_now - nb0) * sizeof(long));
+            }
+            {
+                vector<long> counts(nb_now - nb0);
+                ifstream in(getCountsFp(), std::ifstream::binary);
+                in.seekg(nb0 * sizeof(long), ios_base::beg);
+                in.read((char*)&counts[0], (nb_now - nb0) * sizeof(long));
+                ofstream out(getCountsFp() + ".cpt", std::ofstream::binary | std::ofstream::app);
+                out.write((const char*)&counts[0], (nb_now - nb0) * sizeof(long));
+            }
+            if (ttl_sec > 0) {
+                ofstream out(getTimesFp() + ".cpt", std::ofstream::binary | std::ofstream::app);
+                out.write((const char*)&state->times[nb0], (nb_now - nb0) * sizeof(uint32_t));
+            }
+            if (metric_type == 1) {
+                ofstream out(getNormsFp() + ".cpt", std::ofstream::binary | std::ofstream::app);
+                out.write((const char*)&state->base_norms[nb0], (nb_now - nb0) * sizeof(float));
+            }
+        }
+        // the update backlog is keyed by line number; rewrite it in the new
+        // numbering, records of dead lines retire here
+        updSpillLocked();
+        {
+            long nrec = (long)state->fs_update.tellp() / len_upd_line;
+            vector<char> recs((size_t)nrec * len_upd_line);
+            if (nrec > 0) {
+                state->fs_update.seekg(0, ios_base::beg);
+                state->fs_update.read(&recs[0], nrec * len_upd_line);
+            }
+            long w = 0;
+            for (long r = 0; r < nrec; r++) {
+                char* rec = &recs[r * len_upd_line];
+                long word = *(long*)rec;
+                long line = word & UPD_LINE_MASK;
+                if (line < nb0 && dead[line])
+                    continue;
+                *(long*)rec = (word & ~UPD_LINE_MASK) | newNum(line);
+                if (w != r)
+                    memmove(&recs[w * len_upd_line], rec, len_upd_line);
+                w++;
+            }
+            state->fs_update.close();
+            state->fs_update.open(getUpdateFp(), std::fstream::in | std::fstream::out | std::fstream::binary | std::fstream::trunc);
+            if (w > 0)
+                state->fs_update.write(&recs[0], w * len_upd_line);
+            state->fs_update.flush();
+            state->stat_upd_bytes.store(w * len_upd_line, std::memory_order_relaxed);
+        }
+        // commit point: the marker makes the multi-file swap crash-atomic
+        long new_nsegs = new_nb == 0 ? 0 : (new_nb - 1) / seg_lines + 1;
+        close(state->fd_xids);
+        close(state->fd_counts);
+        if (state->fd_times >= 0)
+            close(state->fd_times);
+        if (state->fd_norms >= 0)
+            close(state->fd_norms);
+        close(state->fd_vec);
+        state->fs_counts2.close();
+        if (metric_type == 1)
+            state->fs_norms2.close();
+        state->fs_dels2.close();
+        {
+            long hdr[2] = { new_nsegs, new_nb };
+            const string fp_tmp = getCompactFp() + ".tmp";
+            {
+                ofstream fs(fp_tmp, std::ofstream::binary | std::ofstream::trunc);
+                fs.write((const char*)hdr, sizeof(hdr));
+            }
+            fs::rename(fp_tmp, getCompactFp());
+        }
+        for (long k = 0; k < new_nsegs; k++)
+            fs::rename(getVecSegFp(k) + ".cpt", getVecSegFp(k));
+        for (long k = new_nsegs; fs::exists(getVecSegFp(k)); k++)
+            fs::remove(getVecSegFp(k));
+        fs::rename(getXidsFp() + ".cpt", getXidsFp());
+        fs::rename(getCountsFp() + ".cpt", getCountsFp());
+        if (ttl_sec > 0)
+            fs::rename(getTimesFp() + ".cpt", getTimesFp());
+        if (metric_type == 1)
+            fs::rename(getNormsFp() + ".cpt", getNormsFp());
+        fs::remove(getDelsFp());
+        // renumber the in-memory mirrors
+        {
+            vector<long> xids2(new_nb);
+            vector<uint32_t> times2(ttl_sec > 0 ? new_nb : 0);
+            vector<float> norms2(metric_type == 1 ? new_nb : 0);
+            for (long l = 0; l < nb_now; l++) {
+                if (l < nb0 && dead[l])
+                    continue;
+                long p = newNum(l);
+                xids2[p] = state->xids[l];
+                if (ttl_sec > 0)
+                    times2[p] = state->times[l];
+                if (metric_type == 1)
+                    norms2[p] = state->base_norms[l];
+            }
+            state->xids.assign(new_nb > 0 ? &xids2[0] : nullptr, new_nb);
+            state->times = std::move(times2);
+            state->base_norms = std::move(norms2);
+        }
+        state->sweep_cursor = newNum(std::min(state->sweep_cursor, nb0));
+        state->dels.clear();
+        state->stat_dels.store(0, std::memory_order_relaxed);
+        state->repl_deleted.clear();
+        {
+            size_t w = 0;
+            for (long line : state->repl_patched) {
+                if (line < nb0 && dead[line])
+                    continue;
+                state->repl_patched[w++] = newNum(line);
+            }
+            state->repl_patched.resize(w);
+        }
+        {
+            bool ident = true;
+            for (long l = 0; l < new_nb; l++)
+                if (state->xids[l] != l) {
+                    ident = false;
+                    break;
+                }
+            state->xids_identity.store(ident, std::memory_order_relaxed);
+        }
+#pragma omp parallel for
+        for (int s = 0; s < XID_NSHARD; s++) {
+            XidShard& shard = state->xid_shards[s];
+            wlock w{ shard.rw };
+            shard.xid2num.clear();
+            for (long l = 0; l < new_nb; l++)
+                if (xidShardOf(state->xids[l]) == s)
+                    shard.xid2num[state->xids[l]] = l;
+        }
+        // reopen the write handles over the swapped files and remap the
+        // segments; the rw_data write lock is held, so remapBase() (which
+        // takes it itself) is inlined here
+        state->total.store(new_nb, std::memory_order_relaxed);
+        state->vec_nsegs = std::max(1L, new_nsegs);
+        const string& fp_tail = getVecSegFp(state->vec_nsegs - 1);
+        state->vec_tail_lines = fs::exists(fp_tail) ? (long)fs::file_size(fp_tail) / len_vec : 0;
+        state->fd_xids = openAppendFd(getXidsFp());
+        state->fd_counts = openAppendFd(getCountsFp());
+        if (ttl_sec > 0)
+            state->fd_times = openAppendFd(getTimesFp());
+        if (metric_type == 1)
+            state->fd_norms = openAppendFd(getNormsFp());
+        state->fd_vec = openAppendFd(fp_tail);
+        state->fs_counts2.open(getCountsFp(), std::fstream::in | std::fstream::out | std::fstream::binary);
+        if (metric_type == 1)
+            state->fs_norms2.open(getNormsFp(), std::fstream::in | std::fstream::out | std::fstream::binary);
+        state->fs_dels2.open(getDelsFp(), std::fstream::out | std::fstream::app);
+        state->fs_dels2.close();
+        state->fs_dels2.open(getDelsFp(), std::fstream::in | std::fstream::out | std::fstream::binary);
+        unmapVecSegments(state->seg_maps);
+        state->seg_maps.clear();
+        state->seg_heat.clear();
+        for (long k = 0; k < state->vec_nsegs; k++) {
+            state->seg_maps.push_back(SegMap{ nullptr, 0 });
+            state->seg_heat.emplace_back();
+            const string& fp = getVecSegFp(k);
+            long len_f = fs::exists(fp) ? (long)fs::file_size(fp) : 0;
+            if (len_f > 0) {
+                SegMap& seg = state->seg_maps[k];
+                mmapFile(fp, seg.data, seg.len);
+                applyMappingOptions(seg.data, seg.len, mlock_bytes - k * seg_lines * len_vec);
+            }
+        }
+        if (state->prefaulted_lines > new_nb)
+            state->prefaulted_lines = new_nb;
+        // flat memtable: drop the dead rows of the tail in place
+        {
+            long flat_start = state->flat_start_num;
+            long nrows = state->flat->ntotal;
+            faiss::IndexFlat* f = dynamic_cast<faiss::IndexFlat*>(state->flat);
+            IndexFlat16* f16 = dynamic_cast<IndexFlat16*>(state->flat);
+            IndexFlatSQ8* f8 = dynamic_cast<IndexFlatSQ8*>(state->flat);
+            IndexFlatBlk* fb = dynamic_cast<IndexFlatBlk*>(state->flat);
+            long sig_words = lsh_bits / 64;
+            vector<float> blk_row(fb != nullptr ? dim : 0);
+            long w = 0;
+            for (long row = 0; row < nrows; row++) {
+                long line = flat_start + row;
+                if (line < nb0 && dead[line])
+                    continue;
+                if (w != row) {
+                    if (f != nullptr)
+                        memmove(&f->xb[w * dim], &f->xb[row * dim], dim * sizeof(float));
+                    else if (f16 != nullptr)
+                        memmove(&f16->xb16[w * dim], &f16->xb16[row * dim], dim * sizeof(uint16_t));
+                    else if (f8 != nullptr)
+                        memmove(&f8->xb8[w * f8->len_line], &f8->xb8[row * f8->len_line], f8->len_line);
+                    else if (fb != nullptr) {
+                        //rows cross block boundaries, so the move is a gather+scatter
+                        fb->getRow(row, &blk_row[0]);
+                        fb->putRow(w, &blk_row[0]);
+                    }
+                    if (lsh_bits > 0)
+                        memmove(&state->flat_sigs[w * sig_words], &state->flat_sigs[row * sig_words], sig_words * sizeof(uint64_t));
+                    if (metric_type == 1)
+                        state->flat_norms[w] = state->flat_norms[row];
+                }
+                w++;
+            }
+            if (f != nullptr)
+                f->xb.resize(w * dim);
+            else if (f16 != nullptr)
+                f16->xb16.resize(w * dim);
+            else if (f8 != nullptr)
+                f8->xb8.resize(w * f8->len_line);
+            else if (fb != nullptr)
+                fb->xbb.resize(((w + IndexFlatBlk::BLK - 1) / IndexFlatBlk::BLK) * IndexFlatBlk::BLK * dim);
+            if (lsh_bits > 0)
+                state->flat_sigs.resize(w * sig_words);
+            if (metric_type == 1)
+                state->flat_norms.resize(w);
+            state->flat->ntotal = w;
+            state->flat_start_num = newNum(flat_start);
+            state->stat_flat.store(w, std::memory_order_relaxed);
+        }
+        // index tiers: rewrite the inverted-list labels to the new numbering,
+        // entries of dead lines retire with their codes
+        auto remapIvf = [&](faiss::Index* idx, long off_old, long off_new) {
+            faiss::IndexIVF* ivf = dynamic_cast<faiss::IndexIVF*>(innerIndex(idx));
+            faiss::ArrayInvertedLists* ail = dynamic_cast<faiss::ArrayInvertedLists*>(ivf->invlists);
+            const size_t cs = ail->code_size;
+            long removed = 0;
+            for (size_t l = 0; l < ail->ids.size(); l++) {
+                auto& ids = ail->ids[l];
+                auto& codes = ail->codes[l];
+                size_t w = 0;
+                for (size_t o = 0; o < ids.size(); o++) {
+                    long line = (long)ids[o] + off_old;
+                    if (line < nb0 && dead[line]) {
+                        removed++;
+                        continue;
+                    }
+                    ids[w] = newNum(line) - off_new;
+                    if (w != o)
+                        memmove(&codes[w * cs], &codes[o * cs], cs);
+                    w++;
+                }
+                ids.resize(w);
+                codes.resize(w * cs);
+            }
+            ivf->ntotal -= removed;
+            if (idx != static_cast<faiss::Index*>(ivf))
+                idx->ntotal = ivf->ntotal;
+        };
+        if (state->index != nullptr) {
+            remapIvf(state->index, 0, 0);
+            for (faiss::Index* replica : state->index_replicas)
+                if (replica != nullptr)
+                    remapIvf(replica, 0, 0);
+            state->stat_nsize.store(state->index->ntotal, std::memory_order_relaxed);
+        }
+        for (size_t di = 0; di < state->delta_indexes.size(); di++) {
+            long start = state->delta_starts[di];
+            long new_start = newNum(start);
+            remapIvf(state->delta_indexes[di], start, new_start);
+            state->delta_starts[di] = new_start;
+        }
+        // persist the remapped index and the manifest before the marker
+        // retires; a crash with the marker present clears the index instead
+        if (state->index != nullptr && state->ntrain > 0) {
+            const string fp_index = getIndexFp(state->ntrain);
+            const string fp_tmp = fp_index + ".tmp";
+            if (mmap_index)
+                faiss::write_index_mmap(state->index, fp_tmp.c_str());
+            else
+                faiss::write_index(state->index, fp_tmp.c_str());
+            rotateIndexFiles();
+            fs::rename(fp_tmp, fp_index);
+            writeManifest(state->ntrain, new_nb);
+            clearIndexFiles(fp_index);
+        } else {
+            clearIndexFiles("");
+            writeManifest(0, new_nb);
+        }
+        fs::remove(getCompactFp());
+        state->compact_epoch.fetch_add(1, std::memory_order_release);
+        state->rcache_epoch.fetch_add(1, memory_order_release);
+        LOG(INFO) << "CompactBase " << work_dir << " done: " << nb_now << " -> " << new_nb << " lines";
+    }
+    return ndead;
+}
+
+//FNV-1a over the query bytes. 0 is reserved for empty cache slots.
+static inline unsigned long hashQueryVec(const float* q, long dim)
+{
+    const uint8_t* p = (const uint8_t*)q;
+    unsigned long h = 1469598103934665603UL;
+    for (long i = 0; i < dim * (long)sizeof(float); i++) {
+        h ^= p[i];
+        h *= 1099511628211UL;
+    }
+    return h == 0 ? 1 : h;
+}
+
+long VectoDB::Search(long nq, const float* xq, float* distances, long* xids)
+{
+    if (cache_cap <= 0)
+        return searchUncached(nq, xq, distances, xids);
+
+    // The epoch is captured before the miss search, so an entry stored below
+    // can never claim freshness past a write that raced with the search.
+    long epoch = state->rcache_epoch.load(memory_order_acquire);
+    const unsigned long mask = (unsigned long)(cache_cap - 1);
+    vector<long> miss;
+    for (long i = 0; i < nq; i++) {
+        unsigned long h = hashQueryVec(xq + i * dim, dim);
+        long slot = (long)(h & mask);
+        mtxlock lk{ state->m_rcache[slot % RCACHE_NSHARD] };
+        RCacheEntry& e = state->rcache[slot];
+        if (e.hash == h && e.epoch == epoch
+            && 0 == memcmp(&e.vec[0], xq + i * dim, dim * sizeof(float))) {
+            distances[i] = e.dis;
+            xids[i] = e.xid;
+            state->st_cache_hits.fetch_add(1, memory_order_relaxed);
+        } else {
+            miss.push_back(i);
+        }
+    }
+    state->st_cache_lookups.fetch_add(nq, memory_order_relaxed);
+    if (miss.empty())
+        return state->total;
+
+    long nm = (long)miss.size();
+    vector<float> xqm(nm * dim);
+    vector<float> Dm(nm);
+    vector<long> Im(nm);
+    for (long j = 0; j < nm; j++)
+        memcpy(&xqm[j * dim], xq + miss[j] * dim, dim * sizeof(float));
+    long total = searchUncached(nm, &xqm[0], &Dm[0], &Im[0]);
+    for (long j = 0; j < nm; j++) {
+        long i = miss[j];
+        xids[i] = Im[j];
+        if (total <= 0)
+            continue; //an empty database computed nothing worth caching
+        distances[i] = Dm[j];
+        unsigned long h = hashQueryVec(xq + i * dim, dim);
+        long slot = (long)(h & mask);
+        mtxlock lk{ state->m_rcache[slot % RCACHE_NSHARD] };
+        RCacheEntry& e = state->rcache[slot];
+        e.hash = h;
+        e.epoch = epoch;
+        e.dis = Dm[j];
+        e.xid = Im[j];
+        e.vec.assign(xq + i * dim, xq + (i + 1) * dim);
+    }
+    return total;
+}
+
+long VectoDB::MultiSearch(long nvdb, VectoDB* const* vdbs, long nq, const float* xq, float* distances, long* xids)
+{
+    for (long i = 0; i < nq; i++)
+        xids[i] = long(-1);
+    int mt = 0;
+    bool have = false;
+    for (long s = 0; s < nvdb && !have; s++)
+        if (vdbs[s] != nullptr) {
+            mt = vdbs[s]->metric_type;
+            have = true;
+        }
+    if (!have || nq <= 0)
+        return 0;
+    // Shards run concurrently on plain threads; each shard's own search
+    // sizes its OpenMP team through the governor, so the fan-out adds
+    // parallelism across shards without oversubscribing the token budget.
+    vector<float> Dall((size_t)nvdb * nq);
+    vector<long> Iall((size_t)nvdb * nq);
+    vector<long> totals(nvdb, 0);
+    std::atomic<long> next{ 0 };
+    long nworkers = std::min(nvdb, effectiveNumProcs());
+    vector<std::thread> pool;
+    pool.reserve(nworkers);
+    for (long w = 0; w < nworkers; w++)
+        pool.emplace_back([&] {
+            for (;;) {
+                long s = next.fetch_add(1, memory_order_relaxed);
+                if (s >= nvdb)
+                    return;
+                if (vdbs[s] == nullptr)
+                    continue;
+                totals[s] = vdbs[s]->Search(nq, xq, &Dall[s * nq], &Iall[s * nq]);
+            }
+        });
+    for (std::thread& t : pool)
+        t.join();
+    // per-query winner across shards, the same merge the Go wrapper ran
+    long total = 0;
+    for (long s = 0; s < nvdb; s++) {
+        if (vdbs[s] == nullptr)
+            continue;
+        total += totals[s];
+        if (totals[s] <= 0)
+            continue;
+        for (long i = 0; i < nq; i++) {
+            long xid = Iall[s * nq + i];
+            if (xid == long(-1))
+                continue;
+            if (xids[i] == long(-1) || CompareDistance(mt, Dall[s * nq + i], distances[i])) {
+                distances[i] = Dall[s * nq + i];
+                xids[i] = xid;
+            }
+        }
+    }
+    return total;
+}
+
+long VectoDB::searchUncached(long nq, const float* xq, float* distances, long* xids)
+{
+    if (coalesce_us <= 0)
+        return SearchKnn(nq, 1, xq, distances, xids);
+
+    SearchReq req{ nq, xq, distances, xids, false, 0 };
+    mtxlock lk{ state->m_coal };
+    state->coal_queue.push_back(&req);
+    if (state->coal_leader_active) {
+        // a leader is already collecting; wait for it to serve this request
+        state->cv_coal.wait(lk, [&req] { return req.done; });
+        return req.total;
+    }
+    state->coal_leader_active = true;
+    lk.unlock();
+    std::this_thread::sleep_for(std::chrono::microseconds(coalesce_us));
+    lk.lock();
+    vector<SearchReq*> batch;
+    batch.swap(state->coal_queue);
+    state->coal_leader_active = false;
+    noteCoalDepth((long)batch.size());
+    lk.unlock();
+
+    long nq2 = 0;
+    for (SearchReq* r : batch)
+        nq2 += r->nq;
+    // Single-flight collapse: upstream retries and fan-in put the same query
+    // vector in flight several times at peak, and the coalesce window is
+    // exactly where those duplicates meet. Identical vectors (hash, then
+    // exact compare) take one slot of the merged batch and share that slot's
+    // result.
+    vector<float> xq2;
+    xq2.reserve(nq2 * dim);
+    vector<long> slot_of(nq2); //flattened (request, row) -> unique slot
+    unordered_map<unsigned long, vector<long>> slots; //query hash -> unique slots
+    long flat = 0, nu = 0;
+    for (SearchReq* r : batch) {
+        for (long i = 0; i < r->nq; i++, flat++) {
+            const float* q = r->xq + i * dim;
+            unsigned long h = hashQueryVec(q, dim);
+            long slot = -1;
+            for (long s : slots[h])
+                if (0 == memcmp(&xq2[s * dim], q, dim * sizeof(float))) {
+                    slot = s;
+                    break;
+                }
+            if (slot < 0) {
+                slot = nu++;
+                xq2.insert(xq2.end(), q, q + dim);
+                slots[h].push_back(slot);
+            }
+            slot_of[flat] = slot;
+        }
+    }
+    vector<float> D2(nu);
+    vector<long> I2(nu);
+    long total = SearchKnn(nu, 1, &xq2[0], &D2[0], &I2[0]);
+    flat = 0;
+    lk.lock();
+    for (SearchReq* r : batch) {
+        for (long i = 0; i < r->nq; i++, flat++) {
+            r->distances[i] = D2[slot_of[flat]];
+            r->xids[i] = I2[slot_of[flat]];
+        }
+        r->total = total;
+        r->done = true;
+    }
+    lk.unlock();
+    state->cv_coal.notify_all();
+    return total;
+}
+
+long VectoDB::SearchKnn(long nq, long k, const float* xq, float* distances, long* xids)
+{
+    return searchKnnFiltered(nq, k, xq, nullptr, distances, xids);
+}
+
+long VectoDB::SearchKnnFiltered(long nq, long k, const float* xq, long n_allowed, const long* allowed_xids, float* distances, long* xids)
+{
+    unordered_set<long> allowed(allowed_xids, allowed_xids + n_allowed);
+    return searchKnnFiltered(nq, k, xq, &allowed, distances, xids);
+}
+
+long VectoDB::SearchKnnWithParams(long nq, long k, const float* xq, const char* params, float* distances, long* xids)
+{
+    string p(params == nullptr ? "" : params);
+    string np_s = stripParam(p, "nprobe");
+    long np = np_s.empty() ? 0 : strtol(np_s.c_str(), nullptr, 10);
+    if (!p.empty())
+        LOG(WARNING) << "SearchKnnWithParams: per-search params \"" << p << "\" not supported, only nprobe can be overridden per call";
+    return searchKnnFiltered(nq, k, xq, nullptr, distances, xids, np);
+}
+
+long VectoDB::SearchDeadline(long nq, const float* xq, long deadline_unix_us, float* distances, long* xids, long* partial)
+{
+    long deadline_us = 0;
+    if (deadline_unix_us > 0) {
+        // Rebase the wall-clock deadline onto the monotonic clock once at
+        // entry; the per-stage checks then never see wall-clock steps.
+        long wall_now_us = (long)chrono::duration_cast<chrono::microseconds>(chrono::system_clock::now().time_since_epoch()).count();
+        long left_us = deadline_unix_us - wall_now_us;
+        if (left_us <= 0) {
+            // already over budget: answer nothing rather than start a scan
+            for (long i = 0; i < nq; i++)
+                xids[i] = long(-1);
+            if (partial != nullptr)
+                *partial = 1;
+            return state->total;
+        }
+        deadline_us = monoNowUs() + left_us;
+    }
+    bool part = false;
+    long total = searchKnnFiltered(nq, 1, xq, nullptr, distances, xids, 0, deadline_us, &part);
+    if (partial != nullptr)
+        *partial = part ? 1 : 0;
+    return total;
+}
+
+//RAII around one searchKnnFiltered call: an interactive call registers
+//itself for the duration, a batch slice first waits until no interactive
+//call is registered. Batch work therefore yields at slice boundaries
+//instead of holding the cores for a whole backfill block.
+struct PrioGuard {
+    DbState* st;
+    bool batch;
+    PrioGuard(DbState* st, bool batch)
+        : st(st)
+        , batch(batch)
+    {
+        if (batch) {
+            mtxlock lk{ st->m_prio };
+            st->cv_prio.wait(lk, [this] { return this->st->inter_inflight.load(memory_order_relaxed) == 0; });
+        } else {
+            st->inter_inflight.fetch_add(1, memory_order_relaxed);
+        }
+    }
+    ~PrioGuard()
+    {
+        if (!batch && 1 == st->inter_inflight.fetch_sub(1, memory_order_relaxed)) {
+            mtxlock lk{ st->m_prio };
+            st->cv_prio.notify_all();
+        }
+    }
+};
+
+long VectoDB::SearchKnnBatch(long nq, long k, const float* xq, float* distances, long* xids)
+{
+    long total = 0;
+    for (long s = 0; s < nq; s += BATCH_SLICE_NQ) {
+        long n = std::min(BATCH_SLICE_NQ, nq - s);
+        total = searchKnnFiltered(n, k, xq + s * dim, nullptr, distances + s * k, xids + s * k, 0, 0, nullptr, true);
+    }
+    return total;
+}
+
+long VectoDB::searchKnnFiltered(long nq, long k, const float* xq, const std::unordered_set<long>* allowed, float* distances, long* xids, long nprobe_override, long deadline_us, bool* partial, bool batch)
+{
+    for (long i = 0; i < nq * k; i++) {
+        xids[i] = long(-1);
+    }
+    PrioGuard prio{ state.get(), batch };
+    long total = state->total;
+    if (total <= 0)
+        return total;
+    // slow-query log: wall clock and fault counters are sampled at entry so
+    // a call over the threshold can record its breakdown at the end
+    const bool slowlog = slowlog_us > 0;
+    long wall0 = 0;
+    struct rusage ru0;
+    if (slowlog) {
+        wall0 = monoNowUs();
+        getrusage(RUSAGE_SELF, &ru0);
+    }
+    // Overload shedding: past coalescer-depth thresholds interactive queries
+    // run with nprobe halved per level and the refine capped at its shallow
+    // prefix — slightly lower recall at bounded latency instead of a timeout
+    // cascade. Batch queries already yield to interactive ones and keep
+    // full quality.
+    const int shed = batch ? 0 : state->shed_level.load(memory_order_relaxed);
+    if (shed > 0)
+        state->st_shed_nq.fetch_add(nq, memory_order_relaxed);
+    // Deadline check shared by the stages (the flat scan polls it from its
+    // own thread). Once over, the remaining stage work is skipped and the
+    // merge answers from whatever candidates the finished stages collected.
+    std::atomic<bool> expired{ false };
+    auto overDeadline = [&]() -> bool {
+        if (deadline_us == 0)
+            return false;
+        if (expired.load(memory_order_relaxed))
+            return true;
+        if (monoNowUs() >= deadline_us) {
+            expired.store(true, memory_order_relaxed);
+            return true;
+        }
+        return false;
+    };
+    // Number of candidates per query. The index search is approximate so
+    // over-fetching then refining keeps recall high even for small k.
+    // Filtered searches over-fetch harder since candidates may be discarded.
+    const long kc = std::max(k, 100L) * (allowed != nullptr ? 4 : 1);
+    vector<float>& D = search_scratch.D;
+    vector<faiss::Index::idx_t>& I = search_scratch.I;
+    vector<vector<pair<float, long>>>& results = search_scratch.results;
+    D.resize(nq * kc);
+    I.resize(nq * kc);
+    if ((long)results.size() < nq)
+        results.resize(nq);
+    // per-query candidates as (distance, line_num) pairs.
+    // Reserved up front so the parallel refine loop never allocates.
+    for (long i = 0; i < nq; i++) {
+        results[i].clear();
+        results[i].reserve(2 * kc);
+    }
+
+    // query norms once per batch: with the base norms cached, every exact L2
+    // below reduces to ||x||^2 + ||q||^2 - 2<x,q>, the same inner-product
+    // path the IP deployments take
+    vector<float> qnorms;
+    if (metric_type == 1) {
+        qnorms.resize(nq);
+        faiss::fvec_norms_L2sqr(&qnorms[0], xq, dim, nq);
+    }
+
+    // stage cycle accumulators, published once at the end of the call
+    long cyc_index = 0, cyc_refine = 0, cyc_flat = 0, cyc_merge = 0;
+    long cyc_coarse = 0, slow_np = 0, slow_visited = 0; //slow-query detail, cyc_coarse is a subset of cyc_index
+    long flat_wins = 0, index_wins = 0;
+    long flat_start = LONG_MAX;
+    // size this call's OpenMP teams by what's actually free: concurrent
+    // nq=1 callers each run single-threaded instead of forking full teams
+    OmpGovernor gov(nq);
+    TraceScope trace{ batch ? "search_batch" : "search", "nq", nq, "k", k };
+    unsigned long ts = rdtscNow();
+    DTRACE_PROBE4(vectodb, search__begin, nq, k, batch,
+        state->inter_inflight.load(memory_order_relaxed));
+
+    // One consistent snapshot for the whole call: the four reader locks are
+    // taken once, in the canonical writer order (rw_index, rw_flat, rw_data,
+    // rw_xids), so the index, the flat memtable, the base mapping and the
+    // xid mirrors all come from the same moment — an activation or
+    // compaction can never interleave mid-search. The stages below and the
+    // flat thread run under this one hold, with no per-stage or per-tier
+    // reacquisition.
+    long lock0 = slowlog ? monoNowUs() : 0;
+    rlock snap_i{ state->rw_index };
+    rlock snap_f{ state->rw_flat };
+    rlock snap_d{ state->rw_data };
+    rlock snap_x{ state->rw_xids };
+    long lock_us = slowlog ? monoNowUs() - lock0 : 0;
+
+    // The flat-tail scan is independent of the index scan, so it runs
+    // concurrently with the index+refine stages on its own scratch; the
+    // candidates of both sides meet in the merge below, which orders them
+    // through CompareDistance regardless of origin. This cuts latency by
+    // roughly the flat-scan time whenever the tail is large before a rebuild.
+    vector<float> Df;
+    vector<faiss::Index::idx_t> If;
+    bool has_flat = false;
+    std::thread flat_thread([&] {
+        unsigned long tf = rdtscNow();
+        OmpGovernor gov_flat(nq); //fresh thread, fresh OpenMP ICVs: govern it too
+        //the caller's rw_flat hold outlives this thread (joined before release)
+        if (state->flat->ntotal == 0)
+            return;
+        if (overDeadline())
+            return; //the merge answers from the index side alone
+        flat_start = state->flat_start_num;
+        long nb_flat = state->flat->ntotal;
+        faiss::IndexFlat* flat_mem = dynamic_cast<faiss::IndexFlat*>(state->flat);
+        IndexFlat16* f16_mem = dynamic_cast<IndexFlat16*>(state->flat);
+        IndexFlatSQ8* sq8_mem = dynamic_cast<IndexFlatSQ8*>(state->flat);
+        IndexFlatBin* bin_mem = dynamic_cast<IndexFlatBin*>(state->flat);
+        IndexFlatBlk* blk_mem = dynamic_cast<IndexFlatBlk*>(state->flat);
+        long nchunks = std::min((long)omp_get_max_threads(), nb_flat / FLAT_PAR_MIN_LINES);
+        if (lsh_bits > 0 && (flat_mem != nullptr || f16_mem != nullptr || sq8_mem != nullptr)) {
+            // Hamming prefilter: scan the packed signatures first (a couple
+            // of popcounts per row against a float distance per row), keep
+            // the LSH_KEEP_FACTOR * kc best per query and compute exact
+            // distances only for those survivors. Queries far from the whole
+            // tail never touch the float data at all.
+            long words = lsh_bits / 64;
+            long C = std::min(nb_flat, LSH_KEEP_FACTOR * kc);
+            Df.resize(nq * kc);
+            If.resize(nq * kc);
+#pragma omp parallel for
+            for (long i = 0; i < nq; i++) {
+                if (overDeadline()) {
+                    std::fill(&If[i * kc], &If[i * kc] + kc, -1);
+                    continue;
+                }
+                vector<uint64_t> qsig(words);
+                lshSign(xq + i * dim, &qsig[0]);
+                vector<float> hD(C);
+                vector<long> hI(C);
+                faiss::maxheap_heapify(C, &hD[0], &hI[0]);
+                const uint64_t* sigs = &state->flat_sigs[0];
+                for (long j = 0; j < nb_flat; j++) {
+                    const uint64_t* sj = sigs + j * words;
+                    int ham = 0;
+                    for (long w = 0; w < words; w++)
+                        ham += faiss::popcount64(qsig[w] ^ sj[w]);
+                    if ((float)ham < hD[0]) {
+                        faiss::maxheap_pop(C, &hD[0], &hI[0]);
+                        faiss::maxheap_push(C, &hD[0], &hI[0], (float)ham, j);
+                    }
+                }
+                float* D = &Df[i * kc];
+                faiss::Index::idx_t* I = &If[i * kc];
+                if (metric_type == 0)
+                    faiss::minheap_heapify(kc, D, I);
+                else
+                    faiss::maxheap_heapify(kc, D, I);
+                for (long c = 0; c < C; c++) {
+                    long j = hI[c];
+                    if (j < 0)
+                        continue;
+                    float dis;
+                    if (flat_mem != nullptr)
+                        dis = (metric_type == 0)
+                            ? fvec_ip(xq + i * dim, &flat_mem->xb[j * dim], dim)
+                            : qnorms[i] + state->flat_norms[j] - 2 * fvec_ip(xq + i * dim, &flat_mem->xb[j * dim], dim);
+                    else if (f16_mem != nullptr)
+                        dis = (metric_type == 0)
+                            ? fvec_inner_product_fp16(xq + i * dim, &f16_mem->xb16[j * f16_mem->d], dim)
+                            : fvec_L2sqr_fp16(xq + i * dim, &f16_mem->xb16[j * f16_mem->d], dim);
+                    else
+                        dis = (metric_type == 0)
+                            ? fvec_inner_product_sq8(xq + i * dim, &sq8_mem->xb8[j * sq8_mem->len_line], dim)
+                            : fvec_L2sqr_sq8(xq + i * dim, &sq8_mem->xb8[j * sq8_mem->len_line], dim);
+                    if (metric_type == 0) {
+                        if (dis > D[0]) {
+                            faiss::minheap_pop(kc, D, I);
+                            faiss::minheap_push(kc, D, I, dis, j);
+                        }
+                    } else if (dis < D[0]) {
+                        faiss::maxheap_pop(kc, D, I);
+                        faiss::maxheap_push(kc, D, I, dis, j);
+                    }
+                }
+            }
+        } else if ((flat_mem == nullptr && f16_mem == nullptr && sq8_mem == nullptr && bin_mem == nullptr && blk_mem == nullptr) || nchunks <= 1 || nq >= nchunks) {
+            Df.resize(nq * kc);
+            If.resize(nq * kc);
+            state->flat->search(nq, xq, kc, &Df[0], &If[0]);
+        } else {
+            // faiss brute force parallelizes across queries only, so a lone
+            // query scans the whole tail on one core. Split the scan into
+            // per-core sub-segments, each filling its own top-kc heaps; the
+            // merge treats their candidates like any other source, so no
+            // separate heap-merge pass is needed. The chunk-major layout
+            // puts the rows of sub-segment c at [c * nq, (c + 1) * nq).
+            Df.resize(nchunks * nq * kc);
+            If.resize(nchunks * nq * kc);
+#pragma omp parallel for
+            for (long c = 0; c < nchunks; c++) {
+                if (overDeadline()) {
+                    std::fill(&If[c * nq * kc], &If[(c + 1) * nq * kc], -1);
+                    continue;
+                }
+                long s = c * nb_flat / nchunks;
+                long e = (c + 1) * nb_flat / nchunks;
+                float* Dc = &Df[c * nq * kc];
+                faiss::Index::idx_t* Ic = &If[c * nq * kc];
+                if (f16_mem != nullptr) {
+                    f16_mem->search_subset(s, e, nq, xq, kc, Dc, Ic); //labels already absolute
+                } else if (sq8_mem != nullptr) {
+                    sq8_mem->search_subset(s, e, nq, xq, kc, Dc, Ic); //labels already absolute
+                } else if (bin_mem != nullptr) {
+                    bin_mem->search_subset(s, e, nq, xq, kc, Dc, Ic); //labels already absolute
+                } else if (blk_mem != nullptr) {
+                    blk_mem->search_subset(s, e, nq, xq, kc, Dc, Ic); //labels already absolute
+                } else if (metric_type == 0) {
+                    faiss::float_minheap_array_t heaps = { size_t(nq), size_t(kc), Ic, Dc };
+                    faiss::knn_inner_product(xq, &flat_mem->xb[s * dim], dim, nq, e - s, &heaps);
+                } else {
+                    // cached-norm identity scan: each row costs one inner
+                    // product against the precomputed ||x||^2 instead of the
+                    // sub+fma L2 loop, and the per-call norm recomputation
+                    // of knn_L2sqr disappears. The merge sorts, so the heaps
+                    // can stay unordered.
+                    const float* bnorms = &state->flat_norms[0];
+                    for (long i = 0; i < nq; i++) {
+                        float* Dq = Dc + i * kc;
+                        faiss::Index::idx_t* Iq = Ic + i * kc;
+                        faiss::maxheap_heapify(kc, Dq, Iq);
+                        const float* xi = xq + i * dim;
+                        for (long j = s; j < e; j++) {
+                            float dis = qnorms[i] + bnorms[j] - 2 * fvec_ip(xi, &flat_mem->xb[j * dim], dim);
+                            if (dis < Dq[0]) {
+                                faiss::maxheap_pop(kc, Dq, Iq);
+                                faiss::maxheap_push(kc, Dq, Iq, dis, j - s);
+                            }
+                        }
+                    }
+                }
+                if (flat_mem != nullptr)
+                    for (long j = 0; j < nq * kc; j++)
+                        if (Ic[j] >= 0)
+                            Ic[j] += s;
+            }
+        }
+        has_flat = true;
+        cyc_flat = (long)(rdtscNow() - tf);
+        DTRACE_PROBE2(vectodb, search__flat__done, nq, cyc_flat);
+    });
+
+    {
+        // Refine result. Computes exact distance of each candidate with the
+        // fvec_* primitives instead of going through a temporary IndexFlat,
+        // so there's no per-query allocation nor heap churn.
+        // Queries are independent, so refine them in parallel.
+        // label_offset translates index-local labels into base line numbers:
+        // 0 for the main index, delta_starts[d] for delta index d.
+        auto refineCandidates = [&](long label_offset) {
+            //the base mapping and the mirrors are pinned by the call-wide snapshot
+            //tombstoned lines never surface; skipping them here also skips
+            //their gather, so dead rows stop costing refine bandwidth
+            const char* dels = state->dels.empty() ? nullptr : &state->dels[0];
+            const long ndels = (long)state->dels.size();
+            // Adaptive refine depth: the candidate row is sorted
+            // best-first by approximate distance, so when the candidate
+            // at the shallow depth is already clearly worse than the
+            // k-th best, exact reordering cannot pull a deeper candidate
+            // into the top k and the gather stops at the shallow prefix.
+            // Tightly clustered rows (small margin) keep the full depth,
+            // the answers stay identical either way.
+            auto refineDepth = [&](long i) -> long {
+                long kr = kc;
+                const long kr0 = std::min(kc, std::max(std::max(2 * k, REFINE_SHALLOW_MIN) >> shed, k));
+                if (kr0 < kc) {
+                    if (shed > 0) {
+                        kr = kr0; //shedding: bounded gather, no margin escalation
+                    } else if (I[i * kc + kr0 - 1] < 0) {
+                        kr = kr0; //the row ends before the shallow depth
+                    } else {
+                        float d_best = D[i * kc + k - 1];
+                        float d_edge = D[i * kc + kr0 - 1];
+                        float gap = metric_type == 0 ? d_best - d_edge : d_edge - d_best;
+                        if (gap > REFINE_MARGIN * (fabsf(d_best) + 1e-6f))
+                            kr = kr0;
+                    }
+                }
+                return kr;
+            };
+            if (batch && deadline_us == 0 && nq >= REFINE_GEMM_MIN_NQ) {
+                // Offline slices rerank as one GEMM instead of nq separate
+                // gather+dot passes: the union of the surviving candidates
+                // is decoded once into a contiguous tile, a single sgemm
+                // computes every <query, candidate> inner product, and the
+                // L2 answers fall out of the cached-norms identity. The
+                // selected lists overlap heavily across a slice, so the
+                // union stays well under nq*kc and each shared line is
+                // gathered once — the pass is BLAS-bound instead of
+                // memory-bound. BATCH_SLICE_NQ bounds the tile and the
+                // product, so faiss-style blocking is not needed here.
+                std::unordered_map<long, long> col_of;
+                col_of.reserve(nq * kc);
+                vector<long> ulines;
+                ulines.reserve(nq * kc);
+                vector<long> qcol;
+                qcol.reserve(nq * kc);
+                vector<long> qoff(nq + 1, 0);
+                for (long i = 0; i < nq; i++) {
+                    long kr = refineDepth(i);
+                    for (long j = 0; j < kr; j++) {
+                        long line_num = I[i * kc + j];
+                        if (line_num < 0)
+                            continue;
+                        line_num += label_offset;
+                        if (line_num < ndels && dels[line_num])
+                            continue;
+                        auto it = col_of.emplace(line_num, (long)ulines.size());
+                        if (it.second)
+                            ulines.push_back(line_num);
+                        qcol.push_back(it.first->second);
+                    }
+                    qoff[i + 1] = (long)qcol.size();
+                }
+                long nu = (long)ulines.size();
+                if (nu == 0)
+                    return;
+                vector<float> tile(nu * dim);
+#pragma omp parallel for
+                for (long u = 0; u < nu; u++) {
+                    const uint8_t* line = segLine(state->seg_maps, ulines[u]);
+                    noteSegAccess(ulines[u]);
+                    if (sq8)
+                        sq8_decode(line, dim, &tile[u * dim]);
+                    else if (binary)
+                        bin_decode(line, dim, &tile[u * dim]);
+                    else
+                        memcpy(&tile[u * dim], line, dim * sizeof(float));
+                }
+                // tile norms instead of the cached base norms: computed from
+                // the decoded rows, so SQ8 answers match the scalar kernels
+                vector<float> tnorms;
+                if (metric_type == 1) {
+                    tnorms.resize(nu);
+                    faiss::fvec_norms_L2sqr(&tnorms[0], &tile[0], dim, nu);
+                }
+                // column-major sgemm as in faiss: ip[i * nu + u] = <xq_i, tile_u>
+                vector<float> ip(nq * nu);
+                {
+                    float one = 1, zero = 0;
+                    FINTEGER nui = nu, nqi = nq, di = dim;
+                    sgemm_("Transpose", "Not transpose", &nui, &nqi, &di, &one, &tile[0], &di, xq, &di, &zero, &ip[0], &nui);
+                }
+                for (long i = 0; i < nq; i++) {
+                    for (long j = qoff[i]; j < qoff[i + 1]; j++) {
+                        long u = qcol[j];
+                        float dis = metric_type == 0 ? ip[i * nu + u] : qnorms[i] + tnorms[u] - 2 * ip[i * nu + u];
+                        results[i].emplace_back(dis, ulines[u]);
+                    }
+                }
+                return;
+            }
+            vector<uint8_t> qbins; //binary: queries packed once up front, popcounted per candidate
+            if (binary) {
+                qbins.resize(nq * len_vec);
+                for (long i = 0; i < nq; i++)
+                    bin_encode(xq + i * dim, dim, &qbins[i * len_vec]);
+            }
+#pragma omp parallel for
+            for (long i = 0; i < nq; i++) {
+                if (overDeadline())
+                    continue; //unrefined candidates are dropped, not emitted with stale distances
+                long kr = refineDepth(i);
+                // Issue prefetches for every candidate line first, so the
+                // TLB/cache misses of the MADV_RANDOM mapping overlap across
+                // candidates instead of serializing in the distance loop.
+                for (long j = 0; j < kr; j++) {
+                    long line_num = I[i * kc + j];
+                    if (line_num < 0)
+                        continue;
+                    line_num += label_offset;
+                    if (line_num < ndels && dels[line_num])
+                        continue;
+                    const uint8_t* line = segLine(state->seg_maps, line_num);
+                    for (long b = 0; b < len_vec; b += 64)
+                        __builtin_prefetch(line + b, 0, 1);
+                }
+                for (long j = 0; j < kr; j++) {
+                    long line_num = I[i * kc + j];
+                    if (line_num < 0)
+                        continue;
+                    line_num += label_offset;
+                    if (line_num < ndels && dels[line_num])
+                        continue;
+                    const uint8_t* line = segLine(state->seg_maps, line_num);
+                    noteSegAccess(line_num);
+                    float dis;
+                    if (sq8)
+                        dis = (metric_type == 0)
+                            ? fvec_inner_product_sq8(xq + i * dim, line, dim)
+                            : fvec_L2sqr_sq8(xq + i * dim, line, dim);
+                    else if (binary)
+                        dis = bin_hamming(&qbins[i * len_vec], line, len_vec);
+                    else if (metric_type == 0)
+                        dis = fvec_ip(xq + i * dim, (const float*)line, dim);
+                    else if (!state->base_norms.empty())
+                        dis = qnorms[i] + state->base_norms[line_num] - 2 * fvec_ip(xq + i * dim, (const float*)line, dim);
+                    else
+                        dis = fvec_l2(xq + i * dim, (const float*)line, dim);
+                    results[i].emplace_back(dis, line_num);
+                }
+            }
+        };
+        faiss::Index* index = localIndexReplica();
+        if (index != nullptr && !overDeadline()) {
+            // Perform a search
+            faiss::IndexPreTransform* ipt = dynamic_cast<faiss::IndexPreTransform*>(index);
+            const bool pairs = state->ids32_active.load(memory_order_relaxed); //ids32=1: the ids are gone, every scan must emit pairs
+            faiss::IndexIVF* ivf = (nprobe_override > 0 || nq == 1 || shed > 0 || pairs) ? dynamic_cast<faiss::IndexIVF*>(ipt != nullptr ? ipt->index : index) : nullptr;
+            if (ivf != nullptr) {
+                // Per-call nprobe without touching the shared index: run the
+                // coarse quantization ourselves and hand the assignment to
+                // search_preassigned. Its row stride is the activated nprobe,
+                // so overrides are capped there and shorter rows are padded
+                // with -1 (skipped by the scan).
+                // An OPQ chain in front is applied to the query batch once
+                // here; the coarse quantization and the PQ scan share the
+                // transformed buffer. Refinement below stays on the raw
+                // mmapped vectors — the rotation is orthonormal, so raw
+                // distances equal rotated ones.
+                const float* xqt = xq;
+                faiss::ScopeDeleter<float> del_xqt;
+                if (ipt != nullptr) {
+                    xqt = ipt->apply_chain(nq, xq);
+                    if (xqt != xq)
+                        del_xqt.set(xqt);
+                }
+                long stride = (long)ivf->nprobe;
+                long np = nprobe_override > 0 ? std::min(stride, nprobe_override) : stride;
+                np = std::max(1L, np >> shed); //shedding halves nprobe per level
+                vector<faiss::Index::idx_t> coarse_idx(nq * stride, -1);
+                vector<float> coarse_dis(nq * stride, 0);
+                unsigned long tc = rdtscNow();
+                if (np == stride) {
+                    ivf->quantizer->search(nq, xqt, np, &coarse_dis[0], &coarse_idx[0]);
+                } else {
+                    vector<faiss::Index::idx_t> ci(nq * np);
+                    vector<float> cd(nq * np);
+                    ivf->quantizer->search(nq, xqt, np, &cd[0], &ci[0]);
+                    for (long i = 0; i < nq; i++) {
+                        memcpy(&coarse_idx[i * stride], &ci[i * np], np * sizeof(faiss::Index::idx_t));
+                        memcpy(&coarse_dis[i * stride], &cd[i * np], np * sizeof(float));
+                    }
+                }
+                cyc_coarse += (long)(rdtscNow() - tc);
+                slow_np = np;
+                if (slowlog)
+                    for (long j = 0; j < nq * stride; j++)
+                        if (coarse_idx[j] >= 0)
+                            slow_visited += (long)ivf->invlists->list_size(coarse_idx[j]);
+                ivf->invlists->prefetch_lists(&coarse_idx[0], nq * stride);
+                // Low-latency fan-out: faiss scans the selected lists of one
+                // query serially on one thread, so nq=1 p50 is that scan even
+                // on an idle box. When the governor sees spare cores, take a
+                // fresh grant and partition the lists round-robin across the
+                // team — one search_preassigned row (its own heap) per worker,
+                // merged below. Round-robin keeps each slice sorted by coarse
+                // distance, which the early-termination cutoff relies on.
+                long fan = 1;
+                std::unique_ptr<OmpGovernor> gov_fan;
+                if (nq == 1 && np > 1) {
+                    gov_fan = std::make_unique<OmpGovernor>(np);
+                    fan = gov_fan->grant;
+                }
+                if (fan > 1) {
+                    vector<faiss::Index::idx_t> keys_f(fan * stride, -1);
+                    vector<float> cdis_f(fan * stride, 0);
+                    vector<long> nf(fan, 0);
+                    for (long ik = 0; ik < np; ik++) {
+                        if (coarse_idx[ik] < 0)
+                            continue;
+                        long t = ik % fan;
+                        keys_f[t * stride + nf[t]] = coarse_idx[ik];
+                        cdis_f[t * stride + nf[t]] = coarse_dis[ik];
+                        nf[t]++;
+                    }
+                    vector<float> Df2(fan * kc);
+                    vector<faiss::Index::idx_t> If2(fan * kc);
+#pragma omp parallel for
+                    for (long t = 0; t < fan; t++)
+                        ivf->search_preassigned(1, xqt, kc, &keys_f[t * stride], &cdis_f[t * stride], &Df2[t * kc], &If2[t * kc], pairs);
+                    // per-thread heaps cover disjoint lists: the top kc of
+                    // their union is exactly what the serial scan returns
+                    vector<pair<float, long>> fcand;
+                    fcand.reserve(fan * kc);
+                    for (long j = 0; j < fan * kc; j++)
+                        if (If2[j] >= 0)
+                            fcand.emplace_back(Df2[j], (long)If2[j]);
+                    long keep = std::min(kc, (long)fcand.size());
+                    int mt = metric_type;
+                    partial_sort(fcand.begin(), fcand.begin() + keep, fcand.end(),
+                        [mt](const pair<float, long>& a, const pair<float, long>& b) { return CompareDistance(mt, a.first, b.first); });
+                    for (long j = 0; j < kc; j++) {
+                        D[j] = j < keep ? fcand[j].first : 0;
+                        I[j] = j < keep ? fcand[j].second : -1;
+                    }
+                } else {
+                    ivf->search_preassigned(nq, xqt, kc, &coarse_idx[0], &coarse_dis[0], &D[0], &I[0], pairs);
+                }
+                if (pairs) {
+                    // widen the (list, offset) pairs back to base line
+                    // numbers through the compact table, at result emission
+                    const uint32_t* tab = &state->ids32_tab[0];
+                    const long* off = &state->ids32_off[0];
+                    for (long j = 0; j < nq * kc; j++)
+                        if (I[j] >= 0)
+                            I[j] = (long)tab[off[I[j] >> 32] + (I[j] & 0xffffffffL)];
+                }
+            } else {
+                index->search(nq, xq, kc, &D[0], &I[0]);
+            }
+            unsigned long ts2 = rdtscNow();
+            cyc_index += (long)(ts2 - ts);
+            ts = ts2;
+            refineCandidates(0);
+            ts2 = rdtscNow();
+            cyc_refine += (long)(ts2 - ts);
+            ts = ts2;
+        }
+        // delta tier: small indexes absorbed from the flat tail between full
+        // rebuilds. Each is searched through the top-level API (no per-call
+        // nprobe machinery; they are tiny) and its candidates join the same
+        // exact refine with the labels offset into base line numbers.
+        for (size_t di = 0; di < state->delta_indexes.size(); di++) {
+            if (overDeadline())
+                break;
+            state->delta_indexes[di]->search(nq, xq, kc, &D[0], &I[0]);
+            unsigned long ts2 = rdtscNow();
+            cyc_index += (long)(ts2 - ts);
+            ts = ts2;
+            refineCandidates(state->delta_starts[di]);
+            ts2 = rdtscNow();
+            cyc_refine += (long)(ts2 - ts);
+            ts = ts2;
+        }
+    }
+
+    DTRACE_PROBE3(vectodb, search__index__done, nq, cyc_index, cyc_refine);
+    flat_thread.join();
+    ts = rdtscNow(); //the wait on the flat thread is overlap, not merge work
+    if (has_flat) {
+        // one kc-row per (sub-segment, query) pair; row r belongs to query r % nq
+        long nrows = (long)If.size() / kc;
+        for (long r = 0; r < nrows; r++) {
+            long i = r % nq;
+            for (long j = 0; j < kc; j++) {
+                long line_num = If[r * kc + j];
+                if (line_num < 0)
+                    continue;
+                results[i].emplace_back(Df[r * kc + j], line_num + flat_start);
+            }
+        }
+    }
+
+    {
+        int mt = metric_type;
+        auto closer = [mt](const pair<float, long>& a, const pair<float, long>& b) {
+            return VectoDB::CompareDistance(mt, a.first, b.first);
+        };
+        // identity fast path: while every xid has equalled its line number
+        // the candidates are already translated, so the merge skips the
+        // gather through the mirror (which the snapshot keeps pinned)
+        const bool ident = state->xids_identity.load(memory_order_relaxed);
+        //flat candidates bypass the refine, so the tombstone filter runs here
+        const bool dels_on = state->stat_dels.load(memory_order_relaxed) > 0;
+        for (long i = 0; i < nq; i++) {
+            auto& cand = results[i];
+            if (dels_on) {
+                const vector<char>& dels = state->dels;
+                size_t w = 0;
+                for (auto& c : cand)
+                    if (c.second >= (long)dels.size() || !dels[c.second])
+                        cand[w++] = c;
+                cand.resize(w);
+            }
+            if (allowed != nullptr) {
+                // push the xid predicate down before selection, so excluded
+                // candidates never enter the top-k sort
+                size_t w = 0;
+                for (auto& c : cand)
+                    if (allowed->count(ident ? c.second : state->xids[c.second]) > 0)
+                        cand[w++] = c;
+                cand.resize(w);
+            }
+            long kr = std::min(k, (long)cand.size());
+            std::partial_sort(cand.begin(), cand.begin() + kr, cand.end(), closer);
+            if (kr > 0) {
+                if (cand[0].second >= flat_start)
+                    flat_wins++;
+                else
+                    index_wins++;
+            }
+            // branchless post-filter of the xid translation: the threshold
+            // compare becomes a mask selecting between the translated xid and
+            // the -1 sentinel the output was prefilled with, so large-nq
+            // offline batches never mispredict here
+            const long* xs = ident ? nullptr : &state->xids[0];
+            long j = 0;
+#ifdef __AVX2__
+            if (sizeof(pair<float, long>) == 16) {
+                // candidates are (float dis, long line_num) pairs 16 bytes
+                // apart; gather 4 distances and line numbers at a time, turn
+                // the compare into a lane mask and let the masked gather
+                // write the sentinel for the failing lanes
+                const char* cb = (const char*)&cand[0];
+                const __m256i qstride = _mm256_set_epi64x(48, 32, 16, 0);
+                const __m128i dstride = _mm_set_epi32(48, 32, 16, 0);
+                const __m128 thrv = _mm_set1_ps(dist_threshold);
+                const __m256i minus1 = _mm256_set1_epi64x(-1);
+                for (; j + 4 <= kr; j += 4) {
+                    const char* p = cb + j * 16;
+                    __m128 d4 = _mm_i32gather_ps((const float*)p, dstride, 1);
+                    __m256i lines = _mm256_i64gather_epi64((const long long*)(p + 8), qstride, 1);
+                    __m128 pass = (metric_type == 0)
+                        ? _mm_cmp_ps(d4, thrv, _CMP_GT_OQ)
+                        : _mm_cmp_ps(d4, thrv, _CMP_LE_OQ);
+                    __m256i mask = _mm256_cvtepi32_epi64(_mm_castps_si128(pass));
+                    __m256i x4 = ident
+                        ? _mm256_blendv_epi8(minus1, lines, mask)
+                        : _mm256_mask_i64gather_epi64(minus1, (const long long*)xs, lines, mask, 8);
+                    _mm_storeu_ps(&distances[i * k + j], d4);
+                    _mm256_storeu_si256((__m256i*)&xids[i * k + j], x4);
+                }
+            }
+#endif
+            for (; j < kr; j++) {
+                distances[i * k + j] = cand[j].first;
+                long pass = -(long)CompareDistance(metric_type, cand[j].first, dist_threshold);
+                long x = ident ? cand[j].second : xs[cand[j].second];
+                xids[i * k + j] = (x & pass) | ~pass;
+            }
+        }
+        cyc_merge = (long)(rdtscNow() - ts);
+    }
+
+    state->st_nq.fetch_add(nq, memory_order_relaxed);
+    state->st_cyc_index.fetch_add(cyc_index, memory_order_relaxed);
+    state->st_cyc_refine.fetch_add(cyc_refine, memory_order_relaxed);
+    state->st_cyc_flat.fetch_add(cyc_flat, memory_order_relaxed);
+    state->st_cyc_merge.fetch_add(cyc_merge, memory_order_relaxed);
+    state->st_flat_wins.fetch_add(flat_wins, memory_order_relaxed);
+    state->st_index_wins.fetch_add(index_wins, memory_order_relaxed);
+    long cyc_query = (cyc_index + cyc_refine + cyc_flat + cyc_merge) / nq;
+    int bucket = cyc_query <= 0 ? 0 : 64 - __builtin_clzl((unsigned long)cyc_query);
+    if (bucket >= SEARCH_HIST_NBUCKET)
+        bucket = SEARCH_HIST_NBUCKET - 1;
+    state->st_hist[bucket].fetch_add(nq, memory_order_relaxed);
+    int pc = batch ? 1 : 0;
+    state->st_prio_nq[pc].fetch_add(nq, memory_order_relaxed);
+    state->st_prio_cyc[pc].fetch_add(cyc_index + cyc_refine + cyc_flat + cyc_merge, memory_order_relaxed);
+    if (partial != nullptr)
+        *partial = expired.load(memory_order_relaxed);
+    if (slowlog) {
+        long total_us = monoNowUs() - wall0;
+        if (total_us >= slowlog_us) {
+            struct rusage ru1;
+            getrusage(RUSAGE_SELF, &ru1);
+            SlowQuery q;
+            q.wall_us = (long)chrono::duration_cast<chrono::microseconds>(chrono::system_clock::now().time_since_epoch()).count();
+            q.nq = nq;
+            q.k = k;
+            q.batch = batch ? 1 : 0;
+            q.total_us = total_us;
+            q.lock_us = lock_us;
+            q.cyc_coarse = cyc_coarse;
+            q.cyc_index = cyc_index;
+            q.cyc_refine = cyc_refine;
+            q.cyc_flat = cyc_flat;
+            q.cyc_merge = cyc_merge;
+            q.nprobe = slow_np;
+            q.visited = slow_visited;
+            q.faults = (long)(ru1.ru_minflt - ru0.ru_minflt) + (long)(ru1.ru_majflt - ru0.ru_majflt);
+            mtxlock lk{ state->m_slowlog };
+            state->slowlog[state->slowlog_seq % SLOWLOG_NSLOT] = q;
+            state->slowlog_seq++;
+        }
+    }
+    DTRACE_PROBE3(vectodb, search__done, nq, total, cyc_query);
+    return total;
+}
+
+long VectoDB::GetSearchStats(long* vals, long n_vals) const
+{
+    long full[17 + SEARCH_HIST_NBUCKET];
+    full[0] = state->st_nq.load(memory_order_relaxed);
+    full[1] = state->st_cyc_index.load(memory_order_relaxed);
+    full[2] = state->st_cyc_refine.load(memory_order_relaxed);
+    full[3] = state->st_cyc_flat.load(memory_order_relaxed);
+    full[4] = state->st_cyc_merge.load(memory_order_relaxed);
+    full[5] = state->st_flat_wins.load(memory_order_relaxed);
+    full[6] = state->st_index_wins.load(memory_order_relaxed);
+    full[7] = state->st_cache_lookups.load(memory_order_relaxed);
+    full[8] = state->st_cache_hits.load(memory_order_relaxed);
+    full[9] = state->st_prio_nq[0].load(memory_order_relaxed);
+    full[10] = state->st_prio_cyc[0].load(memory_order_relaxed);
+    full[11] = state->st_prio_nq[1].load(memory_order_relaxed);
+    full[12] = state->st_prio_cyc[1].load(memory_order_relaxed);
+    full[13] = state->st_shed_nq.load(memory_order_relaxed);
+    full[14] = (long)state->shed_level.load(memory_order_relaxed);
+    full[15] = effectiveNumProcs(); //host cores capped by the cgroup cpu quota
+    full[16] = omp_tokens_used.load(memory_order_relaxed);
+    for (int i = 0; i < SEARCH_HIST_NBUCKET; i++)
+        full[17 + i] = state->st_hist[i].load(memory_order_relaxed);
+    long avail = 17 + SEARCH_HIST_NBUCKET;
+    for (long i = 0; i < std::min(avail, n_vals); i++)
+        vals[i] = full[i];
+    return avail;
+}
+
+long VectoDB::GetSlowLog(long* vals, long n_vals) const
+{
+    mtxlock lk{ state->m_slowlog };
+    long count = std::min(state->slowlog_seq, SLOWLOG_NSLOT);
+    if (n_vals >= 1)
+        vals[0] = count;
+    for (long i = 0; i < count; i++) {
+        // newest first: entry 0 is the most recent slow call
+        const SlowQuery& q = state->slowlog[(state->slowlog_seq - 1 - i) % SLOWLOG_NSLOT];
+        long base = 1 + i * SLOWLOG_NFIELD;
+        if (base + SLOWLOG_NFIELD > n_vals)
+            break;
+        vals[base + 0] = q.wall_us;
+        vals[base + 1] = q.nq;
+        vals[base + 2] = q.k;
+        vals[base + 3] = q.batch;
+        vals[base + 4] = q.total_us;
+        vals[base + 5] = q.lock_us;
+        vals[base + 6] = q.cyc_coarse;
+        vals[base + 7] = q.cyc_index;
+        vals[base + 8] = q.cyc_refine;
+        vals[base + 9] = q.cyc_flat;
+        vals[base + 10] = q.cyc_merge;
+        vals[base + 11] = q.nprobe;
+        vals[base + 12] = q.visited;
+        vals[base + 13] = q.faults;
+    }
+    return 1 + count * SLOWLOG_NFIELD;
+}
+
+long VectoDB::GetShedLevel() const
+{
+    return (long)state->shed_level.load(memory_order_relaxed);
+}
+
+long VectoDB::GetIvfStats(long* vals, long n_vals) const
+{
+    long full[6] = { 0, 0, 0, 0, 0, 0 };
+    {
+        rlock r{ state->rw_index };
+        faiss::IndexIVF* ivf = state->index == nullptr ? nullptr : dynamic_cast<faiss::IndexIVF*>(innerIndex(state->index));
+        if (ivf != nullptr) {
+            long nlist = (long)ivf->nlist;
+            long nonempty = 0, max_sz = 0, total = 0;
+            double sumsq = 0;
+            for (long l = 0; l < nlist; l++) {
+                long sz = (long)ivf->invlists->list_size(l);
+                if (sz == 0)
+                    continue;
+                nonempty++;
+                total += sz;
+                max_sz = std::max(max_sz, sz);
+                sumsq += (double)sz * sz;
+            }
+            full[0] = nlist;
+            full[1] = nonempty;
+            full[2] = max_sz;
+            full[3] = total / std::max(1L, nonempty);
+            //faiss's imbalance factor: nlist * sum(sz^2) / total^2, 1.0 is perfectly uniform
+            if (total > 0)
+                full[4] = (long)(1000.0 * nlist * sumsq / ((double)total * total));
+        }
+    }
+    full[5] = state->st_list_splits.load(memory_order_relaxed);
+    for (long i = 0; i < std::min(6L, n_vals); i++)
+        vals[i] = full[i];
+    return 6;
+}
+
+long VectoDB::GetSegmentStats(long* vals, long n_vals) const
+{
+    rlock r{ state->rw_data };
+    long nsegs = (long)state->seg_heat.size();
+    if (n_vals >= 1)
+        vals[0] = nsegs;
+    for (long k = 0; k < nsegs && 2 + 2 * k < n_vals; k++) {
+        const SegHeat& heat = state->seg_heat[k];
+        vals[1 + 2 * k] = heat.hot.load(memory_order_relaxed);
+        vals[2 + 2 * k] = heat.hits_window.load(memory_order_relaxed);
+    }
+    return 1 + 2 * nsegs;
+}
+
+long VectoDB::RebalanceTiers()
+{
+    long changed = 0, nhot = 0;
+    const long pg = sysconf(_SC_PAGESIZE);
+    rlock r{ state->rw_data };
+    for (long k = 0; k < (long)state->seg_heat.size() && k < (long)state->seg_maps.size(); k++) {
+        SegHeat& heat = state->seg_heat[k];
+        long h = heat.hits.exchange(0, memory_order_relaxed);
+        heat.hits_window.store(h, memory_order_relaxed);
+        SegMap& seg = state->seg_maps[k];
+        if (seg.data == nullptr || seg.len == 0)
+            continue;
+        // Block-granular residency: candidates cluster by inverted list and
+        // a list's rows are contiguous line ranges, so a window's gathers
+        // concentrate in a few blocks. Advising per block keeps a segment's
+        // hot ranges resident while its cold ranges page out, instead of the
+        // old all-or-nothing segment advice.
+        const long blk_bytes = ((seg_lines + SEG_HEAT_NBLOCK - 1) / SEG_HEAT_NBLOCK) * len_vec;
+        uint64_t hot = heat.hot_blocks.load(memory_order_relaxed);
+        //diffuse access (a busy segment without a standout block) still
+        //promotes every touched block, matching the whole-segment behaviour
+        const bool seg_busy = h >= SEG_PROMOTE_HITS;
+        for (long b = 0; b < SEG_HEAT_NBLOCK; b++) {
+            long off = b * blk_bytes;
+            if (off >= seg.len)
+                break;
+            long end = std::min(off + blk_bytes, seg.len);
+            long hb = heat.block_hits[b].exchange(0, memory_order_relaxed);
+            bool bhot = 0 != (hot & (1UL << b));
+            if (!bhot && (hb >= BLOCK_PROMOTE_HITS || (seg_busy && hb > 0))) {
+                //promote: pull the block's pages back in ahead of the
+                //gathers instead of one random fault at a time
+                long s_adv = off & ~(pg - 1);
+                if (madvise(seg.data + s_adv, end - s_adv, MADV_WILLNEED) < 0)
+                    LOG(ERROR) << "madvise(MADV_WILLNEED) failed with " << strerror(errno);
+                hot |= 1UL << b;
+                changed++;
+            } else if (bhot && hb < BLOCK_DEMOTE_HITS) {
+                //the appendable tail keeps taking writes and the mlock budget
+                //pins the front of the base: neither may release its pages
+                if (k == state->vec_nsegs - 1 || k * seg_lines * len_vec + off < mlock_bytes)
+                    continue;
+                //trim to whole pages so the drop never clips a neighbouring block
+                long s_adv = (off + pg - 1) & ~(pg - 1);
+                long e_adv = end & ~(pg - 1);
+                if (e_adv <= s_adv)
+                    continue;
+                if (madvise(seg.data + s_adv, e_adv - s_adv, MADV_DONTNEED) < 0)
+                    LOG(ERROR) << "madvise(MADV_DONTNEED) failed with " << strerror(errno);
+                hot &= ~(1UL << b);
+                changed++;
+            }
+        }
+        heat.hot_blocks.store(hot, memory_order_relaxed);
+        heat.hot.store(hot != 0 ? 1 : 0, memory_order_relaxed);
+        if (hot != 0)
+            nhot++;
+    }
+    if (changed > 0)
+        LOG(INFO) << "RebalanceTiers " << work_dir << " moved " << changed << " blocks, " << nhot << " segments hold resident ranges";
+    return changed;
+}
+
+long VectoDB::GetMemoryStats(long* vals, long n_vals) const
+{
+    long full[14] = { 0 };
+    {
+        rlock r{ state->rw_index };
+        full[0] = indexMemBytes(state->index);
+        if (state->ids32_active.load(memory_order_relaxed))
+            // the 64-bit per-list ids indexMemBytes assumes are freed; the
+            // compact table and its offsets serve instead
+            full[0] += (long)state->ids32_off.size() * (long)sizeof(long)
+                - (long)state->ids32_tab.size() * (long)(sizeof(long) - sizeof(uint32_t));
+        for (faiss::Index* replica : state->index_replicas)
+            full[1] += indexMemBytes(replica);
+        for (faiss::Index* delta : state->delta_indexes)
+            full[2] += indexMemBytes(delta);
+    }
+    {
+        rlock r{ state->rw_flat };
+        full[3] = indexMemBytes(state->flat)
+            + (long)state->flat_sigs.size() * (long)sizeof(uint64_t)
+            + (long)state->flat_norms.size() * (long)sizeof(float);
+    }
+    {
+        rlock r{ state->rw_xids };
+        full[4] = state->xids.memBytes() //committed pages of the reserved store
+            + (long)state->base_norms.size() * (long)sizeof(float);
+    }
+    for (int s = 0; s < XID_NSHARD; s++) {
+        XidShard& shard = state->xid_shards[s];
+        rlock r{ shard.rw };
+        // node-based map: key, value, next pointer and allocator header per
+        // entry, plus the bucket array
+        full[4] += (long)shard.xid2num.size() * (long)(2 * sizeof(long) + 2 * sizeof(void*))
+            + (long)shard.xid2num.bucket_count() * (long)sizeof(void*);
+    }
+    full[4] += XID_BLOOM_BITS / 8; //the negative-lookup filter in front of the shards
+    {
+        rlock r{ state->rw_data };
+        for (const SegMap& seg : state->seg_maps)
+            full[5] += seg.len;
+    }
+    full[6] = state->stat_build_mem.load(memory_order_relaxed);
+    {
+        mtxlock lk{ build_mtx };
+        full[7] = build_mem_inflight;
+    }
+    // jemalloc view, zeros without jemalloc: allocated vs resident per
+    // dedicated arena makes the fragmentation visible (resident >>
+    // allocated on the build arena means a purge has not run yet), the
+    // process-wide pair covers the arenas left to the search path
+    mallocStatsRefresh();
+    if (arena_build != 0) {
+        full[8] = mallocArenaStat(arena_build, "small.allocated")
+            + mallocArenaStat(arena_build, "large.allocated");
+        full[9] = mallocArenaStat(arena_build, "resident");
+    }
+    if (arena_index != 0) {
+        full[10] = mallocArenaStat(arena_index, "small.allocated")
+            + mallocArenaStat(arena_index, "large.allocated");
+        full[11] = mallocArenaStat(arena_index, "resident");
+    }
+    full[12] = mallocStat("stats.allocated");
+    full[13] = mallocStat("stats.resident");
+    long avail = 14;
+    for (long i = 0; i < std::min(avail, n_vals); i++)
+        vals[i] = full[i];
+    return avail;
+}
+
+long VectoDB::SearchRange(long nq, const float* xq, float radius, long cap, float* distances, long* xids, long* lims)
+{
+    long total = state->total;
+    for (long i = 0; i <= nq; i++)
+        lims[i] = 0;
+    if (total <= 0)
+        return 0;
+    OmpGovernor gov(nq);
+    // one consistent snapshot for the whole call, like searchKnnFiltered:
+    // the reader locks are taken once in the canonical writer order, so the
+    // tiers and the xid mirror come from the same moment
+    rlock snap_i{ state->rw_index };
+    rlock snap_f{ state->rw_flat };
+    rlock snap_x{ state->rw_xids };
+    // RangeSearchResult aggregates the variable-size per-query results into
+    // one buffer allocation per call, not one per query.
+    faiss::RangeSearchResult res_index(nq);
+    bool has_index = false;
+    // one result set per delta index, labels offset by its start line
+    vector<std::unique_ptr<faiss::RangeSearchResult>> res_deltas;
+    vector<long> delta_offs;
+    {
+        faiss::Index* index = localIndexReplica();
+        if (index != nullptr && state->ids32_active.load(memory_order_relaxed)) {
+            // the faiss range scan reads the per-list ids, which ids32 freed
+            LOG(WARNING) << "ids32=1 frees the per-list ids, range search covers the flat tail and deltas only";
+        } else if (index != nullptr) {
+            try {
+                index->range_search(nq, xq, radius, &res_index);
+                has_index = true;
+            } catch (faiss::FaissException& e) {
+                LOG(WARNING) << "index " << index_key << " does not support range_search: " << e.what();
+            }
+        }
+        for (size_t di = 0; di < state->delta_indexes.size(); di++) {
+            try {
+                auto res = std::make_unique<faiss::RangeSearchResult>(nq);
+                state->delta_indexes[di]->range_search(nq, xq, radius, res.get());
+                res_deltas.push_back(std::move(res));
+                delta_offs.push_back(state->delta_starts[di]);
+            } catch (faiss::FaissException& e) {
+                LOG(WARNING) << "index " << index_key << " does not support range_search: " << e.what();
+                break;
+            }
+        }
+    }
+    faiss::RangeSearchResult res_flat(nq);
+    bool has_flat = false;
+    long flat_start = 0;
+    {
+        if (state->flat->ntotal != 0) {
+            try {
+                state->flat->range_search(nq, xq, radius, &res_flat);
+                has_flat = true;
+            } catch (faiss::FaissException& e) {
+                LOG(WARNING) << "memtable " << memtable_key << " does not support range_search: " << e.what();
+            }
+        }
+        flat_start = state->flat_start_num;
+    }
+
+    long found = 0;
+    long off = 0;
+    const bool ident = state->xids_identity.load(memory_order_relaxed);
+    const bool dels_on = state->stat_dels.load(memory_order_relaxed) > 0;
+    for (long i = 0; i < nq; i++) {
+        auto emit = [&](float dis, long line_num) {
+            if (dels_on && line_num < (long)state->dels.size() && state->dels[line_num])
+                return;
+            found++;
+            if (off < cap) {
+                distances[off] = dis;
+                xids[off] = ident ? line_num : state->xids[line_num];
+                off++;
+            }
+        };
+        if (has_index)
+            for (size_t j = res_index.lims[i]; j < res_index.lims[i + 1]; j++)
+                emit(res_index.distances[j], res_index.labels[j]);
+        for (size_t di = 0; di < res_deltas.size(); di++) {
+            const faiss::RangeSearchResult& rd = *res_deltas[di];
+            for (size_t j = rd.lims[i]; j < rd.lims[i + 1]; j++)
+                emit(rd.distances[j], rd.labels[j] + delta_offs[di]);
+        }
+        if (has_flat)
+            for (size_t j = res_flat.lims[i]; j < res_flat.lims[i + 1]; j++)
+                emit(res_flat.distances[j], res_flat.labels[j] + flat_start);
+        lims[i + 1] = off;
+    }
+    return found;
+}
+
+std::string VectoDB::getBaseFp() const
+{
+    ostringstream oss;
+    oss << work_dir << "/base.fvecs";
+    return oss.str();
+}
+
+std::string VectoDB::getXidsFp() const
+{
+    ostringstream oss;
+    oss << work_dir << "/base.xids";
+    return oss.str();
+}
+
+std::string VectoDB::getCountsFp() const
+{
+    ostringstream oss;
+    oss << work_dir << "/base.counts";
+    return oss.str();
+}
+
+std::string VectoDB::getNormsFp() const
+{
+    ostringstream oss;
+    oss << work_dir << "/base.norms";
+    return oss.str();
+}
+
+std::string VectoDB::getDelsFp() const
+{
+    ostringstream oss;
+    oss << work_dir << "/base.dels";
+    return oss.str();
+}
+
+std::string VectoDB::getTimesFp() const
+{
+    ostringstream oss;
+    oss << work_dir << "/base.times";
+    return oss.str();
+}
+
+std::string VectoDB::getCompactFp() const
+{
+    ostringstream oss;
+    oss << work_dir << "/COMPACT";
+    return oss.str();
+}
+
+std::string VectoDB::getVecFp() const
+{
+    ostringstream oss;
+    oss << work_dir << "/base.vec";
+    return oss.str();
+}
+
+std::string VectoDB::getVecSegFp(long k) const
+{
+    ostringstream oss;
+    oss << work_dir << "/base.vec." << k;
+    return oss.str();
+}
+
+int VectoDB::openAppendFd(const std::string& fp) const
+{
+    int fd = open(fp.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0)
+        throw fs::filesystem_error(fp, boost::system::error_code(errno, boost::system::generic_category()));
+    return fd;
+}
+
+void VectoDB::openAppender(std::fstream& fs, const std::string& fp) const
+{
+    fs.exceptions(std::ios::failbit | std::ios::badbit);
+    fs.open(fp, std::fstream::out | std::fstream::app); //create file if not exist, otherwise do nothing
+    fs.close();
+    fs.open(fp, std::fstream::in | std::fstream::out | std::fstream::binary);
+    fs.seekp(0, ios_base::end); //a particular libstdc++ implementation may use a single pointer for both seekg and seekp.
+}
+
+void VectoDB::migrateBaseV1()
+{
+    const string& fp_base = getBaseFp();
+    if (!fs::exists(fp_base) || fs::exists(getVecFp()))
+        return;
+    uint8_t* data = nullptr;
+    long len_data = 0;
+    mmapFile(fp_base, data, len_data);
+    adviseAccess(data, len_data, true); //one front-to-back migration pass
+    long nb = getNumLines(len_data, len_base_line);
+    LOG(INFO) << "Migrating " << nb << " lines of v1 " << fp_base << " to the columnar layout";
+    {
+        ofstream fs_xids(getXidsFp(), std::ofstream::binary);
+        ofstream fs_counts(getCountsFp(), std::ofstream::binary);
+        ofstream fs_vec(getVecFp(), std::ofstream::binary);
+        vector<uint8_t> enc(len_vec);
+        for (long i = 0; i < nb; i++) {
+            const char* line = (const char*)data + i * len_base_line;
+            fs_xids.write(line, sizeof(long));
+            fs_counts.write(line + sizeof(long), sizeof(long));
+            if (sq8 || binary) {
+                //v1 always stored floats, encode while migrating
+                if (sq8)
+                    sq8_encode((const float*)(line + 2 * sizeof(long)), dim, &enc[0]);
+                else
+                    bin_encode((const float*)(line + 2 * sizeof(long)), dim, &enc[0]);
+                fs_vec.write((const char*)&enc[0], len_vec);
+            } else {
+                fs_vec.write(line + 2 * sizeof(long), len_vec);
+            }
+        }
+    }
+    munmapFile(fp_base, data, len_data);
+    fs::remove(fp_base);
+}
+
+void VectoDB::migrateVecSegments()
+{
+    // splits a single-file base.vec (v2 layout) into base.vec.<k> segments.
+    // Every segment but the last holds exactly seg_lines lines, so a line
+    // number locates its segment with one division.
+    const string& fp_vec = getVecFp();
+    if (!fs::exists(fp_vec))
+        return;
+    uint8_t* data = nullptr;
+    long len_data = 0;
+    mmapFile(fp_vec, data, len_data);
+    adviseAccess(data, len_data, true); //one front-to-back migration pass
+    long nb = getNumLines(len_data, len_vec);
+    LOG(INFO) << "Migrating " << nb << " lines of single-file " << fp_vec << " to the segmented layout";
+    for (long s = 0; s < nb;) {
+        long e = std::min(nb, s + seg_lines);
+        ofstream fs_seg(getVecSegFp(s / seg_lines), std::ofstream::binary);
+        fs_seg.write((const char*)data + s * len_vec, (e - s) * len_vec);
+        s = e;
+    }
+    munmapFile(fp_vec, data, len_data);
+    fs::remove(fp_vec);
+}
+
+std::string VectoDB::getIndexFp(long ntrain) const
+{
+    ostringstream oss;
+    oss << work_dir << "/" << index_key << "." << ntrain << ".index";
+    return oss.str();
+}
+
+std::string VectoDB::getUpdateFp() const
+{
+    ostringstream oss;
+    oss << work_dir << "/update.fvecs";
+    return oss.str();
+}
+
+std::string VectoDB::getTrainedFp() const
+{
+    ostringstream oss;
+    oss << work_dir << "/" << index_key << ".trained";
+    return oss.str();
+}
+
+//returns the ntrain of the persisted trained artifacts, or 0 if there are none
+long VectoDB::readTrainedNtrain() const
+{
+    ifstream fs_nt(getTrainedFp() + ".ntrain", std::ifstream::binary);
+    if (!fs_nt)
+        return 0;
+    long nt = 0;
+    fs_nt.read((char*)&nt, sizeof(nt));
+    if (!fs_nt || !fs::exists(getTrainedFp()))
+        return 0;
+    return nt;
+}
+
+void VectoDB::writeTrained(faiss::Index* index, long nt) const
+{
+    // persist the trained-but-empty structure so later builds can skip training
+    const string& fp_trained = getTrainedFp();
+    const string fp_tmp = fp_trained + ".tmp";
+    faiss::write_index(index, fp_tmp.c_str());
+    fs::rename(fp_tmp, fp_trained);
+    ofstream fs_nt(fp_trained + ".ntrain", std::ofstream::binary | std::ofstream::trunc);
+    fs_nt.write((const char*)&nt, sizeof(nt));
+}
+
+std::string VectoDB::getManifestFp() const
+{
+    ostringstream oss;
+    oss << work_dir << "/MANIFEST";
+    return oss.str();
+}
+
+//returns recorded ntrain, or -1 if there's no (valid) manifest
+long VectoDB::readManifest() const
+{
+    ifstream fs_manifest(getManifestFp(), std::ifstream::binary);
+    if (!fs_manifest)
+        return -1;
+    Manifest m;
+    fs_manifest.read((char*)&m, sizeof(m));
+    if (!fs_manifest || m.magic != MANIFEST_MAGIC || m.version != MANIFEST_VERSION)
+        return -1;
+    return m.ntrain;
+}
+
+void VectoDB::writeManifest(long ntrain, long nbase) const
+{
+    Manifest m{ MANIFEST_MAGIC, MANIFEST_VERSION, ntrain, nbase };
+    const string& fp = getManifestFp();
+    const string fp_tmp = fp + ".tmp";
+    {
+        ofstream fs_manifest(fp_tmp, std::ofstream::binary | std::ofstream::trunc);
+        fs_manifest.write((const char*)&m, sizeof(m));
+    }
+    fs::rename(fp_tmp, fp);
+}
+
+long VectoDB::getIndexFpNtrain() const
+{
+    long max_ntrain = 0;
+    fs::path fp_index;
+    string prefix(index_key);
+    prefix.append(".");
+    const string suffix(".index");
+    for (auto ent = fs::directory_iterator(work_dir); ent != fs::directory_iterator(); ent++) {
+        const fs::path& p = ent->path();
+        if (fs::is_regular_file(p)) {
+            const string fn = p.filename().string();
+            if (fn.length() >= suffix.length()
+                && 0 == fn.compare(fn.length() - suffix.length(), suffix.length(), suffix)
+                && 0 == fn.compare(0, prefix.length(), prefix)) {
+                long ntrain = std::stol(fn.substr(prefix.length(), fn.length() - prefix.length() - suffix.length()));
+                if (ntrain > max_ntrain) {
+                    max_ntrain = ntrain;
+                    fp_index = p;
+                }
+            }
+        }
+    }
+    return max_ntrain;
+}
+
+void VectoDB::clearIndexFiles(const std::string& keep)
+{
+    static const string suffixes[] = { ".index", ".ivfdata" };
+    for (auto ent = fs::directory_iterator(work_dir); ent != fs::directory_iterator(); ent++) {
+        const fs::path& p = ent->path();
+        if (!fs::is_regular_file(p))
+            continue;
+        const string fn = p.filename().string();
+        for (const string& suffix : suffixes) {
+            if (fn.length() >= suffix.length()
+                && 0 == fn.compare(fn.length() - suffix.length(), suffix.length(), suffix)
+                && 0 != p.string().compare(0, keep.length(), keep)) {
+                fs::remove(p);
+                break;
+            }
+        }
+    }
+}
+
+// Retires the oldest retained index generation, shifts the rest one slot
+// back (.index.1 -> .index.2 ...) and hardlinks the active index file into
+// slot 1, so the rename of the new generation over it never opens a window
+// without a loadable index. Runs in the persister before that rename.
+void VectoDB::rotateIndexFiles() const
+{
+    for (long g = INDEX_RETAIN_GENS; g >= 1; g--) {
+        const string tails[] = { ".index." + std::to_string(g), ".ivfdata." + std::to_string(g) };
+        for (auto ent = fs::directory_iterator(work_dir); ent != fs::directory_iterator(); ent++) {
+            const fs::path& p = ent->path();
+            if (!fs::is_regular_file(p))
+                continue;
+            const string fn = p.filename().string();
+            for (const string& tail : tails) {
+                if (fn.length() < tail.length()
+                    || 0 != fn.compare(fn.length() - tail.length(), tail.length(), tail))
+                    continue;
+                if (g == INDEX_RETAIN_GENS)
+                    fs::remove(p);
+                else {
+                    string dst = p.string();
+                    dst.replace(dst.rfind('.') + 1, string::npos, std::to_string(g + 1));
+                    fs::rename(p, dst);
+                }
+                break;
+            }
+        }
+    }
+    long prev_nt = readManifest();
+    if (prev_nt <= 0)
+        prev_nt = getIndexFpNtrain();
+    if (prev_nt > 0 && fs::exists(getIndexFp(prev_nt))) {
+        fs::create_hard_link(getIndexFp(prev_nt), getIndexFp(prev_nt) + ".1");
+        const string fp_ivf = getIndexFp(prev_nt) + ".ivfdata";
+        if (fs::exists(fp_ivf))
+            fs::create_hard_link(fp_ivf, fp_ivf + ".1");
+    }
+}
+
+long VectoDB::mapVecSegments(vector<SegMap>& segs, bool sequential) const
+{
+    long nb = 0;
+    for (long k = 0;; k++) {
+        const string& fp = getVecSegFp(k);
+        if (!fs::exists(fp))
+            break;
+        SegMap seg{ nullptr, 0 };
+        mmapFile(fp, seg.data, seg.len);
+        if (sequential)
+            adviseAccess(seg.data, seg.len, true);
+        nb += getNumLines(seg.len, len_vec);
+        segs.push_back(seg);
+    }
+    return nb;
+}
+
+void VectoDB::unmapVecSegments(vector<SegMap>& segs) const
+{
+    for (long k = 0; k < (long)segs.size(); k++)
+        munmapFile(getVecSegFp(k), segs[k].data, segs[k].len);
+    segs.clear();
+}
+
+//locates a line within its segment: one division since full segments all
+//hold exactly seg_lines lines
+const uint8_t* VectoDB::segLine(const vector<SegMap>& segs, long line_num) const
+{
+    return segs[line_num / seg_lines].data + (line_num % seg_lines) * len_vec;
+}
+
+//counts one refine gather against the segment and the block holding
+//line_num. Caller holds the rw_data read lock, which keeps seg_heat from
+//growing underneath
+void VectoDB::noteSegAccess(long line_num) const
+{
+    long k = line_num / seg_lines;
+    if (k < (long)state->seg_heat.size()) {
+        SegHeat& heat = state->seg_heat[k];
+        heat.hits.fetch_add(1, memory_order_relaxed);
+        long b = (line_num % seg_lines) * SEG_HEAT_NBLOCK / seg_lines;
+        heat.block_hits[b].fetch_add(1, memory_order_relaxed);
+    }
+}
+
+//adjusts the shed level from one coalescer round's waiter count. Raises
+//immediately on pressure, steps down one level at a time after
+//SHED_CALM_ROUNDS consecutive calm rounds so a bursty spike doesn't flap
+//the quality. Caller shall hold m_coal.
+void VectoDB::noteCoalDepth(long depth) const
+{
+    int lvl = depth >= SHED_DEPTH_L2 ? 2 : depth >= SHED_DEPTH_L1 ? 1 : 0;
+    int cur = state->shed_level.load(memory_order_relaxed);
+    if (lvl > cur) {
+        state->shed_level.store(lvl, memory_order_relaxed);
+        state->shed_calm = 0;
+        LOG(WARNING) << "overloaded (coalescer depth " << depth << "), shedding search quality to level " << lvl;
+    } else if (lvl < cur) {
+        if (++state->shed_calm >= SHED_CALM_ROUNDS) {
+            state->shed_level.store(cur - 1, memory_order_relaxed);
+            state->shed_calm = 0;
+            LOG(INFO) << "load receded, restoring search quality to level " << (cur - 1);
+        }
+    } else if (cur != 0) {
+        state->shed_calm = 0;
+    }
+}
+
+void VectoDB::addChunked(faiss::Index* index, const vector<SegMap>& segs, long num_line, long start_num) const
+{
+    state->stat_build_phase.store(BUILD_ADD, std::memory_order_relaxed);
+    DTRACE_PROBE1(vectodb, build__phase, BUILD_ADD);
+    TraceScope trace{ "build_add", "lines", num_line - start_num };
+    state->stat_build_processed.store(0, std::memory_order_relaxed);
+    if (build_direct) {
+        // Double-buffered O_DIRECT stream: a helper thread reads the next
+        // chunk from disk while faiss digests the current one, so the build
+        // still runs at device speed without its own kernel readahead.
+        vector<float> cur, next;
+        long s = start_num;
+        long e = std::min(s + ADD_CHUNK, num_line);
+        if (readBaseDirect(e, s, cur)) {
+            bool ahead_ok = true;
+            while (s < num_line && ahead_ok) {
+                if (state->build_cancel.load(std::memory_order_relaxed)) {
+                    LOG(INFO) << "BuildIndex " << work_dir << " cancelled at " << s - start_num << " of " << num_line - start_num << " vectors added";
+                    return;
+                }
+                long s2 = e;
+                long e2 = std::min(s2 + ADD_CHUNK, num_line);
+                std::thread ahead;
+                if (s2 < num_line)
+                    ahead = std::thread([&] { ahead_ok = readBaseDirect(e2, s2, next); });
+                {
+                    // the codes this grows are the index's storage, not
+                    // build scratch: keep them out of the purged arena
+                    ArenaBinder b{ arena_index };
+                    index->add(e - s, &cur[0]);
+                }
+                state->stat_build_processed.fetch_add(e - s, std::memory_order_relaxed);
+                if (ahead.joinable())
+                    ahead.join();
+                cur.swap(next);
+                s = s2;
+                e = e2;
+            }
+            if (s >= num_line)
+                return;
+            // a mid-stream read failure resumes below on the mapping at s
+            LOG(WARNING) << "BuildIndex " << work_dir << " O_DIRECT read failed at line " << s << ", finishing on the mapped reader";
+            start_num = s;
+        } else {
+            LOG(WARNING) << "build_direct=1 but " << work_dir << " does not take O_DIRECT reads, using the mapped reader";
+        }
+    }
+    vector<float> chunk;
+    for (long s = start_num; s < num_line;) {
+        if (state->build_cancel.load(std::memory_order_relaxed)) {
+            LOG(INFO) << "BuildIndex " << work_dir << " cancelled at " << s - start_num << " of " << num_line - start_num << " vectors added";
+            return;
+        }
+        //chunks break at segment boundaries too, so plain-float adds stay zero-copy
+        long e = std::min({ s + ADD_CHUNK, num_line, (s / seg_lines + 1) * seg_lines });
+        ArenaBinder b{ arena_index }; //the grown codes are index storage, not build scratch
+        if (sq8 || binary) {
+            readBase(segs, e, s, chunk);
+            index->add(e - s, &chunk[0]);
+        } else {
+            index->add(e - s, (const float*)segLine(segs, s));
+        }
+        state->stat_build_processed.fetch_add(e - s, std::memory_order_relaxed);
+        s = e;
+    }
+}
+
+void VectoDB::readBase(const vector<SegMap>& segs, long num_line, long start_num, vector<float>& base) const
+{
+    if (segs.empty() || num_line <= start_num)
+        return;
+    long nb = num_line - start_num;
+    base.resize(nb * dim);
+    if (sq8) {
+        for (long i = 0; i < nb; i++)
+            sq8_decode(segLine(segs, start_num + i), dim, &base[i * dim]);
+    } else if (binary) {
+        for (long i = 0; i < nb; i++)
+            bin_decode(segLine(segs, start_num + i), dim, &base[i * dim]);
+    } else {
+        //lines are contiguous within a segment, one copy per spanned segment
+        for (long s = start_num; s < num_line;) {
+            long e = std::min(num_line, (s / seg_lines + 1) * seg_lines);
+            long len = (e - s) * len_vec;
+            float* dst = &base[(s - start_num) * dim];
+            if (len >= (1L << 20))
+                memcpy_stream(dst, segLine(segs, s), len);
+            else
+                memcpy(dst, segLine(segs, s), len);
+            s = e;
+        }
+    }
+}
+
+// O_DIRECT variant of readBase for the build ("build_direct=1"): streaming
+// 100GB of base through the page cache evicts the refine gather's hot pages
+// and search limps for the rest of the build. Reads bypass the cache with
+// sector-aligned offsets and buffers; readahead is the caller's job (the
+// kernel's stops at the cache it is told to skip), addChunked double-buffers
+// the chunks for that. Returns false when the filesystem refuses O_DIRECT
+// (tmpfs, some network mounts) so the caller can fall back to the mapping.
+bool VectoDB::readBaseDirect(long num_line, long start_num, vector<float>& base) const
+{
+    if (num_line <= start_num)
+        return true;
+    long nb = num_line - start_num;
+    base.resize(nb * dim);
+    void* scratch = nullptr;
+    long scratch_len = 0;
+    bool ok = true;
+    for (long s = start_num; ok && s < num_line;) {
+        long k = s / seg_lines;
+        long e = std::min(num_line, (k + 1) * seg_lines);
+        long off = (s % seg_lines) * len_vec;
+        long len = (e - s) * len_vec;
+        long a_off = off & ~(DIRECT_IO_ALIGN - 1);
+        long a_len = ((off + len + DIRECT_IO_ALIGN - 1) & ~(DIRECT_IO_ALIGN - 1)) - a_off;
+        if (a_len > scratch_len) {
+            free(scratch);
+            scratch = nullptr;
+            if (0 != posix_memalign(&scratch, DIRECT_IO_ALIGN, a_len)) {
+                LOG(ERROR) << "posix_memalign of " << a_len << " bytes failed";
+                ok = false;
+                break;
+            }
+            scratch_len = a_len;
+        }
+        int fd = open(getVecSegFp(k).c_str(), O_RDONLY | O_DIRECT);
+        if (fd < 0) {
+            ok = false; //the caller logs once and falls back to the mapping
+            break;
+        }
+        // the aligned length may run past EOF on the tail segment; O_DIRECT
+        // returns the bytes up to EOF there, which is all the span needs
+        long got = 0;
+        while (got < off - a_off + len) {
+            ssize_t r = pread(fd, (char*)scratch + got, a_len - got, a_off + got);
+            if (r <= 0) {
+                ok = false;
+                break;
+            }
+            got += r;
+        }
+        close(fd);
+        if (!ok)
+            break;
+        const uint8_t* src = (const uint8_t*)scratch + (off - a_off);
+        float* dst = &base[(s - start_num) * dim];
+        if (sq8) {
+            for (long i = 0; i < e - s; i++)
+                sq8_decode(src + i * len_vec, dim, dst + i * dim);
+        } else if (binary) {
+            for (long i = 0; i < e - s; i++)
+                bin_decode(src + i * len_vec, dim, dst + i * dim);
+        } else {
+            memcpy_stream(dst, src, len);
+        }
+        s = e;
+    }
+    free(scratch);
+    return ok;
+}
+
+void VectoDB::readXids(long num_line, long start_num, vector<long>& xids) const
+{
+    if (num_line <= start_num)
+        return;
+    long nb = num_line - start_num;
+    xids.resize(nb);
+    ifstream fs_xids(getXidsFp(), std::ifstream::binary);
+    fs_xids.seekg(start_num * sizeof(long), ios_base::beg);
+    fs_xids.read((char*)&xids[0], nb * sizeof(long));
+}
+
+//loads the base.norms column (metric L2 only): ||x||^2 per base line, the
+//cached half of the dot-product identity the scans and the refine use.
+//Older work dirs predate the column and recoverTornTails can trim the other
+//columns below a norms append; the surplus is truncated and the missing
+//suffix recomputed from the vector column, so the mirror is complete from
+//here on.
+void VectoDB::loadBaseNorms()
+{
+    long total = state->total;
+    const string& fp = getNormsFp();
+    long have = fs::exists(fp) ? (long)fs::file_size(fp) / (long)sizeof(float) : 0;
+    if (have > total) {
+        fs::resize_file(fp, total * sizeof(float));
+        have = total;
+    }
+    vector<float> norms(have);
+    if (have > 0) {
+        ifstream fs(fp, std::ifstream::binary);
+        fs.read((char*)&norms[0], have * sizeof(float));
+    }
+    if (have < total) {
+        LOG(INFO) << "Computing norms of " << (total - have) << " base lines of " << work_dir;
+        norms.resize(total);
+        vector<SegMap> segs;
+        mapVecSegments(segs, true); //one sequential backfill pass
+        vector<float> dec(dim);
+        for (long i = have; i < total; i++) {
+            const uint8_t* line = segLine(segs, i);
+            const float* v = (const float*)line;
+            if (sq8) {
+                sq8_decode(line, dim, &dec[0]);
+                v = &dec[0];
+            } else if (binary) {
+                bin_decode(line, dim, &dec[0]);
+                v = &dec[0];
+            }
+            norms[i] = faiss::fvec_norm_L2sqr(v, dim);
+        }
+        unmapVecSegments(segs);
+        writeFull(state->fd_norms, &norms[have], (total - have) * sizeof(float));
+    }
+    state->base_norms = std::move(norms);
+}
+
+//loads the base.dels tombstone column. The column is patched in place, not
+//appended, so it can be shorter than the base; missing bytes read as live.
+void VectoDB::loadDels()
+{
+    const string& fp = getDelsFp();
+    if (!fs::exists(fp))
+        return;
+    long total = state->total;
+    long have = std::min(total, (long)fs::file_size(fp));
+    vector<char> dels(have);
+    if (have > 0) {
+        ifstream fs(fp, std::ifstream::binary);
+        fs.read(&dels[0], have);
+    }
+    long n_dels = 0;
+    for (char d : dels)
+        n_dels += d;
+    if (n_dels > 0) {
+        LOG(INFO) << work_dir << " has " << n_dels << " tombstoned lines";
+        // a tombstoned xid must not resolve: a lookup hitting a dead line
+        // would resurrect it through UpdateWithIds or block its re-add
+        for (long i = 0; i < have; i++) {
+            if (!dels[i])
+                continue;
+            XidShard& shard = state->xid_shards[xidShardOf(state->xids[i])];
+            wlock w{ shard.rw };
+            auto it = shard.xid2num.find(state->xids[i]);
+            if (it != shard.xid2num.end() && it->second == i)
+                shard.xid2num.erase(it);
+        }
+    }
+    state->stat_dels.store(n_dels, std::memory_order_relaxed);
+    state->dels = std::move(dels);
+    if (readonly)
+        state->dels_mtime = fs::last_write_time(fp);
+}
+
+//loads the base.times column (ttl_sec=<n> only). Lines written before TTL was
+//enabled, or by a torn wal batch, have no timestamp; the column is padded with
+//zeros up to the line count so later appends stay aligned, and a zero exempts
+//its line from expiry until a re-add refreshes it.
+void VectoDB::loadTimes()
+{
+    const string& fp = getTimesFp();
+    long total = state->total;
+    long have = fs::exists(fp) ? (long)fs::file_size(fp) / (long)sizeof(uint32_t) : 0;
+    if (have > total) {
+        //a compaction-crash leftover cannot happen (the column is filtered
+        //with the others), but be conservative about any overlong tail
+        fs::resize_file(fp, total * sizeof(uint32_t));
+        have = total;
+    }
+    if (have < total) {
+        LOG(INFO) << work_dir << ": padding base.times with " << total - have << " exempt lines ingested before TTL was enabled";
+        ofstream fs(fp, std::ofstream::binary | std::ofstream::app);
+        vector<uint32_t> zeros(1L << 20, 0);
+        for (long s = have; s < total; s += (long)zeros.size())
+            fs.write((const char*)&zeros[0], std::min(total - s, (long)zeros.size()) * sizeof(uint32_t));
+    }
+    vector<uint32_t> times(total);
+    if (total > 0) {
+        ifstream fs(fp, std::ifstream::binary);
+        fs.read((char*)&times[0], total * sizeof(uint32_t));
+    }
+    state->times = std::move(times);
+}
+
+//completes or rolls back a compaction the process died in the middle of. The
+//marker file is the commit point: it records the segment count and line count
+//of the compacted base and is written only after every temp column is
+//complete, so with the marker present the renames just replay; without it the
+//temps are an aborted copy and are dropped. Either way the persisted index is
+//cleared — its labels may refer to either numbering — and the next build
+//recreates it.
+void VectoDB::recoverCompact()
+{
+    const string& fp_marker = getCompactFp();
+    if (fs::exists(fp_marker)) {
+        long hdr[2] = { 0, 0 }; //new segment count, new line count
+        ifstream fs_marker(fp_marker, std::ifstream::binary);
+        fs_marker.read((char*)hdr, sizeof(hdr));
+        if (fs_marker) {
+            LOG(WARNING) << "Finishing the interrupted compaction of " << work_dir << " down to " << hdr[1] << " lines";
+            for (long k = 0; k < hdr[0]; k++) {
+                const string& fp_seg = getVecSegFp(k);
+                if (fs::exists(fp_seg + ".cpt"))
+                    fs::rename(fp_seg + ".cpt", fp_seg);
+            }
+            for (long k = hdr[0]; fs::exists(getVecSegFp(k)); k++)
+                fs::remove(getVecSegFp(k));
+            for (const string& fp : { getXidsFp(), getCountsFp(), getTimesFp(), getNormsFp() }) {
+                if (fs::exists(fp + ".cpt"))
+                    fs::rename(fp + ".cpt", fp);
+            }
+            fs::remove(getDelsFp());
+            fs::remove(getUpdateFp()); //its line numbers are the old numbering
+            clearIndexFiles("");
+            writeManifest(0, hdr[1]);
+        }
+        fs::remove(fp_marker);
+    }
+    //temps from a copy that never reached the commit point
+    for (auto ent = fs::directory_iterator(work_dir); ent != fs::directory_iterator(); ent++) {
+        const fs::path& p = ent->path();
+        if (fs::is_regular_file(p) && p.extension() == ".cpt") {
+            LOG(WARNING) << "Removing the aborted compaction temp " << p.string();
+            fs::remove(p);
+        }
+    }
+}
+
+void VectoDB::ClearWorkDir(const char* work_dir)
+{
+    fs::create_directories(work_dir);
+    static const char* fns[] = { "base.fvecs", "base.xids", "base.counts", "base.norms", "base.dels", "base.times", "base.vec", "update.fvecs", "MANIFEST", "COMPACT" };
+    for (auto fn : fns) {
+        ostringstream oss;
+        oss << work_dir << "/" << fn;
+        fs::remove(oss.str());
+    }
+
+    static const string seg_prefix = "base.vec.";
+    static const string suffixes[] = { ".index", ".ivfdata", ".trained", ".ntrain" };
+    for (auto ent = fs::directory_iterator(work_dir); ent != fs::directory_iterator(); ent++) {
+        const fs::path& p = ent->path();
+        if (!fs::is_regular_file(p))
+            continue;
+        const string fn = p.filename().string();
+        if (0 == fn.compare(0, seg_prefix.length(), seg_prefix)) {
+            fs::remove(p);
+            continue;
+        }
+        for (const string& suffix : suffixes) {
+            if (fn.length() >= suffix.length()
+                && 0 == fn.compare(fn.length() - suffix.length(), suffix.length(), suffix)) {
+                fs::remove(p);
+                break;
+            }
+        }
+    }
+}
+
+long VectoDB::GetEvtLogDropped()
+{
+    return evt_dropped.load(memory_order_relaxed);
+}
+
+void VectoDB::Normalize(std::vector<float>& vec)
+{
+    double l = 0;
+    int dim = vec.size();
+    for (int i = 0; i < dim; i++) {
+        l += double(vec[i]) * double(vec[i]);
+    }
+    l = sqrt(l);
+    for (int i = 0; i < dim; i++) {
+        vec[i] = (float)(((double)vec[i]) / l);
+    }
+}
+
+void VectoDB::NormalizeBatch(long nb, long dim, float* xb)
+{
+    // one vectorized renorm pass; chunked across the team so large ingest
+    // batches run at memory bandwidth instead of one core's
+#pragma omp parallel for schedule(static)
+    for (long s = 0; s < nb; s += 4096) {
+        long e = std::min(nb, s + 4096);
+        faiss::fvec_renorm_L2(dim, e - s, xb + s * dim);
+    }
+}
+
+void VectoDB::TraceStart()
+{
+    trace_head.store(0, memory_order_relaxed);
+    trace_on.store(true, memory_order_release);
+    LOG(INFO) << "trace recording started, ring of " << TRACE_RING_CAP << " spans";
+}
+
+void VectoDB::TraceStop()
+{
+    trace_on.store(false, memory_order_release);
+}
+
+long VectoDB::TraceDump(const char* fp)
+{
+    // stop first: the dump walks the ring and a live writer could tear a
+    // slot under it. The caller restarts recording when it wants more.
+    trace_on.store(false, memory_order_release);
+    const long h = trace_head.load(memory_order_acquire);
+    const long n = std::min(h, TRACE_RING_CAP);
+    ofstream os(fp, std::ofstream::trunc);
+    if (!os) {
+        LOG(ERROR) << "TraceDump cannot open " << fp;
+        return -1;
+    }
+    const long pid = (long)getpid();
+    long emitted = 0;
+    os << "{\"traceEvents\":[";
+    for (long i = h - n; i < h; i++) {
+        const TraceSpan& s = trace_ring[i & (TRACE_RING_CAP - 1)];
+        if (s.name == nullptr || s.us_end < s.us_begin)
+            continue;
+        if (emitted++ > 0)
+            os << ",";
+        os << "\n{\"name\":\"" << s.name << "\",\"ph\":\"X\",\"pid\":" << pid
+           << ",\"tid\":" << s.tid << ",\"ts\":" << s.us_begin
+           << ",\"dur\":" << s.us_end - s.us_begin << ",\"args\":{";
+        if (s.k1 != nullptr)
+            os << "\"" << s.k1 << "\":" << s.a1;
+        if (s.k2 != nullptr)
+            os << (s.k1 != nullptr ? "," : "") << "\"" << s.k2 << "\":" << s.a2;
+        os << "}}";
+    }
+    os << "\n]}\n";
+    LOG(INFO) << "TraceDump " << fp << ": " << emitted << " spans";
+    return emitted;
+}
+
+void VectoDB::recoverTornTails() const
+{
+    // A crash can leave a torn tail in any column, and the columns can
+    // disagree on the line count (the wal thread appends xids first). The
+    // columnar layout is fixed-stride, so the last complete row is exact
+    // from the file sizes alone; truncate everything down to it, then the
+    // shard serves without operator action.
+    struct Col {
+        string fp;
+        long len_line;
+    };
+    const Col cols[] = {
+        { getXidsFp(), (long)sizeof(long) },
+        { getCountsFp(), (long)sizeof(long) },
+    };
+    long nsegs = 0;
+    while (fs::exists(getVecSegFp(nsegs)))
+        nsegs++;
+    if (nsegs == 0)
+        return; //fresh work_dir, nothing to repair
+    for (const Col& c : cols) {
+        if (!fs::exists(c.fp))
+            return;
+    }
+    // the vec column is full segments ahead of one (possibly short) tail. A
+    // short segment followed by later ones means a crash tore the rollover;
+    // the later segments can only duplicate lines the wal re-appends, drop them.
+    long nlines = 0;
+    for (long k = 0; k < nsegs; k++) {
+        long lines = std::min(seg_lines, (long)fs::file_size(getVecSegFp(k)) / len_vec);
+        nlines += lines;
+        if (lines < seg_lines && k + 1 < nsegs) {
+            for (long j = nsegs - 1; j > k; j--) {
+                LOG(WARNING) << "recovery work_dir=" << work_dir << " file=" << getVecSegFp(j) << " removed, it follows the short segment " << getVecSegFp(k);
+                fs::remove(getVecSegFp(j));
+            }
+            nsegs = k + 1;
+        }
+    }
+    for (const Col& c : cols)
+        nlines = std::min(nlines, (long)fs::file_size(c.fp) / c.len_line);
+    for (const Col& c : cols) {
+        long sz = (long)fs::file_size(c.fp);
+        long keep = nlines * c.len_line;
+        if (sz != keep) {
+            LOG(WARNING) << "recovery work_dir=" << work_dir << " file=" << c.fp << " size=" << sz << " truncated_to=" << keep << " torn_bytes=" << sz - keep;
+            fs::resize_file(c.fp, keep);
+        }
+    }
+    // trim the vec column down to nlines: drop whole trailing segments, then
+    // resize the boundary one to the last complete line
+    long kb = (nlines == 0) ? 0 : (nlines - 1) / seg_lines;
+    for (long j = nsegs - 1; j > kb; j--) {
+        LOG(WARNING) << "recovery work_dir=" << work_dir << " file=" << getVecSegFp(j) << " removed, the xids/counts columns end at line " << nlines;
+        fs::remove(getVecSegFp(j));
+    }
+    long sz = (long)fs::file_size(getVecSegFp(kb));
+    long keep = (nlines - kb * seg_lines) * len_vec;
+    if (sz != keep) {
+        LOG(WARNING) << "recovery work_dir=" << work_dir << " file=" << getVecSegFp(kb) << " size=" << sz << " truncated_to=" << keep << " torn_bytes=" << sz - keep;
+        fs::resize_file(getVecSegFp(kb), keep);
+    }
+    const string& fp_upd = getUpdateFp();
+    if (fs::exists(fp_upd)) {
+        long sz = (long)fs::file_size(fp_upd);
+        long keep = (sz / len_upd_line) * len_upd_line;
+        if (sz != keep) {
+            LOG(WARNING) << "recovery work_dir=" << work_dir << " file=" << fp_upd << " size=" << sz << " truncated_to=" << keep << " torn_bytes=" << sz - keep;
+            fs::resize_file(fp_upd, keep);
+        }
+    }
+}
+
+long VectoDB::getNumLines(long len_data, long len_base_line) const
+{
+    long nb = len_data / len_base_line;
+    long remained = len_data - len_base_line * nb;
+    if (remained != 0) {
+        LOG(ERROR) << "file fize could end with partial line. file size " << len_data << ", len_base_line " << len_base_line << ", nb " << nb << ", remained " << remained << ".";
+    }
+    return nb;
+}
+
+void VectoDB::mmapFile(const string& fp, uint8_t*& data, long& len_data)
+{
+    munmapFile(fp, data, len_data);
+    long len_f = fs::file_size(fp); //equivalent to "fs_base.seekp(0, ios_base::end); long len_f = fs_base.tellp();"
+    if (len_f == 0)
+        return;
+    int f = open(fp.c_str(), O_RDONLY);
+    void* tmpd = mmap(NULL, len_f, PROT_READ, MAP_SHARED, f, 0);
+    if (tmpd == MAP_FAILED)
+        throw fs::filesystem_error(fp, boost::system::error_code(errno, boost::system::generic_category()));
+    close(f);
+    //madvise takes a single advice value, not a mask
+    int rc = madvise(tmpd, len_f, MADV_RANDOM);
+    if (rc == 0)
+        rc = madvise(tmpd, len_f, MADV_DONTDUMP);
+    if (rc < 0)
+        LOG(ERROR) << "madvise failed with " << strerror(errno);
+    data = (uint8_t*)tmpd;
+    len_data = len_f;
+}
+
+void VectoDB::applyMappingOptions(uint8_t* data, long len, long mlock_len) const
+{
+    if (data == nullptr || len <= 0)
+        return;
+    if (huge_pages) {
+#ifdef MADV_HUGEPAGE
+        int rc = madvise(data, len, MADV_HUGEPAGE);
+        if (rc < 0)
+            LOG(ERROR) << "madvise(MADV_HUGEPAGE) failed with " << strerror(errno);
+#else
+        LOG(WARNING) << "hugepage=1 requested but MADV_HUGEPAGE is unavailable on this platform";
+#endif
+    }
+    if (mlock_len > 0) {
+        //lock the front of the base, where the hottest lines live
+        long n = std::min(mlock_len, len);
+        if (mlock(data, n) < 0)
+            LOG(WARNING) << "mlock of first " << n << " bytes failed with " << strerror(errno) << " (check RLIMIT_MEMLOCK)";
+    }
+}
+
+void VectoDB::GetMappingStats(long& mapped_bytes, long& resident_bytes) const
+{
+    mapped_bytes = 0;
+    resident_bytes = 0;
+    rlock r{ state->rw_data };
+    long page = sysconf(_SC_PAGESIZE);
+    const long chunk_pages = 1L << 20; //mincore 1M pages (4GB of mapping) at a time
+    vector<unsigned char> vec(chunk_pages);
+    for (const SegMap& seg : state->seg_maps) {
+        if (seg.data == nullptr || seg.len <= 0)
+            continue;
+        mapped_bytes += seg.len;
+        long npages = (seg.len + page - 1) / page;
+        for (long p0 = 0; p0 < npages; p0 += chunk_pages) {
+            long np = std::min(chunk_pages, npages - p0);
+            long len = std::min(np * page, seg.len - p0 * page);
+            if (mincore(seg.data + p0 * page, len, vec.data()) < 0) {
+                LOG(ERROR) << "mincore failed with " << strerror(errno);
+                return;
+            }
+            for (long i = 0; i < np; i++)
+                resident_bytes += (vec[i] & 1) ? page : 0;
+        }
+    }
+    resident_bytes = std::min(resident_bytes, mapped_bytes);
+}
+
+void VectoDB::Snapshot(const char* dst_work_dir)
+{
+    drainWal(); //every accepted add is in the column files once the queue drains
+    fs::path dst{ fs::absolute(dst_work_dir) };
+    fs::create_directories(dst);
+    auto linkOrCopy = [&dst](const string& fp) {
+        const fs::path to = dst / fs::path(fp).filename();
+        try {
+            fs::create_hard_link(fp, to); //same filesystem: O(1) and zero bytes
+        } catch (fs::filesystem_error&) {
+            fs::copy_file(fp, to, fs::copy_option::overwrite_if_exists); //dst on another filesystem
+        }
+    };
+    auto copy = [&dst](const string& fp) {
+        fs::copy_file(fp, dst / fs::path(fp).filename(), fs::copy_option::overwrite_if_exists);
+    };
+    mtxlock m{ state->m_base }; //holds off wal appends, activation and other snapshots
+    mtxlock m2{ state->m_base2 }; //and the random writes of an UpdateBase replay
+    // the index persister retires files with rename/remove; wait it out so
+    // the directory scan below sees a stable set
+    if (state->persist_thread.joinable())
+        state->persist_thread.join();
+    LOG(INFO) << "Snapshotting " << work_dir << " to " << dst.string();
+    // full segments are immutable, hardlink them; the tail and the small
+    // column files are copied while m_base blocks appends
+    for (long k = 0; k + 1 < state->vec_nsegs; k++)
+        linkOrCopy(getVecSegFp(k));
+    copy(getVecSegFp(state->vec_nsegs - 1));
+    copy(getXidsFp());
+    copy(getCountsFp());
+    if (fs::exists(getTimesFp()))
+        copy(getTimesFp());
+    if (fs::exists(getNormsFp()))
+        copy(getNormsFp());
+    if (fs::exists(getDelsFp())) {
+        //the tombstone column goes through a buffered stream too; m_base2 is
+        //held, so the flush races no writer
+        if (!readonly)
+            state->fs_dels2.flush();
+        copy(getDelsFp());
+    }
+    // index files, trained artifacts and the manifest land by atomic rename,
+    // so every inode linked here is complete. An .ivfdata a concurrent
+    // BuildIndex is still filling has no .index referring to it yet; the
+    // snapshot may carry it as an orphan the opener ignores.
+    static const string suffixes[] = { ".index", ".ivfdata", ".trained", ".ntrain" };
+    for (auto ent = fs::directory_iterator(work_dir); ent != fs::directory_iterator(); ent++) {
+        const fs::path& p = ent->path();
+        if (!fs::is_regular_file(p))
+            continue;
+        const string fn = p.filename().string();
+        for (const string& suffix : suffixes) {
+            if (fn.length() >= suffix.length()
+                && 0 == fn.compare(fn.length() - suffix.length(), suffix.length(), suffix)) {
+                linkOrCopy(p.string());
+                break;
+            }
+        }
+    }
+    if (fs::exists(getManifestFp()))
+        copy(getManifestFp());
+    {
+        //the update backlog goes through a buffered stream; spill the
+        //coalescing table and flush before copying
+        mtxlock u{ state->m_update };
+        updSpillLocked();
+        state->fs_update.flush();
+        copy(getUpdateFp());
+    }
+    LOG(INFO) << "Snapshot of " << work_dir << " to " << dst.string() << " done";
+    evtFlushAsync();
+}
+
+long VectoDB::ReadBaseTail(long start_line, long max_lines, float* xb, long* xids)
+{
+    if (start_line < 0 || max_lines <= 0)
+        return 0;
+    vector<SegMap> segs;
+    long nb = mapVecSegments(segs, true); //a tail ship reads sequentially
+    // ship only lines complete in every column; a tail torn between the
+    // columns is recovered locally, never replicated
+    if (fs::exists(getXidsFp()))
+        nb = std::min(nb, (long)fs::file_size(getXidsFp()) / (long)sizeof(long));
+    else
+        nb = 0;
+    long end = std::min(nb, start_line + max_lines);
+    long n = end - start_line;
+    if (n > 0) {
+        vector<float> vec;
+        readBase(segs, end, start_line, vec);
+        memcpy(xb, &vec[0], n * dim * sizeof(float));
+        vector<long> x;
+        readXids(end, start_line, x);
+        memcpy(xids, &x[0], n * sizeof(long));
+    }
+    unmapVecSegments(segs);
+    return n > 0 ? n : 0;
+}
+
+long VectoDB::ReadPatchedTail(long start_idx, long max_lines, long* lines, long* counts, float* xb, long* xids)
+{
+    if (start_idx < 0 || max_lines <= 0)
+        return 0;
+    long n = 0;
+    {
+        rlock r{ state->rw_xids };
+        n = std::min(max_lines, (long)state->repl_patched.size() - start_idx);
+        if (n <= 0)
+            return 0;
+        for (long i = 0; i < n; i++) {
+            lines[i] = state->repl_patched[start_idx + i];
+            xids[i] = state->xids[lines[i]];
+        }
+    }
+    // the record carries current content, so re-applying is idempotent and a
+    // line patched again before the ship simply arrives at its newest state
+    vector<SegMap> segs;
+    mapVecSegments(segs, false); //patched lines scatter across the base
+    ifstream fs_counts(getCountsFp(), std::ifstream::binary);
+    for (long i = 0; i < n; i++) {
+        const uint8_t* vec_line = segLine(segs, lines[i]);
+        if (sq8)
+            sq8_decode(vec_line, dim, &xb[i * dim]);
+        else if (binary)
+            bin_decode(vec_line, dim, &xb[i * dim]);
+        else
+            memcpy(&xb[i * dim], vec_line, len_vec);
+        fs_counts.seekg(lines[i] * (long)sizeof(long), ios_base::beg);
+        fs_counts.read((char*)&counts[i], sizeof(long));
+    }
+    unmapVecSegments(segs);
+    return n;
+}
+
+long VectoDB::ApplyPatch(long n, const long* lines, const long* counts, const float* xb)
+{
+    if (readonly) {
+        LOG(ERROR) << work_dir << " is opened readonly, rejecting ApplyPatch; writes belong to the writer node";
+        return 0;
+    }
+    if (n <= 0)
+        return 0;
+    mtxlock del{ state->m_del }; //a concurrent CompactBase would renumber the lines this patch targets
+    vector<long> upd_lines;
+    vector<float> upd_old, upd_new;
+    {
+        mtxlock m{ state->m_base2 };
+        vector<SegMap> segs;
+        long nb = mapVecSegments(segs, false);
+        vector<uint8_t> enc(len_vec);
+        std::fstream fs_vec2;
+        fs_vec2.exceptions(std::ios::failbit | std::ios::badbit);
+        long cur_seg = -1;
+        for (long i = 0; i < n; i++) {
+            long line_num = lines[i];
+            if (line_num < 0 || line_num >= nb)
+                continue; //not appended here yet, the append ship carries the patched content
+            const uint8_t* vec_line = segLine(segs, line_num);
+            upd_lines.push_back(line_num);
+            if (sq8 || binary) {
+                upd_old.resize(upd_old.size() + dim);
+                if (sq8)
+                    sq8_decode(vec_line, dim, &upd_old[upd_old.size() - dim]);
+                else
+                    bin_decode(vec_line, dim, &upd_old[upd_old.size() - dim]);
+            } else
+                upd_old.insert(upd_old.end(), (const float*)vec_line, (const float*)vec_line + dim);
+            upd_new.insert(upd_new.end(), &xb[i * dim], &xb[i * dim] + dim);
+            long k = line_num / seg_lines;
+            if (k != cur_seg) {
+                if (cur_seg >= 0) {
+                    fs_vec2.flush();
+                    fs_vec2.close();
+                }
+                fs_vec2.open(getVecSegFp(k), std::fstream::in | std::fstream::out | std::fstream::binary);
+                cur_seg = k;
+            }
+            fs_vec2.seekp((line_num % seg_lines) * len_vec, ios_base::beg);
+            if (sq8 || binary) {
+                if (sq8)
+                    sq8_encode(&xb[i * dim], dim, &enc[0]);
+                else
+                    bin_encode(&xb[i * dim], dim, &enc[0]);
+                fs_vec2.write((const char*)&enc[0], len_vec);
+            } else
+                fs_vec2.write((const char*)&xb[i * dim], len_vec);
+            long cnt = counts[i];
+            state->fs_counts2.seekp(line_num * (long)sizeof(long), ios_base::beg);
+            state->fs_counts2.write((const char*)&cnt, sizeof(long));
+            if (metric_type == 1) {
+                float nrm = faiss::fvec_norm_L2sqr(&xb[i * dim], dim);
+                state->fs_norms2.seekp(line_num * (long)sizeof(float), ios_base::beg);
+                state->fs_norms2.write((const char*)&nrm, sizeof(float));
+            }
+        }
+        state->fs_counts2.flush();
+        if (metric_type == 1)
+            state->fs_norms2.flush();
+        if (cur_seg >= 0)
+            fs_vec2.flush();
+        unmapVecSegments(segs);
+    }
+    if (upd_lines.empty())
+        return 0;
+    {
+        wlock w{ state->rw_xids };
+        if (metric_type == 1)
+            for (size_t i = 0; i < upd_lines.size(); i++)
+                state->base_norms[upd_lines[i]] = faiss::fvec_norm_L2sqr(&upd_new[i * dim], dim);
+        //a chained standby re-ships what it applied
+        state->repl_patched.insert(state->repl_patched.end(), upd_lines.begin(), upd_lines.end());
+    }
+    long failed = patchIndexTiers(upd_lines, upd_old, upd_new);
+    if (failed > 0)
+        LOG(INFO) << "ApplyPatch " << work_dir << ": " << failed << " of " << upd_lines.size() << " lines not patchable in place, a rebuild is still due";
+    state->rcache_epoch.fetch_add(1, memory_order_release);
+    evtFlushAsync();
+    return (long)upd_lines.size();
+}
+
+long VectoDB::Warmup(int budget_mbps)
+{
+    using namespace std::chrono;
+    const long page = sysconf(_SC_PAGESIZE);
+    const long chunk = 8L << 20; //throttle granularity
+    long touched = 0;
+    volatile unsigned long sink = 0; //defeats dead-load elimination
+    auto t0 = steady_clock::now();
+    // touch one byte per page; after each chunk sleep up to the point the
+    // byte budget allows, so faulting competes with serving at a bounded rate
+    auto touchRange = [&](const uint8_t* p, long len) {
+        if (p == nullptr || len <= 0)
+            return;
+        for (long off = 0; off < len;) {
+            long e = std::min(len, off + chunk);
+            for (long o = off; o < e; o += page)
+                sink += p[o];
+            touched += e - off;
+            if (budget_mbps > 0)
+                std::this_thread::sleep_until(t0 + microseconds(touched * 1000000L / ((long)budget_mbps << 20)));
+            off = e;
+        }
+    };
+    LOG(INFO) << "Warmup " << work_dir << " at " << budget_mbps << " MB/s";
+    {
+        rlock r{ state->rw_index };
+        faiss::IndexIVF* ivf = dynamic_cast<faiss::IndexIVF*>(innerIndex(state->index));
+        if (ivf != nullptr) {
+            //quantizer centroids first, every query touches them
+            faiss::IndexFlat* quant = dynamic_cast<faiss::IndexFlat*>(ivf->quantizer);
+            if (quant != nullptr)
+                touchRange((const uint8_t*)quant->xb.data(), (long)quant->xb.size() * sizeof(float));
+            //then every inverted list. For mapped lists (ondisk=1, mmap=1)
+            //this is the paced page-in; for in-RAM lists it prefills the TLB
+            //and takes the first-touch misses off the query path.
+            for (size_t l = 0; l < ivf->nlist; l++) {
+                size_t sz = ivf->invlists->list_size(l);
+                if (sz == 0)
+                    continue;
+                touchRange(ivf->invlists->get_codes(l), (long)(sz * ivf->invlists->code_size));
+                touchRange((const uint8_t*)ivf->invlists->get_ids(l), (long)(sz * sizeof(faiss::Index::idx_t)));
+            }
+        }
+    }
+    {
+        rlock r{ state->rw_flat };
+        faiss::IndexFlat* flat = dynamic_cast<faiss::IndexFlat*>(state->flat);
+        if (flat != nullptr)
+            touchRange((const uint8_t*)flat->xb.data(), (long)flat->xb.size() * sizeof(float));
+        IndexFlat16* f16 = dynamic_cast<IndexFlat16*>(state->flat);
+        if (f16 != nullptr)
+            touchRange((const uint8_t*)f16->xb16.data(), (long)f16->xb16.size() * sizeof(uint16_t));
+        IndexFlatSQ8* f8 = dynamic_cast<IndexFlatSQ8*>(state->flat);
+        if (f8 != nullptr)
+            touchRange(f8->xb8.data(), (long)f8->xb8.size());
+        IndexFlatBlk* fb = dynamic_cast<IndexFlatBlk*>(state->flat);
+        if (fb != nullptr)
+            touchRange((const uint8_t*)fb->xbb.data(), (long)fb->xbb.size() * sizeof(float));
+    }
+    {
+        //base segments front to back, so the mlock'd hot-front region and the
+        //oldest (most-referenced) lines arrive first
+        rlock r{ state->rw_data };
+        for (const SegMap& seg : state->seg_maps)
+            touchRange(seg.data, seg.len);
+    }
+    (void)sink;
+    state->stat_warmed.store(true, std::memory_order_relaxed);
+    LOG(INFO) << "Warmup " << work_dir << " done, " << touched << " bytes in "
+              << duration_cast<milliseconds>(steady_clock::now() - t0).count() << " ms";
+    evtFlushAsync();
+    return touched;
+}
+
+bool VectoDB::IsWarm() const
+{
+    return state->stat_warmed.load(std::memory_order_relaxed);
+}
+
+void VectoDB::adviseAccess(uint8_t* data, long len, bool sequential)
+{
+    if (data == nullptr || len <= 0)
+        return;
+    long page = sysconf(_SC_PAGESIZE);
+    uintptr_t beg = (uintptr_t)data & ~(uintptr_t)(page - 1);
+    long len_adj = len + (long)((uintptr_t)data - beg);
+    int rc;
+    if (sequential) {
+        rc = madvise((void*)beg, len_adj, MADV_SEQUENTIAL);
+        if (rc == 0)
+            rc = madvise((void*)beg, len_adj, MADV_WILLNEED);
+    } else {
+        rc = madvise((void*)beg, len_adj, MADV_RANDOM);
+    }
+    if (rc < 0)
+        LOG(ERROR) << "madvise failed with " << strerror(errno);
+}
+
+void VectoDB::munmapFile(const string& fp, uint8_t*& data, long& len_data)
+{
+    if (data != nullptr) {
+        int rc = munmap(data, len_data);
+        if (rc < 0)
+            throw fs::filesystem_error(fp, boost::system::error_code(errno, boost::system::generic_category()));
+        data = nullptr;
+        len_data = 0;
+    }
+}
+
+/**
+ * C wrappers.
+ */
+
+void* VectodbNew(char* work_dir, long dim, int metric_type, char* index_key, char* query_params, float dist_threshold)
+{
+    VectoDB* vdb = new VectoDB(work_dir, dim, metric_type, index_key, query_params, dist_threshold);
+    return vdb;
+}
+
+void VectodbDelete(void* vdb)
+{
+    delete static_cast<VectoDB*>(vdb);
+}
+
+void* VectodbBuildIndex(void* vdb, long cur_ntrain, long cur_nsize, long* ntrain)
+{
+    faiss::Index* index = nullptr;
+    static_cast<VectoDB*>(vdb)->BuildIndex(cur_ntrain, cur_nsize, index, *ntrain);
+    return index;
+}
+
+void* VectodbTryBuildIndex(void* vdb, long cur_ntrain, long cur_nsize, long* ntrain, long* ran)
+{
+    faiss::Index* index = nullptr;
+    *ran = static_cast<VectoDB*>(vdb)->TryBuildIndex(cur_ntrain, cur_nsize, index, *ntrain) ? 1 : 0;
+    return index;
+}
+
+void VectodbGetBuildProgress(void* vdb, long* phase, long* processed)
+{
+    static_cast<VectoDB*>(vdb)->GetBuildProgress(*phase, *processed);
+}
+
+void VectodbCancelBuild(void* vdb)
+{
+    static_cast<VectoDB*>(vdb)->CancelBuild();
+}
+
+long VectodbBuildDeltaIndex(void* vdb)
+{
+    return static_cast<VectoDB*>(vdb)->BuildDeltaIndex();
+}
+
+void VectodbAddWithIds(void* vdb, long nb, float* xb, long* xids)
+{
+    static_cast<VectoDB*>(vdb)->AddWithIds(nb, xb, xids);
+}
+
+long VectodbBulkLoad(void* vdb, char* fp_fvecs, long* xids)
+{
+    return static_cast<VectoDB*>(vdb)->BulkLoad(fp_fvecs, xids);
+}
+
+void VectodbUpdateWithIds(void* vdb, long nb, float* xb, long* xids)
+{
+    static_cast<VectoDB*>(vdb)->UpdateWithIds(nb, xb, xids);
+}
+
+long VectodbUpdateBasePatched(void* vdb, long* patched)
+{
+    return static_cast<VectoDB*>(vdb)->UpdateBase(patched);
+}
+
+void VectodbUpsertWithIds(void* vdb, long nb, float* xb, long* xids)
+{
+    static_cast<VectoDB*>(vdb)->UpsertWithIds(nb, xb, xids);
+}
+
+long VectodbUpdateBase(void* vdb)
+{
+    return static_cast<VectoDB*>(vdb)->UpdateBase();
+}
+
+long VectodbDeleteWithIds(void* vdb, long nb, long* xids)
+{
+    return static_cast<VectoDB*>(vdb)->DeleteWithIds(nb, xids);
+}
+
+long VectodbCompactBase(void* vdb)
+{
+    return static_cast<VectoDB*>(vdb)->CompactBase();
+}
+
+long VectodbSweepExpired(void* vdb)
+{
+    return static_cast<VectoDB*>(vdb)->SweepExpired();
+}
+
+long VectodbGetTotal(void* vdb)
+{
+    return static_cast<VectoDB*>(vdb)->GetTotal();
+}
+
+long VectodbGetFlatSize(void* vdb)
+{
+    return static_cast<VectoDB*>(vdb)->GetFlatSize();
+}
+
+long VectodbGetUpdateSize(void* vdb)
+{
+    return static_cast<VectoDB*>(vdb)->GetUpdateSize();
+}
+
+long VectodbGetWalQueueDepth(void* vdb)
+{
+    return static_cast<VectoDB*>(vdb)->GetWalQueueDepth();
+}
+
+long VectodbGetDeletedSize(void* vdb)
+{
+    return static_cast<VectoDB*>(vdb)->GetDeletedSize();
+}
+
+void VectodbGetStats(void* vdb, long* total, long* flat_size, long* index_ntrain, long* index_size, long* update_size, long* building)
+{
+    static_cast<VectoDB*>(vdb)->GetStats(*total, *flat_size, *index_ntrain, *index_size, *update_size, *building);
+}
+
+void VectodbActivateIndex(void* vdb, void* index, long ntrain)
+{
+    static_cast<VectoDB*>(vdb)->ActivateIndex(static_cast<faiss::Index*>(index), ntrain);
+}
+
+void VectodbGetIndexSize(void* vdb, long* ntrain, long* ntotal)
+{
+    static_cast<VectoDB*>(vdb)->GetIndexSize(*ntrain, *ntotal);
+}
 
-    faiss::Index* flat = new faiss::IndexFlat(dim, metric_type == 0 ? faiss::METRIC_INNER_PRODUCT : faiss::METRIC_L2);
-    vector<float> base;
-    readBase(state->data, nb, index_size, base);
-    flat->add(base.size() / dim, &base[0]);
+long VectodbSearch(void* vdb, long nq, float* xq, float* distances, long* xids)
+{
+    return static_cast<VectoDB*>(vdb)->Search(nq, xq, distances, xids);
+}
 
-    wlock l{ state->rw_flat };
-    delete state->flat;
-    state->flat = flat;
-    state->flat_start_num = index_size;
+long VectodbMultiSearch(void** vdbs, long nvdb, long nq, float* xq, float* distances, long* xids)
+{
+    return VectoDB::MultiSearch(nvdb, (VectoDB* const*)vdbs, nq, xq, distances, xids);
 }
 
-void VectoDB::GetIndexSize(long& ntrain, long& nsize) const
+long VectodbSearchDeadline(void* vdb, long nq, float* xq, long deadline_unix_us, float* distances, long* xids, long* partial)
 {
-    rlock r{ state->rw_index };
-    if (state->index == nullptr) {
-        ntrain = 0;
-        nsize = 0;
-    } else {
-        ntrain = state->ntrain;
-        nsize = state->index->ntotal;
-    }
+    return static_cast<VectoDB*>(vdb)->SearchDeadline(nq, xq, deadline_unix_us, distances, xids, partial);
 }
 
-long VectoDB::GetTotal()
+long VectodbSearchKnn(void* vdb, long nq, long k, float* xq, float* distances, long* xids)
 {
-    rlock l{ state->rw_flat };
-    return state->total;
+    return static_cast<VectoDB*>(vdb)->SearchKnn(nq, k, xq, distances, xids);
 }
 
-long VectoDB::GetFlatSize()
+long VectodbSearchKnnWithParams(void* vdb, long nq, long k, float* xq, char* params, float* distances, long* xids)
 {
-    rlock l{ state->rw_flat };
-    long nflat = state->flat->ntotal;
-    return nflat;
+    return static_cast<VectoDB*>(vdb)->SearchKnnWithParams(nq, k, xq, params, distances, xids);
 }
 
-void VectoDB::AddWithIds(long nb, const float* xb, const long* xids)
+long VectodbSearchRange(void* vdb, long nq, float* xq, float radius, long cap, float* distances, long* xids, long* lims)
 {
-    long len_buf = nb * len_base_line;
-    std::vector<char> buf(len_buf);
-    for (long i = 0; i < nb; i++) {
-        *(long*)&buf[i * len_base_line] = xids[i];
-        *(long*)&buf[i * len_base_line + sizeof(long)] = 1;
-        memcpy(&buf[i * len_base_line + 2 * sizeof(long)], &xb[i * dim], len_vec);
-    }
-    // deduplicate xids
-    {
-        rlock r{ state->rw_xids };
-        if (state->xid2num.count(xids[0]) > 0)
-            return;
-    }
-    mtxlock m{ state->m_base };
-    state->fs_base.write(&buf[0], len_buf);
-    long ntotal = state->total.fetch_add(nb);
-    {
-        wlock w1{ state->rw_flat };
-        wlock w2{ state->rw_xids };
-        state->flat->add(nb, xb);
-        for (long i = 0; i < nb; i++) {
-            state->xids.push_back(xids[i]);
-            state->xid2num[xids[i]] = ntotal + i;
-        }
-    }
+    return static_cast<VectoDB*>(vdb)->SearchRange(nq, xq, radius, cap, distances, xids, lims);
 }
 
-void VectoDB::UpdateWithIds(long nb, const float* xb, const long* xids)
+/**
+ * Result-lease pool backing the Leased search variants. Copying large result
+ * arrays from C to Go per call doubles the memory traffic of analytics jobs
+ * that consume millions of results; instead the engine fills pooled C-owned
+ * buffers and the caller reads them in place until it releases the lease.
+ * Released buffers are recycled through a bounded free list; oversized
+ * outliers are freed rather than pooled.
+ */
+namespace {
+struct ResultLease {
+    float* distances;
+    long* xids;
+    long* lims;
+    long res_cap; //capacity of distances and xids, in results
+    long lims_cap; //capacity of lims, in entries
+};
+
+std::mutex mtx_leases;
+std::vector<ResultLease*> free_leases;
+const size_t MAX_POOLED_LEASES = 16;
+const long MAX_POOLED_RES_CAP = 64L << 20; //released buffers beyond this are freed, not pooled
+
+void freeLease(ResultLease* l)
 {
-    long len_buf = nb * len_upd_line;
-    std::vector<char> buf(len_buf);
-    int pos = 0;
-    mtxlock m{ state->m_update };
-    {
-        rlock r{ state->rw_xids };
-        auto end = state->xid2num.end();
-        for (long i = 0; i < nb; i++) {
-            auto it = state->xid2num.find(xids[i]);
-            if (it == end)
-                continue;
-            long line_num = it->second;
-            *(long*)&buf[pos] = line_num;
-            memcpy(&buf[pos + sizeof(long)], &xb[i * dim], len_vec);
-            pos += len_upd_line;
-        }
-    }
-    state->fs_update.write(&buf[0], pos);
+    delete[] l->distances;
+    delete[] l->xids;
+    delete[] l->lims;
+    delete l;
 }
 
-long VectoDB::UpdateBase()
+ResultLease* acquireLease(long res_cap, long lims_cap)
 {
-    map<long, unique_ptr<VecExt>> updates;
-    long played = 0;
     {
-        mtxlock m{ state->m_update };
-        played = state->fs_update.tellp() / len_upd_line;
-        if (played <= 0)
-            return played;
-
-        LOG(INFO) << "Loading " << played << " updates";
-        // read and truncate update.fvecs
-        auto update{ std::make_unique<VecExt>() };
-        update->vec.resize(dim);
-        long line_num = 0;
-        state->fs_update.seekg(0, ios_base::beg);
-        for (long i = 0; i < played; i++) {
-            state->fs_update.read((char*)&line_num, sizeof(long));
-            state->fs_update.read((char*)&update->vec[0], len_vec);
-            auto it = updates.find(line_num);
-            if (it == updates.end()) {
-                // not found - insert and reallocate update
-                update->count = 1;
-                updates[line_num] = std::move(update);
-                update = std::make_unique<VecExt>();
-                update->vec.resize(dim);
-            } else {
-                // found - reuse update
-                auto& curUpdate = it->second;
-                curUpdate->count++;
-                for (int d = 0; d < dim; d++) {
-                    curUpdate->vec[d] += update->vec[d];
-                }
+        std::lock_guard<std::mutex> lk(mtx_leases);
+        for (size_t i = 0; i < free_leases.size(); i++) {
+            ResultLease* l = free_leases[i];
+            if (l->res_cap >= res_cap && l->lims_cap >= lims_cap) {
+                free_leases.erase(free_leases.begin() + i);
+                return l;
             }
         }
-        state->fs_update.close();
-        state->fs_update.open(getUpdateFp(), std::fstream::in | std::fstream::out | std::fstream::binary | std::fstream::trunc);
     }
-    LOG(INFO) << "Playing " << played << " updates";
-    {
-        const string& fp_base = getBaseFp();
-        uint8_t* data = nullptr;
-        long len_data = 0;
-        mmapFile(fp_base, data, len_data);
-        getNumLines(len_data, len_base_line);
-        mtxlock m{ state->m_base2 };
+    ResultLease* l = new ResultLease();
+    l->res_cap = res_cap;
+    l->lims_cap = lims_cap;
+    l->distances = new float[res_cap];
+    l->xids = new long[res_cap];
+    l->lims = lims_cap == 0 ? nullptr : new long[lims_cap];
+    return l;
+}
 
-        for (auto& elem : updates) {
-            long line_num = elem.first;
-            auto& update = elem.second;
-            long line_pos = line_num * len_base_line;
-            long pos = line_pos + sizeof(long);
-            long curCnt = *(long*)(data + pos);
-            update->count += curCnt;
-            pos += sizeof(long);
-            //LOG(INFO) << "Playing update, line_num " << line_num << " updates";
-            for (long d = 0; d < dim; pos += sizeof(float), d++) {
-                float curVec = *(float*)(data + pos);
-                update->vec[d] += curCnt * curVec;
-            }
-            VectoDB::Normalize(update->vec);
-            state->fs_base2.seekp(line_pos + sizeof(long), ios_base::beg);
-            state->fs_base2.write((const char*)&update->count, sizeof(long));
-            state->fs_base2.write((const char*)&update->vec[0], len_vec);
+void releaseLease(ResultLease* l)
+{
+    if (l->res_cap <= MAX_POOLED_RES_CAP) {
+        std::lock_guard<std::mutex> lk(mtx_leases);
+        if (free_leases.size() < MAX_POOLED_LEASES) {
+            free_leases.push_back(l);
+            return;
         }
-        // The experiment indicates that the readers of mmaped file are not ware to following changes untill they be flushed.
-        // TODO: Is it possible that readers get the middle state of a change?
-        state->fs_base2.flush();
-        munmapFile(fp_base, data, len_data);
     }
-    LOG(INFO) << "Played " << played << " updates";
-    google::FlushLogFiles(google::INFO);
-    return played;
+    freeLease(l);
+}
 }
 
-long VectoDB::Search(long nq, const float* xq, float* distances, long* xids)
+long VectodbSearchKnnLeased(void* vdb, long nq, long k, float* xq, void** lease, float** distances, long** xids)
 {
-    for (int i = 0; i < nq; i++) {
-        xids[i] = long(-1);
-    }
-    long total = state->total;
-    if (total <= 0)
-        return total;
-    // output buffers
-    const long k = 100;
-    vector<float> D(nq * k);
-    vector<faiss::Index::idx_t> I(nq * k);
-
-    std::vector<float> xb2(dim * k);
-    std::vector<float> D2(k);
-    vector<faiss::Index::idx_t> I2(k);
-    /*
-    // refers to https://blog.csdn.net/quyuan2009/article/details/50001679
-    float xb2[dim * k];
-    float D2[k];
-    faiss::Index::idx_t I2[k];
-    */
+    ResultLease* l = acquireLease(nq * k, 0);
+    long total = static_cast<VectoDB*>(vdb)->SearchKnn(nq, k, xq, l->distances, l->xids);
+    *lease = l;
+    *distances = l->distances;
+    *xids = l->xids;
+    return total;
+}
 
-    long index_size = 0;
-    {
-        rlock r{ state->rw_index };
-        if (state->index != nullptr) {
-            index_size = state->index->ntotal;
-            // Perform a search
-            state->index->search(nq, xq, k, &D[0], &I[0]);
+long VectodbSearchRangeLeased(void* vdb, long nq, float* xq, float radius, long cap, void** lease, float** distances, long** xids, long** lims)
+{
+    ResultLease* l = acquireLease(cap, nq + 1);
+    long found = static_cast<VectoDB*>(vdb)->SearchRange(nq, xq, radius, cap, l->distances, l->xids, l->lims);
+    *lease = l;
+    *distances = l->distances;
+    *xids = l->xids;
+    *lims = l->lims;
+    return found;
+}
 
-            // Refine result
-            faiss::Index* index2 = new faiss::IndexFlat(dim, metric_type == 0 ? faiss::METRIC_INNER_PRODUCT : faiss::METRIC_L2);
-            for (int i = 0; i < nq; i++) {
-                {
-                    rlock r{ state->rw_data };
-                    for (int j = 0; j < k; j++) {
-                        long line_num = I[i * k + j];
-                        memcpy(&xb2[j * dim], &state->data[len_base_line * line_num + 2 * sizeof(long)], len_vec);
-                    }
-                }
-                index2->add(k, &xb2[0]);
-                index2->search(1, xq + i * dim, k, &D2[0], &I2[0]);
-                index2->reset();
-                distances[i] = D2[0];
-                xids[i] = I[i * k + I2[0]];
+void VectodbResultRelease(void* lease)
+{
+    releaseLease(static_cast<ResultLease*>(lease));
+}
+
+/**
+ * Chunked streaming Search backing the Go-side SearchStream. An offline join
+ * with nq in the millions otherwise preallocates nq-sized result arrays and
+ * the engine holds nq-sized intermediates alive at once; the stream computes
+ * fixed-size chunks on a worker thread, keeps at most two finished chunks
+ * queued, and the consumer pulls them in order. Peak memory is O(chunk) and
+ * the consumer's downstream work overlaps the next chunk's compute.
+ */
+namespace {
+struct SearchStream {
+    VectoDB* vdb;
+    const float* xq;
+    long nq;
+    long dim;
+    long chunk_size;
+    struct Chunk {
+        long start;
+        long n;
+        std::vector<float> distances;
+        std::vector<long> xids;
+    };
+    std::mutex mtx;
+    std::condition_variable cv_space; //wakes the worker when a queued chunk is consumed
+    std::condition_variable cv_ready; //wakes the consumer when a chunk lands
+    std::deque<Chunk> ready;
+    Chunk cur; //held for the consumer, valid until the next pull or the close
+    bool done;
+    bool stop;
+    std::thread worker;
+};
+}
+
+void* VectodbSearchStreamStart(void* vdb, long nq, long dim, float* xq, long chunk_size)
+{
+    SearchStream* st = new SearchStream();
+    st->vdb = static_cast<VectoDB*>(vdb);
+    st->xq = xq;
+    st->nq = nq;
+    st->dim = dim;
+    st->chunk_size = chunk_size <= 0 ? 16384 : chunk_size;
+    st->done = false;
+    st->stop = false;
+    st->worker = std::thread([st] {
+        for (long s = 0; s < st->nq;) {
+            long n = std::min(st->chunk_size, st->nq - s);
+            SearchStream::Chunk c;
+            c.start = s;
+            c.n = n;
+            c.distances.resize(n);
+            c.xids.resize(n);
+            st->vdb->Search(n, st->xq + s * st->dim, &c.distances[0], &c.xids[0]);
+            {
+                std::unique_lock<std::mutex> lk{ st->mtx };
+                st->cv_space.wait(lk, [st] { return st->ready.size() < 2 || st->stop; });
+                if (st->stop)
+                    break;
+                st->ready.push_back(std::move(c));
             }
-            delete index2;
+            st->cv_ready.notify_one();
+            s += n;
         }
-    }
+        {
+            std::lock_guard<std::mutex> lk{ st->mtx };
+            st->done = true;
+        }
+        st->cv_ready.notify_one();
+    });
+    return st;
+}
 
+long VectodbSearchStreamNext(void* stream, long* start, float** distances, long** xids)
+{
+    SearchStream* st = static_cast<SearchStream*>(stream);
     {
-        rlock r{ state->rw_flat };
-        if (state->flat->ntotal != 0) {
-            state->flat->search(nq, xq, k, &D[0], &I[0]);
-            for (int i = 0; i < nq; i++) {
-                if (0 == index_size || CompareDistance(metric_type, D[i * k], distances[i])) {
-                    distances[i] = D[i * k];
-                    xids[i] = I[i * k] + state->flat_start_num;
-                }
-            }
-        }
+        std::unique_lock<std::mutex> lk{ st->mtx };
+        st->cv_ready.wait(lk, [st] { return !st->ready.empty() || st->done; });
+        if (st->ready.empty())
+            return 0;
+        st->cur = std::move(st->ready.front());
+        st->ready.pop_front();
     }
+    st->cv_space.notify_one();
+    *start = st->cur.start;
+    *distances = &st->cur.distances[0];
+    *xids = &st->cur.xids[0];
+    return st->cur.n;
+}
 
+void VectodbSearchStreamClose(void* stream)
+{
+    SearchStream* st = static_cast<SearchStream*>(stream);
     {
-        rlock r{ state->rw_xids };
-        for (int i = 0; i < nq; i++) {
-            if (CompareDistance(metric_type, distances[i], dist_threshold)) {
-                xids[i] = state->xids[xids[i]];
-            } else {
-                xids[i] = long(-1);
-            }
-        }
-        //printf("\nmetric_type=%d, dist_threshold=%f\n", metric_type, dist_threshold);
+        std::lock_guard<std::mutex> lk{ st->mtx };
+        st->stop = true;
     }
-    return total;
+    st->cv_space.notify_one();
+    st->worker.join();
+    delete st;
 }
 
-std::string VectoDB::getBaseFp() const
+long VectodbSearchKnnBatch(void* vdb, long nq, long k, float* xq, float* distances, long* xids)
 {
-    ostringstream oss;
-    oss << work_dir << "/base.fvecs";
-    return oss.str();
+    return static_cast<VectoDB*>(vdb)->SearchKnnBatch(nq, k, xq, distances, xids);
 }
 
-std::string VectoDB::getIndexFp(long ntrain) const
+long VectodbSearchKnnFiltered(void* vdb, long nq, long k, float* xq, long n_allowed, long* allowed_xids, float* distances, long* xids)
 {
-    ostringstream oss;
-    oss << work_dir << "/" << index_key << "." << ntrain << ".index";
-    return oss.str();
+    return static_cast<VectoDB*>(vdb)->SearchKnnFiltered(nq, k, xq, n_allowed, allowed_xids, distances, xids);
 }
 
-std::string VectoDB::getUpdateFp() const
+long VectodbLoadIndex(void* vdb)
 {
-    ostringstream oss;
-    oss << work_dir << "/update.fvecs";
-    return oss.str();
+    return static_cast<VectoDB*>(vdb)->LoadIndex();
 }
 
-long VectoDB::getIndexFpNtrain() const
+long VectodbRollbackIndex(void* vdb)
 {
-    long max_ntrain = 0;
-    fs::path fp_index;
-    string prefix(index_key);
-    prefix.append(".");
-    const string suffix(".index");
-    for (auto ent = fs::directory_iterator(work_dir); ent != fs::directory_iterator(); ent++) {
-        const fs::path& p = ent->path();
-        if (fs::is_regular_file(p)) {
-            const string fn = p.filename().string();
-            if (fn.length() >= suffix.length()
-                && 0 == fn.compare(fn.length() - suffix.length(), suffix.length(), suffix)
-                && 0 == fn.compare(0, prefix.length(), prefix)) {
-                long ntrain = std::stol(fn.substr(prefix.length(), fn.length() - prefix.length() - suffix.length()));
-                if (ntrain > max_ntrain) {
-                    max_ntrain = ntrain;
-                    fp_index = p;
-                }
-            }
-        }
-    }
-    return max_ntrain;
+    return static_cast<VectoDB*>(vdb)->RollbackIndex();
 }
 
-void VectoDB::clearIndexFiles()
+long VectodbRollbackIfRegressed(void* vdb, double max_ratio)
 {
-    fs::path fp_index;
-    const string suffix(".index");
-    for (auto ent = fs::directory_iterator(work_dir); ent != fs::directory_iterator(); ent++) {
-        const fs::path& p = ent->path();
-        if (fs::is_regular_file(p)) {
-            const string fn = p.filename().string();
-            if (fn.length() >= suffix.length()
-                && 0 == fn.compare(fn.length() - suffix.length(), suffix.length(), suffix)) {
-                fs::remove(p);
-            }
-        }
-    }
+    return static_cast<VectoDB*>(vdb)->RollbackIfRegressed(max_ratio);
 }
 
-void VectoDB::readBase(const uint8_t* data, long num_line, long start_num, vector<float>& base) const
+long VectodbReadBaseTail(void* vdb, long start_line, long max_lines, float* xb, long* xids)
 {
-    if (data == nullptr || num_line <= start_num)
-        return;
-    long nb = num_line - start_num;
-    base.resize(nb * dim);
-    for (long i = 0; i < nb; i++) {
-        const uint8_t* start_pos = data + (i + start_num) * len_base_line;
-        memcpy(&base[i * dim], (float*)(start_pos + 2 * sizeof(long)), len_vec);
-    }
+    return static_cast<VectoDB*>(vdb)->ReadBaseTail(start_line, max_lines, xb, xids);
 }
 
-void VectoDB::readXids(const uint8_t* data, long num_line, long start_num, vector<long>& xids) const
+long VectodbReadPatchedTail(void* vdb, long start_idx, long max_lines, long* lines, long* counts, float* xb, long* xids)
 {
-    if (data == nullptr || num_line <= start_num)
-        return;
-    long nb = num_line - start_num;
-    xids.resize(nb);
-    for (long i = 0; i < nb; i++) {
-        const uint8_t* start_pos = data + (i + start_num) * len_base_line;
-        xids[i] = *(long*)start_pos;
-    }
+    return static_cast<VectoDB*>(vdb)->ReadPatchedTail(start_idx, max_lines, lines, counts, xb, xids);
 }
 
-void VectoDB::ClearWorkDir(const char* work_dir)
+long VectodbApplyPatch(void* vdb, long n, long* lines, long* counts, float* xb)
 {
-    fs::create_directories(work_dir);
-    ostringstream oss;
-    oss << work_dir << "/base.fvecs";
-    fs::remove(oss.str());
-    oss.clear();
-    oss << work_dir << "/update.fvecs";
-    fs::remove(oss.str());
+    return static_cast<VectoDB*>(vdb)->ApplyPatch(n, lines, counts, xb);
+}
 
-    const string suffix(".index");
-    for (auto ent = fs::directory_iterator(work_dir); ent != fs::directory_iterator(); ent++) {
-        const fs::path& p = ent->path();
-        if (fs::is_regular_file(p)) {
-            const string fn = p.filename().string();
-            if (fn.length() >= suffix.length()
-                && 0 == fn.compare(fn.length() - suffix.length(), suffix.length(), suffix)) {
-                fs::remove(p);
-            }
-        }
-    }
+long VectodbReadDeletedTail(void* vdb, long start_idx, long max_xids, long* xids)
+{
+    return static_cast<VectoDB*>(vdb)->ReadDeletedTail(start_idx, max_xids, xids);
 }
 
-void VectoDB::Normalize(std::vector<float>& vec)
+long VectodbGetSearchStats(void* vdb, long* vals, long n_vals)
 {
-    double l = 0;
-    int dim = vec.size();
-    for (int i = 0; i < dim; i++) {
-        l += double(vec[i]) * double(vec[i]);
-    }
-    l = sqrt(l);
-    for (int i = 0; i < dim; i++) {
-        vec[i] = (float)(((double)vec[i]) / l);
-    }
+    return static_cast<VectoDB*>(vdb)->GetSearchStats(vals, n_vals);
 }
 
-long VectoDB::getNumLines(long len_data, long len_base_line) const
+long VectodbGetSlowLog(void* vdb, long* vals, long n_vals)
 {
-    long nb = len_data / len_base_line;
-    long remained = len_data - len_base_line * nb;
-    if (remained != 0) {
-        LOG(ERROR) << "file fize could end with partial line. file size " << len_data << ", len_base_line " << len_base_line << ", nb " << nb << ", remained " << remained << ".";
-    }
-    return nb;
+    return static_cast<VectoDB*>(vdb)->GetSlowLog(vals, n_vals);
 }
 
-void VectoDB::mmapFile(const string& fp, uint8_t*& data, long& len_data)
+long VectodbGetShedLevel(void* vdb)
 {
-    munmapFile(fp, data, len_data);
-    long len_f = fs::file_size(fp); //equivalent to "fs_base.seekp(0, ios_base::end); long len_f = fs_base.tellp();"
-    if (len_f == 0)
-        return;
-    int f = open(fp.c_str(), O_RDONLY);
-    void* tmpd = mmap(NULL, len_f, PROT_READ, MAP_SHARED, f, 0);
-    if (tmpd == MAP_FAILED)
-        throw fs::filesystem_error(fp, boost::system::error_code(errno, boost::system::generic_category()));
-    close(f);
-    int rc = madvise(tmpd, len_f, MADV_RANDOM | MADV_DONTDUMP);
-    if (rc < 0)
-        LOG(ERROR) << "madvise failed with " << strerror(errno);
-    data = (uint8_t*)tmpd;
-    len_data = len_f;
+    return static_cast<VectoDB*>(vdb)->GetShedLevel();
 }
 
-void VectoDB::munmapFile(const string& fp, uint8_t*& data, long& len_data)
+long VectodbGetIvfStats(void* vdb, long* vals, long n_vals)
 {
-    if (data != nullptr) {
-        int rc = munmap(data, len_data);
-        if (rc < 0)
-            throw fs::filesystem_error(fp, boost::system::error_code(errno, boost::system::generic_category()));
-        data = nullptr;
-        len_data = 0;
-    }
+    return static_cast<VectoDB*>(vdb)->GetIvfStats(vals, n_vals);
 }
 
-/**
- * C wrappers.
- */
+long VectodbSplitHotLists(void* vdb, long max_splits)
+{
+    return static_cast<VectoDB*>(vdb)->SplitHotLists(max_splits);
+}
 
-void* VectodbNew(char* work_dir, long dim, int metric_type, char* index_key, char* query_params, float dist_threshold)
+long VectodbGetSegmentStats(void* vdb, long* vals, long n_vals)
 {
-    VectoDB* vdb = new VectoDB(work_dir, dim, metric_type, index_key, query_params, dist_threshold);
-    return vdb;
+    return static_cast<VectoDB*>(vdb)->GetSegmentStats(vals, n_vals);
 }
 
-void VectodbDelete(void* vdb)
+long VectodbRebalanceTiers(void* vdb)
 {
-    delete static_cast<VectoDB*>(vdb);
+    return static_cast<VectoDB*>(vdb)->RebalanceTiers();
 }
 
-void* VectodbBuildIndex(void* vdb, long cur_ntrain, long cur_nsize, long* ntrain)
+long VectodbGetMemoryStats(void* vdb, long* vals, long n_vals)
 {
-    faiss::Index* index = nullptr;
-    static_cast<VectoDB*>(vdb)->BuildIndex(cur_ntrain, cur_nsize, index, *ntrain);
-    return index;
+    return static_cast<VectoDB*>(vdb)->GetMemoryStats(vals, n_vals);
 }
 
-void VectodbAddWithIds(void* vdb, long nb, float* xb, long* xids)
+void VectodbGetMappingStats(void* vdb, long* mapped_bytes, long* resident_bytes)
 {
-    static_cast<VectoDB*>(vdb)->AddWithIds(nb, xb, xids);
+    static_cast<VectoDB*>(vdb)->GetMappingStats(*mapped_bytes, *resident_bytes);
 }
 
-void VectodbUpdateWithIds(void* vdb, long nb, float* xb, long* xids)
+void VectodbSnapshot(void* vdb, char* dst_work_dir)
 {
-    static_cast<VectoDB*>(vdb)->UpdateWithIds(nb, xb, xids);
+    static_cast<VectoDB*>(vdb)->Snapshot(dst_work_dir);
 }
 
-long VectodbUpdateBase(void* vdb)
+long VectodbWarmup(void* vdb, int budget_mbps)
 {
-    return static_cast<VectoDB*>(vdb)->UpdateBase();
+    return static_cast<VectoDB*>(vdb)->Warmup(budget_mbps);
 }
 
-long VectodbGetTotal(void* vdb)
+long VectodbIsWarm(void* vdb)
 {
-    return static_cast<VectoDB*>(vdb)->GetTotal();
+    return static_cast<VectoDB*>(vdb)->IsWarm() ? 1 : 0;
 }
 
-long VectodbGetFlatSize(void* vdb)
+void VectodbNormalizeBatch(long nb, long dim, float* xb)
 {
-    return static_cast<VectoDB*>(vdb)->GetFlatSize();
+    VectoDB::NormalizeBatch(nb, dim, xb);
 }
 
-void VectodbActivateIndex(void* vdb, void* index, long ntrain)
+void VectodbTraceStart()
 {
-    static_cast<VectoDB*>(vdb)->ActivateIndex(static_cast<faiss::Index*>(index), ntrain);
+    VectoDB::TraceStart();
 }
 
-void VectodbGetIndexSize(void* vdb, long* ntrain, long* ntotal)
+void VectodbTraceStop()
 {
-    static_cast<VectoDB*>(vdb)->GetIndexSize(*ntrain, *ntotal);
+    VectoDB::TraceStop();
 }
 
-long VectodbSearch(void* vdb, long nq, float* xq, float* distances, long* xids)
+long VectodbTraceDump(char* fp)
 {
-    return static_cast<VectoDB*>(vdb)->Search(nq, xq, distances, xids);
+    return VectoDB::TraceDump(fp);
 }
 
 void VectodbClearWorkDir(char* work_dir)
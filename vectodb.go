@@ -10,16 +10,31 @@ package vectodb
 import "C"
 
 import (
+	"context"
+	"encoding/binary"
+	"encoding/json"
+	"io"
+	"io/ioutil"
+	"math"
+	"os"
+	"path/filepath"
+	"runtime"
+	"sync"
+	"time"
 	"unsafe"
 
+	"github.com/pkg/errors"
 	log "github.com/sirupsen/logrus"
+	"golang.org/x/sys/unix"
 )
 
 type VectoDB struct {
-	vdbC          unsafe.Pointer
-	dim           int
-	workDir       string
-	flatThreshold int
+	vdbC           unsafe.Pointer
+	dim            int
+	workDir        string
+	flatThreshold  int
+	adaptiveCancel context.CancelFunc
+	sPool          *searchPool //bounded cgo search workers, nil runs searches inline
 }
 
 func NewVectoDB(workDir string, dimIn int, metricType int, indexKey string, queryParams string, distThreshold float32, flatThreshold int) (vdb *VectoDB, err error) {
@@ -56,6 +71,169 @@ func (vdb *VectoDB) AddWithIds(xb []float32, xids []int64) (err error) {
 	return
 }
 
+// BulkLoad streams an fvecs dataset file straight into the base columns of an
+// empty database with parallel chunk writers, skipping the per-batch dedup and
+// flat-memtable work of AddWithIds. xids must hold one unique id per dataset
+// line, or be nil to assign the line numbers. Follow with UpdateIndex to build
+// and activate the index over the loaded data.
+func (vdb *VectoDB) BulkLoad(fvecsPath string, xids []int64) (nb int, err error) {
+	fvecsPathC := C.CString(fvecsPath)
+	var xidsC *C.long
+	if xids != nil {
+		xidsC = (*C.long)(&xids[0])
+	}
+	nb = int(C.VectodbBulkLoad(vdb.vdbC, fvecsPathC, xidsC))
+	C.free(unsafe.Pointer(fvecsPathC))
+	return
+}
+
+// BulkLoadCheckpoint is the durable high-water mark a resumable bulk load
+// persists with each batch: how far into the source it got and which
+// identifier range it handed out.
+type BulkLoadCheckpoint struct {
+	SourcePath   string `json:"sourcePath"`
+	SourceOffset int64  `json:"sourceOffset"` //bytes of the source consumed
+	NextXid      int64  `json:"nextXid"`      //first identifier of the next batch
+	Lines        int64  `json:"lines"`        //vectors ingested by this load
+	DbTotal      int64  `json:"dbTotal"`      //db size at checkpoint time, reconciles a crash between batch and checkpoint
+}
+
+func (vdb *VectoDB) checkpointPath() string {
+	return filepath.Join(vdb.workDir, "bulkload.checkpoint")
+}
+
+func (vdb *VectoDB) writeCheckpoint(cp *BulkLoadCheckpoint) (err error) {
+	var b []byte
+	if b, err = json.Marshal(cp); err != nil {
+		err = errors.Wrap(err, "")
+		return
+	}
+	tmp := vdb.checkpointPath() + ".tmp"
+	if err = ioutil.WriteFile(tmp, b, 0600); err != nil {
+		err = errors.Wrap(err, "")
+		return
+	}
+	if err = os.Rename(tmp, vdb.checkpointPath()); err != nil {
+		err = errors.Wrap(err, "")
+	}
+	return
+}
+
+// BulkLoadResumable ingests an fvecs dataset in batches of batchLines
+// vectors, assigning sequential identifiers from xidBase and persisting a
+// checkpoint into the work dir after each batch, so a loader that dies at
+// hour 20 of a 100M-scale backfill resumes at the last checkpoint instead of
+// from zero. On restart the checkpoint is reconciled against GetTotal, which
+// covers a crash on either side of the checkpoint write. Unlike BulkLoad it
+// appends through the regular write path, so it works on a non-empty
+// database and concurrent searches see the load progress.
+func (vdb *VectoDB) BulkLoadResumable(fvecsPath string, xidBase int64, batchLines int) (nb int, err error) {
+	recSize := int64((vdb.dim + 1) * 4)
+	var total int
+	if total, err = vdb.GetTotal(); err != nil {
+		return
+	}
+	cp := &BulkLoadCheckpoint{SourcePath: fvecsPath, NextXid: xidBase, DbTotal: int64(total)}
+	var b []byte
+	if b, err = ioutil.ReadFile(vdb.checkpointPath()); err == nil {
+		if err = json.Unmarshal(b, cp); err != nil {
+			err = errors.Wrap(err, "")
+			return
+		}
+		if cp.SourcePath != fvecsPath {
+			err = errors.Errorf("checkpoint of %s belongs to %s, not %s", vdb.workDir, cp.SourcePath, fvecsPath)
+			return
+		}
+		// the db runs ahead of the checkpoint when the crash hit between a
+		// batch and its checkpoint write, and behind it when unsynced
+		// appends were lost; roll the checkpoint either way
+		if delta := int64(total) - cp.DbTotal; delta != 0 {
+			cp.SourceOffset += delta * recSize
+			cp.NextXid += delta
+			cp.Lines += delta
+			cp.DbTotal = int64(total)
+		}
+		log.Infof("BulkLoadResumable %s resuming at offset %d, xid %d, %d lines done", fvecsPath, cp.SourceOffset, cp.NextXid, cp.Lines)
+	} else if !os.IsNotExist(err) {
+		err = errors.Wrap(err, "")
+		return
+	} else {
+		err = nil
+	}
+
+	var f *os.File
+	if f, err = os.Open(fvecsPath); err != nil {
+		err = errors.Wrap(err, "")
+		return
+	}
+	defer f.Close()
+	var fi os.FileInfo
+	if fi, err = f.Stat(); err != nil {
+		err = errors.Wrap(err, "")
+		return
+	}
+	size := fi.Size()
+	if size%recSize != 0 {
+		err = errors.Errorf("%s size %d is not a multiple of the %d-byte record", fvecsPath, size, recSize)
+		return
+	}
+	if _, err = f.Seek(cp.SourceOffset, io.SeekStart); err != nil {
+		err = errors.Wrap(err, "")
+		return
+	}
+	buf := make([]byte, int64(batchLines)*recSize)
+	xb := make([]float32, batchLines*vdb.dim)
+	xids := make([]int64, batchLines)
+	for cp.SourceOffset < size {
+		want := size - cp.SourceOffset
+		if want > int64(len(buf)) {
+			want = int64(len(buf))
+		}
+		if _, err = io.ReadFull(f, buf[:want]); err != nil {
+			err = errors.Wrap(err, "")
+			return
+		}
+		lines := int(want / recSize)
+		for i := 0; i < lines; i++ {
+			off := int64(i) * recSize
+			if d := int(binary.LittleEndian.Uint32(buf[off:])); d != vdb.dim {
+				err = errors.Errorf("%s offset %d: dimension %d, want %d", fvecsPath, cp.SourceOffset+off, d, vdb.dim)
+				return
+			}
+			for j := 0; j < vdb.dim; j++ {
+				xb[i*vdb.dim+j] = math.Float32frombits(binary.LittleEndian.Uint32(buf[int(off)+4+j*4:]))
+			}
+			xids[i] = cp.NextXid + int64(i)
+		}
+		if err = vdb.AddWithIds(xb[:lines*vdb.dim], xids[:lines]); err != nil {
+			return
+		}
+		nb += lines
+		cp.SourceOffset += int64(lines) * recSize
+		cp.NextXid += int64(lines)
+		cp.Lines += int64(lines)
+		cp.DbTotal += int64(lines)
+		if err = vdb.writeCheckpoint(cp); err != nil {
+			return
+		}
+	}
+	log.Infof("BulkLoadResumable %s done, %d lines this run, %d in total", fvecsPath, nb, cp.Lines)
+	return
+}
+
+// UpsertWithIds splits a batch of unknown novelty in one probe pass: known
+// xids are recorded as updates (played by UpdateIndex like UpdateWithIds),
+// new xids are appended like AddWithIds. Mixed batches pay half the
+// ingest-path overhead of calling both.
+func (vdb *VectoDB) UpsertWithIds(xb []float32, xids []int64) (err error) {
+	nb := len(xids)
+	if len(xb) != nb*vdb.dim {
+		log.Fatalf("invalid length of xb, want %v, have %v", nb*vdb.dim, len(xb))
+	}
+	C.VectodbUpsertWithIds(vdb.vdbC, C.long(nb), (*C.float)(&xb[0]), (*C.long)(&xids[0]))
+	return
+}
+
 func (vdb *VectoDB) UpdateWithIds(xb []float32, xids []int64) (err error) {
 	nb := len(xids)
 	if len(xb) != nb*vdb.dim {
@@ -65,32 +243,111 @@ func (vdb *VectoDB) UpdateWithIds(xb []float32, xids []int64) (err error) {
 	return
 }
 
+// DeleteWithIds tombstones the given xids: they stop surfacing from searches
+// immediately, and the space is reclaimed later by base compaction. Unknown
+// xids are ignored. Returns the number of xids actually tombstoned.
+func (vdb *VectoDB) DeleteWithIds(xids []int64) (deleted int, err error) {
+	nb := len(xids)
+	if nb == 0 {
+		return
+	}
+	deleted = int(C.VectodbDeleteWithIds(vdb.vdbC, C.long(nb), (*C.long)(&xids[0])))
+	return
+}
+
+// sweepExpired tombstones every vector older than the configured TTL
+// ("ttl_sec=<n>" in queryParams). A no-op when TTL is disabled; the reclaim
+// itself is left to the base compaction the dead fraction triggers.
+func (vdb *VectoDB) sweepExpired() (expired int) {
+	return int(C.VectodbSweepExpired(vdb.vdbC))
+}
+
+func (vdb *VectoDB) GetDeletedSize() (ndels int, err error) {
+	ndelsC := C.VectodbGetDeletedSize(vdb.vdbC)
+	ndels = int(ndelsC)
+	return
+}
+
+// compactBase rewrites the base dropping tombstoned lines and renumbers the
+// live tiers in place. Returns the number of lines reclaimed, 0 when there is
+// nothing to do, or -1 when the index layout is not remappable and a full
+// build must run first.
+func (vdb *VectoDB) compactBase() (reclaimed int) {
+	return int(C.VectodbCompactBase(vdb.vdbC))
+}
+
+// compactDeadFrac is the dead fraction above which UpdateIndex schedules a
+// base compaction; below it the tombstones only cost the scan-skip checks.
+const compactDeadFrac = 0.15
+
 func (vdb *VectoDB) UpdateIndex() (err error) {
+	return vdb.updateIndexWithThreshold(vdb.flatThreshold)
+}
+
+func (vdb *VectoDB) updateIndexWithThreshold(flatThreshold int) (err error) {
 	var needBuild bool
 	var index unsafe.Pointer
-	var curNtrain, curNsize, ntrain, nflat, played int
-	if played, err = vdb.updateBase(); err != nil {
+	var curNtrain, curNsize, ntrain, played int
+	// one lock-free stats call decides whether this tick has any work at all
+	var st DbStats
+	if st, err = vdb.GetStats(); err != nil {
 		return
 	}
-	if played != 0 {
+	if expired := vdb.sweepExpired(); expired > 0 {
+		log.Infof("%s: expired %d vectors past their TTL", vdb.workDir, expired)
+	}
+	var ndels int
+	if ndels, err = vdb.GetDeletedSize(); err != nil {
+		return
+	}
+	if st.Total > 0 && float64(ndels) > compactDeadFrac*float64(st.Total) {
+		if reclaimed := vdb.compactBase(); reclaimed > 0 {
+			log.Infof("%s: compacted the base, reclaimed %d tombstoned lines", vdb.workDir, reclaimed)
+			return
+		} else if reclaimed < 0 {
+			// the live index layout is not remappable in place; a full build
+			// replaces it with one that is, so the next tick can compact
+			log.Infof("%s: base compaction needs a remappable index, waiting for a full build", vdb.workDir)
+		}
+	}
+	var patched bool
+	if st.UpdateSize != 0 {
+		if played, patched, err = vdb.updateBase(); err != nil {
+			return
+		}
+	}
+	if played != 0 && patched {
+		// every updated line was patched into the live tiers in place, the
+		// rebuild would only redo work already visible to searches
+		log.Infof("%s: played %d updates, patched the live index in place", vdb.workDir, played)
+	} else if played != 0 {
 		needBuild = true
 		curNtrain = 0
 		curNsize = 0
 		log.Infof("%s: played %d updates, need build index", vdb.workDir, played)
-	} else {
-		if nflat, err = vdb.GetFlatSize(); err != nil {
+	} else if st.FlatSize >= flatThreshold {
+		// LSM-style tier: absorb the tail into a small delta index first,
+		// which reuses the trained artifacts and costs one add pass over
+		// just the new data. 0 means no trained main index yet, -1 means
+		// the tier is full; both fall back to a compacting full build.
+		if absorbed := vdb.buildDeltaIndex(); absorbed > 0 {
+			log.Infof("%s: absorbed %d tail vectors into a delta index", vdb.workDir, absorbed)
 			return
 		}
-		if nflat >= vdb.flatThreshold {
-			needBuild = true
-			if curNtrain, curNsize, err = vdb.getIndexSize(); err != nil {
-				return
-			}
-			log.Infof("%s: nflat %d goes above threshold, need build idnex. curNtrain %d, curNsize %d", vdb.workDir, nflat, curNtrain, curNsize)
-		}
+		needBuild = true
+		curNtrain = st.IndexNtrain
+		curNsize = st.IndexSize
+		log.Infof("%s: nflat %d goes above threshold, need build idnex. curNtrain %d, curNsize %d", vdb.workDir, st.FlatSize, curNtrain, curNsize)
 	}
 	if needBuild {
-		if index, ntrain, err = vdb.buildIndex(curNtrain, curNsize); err != nil {
+		var ran bool
+		if index, ntrain, ran, err = vdb.tryBuildIndex(curNtrain, curNsize); err != nil {
+			return
+		}
+		if !ran {
+			// a build of this shard is already in flight; racing a second
+			// one would double build memory and waste a full training
+			log.Infof("%s: build already in flight, skipping this tick", vdb.workDir)
 			return
 		}
 		if ntrain != 0 {
@@ -110,18 +367,102 @@ func (vdb *VectoDB) buildIndex(cur_ntrain, cur_ntotal int) (index unsafe.Pointer
 	return
 }
 
-func (vdb *VectoDB) updateBase() (played int, err error) {
-	playedC := C.VectodbUpdateBase(vdb.vdbC)
+// tryBuildIndex is buildIndex, but ran reports false immediately when a build
+// is already in flight instead of racing a second one.
+func (vdb *VectoDB) tryBuildIndex(cur_ntrain, cur_ntotal int) (index unsafe.Pointer, ntrain int, ran bool, err error) {
+	var ntrainC, ranC C.long
+	index = C.VectodbTryBuildIndex(vdb.vdbC, C.long(cur_ntrain), C.long(cur_ntotal), &ntrainC, &ranC)
+	ntrain = int(ntrainC)
+	ran = ranC != 0
+	return
+}
+
+// buildDeltaIndex absorbs the flat tail into a small delta index, reusing the
+// trained artifacts of the main index. Returns the number of vectors
+// absorbed, 0 when there is no trained main index yet, or -1 when the delta
+// tier is full and a compacting full build is due.
+func (vdb *VectoDB) buildDeltaIndex() (absorbed int) {
+	return int(C.VectodbBuildDeltaIndex(vdb.vdbC))
+}
+
+// Phases of an in-flight build, as reported by GetBuildProgress.
+const (
+	BuildIdle  = 0 // no build in flight
+	BuildTrain = 1 // training quantizer and codebooks
+	BuildAdd   = 2 // adding base vectors to the index
+	BuildTune  = 3 // auto-tuning query params on a held-out sample
+)
+
+// GetBuildProgress reports the phase of the in-flight build and the number of
+// vectors done in that phase, read from relaxed atomics like GetStats.
+func (vdb *VectoDB) GetBuildProgress() (phase, processed int, err error) {
+	var phaseC, processedC C.long
+	C.VectodbGetBuildProgress(vdb.vdbC, &phaseC, &processedC)
+	phase = int(phaseC)
+	processed = int(processedC)
+	return
+}
+
+// CancelBuild asks the in-flight build (if any) to abort at the next chunk
+// boundary, e.g. because a newer build supersedes it.
+func (vdb *VectoDB) CancelBuild() (err error) {
+	C.VectodbCancelBuild(vdb.vdbC)
+	return
+}
+
+func (vdb *VectoDB) updateBase() (played int, patched bool, err error) {
+	var patchedC C.long
+	playedC := C.VectodbUpdateBasePatched(vdb.vdbC, &patchedC)
 	played = int(playedC)
+	patched = patchedC != 0
 	return
 }
 
 func (vdb *VectoDB) GetTotal() (total int, err error) {
-	totalC := C.VectodbGetFlatSize(vdb.vdbC)
+	totalC := C.VectodbGetTotal(vdb.vdbC)
 	total = int(totalC)
 	return
 }
 
+func (vdb *VectoDB) GetUpdateSize() (nsize int, err error) {
+	nsizeC := C.VectodbGetUpdateSize(vdb.vdbC)
+	nsize = int(nsizeC)
+	return
+}
+
+// GetWalQueueDepth returns the number of added lines enqueued in the engine's
+// group-commit queue but not yet flushed to the column files. Ingestion
+// feeders poll it as a backpressure signal.
+func (vdb *VectoDB) GetWalQueueDepth() (depth int) {
+	depth = int(C.VectodbGetWalQueueDepth(vdb.vdbC))
+	return
+}
+
+// DbStats is a snapshot of the database counters, read from relaxed atomics in
+// a single cgo call so maintenance polling never contends with searches.
+type DbStats struct {
+	Total       int  // total number of vectors
+	FlatSize    int  // vectors in the flat memtable
+	IndexNtrain int  // ntrain of the activated index, 0 if none
+	IndexSize   int  // vectors of the activated index
+	UpdateSize  int  // backlogged update records
+	Building    bool // a BuildIndex is in flight
+}
+
+func (vdb *VectoDB) GetStats() (st DbStats, err error) {
+	var totalC, flatSizeC, indexNtrainC, indexSizeC, updateSizeC, buildingC C.long
+	C.VectodbGetStats(vdb.vdbC, &totalC, &flatSizeC, &indexNtrainC, &indexSizeC, &updateSizeC, &buildingC)
+	st = DbStats{
+		Total:       int(totalC),
+		FlatSize:    int(flatSizeC),
+		IndexNtrain: int(indexNtrainC),
+		IndexSize:   int(indexSizeC),
+		UpdateSize:  int(updateSizeC),
+		Building:    buildingC != 0,
+	}
+	return
+}
+
 func (vdb *VectoDB) GetFlatSize() (nsize int, err error) {
 	nsizeC := C.VectodbGetFlatSize(vdb.vdbC)
 	nsize = int(nsizeC)
@@ -133,6 +474,39 @@ func (vdb *VectoDB) activateIndex(index unsafe.Pointer, ntrain int) (err error)
 	return
 }
 
+// LoadIndex loads the newest index file in the workDir and activates it, the
+// standby side of a shipped build artifact: builds happen once on the
+// primary, standbys activate the file instead of training.
+func (vdb *VectoDB) LoadIndex() (ntrain int, err error) {
+	ntrain = int(C.VectodbLoadIndex(vdb.vdbC))
+	return
+}
+
+// RollbackIndex re-activates the newest retained index generation from disk,
+// the escape hatch when a bad build ships. Activation keeps the last few
+// generations aside, so the rollback is seconds instead of a rebuild.
+// Returns the ntrain of the re-activated generation, or an error when none
+// is retained.
+func (vdb *VectoDB) RollbackIndex() (ntrain int, err error) {
+	ntrain = int(C.VectodbRollbackIndex(vdb.vdbC))
+	if ntrain < 0 {
+		err = errors.Errorf("no retained index generation in %s", vdb.workDir)
+	}
+	return
+}
+
+// RollbackIfRegressed compares the mean cycles/query of the current index
+// generation against the previous one's and rolls back once the ratio
+// exceeds maxRatio; meant to run periodically after an activation. Returns
+// the re-activated ntrain when triggered, 0 otherwise.
+func (vdb *VectoDB) RollbackIfRegressed(maxRatio float64) (ntrain int, err error) {
+	ntrain = int(C.VectodbRollbackIfRegressed(vdb.vdbC, C.double(maxRatio)))
+	if ntrain < 0 {
+		err = errors.Errorf("no retained index generation in %s", vdb.workDir)
+	}
+	return
+}
+
 func (vdb *VectoDB) getIndexSize() (ntrain, nsize int, err error) {
 	var ntrainC, nsizeC C.long
 	C.VectodbGetIndexSize(vdb.vdbC, &ntrainC, &nsizeC)
@@ -141,6 +515,81 @@ func (vdb *VectoDB) getIndexSize() (ntrain, nsize int, err error) {
 	return
 }
 
+// searchPool owns the cgo search calls. Each concurrent Search from Go
+// otherwise parks its own OS thread inside cgo for the duration of the C++
+// search, and at high concurrency the runtime spawns hundreds of threads,
+// wrecking the scheduler. Pool workers are dedicated LockOSThread goroutines,
+// so the thread count stays bounded no matter how many goroutines search;
+// callers hand their call over a channel and block until it ran. Funneling
+// the calls through few threads also lines them up back-to-back, which feeds
+// the engine's search coalescing. Optionally each worker thread is pinned to
+// a core for cache affinity.
+type searchPool struct {
+	jobs chan func()
+	wg   sync.WaitGroup
+}
+
+// StartSearchPool switches the search entry points to worker-pool mode with
+// the given number of dedicated cgo threads. With pinCPUs the worker threads
+// are pinned round-robin over the cores. Shall be called before concurrent
+// searches start.
+func (vdb *VectoDB) StartSearchPool(workers int, pinCPUs bool) {
+	if vdb.sPool != nil || workers <= 0 {
+		return
+	}
+	p := &searchPool{jobs: make(chan func())}
+	ncpu := runtime.NumCPU()
+	for w := 0; w < workers; w++ {
+		p.wg.Add(1)
+		go func(w int) {
+			defer p.wg.Done()
+			runtime.LockOSThread()
+			defer runtime.UnlockOSThread()
+			if pinCPUs {
+				var set unix.CPUSet
+				set.Set(w % ncpu)
+				if err := unix.SchedSetaffinity(0, &set); err != nil {
+					log.Warnf("pinning search worker %d: %v", w, err)
+				}
+			}
+			for job := range p.jobs {
+				job()
+			}
+		}(w)
+	}
+	vdb.sPool = p
+	return
+}
+
+// StopSearchPool drains the workers and returns searches to inline mode.
+func (vdb *VectoDB) StopSearchPool() {
+	if vdb.sPool == nil {
+		return
+	}
+	p := vdb.sPool
+	vdb.sPool = nil
+	close(p.jobs)
+	p.wg.Wait()
+	return
+}
+
+// runSearch executes one cgo search call on the pool when one is running,
+// inline otherwise.
+func (vdb *VectoDB) runSearch(fn func()) {
+	p := vdb.sPool
+	if p == nil {
+		fn()
+		return
+	}
+	done := make(chan struct{})
+	p.jobs <- func() {
+		fn()
+		close(done)
+	}
+	<-done
+	return
+}
+
 func (vdb *VectoDB) Search(xq []float32, distances []float32, xids []int64) (ntotal int, err error) {
 	nq := len(xids)
 	if len(xq) != nq*vdb.dim {
@@ -149,11 +598,817 @@ func (vdb *VectoDB) Search(xq []float32, distances []float32, xids []int64) (nto
 	if len(distances) != nq {
 		log.Fatalf("invalid length of distances, want %v, have %v", nq, len(distances))
 	}
-	ntotalC := C.VectodbSearch(vdb.vdbC, C.long(nq), (*C.float)(&xq[0]), (*C.float)(&distances[0]), (*C.long)(&xids[0]))
+	var ntotalC C.long
+	vdb.runSearch(func() {
+		ntotalC = C.VectodbSearch(vdb.vdbC, C.long(nq), (*C.float)(&xq[0]), (*C.float)(&distances[0]), (*C.long)(&xids[0]))
+	})
+	ntotal = int(ntotalC)
+	return
+}
+
+// VectodbMultiSearch fans one 1-NN query batch across several databases in a
+// single cgo call: the C side runs the shards on its own worker pool and
+// merges the per-query winners, so the boundary is crossed once per batch
+// regardless of shard count. Nil entries (shards still opening) are skipped.
+func VectodbMultiSearch(vdbs []*VectoDB, xq []float32, distances []float32, xids []int64) (ntotal int) {
+	nq := len(xids)
+	if len(distances) != nq {
+		log.Fatalf("invalid length of distances, want %v, have %v", nq, len(distances))
+	}
+	ptrs := make([]unsafe.Pointer, 0, len(vdbs))
+	for _, vdb := range vdbs {
+		if vdb == nil {
+			continue
+		}
+		if len(xq) != nq*vdb.dim {
+			log.Fatalf("invalid length of xq, want %v, have %v", nq*vdb.dim, len(xq))
+		}
+		ptrs = append(ptrs, vdb.vdbC)
+	}
+	if len(ptrs) == 0 || nq == 0 {
+		for i := range xids {
+			xids[i] = -1
+		}
+		return 0
+	}
+	ntotal = int(C.VectodbMultiSearch(&ptrs[0], C.long(len(ptrs)), C.long(nq), (*C.float)(&xq[0]), (*C.float)(&distances[0]), (*C.long)(&xids[0])))
+	return
+}
+
+// SearchWithDeadline is Search with the context's deadline threaded into the
+// scan loops: once the deadline passes, the remaining stages are skipped and
+// the best results collected so far are returned with partial=true. A context
+// without a deadline behaves like Search. The deadline path bypasses the
+// result cache and the coalescer, so latency-bound callers never wait behind
+// a merged batch.
+func (vdb *VectoDB) SearchWithDeadline(ctx context.Context, xq []float32, distances []float32, xids []int64) (ntotal int, partial bool, err error) {
+	nq := len(xids)
+	if len(xq) != nq*vdb.dim {
+		log.Fatalf("invalid length of xq, want %v, have %v", nq*vdb.dim, len(xq))
+	}
+	if len(distances) != nq {
+		log.Fatalf("invalid length of distances, want %v, have %v", nq, len(distances))
+	}
+	var deadlineUs int64
+	if dl, ok := ctx.Deadline(); ok {
+		deadlineUs = dl.UnixNano() / 1000
+	}
+	var ntotalC, partialC C.long
+	vdb.runSearch(func() {
+		ntotalC = C.VectodbSearchDeadline(vdb.vdbC, C.long(nq), (*C.float)(&xq[0]), C.long(deadlineUs), (*C.float)(&distances[0]), (*C.long)(&xids[0]), &partialC)
+	})
+	ntotal = int(ntotalC)
+	partial = partialC != 0
+	return
+}
+
+// SearchKnn returns the k nearest neighbors of each query vector in one pass.
+// xids and distances shall be of length nq*k. Missing neighbors are filled with -1.
+func (vdb *VectoDB) SearchKnn(k int, xq []float32, distances []float32, xids []int64) (ntotal int, err error) {
+	if len(xids)%k != 0 {
+		log.Fatalf("invalid length of xids, want a multiple of %v, have %v", k, len(xids))
+	}
+	nq := len(xids) / k
+	if len(xq) != nq*vdb.dim {
+		log.Fatalf("invalid length of xq, want %v, have %v", nq*vdb.dim, len(xq))
+	}
+	if len(distances) != nq*k {
+		log.Fatalf("invalid length of distances, want %v, have %v", nq*k, len(distances))
+	}
+	var ntotalC C.long
+	vdb.runSearch(func() {
+		ntotalC = C.VectodbSearchKnn(vdb.vdbC, C.long(nq), C.long(k), (*C.float)(&xq[0]), (*C.float)(&distances[0]), (*C.long)(&xids[0]))
+	})
 	ntotal = int(ntotalC)
 	return
 }
 
+// SearchKnnBatch is SearchKnn for backfill and other batch traffic sharing
+// the instance with interactive queries. The engine runs the batch in small
+// slices and lets interactive searches preempt it at slice boundaries;
+// per-class counters in SearchStats verify the isolation.
+func (vdb *VectoDB) SearchKnnBatch(k int, xq []float32, distances []float32, xids []int64) (ntotal int, err error) {
+	if len(xids)%k != 0 {
+		log.Fatalf("invalid length of xids, want a multiple of %v, have %v", k, len(xids))
+	}
+	nq := len(xids) / k
+	if len(xq) != nq*vdb.dim {
+		log.Fatalf("invalid length of xq, want %v, have %v", nq*vdb.dim, len(xq))
+	}
+	if len(distances) != nq*k {
+		log.Fatalf("invalid length of distances, want %v, have %v", nq*k, len(distances))
+	}
+	var ntotalC C.long
+	vdb.runSearch(func() {
+		ntotalC = C.VectodbSearchKnnBatch(vdb.vdbC, C.long(nq), C.long(k), (*C.float)(&xq[0]), (*C.float)(&distances[0]), (*C.long)(&xids[0]))
+	})
+	ntotal = int(ntotalC)
+	return
+}
+
+// SearchKnnWithParams is SearchKnn with per-search parameter overrides, e.g.
+// "nprobe=32", so latency-sensitive and batch callers can tune the same
+// activated index differently. nprobe is capped at the value the index was
+// activated with; build with a generous default and override downwards.
+func (vdb *VectoDB) SearchKnnWithParams(k int, xq []float32, params string, distances []float32, xids []int64) (ntotal int, err error) {
+	if len(xids)%k != 0 {
+		log.Fatalf("invalid length of xids, want a multiple of %v, have %v", k, len(xids))
+	}
+	nq := len(xids) / k
+	if len(xq) != nq*vdb.dim {
+		log.Fatalf("invalid length of xq, want %v, have %v", nq*vdb.dim, len(xq))
+	}
+	if len(distances) != nq*k {
+		log.Fatalf("invalid length of distances, want %v, have %v", nq*k, len(distances))
+	}
+	paramsC := C.CString(params)
+	defer C.free(unsafe.Pointer(paramsC))
+	var ntotalC C.long
+	vdb.runSearch(func() {
+		ntotalC = C.VectodbSearchKnnWithParams(vdb.vdbC, C.long(nq), C.long(k), (*C.float)(&xq[0]), paramsC, (*C.float)(&distances[0]), (*C.long)(&xids[0]))
+	})
+	ntotal = int(ntotalC)
+	return
+}
+
+// SearchKnnFiltered is SearchKnn restricted to vectors whose xid is in allowedXids.
+// The filter is applied inside the engine before top-k selection.
+func (vdb *VectoDB) SearchKnnFiltered(k int, xq []float32, allowedXids []int64, distances []float32, xids []int64) (ntotal int, err error) {
+	if len(xids)%k != 0 {
+		log.Fatalf("invalid length of xids, want a multiple of %v, have %v", k, len(xids))
+	}
+	nq := len(xids) / k
+	if len(xq) != nq*vdb.dim {
+		log.Fatalf("invalid length of xq, want %v, have %v", nq*vdb.dim, len(xq))
+	}
+	if len(distances) != nq*k {
+		log.Fatalf("invalid length of distances, want %v, have %v", nq*k, len(distances))
+	}
+	var allowedPtr *C.long
+	if len(allowedXids) != 0 {
+		allowedPtr = (*C.long)(&allowedXids[0])
+	}
+	var ntotalC C.long
+	vdb.runSearch(func() {
+		ntotalC = C.VectodbSearchKnnFiltered(vdb.vdbC, C.long(nq), C.long(k), (*C.float)(&xq[0]), C.long(len(allowedXids)), allowedPtr, (*C.float)(&distances[0]), (*C.long)(&xids[0]))
+	})
+	ntotal = int(ntotalC)
+	return
+}
+
+// SearchRange returns all neighbors within radius of each query vector.
+// resCap bounds the total number of returned results across all queries;
+// found reports how many matches exist, which may exceed resCap.
+// The results of query i are distances[lims[i]:lims[i+1]] / xids[lims[i]:lims[i+1]].
+func (vdb *VectoDB) SearchRange(xq []float32, radius float32, resCap int) (distances []float32, xids []int64, lims []int64, found int, err error) {
+	if len(xq)%vdb.dim != 0 {
+		log.Fatalf("invalid length of xq, want a multiple of %v, have %v", vdb.dim, len(xq))
+	}
+	nq := len(xq) / vdb.dim
+	distances = make([]float32, resCap)
+	xids = make([]int64, resCap)
+	lims = make([]int64, nq+1)
+	var foundC C.long
+	vdb.runSearch(func() {
+		foundC = C.VectodbSearchRange(vdb.vdbC, C.long(nq), (*C.float)(&xq[0]), C.float(radius), C.long(resCap), (*C.float)(&distances[0]), (*C.long)(&xids[0]), (*C.long)(&lims[0]))
+	})
+	found = int(foundC)
+	distances = distances[:lims[nq]]
+	xids = xids[:lims[nq]]
+	return
+}
+
+// ResultLease is a zero-copy view over search results that live in a C-owned
+// pooled buffer. Analytics paths that consume millions of results per call
+// read Distances/Xids in place instead of paying a second copy into Go
+// slices. The view is only valid until Release, which hands the buffer back
+// to the C-side pool; a forgotten lease is released by a finalizer.
+type ResultLease struct {
+	handle    unsafe.Pointer
+	Distances []float32
+	Xids      []int64
+	Lims      []int64 //result offsets of SearchRangeLeased, nil for SearchKnnLeased
+}
+
+func (l *ResultLease) Release() {
+	if l.handle == nil {
+		return
+	}
+	C.VectodbResultRelease(l.handle)
+	l.handle = nil
+	l.Distances = nil
+	l.Xids = nil
+	l.Lims = nil
+	runtime.SetFinalizer(l, nil)
+	return
+}
+
+// SearchKnnLeased is SearchKnn without the Go-side result buffers: the engine
+// fills a pooled C buffer and the returned lease views the nq*k results in
+// place. Release the lease when done reading.
+func (vdb *VectoDB) SearchKnnLeased(k int, xq []float32) (l *ResultLease, ntotal int, err error) {
+	if len(xq)%vdb.dim != 0 {
+		log.Fatalf("invalid length of xq, want a multiple of %v, have %v", vdb.dim, len(xq))
+	}
+	nq := len(xq) / vdb.dim
+	var handle unsafe.Pointer
+	var disC *C.float
+	var xidsC *C.long
+	var ntotalC C.long
+	vdb.runSearch(func() {
+		ntotalC = C.VectodbSearchKnnLeased(vdb.vdbC, C.long(nq), C.long(k), (*C.float)(&xq[0]), &handle, &disC, &xidsC)
+	})
+	ntotal = int(ntotalC)
+	n := nq * k
+	l = &ResultLease{
+		handle:    handle,
+		Distances: (*[1 << 30]float32)(unsafe.Pointer(disC))[:n:n],
+		Xids:      (*[1 << 30]int64)(unsafe.Pointer(xidsC))[:n:n],
+	}
+	runtime.SetFinalizer(l, (*ResultLease).Release)
+	return
+}
+
+// SearchRangeLeased is SearchRange without the Go-side result buffers; the
+// layout matches SearchRange, read through lease.Lims. Release the lease
+// when done reading.
+func (vdb *VectoDB) SearchRangeLeased(xq []float32, radius float32, resCap int) (l *ResultLease, found int, err error) {
+	if len(xq)%vdb.dim != 0 {
+		log.Fatalf("invalid length of xq, want a multiple of %v, have %v", vdb.dim, len(xq))
+	}
+	nq := len(xq) / vdb.dim
+	var handle unsafe.Pointer
+	var disC *C.float
+	var xidsC, limsC *C.long
+	var foundC C.long
+	vdb.runSearch(func() {
+		foundC = C.VectodbSearchRangeLeased(vdb.vdbC, C.long(nq), (*C.float)(&xq[0]), C.float(radius), C.long(resCap), &handle, &disC, &xidsC, &limsC)
+	})
+	found = int(foundC)
+	lims := (*[1 << 30]int64)(unsafe.Pointer(limsC))[: nq+1 : nq+1]
+	n := int(lims[nq])
+	l = &ResultLease{
+		handle:    handle,
+		Distances: (*[1 << 30]float32)(unsafe.Pointer(disC))[:n:n],
+		Xids:      (*[1 << 30]int64)(unsafe.Pointer(xidsC))[:n:n],
+		Lims:      lims,
+	}
+	runtime.SetFinalizer(l, (*ResultLease).Release)
+	return
+}
+
+// SearchStream streams Search answers for a very large query block in
+// chunks: the engine computes fixed-size chunks on a worker thread, keeps at
+// most two queued, and Next pulls them in order. Peak memory is O(chunkSize)
+// instead of O(nq), and the consumer's downstream work pipelines with the
+// next chunk's compute. The query block is copied into C memory up front
+// (cgo forbids the C side holding a Go pointer across calls), released by
+// Close. chunkSize <= 0 picks the engine default.
+type SearchStream struct {
+	ptr unsafe.Pointer
+	xqC unsafe.Pointer
+}
+
+func (vdb *VectoDB) SearchStream(xq []float32, chunkSize int) (st *SearchStream) {
+	if len(xq) == 0 || len(xq)%vdb.dim != 0 {
+		log.Fatalf("invalid length of xq, want a non-empty multiple of %v, have %v", vdb.dim, len(xq))
+	}
+	nq := len(xq) / vdb.dim
+	xqC := C.malloc(C.size_t(len(xq) * 4))
+	copy((*[1 << 30]float32)(xqC)[:len(xq):len(xq)], xq)
+	st = &SearchStream{
+		ptr: C.VectodbSearchStreamStart(vdb.vdbC, C.long(nq), C.long(vdb.dim), (*C.float)(xqC), C.long(chunkSize)),
+		xqC: xqC,
+	}
+	return
+}
+
+// Next pulls the next completed chunk. start indexes the chunk's first query
+// in xq; the slices view C memory valid until the next pull or Close. n == 0
+// means the stream is exhausted.
+func (st *SearchStream) Next() (start, n int, distances []float32, xids []int64) {
+	var startC C.long
+	var disC *C.float
+	var xidsC *C.long
+	n = int(C.VectodbSearchStreamNext(st.ptr, &startC, &disC, &xidsC))
+	if n == 0 {
+		return
+	}
+	start = int(startC)
+	distances = (*[1 << 30]float32)(unsafe.Pointer(disC))[:n:n]
+	xids = (*[1 << 30]int64)(unsafe.Pointer(xidsC))[:n:n]
+	return
+}
+
+// Close joins the worker and releases the stream. Safe before exhaustion.
+func (st *SearchStream) Close() {
+	C.VectodbSearchStreamClose(st.ptr)
+	C.free(st.xqC)
+	return
+}
+
+// Warmup pages the activated index and the base mapping into RAM at a bounded
+// I/O rate (budgetMBps <= 0 means unthrottled), so post-restart traffic does
+// not fault them in on the query path. Synchronous: its return is the
+// readiness signal. Run it in a goroutine and poll IsWarm to warm while
+// serving.
+func (vdb *VectoDB) Warmup(budgetMBps int) (touchedBytes int, err error) {
+	touchedBytes = int(C.VectodbWarmup(vdb.vdbC, C.int(budgetMBps)))
+	return
+}
+
+// IsWarm reports whether a Warmup has completed since the database was opened.
+func (vdb *VectoDB) IsWarm() (warm bool, err error) {
+	warm = C.VectodbIsWarm(vdb.vdbC) != 0
+	return
+}
+
+// Slab is a reusable set of C-allocated buffers for batched cgo calls. The
+// memory is C-owned, so cgo's per-call pointer checks see no Go pointers, and
+// callers encode vectors directly into Vecs instead of handing over fresh Go
+// slices — amortizing the boundary cost over a whole batch. A Slab belongs to
+// one goroutine at a time; lease one per worker or go through a SlabPool.
+type Slab struct {
+	maxN      int
+	maxK      int
+	vecsC     unsafe.Pointer
+	disC      unsafe.Pointer
+	xidsC     unsafe.Pointer
+	Vecs      []float32 // maxN*dim, the queries of SearchKnnSlab or the vectors of AddWithIdsSlab
+	Distances []float32 // maxN*maxK, the output distances of SearchKnnSlab
+	Xids      []int64   // maxN*maxK, ids: input of AddWithIdsSlab, output of SearchKnnSlab
+}
+
+// NewSlab allocates a Slab for batches of up to maxN vectors and searches of up
+// to maxK neighbors per query. Free it with Slab.Free; a forgotten Slab is
+// reclaimed by a finalizer.
+func (vdb *VectoDB) NewSlab(maxN, maxK int) (s *Slab) {
+	s = &Slab{maxN: maxN, maxK: maxK}
+	s.vecsC = C.malloc(C.size_t(maxN * vdb.dim * 4))
+	s.disC = C.malloc(C.size_t(maxN * maxK * 4))
+	s.xidsC = C.malloc(C.size_t(maxN * maxK * 8))
+	s.Vecs = (*[1 << 30]float32)(s.vecsC)[: maxN*vdb.dim : maxN*vdb.dim]
+	s.Distances = (*[1 << 30]float32)(s.disC)[: maxN*maxK : maxN*maxK]
+	s.Xids = (*[1 << 30]int64)(s.xidsC)[: maxN*maxK : maxN*maxK]
+	runtime.SetFinalizer(s, (*Slab).Free)
+	return
+}
+
+func (s *Slab) Free() {
+	if s.vecsC == nil {
+		return
+	}
+	runtime.SetFinalizer(s, nil)
+	C.free(s.vecsC)
+	C.free(s.disC)
+	C.free(s.xidsC)
+	s.vecsC, s.disC, s.xidsC = nil, nil, nil
+	s.Vecs, s.Distances, s.Xids = nil, nil, nil
+}
+
+// AddWithIdsSlab adds the nb vectors encoded in s.Vecs[:nb*dim] with ids
+// s.Xids[:nb] in one cgo call.
+func (vdb *VectoDB) AddWithIdsSlab(s *Slab, nb int) (err error) {
+	if nb > s.maxN {
+		log.Fatalf("invalid nb, want <=%v, have %v", s.maxN, nb)
+	}
+	C.VectodbAddWithIds(vdb.vdbC, C.long(nb), (*C.float)(s.vecsC), (*C.long)(s.xidsC))
+	return
+}
+
+// SearchKnnSlab searches the nq queries encoded in s.Vecs[:nq*dim] for their k
+// nearest neighbors in one cgo call. Results land in s.Distances[:nq*k] and
+// s.Xids[:nq*k], -1 padded like SearchKnn.
+func (vdb *VectoDB) SearchKnnSlab(s *Slab, nq, k int) (ntotal int, err error) {
+	if nq > s.maxN {
+		log.Fatalf("invalid nq, want <=%v, have %v", s.maxN, nq)
+	}
+	if k > s.maxK {
+		log.Fatalf("invalid k, want <=%v, have %v", s.maxK, k)
+	}
+	var ntotalC C.long
+	vdb.runSearch(func() {
+		ntotalC = C.VectodbSearchKnn(vdb.vdbC, C.long(nq), C.long(k), (*C.float)(s.vecsC), (*C.float)(s.disC), (*C.long)(s.xidsC))
+	})
+	ntotal = int(ntotalC)
+	return
+}
+
+// SlabPool leases Slabs to goroutine-pool workers, so steady-state traffic
+// allocates nothing at the cgo boundary. It grows to the number of concurrent
+// workers; idle Slabs dropped by the garbage collector free their C memory
+// through the Slab finalizer.
+type SlabPool struct {
+	pool sync.Pool
+}
+
+func (vdb *VectoDB) NewSlabPool(maxN, maxK int) (p *SlabPool) {
+	p = &SlabPool{}
+	p.pool.New = func() interface{} { return vdb.NewSlab(maxN, maxK) }
+	return
+}
+
+func (p *SlabPool) Get() *Slab {
+	return p.pool.Get().(*Slab)
+}
+
+func (p *SlabPool) Put(s *Slab) {
+	p.pool.Put(s)
+}
+
+// AdaptiveIndexPolicy drives the adaptive UpdateIndex loop. Zero fields take
+// the documented defaults.
+type AdaptiveIndexPolicy struct {
+	Interval  time.Duration // evaluation period, default 2s
+	FlatShare float64       // build once the flat scan exceeds this share of search cycles, default 0.25
+	CPUBudget float64       // max fraction of wall time spent building, default 0.5
+}
+
+// StartAdaptiveIndexLoop replaces the caller-driven UpdateIndex ticker with a
+// load-aware trigger: a build is scheduled when the flat tail crosses
+// flatThreshold, is projected to cross it within the next period, or is
+// observed (via GetSearchStats) to contribute more than FlatShare of search
+// cycles — and only while build time stays within CPUBudget. Idle databases
+// thus skip rebuilds, loaded ones rebuild before flat-tail latency climbs.
+func (vdb *VectoDB) StartAdaptiveIndexLoop(policy AdaptiveIndexPolicy) {
+	if vdb.adaptiveCancel != nil {
+		return
+	}
+	if policy.Interval <= 0 {
+		policy.Interval = 2 * time.Second
+	}
+	if policy.FlatShare <= 0 {
+		policy.FlatShare = 0.25
+	}
+	if policy.CPUBudget <= 0 {
+		policy.CPUBudget = 0.5
+	}
+	ctx, cancel := context.WithCancel(context.Background())
+	vdb.adaptiveCancel = cancel
+	go func() {
+		ticker := time.NewTicker(policy.Interval)
+		defer ticker.Stop()
+		start := time.Now()
+		var buildTime time.Duration
+		var lastNflat int
+		var lastStats SearchStats
+		for {
+			select {
+			case <-ctx.Done():
+				return
+			case <-ticker.C:
+			}
+			nflat, err := vdb.GetFlatSize()
+			if err != nil {
+				log.Errorf("%s: %+v", vdb.workDir, err)
+				continue
+			}
+			st, err := vdb.GetSearchStats()
+			if err != nil {
+				log.Errorf("%s: %+v", vdb.workDir, err)
+				continue
+			}
+			growth := nflat - lastNflat
+			cycFlat := st.CycFlat - lastStats.CycFlat
+			cycAll := (st.CycIndex + st.CycRefine + st.CycFlat + st.CycMerge) - (lastStats.CycIndex + lastStats.CycRefine + lastStats.CycFlat + lastStats.CycMerge)
+			lastNflat = nflat
+			lastStats = st
+			trigger := nflat >= vdb.flatThreshold ||
+				(growth > 0 && nflat+growth >= vdb.flatThreshold) ||
+				(cycAll > 0 && float64(cycFlat)/float64(cycAll) > policy.FlatShare && nflat > 0)
+			if !trigger {
+				continue
+			}
+			if float64(buildTime) > policy.CPUBudget*float64(time.Since(start)) {
+				log.Infof("%s: build deferred, CPU budget exhausted", vdb.workDir)
+				continue
+			}
+			t0 := time.Now()
+			if err = vdb.updateIndexWithThreshold(MinInt(MaxInt(nflat, 1), vdb.flatThreshold)); err != nil {
+				log.Fatalf("%+v", err)
+			}
+			buildTime += time.Since(t0)
+		}
+	}()
+	return
+}
+
+// StopAdaptiveIndexLoop stops the loop started by StartAdaptiveIndexLoop.
+func (vdb *VectoDB) StopAdaptiveIndexLoop() {
+	if vdb.adaptiveCancel == nil {
+		return
+	}
+	vdb.adaptiveCancel()
+	vdb.adaptiveCancel = nil
+	return
+}
+
+// SearchStats aggregates per-stage search counters since the database was opened.
+// Cycle counts are rdtsc deltas; ratios between stages are what matters, not
+// absolute values. Hist is a log2 histogram of per-query search cycles.
+type SearchStats struct {
+	Nq           int64
+	CycIndex     int64
+	CycRefine    int64
+	CycFlat      int64
+	CycMerge     int64
+	FlatWins     int64
+	IndexWins    int64
+	CacheLookups int64 // result-cache lookups, 0 unless opened with cache=<n>
+	CacheHits    int64 // hit rate is CacheHits/CacheLookups
+	InterNq      int64 // queries served in the interactive class
+	InterCyc     int64 // cycles spent on the interactive class
+	BatchNq      int64 // queries served via SearchKnnBatch
+	BatchCyc     int64 // cycles spent on the batch class
+	ShedNq       int64 // interactive queries answered at a degraded quality level
+	ShedLevel    int64 // current overload-shedding level, 0 = full quality
+	EffProcs     int64 // effective parallelism: host cores capped by the cgroup CPU quota
+	OmpTokens    int64 // OpenMP governor tokens currently granted across in-flight calls
+	Hist         []int64
+}
+
+// GetSearchStats snapshots the engine's search counters, for tuning
+// flatThreshold and nprobe from production data.
+func (vdb *VectoDB) GetSearchStats() (st SearchStats, err error) {
+	vals := make([]int64, 64)
+	n := int(C.VectodbGetSearchStats(vdb.vdbC, (*C.long)(&vals[0]), C.long(len(vals))))
+	if n > len(vals) {
+		n = len(vals)
+	}
+	if n < 17 {
+		log.Fatalf("invalid search stats length %v", n)
+	}
+	st = SearchStats{
+		Nq:           vals[0],
+		CycIndex:     vals[1],
+		CycRefine:    vals[2],
+		CycFlat:      vals[3],
+		CycMerge:     vals[4],
+		FlatWins:     vals[5],
+		IndexWins:    vals[6],
+		CacheLookups: vals[7],
+		CacheHits:    vals[8],
+		InterNq:      vals[9],
+		InterCyc:     vals[10],
+		BatchNq:      vals[11],
+		BatchCyc:     vals[12],
+		ShedNq:       vals[13],
+		ShedLevel:    vals[14],
+		EffProcs:     vals[15],
+		OmpTokens:    vals[16],
+		Hist:         vals[17:n],
+	}
+	return
+}
+
+// SlowQuery is one entry of the slow-query ring (slowlog_us=<n> in
+// queryParams). Wall times are microseconds; the stage costs are rdtsc
+// cycles, directly comparable to the SearchStats counters.
+type SlowQuery struct {
+	WallUs    int64 // unix microseconds at completion
+	Nq        int64
+	K         int64
+	Batch     bool  // a SearchKnnBatch slice
+	TotalUs   int64 // wall time of the call, what the threshold compares
+	LockUs    int64 // wait for the engine's snapshot reader locks
+	CycCoarse int64 // coarse quantization, a subset of CycIndex
+	CycIndex  int64 // index stage including the list scan
+	CycRefine int64 // exact refine over the mapped base
+	CycFlat   int64 // flat-tail scan, concurrent with the index stage
+	CycMerge  int64
+	Nprobe    int64 // effective nprobe, 0 when the per-call path did not run
+	Visited   int64 // lines of the selected inverted lists
+	Faults    int64 // process page faults (minor+major) during the call
+}
+
+const slowQueryFields = 14
+
+// GetSlowLog snapshots the slow-query ring, newest first: every search that
+// exceeded slowlog_us with its per-stage breakdown, turning a production
+// latency complaint into a log lookup. Empty unless opened with slowlog_us.
+func (vdb *VectoDB) GetSlowLog() (qs []SlowQuery) {
+	vals := make([]int64, 1+64*slowQueryFields)
+	n := int(C.VectodbGetSlowLog(vdb.vdbC, (*C.long)(&vals[0]), C.long(len(vals))))
+	if n > len(vals) {
+		n = len(vals)
+	}
+	if n < 1 {
+		return
+	}
+	count := int(vals[0])
+	for i := 0; i < count && 1+(i+1)*slowQueryFields <= n; i++ {
+		v := vals[1+i*slowQueryFields:]
+		qs = append(qs, SlowQuery{
+			WallUs:    v[0],
+			Nq:        v[1],
+			K:         v[2],
+			Batch:     v[3] != 0,
+			TotalUs:   v[4],
+			LockUs:    v[5],
+			CycCoarse: v[6],
+			CycIndex:  v[7],
+			CycRefine: v[8],
+			CycFlat:   v[9],
+			CycMerge:  v[10],
+			Nprobe:    v[11],
+			Visited:   v[12],
+			Faults:    v[13],
+		})
+	}
+	return
+}
+
+// GetShedLevel returns the current overload-shedding level: 0 full quality,
+// 1/2 progressively reduced nprobe and refine depth for interactive queries
+// while the batch coalescer is congested. Cheap enough to read around each
+// search as a per-response degradation flag.
+func (vdb *VectoDB) GetShedLevel() int {
+	return int(C.VectodbGetShedLevel(vdb.vdbC))
+}
+
+// IvfStats describes the inverted-list balance of the activated IVF index;
+// a large MaxListSize or Imbalance well above 1000 explains a bimodal
+// latency histogram (queries probing the hot lists pay the outsized scan).
+type IvfStats struct {
+	Nlist       int64 // lists of the activated index, grows as lists split
+	Nonempty    int64
+	MaxListSize int64
+	AvgListSize int64 // over nonempty lists
+	Imbalance   int64 // faiss imbalance factor x1000, 1000 = uniform
+	Splits      int64 // lists split by SplitHotLists since open
+}
+
+// GetIvfStats snapshots the inverted-list balance, for deciding when to run
+// SplitHotLists.
+func (vdb *VectoDB) GetIvfStats() (st IvfStats, err error) {
+	vals := make([]int64, 6)
+	n := int(C.VectodbGetIvfStats(vdb.vdbC, (*C.long)(&vals[0]), C.long(len(vals))))
+	if n < 6 {
+		log.Fatalf("invalid ivf stats length %v", n)
+	}
+	st = IvfStats{
+		Nlist:       vals[0],
+		Nonempty:    vals[1],
+		MaxListSize: vals[2],
+		AvgListSize: vals[3],
+		Imbalance:   vals[4],
+		Splits:      vals[5],
+	}
+	return
+}
+
+// SplitHotLists splits up to maxSplits oversized inverted lists of the
+// activated index in place, re-clustering each into two sub-centroids. It
+// flattens the latency tail on clustered data without retraining or raising
+// nprobe; splits are transient and the next full build supersedes them.
+// Returns the number of lists split.
+func (vdb *VectoDB) SplitHotLists(maxSplits int) (split int, err error) {
+	split = int(C.VectodbSplitHotLists(vdb.vdbC, C.long(maxSplits)))
+	return
+}
+
+// SegmentTemp is the temperature of one base segment, as reported by
+// GetSegmentStats.
+type SegmentTemp struct {
+	Hot  bool  // the segment sits on the fast tier
+	Hits int64 // refine gathers during the last completed RebalanceTiers window
+}
+
+// GetSegmentStats reports the per-segment temperature of the base mapping,
+// for sizing the fast tier to the working set.
+func (vdb *VectoDB) GetSegmentStats() (segs []SegmentTemp, err error) {
+	vals := make([]int64, 1+2*64)
+	n := int(C.VectodbGetSegmentStats(vdb.vdbC, (*C.long)(&vals[0]), C.long(len(vals))))
+	if n > len(vals) {
+		vals = make([]int64, n)
+		n = int(C.VectodbGetSegmentStats(vdb.vdbC, (*C.long)(&vals[0]), C.long(len(vals))))
+	}
+	if n < 1 {
+		log.Fatalf("invalid segment stats length %v", n)
+	}
+	nsegs := int(vals[0])
+	segs = make([]SegmentTemp, 0, nsegs)
+	for k := 0; k < nsegs && 2+2*k < n; k++ {
+		segs = append(segs, SegmentTemp{Hot: vals[1+2*k] != 0, Hits: vals[2+2*k]})
+	}
+	return
+}
+
+// RebalanceTiers adjusts the residency of the base mapping from the refine
+// access pattern since the last call: hot line ranges (tracked per block
+// within each segment) are kept resident, idle ones page out; meant to run
+// periodically. Returns the number of blocks whose residency changed.
+func (vdb *VectoDB) RebalanceTiers() (changed int, err error) {
+	changed = int(C.VectodbRebalanceTiers(vdb.vdbC))
+	return
+}
+
+// MemoryStats itemizes an instance's memory footprint in bytes, so per-shard
+// capacity planning doesn't have to work backwards from process RSS.
+type MemoryStats struct {
+	IndexBytes    int64 // main faiss index
+	ReplicaBytes  int64 // NUMA replicas (numa=1)
+	DeltaBytes    int64 // delta-tier indexes
+	FlatBytes     int64 // flat memtable with its LSH signatures and norms
+	XidBytes      int64 // xid mirror, norms mirror and the sharded xid map
+	MappedBytes   int64 // base vector mapping
+	BuildBytes    int64 // transient held by this instance's in-flight build
+	BuildInflight int64 // build bytes in flight process-wide under build_mem_gb
+
+	// jemalloc view, process-wide and zero when linked without jemalloc:
+	// resident far above allocated on an arena is fragmentation
+	BuildArenaAllocated int64 // dedicated build-transient arena, purged after activation
+	BuildArenaResident  int64
+	IndexArenaAllocated int64 // dedicated index-storage arena
+	IndexArenaResident  int64
+	HeapAllocated       int64 // jemalloc total, the rest belongs to the search path
+	HeapResident        int64
+}
+
+// GetMemoryStats snapshots the itemized memory footprint of the instance.
+func (vdb *VectoDB) GetMemoryStats() (st MemoryStats, err error) {
+	vals := make([]int64, 14)
+	n := int(C.VectodbGetMemoryStats(vdb.vdbC, (*C.long)(&vals[0]), C.long(len(vals))))
+	if n < 14 {
+		log.Fatalf("invalid memory stats length %v", n)
+	}
+	st = MemoryStats{
+		IndexBytes:          vals[0],
+		ReplicaBytes:        vals[1],
+		DeltaBytes:          vals[2],
+		FlatBytes:           vals[3],
+		XidBytes:            vals[4],
+		MappedBytes:         vals[5],
+		BuildBytes:          vals[6],
+		BuildInflight:       vals[7],
+		BuildArenaAllocated: vals[8],
+		BuildArenaResident:  vals[9],
+		IndexArenaAllocated: vals[10],
+		IndexArenaResident:  vals[11],
+		HeapAllocated:       vals[12],
+		HeapResident:        vals[13],
+	}
+	return
+}
+
+// GetMappingStats reports the base mapping footprint: bytes mapped vs bytes
+// resident in RAM, for sizing the hugepage/mlock_gb options.
+func (vdb *VectoDB) GetMappingStats() (mappedBytes, residentBytes int64, err error) {
+	C.VectodbGetMappingStats(vdb.vdbC, (*C.long)(&mappedBytes), (*C.long)(&residentBytes))
+	return
+}
+
+// Snapshot clones the database into dstWorkDir while serving: immutable base
+// segments and index files are hardlinked, only the small mutable tail files
+// are copied. The destination is a complete workDir NewVectoDB can open.
+func (vdb *VectoDB) Snapshot(dstWorkDir string) (err error) {
+	dstWorkDirC := C.CString(dstWorkDir)
+	C.VectodbSnapshot(vdb.vdbC, dstWorkDirC)
+	C.free(unsafe.Pointer(dstWorkDirC))
+	return
+}
+
+// ReadBaseTail reads up to cap(xids) durable base lines starting at startLine
+// into xb/xids, decoded to floats. The replication shipper tails the base
+// with this; only lines complete in every column are returned.
+func (vdb *VectoDB) ReadBaseTail(startLine int64, xb []float32, xids []int64) (n int, err error) {
+	maxLines := len(xids)
+	if maxLines <= 0 || len(xb) < maxLines*vdb.dim {
+		log.Fatalf("invalid ReadBaseTail buffers, len(xb) %v, len(xids) %v, dim %v", len(xb), len(xids), vdb.dim)
+	}
+	n = int(C.VectodbReadBaseTail(vdb.vdbC, C.long(startLine), C.long(maxLines), (*C.float)(&xb[0]), (*C.long)(&xids[0])))
+	return
+}
+
+// ReadPatchedTail reads records of base lines patched in place by update
+// replays since the process opened the work dir. startIdx is a cursor into
+// the in-memory patch log; records are idempotent to re-apply, so a shipper
+// replays the log from 0 on every (re)connect.
+func (vdb *VectoDB) ReadPatchedTail(startIdx int64, lines, counts []int64, xb []float32, xids []int64) (n int, err error) {
+	maxLines := len(lines)
+	if maxLines <= 0 || len(counts) < maxLines || len(xids) < maxLines || len(xb) < maxLines*vdb.dim {
+		log.Fatalf("invalid ReadPatchedTail buffers, len(lines) %v, len(counts) %v, len(xb) %v, len(xids) %v, dim %v", len(lines), len(counts), len(xb), len(xids), vdb.dim)
+	}
+	n = int(C.VectodbReadPatchedTail(vdb.vdbC, C.long(startIdx), C.long(maxLines), (*C.long)(&lines[0]), (*C.long)(&counts[0]), (*C.float)(&xb[0]), (*C.long)(&xids[0])))
+	return
+}
+
+// ApplyPatch overwrites base lines with replicated patch records, the standby
+// side of an update replay: the columns, the in-memory mirrors and the live
+// index tiers are patched in place. Lines beyond the durable base are
+// skipped; their later append ship already carries the patched content.
+func (vdb *VectoDB) ApplyPatch(lines, counts []int64, xb []float32) (applied int, err error) {
+	n := len(lines)
+	if n == 0 {
+		return
+	}
+	if len(counts) != n || len(xb) != n*vdb.dim {
+		log.Fatalf("invalid ApplyPatch buffers, len(lines) %v, len(counts) %v, len(xb) %v, dim %v", len(lines), len(counts), len(xb), vdb.dim)
+	}
+	applied = int(C.VectodbApplyPatch(vdb.vdbC, C.long(n), (*C.long)(&lines[0]), (*C.long)(&counts[0]), (*C.float)(&xb[0])))
+	return
+}
+
 /**
  * Static methods.
  */
@@ -166,6 +1421,45 @@ func VectodbClearWorkDir(workDir string) (err error) {
 	return
 }
 
+// VectodbNormalizeBatch L2-normalizes a batch of vectors in place with the
+// engine's vectorized norm kernels — one cgo call for a whole ingest or
+// query batch instead of a per-vector Go loop.
+func VectodbNormalizeBatch(dim int, xb []float32) {
+	if len(xb)%dim != 0 {
+		log.Fatalf("invalid length of xb, want a multiple of %v, have %v", dim, len(xb))
+	}
+	nb := len(xb) / dim
+	if nb == 0 {
+		return
+	}
+	C.VectodbNormalizeBatch(C.long(nb), C.long(dim), (*C.float)(&xb[0]))
+}
+
+// VectodbTraceStart begins span recording, process-wide across all
+// instances: builds, activations, group commits, update replays and search
+// batches record begin/end spans into a fixed lock-free ring.
+func VectodbTraceStart() {
+	C.VectodbTraceStart()
+}
+
+// VectodbTraceStop stops span recording.
+func VectodbTraceStop() {
+	C.VectodbTraceStop()
+}
+
+// VectodbTraceDump stops recording and writes the recorded spans as Chrome
+// trace-event JSON to fp, loadable in Perfetto to see how the engine
+// pipeline interleaved over an incident window. Returns the span count.
+func VectodbTraceDump(fp string) (spans int, err error) {
+	fpC := C.CString(fp)
+	spans = int(C.VectodbTraceDump(fpC))
+	C.free(unsafe.Pointer(fpC))
+	if spans < 0 {
+		err = errors.Errorf("cannot open trace dump file %s", fp)
+	}
+	return
+}
+
 // VectodbCompareDistance returns true if dis1 is closer then dis2.
 func VectodbCompareDistance(metricType int, dis1, dis2 float32) bool {
 	return (metricType == 0) == (dis1 > dis2)
@@ -11,20 +11,94 @@ void* VectodbNew(char* work_dir, long dim, int metric_type, char* index_key, cha
 void VectodbDelete(void* vdb);
 
 void* VectodbBuildIndex(void* vdb, long cur_ntrain, long cur_ntotal, long* ntrain);
+void* VectodbTryBuildIndex(void* vdb, long cur_ntrain, long cur_ntotal, long* ntrain, long* ran);
+void VectodbGetBuildProgress(void* vdb, long* phase, long* processed);
+void VectodbCancelBuild(void* vdb);
+long VectodbBuildDeltaIndex(void* vdb);
 void VectodbAddWithIds(void* vdb, long nb, float* xb, long* xids);
+long VectodbBulkLoad(void* vdb, char* fp_fvecs, long* xids);
 void VectodbUpdateWithIds(void* vdb, long nb, float* xb, long* xids);
+void VectodbUpsertWithIds(void* vdb, long nb, float* xb, long* xids);
 long VectodbUpdateBase(void* vdb);
+long VectodbUpdateBasePatched(void* vdb, long* patched);
+long VectodbDeleteWithIds(void* vdb, long nb, long* xids);
+long VectodbSweepExpired(void* vdb);
+long VectodbCompactBase(void* vdb);
 long VectodbGetTotal(void* vdb);
 long VectodbGetFlatSize(void* vdb);
+long VectodbGetUpdateSize(void* vdb);
+long VectodbGetWalQueueDepth(void* vdb);
+long VectodbGetDeletedSize(void* vdb);
+void VectodbGetStats(void* vdb, long* total, long* flat_size, long* index_ntrain, long* index_size, long* update_size, long* building);
 
 void VectodbActivateIndex(void* vdb, void* index, long ntrain);
 void VectodbGetIndexSize(void* vdb, long* ntrain, long* nsize);
 long VectodbSearch(void* vdb, long nq, float* xq, float* distances, long* xids);
+long VectodbMultiSearch(void** vdbs, long nvdb, long nq, float* xq, float* distances, long* xids);
+long VectodbSearchDeadline(void* vdb, long nq, float* xq, long deadline_unix_us, float* distances, long* xids, long* partial);
+long VectodbSearchKnn(void* vdb, long nq, long k, float* xq, float* distances, long* xids);
+long VectodbSearchRange(void* vdb, long nq, float* xq, float radius, long cap, float* distances, long* xids, long* lims);
+long VectodbSearchKnnFiltered(void* vdb, long nq, long k, float* xq, long n_allowed, long* allowed_xids, float* distances, long* xids);
+long VectodbSearchKnnWithParams(void* vdb, long nq, long k, float* xq, char* params, float* distances, long* xids);
+long VectodbSearchKnnBatch(void* vdb, long nq, long k, float* xq, float* distances, long* xids);
+
+/**
+ * Leased zero-copy search variants. Results are filled into a buffer owned
+ * by a C-side pool; the caller reads them in place through the returned
+ * pointers and hands the buffer back with VectodbResultRelease.
+ */
+long VectodbSearchKnnLeased(void* vdb, long nq, long k, float* xq, void** lease, float** distances, long** xids);
+long VectodbSearchRangeLeased(void* vdb, long nq, float* xq, float radius, long cap, void** lease, float** distances, long** xids, long** lims);
+void VectodbResultRelease(void* lease);
+
+/**
+ * Chunked streaming variant of VectodbSearch for very large query blocks:
+ * a worker computes fixed-size chunks ahead (at most two queued), the
+ * caller pulls them in order. Next returns the chunk's query count, 0 at
+ * exhaustion; its pointers stay valid until the next pull or the close.
+ * xq must stay alive until the stream is closed.
+ */
+void* VectodbSearchStreamStart(void* vdb, long nq, long dim, float* xq, long chunk_size);
+long VectodbSearchStreamNext(void* stream, long* start, float** distances, long** xids);
+void VectodbSearchStreamClose(void* stream);
+
+long VectodbLoadIndex(void* vdb);
+long VectodbRollbackIndex(void* vdb);
+long VectodbRollbackIfRegressed(void* vdb, double max_ratio);
+long VectodbReadBaseTail(void* vdb, long start_line, long max_lines, float* xb, long* xids);
+long VectodbReadPatchedTail(void* vdb, long start_idx, long max_lines, long* lines, long* counts, float* xb, long* xids);
+long VectodbApplyPatch(void* vdb, long n, long* lines, long* counts, float* xb);
+long VectodbReadDeletedTail(void* vdb, long start_idx, long max_xids, long* xids);
+
+long VectodbGetSearchStats(void* vdb, long* vals, long n_vals);
+long VectodbGetSlowLog(void* vdb, long* vals, long n_vals);
+long VectodbGetShedLevel(void* vdb);
+long VectodbGetIvfStats(void* vdb, long* vals, long n_vals);
+long VectodbSplitHotLists(void* vdb, long max_splits);
+long VectodbGetSegmentStats(void* vdb, long* vals, long n_vals);
+long VectodbRebalanceTiers(void* vdb);
+long VectodbGetMemoryStats(void* vdb, long* vals, long n_vals);
+void VectodbGetMappingStats(void* vdb, long* mapped_bytes, long* resident_bytes);
+void VectodbSnapshot(void* vdb, char* dst_work_dir);
+long VectodbWarmup(void* vdb, int budget_mbps);
+long VectodbIsWarm(void* vdb);
 
 /**
  * Static methods.
  */
 void VectodbClearWorkDir(char* work_dir);
+void VectodbNormalizeBatch(long nb, long dim, float* xb);
+
+/**
+ * Span tracing, process-wide: while recording is on, builds, activations,
+ * group commits, update replays and search batches record spans into a
+ * fixed lock-free ring. VectodbTraceDump stops recording and writes the
+ * ring as Chrome trace-event JSON to fp (Perfetto-loadable), returning the
+ * number of spans, -1 if fp cannot be opened.
+ */
+void VectodbTraceStart();
+void VectodbTraceStop();
+long VectodbTraceDump(char* fp);
 
 #ifdef __cplusplus
 }
@@ -1,7 +1,9 @@
 #pragma once
 
 #include <memory> //std::shared_ptr
+#include <sched.h> //cpu_set_t
 #include <string>
+#include <unordered_set>
 #include <vector>
 
 class DbState;
@@ -12,14 +14,73 @@ class Index;
 
 class VectoDB {
 public:
-    /** 
+    //one mapped base.vec.<k> segment. Full segments are immutable; only the
+    //last one (the appendable tail) ever changes size.
+    struct SegMap {
+        uint8_t* data;
+        long len;
+    };
+
+    /**
      * Construct a VectoDB, load base and index from work_dir.
      *
      * @param work_dir      input working direcotry
      * @param dim           input dimension of vector
      * @param metric_type   input faiss metric, 0 - METRIC_INNER_PRODUCT, 1 - METRIC_L2
-     * @param index_key     input faiss index_key
-     * @param query_params  input faiss selected params of auto-tuning
+     * @param index_key     input faiss index_key. "auto" lets BuildIndex choose the factory
+     *                      string from the data size and dimension and pick query_params with
+     *                      a bounded auto-tuning sweep on a held-out sample.
+     * @param query_params  input faiss selected params of auto-tuning. An extra
+     *                      "memtable=HNSW<M>" entry selects an HNSW memtable for the unindexed tail (METRIC_L2 only);
+     *                      "memtable=Flat16" stores the tail in float16, halving its scan bandwidth;
+     *                      "memtable=SQ8" stores it as SQ8 codes with per-vector min/scale, a
+     *                      quarter of the Flat footprint for memory-constrained deployments;
+     *                      "memtable=FlatBlk" stores it block-interleaved in groups of 8 rows,
+     *                      scanned by vertical SIMD multiply-adds at ~1.7x the row-major speed.
+     *                      An extra "sq8=1" entry stores base.vec SQ8-encoded, 4x smaller for ~1% recall loss.
+     *                      An extra "binary=1" entry packs base.vec to 1 bit per dimension for binary
+     *                      fingerprints, 32x smaller, with a popcount tail scan; on 0/1 vectors squared L2
+     *                      equals Hamming, so it needs metric_type 1 and dim divisible by 8.
+     *                      An extra "gpu=<device>" entry trains and adds on that GPU during BuildIndex
+     *                      (requires the "scons gpu" build), serving stays on CPU.
+     *                      An extra "mmap=1" entry persists the index in an aligned sectioned format
+     *                      and opens it with lazily mapped inverted lists, so open takes milliseconds.
+     *                      An extra "hugepage=1" entry backs the base mapping with transparent huge
+     *                      pages; "mlock_gb=<n>" locks its first n GB in RAM.
+     *                      An extra "numa=1" entry replicates the activated index per NUMA node
+     *                      and routes each search to the replica local to its CPU.
+     *                      An extra "cache=<n>" entry caches the 1-NN answers of up to n distinct
+     *                      query vectors; every write invalidates the cache as a whole.
+     *                      An extra "lsh=<bits>" entry prefilters the flat-tail scan with packed
+     *                      LSH signatures, computing exact distances only for Hamming survivors.
+     *                      An extra "pca=<d>" entry builds and searches the index in a PCA-reduced
+     *                      d-dim space; the base keeps the raw vectors and the exact refine stage
+     *                      over the mmap repairs the ranking.
+     *                      Extra "build_threads=<n>", "build_cores=<a>-<b>", "build_nice=<n>" and
+     *                      "build_mem_gb=<n>" entries isolate BuildIndex from serving: the build
+     *                      runs on a dedicated thread with that OpenMP team size, core range and
+     *                      priority, and concurrent builds (vectodb_multi shards) are staggered
+     *                      under the process-wide memory budget. An extra "build_direct=1"
+     *                      entry streams the base through O_DIRECT reads during builds,
+     *                      leaving the page cache to the serving path.
+     *                      An extra "stream_add=<n>" entry streams the durable tail straight into
+     *                      the live index's inverted lists once it holds n lines; the coarse
+     *                      quantizer is fixed after training, so the flat scan shrinks to the
+     *                      last write burst.
+     *                      An extra "upd_coalesce=<n>" entry absorbs repeat updates of the same
+     *                      line into a bounded in-memory table of up to n distinct lines, spilled
+     *                      to update.fvecs as merged records only on overflow, snapshot, shutdown
+     *                      or replay — the backlog file and its replay shrink by the redundancy
+     *                      factor of the update stream.
+     *                      An extra "ttl_sec=<n>" entry records the add time of every vector in a
+     *                      base.times column; SweepExpired tombstones lines older than n seconds
+     *                      and CompactBase reclaims them.
+     *                      An extra "upd_sq8=1" entry stores update.fvecs payloads as SQ8 codes
+     *                      with a per-vector min/scale, a quarter of the float32 backlog bytes
+     *                      and replay reads; updates feed a normalized weighted average, so the
+     *                      8-bit grid loses nothing that survives the normalization. The backlog
+     *                      file is not self-describing — pick the format when the work_dir is
+     *                      created and keep it for the life of the directory.
      * @param dist_threshold   input distance threshold
      */
     VectoDB(const char* work_dir, long dim, int metric_type = 0, const char* index_key = "IVF4096,PQ32", const char* query_params = "nprobe=256,ht=256", float dist_threshold = 0.6f);
@@ -38,7 +99,52 @@ public:
      */
     void BuildIndex(long cur_ntrain, long cur_nsize, faiss::Index*& index, long& ntrain) const;
 
-    /** 
+    /**
+     * Same as BuildIndex, but returns false immediately when a build is
+     * already in flight instead of racing a second one — overlapping builds
+     * of the same shard double memory and waste a full training.
+     * Returns true when this call ran (or had nothing to do) and its
+     * outputs are valid.
+     */
+    bool TryBuildIndex(long cur_ntrain, long cur_nsize, faiss::Index*& index, long& ntrain) const;
+
+    /// phases of an in-flight build, reported by GetBuildProgress
+    enum BuildPhase { BUILD_IDLE = 0,
+        BUILD_TRAIN = 1,
+        BUILD_ADD = 2,
+        BUILD_TUNE = 3 };
+
+    /**
+     * Progress of the in-flight build.
+     * @param phase       output one of BuildPhase
+     * @param processed   output vectors done in the current phase
+     */
+    void GetBuildProgress(long& phase, long& processed) const;
+
+    /**
+     * Ask the in-flight build (if any) to abort, e.g. because a newer build
+     * supersedes it. Takes effect at phase and add-chunk boundaries; a
+     * cancelled build produces no index.
+     */
+    void CancelBuild() const;
+
+    /**
+     * Absorb the flat tail into a small delta index instead of a full
+     * rebuild. Reuses the trained artifacts (coarse centroids, codebooks) of
+     * the main index, so the cost is one add pass over just the new data.
+     * Searches cover main index, delta indexes and flat with merged results;
+     * a later BuildIndex + ActivateIndex compacts all deltas into the main
+     * index. Deltas are not persisted — they are rebuilt as the tail regrows
+     * after a restart.
+     *
+     * @return the number of vectors absorbed; 0 when there is nothing to do
+     *         or no trained main index yet (run a full build instead); -1
+     *         when the delta tier is full and a compacting full rebuild is
+     *         due
+     */
+    long BuildDeltaIndex();
+
+    /**
      * Add n vectors of dimension d to the index.
      * The upper layer does memory management for xb, xids.
      *
@@ -47,7 +153,22 @@ public:
      */
     void AddWithIds(long nb, const float* xb, const long* xids);
 
-    /** 
+    /**
+     * Bulk-load an fvecs dataset file into an empty database.
+     * Streams the vectors straight into the base segment files with parallel
+     * chunk writers and builds the xid maps with a parallel pass, skipping the
+     * per-batch dedup and flat-memtable work of AddWithIds; follow with one
+     * BuildIndex + ActivateIndex to serve the data. Ingests at roughly disk
+     * bandwidth.
+     *
+     * @param fp_fvecs  input dataset, <dim:int32>{<dim>}<float> per line
+     * @param xids      ids to store for the vectors, one per line, must be
+     *                  unique; nullptr assigns the line numbers
+     * @return the number of vectors loaded, -1 if the database is not empty
+     */
+    long BulkLoad(const char* fp_fvecs, const long* xids);
+
+    /**
      * Record update requests to a backlog.
      * The upper layer does memory management for xb, xids.
      *
@@ -56,14 +177,82 @@ public:
      */
     void UpdateWithIds(long nb, const float* xb, const long* xids);
 
-    /** 
+    /**
+     * Single-pass bulk upsert for batches of unknown novelty. One sharded-map
+     * probe pass splits the batch: xids already in the database are recorded
+     * as updates (played by UpdateBase like UpdateWithIds), new xids are
+     * deduplicated within the batch and appended like AddWithIds. A mixed
+     * batch pays one probe pass and one append per stream instead of a
+     * separate AddWithIds + UpdateWithIds round.
+     */
+    void UpsertWithIds(long nb, const float* xb, const long* xids);
+
+    /**
      * Play update backlog and return the number of played updates.
      * Assuming this operation is rare, i.e. once every 15 minutes.
-     * This causes disagreement between database and index, so user shall invoke BuildIndex and ActivateIndex later. 
+     * The live tiers (index, deltas, flat) are patched in place afterwards,
+     * so the updates are visible immediately. Only when some line could not
+     * be patched (reported via patched) does the database disagree with the
+     * index and the user shall invoke BuildIndex and ActivateIndex later.
+     *
+     * @param patched  optional output, 1 when every updated line was patched
+     *                 in place and no rebuild is needed
      */
-    long UpdateBase();
+    long UpdateBase(long* patched = nullptr);
 
-    /** 
+    /**
+     * Tombstone the given xids and return how many resolved. A deleted line
+     * never surfaces from a search again: the refine and merge stages skip
+     * it, the training sample of the next BuildIndex excludes it, and
+     * CompactBase reclaims its storage once enough of the base is dead. The
+     * xid leaves the lookup maps immediately, so a later add of the same xid
+     * creates a fresh line.
+     */
+    long DeleteWithIds(long nb, const long* xids);
+
+    /**
+     * Tombstone every line older than the configured TTL ("ttl_sec=<n>" in
+     * query_params) and return how many expired. Timestamps are recorded at
+     * add time, so the expired set is a prefix of the base and each call
+     * costs one comparison per newly expired line plus the tombstoning
+     * itself; with TTL disabled this is a no-op. Lines ingested before TTL
+     * was enabled carry no timestamp and never expire.
+     */
+    long SweepExpired();
+
+    /**
+     * Get the number of tombstoned lines not yet reclaimed by CompactBase.
+     */
+    long GetDeletedSize();
+
+    /**
+     * Read the log of xids tombstoned since open, the deletion counterpart of
+     * ReadPatchedTail; a standby applies them with DeleteWithIds. CompactBase
+     * clears the log — it renumbers every line, so standbys must re-sync from
+     * a fresh Snapshot after a compaction anyway.
+     *
+     * @param start_idx  first log entry to read
+     * @param max_xids   capacity of xids
+     * @param xids       output, the deleted xids
+     */
+    long ReadDeletedTail(long start_idx, long max_xids, long* xids);
+
+    /**
+     * Reclaim the tombstoned lines: every column is rewritten without them
+     * (crash-safe via a marker file) and the live tiers are remapped in
+     * place — inverted-list labels rewritten, the flat memtable filtered —
+     * so search quality never dips and no rebuild is owed. The bulk of the
+     * copy runs without locks; only a short barrier freezes writers for the
+     * swap. Assuming this operation is rare, like UpdateBase.
+     *
+     * @return the number of reclaimed lines, 0 when nothing is tombstoned or
+     *         a build is in flight, -1 when a live tier cannot be remapped in
+     *         place (on-disk inverted lists, an HNSW memtable); run a full
+     *         BuildIndex first in that case
+     */
+    long CompactBase();
+
+    /**
      * Get total number of vectors.
      *
      */
@@ -75,12 +264,33 @@ public:
      */
     long GetFlatSize();
 
-    /** 
-     * Get update size.
+    /**
+     * Get the number of backlogged update records in update.fvecs.
      *
      */
     long GetUpdateSize();
 
+    /**
+     * Get the number of added lines sitting in the group-commit queue, i.e.
+     * enqueued by AddWithIds but not yet flushed to the column files. Read
+     * from a relaxed atomic; ingestion feeders poll it as a backpressure
+     * signal.
+     */
+    long GetWalQueueDepth() const;
+
+    /**
+     * Get all polled counters in one call, from relaxed atomics: no lock is
+     * taken, so the Go maintenance tick never contends with searches.
+     *
+     * @param total         output total number of vectors
+     * @param flat_size     output number of vectors in the flat memtable
+     * @param index_ntrain  output ntrain of the activated index, 0 if none
+     * @param index_size    output number of vectors of the activated index
+     * @param update_size   output number of backlogged update records
+     * @param building      output 1 if a BuildIndex is in flight
+     */
+    void GetStats(long& total, long& flat_size, long& index_ntrain, long& index_size, long& update_size, long& building) const;
+
     /**  
      * Activate index built with TryBuildIndex or BuildIndex.
      * If upper layer decide not to activate an index, it shall delete the index to reclaim resource.
@@ -90,7 +300,42 @@ public:
      */
     void ActivateIndex(faiss::Index* index, long ntrain);
 
-    /** 
+    /**
+     * Load the newest index file in the work dir and activate it, the
+     * standby side of an artifact ship: builds happen once on the primary
+     * and standbys activate the shipped file instead of training.
+     *
+     * @return the ntrain of the activated index, 0 when no index file exists
+     */
+    long LoadIndex();
+
+    /**
+     * Re-activate the newest retained index generation from disk, the
+     * escape hatch when a bad build ships (e.g. a quantizer trained on
+     * skewed data). Activation keeps the last few generations on disk
+     * (hardlinked aside before the new file lands), so the rollback is a
+     * read + activate, seconds instead of a rebuild. The regressed
+     * generation is dropped and the manifest rewritten, so a restart also
+     * comes back on the rolled-back index.
+     *
+     * @return the ntrain of the re-activated generation, -1 when none is retained
+     */
+    long RollbackIndex();
+
+    /**
+     * Automatic rollback probe, meant to run periodically after an
+     * activation: compares the mean cycles/query served by the current
+     * generation (from the instrumentation counters) against the previous
+     * generation's, and rolls back once the ratio exceeds max_ratio. Both
+     * windows must cover enough queries to judge. Recall probes need ground
+     * truth the engine does not hold; a caller that runs its own may invoke
+     * RollbackIndex directly.
+     *
+     * @return RollbackIndex's result when triggered, 0 otherwise
+     */
+    long RollbackIfRegressed(double max_ratio);
+
+    /**
      * Get index size.
      *
      * @param ntain         output number of index train points
@@ -109,6 +354,294 @@ public:
      */
     long Search(long nq, const float* xq, float* distances, long* xids);
 
+    /**
+     * Search across several databases in one call: every shard runs the
+     * whole batch on a small worker pool here and the per-query winners
+     * merge by metric order, so a multi-shard FFI caller crosses the
+     * boundary once per batch instead of once per shard. Null entries
+     * (shards still opening) are routed around. All shards share one
+     * metric; a query with no hit in any shard keeps xid -1.
+     *
+     * @param nvdb          input number of databases
+     * @param vdbs          input databases, null entries skipped
+     * @param nq            input number of vectors to search
+     * @param xq            input vectors to search, size nq * d
+     * @param distances     output pairwise distances, size nq
+     * @param xids          output labels of the 1-NNs, size nq
+     * @return the summed ntotal of the shards searched
+     */
+    static long MultiSearch(long nvdb, VectoDB* const* vdbs, long nq, const float* xq, float* distances, long* xids);
+
+    /**
+     * Search with an absolute deadline, for SLA-bound callers: the stages
+     * check the deadline at list/chunk granularity, whatever a stage cannot
+     * finish in time is skipped, and the merge still returns the best
+     * candidates found so far. partial is set to 1 when any stage was cut
+     * short, 0 when the answer is complete. Bypasses the result cache and
+     * the coalescer, whose waits would fight the deadline.
+     *
+     * @param nq                input the number of vectors to search
+     * @param xq                input vectors to search, size nq * d
+     * @param deadline_unix_us  input absolute deadline in unix microseconds, 0 means none
+     * @param distances         output pairwise distances, size nq
+     * @param xids              output labels of the 1-NNs, size nq
+     * @param partial           output whether the result is partial, may be null
+     */
+    long SearchDeadline(long nq, const float* xq, long deadline_unix_us, float* distances, long* xids, long* partial);
+
+    /**
+     * Query n vectors of dimension d to the index, returning the k nearest neighbors of each.
+     * The upper layer does memory management for xq, distances, xids.
+     *
+     * @param nq            input the number of vectors to search
+     * @param k             input the number of nearest neighbors per query
+     * @param xq            input vectors to search, size nq * d
+     * @param xids          output labels of the k-NNs, size nq * k, -1 paddings if less than k hits
+     * @param distances     output pairwise distances, size nq * k
+     */
+    long SearchKnn(long nq, long k, const float* xq, float* distances, long* xids);
+
+    /**
+     * Like SearchKnn, but only vectors whose xid is among allowed_xids may appear in the results.
+     * The predicate is applied before top-k selection, so excluded vectors never displace allowed ones.
+     *
+     * @param n_allowed     input the number of allowed xids
+     * @param allowed_xids  input allowed xids, size n_allowed
+     */
+    long SearchKnnFiltered(long nq, long k, const float* xq, long n_allowed, const long* allowed_xids, float* distances, long* xids);
+
+    /**
+     * Like SearchKnn, but with per-search parameter overrides, so
+     * latency-sensitive and batch callers can tune the same activated index
+     * differently instead of running two instances.
+     * Currently "nprobe=<n>" is supported, capped at the nprobe the index was
+     * activated with (the preassigned-search row stride is fixed at that
+     * value); build with a generous default and override downwards.
+     * Unknown params are ignored with a warning. Non-IVF indices ignore the
+     * override entirely.
+     *
+     * @param params        input comma-separated overrides, e.g. "nprobe=32"
+     */
+    long SearchKnnWithParams(long nq, long k, const float* xq, const char* params, float* distances, long* xids);
+
+    /**
+     * SearchKnn for backfill and other batch work sharing the instance with
+     * interactive traffic. The batch runs in small slices; each slice waits
+     * until no interactive search is in flight, so interactive queries
+     * preempt batch work at slice boundaries instead of queueing behind a
+     * whole block. Per-class counters are exposed through GetSearchStats.
+     * Full slices rerank their gathered candidates through one sgemm over a
+     * deduplicated tile, so large offline jobs are BLAS-bound rather than
+     * bound by per-query gather bandwidth.
+     */
+    long SearchKnnBatch(long nq, long k, const float* xq, float* distances, long* xids);
+
+    /**
+     * Query n vectors of dimension d to the index, returning all neighbors within radius.
+     * The upper layer does memory management for xq, distances, xids, lims.
+     *
+     * @param nq            input the number of vectors to search
+     * @param xq            input vectors to search, size nq * d
+     * @param radius        input search radius (metric-dependent, as faiss range_search)
+     * @param cap           input capacity of distances and xids
+     * @param distances     output distances, the results of query i are [lims[i], lims[i+1])
+     * @param xids          output labels, same layout as distances
+     * @param lims          output result offsets, size nq + 1
+     * @return the number of matches found, which may exceed cap
+     */
+    long SearchRange(long nq, const float* xq, float radius, long cap, float* distances, long* xids, long* lims);
+
+    /**
+     * Get per-stage search counters accumulated since the database was opened.
+     * Layout: [0] queries, [1..4] cycles spent in index search, refine,
+     * flat-tail scan and merge, [5] flat-tail rank-0 wins, [6] index rank-0
+     * wins, [7] result-cache lookups, [8] result-cache hits, [9..12]
+     * interactive/batch class queries and cycles, [13] queries answered at a
+     * degraded quality level, [14] current shed level, [15] effective
+     * parallelism (host cores capped by the cgroup CPU quota, re-detected
+     * periodically), [16] OpenMP governor tokens currently granted, [17..]
+     * log2 histogram of per-query search cycles.
+     *
+     * @param vals      output counters, the first min(n_vals, available) are written
+     * @param n_vals    input capacity of vals
+     * @return the number of available counters
+     */
+    long GetSearchStats(long* vals, long n_vals) const;
+
+    /**
+     * Slow-query ring (slowlog_us=<n>), newest first. Layout: [0] entry
+     * count, then 14 longs per entry: [unix us at completion, nq, k, batch,
+     * total wall us, lock wait us, coarse-quantization cycles, index-stage
+     * cycles (coarse included), refine cycles, flat-scan cycles, merge
+     * cycles, effective nprobe, lines of the selected inverted lists,
+     * process page faults during the call]. Stage costs are rdtsc cycles
+     * like GetSearchStats; empty unless opened with slowlog_us.
+     *
+     * @param vals      output, the first min(n_vals, available) are written
+     * @param n_vals    input capacity of vals
+     * @return the number of available longs
+     */
+    long GetSlowLog(long* vals, long n_vals) const;
+
+    /**
+     * Current overload-shedding level: 0 full quality, 1/2 progressively
+     * reduced nprobe and refine depth for interactive queries. Raised when
+     * the coalescer queue depth crosses thresholds, lowered again once the
+     * load recedes. Cheap enough to read around each search as a
+     * per-response degradation flag.
+     */
+    long GetShedLevel() const;
+
+    /**
+     * Inverted-list balance of the activated IVF index, for spotting the hot
+     * lists behind a bimodal latency histogram. Fills up to n_vals of:
+     * [nlist, nonempty lists, max list size, avg nonempty size,
+     * imbalance factor x1000 (1000 = uniform), lists split since open].
+     * Zeros (except the split counter) when no IVF index is active.
+     */
+    long GetIvfStats(long* vals, long n_vals) const;
+
+    /**
+     * Maintenance: split up to max_splits oversized inverted lists in place.
+     * A hot list (several times the mean size — clustered data piles up
+     * there) is re-clustered locally into two sub-centroids: one overwrites
+     * the list's centroid, the other is appended as a fresh list, and the
+     * entries are re-filed (PQ residual codes re-encoded) — no retraining,
+     * no nprobe raise. NUMA replicas get the identical split. Splits are not
+     * persisted; the next full build re-clusters from scratch anyway.
+     * Returns the number of lists split.
+     */
+    long SplitHotLists(long max_splits);
+
+    /**
+     * Per-segment temperature of the base mapping, for sizing the fast tier
+     * to the working set instead of the corpus. vals[0] is the segment
+     * count, then two slots per segment: whether it sits on the hot tier,
+     * and its refine gathers during the last completed RebalanceTiers
+     * window. Fills up to n_vals; returns the slots the full report takes.
+     */
+    long GetSegmentStats(long* vals, long n_vals) const;
+
+    /**
+     * Maintenance: adjust the residency of the base mapping from the refine
+     * access pattern since the last call. Gathers are counted per fixed-size
+     * block within each segment — candidates cluster by inverted list, so
+     * the hot blocks trace the hot lists — and an idle block has its pages
+     * released back to storage (refaulted on demand if touched again) while
+     * a block whose gather rate crossed the threshold is read back ahead of
+     * the searches. The appendable tail and the mlocked front never demote.
+     * Meant to run periodically; returns the number of blocks whose
+     * residency changed.
+     */
+    long RebalanceTiers();
+
+    /**
+     * Itemize the instance's memory footprint, for per-shard capacity
+     * planning instead of reading one process-wide RSS.
+     * Layout (bytes): [0] main index, [1] NUMA replicas, [2] delta indexes,
+     * [3] flat memtable with its signatures and norms, [4] xid mirror, norms
+     * mirror and the sharded xid map (map overhead estimated), [5] base
+     * mapping, [6] transient held by this instance's in-flight build,
+     * [7] build bytes in flight process-wide under build_mem_gb,
+     * [8]/[9] allocated/resident of the process-wide jemalloc build arena
+     * (resident far above allocated means fragmentation a purge has not
+     * returned yet), [10]/[11] the same for the index-storage arena,
+     * [12]/[13] jemalloc allocated/resident process-wide. [8..13] are zero
+     * when the binary is linked without jemalloc.
+     *
+     * @param vals      output sizes, the first min(n_vals, available) are written
+     * @param n_vals    input capacity of vals
+     * @return the number of available sizes
+     */
+    long GetMemoryStats(long* vals, long n_vals) const;
+
+    /**
+     * Report the base mapping footprint: bytes mapped vs bytes resident in
+     * RAM (via mincore), for sizing hugepage/mlock_gb settings.
+     *
+     * @param mapped_bytes      output size of the base mapping
+     * @param resident_bytes    output bytes of it resident in RAM
+     */
+    void GetMappingStats(long& mapped_bytes, long& resident_bytes) const;
+
+    /**
+     * Clone the database into another work directory while serving.
+     * Immutable files (full base segments, index and trained artifacts) are
+     * hardlinked, falling back to a copy when dst is on another filesystem;
+     * only the small mutable tail files are copied. Searches keep running, and
+     * the destination is a complete work_dir a VectoDB can open.
+     *
+     * @param dst_work_dir      input destination working directory
+     */
+    void Snapshot(const char* dst_work_dir);
+
+    /**
+     * Read up to max_lines durable base lines starting at start_line,
+     * decoded to floats, together with their xids. A replication shipper
+     * tails the base with this: read from its cursor until the return falls
+     * short, then poll again. Only lines complete in every column are
+     * returned, so a tail torn between columns is never shipped.
+     *
+     * @param start_line    input first base line to read
+     * @param max_lines     input capacity of xb (max_lines*dim) and xids
+     * @param xb            output vectors, decoded to floats
+     * @param xids          output xids
+     * @return the number of lines read
+     */
+    long ReadBaseTail(long start_line, long max_lines, float* xb, long* xids);
+
+    /**
+     * Read base lines patched in place by UpdateBase replays since this
+     * process opened the work dir. start_idx is a cursor into the in-memory
+     * patch log (0 at open); a record carries the line number, its current
+     * update count, xid and current vector content, and is idempotent to
+     * re-apply. A shipper replays the log from 0 on every (re)connect, so a
+     * standby that missed patches while disconnected still converges.
+     *
+     * @param start_idx     input cursor into the patch log
+     * @param max_lines     input capacity of the output arrays
+     * @param lines         output patched base line numbers
+     * @param counts        output current update counts of those lines
+     * @param xb            output current vectors, decoded to floats
+     * @param xids          output xids
+     * @return the number of records read
+     */
+    long ReadPatchedTail(long start_idx, long max_lines, long* lines, long* counts, float* xb, long* xids);
+
+    /**
+     * Overwrite base lines with replicated patch records, the standby side
+     * of an UpdateBase replay: rewrites the vector, count and norm columns,
+     * refreshes the in-memory mirrors and patches the live index tiers in
+     * place. Lines at or beyond the durable base are skipped; their later
+     * append ship already carries the patched content.
+     *
+     * @param n         input number of patch records
+     * @param lines     input patched base line numbers
+     * @param counts    input update counts of those lines
+     * @param xb        input patched vectors
+     * @return the number of lines applied
+     */
+    long ApplyPatch(long n, const long* lines, const long* counts, const float* xb);
+
+    /**
+     * Page the activated index and the base mapping into RAM at a bounded I/O
+     * rate, so the first minutes of traffic after a restart or activation do
+     * not fault them in on the query path. Touches the quantizer centroids,
+     * every inverted list and the flat memtable, then walks the base segments
+     * front to back (the mlock'd hot-front region first).
+     * Synchronous: the return is the readiness signal. Run it from a
+     * background thread and gate traffic on IsWarm to warm while serving.
+     *
+     * @param budget_mbps   input I/O budget in MB/s, <=0 means unthrottled
+     * @return the number of bytes touched
+     */
+    long Warmup(int budget_mbps);
+
+    /**
+     * Whether a Warmup has completed since the database was opened.
+     */
+    bool IsWarm() const;
+
 public:
     /** 
      * Remove base and index files under the given work directory.
@@ -117,6 +650,13 @@ public:
      */
     static void ClearWorkDir(const char* work_dir);
 
+    /**
+     * Records dropped by the asynchronous event log (process-wide, shared
+     * by all instances). Engine threads never block on log I/O; when a
+     * per-thread event ring fills, records are dropped and counted here.
+     */
+    static long GetEvtLogDropped();
+
     /** 
      * Compare distance. Return true if dis1 is closer then dis2.
      *
@@ -126,18 +666,101 @@ public:
         return (metric_type == 0) == (dis1 > dis2);
     }
     static void Normalize(std::vector<float>& vec);
+    /**
+     * L2-normalize nb vectors of dimension dim in place with the vectorized
+     * norm kernels, parallel across the batch. One call replaces a per-vector
+     * scalar loop on the ingest and query paths; zero vectors stay zero.
+     */
+    static void NormalizeBatch(long nb, long dim, float* xb);
+
+    /**
+     * Span tracing, process-wide across all instances: builds, activations,
+     * group commits, update replays and search batches record begin/end
+     * spans into a fixed lock-free ring while recording is on. TraceDump
+     * stops recording and writes the ring as Chrome trace-event JSON to fp,
+     * loadable in Perfetto/chrome://tracing to see what overlapped with a
+     * latency spike. Disarmed spans cost one relaxed load.
+     *
+     * @return the number of spans dumped, -1 if fp cannot be opened
+     */
+    static void TraceStart();
+    static void TraceStop();
+    static long TraceDump(const char* fp);
     static void mmapFile(const std::string& fp, uint8_t*& data, long& len_data);
     static void munmapFile(const std::string& fp, uint8_t*& data, long& len_data);
+    /**
+     * Switch the kernel access-pattern advice of a mapped range. Mappings
+     * start out MADV_RANDOM for the refine gather; bulk scans flip their
+     * range to sequential (readahead + willneed) and back when done.
+     */
+    static void adviseAccess(uint8_t* data, long len, bool sequential);
 
 private:
     std::string getBaseFp() const;
+    std::string getXidsFp() const;
+    std::string getCountsFp() const;
+    std::string getNormsFp() const;
+    void loadBaseNorms();
+    std::string getDelsFp() const;
+    std::string getCompactFp() const;
+    void loadDels();
+    std::string getTimesFp() const;
+    void loadTimes();
+    long deleteInner(long nb, const long* xids);
+    void recoverCompact();
+    long compactInner();
+    std::string getVecFp() const;
+    std::string getVecSegFp(long k) const;
     std::string getIndexFp(long ntrain) const;
+    std::string getTrainedFp() const;
+    long readTrainedNtrain() const;
+    void writeTrained(faiss::Index* index, long nt) const;
+    std::string getManifestFp() const;
+    long readManifest() const;
+    void writeManifest(long ntrain, long nbase) const;
     std::string getUpdateFp() const;
+    void openAppender(std::fstream& fs, const std::string& fp) const;
+    int openAppendFd(const std::string& fp) const;
+    void servWal();
+    void drainWal();
+    void servFollow();
+    void refreshFollowTail();
+    void refreshFollowDels();
+    void streamAbsorb();
+    faiss::Index* newMemtable() const;
+    void parseNumaTopology();
+    faiss::Index* localIndexReplica() const;
+    long searchUncached(long nq, const float* xq, float* distances, long* xids);
+    void noteCoalDepth(long depth) const;
+    void lshSign(const float* vec, uint64_t* sig) const;
+    std::string chooseIndexKey(long nb) const;
+    void buildIndexInner(long cur_ntrain, long cur_nsize, faiss::Index*& index, long& ntrain) const;
+    long remapBase();
+    void rebuildFlatTail(long cut, long nb);
+    long patchIvfEntries(faiss::Index* idx, long label_offset, const std::vector<long>& lines,
+        const std::vector<float>& old_vecs, const std::vector<float>& new_vecs) const;
+    long patchIndexTiers(const std::vector<long>& lines, const std::vector<float>& old_vecs, const std::vector<float>& new_vecs);
+    bool updAbsorb(const char* recs, long nrec, long epoch0);
+    void updSpillLocked();
+    void applyMappingOptions(uint8_t* data, long len, long mlock_len) const;
+    std::string autoTuneParams(faiss::Index* index, const std::vector<SegMap>& segs, long nb) const;
+    long searchKnnFiltered(long nq, long k, const float* xq, const std::unordered_set<long>* allowed, float* distances, long* xids, long nprobe_override = 0, long deadline_us = 0, bool* partial = nullptr, bool batch = false);
+    void migrateBaseV1();
+    void migrateVecSegments();
+    void recoverTornTails() const;
+    long mapVecSegments(std::vector<SegMap>& segs, bool sequential) const;
+    void unmapVecSegments(std::vector<SegMap>& segs) const;
+    const uint8_t* segLine(const std::vector<SegMap>& segs, long line_num) const;
+    void noteSegAccess(long line_num) const;
     long getNumLines(long len_data, long len_base_line) const;
     long getIndexFpNtrain() const;
-    void clearIndexFiles();
-    void readBase(const uint8_t* data, long len_data, long start_num, std::vector<float>& base) const;
-    void readXids(const uint8_t* data, long len_data, long start_num, std::vector<long>& xids) const;
+    void clearIndexFiles(const std::string& keep);
+    void rotateIndexFiles() const;
+    void addChunked(faiss::Index* index, const std::vector<SegMap>& segs, long num_line, long start_num) const;
+    void addDeduped(std::vector<long>& keep_xids, std::vector<float>& keep_vec);
+    void readBase(const std::vector<SegMap>& segs, long num_line, long start_num, std::vector<float>& base) const;
+    bool readBaseDirect(long num_line, long start_num, std::vector<float>& base) const;
+    void readXids(long num_line, long start_num, std::vector<long>& xids) const;
 
 private:
     std::string work_dir;
@@ -145,9 +768,42 @@ private:
     long len_vec;
     long len_base_line;
     long len_upd_line;
+    long seg_lines; //lines per base.vec.<k> segment file (SEG_BYTES / len_vec)
     int metric_type;
+    float (*fvec_l2)(const float*, const float*, size_t); //exact L2, fully unrolled for dim 128/256/512
+    float (*fvec_ip)(const float*, const float*, size_t); //exact inner product, same specialization
     float dist_threshold;
     std::string index_key;
     std::string query_params;
+    std::string memtable_key; //"Flat" (default), "Flat16", "SQ8", "FlatBlk" or "HNSW<M>" for the unindexed tail
+    bool ondisk_ivf; //keep IVF inverted lists in a mapped .ivfdata file
+    bool mmap_index; //persist aligned sectioned index files, open with read_index_mmap
+    bool sq8; //store base.vec SQ8-encoded with per-vector scale, 4x smaller
+    bool binary; //store base.vec 1-bit packed for binary fingerprints, 32x smaller; squared L2 on 0/1 vectors is Hamming
+    bool readonly; //follower over a shared work_dir: no write streams, tails the writer's appends and activations
+    bool attach; //co-located readonly attach: implies readonly and mmap_index, polls the writer at 100ms
+    long minibatch_niter; //minibatch k-means iterations for coarse quantizer training, 0 = full-batch only
+    long build_threads; //OpenMP team size of the build thread, 0 = runtime default
+    int build_core_lo, build_core_hi; //cpu range the build thread is pinned to, -1 = no pinning
+    long build_nice; //CPU nice of the build thread (idle I/O class when >=10), 0 = unchanged
+    long build_mem_gb; //memory budget staggering concurrent builds process-wide, 0 = unlimited
+    bool build_direct; //stream the base through O_DIRECT during builds, protecting the page cache
+    long stream_add; //stream the durable tail into the live index once the flat holds this many lines, 0 disables
+    int gpu_device; //GPU device BuildIndex trains and adds on, -1 = CPU only
+    bool huge_pages; //advise MADV_HUGEPAGE on the base mapping
+    long mlock_bytes; //lock the first n bytes of the base mapping in RAM, 0 = none
+    long coalesce_us; //window for merging concurrent 1-NN searches, 0 disables
+    long cache_cap; //slots of the 1-NN result cache, rounded up to a power of two, 0 disables
+    long upd_coalesce; //distinct lines of the in-memory update-coalescing table, 0 appends every update to the backlog file
+    long ttl_sec; //vectors older than this expire via SweepExpired, 0 disables TTL
+    bool upd_sq8; //store update.fvecs payloads SQ8-encoded with per-vector scale, 4x less backlog I/O
+    long slowlog_us; //searches slower than this record their per-stage breakdown, 0 disables the slow-query log
+    bool ids32; //replace the 64-bit per-list ids of the activated IVF index with one compact 32-bit table
+    int lsh_bits; //bits of the flat-tail LSH prefilter signatures, whole 64-bit words, 0 disables
+    long pca_dim; //index the base in a PCA-reduced space of this many dims, 0 disables
+    std::vector<float> lsh_planes; //lsh_bits random hyperplanes of dim floats each
+    int numa_nodes; //replicate the activated index per NUMA node when >1
+    std::vector<cpu_set_t> node_cpus; //cpus of each node, binds the first-touch replica builds
+    std::vector<int> cpu_to_node; //cpu -> node, routes each query to its local replica
     std::unique_ptr<DbState> state;
 };
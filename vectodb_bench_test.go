@@ -0,0 +1,190 @@
+package vectodb
+
+// Concurrent soak benchmarks for the production pattern the functional tests
+// never exercise: AddWithIds + Search + UpdateIndex hammering one instance at
+// the same time. Locking regressions on the add/search/activate paths show up
+// here as throughput cliffs long before release.
+//
+//	go test -run=NONE -bench=BenchmarkMixed -benchtime=30s
+//	BENCH_SOAK_CYCLES=10 go test -run=NONE -bench=BenchmarkSoak -benchtime=1x
+//
+// Knobs (environment): BENCH_DIM, BENCH_WRITERS, BENCH_SEARCHERS, BENCH_BATCH,
+// BENCH_SEED, BENCH_SOAK_CYCLES.
+
+import (
+	"math/rand"
+	"os"
+	"runtime"
+	"strconv"
+	"sync"
+	"sync/atomic"
+	"testing"
+	"time"
+)
+
+const benchWorkDir string = "/tmp/vectodb_bench_go"
+
+func envInt(name string, def int) int {
+	if s := os.Getenv(name); s != "" {
+		if v, err := strconv.Atoi(s); err == nil {
+			return v
+		}
+	}
+	return def
+}
+
+func benchVecs(r *rand.Rand, n, d int) (xb []float32) {
+	xb = make([]float32, n*d)
+	for i := 0; i < len(xb); i++ {
+		xb[i] = r.Float32()
+	}
+	return
+}
+
+func newBenchDb(b *testing.B, d int) (vdb *VectoDB) {
+	var err error
+	if err = VectodbClearWorkDir(benchWorkDir); err != nil {
+		b.Fatalf("%+v", err)
+	}
+	if vdb, err = NewVectoDB(benchWorkDir, d, metric, indexkey, queryParams, distThr, flatThr); err != nil {
+		b.Fatalf("%+v", err)
+	}
+	r := rand.New(rand.NewSource(int64(envInt("BENCH_SEED", 42))))
+	seed := envInt("BENCH_SEED_VECTORS", 10000)
+	xb := benchVecs(r, seed, d)
+	xids := make([]int64, seed)
+	for i := 0; i < seed; i++ {
+		xids[i] = int64(i)
+	}
+	if err = vdb.AddWithIds(xb, xids); err != nil {
+		b.Fatalf("%+v", err)
+	}
+	return
+}
+
+// startWriters launches background goroutines appending random batches until
+// stop closes, counting added vectors. Writer w owns the xid range w<<40.
+func startWriters(b *testing.B, vdb *VectoDB, d, writers, batch int, stop chan struct{}, wg *sync.WaitGroup, adds *uint64) {
+	for w := 0; w < writers; w++ {
+		wg.Add(1)
+		go func(w int) {
+			defer wg.Done()
+			r := rand.New(rand.NewSource(int64(w + 1)))
+			xids := make([]int64, batch)
+			next := int64(w+1) << 40
+			for {
+				select {
+				case <-stop:
+					return
+				default:
+				}
+				xb := benchVecs(r, batch, d)
+				for i := 0; i < batch; i++ {
+					xids[i] = next
+					next++
+				}
+				if err := vdb.AddWithIds(xb, xids); err != nil {
+					b.Errorf("%+v", err)
+					return
+				}
+				atomic.AddUint64(adds, uint64(batch))
+			}
+		}(w)
+	}
+}
+
+// BenchmarkMixed measures search throughput while a configurable set of
+// writers appends concurrently, reporting both sides plus allocations.
+func BenchmarkMixed(b *testing.B) {
+	d := envInt("BENCH_DIM", 128)
+	writers := envInt("BENCH_WRITERS", 2)
+	searchers := envInt("BENCH_SEARCHERS", runtime.GOMAXPROCS(0))
+	batch := envInt("BENCH_BATCH", 64)
+	vdb := newBenchDb(b, d)
+	defer vdb.Destroy()
+
+	stop := make(chan struct{})
+	var wg sync.WaitGroup
+	var adds uint64
+	startWriters(b, vdb, d, writers, batch, stop, &wg, &adds)
+
+	b.SetParallelism((searchers + runtime.GOMAXPROCS(0) - 1) / runtime.GOMAXPROCS(0))
+	b.ReportAllocs()
+	b.ResetTimer()
+	t0 := time.Now()
+	b.RunParallel(func(pb *testing.PB) {
+		r := rand.New(rand.NewSource(time.Now().UnixNano()))
+		dis := make([]float32, 1)
+		xids := make([]int64, 1)
+		for pb.Next() {
+			xq := benchVecs(r, 1, d)
+			if _, err := vdb.Search(xq, dis, xids); err != nil {
+				b.Errorf("%+v", err)
+				return
+			}
+		}
+	})
+	elapsed := time.Since(t0).Seconds()
+	b.StopTimer()
+	close(stop)
+	wg.Wait()
+	b.ReportMetric(float64(atomic.LoadUint64(&adds))/elapsed, "adds/s")
+}
+
+// BenchmarkSoak runs the mixed workload across several BuildIndex/
+// ActivateIndex cycles per iteration: writers and searchers hammer the
+// instance while UpdateIndex rebuilds and swaps the index underneath them.
+// Run with -benchtime=1x (or a small count) and BENCH_SOAK_CYCLES sized to
+// the soak length wanted.
+func BenchmarkSoak(b *testing.B) {
+	d := envInt("BENCH_DIM", 128)
+	writers := envInt("BENCH_WRITERS", 2)
+	searchers := envInt("BENCH_SEARCHERS", runtime.GOMAXPROCS(0))
+	batch := envInt("BENCH_BATCH", 64)
+	cycles := envInt("BENCH_SOAK_CYCLES", 3)
+	vdb := newBenchDb(b, d)
+	defer vdb.Destroy()
+
+	stop := make(chan struct{})
+	var wg sync.WaitGroup
+	var adds, searches uint64
+	startWriters(b, vdb, d, writers, batch, stop, &wg, &adds)
+	for s := 0; s < searchers; s++ {
+		wg.Add(1)
+		go func(s int) {
+			defer wg.Done()
+			r := rand.New(rand.NewSource(int64(s + 1)))
+			dis := make([]float32, 1)
+			xids := make([]int64, 1)
+			for {
+				select {
+				case <-stop:
+					return
+				default:
+				}
+				xq := benchVecs(r, 1, d)
+				if _, err := vdb.Search(xq, dis, xids); err != nil {
+					b.Errorf("%+v", err)
+					return
+				}
+				atomic.AddUint64(&searches, 1)
+			}
+		}(s)
+	}
+
+	b.ResetTimer()
+	t0 := time.Now()
+	for i := 0; i < b.N; i++ {
+		for c := 0; c < cycles; c++ {
+			if err := vdb.UpdateIndex(); err != nil {
+				b.Fatalf("%+v", err)
+			}
+		}
+	}
+	elapsed := time.Since(t0).Seconds()
+	b.StopTimer()
+	close(stop)
+	wg.Wait()
+	b.ReportMetric(float64(atomic.LoadUint64(&adds))/elapsed, "adds/s")
+	b.ReportMetric(float64(atomic.LoadUint64(&searches))/elapsed, "searches/s")
+}
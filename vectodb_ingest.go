@@ -0,0 +1,213 @@
+package vectodb
+
+// Streaming ingestion sink. Pipelines feeding a VectoDB from a message bus
+// tend to either under-batch (one engine call per record, paying the
+// group-commit wait each time) or buffer without bound (OOM once the
+// consumer lags). Sink standardizes the fast path: records accepted by Put
+// are buffered in a bounded channel, a flusher goroutine batches them
+// adaptively against a size and a latency target and hands the batches to
+// AddWithIds/UpsertWithIds, and two backpressure points push slowness to
+// the producer instead of into memory — Put blocks when the channel is
+// full, and the flusher pauses while the engine's group-commit queue
+// (GetWalQueueDepth) is deeper than the configured bound.
+//
+// The flush size adapts between sinkMinBatch and sinkMaxBatch: a flush that
+// took longer than half the linger bound halves it, a flush that left the
+// channel more than a batch deep doubles it, so steady load converges on
+// the largest batch that still meets the latency target.
+
+import (
+	"sync"
+	"sync/atomic"
+	"time"
+
+	log "github.com/sirupsen/logrus"
+)
+
+const (
+	sinkMinBatch      = 64
+	sinkMaxBatch      = 8192
+	sinkDefaultBatch  = 256
+	sinkDefaultLinger = 50 * time.Millisecond
+	sinkDefaultDepth  = 1 << 16 //group-commit lines pending before the flusher pauses
+	sinkDepthPoll     = time.Millisecond
+)
+
+type SinkConfig struct {
+	BatchSize   int           //initial flush size in records, adapted at runtime (default 256)
+	MaxLinger   time.Duration //the oldest buffered record flushes within this bound (default 50ms)
+	QueueCap    int           //buffered records before Put blocks (default 16*BatchSize)
+	MaxWalDepth int           //engine group-commit backlog, in lines, above which flushing pauses (default 65536)
+	Upsert      bool          //flush with UpsertWithIds instead of AddWithIds
+}
+
+// SinkStats is a snapshot of the sink counters, read from atomics.
+type SinkStats struct {
+	Accepted  int64 //records accepted by Put/PutBatch
+	Flushed   int64 //records handed to the engine
+	Flushes   int64 //engine calls issued
+	StallNs   int64 //time the flusher spent paused on engine backpressure
+	Queued    int   //records currently buffered, the consumer lag
+	BatchSize int   //current adaptive flush size
+}
+
+type sinkRec struct {
+	xid int64
+	vec []float32
+}
+
+// Sink accepts a stream of (xid, vector) records and feeds them to one
+// VectoDB. The sink takes ownership of every vector slice passed in; the
+// caller must not modify it afterwards. Close flushes what is buffered and
+// stops the flusher; Put after Close panics on the closed channel.
+type Sink struct {
+	vdb  *VectoDB
+	conf SinkConfig
+	in   chan sinkRec
+	wg   sync.WaitGroup
+
+	accepted int64
+	flushed  int64
+	flushes  int64
+	stallNs  int64
+	batch    int64
+}
+
+func NewSink(vdb *VectoDB, conf SinkConfig) (s *Sink) {
+	if conf.BatchSize <= 0 {
+		conf.BatchSize = sinkDefaultBatch
+	}
+	if conf.MaxLinger <= 0 {
+		conf.MaxLinger = sinkDefaultLinger
+	}
+	if conf.QueueCap <= 0 {
+		conf.QueueCap = 16 * conf.BatchSize
+	}
+	if conf.MaxWalDepth <= 0 {
+		conf.MaxWalDepth = sinkDefaultDepth
+	}
+	s = &Sink{
+		vdb:   vdb,
+		conf:  conf,
+		in:    make(chan sinkRec, conf.QueueCap),
+		batch: int64(conf.BatchSize),
+	}
+	s.wg.Add(1)
+	go s.flushLoop()
+	return
+}
+
+// Put buffers one record, blocking while the sink is QueueCap deep.
+func (s *Sink) Put(xid int64, vec []float32) {
+	if len(vec) != s.vdb.dim {
+		log.Fatalf("invalid length of vec, want %v, have %v", s.vdb.dim, len(vec))
+	}
+	s.in <- sinkRec{xid: xid, vec: vec}
+	atomic.AddInt64(&s.accepted, 1)
+	return
+}
+
+// PutBatch buffers a block of records laid out like AddWithIds; the sink
+// keeps subslices of xb, so the caller must not modify it afterwards.
+func (s *Sink) PutBatch(xb []float32, xids []int64) {
+	nb := len(xids)
+	if len(xb) != nb*s.vdb.dim {
+		log.Fatalf("invalid length of xb, want %v, have %v", nb*s.vdb.dim, len(xb))
+	}
+	for i := 0; i < nb; i++ {
+		s.in <- sinkRec{xid: xids[i], vec: xb[i*s.vdb.dim : (i+1)*s.vdb.dim]}
+	}
+	atomic.AddInt64(&s.accepted, int64(nb))
+	return
+}
+
+// Close flushes every buffered record and stops the flusher.
+func (s *Sink) Close() {
+	close(s.in)
+	s.wg.Wait()
+	return
+}
+
+func (s *Sink) Stats() (st SinkStats) {
+	st = SinkStats{
+		Accepted:  atomic.LoadInt64(&s.accepted),
+		Flushed:   atomic.LoadInt64(&s.flushed),
+		Flushes:   atomic.LoadInt64(&s.flushes),
+		StallNs:   atomic.LoadInt64(&s.stallNs),
+		Queued:    len(s.in),
+		BatchSize: int(atomic.LoadInt64(&s.batch)),
+	}
+	return
+}
+
+func (s *Sink) flushLoop() {
+	defer s.wg.Done()
+	dim := s.vdb.dim
+	xb := make([]float32, 0, sinkMaxBatch*dim)
+	xids := make([]int64, 0, sinkMaxBatch)
+	linger := time.NewTimer(s.conf.MaxLinger)
+	defer linger.Stop()
+	for {
+		// block for the first record of the batch, then drain until the
+		// adaptive size is reached or the oldest record has lingered enough
+		rec, ok := <-s.in
+		if !ok {
+			return
+		}
+		batch := int(atomic.LoadInt64(&s.batch))
+		xb = append(xb[:0], rec.vec...)
+		xids = append(xids[:0], rec.xid)
+		if !linger.Stop() {
+			select {
+			case <-linger.C:
+			default:
+			}
+		}
+		linger.Reset(s.conf.MaxLinger)
+		full := false
+		for len(xids) < batch && !full {
+			select {
+			case rec, ok = <-s.in:
+				if !ok {
+					full = true
+					break
+				}
+				xb = append(xb, rec.vec...)
+				xids = append(xids, rec.xid)
+			case <-linger.C:
+				full = true
+			}
+		}
+		// engine backpressure: let the group-commit writer drain before
+		// handing it more, which fills the channel and blocks the producers
+		if s.vdb.GetWalQueueDepth() > s.conf.MaxWalDepth {
+			stall := time.Now()
+			for s.vdb.GetWalQueueDepth() > s.conf.MaxWalDepth {
+				time.Sleep(sinkDepthPoll)
+			}
+			atomic.AddInt64(&s.stallNs, int64(time.Since(stall)))
+		}
+		t0 := time.Now()
+		if s.conf.Upsert {
+			s.vdb.UpsertWithIds(xb, xids)
+		} else {
+			s.vdb.AddWithIds(xb, xids)
+		}
+		dur := time.Since(t0)
+		atomic.AddInt64(&s.flushed, int64(len(xids)))
+		atomic.AddInt64(&s.flushes, 1)
+		if dur > s.conf.MaxLinger/2 && batch > sinkMinBatch {
+			batch /= 2
+			if batch < sinkMinBatch {
+				batch = sinkMinBatch
+			}
+			atomic.StoreInt64(&s.batch, int64(batch))
+		} else if dur <= s.conf.MaxLinger/2 && len(s.in) > batch && batch < sinkMaxBatch {
+			batch *= 2
+			if batch > sinkMaxBatch {
+				batch = sinkMaxBatch
+			}
+			atomic.StoreInt64(&s.batch, int64(batch))
+		}
+	}
+}
@@ -0,0 +1,42 @@
+package vectodb
+
+import (
+	"math/rand"
+	"testing"
+	"time"
+
+	"github.com/stretchr/testify/require"
+)
+
+const workDirIngest string = "/tmp/vectodb_ingest_test_go"
+
+func TestVectodbSink(t *testing.T) {
+	VectodbClearWorkDir(workDirIngest)
+	vdb, err := NewVectoDB(workDirIngest, dim, metric, indexkey, queryParams, distThr, flatThr)
+	require.NoError(t, err)
+
+	const nb = 5000
+	s := NewSink(vdb, SinkConfig{MaxLinger: 10 * time.Millisecond})
+	for i := 0; i < nb; i++ {
+		vec := make([]float32, dim)
+		for j := 0; j < dim; j++ {
+			vec[j] = rand.Float32()
+		}
+		normalizeInplace(dim, vec)
+		s.Put(int64(i), vec)
+	}
+	s.Close()
+
+	st := s.Stats()
+	require.Equal(t, int64(nb), st.Accepted)
+	require.Equal(t, int64(nb), st.Flushed)
+	require.Equal(t, 0, st.Queued)
+	require.True(t, st.Flushes < nb, "flusher did not batch: %v calls for %v records", st.Flushes, nb)
+
+	total, err := vdb.GetTotal()
+	require.NoError(t, err)
+	require.Equal(t, nb, total)
+
+	err = vdb.Destroy()
+	require.NoError(t, err)
+}
@@ -7,8 +7,10 @@ import (
 	"os"
 	"path/filepath"
 	"regexp"
+	"runtime"
 	"sort"
 	"strconv"
+	"sync"
 	"sync/atomic"
 	"time"
 
@@ -29,12 +31,58 @@ type VectodbMulti struct {
 	distThr     float32
 	workDir     string //the working directory of each VectoDB instance is <workDir>/vdb-<seq>
 	sizeLimit   int    //size limit of each VectoDB instance
+	builderWorkers int //number of concurrent UpdateIndex workers of the builder loop
+	searchWorkers  int     //number of concurrent per-shard searches of Search
+	earlyMargin    float32 //margin beyond distThr at which Search stops querying further shards, 0 disables
+	hedge          bool    //re-issue a shard search past the shard's recent p95 latency, first response wins
 
 	//state
 	curXidBatch int64
 	maxSeq      int
-	vdbs        []*VectoDB
+	vdbs        []*VectoDB //nil entries are shards still opening, Search routes around them
 	cancel      context.CancelFunc
+
+	//shard opening, concurrent since a cold read_index takes minutes per big shard
+	readyShards int32 //shards open and serving
+	openWg      sync.WaitGroup
+	mtxOpen     sync.Mutex
+	openErr     error //first shard-open failure, reported by WaitReady
+
+	//write buffering: producers append into lock-striped buffers, threshold
+	//and ticker flushes drain them into one large AddWithIds cgo call
+	addBuffers []*addBuffer
+	addRR      uint32     //round-robin cursor over the stripes
+	mtxFlush   sync.Mutex //serializes flushes and write-head rollover
+	flushErr   error      //sticky first flush failure, guarded by mtxFlush
+
+	//id allocation, a large range is minted per rangeAlloc round-trip and
+	//sub-allocated locally under mtxXid
+	rangeAlloc  RangeAllocator
+	mtxXid      sync.Mutex
+	xidCur      int64 //next batch of the current range
+	xidEnd      int64 //first batch beyond the current range
+	xidNext     int64 //first batch of the prefetched range, -1 if none
+	xidNextEnd  int64
+	xidFetching bool
+
+	//hedged search: recent per-shard latencies feed a p95 deadline past
+	//which the query is issued a second time against the same shard
+	mtxLat    sync.Mutex
+	shardLats map[*VectoDB]*shardLat
+}
+
+const (
+	addBufferStripes = 8                     //lock-striped write buffers, sized to producer parallelism
+	addFlushVectors  = 4096                  //a stripe beyond this size triggers an immediate flush
+	addFlushInterval = 50 * time.Millisecond //ticker flush for trickle producers
+)
+
+//addBuffer is one stripe of the write buffer. Producers hash onto stripes
+//round-robin so they rarely contend on the same mutex.
+type addBuffer struct {
+	mtx  sync.Mutex
+	xb   []float32
+	xids []int64
 }
 
 func MinInt(x, y int) int {
@@ -87,6 +135,16 @@ func NewVectodbMulti(workDir string, dim int, metricType int, indexKey string, q
 		workDir:     workDir,
 		sizeLimit:   sizeLimit,
 		curXidBatch: 0,
+		builderWorkers: MaxInt(1, runtime.NumCPU()/2),
+		searchWorkers:  MaxInt(1, runtime.NumCPU()/2),
+		earlyMargin:    0,
+		hedge:          true,
+		xidNext:        -1,
+		shardLats:      make(map[*VectoDB]*shardLat),
+	}
+	vm.rangeAlloc = func(nBatches int64) (batchBegin int64, err error) {
+		batchBegin = atomic.AddInt64(&vm.curXidBatch, nBatches) - nBatches
+		return
 	}
 	if err = os.MkdirAll(workDir, 0700); err != nil {
 		err = errors.Wrap(err, "")
@@ -118,15 +176,175 @@ func NewVectodbMulti(workDir string, dim int, metricType int, indexKey string, q
 		seqs = append(seqs, 0)
 	}
 	sort.Ints(seqs)
-	for _, seq := range seqs {
-		dp := filepath.Join(workDir, getWorkDir(seq))
-		vdb, err = NewVectoDB(dp, dim, metricType, indexKey, queryParams, distThr, vm.sizeLimit/200)
-		vm.vdbs = append(vm.vdbs, vdb)
-	}
 	vm.maxSeq = seqs[len(seqs)-1]
+	vm.vdbs = make([]*VectoDB, len(seqs))
+	// The write-head (newest) shard opens synchronously so AddWithIds works
+	// as soon as the constructor returns; it is also the least full one.
+	last := len(seqs) - 1
+	dp := filepath.Join(workDir, getWorkDir(seqs[last]))
+	if vdb, err = NewVectoDB(dp, dim, metricType, indexKey, queryParams, distThr, vm.sizeLimit/200); err != nil {
+		return
+	}
+	vm.vdbs[last] = vdb
+	atomic.AddInt32(&vm.readyShards, 1)
+	// The rest open on a bounded worker pool; each shard begins serving the
+	// moment it is ready and the nil entries tell Search, UpdateWithIds and
+	// the builder loop to route around the ones still loading.
+	jobs := make(chan int)
+	for w := 0; w < MinInt(MaxInt(1, runtime.NumCPU()/2), last); w++ {
+		vm.openWg.Add(1)
+		go func() {
+			defer vm.openWg.Done()
+			for i := range jobs {
+				t0 := time.Now()
+				dp2 := filepath.Join(vm.workDir, getWorkDir(seqs[i]))
+				vdb2, err2 := NewVectoDB(dp2, vm.dim, vm.metricType, vm.indexKey, vm.queryParams, vm.distThr, vm.sizeLimit/200)
+				if err2 != nil {
+					log.Errorf("opening shard %s: %+v", dp2, err2)
+					vm.mtxOpen.Lock()
+					if vm.openErr == nil {
+						vm.openErr = err2
+					}
+					vm.mtxOpen.Unlock()
+					continue
+				}
+				vm.vdbs[i] = vdb2
+				n := atomic.AddInt32(&vm.readyShards, 1)
+				log.Infof("shard %s ready in %v, %d/%d serving", dp2, time.Since(t0), n, len(vm.vdbs))
+			}
+		}()
+	}
+	go func() {
+		for i := 0; i < last; i++ {
+			jobs <- i
+		}
+		close(jobs)
+	}()
+	vm.addBuffers = make([]*addBuffer, addBufferStripes)
+	for i := range vm.addBuffers {
+		vm.addBuffers[i] = &addBuffer{}
+	}
+	go func() {
+		ticker := time.Tick(addFlushInterval)
+		for range ticker {
+			vm.Flush()
+		}
+	}()
 	return
 }
 
+//ShardsReady reports how many shards are open and serving out of the total,
+//so the cluster layer can route around a node that is still loading.
+func (vm *VectodbMulti) ShardsReady() (ready, total int) {
+	return int(atomic.LoadInt32(&vm.readyShards)), len(vm.vdbs)
+}
+
+//WaitReady blocks until every shard has finished opening and returns the
+//first open failure, if any. NewVectodbMulti only waits for the write-head
+//shard; callers needing full coverage (e.g. exhaustive dedup) wait here.
+func (vm *VectodbMulti) WaitReady() (err error) {
+	vm.openWg.Wait()
+	vm.mtxOpen.Lock()
+	err = vm.openErr
+	vm.mtxOpen.Unlock()
+	return
+}
+
+const (
+	latRingCap    = 64 //recent latencies tracked per shard, feeding the p95 estimate
+	latMinSamples = 16 //hedging stays off until a shard has this many samples
+)
+
+//shardLat tracks the recent search latencies of one shard.
+type shardLat struct {
+	mtx  sync.Mutex
+	ring [latRingCap]time.Duration
+	next int
+	n    int
+}
+
+func (sl *shardLat) observe(d time.Duration) {
+	sl.mtx.Lock()
+	sl.ring[sl.next] = d
+	sl.next = (sl.next + 1) % latRingCap
+	if sl.n < latRingCap {
+		sl.n++
+	}
+	sl.mtx.Unlock()
+}
+
+//p95 returns the 95th percentile of the recent latencies, 0 while there are
+//too few samples to hedge on.
+func (sl *shardLat) p95() (d time.Duration) {
+	sl.mtx.Lock()
+	if sl.n < latMinSamples {
+		sl.mtx.Unlock()
+		return 0
+	}
+	lats := make([]time.Duration, sl.n)
+	copy(lats, sl.ring[:sl.n])
+	sl.mtx.Unlock()
+	sort.Slice(lats, func(i, j int) bool { return lats[i] < lats[j] })
+	return lats[len(lats)*95/100]
+}
+
+func (vm *VectodbMulti) latOf(vdb *VectoDB) (sl *shardLat) {
+	vm.mtxLat.Lock()
+	var ok bool
+	if sl, ok = vm.shardLats[vdb]; !ok {
+		sl = &shardLat{}
+		vm.shardLats[vdb] = sl
+	}
+	vm.mtxLat.Unlock()
+	return
+}
+
+//searchShardHedged runs one shard search, issuing the query a second time
+//against the same shard if the first attempt hasn't answered within the p95
+//of the shard's recent latencies. The tail events hedging cuts (a GC pause,
+//an activation or page fault burst) rarely hit both attempts, so the first
+//response wins and the loser is discarded. Each attempt's latency feeds the
+//estimator. Without hedging (disabled, or too few samples yet) this is a
+//plain timed call into the caller's buffers.
+func (vm *VectodbMulti) searchShardHedged(vdb *VectoDB, nq int, xq []float32, dis []float32, xids []int64) (total int, err error) {
+	sl := vm.latOf(vdb)
+	p95 := sl.p95()
+	if !vm.hedge || p95 <= 0 {
+		t0 := time.Now()
+		total, err = vdb.Search(xq, dis, xids)
+		sl.observe(time.Since(t0))
+		return
+	}
+	type shardResp struct {
+		total int
+		err   error
+		dis   []float32
+		xids  []int64
+	}
+	ch := make(chan shardResp, 2) //buffered so the loser's send doesn't leak its goroutine
+	attempt := func() {
+		dis2 := make([]float32, nq)
+		xids2 := make([]int64, nq)
+		t0 := time.Now()
+		total2, err2 := vdb.Search(xq, dis2, xids2)
+		sl.observe(time.Since(t0))
+		ch <- shardResp{total2, err2, dis2, xids2}
+	}
+	go attempt()
+	var resp shardResp
+	timer := time.NewTimer(p95)
+	select {
+	case resp = <-ch:
+		timer.Stop()
+	case <-timer.C:
+		go attempt()
+		resp = <-ch
+	}
+	copy(dis, resp.dis)
+	copy(xids, resp.xids)
+	return resp.total, resp.err
+}
+
 //Search perform batch search
 /**
  * nq       number of query points, shall be equal to len(xids)
@@ -140,33 +358,167 @@ func (vm *VectodbMulti) Search(nq int, xq []float32) (xids []int64, err error) {
 		dis[i] = vm.distThr
 		xids[i] = int64(-1)
 	}
-	dis2 := make([]float32, nq)
-	xids2 := make([]int64, nq)
-	var total int
-	for _, vdb := range vm.vdbs {
-		if total, err = vdb.Search(xq, dis2, xids2); err != nil {
-			return
-		}
-		if total == 0 {
-			continue
-		}
-		for i := 0; i < nq; i++ {
-			if xids[i] == int64(-1) || VectodbCompareDistance(vm.metricType, dis2[i], dis[i]) {
-				dis[i] = dis2[i]
-				xids[i] = xids2[i]
+	// With hedging and early termination off, one cgo call fans the batch
+	// across all shards and merges inside C, so small batches stop paying
+	// one boundary crossing per shard.
+	if !vm.hedge && vm.earlyMargin == 0 {
+		VectodbMultiSearch(vm.vdbs, xq, dis, xids)
+		return
+	}
+	vdbs := vm.vdbs
+	// Fan the shards out to a bounded worker pool and merge under a lock.
+	// With a non-zero earlyMargin, once every query holds a hit beating
+	// distThr by the margin, the shards not yet queried are skipped. An
+	// in-flight shard search cannot be interrupted, only pending ones.
+	jobs := make(chan *VectoDB)
+	var mu sync.Mutex
+	var wg sync.WaitGroup
+	var done int32
+	for w := 0; w < MinInt(vm.searchWorkers, len(vdbs)); w++ {
+		wg.Add(1)
+		go func() {
+			defer wg.Done()
+			dis2 := make([]float32, nq)
+			xids2 := make([]int64, nq)
+			for vdb := range jobs {
+				if atomic.LoadInt32(&done) != 0 {
+					continue
+				}
+				total, err2 := vm.searchShardHedged(vdb, nq, xq, dis2, xids2)
+				mu.Lock()
+				if err2 != nil {
+					if err == nil {
+						err = err2
+					}
+					mu.Unlock()
+					continue
+				}
+				if total == 0 {
+					mu.Unlock()
+					continue
+				}
+				for i := 0; i < nq; i++ {
+					if xids[i] == int64(-1) || VectodbCompareDistance(vm.metricType, dis2[i], dis[i]) {
+						dis[i] = dis2[i]
+						xids[i] = xids2[i]
+					}
+				}
+				if vm.earlyMargin > 0 && vm.allConfident(dis, xids) {
+					atomic.StoreInt32(&done, 1)
+				}
+				mu.Unlock()
 			}
+		}()
+	}
+	for _, vdb := range vdbs {
+		if vdb == nil { //shard still opening, route around it
+			continue
 		}
+		jobs <- vdb
 	}
+	close(jobs)
+	wg.Wait()
+	return
+}
+
+//SetSearchWorkers bounds how many shards Search queries concurrently.
+//The default is half the cores.
+func (vm *VectodbMulti) SetSearchWorkers(workers int) {
+	vm.searchWorkers = MaxInt(1, workers)
+	return
+}
+
+//SetSearchEarlyMargin enables early termination of Search: once every query
+//holds a hit beating distThr by the given margin, remaining shards are skipped.
+//Zero (the default) disables it.
+func (vm *VectodbMulti) SetSearchEarlyMargin(margin float32) {
+	vm.earlyMargin = margin
+	return
+}
+
+//SetSearchHedge toggles hedged shard searches: a shard search still pending
+//past the p95 of that shard's recent latencies is issued a second time and
+//the first response wins, cutting the p99 toward the p95 at a few percent
+//of extra shard load. Enabled by default.
+func (vm *VectodbMulti) SetSearchHedge(enabled bool) {
+	vm.hedge = enabled
 	return
 }
 
+//allConfident reports whether every query already holds a hit beating distThr
+//by earlyMargin. Shall be called with the merge lock held.
+func (vm *VectodbMulti) allConfident(dis []float32, xids []int64) bool {
+	thr := vm.distThr + vm.earlyMargin
+	if vm.metricType != 0 {
+		thr = vm.distThr - vm.earlyMargin
+	}
+	for i := 0; i < len(xids); i++ {
+		if xids[i] == int64(-1) || !VectodbCompareDistance(vm.metricType, dis[i], thr) {
+			return false
+		}
+	}
+	return true
+}
+
 //AddWithIds add vectors
 /**
  * nb       number of vectors, shall be equal to len(xids)
  * xb       vectors
  * xids     vector identifiers
+ *
+ * The vectors only get buffered here: producers append to a lock stripe and
+ * return, so small batches from many goroutines neither serialize on one
+ * lock nor cross cgo individually. A stripe past addFlushVectors flushes
+ * inline (backpressure), the ticker flushes the trickle, and Flush does it
+ * on demand. A flush failure is sticky and reported by the next call.
  */
 func (vm *VectodbMulti) AddWithIds(xb []float32, xids []int64) (err error) {
+	b := vm.addBuffers[int(atomic.AddUint32(&vm.addRR, 1))%len(vm.addBuffers)]
+	b.mtx.Lock()
+	b.xb = append(b.xb, xb...)
+	b.xids = append(b.xids, xids...)
+	n := len(b.xids)
+	b.mtx.Unlock()
+	if n >= addFlushVectors {
+		err = vm.Flush()
+	}
+	return
+}
+
+//Flush drains the buffered adds into the write-head shard in one large
+//AddWithIds cgo call. AddWithIds only enqueues; callers needing their
+//vectors visible to Search right away call Flush after the last add.
+func (vm *VectodbMulti) Flush() (err error) {
+	vm.mtxFlush.Lock()
+	defer vm.mtxFlush.Unlock()
+	if err = vm.flushErr; err != nil {
+		return
+	}
+	var xb []float32
+	var xids []int64
+	for _, b := range vm.addBuffers {
+		b.mtx.Lock()
+		if len(b.xids) != 0 {
+			xb = append(xb, b.xb...)
+			xids = append(xids, b.xids...)
+			b.xb = b.xb[:0]
+			b.xids = b.xids[:0]
+		}
+		b.mtx.Unlock()
+	}
+	if len(xids) == 0 {
+		return
+	}
+	if err = vm.addToWriteHead(xb, xids); err != nil {
+		log.Errorf("flushing buffered adds: %+v", err)
+		vm.flushErr = err
+	}
+	return
+}
+
+//addToWriteHead appends vectors to the newest shard, rolling over to a
+//fresh one when it fills up. Shall be called with mtxFlush held.
+func (vm *VectodbMulti) addToWriteHead(xb []float32, xids []int64) (err error) {
 	var quota, total, added int
 	nb := len(xids)
 	vdb := vm.vdbs[len(vm.vdbs)-1]
@@ -202,6 +554,9 @@ func (vm *VectodbMulti) AddWithIds(xb []float32, xids []int64) (err error) {
  */
 func (vm *VectodbMulti) UpdateWithIds(xb []float32, xids []int64) (err error) {
 	for _, vdb := range vm.vdbs {
+		if vdb == nil { //shard still opening
+			continue
+		}
 		if err = vdb.UpdateWithIds(xb, xids); err != nil {
 			return
 		}
@@ -209,6 +564,140 @@ func (vm *VectodbMulti) UpdateWithIds(xb []float32, xids []int64) (err error) {
 	return
 }
 
+//SetBuilderWorkers bounds how many shards the builder loop rebuilds concurrently.
+//The default is half the cores. Shall be called before StartBuilderLoop.
+func (vm *VectodbMulti) SetBuilderWorkers(workers int) {
+	vm.builderWorkers = MaxInt(1, workers)
+	return
+}
+
+//node-wide build admission. Even with per-shard budgets two shards entering
+//the training phase together can take the box into swap: their transient
+//readBase copies and training scratch peak at roughly the mapped base size
+//each. A build projects that transient up front and queues here until the
+//projections in flight fit under the ceiling, so build parallelism is
+//whatever the memory actually allows instead of only the worker count.
+//The gate is process-wide on purpose: every VectodbMulti on the node shares
+//it. Gating in Go rather than relying on the C++ build_mem_gb gate keeps
+//the builder workers free instead of parked inside a blocked cgo call.
+var nodeBuildAdm = newBuildAdmission()
+
+type buildAdmission struct {
+	mtx      sync.Mutex
+	cond     *sync.Cond
+	ceiling  int64 //bytes, 0 disables the gate
+	inflight int64 //sum of the projections of the admitted builds
+}
+
+func newBuildAdmission() *buildAdmission {
+	adm := &buildAdmission{}
+	adm.cond = sync.NewCond(&adm.mtx)
+	return adm
+}
+
+func (adm *buildAdmission) acquire(bytes int64) {
+	adm.mtx.Lock()
+	//an oversized build is admitted alone rather than waiting forever
+	for adm.ceiling > 0 && adm.inflight > 0 && adm.inflight+bytes > adm.ceiling {
+		adm.cond.Wait()
+	}
+	adm.inflight += bytes
+	adm.mtx.Unlock()
+	return
+}
+
+func (adm *buildAdmission) release(bytes int64) {
+	adm.mtx.Lock()
+	adm.inflight -= bytes
+	adm.mtx.Unlock()
+	adm.cond.Broadcast()
+	return
+}
+
+//projectBuildMem estimates the transient peak of one shard's UpdateIndex:
+//the contiguous base copy the build scans plus training scratch, both
+//bounded by the mapped base size.
+func projectBuildMem(vdb *VectoDB) int64 {
+	st, err := vdb.GetMemoryStats()
+	if err != nil || st.MappedBytes <= 0 {
+		return 1 << 30 //unknown shards still occupy a slice of the ceiling
+	}
+	return st.MappedBytes + st.MappedBytes/10
+}
+
+//SetBuildMemCeiling caps the summed projected transient memory of builds
+//running concurrently on this node, in GB; 0 (the default) disables the
+//gate. The ceiling is shared by every VectodbMulti in the process. Shall be
+//called before StartBuilderLoop.
+func (vm *VectodbMulti) SetBuildMemCeiling(gb int) {
+	nodeBuildAdm.mtx.Lock()
+	nodeBuildAdm.ceiling = int64(gb) << 30
+	nodeBuildAdm.mtx.Unlock()
+	return
+}
+
+func copyFileAtomic(src, dst string) (err error) {
+	var b []byte
+	if b, err = ioutil.ReadFile(src); err != nil {
+		err = errors.Wrap(err, "")
+		return
+	}
+	tmp := dst + ".tmp"
+	if err = ioutil.WriteFile(tmp, b, 0600); err != nil {
+		err = errors.Wrap(err, "")
+		return
+	}
+	if err = os.Rename(tmp, dst); err != nil {
+		err = errors.Wrap(err, "")
+	}
+	return
+}
+
+//shareTrainedArtifacts copies the trained index skeleton of the first shard
+//that has one into the sibling work dirs which don't, so their BuildIndex
+//reuses it and runs pure add. The shards hold statistically identical data,
+//making one training round valid for all of them. An offline job may also
+//drop the <indexKey>.trained and .trained.ntrain files into any shard dir.
+//Returns whether a skeleton was available.
+func (vm *VectodbMulti) shareTrainedArtifacts() bool {
+	names := []string{vm.indexKey + ".trained", vm.indexKey + ".trained.ntrain"}
+	var srcDir string
+	for _, vdb := range vm.vdbs {
+		if vdb == nil {
+			continue
+		}
+		ok := true
+		for _, name := range names {
+			if _, err := os.Stat(filepath.Join(vdb.workDir, name)); err != nil {
+				ok = false
+				break
+			}
+		}
+		if ok {
+			srcDir = vdb.workDir
+			break
+		}
+	}
+	if srcDir == "" {
+		return false
+	}
+	for _, vdb := range vm.vdbs {
+		if vdb == nil || vdb.workDir == srcDir {
+			continue
+		}
+		if _, err := os.Stat(filepath.Join(vdb.workDir, names[0])); err == nil {
+			continue
+		}
+		for _, name := range names {
+			if err := copyFileAtomic(filepath.Join(srcDir, name), filepath.Join(vdb.workDir, name)); err != nil {
+				log.Errorf("sharing trained artifacts to %s: %+v", vdb.workDir, err)
+				return true
+			}
+		}
+	}
+	return true
+}
+
 //StartBuilderLoop starts a goroutine to build build index in loop
 func (vm *VectodbMulti) StartBuilderLoop() {
 	if vm.cancel != nil {
@@ -225,16 +714,62 @@ func (vm *VectodbMulti) StartBuilderLoop() {
 			case <-ticker:
 				log.Infof("build iteration begin")
 				vdbs := vm.vdbs
-				for _, vdb := range vdbs {
-					if err = vdb.UpdateIndex(); err != nil {
+				// rebuild the shards with the largest flat tail first, they hurt search latency most
+				nflats := make([]int, len(vdbs))
+				order := make([]int, 0, len(vdbs))
+				for i, vdb := range vdbs {
+					if vdb == nil { //shard still opening
+						continue
+					}
+					if nflats[i], err = vdb.GetFlatSize(); err != nil {
 						log.Fatalf("%+v", err)
 					}
-					// sleep a while to avoid busy loop
+					order = append(order, i)
+				}
+				sort.Slice(order, func(a, b int) bool { return nflats[order[a]] > nflats[order[b]] })
+				// Shared trained-template: once any shard has persisted
+				// trained artifacts, copy them to the siblings so their
+				// builds skip training. Until then only the fullest shard
+				// is built per iteration, so training runs once, not per shard.
+				shared := vm.shareTrainedArtifacts()
+				// bounded worker pool, one shard build per worker at a time
+				jobs := make(chan *VectoDB)
+				var wg sync.WaitGroup
+				for w := 0; w < MinInt(vm.builderWorkers, len(vdbs)); w++ {
+					wg.Add(1)
+					go func() {
+						defer wg.Done()
+						for vdb := range jobs {
+							//node-wide admission: stagger memory-heavy builds
+							//so their transients fit under the ceiling
+							proj := projectBuildMem(vdb)
+							nodeBuildAdm.acquire(proj)
+							err2 := vdb.UpdateIndex()
+							nodeBuildAdm.release(proj)
+							if err2 != nil {
+								log.Fatalf("%+v", err2)
+							}
+						}
+					}()
+				}
+				canceled := false
+				for n, i := range order {
+					if !shared && n > 0 {
+						break
+					}
 					select {
 					case <-ctx.Done():
-						return
-					case <-ticker:
+						canceled = true
+					case jobs <- vdbs[i]:
 					}
+					if canceled {
+						break
+					}
+				}
+				close(jobs)
+				wg.Wait()
+				if canceled {
+					return
 				}
 				log.Infof("build iteration done")
 			}
@@ -255,9 +790,63 @@ func (vm *VectodbMulti) StopBuilderLoop() {
 	return
 }
 
+const (
+	xidBatchSize    int64 = 2 << 20 //identifiers handed out per AllocateIds call
+	xidRangeBatches int64 = 512     //batches minted per RangeAllocator round-trip
+)
+
+//RangeAllocator mints a contiguous range of nBatches identifier batches and
+//returns the sequence of the first one. The default allocator is a local
+//counter; a cluster deployment plugs in an etcd-backed one so the etcd
+//round-trip happens once per range instead of once per AllocateIds call.
+type RangeAllocator func(nBatches int64) (batchBegin int64, err error)
+
+//SetRangeAllocator replaces the batch range source. Shall be called before
+//the first AllocateIds.
+func (vm *VectodbMulti) SetRangeAllocator(ra RangeAllocator) {
+	vm.rangeAlloc = ra
+	return
+}
+
 //AllocateIds allocate a batch of identifiers. The batch size is 2<<20.
+//Batches are sub-allocated locally from a large range and the next range is
+//fetched asynchronously before exhaustion, so the range source stays off the
+//ingest hot path.
 func (vm *VectodbMulti) AllocateIds() (xidBegin int64, err error) {
-	xidBatch := atomic.AddInt64(&vm.curXidBatch, int64(1)) - 1
-	xidBegin = xidBatch * int64(2<<20)
+	vm.mtxXid.Lock()
+	defer vm.mtxXid.Unlock()
+	if vm.xidCur >= vm.xidEnd {
+		if vm.xidNext >= 0 {
+			vm.xidCur = vm.xidNext
+			vm.xidEnd = vm.xidNextEnd
+			vm.xidNext = -1
+		} else {
+			// first use, or the refresh lost the race against a burst
+			var begin int64
+			if begin, err = vm.rangeAlloc(xidRangeBatches); err != nil {
+				return
+			}
+			vm.xidCur = begin
+			vm.xidEnd = begin + xidRangeBatches
+		}
+	}
+	xidBatch := vm.xidCur
+	vm.xidCur++
+	if vm.xidEnd-vm.xidCur <= xidRangeBatches/4 && vm.xidNext < 0 && !vm.xidFetching {
+		vm.xidFetching = true
+		go func() {
+			begin, err2 := vm.rangeAlloc(xidRangeBatches)
+			vm.mtxXid.Lock()
+			vm.xidFetching = false
+			if err2 != nil {
+				log.Errorf("id range refresh failed: %+v", err2)
+			} else {
+				vm.xidNext = begin
+				vm.xidNextEnd = begin + xidRangeBatches
+			}
+			vm.mtxXid.Unlock()
+		}()
+	}
+	xidBegin = xidBatch * xidBatchSize
 	return
 }
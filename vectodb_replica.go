@@ -0,0 +1,462 @@
+package vectodb
+
+// Streaming base replication to warm standbys. The primary tails every
+// durable base append and every update replay out of the engine
+// (ReadBaseTail/ReadPatchedTail) and ships them to standby nodes over a
+// binary TCP stream; a standby applies the records through its own engine,
+// so it maintains its own base columns, mmap and flat memtable. Builds
+// happen once on the primary: index artifacts are shipped as files and the
+// standby activates them with LoadIndex. A failover is therefore seconds —
+// the standby already serves from the last shipped index plus its
+// up-to-date tail — instead of copying a work_dir and loading an index.
+//
+// The stream carries three frame kinds after a handshake:
+//   append: a run of new base lines, applied with AddWithIds
+//   patch:  lines rewritten in place by an update replay, applied with ApplyPatch
+//   file:   an index artifact, landed with write-to-temp plus rename
+// On every (re)connect the standby reports its durable line count, which is
+// the resume cursor; patch records are idempotent and replayed from 0.
+
+import (
+	"bufio"
+	"context"
+	"encoding/binary"
+	"io"
+	"io/ioutil"
+	"net"
+	"os"
+	"path/filepath"
+	"strings"
+	"sync"
+	"time"
+
+	"github.com/pkg/errors"
+	log "github.com/sirupsen/logrus"
+)
+
+const (
+	replMagic   = uint32(0x52424456) //"VDBR"
+	replVersion = uint32(1)
+
+	replFrameAppend = byte(1)
+	replFramePatch  = byte(2)
+	replFrameFile   = byte(3)
+
+	replBatchLines = 4096
+)
+
+// .index last: an index file refers to its sidecars, so they must land first
+var replArtifactSuffixes = []string{".ivfdata", ".trained", ".ntrain", ".index"}
+
+type replStamp struct {
+	size  int64
+	mtime int64
+}
+
+// Replicator is the primary-side shipper. Start begins tailing the base to
+// every standby address; a broken standby is redialed forever and resumes
+// from the line count it reports at reconnect.
+type Replicator struct {
+	vdb      *VectoDB
+	workDir  string
+	addrs    []string
+	interval time.Duration
+	cancel   context.CancelFunc
+	wg       sync.WaitGroup
+}
+
+func NewReplicator(vdb *VectoDB, standbys []string) (r *Replicator) {
+	r = &Replicator{
+		vdb:      vdb,
+		workDir:  vdb.workDir,
+		addrs:    standbys,
+		interval: time.Second,
+	}
+	return
+}
+
+func (r *Replicator) Start() {
+	ctx, cancel := context.WithCancel(context.Background())
+	r.cancel = cancel
+	for _, addr := range r.addrs {
+		r.wg.Add(1)
+		go func(addr string) {
+			defer r.wg.Done()
+			for {
+				if err := r.streamTo(ctx, addr); err != nil && ctx.Err() == nil {
+					log.Errorf("replication of %s to %s interrupted: %+v", r.workDir, addr, err)
+				}
+				select {
+				case <-ctx.Done():
+					return
+				case <-time.After(r.interval):
+				}
+			}
+		}(addr)
+	}
+	return
+}
+
+func (r *Replicator) Stop() {
+	if r.cancel != nil {
+		r.cancel()
+		r.wg.Wait()
+	}
+	return
+}
+
+func (r *Replicator) streamTo(ctx context.Context, addr string) (err error) {
+	var d net.Dialer
+	conn, err := d.DialContext(ctx, "tcp", addr)
+	if err != nil {
+		err = errors.Wrap(err, "")
+		return
+	}
+	defer conn.Close()
+	done := make(chan struct{})
+	defer close(done)
+	go func() {
+		select {
+		case <-ctx.Done():
+			conn.Close() //fails the blocking reads and writes below
+		case <-done:
+		}
+	}()
+	w := bufio.NewWriter(conn)
+	for _, v := range []interface{}{replMagic, replVersion, int64(r.vdb.dim)} {
+		if err = binary.Write(w, binary.LittleEndian, v); err != nil {
+			err = errors.Wrap(err, "")
+			return
+		}
+	}
+	if err = w.Flush(); err != nil {
+		err = errors.Wrap(err, "")
+		return
+	}
+	var cursor int64
+	if err = binary.Read(conn, binary.LittleEndian, &cursor); err != nil {
+		err = errors.Wrap(err, "")
+		return
+	}
+	log.Infof("replicating %s to %s from line %d", r.workDir, addr, cursor)
+	var patchIdx int64
+	shipped := make(map[string]replStamp)
+	xb := make([]float32, replBatchLines*r.vdb.dim)
+	xids := make([]int64, replBatchLines)
+	lines := make([]int64, replBatchLines)
+	counts := make([]int64, replBatchLines)
+	for {
+		for {
+			var n int
+			if n, err = r.vdb.ReadBaseTail(cursor, xb, xids); err != nil {
+				return
+			} else if n == 0 {
+				break
+			}
+			for _, v := range []interface{}{replFrameAppend, cursor, int64(n), xids[:n], xb[:n*r.vdb.dim]} {
+				if err = binary.Write(w, binary.LittleEndian, v); err != nil {
+					err = errors.Wrap(err, "")
+					return
+				}
+			}
+			cursor += int64(n)
+		}
+		for {
+			var n int
+			if n, err = r.vdb.ReadPatchedTail(patchIdx, lines, counts, xb, xids); err != nil {
+				return
+			} else if n == 0 {
+				break
+			}
+			for _, v := range []interface{}{replFramePatch, int64(n), lines[:n], counts[:n], xb[:n*r.vdb.dim]} {
+				if err = binary.Write(w, binary.LittleEndian, v); err != nil {
+					err = errors.Wrap(err, "")
+					return
+				}
+			}
+			patchIdx += int64(n)
+		}
+		if err = r.shipArtifacts(w, shipped); err != nil {
+			return
+		}
+		if err = w.Flush(); err != nil {
+			err = errors.Wrap(err, "")
+			return
+		}
+		select {
+		case <-ctx.Done():
+			return
+		case <-time.After(r.interval):
+		}
+	}
+}
+
+func (r *Replicator) shipArtifacts(w *bufio.Writer, shipped map[string]replStamp) (err error) {
+	fis, err := ioutil.ReadDir(r.workDir)
+	if err != nil {
+		err = errors.Wrap(err, "")
+		return
+	}
+	for _, suffix := range replArtifactSuffixes {
+		for _, fi := range fis {
+			fn := fi.Name()
+			if !fi.Mode().IsRegular() || !strings.HasSuffix(fn, suffix) {
+				continue
+			}
+			st := replStamp{size: fi.Size(), mtime: fi.ModTime().UnixNano()}
+			if old, ok := shipped[fn]; ok && old == st {
+				continue
+			}
+			if err = replWriteFile(w, filepath.Join(r.workDir, fn), fn, st.size); err != nil {
+				return
+			}
+			shipped[fn] = st
+			log.Infof("shipped artifact %s (%d bytes) of %s", fn, st.size, r.workDir)
+		}
+	}
+	return
+}
+
+func replWriteFile(w io.Writer, fp, name string, size int64) (err error) {
+	f, err := os.Open(fp)
+	if err != nil {
+		err = errors.Wrap(err, "")
+		return
+	}
+	defer f.Close()
+	for _, v := range []interface{}{replFrameFile, int64(len(name)), []byte(name), size} {
+		if err = binary.Write(w, binary.LittleEndian, v); err != nil {
+			err = errors.Wrap(err, "")
+			return
+		}
+	}
+	if _, err = io.CopyN(w, f, size); err != nil {
+		err = errors.Wrap(err, "")
+	}
+	return
+}
+
+// ReplicaServer is the standby-side intake: it applies a primary's stream to
+// the local VectoDB, which keeps serving searches throughout. Promotion is
+// just Stop — the last shipped index file is already active and the tail is
+// in the flat memtable; the connected primary (if still alive) keeps
+// redialing, so the roles can later be swapped back.
+type ReplicaServer struct {
+	vdb      *VectoDB
+	workDir  string
+	ln       net.Listener
+	applyMtx sync.Mutex //frames of concurrent streams must not interleave
+	connMtx  sync.Mutex
+	conns    map[net.Conn]struct{}
+	wg       sync.WaitGroup
+}
+
+func NewReplicaServer(vdb *VectoDB, listenAddr string) (s *ReplicaServer, err error) {
+	ln, err := net.Listen("tcp", listenAddr)
+	if err != nil {
+		err = errors.Wrap(err, "")
+		return
+	}
+	s = &ReplicaServer{
+		vdb:     vdb,
+		workDir: vdb.workDir,
+		ln:      ln,
+		conns:   make(map[net.Conn]struct{}),
+	}
+	s.wg.Add(1)
+	go s.serve()
+	log.Infof("replication intake of %s listening on %s", s.workDir, listenAddr)
+	return
+}
+
+// Stop halts the replication intake and waits out in-flight frames.
+func (s *ReplicaServer) Stop() {
+	s.ln.Close()
+	s.connMtx.Lock()
+	for conn := range s.conns {
+		conn.Close()
+	}
+	s.connMtx.Unlock()
+	s.wg.Wait()
+	return
+}
+
+func (s *ReplicaServer) serve() {
+	defer s.wg.Done()
+	for {
+		conn, err := s.ln.Accept()
+		if err != nil {
+			return //Stop closed the listener
+		}
+		s.connMtx.Lock()
+		s.conns[conn] = struct{}{}
+		s.connMtx.Unlock()
+		s.wg.Add(1)
+		go func() {
+			defer s.wg.Done()
+			if err2 := s.handle(conn); err2 != nil && errors.Cause(err2) != io.EOF {
+				log.Errorf("replication intake of %s from %s: %+v", s.workDir, conn.RemoteAddr(), err2)
+			}
+			conn.Close()
+			s.connMtx.Lock()
+			delete(s.conns, conn)
+			s.connMtx.Unlock()
+		}()
+	}
+}
+
+func (s *ReplicaServer) handle(conn net.Conn) (err error) {
+	rd := bufio.NewReader(conn)
+	var magic, version uint32
+	var dim int64
+	for _, v := range []interface{}{&magic, &version, &dim} {
+		if err = binary.Read(rd, binary.LittleEndian, v); err != nil {
+			err = errors.Wrap(err, "")
+			return
+		}
+	}
+	if magic != replMagic || version != replVersion || int(dim) != s.vdb.dim {
+		err = errors.Errorf("replication handshake mismatch: got magic %x version %d dim %d, want %x %d %d", magic, version, dim, replMagic, replVersion, s.vdb.dim)
+		return
+	}
+	total, err := s.vdb.GetTotal()
+	if err != nil {
+		return
+	}
+	if err = binary.Write(conn, binary.LittleEndian, int64(total)); err != nil {
+		err = errors.Wrap(err, "")
+		return
+	}
+	log.Infof("replication intake of %s resuming at line %d", s.workDir, total)
+	xb := make([]float32, replBatchLines*s.vdb.dim)
+	xids := make([]int64, replBatchLines)
+	lines := make([]int64, replBatchLines)
+	counts := make([]int64, replBatchLines)
+	for {
+		var kind byte
+		if err = binary.Read(rd, binary.LittleEndian, &kind); err != nil {
+			err = errors.Wrap(err, "")
+			return
+		}
+		switch kind {
+		case replFrameAppend:
+			var startLine, n int64
+			for _, v := range []interface{}{&startLine, &n} {
+				if err = binary.Read(rd, binary.LittleEndian, v); err != nil {
+					err = errors.Wrap(err, "")
+					return
+				}
+			}
+			if n <= 0 || n > replBatchLines {
+				err = errors.Errorf("replication append of %d lines out of range", n)
+				return
+			}
+			for _, v := range []interface{}{xids[:n], xb[:n*int64(s.vdb.dim)]} {
+				if err = binary.Read(rd, binary.LittleEndian, v); err != nil {
+					err = errors.Wrap(err, "")
+					return
+				}
+			}
+			s.applyMtx.Lock()
+			if total, err = s.vdb.GetTotal(); err == nil {
+				if startLine != int64(total) {
+					err = errors.Errorf("replication append at line %d, standby %s at %d", startLine, s.workDir, total)
+				} else {
+					err = s.vdb.AddWithIds(xb[:n*int64(s.vdb.dim)], xids[:n])
+				}
+			}
+			s.applyMtx.Unlock()
+			if err != nil {
+				return
+			}
+		case replFramePatch:
+			var n int64
+			if err = binary.Read(rd, binary.LittleEndian, &n); err != nil {
+				err = errors.Wrap(err, "")
+				return
+			}
+			if n <= 0 || n > replBatchLines {
+				err = errors.Errorf("replication patch of %d lines out of range", n)
+				return
+			}
+			for _, v := range []interface{}{lines[:n], counts[:n], xb[:n*int64(s.vdb.dim)]} {
+				if err = binary.Read(rd, binary.LittleEndian, v); err != nil {
+					err = errors.Wrap(err, "")
+					return
+				}
+			}
+			s.applyMtx.Lock()
+			_, err = s.vdb.ApplyPatch(lines[:n], counts[:n], xb[:n*int64(s.vdb.dim)])
+			s.applyMtx.Unlock()
+			if err != nil {
+				return
+			}
+		case replFrameFile:
+			if err = s.landFile(rd); err != nil {
+				return
+			}
+		default:
+			err = errors.Errorf("unknown replication frame %d", kind)
+			return
+		}
+	}
+}
+
+func (s *ReplicaServer) landFile(rd *bufio.Reader) (err error) {
+	var nameLen int64
+	if err = binary.Read(rd, binary.LittleEndian, &nameLen); err != nil {
+		err = errors.Wrap(err, "")
+		return
+	}
+	if nameLen <= 0 || nameLen > 4096 {
+		err = errors.Errorf("replication artifact name of %d bytes out of range", nameLen)
+		return
+	}
+	nameBuf := make([]byte, nameLen)
+	if _, err = io.ReadFull(rd, nameBuf); err != nil {
+		err = errors.Wrap(err, "")
+		return
+	}
+	name := string(nameBuf)
+	if strings.ContainsAny(name, "/\\") || name == "." || name == ".." {
+		err = errors.Errorf("replication artifact name %q is not a plain file name", name)
+		return
+	}
+	var size int64
+	if err = binary.Read(rd, binary.LittleEndian, &size); err != nil {
+		err = errors.Wrap(err, "")
+		return
+	}
+	fp := filepath.Join(s.workDir, name)
+	tmp := fp + ".rtmp"
+	f, err := os.Create(tmp)
+	if err != nil {
+		err = errors.Wrap(err, "")
+		return
+	}
+	if _, err = io.CopyN(f, rd, size); err != nil {
+		f.Close()
+		os.Remove(tmp)
+		err = errors.Wrap(err, "")
+		return
+	}
+	if err = f.Close(); err != nil {
+		os.Remove(tmp)
+		err = errors.Wrap(err, "")
+		return
+	}
+	//the artifact lands by atomic rename, same as the builder writes it
+	if err = os.Rename(tmp, fp); err != nil {
+		err = errors.Wrap(err, "")
+		return
+	}
+	log.Infof("landed artifact %s (%d bytes) into %s", name, size, s.workDir)
+	if strings.HasSuffix(name, ".index") {
+		var ntrain int
+		if ntrain, err = s.vdb.LoadIndex(); err != nil {
+			return
+		}
+		log.Infof("activated shipped index %s of %s, ntrain %d", name, s.workDir, ntrain)
+	}
+	return
+}
@@ -141,3 +141,51 @@ func TestVectodbUpdate(t *testing.T) {
 	err = vdb2.Destroy()
 	require.NoError(t, err)
 }
+
+// ids32=1 frees the per-list 64-bit ids once the activated index is safely on
+// disk; a readonly activation of an on-disk index frees them immediately. The
+// main index must still answer searches afterwards — the list sizes derive
+// from the codes, not from the freed id arrays.
+func TestVectodbIds32(t *testing.T) {
+	var err error
+	const ids32WorkDir string = "/tmp/vectodb_test_ids32_go"
+	const ids32Dim int = 8
+	const ids32IndexKey string = "IVF16,Flat"
+	VectodbClearWorkDir(ids32WorkDir)
+	vdb, err := NewVectoDB(ids32WorkDir, ids32Dim, metric, ids32IndexKey, "nprobe=16,ids32=1", distThr, flatThr)
+	require.NoError(t, err)
+
+	const nb int = 1000
+	xb := make([]float32, nb*ids32Dim)
+	xids := make([]int64, nb)
+	for i := 0; i < nb; i++ {
+		for j := 0; j < ids32Dim; j++ {
+			xb[i*ids32Dim+j] = rand.Float32()
+		}
+		normalizeInplace(ids32Dim, xb[i*ids32Dim:(i+1)*ids32Dim])
+		xids[i] = int64(i)
+	}
+	err = vdb.AddWithIds(xb, xids)
+	require.NoError(t, err)
+	err = vdb.UpdateIndex()
+	require.NoError(t, err)
+	// Destroy joins the background persist, so the ids are freed and the
+	// index file is on disk by the time it returns
+	err = vdb.Destroy()
+	require.NoError(t, err)
+
+	vdb2, err := NewVectoDB(ids32WorkDir, ids32Dim, metric, ids32IndexKey, "nprobe=16,ids32=1,readonly=1", distThr, flatThr)
+	require.NoError(t, err)
+	ntrain, err := vdb2.LoadIndex()
+	require.NoError(t, err)
+	require.True(t, ntrain > 0)
+	D := make([]float32, nb)
+	I := make([]int64, nb)
+	total, err := vdb2.Search(xb, D, I)
+	require.NoError(t, err)
+	require.Equal(t, nb, total)
+	diff(ids32Dim, xb, xids, I, D)
+	require.Equal(t, xids, I)
+	err = vdb2.Destroy()
+	require.NoError(t, err)
+}
@@ -8,9 +8,12 @@ import "C"
 
 import (
 	"context"
+	"encoding/binary"
 	"fmt"
 	"hash"
+	"math"
 	"reflect"
+	"runtime"
 	"strconv"
 	"sync"
 	"sync/atomic"
@@ -25,8 +28,16 @@ import (
 )
 
 const (
-	SIZEOF_FLOAT32       = 4
-	ValidSeconds   int64 = 365 * 24 * 60 * 60 // 1 year
+	SIZEOF_FLOAT32          = 4
+	ValidSeconds      int64 = 365 * 24 * 60 * 60 // 1 year
+	ExpireTickSeconds int64 = 10                 //granularity of servExpire and the timing wheel
+
+	//flat-index snapshots: IndexFlat storage is just the vectors plus our
+	//xids, so a cold load can restore with one bulk read instead of
+	//re-adding every record through rebuildFlatC
+	SnapshotMagic           uint32 = 0x53424456 //"VDBS" in little endian
+	SnapshotVersion         uint32 = 1
+	SnapshotIntervalSeconds int64  = 600
 )
 
 // VectoDBLite is tiny stateless non-updatable non-removable vector database. Only supports metric type 0 - METRIC_INNER_PRODUCT.
@@ -41,7 +52,10 @@ type VectoDBLite struct {
 	flatC         unsafe.Pointer
 	rwlock        sync.RWMutex // protect flatC
 	h64           hash.Hash64
-	numEvicted    int32
+	mtxRemove     sync.Mutex
+	pendingRemove []uint64     //xids evicted from lru, tombstoned in flatC at the next expiry tick
+	wheel         *timingWheel //expirations keyed by ExpireAt; each tick touches only due entries
+	numDirty      uint64       //mutations since the last snapshot, atomic
 	cancel        context.CancelFunc
 }
 
@@ -65,51 +79,182 @@ func NewVectoDBLite(redisAddr string, dbID int, dimIn int, distThreshold float32
 	onEvicted := func(key, value interface{}) {
 		xidS := key.(string)
 		vdbl.rcli.HDel(vdbl.dbKey, xidS)
-		atomic.AddInt32(&vdbl.numEvicted, int32(1))
+		atomic.AddUint64(&vdbl.numDirty, 1)
+		if xid, err2 := strconv.ParseUint(xidS, 16, 64); err2 == nil {
+			vdbl.mtxRemove.Lock()
+			vdbl.pendingRemove = append(vdbl.pendingRemove, xid)
+			vdbl.mtxRemove.Unlock()
+		}
 	}
 	if vdbl.lru, err = lru.NewWithEvict(sizeLimit, onEvicted); err != nil {
 		err = errors.Wrapf(err, "")
 		return
 	}
+	vdbl.wheel = newTimingWheel(ExpireTickSeconds, time.Now().Unix())
 	ctx, cancel := context.WithCancel(context.TODO())
 	vdbl.cancel = cancel
 	go vdbl.servExpire(ctx)
+	go vdbl.servSnapshot(ctx)
 	if err = vdbl.load(); err != nil {
 		return
 	}
 	return
 }
 
-// Init load data from redis
-func (vdbl *VectoDBLite) load() (err error) {
-	var vecMapS map[string]string
-	if vecMapS, err = vdbl.rcli.HGetAll(vdbl.dbKey).Result(); err != nil {
-		err = errors.Wrap(err, "")
+// NewVectoDBLiteFromDump is NewVectoDBLite seeded from another node's Dump
+// instead of redis, for warm migration during rebalancing. Vectors added on
+// the source after the dump are still safe in redis and surface at the next
+// cold load.
+func NewVectoDBLiteFromDump(redisAddr string, dbID int, dimIn int, distThreshold float32, sizeLimit int, items map[string][]byte) (vdbl *VectoDBLite, err error) {
+	dbKey := getDbKey(dbID)
+	log.Infof("vectodblite %s creating from dump of %d items", dbKey, len(items))
+	rcli := redis.NewClient(&redis.Options{
+		Addr:     redisAddr,
+		Password: "", // no password set
+		DB:       0,  // use default DB
+	})
+	vdbl = &VectoDBLite{
+		redisAddr:     redisAddr,
+		dim:           dimIn,
+		distThreshold: distThreshold,
+		sizeLimit:     sizeLimit,
+		dbKey:         dbKey,
+		rcli:          rcli,
+		h64:           xxhash.New(),
+	}
+	onEvicted := func(key, value interface{}) {
+		xidS := key.(string)
+		vdbl.rcli.HDel(vdbl.dbKey, xidS)
+		atomic.AddUint64(&vdbl.numDirty, 1)
+		if xid, err2 := strconv.ParseUint(xidS, 16, 64); err2 == nil {
+			vdbl.mtxRemove.Lock()
+			vdbl.pendingRemove = append(vdbl.pendingRemove, xid)
+			vdbl.mtxRemove.Unlock()
+		}
+	}
+	if vdbl.lru, err = lru.NewWithEvict(sizeLimit, onEvicted); err != nil {
+		err = errors.Wrapf(err, "")
 		return
 	}
-	log.Debugf("vectodblite %s HGetAll: %+v", vdbl.dbKey, vecMapS)
-	expiredXids := make([]string, 0)
+	vdbl.wheel = newTimingWheel(ExpireTickSeconds, time.Now().Unix())
+	ctx, cancel := context.WithCancel(context.TODO())
+	vdbl.cancel = cancel
+	go vdbl.servExpire(ctx)
+	go vdbl.servSnapshot(ctx)
 	now := time.Now().Unix()
-	for xidS, vtS := range vecMapS {
+	for xidS, vtB := range items {
 		vt := VecTimestamp{}
-		if err = vt.Unmarshal([]byte(vtS)); err != nil {
+		if err = vt.Unmarshal(vtB); err != nil {
 			err = errors.Wrapf(err, "")
 			return
 		}
-		if vt.ExpireAt < now {
-			expiredXids = append(expiredXids, xidS)
-		} else {
+		if vt.ExpireAt >= now {
 			vdbl.lru.Add(xidS, &vt)
+			if xid, err2 := strconv.ParseUint(xidS, 16, 64); err2 == nil {
+				vdbl.wheel.schedule(xid, vt.ExpireAt)
+			}
+		}
+	}
+	if err = vdbl.rebuildFlatC(); err != nil {
+		return
+	}
+	return
+}
+
+// Dump serializes every resident vector record, for warm migration to
+// another node. The records are the same bytes stored in redis.
+func (vdbl *VectoDBLite) Dump() (items map[string][]byte, err error) {
+	items = make(map[string][]byte, vdbl.lru.Len())
+	for _, xidInf := range vdbl.lru.Keys() {
+		var vtInf interface{}
+		var ok bool
+		if vtInf, ok = vdbl.lru.Peek(xidInf); !ok {
+			continue
+		}
+		vt := vtInf.(*VecTimestamp)
+		var vtB []byte
+		if vtB, err = vt.Marshal(); err != nil {
+			err = errors.Wrapf(err, "")
+			return
+		}
+		items[xidInf.(string)] = vtB
+	}
+	return
+}
+
+// Init load data from redis.
+// The hash is read with paged HSCAN instead of one HGETALL so large databases
+// neither stall redis nor buffer the whole reply at once, and each page is
+// decoded by parallel workers before the flat index is rebuilt in bulk.
+func (vdbl *VectoDBLite) load() (err error) {
+	const scanCount = 4096
+	now := time.Now().Unix()
+	if vdbl.restoreSnapshot(now) {
+		log.Infof("vectodblite %s restored %d items from snapshot", vdbl.dbKey, vdbl.lru.Len())
+		return
+	}
+	expiredXids := make([]string, 0)
+	var mu sync.Mutex
+	var cursor uint64
+	for {
+		var kvs []string
+		if kvs, cursor, err = vdbl.rcli.HScan(vdbl.dbKey, cursor, "", scanCount).Result(); err != nil {
+			err = errors.Wrap(err, "")
+			return
+		}
+		var wg sync.WaitGroup
+		var decErr error
+		nw := MinInt(runtime.NumCPU(), 8)
+		for w := 0; w < nw; w++ {
+			wg.Add(1)
+			go func(w int) {
+				defer wg.Done()
+				//kvs is a flat field/value pair list, workers take strided pairs
+				for i := 2 * w; i+1 < len(kvs); i += 2 * nw {
+					xidS := kvs[i]
+					vt := VecTimestamp{}
+					if err2 := vt.Unmarshal([]byte(kvs[i+1])); err2 != nil {
+						mu.Lock()
+						if decErr == nil {
+							decErr = errors.Wrapf(err2, "")
+						}
+						mu.Unlock()
+						return
+					}
+					if vt.ExpireAt < now {
+						mu.Lock()
+						expiredXids = append(expiredXids, xidS)
+						mu.Unlock()
+					} else {
+						vdbl.lru.Add(xidS, &vt)
+						if xid, err3 := strconv.ParseUint(xidS, 16, 64); err3 == nil {
+							vdbl.wheel.schedule(xid, vt.ExpireAt)
+						}
+					}
+				}
+			}(w)
+		}
+		wg.Wait()
+		if decErr != nil {
+			err = decErr
+			return
+		}
+		if cursor == 0 {
+			break
 		}
 	}
 
 	if len(expiredXids) != 0 {
 		log.Infof("vectodblite %s purging expired items from redis: %v", vdbl.dbKey, expiredXids)
-		for _, xidS := range expiredXids {
-			if _, err = vdbl.rcli.HDel(vdbl.dbKey, xidS).Result(); err != nil {
-				err = errors.Wrapf(err, "")
-				return
+		//one pipelined round trip for all deletions
+		if _, err = vdbl.rcli.Pipelined(func(pipe redis.Pipeliner) error {
+			for _, xidS := range expiredXids {
+				pipe.HDel(vdbl.dbKey, xidS)
 			}
+			return nil
+		}); err != nil {
+			err = errors.Wrapf(err, "")
+			return
 		}
 	}
 
@@ -120,6 +265,135 @@ func (vdbl *VectoDBLite) load() (err error) {
 	return
 }
 
+func (vdbl *VectoDBLite) getSnapKey() string {
+	return vdbl.dbKey + "_snapshot"
+}
+
+// writeSnapshot persists the resident records as one versioned binary blob
+// beside the redis hash: a header, then per record xid, expireAt and the raw
+// vector. The snapshot is a cache of the hash, never a replacement — the
+// record count is stored so restoreSnapshot can detect staleness.
+func (vdbl *VectoDBLite) writeSnapshot() (err error) {
+	keys := vdbl.lru.Keys()
+	recSize := 16 + vdbl.dim*SIZEOF_FLOAT32
+	buf := make([]byte, 24, 24+len(keys)*recSize)
+	binary.LittleEndian.PutUint32(buf[0:], SnapshotMagic)
+	binary.LittleEndian.PutUint32(buf[4:], SnapshotVersion)
+	binary.LittleEndian.PutUint64(buf[8:], uint64(vdbl.dim))
+	var n uint64
+	var scratch [16]byte
+	var b4 [4]byte
+	for _, xidInf := range keys {
+		vtInf, ok := vdbl.lru.Peek(xidInf)
+		if !ok {
+			continue
+		}
+		var xid uint64
+		if xid, err = strconv.ParseUint(xidInf.(string), 16, 64); err != nil {
+			err = errors.Wrapf(err, "")
+			return
+		}
+		vt := vtInf.(*VecTimestamp)
+		binary.LittleEndian.PutUint64(scratch[0:], xid)
+		binary.LittleEndian.PutUint64(scratch[8:], uint64(vt.ExpireAt))
+		buf = append(buf, scratch[:]...)
+		for _, v := range vt.Vec {
+			binary.LittleEndian.PutUint32(b4[:], math.Float32bits(v))
+			buf = append(buf, b4[:]...)
+		}
+		n++
+	}
+	binary.LittleEndian.PutUint64(buf[16:], n)
+	if err = vdbl.rcli.Set(vdbl.getSnapKey(), string(buf), 0).Err(); err != nil {
+		err = errors.Wrapf(err, "")
+		return
+	}
+	log.Debugf("vectodblite %s snapshotted %d items, %d bytes", vdbl.dbKey, n, len(buf))
+	return
+}
+
+// restoreSnapshot rebuilds lru, wheel and flatC from the snapshot blob with
+// one bulk pass. Returns false without error when the snapshot is absent,
+// from a different layout, or stale (its record count no longer matches the
+// hash), in which case the caller falls back to the per-record scan.
+func (vdbl *VectoDBLite) restoreSnapshot(now int64) (restored bool) {
+	snapB, err := vdbl.rcli.Get(vdbl.getSnapKey()).Bytes()
+	if err != nil {
+		return //absent or redis hiccup; the scan path covers both
+	}
+	if len(snapB) < 24 ||
+		binary.LittleEndian.Uint32(snapB[0:]) != SnapshotMagic ||
+		binary.LittleEndian.Uint32(snapB[4:]) != SnapshotVersion ||
+		binary.LittleEndian.Uint64(snapB[8:]) != uint64(vdbl.dim) {
+		log.Warnf("vectodblite %s snapshot has unexpected layout, falling back to scan", vdbl.dbKey)
+		return
+	}
+	count := binary.LittleEndian.Uint64(snapB[16:])
+	recSize := 16 + vdbl.dim*SIZEOF_FLOAT32
+	if uint64(len(snapB)-24) != count*uint64(recSize) {
+		log.Warnf("vectodblite %s snapshot is truncated, falling back to scan", vdbl.dbKey)
+		return
+	}
+	hlen, err := vdbl.rcli.HLen(vdbl.dbKey).Result()
+	if err != nil || uint64(hlen) != count {
+		log.Infof("vectodblite %s snapshot is stale (%d items vs %d in redis), falling back to scan", vdbl.dbKey, count, hlen)
+		return
+	}
+	xids := make([]uint64, 0, count)
+	vecs := make([]float32, 0, int(count)*vdbl.dim)
+	off := 24
+	for i := uint64(0); i < count; i++ {
+		xid := binary.LittleEndian.Uint64(snapB[off:])
+		expireAt := int64(binary.LittleEndian.Uint64(snapB[off+8:]))
+		off += 16
+		vec := make([]float32, vdbl.dim)
+		for j := 0; j < vdbl.dim; j++ {
+			vec[j] = math.Float32frombits(binary.LittleEndian.Uint32(snapB[off:]))
+			off += SIZEOF_FLOAT32
+		}
+		if expireAt < now {
+			//an expired record means the snapshot predates an expiry the
+			//scan path would handle; cheaper to just take the scan path
+			return
+		}
+		vdbl.lru.Add(getXidKey(xid), &VecTimestamp{Vec: vec, ExpireAt: expireAt})
+		vdbl.wheel.schedule(xid, expireAt)
+		xids = append(xids, xid)
+		vecs = append(vecs, vec...)
+	}
+	vdbl.rwlock.Lock()
+	if vdbl.flatC != nil {
+		C.IndexFlatDelete(vdbl.flatC)
+	}
+	vdbl.flatC = C.IndexFlatNew(C.long(vdbl.dim), C.float(vdbl.distThreshold))
+	if len(xids) != 0 {
+		C.IndexFlatAddWithIds(vdbl.flatC, C.long(len(xids)), (*C.float)(&vecs[0]), (*C.ulong)(&xids[0]))
+	}
+	vdbl.rwlock.Unlock()
+	restored = true
+	return
+}
+
+// servSnapshot refreshes the snapshot periodically while the database is
+// mutating; an unchanged database costs nothing.
+func (vdbl *VectoDBLite) servSnapshot(ctx context.Context) {
+	tickCh := time.Tick(time.Duration(SnapshotIntervalSeconds) * time.Second)
+	for {
+		select {
+		case <-ctx.Done():
+			log.Infof("vectodblite %s servSnapshot goroutine exited", vdbl.dbKey)
+			return
+		case <-tickCh:
+			if atomic.SwapUint64(&vdbl.numDirty, 0) == 0 {
+				continue
+			}
+			if err := vdbl.writeSnapshot(); err != nil {
+				log.Errorf("got error %+v", err)
+			}
+		}
+	}
+}
+
 func (vdbl *VectoDBLite) rebuildFlatC() (err error) {
 	vdbl.rwlock.Lock()
 	defer vdbl.rwlock.Unlock()
@@ -127,6 +401,18 @@ func (vdbl *VectoDBLite) rebuildFlatC() (err error) {
 		C.IndexFlatDelete(vdbl.flatC)
 	}
 	vdbl.flatC = C.IndexFlatNew(C.long(vdbl.dim), C.float(vdbl.distThreshold))
+	//bulk-add in chunks, one cgo call per chunk instead of per vector
+	const addChunk = 4096
+	xids := make([]uint64, 0, addChunk)
+	vecs := make([]float32, 0, addChunk*vdbl.dim)
+	flush := func() {
+		if len(xids) == 0 {
+			return
+		}
+		C.IndexFlatAddWithIds(vdbl.flatC, C.long(len(xids)), (*C.float)(&vecs[0]), (*C.ulong)(&xids[0]))
+		xids = xids[:0]
+		vecs = vecs[:0]
+	}
 	var xid uint64
 	for _, xidInf := range vdbl.lru.Keys() {
 		if xid, err = strconv.ParseUint(xidInf.(string), 16, 64); err != nil {
@@ -140,23 +426,50 @@ func (vdbl *VectoDBLite) rebuildFlatC() (err error) {
 			return
 		}
 		vt := vtInf.(*VecTimestamp)
-		C.IndexFlatAddWithIds(vdbl.flatC, C.long(1), (*C.float)(&vt.Vec[0]), (*C.ulong)(&xid))
+		xids = append(xids, xid)
+		vecs = append(vecs, vt.Vec...)
+		if len(xids) == addChunk {
+			flush()
+		}
 	}
+	flush()
 	return
 }
 
 func (vdbl *VectoDBLite) servExpire(ctx context.Context) {
-	tickCh := time.Tick(10 * time.Second)
+	tickCh := time.Tick(time.Duration(ExpireTickSeconds) * time.Second)
 	for {
 		select {
 		case <-ctx.Done():
 			log.Infof("vectodblite %s servExpire goroutine exited", vdbl.dbKey)
 			return
 		case <-tickCh:
-			if atomic.SwapInt32(&vdbl.numEvicted, 0) != 0 {
-				if err := vdbl.rebuildFlatC(); err != nil {
-					log.Errorf("vectodblite %s got error %+v", vdbl.dbKey, err)
+			//the wheel hands over only the entries whose slot came due; the
+			//authoritative ExpireAt decides, so touched entries re-schedule
+			now := time.Now().Unix()
+			for _, e := range vdbl.wheel.advance(now) {
+				xidS := getXidKey(e.xid)
+				vtInf, ok := vdbl.lru.Peek(xidS)
+				if !ok {
+					continue //already evicted by the LRU
 				}
+				vt := vtInf.(*VecTimestamp)
+				if vt.ExpireAt > now {
+					vdbl.wheel.schedule(e.xid, vt.ExpireAt)
+					continue
+				}
+				//Remove runs onEvicted: the redis HDel plus the tombstone below
+				vdbl.lru.Remove(xidS)
+			}
+			vdbl.mtxRemove.Lock()
+			toRemove := vdbl.pendingRemove
+			vdbl.pendingRemove = nil
+			vdbl.mtxRemove.Unlock()
+			if len(toRemove) != 0 {
+				//tombstone the evicted rows instead of rebuilding the whole index
+				vdbl.rwlock.Lock()
+				C.IndexFlatRemoveIds(vdbl.flatC, C.long(len(toRemove)), (*C.ulong)(&toRemove[0]))
+				vdbl.rwlock.Unlock()
 			}
 		}
 	}
@@ -165,6 +478,12 @@ func (vdbl *VectoDBLite) servExpire(ctx context.Context) {
 func (vdbl *VectoDBLite) Destroy() (err error) {
 	log.Infof("vectodblite %s destroying", vdbl.dbKey)
 	vdbl.cancel()
+	//a parting snapshot makes the next cold load of this database cheap
+	if atomic.SwapUint64(&vdbl.numDirty, 0) != 0 {
+		if errS := vdbl.writeSnapshot(); errS != nil {
+			log.Warnf("vectodblite %s failed to write parting snapshot, error %+v", vdbl.dbKey, errS)
+		}
+	}
 	vdbl.rwlock.Lock()
 	defer vdbl.rwlock.Unlock()
 	if vdbl.flatC != nil {
@@ -203,12 +522,82 @@ func (vdbl *VectoDBLite) AddWithId(xb []float32, xid uint64) (err error) {
 		return
 	}
 	vdbl.lru.Add(xidS, vt)
+	vdbl.wheel.schedule(xid, vt.ExpireAt)
+	atomic.AddUint64(&vdbl.numDirty, 1)
 	vdbl.rwlock.Lock()
 	C.IndexFlatAddWithIds(vdbl.flatC, C.long(1), (*C.float)(&xb[0]), (*C.ulong)(&xid))
 	vdbl.rwlock.Unlock()
 	return
 }
 
+// AddBatch enrolls a whole batch with bulk operations: every vector is
+// hashed up front and duplicates within the batch collapse to one record,
+// the records are persisted in a single pipelined redis round trip, and the
+// flat index grows by one IndexFlatAddWithIds call instead of one per
+// vector. xids is parallel to xbs; a duplicate vector maps to the same xid
+// as its first occurrence.
+func (vdbl *VectoDBLite) AddBatch(xbs [][]float32) (xids []uint64, err error) {
+	if len(xbs) == 0 {
+		return
+	}
+	for i, xb := range xbs {
+		if len(xb) != vdbl.dim {
+			err = errors.Errorf("vectodblite %s invalid length of xbs[%d], want %v, have %v", vdbl.dbKey, i, vdbl.dim, len(xb))
+			return
+		}
+	}
+	xids = make([]uint64, len(xbs))
+	expireAt := time.Now().Unix() + ValidSeconds
+	type batchEntry struct {
+		xid  uint64
+		xidS string
+		vtB  []byte
+		vt   *VecTimestamp
+	}
+	seen := make(map[uint64]bool, len(xbs))
+	entries := make([]batchEntry, 0, len(xbs))
+	uniqXids := make([]uint64, 0, len(xbs))
+	vecs := make([]float32, 0, len(xbs)*vdbl.dim)
+	for i, xb := range xbs {
+		xids[i] = allocateXid(vdbl.h64, xb)
+		if seen[xids[i]] {
+			continue
+		}
+		seen[xids[i]] = true
+		vt := &VecTimestamp{
+			Vec:      xb,
+			ExpireAt: expireAt,
+		}
+		var vtB []byte
+		if vtB, err = vt.Marshal(); err != nil {
+			err = errors.Wrapf(err, "")
+			return
+		}
+		entries = append(entries, batchEntry{xid: xids[i], xidS: getXidKey(xids[i]), vtB: vtB, vt: vt})
+		uniqXids = append(uniqXids, xids[i])
+		vecs = append(vecs, xb...)
+	}
+	//one pipelined round trip persists the whole batch
+	if _, err = vdbl.rcli.Pipelined(func(pipe redis.Pipeliner) error {
+		for _, e := range entries {
+			pipe.HSet(vdbl.dbKey, e.xidS, string(e.vtB))
+		}
+		return nil
+	}); err != nil {
+		err = errors.Wrapf(err, "")
+		return
+	}
+	for _, e := range entries {
+		vdbl.lru.Add(e.xidS, e.vt)
+		vdbl.wheel.schedule(e.xid, e.vt.ExpireAt)
+	}
+	atomic.AddUint64(&vdbl.numDirty, uint64(len(entries)))
+	vdbl.rwlock.Lock()
+	C.IndexFlatAddWithIds(vdbl.flatC, C.long(len(uniqXids)), (*C.float)(&vecs[0]), (*C.ulong)(&uniqXids[0]))
+	vdbl.rwlock.Unlock()
+	return
+}
+
 func (vdbl *VectoDBLite) Search(xq []float32) (xid uint64, distance float32, err error) {
 	if len(xq) != vdbl.dim {
 		err = errors.Errorf("vectodblite %s invalid length of xq, want %v, have %v", vdbl.dbKey, vdbl.dim, len(xq))
@@ -219,25 +608,184 @@ func (vdbl *VectoDBLite) Search(xq []float32) (xid uint64, distance float32, err
 	vdbl.rwlock.RUnlock()
 	if xid != ^uint64(0) {
 		//search ok, update expireAt at lur, and redis.
-		xidS := getXidKey(xid)
-		var vtInf interface{}
-		var ok bool
-		if vtInf, ok = vdbl.lru.Get(xidS); !ok {
-			log.Infof("vectodblite %s xid %v in IndexFlat is absent in LRU", vdbl.dbKey, xidS)
+		var found bool
+		if found, err = vdbl.touch(xid); err != nil {
+			return
+		} else if !found {
 			xid = ^uint64(0)
+		}
+	}
+	return
+}
+
+// SearchBatch searches nq vectors in one IndexFlatSearch call. Missing hits
+// are reported as ^uint64(0) in xids.
+func (vdbl *VectoDBLite) SearchBatch(nq int, xq []float32) (xids []uint64, distances []float32, err error) {
+	if len(xq) != nq*vdbl.dim {
+		err = errors.Errorf("vectodblite %s invalid length of xq, want %v, have %v", vdbl.dbKey, nq*vdbl.dim, len(xq))
+		return
+	}
+	xids = make([]uint64, nq)
+	distances = make([]float32, nq)
+	vdbl.rwlock.RLock()
+	C.IndexFlatSearch(vdbl.flatC, C.long(nq), (*C.float)(&xq[0]), (*C.float)(&distances[0]), (*C.ulong)(&xids[0]))
+	vdbl.rwlock.RUnlock()
+	for i := 0; i < nq; i++ {
+		if xids[i] == ^uint64(0) {
+			continue
+		}
+		var found bool
+		if found, err = vdbl.touch(xids[i]); err != nil {
 			return
+		} else if !found {
+			xids[i] = ^uint64(0)
 		}
-		vt := vtInf.(*VecTimestamp)
-		vt.ExpireAt = time.Now().Unix() + ValidSeconds
-		var vtB []byte
-		if vtB, err = vt.Marshal(); err != nil {
+	}
+	return
+}
+
+// SearchKnn returns the k nearest matches of each of the nq query vectors in
+// one cgo call, so multi-probe requests hit the batched BLAS path inside
+// faiss. Result slices are nq*k, row-major; slots without a match (fewer than
+// k resident vectors, or distance below the threshold) hold ^uint64(0).
+func (vdbl *VectoDBLite) SearchKnn(nq, k int, xq []float32) (xids []uint64, distances []float32, err error) {
+	if k <= 0 {
+		err = errors.Errorf("vectodblite %s invalid k %v", vdbl.dbKey, k)
+		return
+	}
+	if len(xq) != nq*vdbl.dim {
+		err = errors.Errorf("vectodblite %s invalid length of xq, want %v, have %v", vdbl.dbKey, nq*vdbl.dim, len(xq))
+		return
+	}
+	xids = make([]uint64, nq*k)
+	distances = make([]float32, nq*k)
+	vdbl.rwlock.RLock()
+	C.IndexFlatSearchKnn(vdbl.flatC, C.long(nq), C.long(k), (*C.float)(&xq[0]), (*C.float)(&distances[0]), (*C.ulong)(&xids[0]))
+	vdbl.rwlock.RUnlock()
+	//touch each distinct hit once
+	touched := make(map[uint64]bool)
+	for i := range xids {
+		if xids[i] == ^uint64(0) {
+			continue
+		}
+		found, ok := touched[xids[i]]
+		if !ok {
+			if found, err = vdbl.touch(xids[i]); err != nil {
+				return
+			}
+			touched[xids[i]] = found
+		}
+		if !found {
+			xids[i] = ^uint64(0)
+		}
+	}
+	return
+}
+
+// touch updates expireAt of a search hit at lru, and redis.
+func (vdbl *VectoDBLite) touch(xid uint64) (found bool, err error) {
+	xidS := getXidKey(xid)
+	var vtInf interface{}
+	var ok bool
+	if vtInf, ok = vdbl.lru.Get(xidS); !ok {
+		log.Infof("vectodblite %s xid %v in IndexFlat is absent in LRU", vdbl.dbKey, xidS)
+		return
+	}
+	found = true
+	vt := vtInf.(*VecTimestamp)
+	vt.ExpireAt = time.Now().Unix() + ValidSeconds
+	var vtB []byte
+	if vtB, err = vt.Marshal(); err != nil {
+		err = errors.Wrapf(err, "")
+		return
+	}
+	if _, err = vdbl.rcli.HSet(vdbl.dbKey, xidS, string(vtB)).Result(); err != nil {
+		err = errors.Wrapf(err, "")
+		return
+	}
+	atomic.AddUint64(&vdbl.numDirty, 1)
+	return
+}
+
+// MergeDump bulk-adds the records of a dump that are not already resident.
+// Used at the cutover of a pre-warmed migration: the instance already loaded
+// the redis state in the background, so only the records added at the source
+// since the prewarm are missing — and those are in redis under this dbKey
+// already, so no redis write is needed.
+func (vdbl *VectoDBLite) MergeDump(items map[string][]byte) (numAdded int, err error) {
+	now := time.Now().Unix()
+	xids := make([]uint64, 0)
+	vecs := make([]float32, 0)
+	for xidS, vtB := range items {
+		if _, ok := vdbl.lru.Peek(xidS); ok {
+			continue
+		}
+		vt := VecTimestamp{}
+		if err = vt.Unmarshal(vtB); err != nil {
 			err = errors.Wrapf(err, "")
 			return
 		}
-		if _, err = vdbl.rcli.HSet(vdbl.dbKey, xidS, string(vtB)).Result(); err != nil {
+		if vt.ExpireAt < now {
+			continue
+		}
+		var xid uint64
+		if xid, err = strconv.ParseUint(xidS, 16, 64); err != nil {
 			err = errors.Wrapf(err, "")
 			return
 		}
+		vdbl.lru.Add(xidS, &vt)
+		vdbl.wheel.schedule(xid, vt.ExpireAt)
+		xids = append(xids, xid)
+		vecs = append(vecs, vt.Vec...)
+	}
+	if len(xids) != 0 {
+		vdbl.rwlock.Lock()
+		C.IndexFlatAddWithIds(vdbl.flatC, C.long(len(xids)), (*C.float)(&vecs[0]), (*C.ulong)(&xids[0]))
+		vdbl.rwlock.Unlock()
+		atomic.AddUint64(&vdbl.numDirty, uint64(len(xids)))
+	}
+	numAdded = len(xids)
+	return
+}
+
+// PersistResident rewrites every resident record into this database's redis
+// hash with one pipelined round trip. The dump/import path assumes redis
+// already holds the records under this dbKey; a split violates that (the
+// records arrive from the parent's hash), so a new sub-shard calls this once
+// before the split is made visible.
+func (vdbl *VectoDBLite) PersistResident() (err error) {
+	var items map[string][]byte
+	if items, err = vdbl.Dump(); err != nil {
+		return
+	}
+	if len(items) == 0 {
+		return
+	}
+	if _, err = vdbl.rcli.Pipelined(func(pipe redis.Pipeliner) error {
+		for xidS, vtB := range items {
+			pipe.HSet(vdbl.dbKey, xidS, string(vtB))
+		}
+		return nil
+	}); err != nil {
+		err = errors.Wrapf(err, "")
+		return
+	}
+	atomic.AddUint64(&vdbl.numDirty, uint64(len(items)))
+	return
+}
+
+// DropDbData removes a database's redis hash and snapshot. Used after a split
+// retires the parent dbID, whose records live on under the sub-shard hashes.
+func DropDbData(redisAddr string, dbID int) (err error) {
+	rcli := redis.NewClient(&redis.Options{
+		Addr:     redisAddr,
+		Password: "", // no password set
+		DB:       0,  // use default DB
+	})
+	defer rcli.Close()
+	dbKey := getDbKey(dbID)
+	if err = rcli.Del(dbKey, dbKey+"_snapshot").Err(); err != nil {
+		err = errors.Wrapf(err, "")
 	}
 	return
 }
@@ -254,6 +802,17 @@ func getDbKey(dbID int) string {
 	return fmt.Sprintf("vectodblite_%v", dbID)
 }
 
+// AllocateXid computes the xid of a vector without a database instance — the
+// same xxhash Add uses — so the cluster layer can route a vector by xid
+// before any database has seen it.
+func AllocateXid(vec []float32) (xid uint64) {
+	header := *(*reflect.SliceHeader)(unsafe.Pointer(&vec))
+	header.Len *= SIZEOF_FLOAT32
+	header.Cap *= SIZEOF_FLOAT32
+	data := *(*[]byte)(unsafe.Pointer(&header))
+	return xxhash.Sum64(data)
+}
+
 // allocateXid uses hash of vec as xid.
 func allocateXid(h64 hash.Hash64, vec []float32) (xid uint64) {
 	// https://stackoverflow.com/questions/11924196/convert-between-slices-of-different-types